@@ -89,13 +89,7 @@ static int aea_read_header(AVFormatContext *s,
 
 static int aea_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
-    int ret = av_get_packet(s->pb, pkt, s->streams[0]->codec->block_align);
-
-    pkt->stream_index = 0;
-    if (ret <= 0)
-        return AVERROR(EIO);
-
-    return ret;
+    return ff_pcm_read_packet(s, pkt, s->streams[0]->codec->block_align);
 }
 
 AVInputFormat aea_demuxer = {
@@ -300,7 +300,7 @@ static int aiff_read_packet(AVFormatContext *s,
     if (st->codec->block_align >= 33) // GSM, QCLP, IMA4
         size = st->codec->block_align;
     else
-        size = (MAX_SIZE / st->codec->block_align) * st->codec->block_align;
+        size = ff_pcm_packet_size(s, st, MAX_SIZE);
     size = FFMIN(max_size, size);
     res = av_get_packet(s->pb, pkt, size);
     if (res < 0)
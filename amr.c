@@ -114,11 +114,40 @@ static int amr_read_header(AVFormatContext *s,
     return 0;
 }
 
+/** largest frame, toc byte included */
+#define AMR_MAX_FRAME_SIZE 61
+/** most frames grouped in a packet */
+#define AMR_MAX_FRAMES   500
+
+/**
+ * @return the size of the frame starting with toc, toc byte included,
+ *         0 if invalid
+ */
+static int amr_frame_size(enum CodecID codec_id, int toc)
+{
+    int mode = (toc >> 3) & 0x0F;
+
+    if (codec_id == CODEC_ID_AMR_NB)
+    {
+        static const uint8_t packed_size[16] = {12, 13, 15, 17, 19, 20, 26, 31, 5, 0, 0, 0, 0, 0, 0, 0};
+
+        return packed_size[mode]+1;
+    }
+    else if(codec_id == CODEC_ID_AMR_WB)
+    {
+        static const uint8_t packed_size[16] = {18, 24, 33, 37, 41, 47, 51, 59, 61, 6, 6, 0, 0, 0, 1, 1};
+
+        return packed_size[mode];
+    }
+    assert(0);
+    return 0;
+}
+
 static int amr_read_packet(AVFormatContext *s,
                           AVPacket *pkt)
 {
     AVCodecContext *enc = s->streams[0]->codec;
-    int read, size = 0, toc, mode;
+    int read, size = 0, toc, frame_duration, nb_frames = 1;
 
     if (url_feof(s->pb))
     {
@@ -127,34 +156,25 @@ static int amr_read_packet(AVFormatContext *s,
 
 //FIXME this is wrong, this should rather be in a AVParset
     toc=get_byte(s->pb);
-    mode = (toc >> 3) & 0x0F;
-
-    if (enc->codec_id == CODEC_ID_AMR_NB)
-    {
-        static const uint8_t packed_size[16] = {12, 13, 15, 17, 19, 20, 26, 31, 5, 0, 0, 0, 0, 0, 0, 0};
-
-        size=packed_size[mode]+1;
+    size = amr_frame_size(enc->codec_id, toc);
+    frame_duration = enc->codec_id == CODEC_ID_AMR_NB ? 160 : 320;
+
+    /* the frames are independent, several of them can go in one packet */
+    if (s->pcm_packet_duration > 0) {
+        nb_frames = av_rescale(s->pcm_packet_duration, enc->sample_rate,
+                               1000000 * (int64_t)frame_duration);
+        nb_frames = av_clip(nb_frames, 1, AMR_MAX_FRAMES);
     }
-    else if(enc->codec_id == CODEC_ID_AMR_WB)
-    {
-        static uint8_t packed_size[16] = {18, 24, 33, 37, 41, 47, 51, 59, 61, 6, 6, 0, 0, 0, 1, 1};
 
-        size=packed_size[mode];
-    }
-    else
-    {
-        assert(0);
-    }
-
-    if ( (size==0) || av_new_packet(pkt, size))
+    if ( (size==0) || av_new_packet(pkt, nb_frames > 1 ? nb_frames * AMR_MAX_FRAME_SIZE : size))
     {
         return AVERROR(EIO);
     }
 
     pkt->stream_index = 0;
-    pkt->pos= url_ftell(s->pb);
+    pkt->pos= url_ftell(s->pb) - 1;
     pkt->data[0]=toc;
-    pkt->duration= enc->codec_id == CODEC_ID_AMR_NB ? 160 : 320;
+    pkt->duration= frame_duration;
     read = get_buffer(s->pb, pkt->data+1, size-1);
 
     if (read != size-1)
@@ -163,6 +183,21 @@ static int amr_read_packet(AVFormatContext *s,
         return AVERROR(EIO);
     }
 
+    for (; nb_frames > 1; nb_frames--) {
+        const uint8_t *buf;
+        int frame_size;
+
+        /* only take the frames read entirely, whatever else is left for
+           the next packet */
+        if (url_fpeek(s->pb, &buf, 1) < 1 ||
+            !(frame_size = amr_frame_size(enc->codec_id, buf[0])) ||
+            get_buffer(s->pb, pkt->data + size, frame_size) != frame_size)
+            break;
+        size          += frame_size;
+        pkt->duration += frame_duration;
+    }
+    av_shrink_packet(pkt, size);
+
     return 0;
 }
 
@@ -24,6 +24,7 @@
 
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
+#include "internal.h"
 #include "apetag.h"
 
 #define ENABLE_DEBUG 0
@@ -57,7 +58,6 @@ typedef struct {
     uint32_t firstframe;
     uint32_t totalsamples;
     int currentframe;
-    APEFrame *frames;
 
     /* Info from Descriptor Block */
     char magic[4];
@@ -94,10 +94,34 @@ static int ape_probe(AVProbeData * p)
     return 0;
 }
 
+/**
+ * Compute frame i from the seek table, which is all that is kept in memory.
+ */
+static void ape_get_frame(APEContext *ape, int i, APEFrame *frame)
+{
+    int64_t next;
+
+    frame->pos     = i ? ape->seektable[i] : ape->firstframe;
+    frame->nblocks = ape->blocksperframe;
+    frame->skip    = (frame->pos - ape->firstframe) & 3;
+    frame->pts     = (int64_t)i * (ape->blocksperframe / MAC_SUBFRAME_SIZE);
+    if (i == ape->totalframes - 1) {
+        frame->size    = ape->finalframeblocks * 4;
+        frame->nblocks = ape->finalframeblocks;
+    } else {
+        next        = ape->seektable[i + 1];
+        frame->size = next - frame->pos;
+    }
+    frame->pos  -= frame->skip;
+    frame->size += frame->skip;
+    frame->size  = (frame->size + 3) & ~3;
+}
+
 static void ape_dumpinfo(AVFormatContext * s, APEContext * ape_ctx)
 {
 #if ENABLE_DEBUG
     int i;
+    APEFrame frame;
 
     av_log(s, AV_LOG_DEBUG, "Descriptor Block:\n\n");
     av_log(s, AV_LOG_DEBUG, "magic                = \"%c%c%c%c\"\n", ape_ctx->magic[0], ape_ctx->magic[1], ape_ctx->magic[2], ape_ctx->magic[3]);
@@ -139,8 +163,10 @@ static void ape_dumpinfo(AVFormatContext * s, APEContext * ape_ctx)
     }
 
     av_log(s, AV_LOG_DEBUG, "\nFrames\n\n");
-    for (i = 0; i < ape_ctx->totalframes; i++)
-        av_log(s, AV_LOG_DEBUG, "%8d   %8lld %8d (%d samples)\n", i, ape_ctx->frames[i].pos, ape_ctx->frames[i].size, ape_ctx->frames[i].nblocks);
+    for (i = 0; i < ape_ctx->totalframes; i++) {
+        ape_get_frame(ape_ctx, i, &frame);
+        av_log(s, AV_LOG_DEBUG, "%8d   %8lld %8d (%d samples)\n", i, frame.pos, frame.size, frame.nblocks);
+    }
 
     av_log(s, AV_LOG_DEBUG, "\nCalculated information:\n\n");
     av_log(s, AV_LOG_DEBUG, "junklength           = %d\n", ape_ctx->junklength);
@@ -157,7 +183,6 @@ static int ape_read_header(AVFormatContext * s, AVFormatParameters * ap)
     uint32_t tag;
     int i;
     int total_blocks;
-    int64_t pts;
 
     /* TODO: Skip any leading junk such as id3v2 tags */
     ape->junklength = 0;
@@ -242,13 +267,15 @@ static int ape_read_header(AVFormatContext * s, AVFormatParameters * ap)
             url_fskip(pb, ape->wavheaderlength);
     }
 
-    if(ape->totalframes > UINT_MAX / sizeof(APEFrame)){
-        av_log(s, AV_LOG_ERROR, "Too many frames: %d\n", ape->totalframes);
+    if(!ape->totalframes || ape->totalframes > UINT_MAX / sizeof(uint32_t)){
+        av_log(s, AV_LOG_ERROR, "Invalid number of frames: %d\n", ape->totalframes);
+        return -1;
+    }
+    if(ape->seektablelength / sizeof(uint32_t) < ape->totalframes){
+        av_log(s, AV_LOG_ERROR, "Seek table has fewer entries than the %d frames\n",
+               ape->totalframes);
         return -1;
     }
-    ape->frames       = av_malloc(ape->totalframes * sizeof(APEFrame));
-    if(!ape->frames)
-        return AVERROR_NOMEM;
     ape->firstframe   = ape->junklength + ape->descriptorlength + ape->headerlength + ape->seektablelength + ape->wavheaderlength;
     ape->currentframe = 0;
 
@@ -257,40 +284,18 @@ static int ape_read_header(AVFormatContext * s, AVFormatParameters * ap)
     if (ape->totalframes > 1)
         ape->totalsamples += ape->blocksperframe * (ape->totalframes - 1);
 
-    if (ape->seektablelength > 0) {
-        ape->seektable = av_malloc(ape->seektablelength);
-        for (i = 0; i < ape->seektablelength / sizeof(uint32_t); i++)
-            ape->seektable[i] = get_le32(pb);
-    }
-
-    ape->frames[0].pos     = ape->firstframe;
-    ape->frames[0].nblocks = ape->blocksperframe;
-    ape->frames[0].skip    = 0;
-    for (i = 1; i < ape->totalframes; i++) {
-        ape->frames[i].pos      = ape->seektable[i]; //ape->frames[i-1].pos + ape->blocksperframe;
-        ape->frames[i].nblocks  = ape->blocksperframe;
-        ape->frames[i - 1].size = ape->frames[i].pos - ape->frames[i - 1].pos;
-        ape->frames[i].skip     = (ape->frames[i].pos - ape->frames[0].pos) & 3;
-    }
-    ape->frames[ape->totalframes - 1].size    = ape->finalframeblocks * 4;
-    ape->frames[ape->totalframes - 1].nblocks = ape->finalframeblocks;
-
-    for (i = 0; i < ape->totalframes; i++) {
-        if(ape->frames[i].skip){
-            ape->frames[i].pos  -= ape->frames[i].skip;
-            ape->frames[i].size += ape->frames[i].skip;
-        }
-        ape->frames[i].size = (ape->frames[i].size + 3) & ~3;
-    }
+    /* the frames are only computed from the table when they are read */
+    ape->seektable = av_malloc(ape->seektablelength);
+    if (!ape->seektable)
+        return AVERROR_NOMEM;
+    for (i = 0; i < ape->seektablelength / sizeof(uint32_t); i++)
+        ape->seektable[i] = get_le32(pb);
 
 
     ape_dumpinfo(s, ape);
 
     /* try to read APE tags */
-    if (!url_is_streamed(pb)) {
-        ff_ape_parse_tag(s);
-        url_fseek(pb, 0, SEEK_SET);
-    }
+    ff_read_tail_tags(s, ff_ape_parse_tag);
 
     av_log(s, AV_LOG_DEBUG, "Decoding file - v%d.%02d, compression level %d\n", ape->fileversion / 1000, (ape->fileversion % 1000) / 10, ape->compressiontype);
 
@@ -320,13 +325,6 @@ static int ape_read_header(AVFormatContext * s, AVFormatParameters * ap)
     AV_WL16(st->codec->extradata + 2, ape->compressiontype);
     AV_WL16(st->codec->extradata + 4, ape->formatflags);
 
-    pts = 0;
-    for (i = 0; i < ape->totalframes; i++) {
-        ape->frames[i].pts = pts;
-        av_add_index_entry(st, ape->frames[i].pos, ape->frames[i].pts, 0, 0, AVINDEX_KEYFRAME);
-        pts += ape->blocksperframe / MAC_SUBFRAME_SIZE;
-    }
-
     return 0;
 }
 
@@ -335,30 +333,32 @@ static int ape_read_packet(AVFormatContext * s, AVPacket * pkt)
     int ret;
     int nblocks;
     APEContext *ape = s->priv_data;
+    APEFrame frame;
     uint32_t extra_size = 8;
 
     if (url_feof(s->pb))
         return AVERROR_IO;
-    if (ape->currentframe > ape->totalframes)
+    if (ape->currentframe >= ape->totalframes)
         return AVERROR_IO;
 
-    url_fseek (s->pb, ape->frames[ape->currentframe].pos, SEEK_SET);
+    ape_get_frame(ape, ape->currentframe, &frame);
+    url_fseek (s->pb, frame.pos, SEEK_SET);
 
     /* Calculate how many blocks there are in this frame */
-    if (ape->currentframe == (ape->totalframes - 1))
-        nblocks = ape->finalframeblocks;
-    else
-        nblocks = ape->blocksperframe;
+    nblocks = frame.nblocks;
 
-    if (av_new_packet(pkt,  ape->frames[ape->currentframe].size + extra_size) < 0)
+    if (frame.size <= 0)
+        return AVERROR_INVALIDDATA;
+    if (av_new_packet(pkt, frame.size + extra_size) < 0)
         return AVERROR_NOMEM;
 
     AV_WL32(pkt->data    , nblocks);
-    AV_WL32(pkt->data + 4, ape->frames[ape->currentframe].skip);
-    ret = get_buffer(s->pb, pkt->data + extra_size, ape->frames[ape->currentframe].size);
+    AV_WL32(pkt->data + 4, frame.skip);
+    ret = get_buffer(s->pb, pkt->data + extra_size, frame.size);
 
-    pkt->pts = ape->frames[ape->currentframe].pts;
+    pkt->pts = frame.pts;
     pkt->stream_index = 0;
+    av_add_index_entry(s->streams[0], frame.pos, frame.pts, 0, 0, AVINDEX_KEYFRAME);
 
     /* note: we need to modify the packet size here to handle the last
        packet */
@@ -373,18 +373,26 @@ static int ape_read_close(AVFormatContext * s)
 {
     APEContext *ape = s->priv_data;
 
-    av_freep(&ape->frames);
     av_freep(&ape->seektable);
     return 0;
 }
 
 static int ape_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp, int flags)
 {
-    AVStream *st = s->streams[stream_index];
     APEContext *ape = s->priv_data;
-    int index = av_index_search_timestamp(st, timestamp, flags);
-
-    if (index < 0)
+    int64_t duration = ape->blocksperframe / MAC_SUBFRAME_SIZE;
+    int64_t index;
+
+    /* frames have a constant duration, the table needs no search */
+    if (!duration)
+        index = 0;
+    else if (flags & AVSEEK_FLAG_BACKWARD)
+        index = timestamp >= 0 ? timestamp / duration : -1;
+    else
+        index = (FFMAX(timestamp, 0) + duration - 1) / duration;
+    if (index >= ape->totalframes && (flags & AVSEEK_FLAG_BACKWARD))
+        index = ape->totalframes - 1;
+    if (index < 0 || index >= ape->totalframes)
         return -1;
 
     ape->currentframe = index;
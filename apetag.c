@@ -29,6 +29,8 @@
 #define APE_TAG_FOOTER_BYTES          32
 #define APE_TAG_FLAG_CONTAINS_HEADER  (1 << 31)
 #define APE_TAG_FLAG_IS_HEADER        (1 << 29)
+#define APE_TAG_ITEM_TYPE(flags)      ((flags) >> 1 & 3)
+#define APE_TAG_ITEM_BINARY           1
 
 static int ape_tag_read_field(AVFormatContext *s)
 {
@@ -53,6 +55,12 @@ static int ape_tag_read_field(AVFormatContext *s)
     }
     if (size >= UINT_MAX)
         return -1;
+    /* cover art and such are no text, only worth reading when asked for */
+    if ((s->flags & AVFMT_FLAG_LAZY_TAGS) &&
+        APE_TAG_ITEM_TYPE(flags) == APE_TAG_ITEM_BINARY) {
+        url_fseek(pb, size, SEEK_CUR);
+        return 0;
+    }
     value = av_malloc(size+1);
     if (!value)
         return AVERROR_NOMEM;
@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include "avformat.h"
 #include "metadata.h"
+#include "asfcrypt.h"
 
 #define PACKET_SIZE 3200
 
@@ -44,6 +45,12 @@ typedef struct {
 
     uint16_t stream_language_index;
 
+    int64_t index_pts;          ///< all keyframes up to this pts are in the index, INT64_MAX if it is complete
+    int64_t index_pos;          ///< position of the last keyframe added to the index in order
+    int index_dense;            ///< set while reading on from index_pos, see asf_index_packet()
+
+    uint8_t *ds_buf;            ///< copy of the scrambled object, reused for each object
+    unsigned int ds_buf_size;
 } ASFStream;
 
 typedef uint8_t ff_asf_guid[16];
@@ -135,6 +142,9 @@ typedef struct {
     uint16_t maximum_packet;
 
     ASFStream* asf_st;                   ///< currently decoded stream
+
+    ASFCryptContext crypt;               ///< key schedule of AVFormatContext.key
+    int crypt_init;
 } ASFContext;
 
 extern const ff_asf_guid ff_asf_header;
@@ -69,7 +69,7 @@ static void multiswap_invert_keys(uint32_t keys[12]) {
         keys[i] = inverse(keys[i]);
 }
 
-static uint32_t multiswap_step(const uint32_t keys[12], uint32_t v) {
+static av_always_inline uint32_t multiswap_step(const uint32_t keys[12], uint32_t v) {
     int i;
     v *= keys[0];
     for (i = 1; i < 5; i++) {
@@ -80,7 +80,7 @@ static uint32_t multiswap_step(const uint32_t keys[12], uint32_t v) {
     return v;
 }
 
-static uint32_t multiswap_inv_step(const uint32_t keys[12], uint32_t v) {
+static av_always_inline uint32_t multiswap_inv_step(const uint32_t keys[12], uint32_t v) {
     int i;
     v -= keys[5];
     for (i = 4; i > 0; i--) {
@@ -99,18 +99,32 @@ static uint32_t multiswap_inv_step(const uint32_t keys[12], uint32_t v) {
  * \param data data to encrypt
  * \return encrypted data
  */
-static uint64_t multiswap_enc(const uint32_t keys[12], uint64_t key, uint64_t data) {
-    uint32_t a = data;
-    uint32_t b = data >> 32;
-    uint32_t c;
-    uint32_t tmp;
-    a += key;
-    tmp = multiswap_step(keys    , a);
-    b += tmp;
-    c = (key >> 32) + tmp;
-    tmp = multiswap_step(keys + 6, b);
-    c += tmp;
-    return ((uint64_t)c << 32) | tmp;
+/**
+ * \brief "MultiSwap" encryption of a run of 64 bit words, giving the state
+ *        multiswap_enc() would reach word by word starting from 0
+ * \param keys 32 bit numbers in machine endianness,
+ *             0-4 and 6-10 must be inverted from decryption
+ * \param data little-endian words to encrypt, need not be aligned
+ * \param num_qwords number of words
+ * \return encrypted last word, used as key for the decryption
+ */
+static uint64_t multiswap_enc_run(const uint32_t keys[12], const uint8_t *data, int num_qwords) {
+    uint32_t k[12];
+    uint32_t lo = 0, hi = 0;
+    int i;
+
+    /* a local copy lets the compiler keep the keys in registers */
+    memcpy(k, keys, sizeof(k));
+    for (i = 0; i < num_qwords; i++, data += 8) {
+        uint32_t a = AV_RL32(data) + lo;
+        uint32_t b = AV_RL32(data + 4);
+        uint32_t tmp = multiswap_step(k, a);
+        b  += tmp;
+        hi += tmp;
+        lo  = multiswap_step(k + 6, b);
+        hi += lo;
+    }
+    return ((uint64_t)hi << 32) | lo;
 }
 
 /**
@@ -135,42 +149,46 @@ static uint64_t multiswap_dec(const uint32_t keys[12], uint64_t key, uint64_t da
     return ((uint64_t)b << 32) | a;
 }
 
-void ff_asfcrypt_dec(const uint8_t key[20], uint8_t *data, int len) {
-    struct AVDES des;
+void ff_asfcrypt_init(ASFCryptContext *c, const uint8_t key[20]) {
     struct AVRC4 rc4;
-    int num_qwords = len >> 3;
-    uint64_t *qwords = (uint64_t *)data;
     uint64_t rc4buff[8];
+
+    memcpy(c->key, key, sizeof(c->key));
+    memset(rc4buff, 0, sizeof(rc4buff));
+    av_rc4_init(&rc4, key, 12 * 8, 1);
+    av_rc4_crypt(&rc4, (uint8_t *)rc4buff, NULL, sizeof(rc4buff), NULL, 1);
+    multiswap_init((uint8_t *)rc4buff, c->ms_keys);
+    memcpy(c->ms_inv_keys, c->ms_keys, sizeof(c->ms_keys));
+    multiswap_invert_keys(c->ms_inv_keys);
+    c->packetkey_mask[0] = rc4buff[6];
+    c->packetkey_mask[1] = rc4buff[7];
+    av_des_init(&c->des, key + 12, 64, 1);
+}
+
+void ff_asfcrypt_dec(ASFCryptContext *c, uint8_t *data, int len) {
+    struct AVRC4 rc4;
+    int num_qwords = len >> 3;
+    uint8_t *last_qword = data + 8 * (num_qwords - 1);
     uint64_t packetkey;
-    uint32_t ms_keys[12];
     uint64_t ms_state;
     int i;
     if (len < 16) {
         for (i = 0; i < len; i++)
-            data[i] ^= key[i];
+            data[i] ^= c->key[i];
         return;
     }
 
-    memset(rc4buff, 0, sizeof(rc4buff));
-    av_rc4_init(&rc4, key, 12 * 8, 1);
-    av_rc4_crypt(&rc4, (uint8_t *)rc4buff, NULL, sizeof(rc4buff), NULL, 1);
-    multiswap_init((uint8_t *)rc4buff, ms_keys);
-
-    packetkey = qwords[num_qwords - 1];
-    packetkey ^= rc4buff[7];
-    av_des_init(&des, key + 12, 64, 1);
-    av_des_crypt(&des, (uint8_t *)&packetkey, (uint8_t *)&packetkey, 1, NULL, 1);
-    packetkey ^= rc4buff[6];
+    memcpy(&packetkey, last_qword, 8);
+    packetkey ^= c->packetkey_mask[1];
+    av_des_crypt(&c->des, (uint8_t *)&packetkey, (uint8_t *)&packetkey, 1, NULL, 1);
+    packetkey ^= c->packetkey_mask[0];
 
     av_rc4_init(&rc4, (uint8_t *)&packetkey, 64, 1);
     av_rc4_crypt(&rc4, data, data, len, NULL, 1);
 
-    ms_state = 0;
-    for (i = 0; i < num_qwords - 1; i++, qwords++)
-        ms_state = multiswap_enc(ms_keys, ms_state, AV_RL64(qwords));
-    multiswap_invert_keys(ms_keys);
+    ms_state = multiswap_enc_run(c->ms_keys, data, num_qwords - 1);
     packetkey = (packetkey << 32) | (packetkey >> 32);
     packetkey = le2me_64(packetkey);
-    packetkey = multiswap_dec(ms_keys, ms_state, packetkey);
-    AV_WL64(qwords, packetkey);
+    packetkey = multiswap_dec(c->ms_inv_keys, ms_state, packetkey);
+    AV_WL64(last_qword, packetkey);
 }
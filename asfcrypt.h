@@ -23,7 +23,28 @@
 #define AVFORMAT_ASFCRYPT_H
 
 #include <inttypes.h>
+#include "libavutil/des.h"
 
-void ff_asfcrypt_dec(const uint8_t key[20], uint8_t *data, int len);
+/**
+ * Key schedule derived from the content key, the same for all the
+ * packets of a file.
+ */
+typedef struct ASFCryptContext {
+    uint8_t key[20];
+    uint64_t packetkey_mask[2]; ///< RC4 output xored into the packet key
+    struct AVDES des;           ///< decrypts the packet key
+    uint32_t ms_keys[12];       ///< MultiSwap encryption keys
+    uint32_t ms_inv_keys[12];   ///< MultiSwap decryption keys
+} ASFCryptContext;
+
+/**
+ * Compute the key schedule of key, done once instead of for every packet.
+ */
+void ff_asfcrypt_init(ASFCryptContext *c, const uint8_t key[20]);
+
+/**
+ * Decrypt a payload in place.
+ */
+void ff_asfcrypt_dec(ASFCryptContext *c, uint8_t *data, int len);
 
 #endif /* AVFORMAT_ASFCRYPT_H */
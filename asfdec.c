@@ -25,6 +25,7 @@
 #include "libavutil/avstring.h"
 #include "libavcodec/mpegaudio.h"
 #include "avformat.h"
+#include "internal.h"
 #include "riff.h"
 #include "asf.h"
 #include "asfcrypt.h"
@@ -175,6 +176,76 @@ static void get_tag(AVFormatContext *s, const char *key, int type, int len)
     av_metadata_set2(&s->metadata, key, value, AV_METADATA_DONT_STRDUP_VAL);
 }
 
+/**
+ * Read the Simple Index Objects following the data object. There is one per
+ * video stream, in stream order; files without video may have one for
+ * their first stream.
+ */
+static void asf_read_simple_index(AVFormatContext *s)
+{
+    ASFContext *asf = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int64_t current_pos = url_ftell(pb);
+    int64_t obj_pos = asf->data_object_offset + asf->data_object_size;
+    int64_t filesize = url_fsize(pb);
+    int stream_index = -1;
+    ff_asf_guid g;
+    int i;
+
+    while (filesize <= 0 || obj_pos + 24 <= filesize) {
+        int64_t gsize;
+
+        url_fseek(pb, obj_pos, SEEK_SET);
+        get_guid(pb, &g);
+        gsize = get_le64(pb);
+        if (url_feof(pb) || gsize < 24)
+            break;
+        if (!guidcmp(&g, &index_guid)) {
+            AVStream *st;
+            ASFStream *asf_st;
+            int64_t itime, last_pos=-1;
+            int pct, ict;
+
+            for (stream_index++; stream_index < s->nb_streams; stream_index++)
+                if (s->streams[stream_index]->codec->codec_type == CODEC_TYPE_VIDEO)
+                    break;
+            if (stream_index >= s->nb_streams) {
+                if (asf->index_read || !s->nb_streams)
+                    break;
+                stream_index = 0;
+            }
+            st     = s->streams[stream_index];
+            asf_st = st->priv_data;
+
+            get_guid(pb, &g);
+            itime=get_le64(pb);
+            pct=get_le32(pb);
+            ict=get_le32(pb);
+            av_log(s, AV_LOG_DEBUG, "itime:0x%"PRIx64", pct:%d, ict:%d\n",itime,pct,ict);
+
+            for (i=0;i<ict;i++){
+                int pktnum=get_le32(pb);
+                int pktct =get_le16(pb);
+                int64_t pos      = s->data_offset + s->packet_size*(int64_t)pktnum;
+                int64_t index_pts= av_rescale(itime, i, 10000);
+
+                if (url_feof(pb))
+                    break;
+                if(pos != last_pos){
+                    av_log(s, AV_LOG_DEBUG, "pktnum:%d, pktct:%d\n", pktnum, pktct);
+                    av_add_index_entry(st, pos, index_pts, s->packet_size, 0, AVINDEX_KEYFRAME);
+                    last_pos=pos;
+                }
+            }
+            if (st->nb_index_entries)
+                asf_st->index_pts = INT64_MAX;
+            asf->index_read= 1;
+        }
+        obj_pos += gsize;
+    }
+    url_fseek(pb, current_pos, SEEK_SET);
+}
+
 static int asf_read_header(AVFormatContext *s, AVFormatParameters *ap)
 {
     ASFContext *asf = s->priv_data;
@@ -251,6 +322,8 @@ static int asf_read_header(AVFormatContext *s, AVFormatParameters *ap)
             start_time = asf->hdr.preroll;
 
             asf_st->stream_language_index = 128; // invalid stream index means no language info
+            asf_st->index_pts   = INT64_MIN;
+            asf_st->index_dense = 1;
 
             if(!(asf->hdr.flags & 0x01)) { // if we aren't streaming...
                 st->duration = asf->hdr.play_time /
@@ -587,6 +660,23 @@ static int asf_read_header(AVFormatContext *s, AVFormatParameters *ap)
         }
     }
 
+    for (i = 0; i < s->nb_streams; i++) {
+        ASFStream *asf_st = s->streams[i]->priv_data;
+        asf_st->index_pos = asf->data_offset;
+    }
+    if (!url_is_streamed(pb) && !(s->flags & AVFMT_FLAG_IGNIDX) && s->packet_size > 0) {
+        if (ff_index_cache_restore(s, NULL)) {
+            for (i = 0; i < s->nb_streams; i++) {
+                ASFStream *asf_st = s->streams[i]->priv_data;
+                if (s->streams[i]->nb_index_entries)
+                    asf_st->index_pts = INT64_MAX;
+            }
+            asf->index_read = 1;
+        } else if (asf->data_object_size != (uint64_t)-1) {
+            asf_read_simple_index(s);
+        }
+    }
+
     return 0;
 }
 
@@ -845,8 +935,9 @@ static int ff_asf_parse_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *
                 asf_st->frag_offset = 0;
                 av_free_packet(&asf_st->pkt);
             }
-            /* new packet */
-            av_new_packet(&asf_st->pkt, asf->packet_obj_size);
+            /* new packet, the fragments are read in place */
+            if (ff_new_packet(s, &asf_st->pkt, asf->packet_obj_size) < 0)
+                return AVERROR(ENOMEM);
             asf_st->seq = asf->packet_seq;
             asf_st->pkt.dts = asf->packet_frag_timestamp;
             asf_st->pkt.stream_index = asf->stream_index;
@@ -878,9 +969,14 @@ static int ff_asf_parse_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *
 
         get_buffer(pb, asf_st->pkt.data + asf->packet_frag_offset,
                    asf->packet_frag_size);
-        if (s->key && s->keylen == 20)
-            ff_asfcrypt_dec(s->key, asf_st->pkt.data + asf->packet_frag_offset,
+        if (s->key && s->keylen == 20) {
+            if (!asf->crypt_init || memcmp(asf->crypt.key, s->key, 20)) {
+                ff_asfcrypt_init(&asf->crypt, s->key);
+                asf->crypt_init = 1;
+            }
+            ff_asfcrypt_dec(&asf->crypt, asf_st->pkt.data + asf->packet_frag_offset,
                             asf->packet_frag_size);
+        }
         asf_st->frag_offset += asf->packet_frag_size;
         /* test if whole packet is read */
         if (asf_st->frag_offset == asf_st->pkt.size) {
@@ -902,10 +998,11 @@ static int ff_asf_parse_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *
               if(asf_st->pkt.size != asf_st->ds_packet_size * asf_st->ds_span){
                     av_log(s, AV_LOG_ERROR, "pkt.size != ds_packet_size * ds_span (%d %d %d)\n", asf_st->pkt.size, asf_st->ds_packet_size, asf_st->ds_span);
               }else{
-                /* packet descrambling */
-                uint8_t *newdata = av_malloc(asf_st->pkt.size);
-                if (newdata) {
+                /* packet descrambling, from a copy of the object */
+                av_fast_malloc(&asf_st->ds_buf, &asf_st->ds_buf_size, asf_st->pkt.size);
+                if (asf_st->ds_buf) {
                     int offset = 0;
+                    memcpy(asf_st->ds_buf, asf_st->pkt.data, asf_st->pkt.size);
                     while (offset < asf_st->pkt.size) {
                         int off = offset / asf_st->ds_chunk_size;
                         int row = off / asf_st->ds_span;
@@ -915,13 +1012,11 @@ static int ff_asf_parse_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *
 
                         assert(offset + asf_st->ds_chunk_size <= asf_st->pkt.size);
                         assert(idx+1 <= asf_st->pkt.size / asf_st->ds_chunk_size);
-                        memcpy(newdata + offset,
-                               asf_st->pkt.data + idx * asf_st->ds_chunk_size,
+                        memcpy(asf_st->pkt.data + offset,
+                               asf_st->ds_buf + idx * asf_st->ds_chunk_size,
                                asf_st->ds_chunk_size);
                         offset += asf_st->ds_chunk_size;
                     }
-                    av_free(asf_st->pkt.data);
-                    asf_st->pkt.data = newdata;
                 }
               }
             }
@@ -936,6 +1031,39 @@ static int ff_asf_parse_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *
     return 0;
 }
 
+/**
+ * Add the keyframes of streams without a complete index to the index while
+ * they are read in order, so that seeking back in the part of the file
+ * already read does not need to scan packets.
+ */
+static void asf_index_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    AVStream *st = s->streams[pkt->stream_index];
+    ASFStream *asf_st = st->priv_data;
+
+    if (!(pkt->flags & PKT_FLAG_KEY) || pkt->dts == AV_NOPTS_VALUE ||
+        asf_st->index_pts == INT64_MAX || !asf_st->index_dense)
+        return;
+    av_add_index_entry(st, asf_st->packet_pos, pkt->dts, pkt->size, 0, AVINDEX_KEYFRAME);
+    asf_st->index_pts = FFMAX(asf_st->index_pts, pkt->dts);
+    asf_st->index_pos = FFMAX(asf_st->index_pos, asf_st->packet_pos);
+}
+
+/**
+ * Update the index state after moving the read position to pos, -1 if
+ * unknown: reading on from a position in the part of a stream indexed in
+ * order extends it, the keyframes read from elsewhere leave gaps.
+ */
+static void asf_index_seek(AVFormatContext *s, int64_t pos)
+{
+    int i;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        ASFStream *asf_st = s->streams[i]->priv_data;
+        asf_st->index_dense = pos >= 0 && pos <= asf_st->index_pos;
+    }
+}
+
 static int asf_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     ASFContext *asf = s->priv_data;
@@ -944,8 +1072,11 @@ static int asf_read_packet(AVFormatContext *s, AVPacket *pkt)
         int ret;
 
         /* parse cached packets, if any */
-        if ((ret = ff_asf_parse_packet(s, s->pb, pkt)) <= 0)
+        if ((ret = ff_asf_parse_packet(s, s->pb, pkt)) <= 0) {
+            if (!ret)
+                asf_index_packet(s, pkt);
             return ret;
+        }
         if ((ret = ff_asf_get_packet(s, s->pb)) < 0)
             assert(asf->packet_size_left < FRAME_HEADER_SIZE || asf->packet_segments < 1);
         asf->packet_time_start = 0;
@@ -999,7 +1130,9 @@ static int asf_read_close(AVFormatContext *s)
     asf_reset_header(s);
     for(i=0;i<s->nb_streams;i++) {
         AVStream *st = s->streams[i];
+        ASFStream *asf_st = st->priv_data;
         av_free(st->codec->palctrl);
+        av_freep(&asf_st->ds_buf);
     }
     return 0;
 }
@@ -1021,6 +1154,7 @@ static int64_t asf_read_pts(AVFormatContext *s, int stream_index, int64_t *ppos,
         pos= (pos+s->packet_size-1-s->data_offset)/s->packet_size*s->packet_size+ s->data_offset;
     *ppos= pos;
     url_fseek(s->pb, pos, SEEK_SET);
+    asf_index_seek(s, pos);
 
 //printf("asf_read_pts\n");
     asf_reset_header(s);
@@ -1055,46 +1189,10 @@ static int64_t asf_read_pts(AVFormatContext *s, int stream_index, int64_t *ppos,
     return pts;
 }
 
-static void asf_build_simple_index(AVFormatContext *s, int stream_index)
-{
-    ff_asf_guid g;
-    ASFContext *asf = s->priv_data;
-    int64_t current_pos= url_ftell(s->pb);
-    int i;
-
-    url_fseek(s->pb, asf->data_object_offset + asf->data_object_size, SEEK_SET);
-    get_guid(s->pb, &g);
-    if (!guidcmp(&g, &index_guid)) {
-        int64_t itime, last_pos=-1;
-        int pct, ict;
-        int64_t av_unused gsize= get_le64(s->pb);
-        get_guid(s->pb, &g);
-        itime=get_le64(s->pb);
-        pct=get_le32(s->pb);
-        ict=get_le32(s->pb);
-        av_log(s, AV_LOG_DEBUG, "itime:0x%"PRIx64", pct:%d, ict:%d\n",itime,pct,ict);
-
-        for (i=0;i<ict;i++){
-            int pktnum=get_le32(s->pb);
-            int pktct =get_le16(s->pb);
-            int64_t pos      = s->data_offset + s->packet_size*(int64_t)pktnum;
-            int64_t index_pts= av_rescale(itime, i, 10000);
-
-            if(pos != last_pos){
-            av_log(s, AV_LOG_DEBUG, "pktnum:%d, pktct:%d\n", pktnum, pktct);
-            av_add_index_entry(s->streams[stream_index], pos, index_pts, s->packet_size, 0, AVINDEX_KEYFRAME);
-            last_pos=pos;
-            }
-        }
-        asf->index_read= 1;
-    }
-    url_fseek(s->pb, current_pos, SEEK_SET);
-}
-
 static int asf_read_seek(AVFormatContext *s, int stream_index, int64_t pts, int flags)
 {
-    ASFContext *asf = s->priv_data;
     AVStream *st = s->streams[stream_index];
+    ASFStream *asf_st = st->priv_data;
     int64_t pos;
     int index;
 
@@ -1104,18 +1202,20 @@ static int asf_read_seek(AVFormatContext *s, int stream_index, int64_t pts, int
     /* Try using the protocol's read_seek if available */
     if(s->pb) {
         int ret = av_url_read_fseek(s->pb, stream_index, pts, flags);
-        if(ret >= 0)
+        if(ret >= 0) {
             asf_reset_header(s);
+            asf_index_seek(s, -1);
+        }
         if (ret != AVERROR(ENOSYS))
             return ret;
     }
 
-    if (!asf->index_read)
-        asf_build_simple_index(s, stream_index);
-
-    if(!(asf->index_read && st->index_entries)){
+    /* the index read at open or built while reading is used where it
+     * holds all the keyframes, elsewhere the packets are scanned */
+    if(!st->nb_index_entries || pts > asf_st->index_pts){
         if(av_seek_frame_binary(s, stream_index, pts, flags)<0)
             return -1;
+        asf_index_seek(s, url_ftell(s->pb));
     }else{
         index= av_index_search_timestamp(st, pts, flags);
         if(index<0)
@@ -1148,6 +1248,7 @@ static int asf_read_seek(AVFormatContext *s, int stream_index, int64_t pts, int
         /* do the seek */
         av_log(s, AV_LOG_DEBUG, "SEEKTO: %"PRId64"\n", pos);
         url_fseek(s->pb, pos, SEEK_SET);
+        asf_index_seek(s, pos);
     }
     asf_reset_header(s);
     return 0;
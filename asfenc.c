@@ -197,6 +197,9 @@ static const AVCodecTag codec_asf_bmp_tags[] = {
 
 #define PREROLL_TIME 3100
 
+/* the packet duration field is 16 bits wide */
+#define ASF_MAX_PACKET_DURATION 0xFFFF
+
 static void put_guid(ByteIOContext *s, const ff_asf_guid *g)
 {
     assert(sizeof(*g) == 16);
@@ -604,10 +607,15 @@ static int put_payload_parsing_info(
     return ppi_size;
 }
 
-static void flush_packet(AVFormatContext *s)
+/**
+ * Write the chunk header and the payload parsing information of the
+ * current packet to the output context.
+ * @return size of the payload parsing information
+ */
+static int put_packet_header(AVFormatContext *s)
 {
     ASFContext *asf = s->priv_data;
-    int packet_hdr_size, packet_filled_size;
+    int packet_hdr_size;
 
     assert(asf->packet_timestamp_end >= asf->packet_timestamp_start);
 
@@ -622,12 +630,14 @@ static void flush_packet(AVFormatContext *s)
                             asf->packet_nb_payloads,
                             asf->packet_size_left
                         );
-
-    packet_filled_size = PACKET_SIZE - asf->packet_size_left;
     assert(packet_hdr_size <= asf->packet_size_left);
-    memset(asf->packet_buf + packet_filled_size, 0, asf->packet_size_left);
 
-    put_buffer(s->pb, asf->packet_buf, s->packet_size - packet_hdr_size);
+    return packet_hdr_size;
+}
+
+static void end_packet(AVFormatContext *s)
+{
+    ASFContext *asf = s->priv_data;
 
     put_flush_packet(s->pb);
     asf->nb_packets++;
@@ -638,8 +648,27 @@ static void flush_packet(AVFormatContext *s)
                   NULL, NULL, NULL, NULL);
 }
 
+/**
+ * Write out the multiple payload packet assembled in packet_buf.
+ */
+static void flush_packet(AVFormatContext *s)
+{
+    ASFContext *asf = s->priv_data;
+    int packet_hdr_size, packet_filled_size;
+
+    packet_hdr_size = put_packet_header(s);
+
+    packet_filled_size = PACKET_SIZE - asf->packet_size_left;
+    memset(asf->packet_buf + packet_filled_size, 0, asf->packet_size_left - packet_hdr_size);
+
+    put_buffer(s->pb, asf->packet_buf, s->packet_size - packet_hdr_size);
+
+    end_packet(s);
+}
+
 static void put_payload_header(
                                 AVFormatContext *s,
+                                ByteIOContext   *pb,
                                 ASFStream       *stream,
                                 int             presentation_time,
                                 int             m_obj_size,
@@ -649,7 +678,6 @@ static void put_payload_header(
             )
 {
     ASFContext *asf = s->priv_data;
-    ByteIOContext *pb = &asf->pb;
     int val;
 
     val = stream->num;
@@ -686,11 +714,19 @@ static void put_frame(
                 )
 {
     ASFContext *asf = s->priv_data;
-    int m_obj_offset, payload_len, frag_len1;
+    int m_obj_offset, payload_len, frag_len1, pad_len;
+    int max_duration = ASF_MAX_PACKET_DURATION;
+
+    /* keep payloads sharing a packet within the muxing latency limit */
+    if (s->max_delay > 0)
+        max_duration = FFMIN(max_duration, s->max_delay / 1000);
 
     m_obj_offset = 0;
     while (m_obj_offset < m_obj_size) {
         payload_len = m_obj_size - m_obj_offset;
+        if (asf->packet_timestamp_start != -1 &&
+            timestamp - asf->packet_timestamp_start > max_duration)
+            flush_packet(s);
         if (asf->packet_timestamp_start == -1) {
             asf->multi_payloads_present = (payload_len < MULTI_PAYLOAD_CONSTANT);
 
@@ -718,25 +754,32 @@ static void put_frame(
             else if (payload_len == (frag_len1 - 1))
                 payload_len = frag_len1 - 2;  //additional byte need to put padding length
 
-            put_payload_header(s, stream, timestamp+PREROLL_TIME, m_obj_size, m_obj_offset, payload_len, flags);
-            put_buffer(&asf->pb, buf, payload_len);
+            asf->packet_timestamp_end = timestamp;
+            asf->packet_nb_payloads++;
 
-            if (asf->multi_payloads_present)
+            if (asf->multi_payloads_present) {
+                put_payload_header(s, &asf->pb, stream, timestamp+PREROLL_TIME, m_obj_size, m_obj_offset, payload_len, flags);
+                put_buffer(&asf->pb, buf, payload_len);
                 asf->packet_size_left -= (payload_len + PAYLOAD_HEADER_SIZE_MULTIPLE_PAYLOADS);
-            else
+            } else {
+                /* the packet header of a single payload packet is known
+                 * up front, so the fragment goes straight to the output */
                 asf->packet_size_left -= (payload_len + PAYLOAD_HEADER_SIZE_SINGLE_PAYLOAD);
-            asf->packet_timestamp_end = timestamp;
-
-            asf->packet_nb_payloads++;
+                pad_len = asf->packet_size_left - put_packet_header(s);
+                put_payload_header(s, s->pb, stream, timestamp+PREROLL_TIME, m_obj_size, m_obj_offset, payload_len, flags);
+                put_buffer(s->pb, buf, payload_len);
+                memset(asf->packet_buf, 0, pad_len);
+                put_buffer(s->pb, asf->packet_buf, pad_len);
+                end_packet(s);
+            }
         } else {
             payload_len = 0;
         }
         m_obj_offset += payload_len;
         buf += payload_len;
 
-        if (!asf->multi_payloads_present)
-            flush_packet(s);
-        else if (asf->packet_size_left <= (PAYLOAD_HEADER_SIZE_MULTIPLE_PAYLOADS + PACKET_HEADER_MIN_SIZE + 1))
+        if (asf->multi_payloads_present &&
+            asf->packet_size_left <= (PAYLOAD_HEADER_SIZE_MULTIPLE_PAYLOADS + PACKET_HEADER_MIN_SIZE + 1))
             flush_packet(s);
     }
     stream->seq++;
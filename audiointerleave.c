@@ -76,10 +76,14 @@ static int ff_interleave_new_audio_packet(AVFormatContext *s, AVPacket *pkt,
     AudioInterleaveContext *aic = st->priv_data;
 
     int size = FFMIN(av_fifo_size(aic->fifo), *aic->samples * aic->sample_size);
+    int ret;
+
     if (!size || (!flush && size == av_fifo_size(aic->fifo)))
         return 0;
 
-    av_new_packet(pkt, size);
+    /* chunks are freed after being muxed, so their buffers can be reused */
+    if ((ret = ff_packet_pool_new(s, pkt, size)) < 0)
+        return ret;
     av_fifo_generic_read(aic->fifo, pkt->data, size, NULL);
 
     pkt->dts = pkt->pts = aic->dts;
@@ -94,11 +98,30 @@ static int ff_interleave_new_audio_packet(AVFormatContext *s, AVPacket *pkt,
     return size;
 }
 
+/**
+ * Queue the chunks of stream_index that are complete, or all its samples
+ * if flush is set.
+ */
+static int interleave_audio_chunks(AVFormatContext *s, int stream_index, int flush,
+                                   int (*compare_ts)(AVFormatContext *, AVPacket *, AVPacket *))
+{
+    AVPacket new_pkt;
+    int ret;
+
+    while ((ret = ff_interleave_new_audio_packet(s, &new_pkt, stream_index, flush)) > 0) {
+        if ((ret = ff_interleave_add_packet(s, &new_pkt, compare_ts)) < 0) {
+            av_free_packet(&new_pkt);
+            return ret;
+        }
+    }
+    return ret;
+}
+
 int ff_audio_rechunk_interleave(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush,
                         int (*get_packet)(AVFormatContext *, AVPacket *, AVPacket *, int),
                         int (*compare_ts)(AVFormatContext *, AVPacket *, AVPacket *))
 {
-    int i;
+    int i, ret;
 
     if (pkt) {
         AVStream *st = s->streams[pkt->stream_index];
@@ -106,26 +129,33 @@ int ff_audio_rechunk_interleave(AVFormatContext *s, AVPacket *out, AVPacket *pkt
         if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
             unsigned new_size = av_fifo_size(aic->fifo) + pkt->size;
             if (new_size > aic->fifo_size) {
+                /* grow geometrically, not by every packet that does not fit */
+                new_size = FFMAX(new_size, 2 * aic->fifo_size);
                 if (av_fifo_realloc2(aic->fifo, new_size) < 0)
-                    return -1;
+                    return AVERROR(ENOMEM);
                 aic->fifo_size = new_size;
             }
             av_fifo_generic_write(aic->fifo, pkt->data, pkt->size, NULL);
+            /* only this stream can have new complete chunks, the others
+             * were emptied down to a partial chunk when they were fed */
+            if (!flush &&
+                (ret = interleave_audio_chunks(s, pkt->stream_index, 0, compare_ts)) < 0)
+                return ret;
         } else {
             // rewrite pts and dts to be decoded time line position
             pkt->pts = pkt->dts = aic->dts;
             aic->dts += pkt->duration;
-            ff_interleave_add_packet(s, pkt, compare_ts);
+            if ((ret = ff_interleave_add_packet(s, pkt, compare_ts)) < 0)
+                return ret;
         }
         pkt = NULL;
     }
 
-    for (i = 0; i < s->nb_streams; i++) {
-        AVStream *st = s->streams[i];
-        if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
-            AVPacket new_pkt;
-            while (ff_interleave_new_audio_packet(s, &new_pkt, i, flush))
-                ff_interleave_add_packet(s, &new_pkt, compare_ts);
+    if (flush) {
+        for (i = 0; i < s->nb_streams; i++) {
+            if (s->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO &&
+                (ret = interleave_audio_chunks(s, i, 1, compare_ts)) < 0)
+                return ret;
         }
     }
 
@@ -19,45 +19,25 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <string.h>
+
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
 #include "avio.h"
 
 const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end)
 {
-    const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-    for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    for (end -= 3; p < end; p += 4) {
-        uint32_t x = *(const uint32_t*)p;
-//      if ((x - 0x01000100) & (~x) & 0x80008000) // little endian
-//      if ((x - 0x00010001) & (~x) & 0x00800080) // big endian
-        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-            if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
-                    return p-1;
-                if (p[2] == 0 && p[3] == 1)
-                    return p;
-            }
-            if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
-                    return p+1;
-                if (p[4] == 0 && p[5] == 1)
-                    return p+2;
-            }
-        }
+    const uint8_t *q = p + 2;
+
+    /* The 1 ending a startcode is rare in coded data, so let memchr(),
+     * which libc vectorizes, find the candidates. As q[0] is not 0, the
+     * next startcode cannot end before q + 3. */
+    while (q < end && (q = memchr(q, 1, end - q))) {
+        if (!q[-1] && !q[-2])
+            return q - 2;
+        q += 3;
     }
-
-    for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    return end + 3;
+    return end;
 }
 
 int ff_avc_parse_nal_units(ByteIOContext *pb, const uint8_t *buf_in, int size)
@@ -79,17 +59,44 @@ int ff_avc_parse_nal_units(ByteIOContext *pb, const uint8_t *buf_in, int size)
     return size;
 }
 
+int ff_avc_convert_nal_units(const uint8_t *buf_in, int size,
+                             uint8_t **buf, unsigned int *buf_size)
+{
+    const uint8_t *end = buf_in + size;
+    const uint8_t *nal_start, *nal_end;
+    uint8_t *out;
+
+    /* a start code takes at least 3 bytes and is replaced by 4 */
+    out = av_fast_realloc(*buf, buf_size, (unsigned)size + size / 3 + 4);
+    if (!out) {
+        *buf_size = 0;
+        return AVERROR(ENOMEM);
+    }
+    *buf = out;
+
+    nal_start = ff_avc_find_startcode(buf_in, end);
+    while (nal_start < end) {
+        while(!*(nal_start++));
+        nal_end = ff_avc_find_startcode(nal_start, end);
+        AV_WB32(out, nal_end - nal_start);
+        memcpy(out + 4, nal_start, nal_end - nal_start);
+        out += 4 + nal_end - nal_start;
+        nal_start = nal_end;
+    }
+    return out - *buf;
+}
+
 int ff_avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size)
 {
-    ByteIOContext *pb;
-    int ret = url_open_dyn_buf(&pb);
+    uint8_t *out = NULL;
+    unsigned int out_size = 0;
+    int ret = ff_avc_convert_nal_units(buf_in, *size, &out, &out_size);
     if(ret < 0)
         return ret;
 
-    ff_avc_parse_nal_units(pb, buf_in, *size);
-
     av_freep(buf);
-    *size = url_close_dyn_buf(pb, buf);
+    *buf  = out;
+    *size = ret;
     return 0;
 }
 
@@ -146,3 +153,71 @@ int ff_isom_write_avcc(ByteIOContext *pb, const uint8_t *data, int len)
     }
     return 0;
 }
+
+#ifdef TEST
+#include <stdio.h>
+#include "libavutil/lfg.h"
+
+#define BUF_SIZE (1 << 20)
+#define ROUNDS   256
+
+static const uint8_t *find_startcode_ref(const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 2 < end; p++)
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    return end;
+}
+
+int main(void)
+{
+    static uint8_t buf[BUF_SIZE];
+    AVLFG prng;
+    const uint8_t *p, *end = buf + BUF_SIZE;
+    int64_t t0, t1, t2;
+    int i, len, count = 0, ref_count = 0;
+
+    /* random coded data with a startcode about every 4 kB */
+    av_lfg_init(&prng, 1);
+    for (i = 0; i < BUF_SIZE; i++)
+        buf[i] = av_lfg_get(&prng);
+    for (i = 0; i < BUF_SIZE / 4096; i++) {
+        int pos = av_lfg_get(&prng) % (BUF_SIZE - 4);
+        memcpy(buf + pos, "\0\0\0\1", 4);
+    }
+
+    /* all lengths and alignments at the buffer edges */
+    for (len = 0; len < 16; len++) {
+        for (i = 0; i < 8; i++) {
+            int j;
+            for (j = 0; j <= len; j++) {
+                uint8_t tmp[32] = { 0 };
+                tmp[i + j] = 1;
+                if (ff_avc_find_startcode(tmp + i, tmp + i + len) !=
+                    find_startcode_ref(tmp + i, tmp + i + len)) {
+                    printf("mismatch for len %d offset %d\n", len, i);
+                    return 1;
+                }
+            }
+        }
+    }
+
+    t0 = av_gettime();
+    for (i = 0; i < ROUNDS; i++)
+        for (p = buf; (p = find_startcode_ref(p, end)) < end; p += 3)
+            ref_count++;
+    t1 = av_gettime();
+    for (i = 0; i < ROUNDS; i++)
+        for (p = buf; (p = ff_avc_find_startcode(p, end)) < end; p += 3)
+            count++;
+    t2 = av_gettime();
+
+    if (count != ref_count) {
+        printf("found %d startcodes instead of %d\n", count, ref_count);
+        return 1;
+    }
+    printf("byte loop:             %6.3f GB/s\n", ROUNDS * (double)BUF_SIZE / 1000 / FFMAX(t1 - t0, 1));
+    printf("ff_avc_find_startcode: %6.3f GB/s\n", ROUNDS * (double)BUF_SIZE / 1000 / FFMAX(t2 - t1, 1));
+    return 0;
+}
+#endif
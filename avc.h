@@ -27,6 +27,14 @@
 
 int ff_avc_parse_nal_units(ByteIOContext *s, const uint8_t *buf, int size);
 int ff_avc_parse_nal_units_buf(const uint8_t *buf_in, uint8_t **buf, int *size);
+/**
+ * Convert the Annex B NAL units of buf_in to NAL units prefixed with
+ * their 32-bit size, into *buf, which is grown with av_fast_realloc()
+ * if needed so that it can be reused for the next call.
+ * @return size of the converted data, or <0 on error
+ */
+int ff_avc_convert_nal_units(const uint8_t *buf_in, int size,
+                             uint8_t **buf, unsigned int *buf_size);
 int ff_isom_write_avcc(ByteIOContext *pb, const uint8_t *data, int len);
 const uint8_t *ff_avc_find_startcode(const uint8_t *p, const uint8_t *end);
 
@@ -22,7 +22,7 @@
 #define AVFORMAT_AVFORMAT_H
 
 #define LIBAVFORMAT_VERSION_MAJOR 52
-#define LIBAVFORMAT_VERSION_MINOR 47
+#define LIBAVFORMAT_VERSION_MINOR 106
 #define LIBAVFORMAT_VERSION_MICRO  0
 
 #define LIBAVFORMAT_VERSION_INT AV_VERSION_INT(LIBAVFORMAT_VERSION_MAJOR, \
@@ -248,6 +248,8 @@ typedef struct AVOutputFormat {
     struct AVOutputFormat *next;
 } AVOutputFormat;
 
+struct AVStreamNetworkStats;
+
 typedef struct AVInputFormat {
     const char *name;
     /**
@@ -328,6 +330,20 @@ typedef struct AVInputFormat {
 
     const AVMetadataConv *metadata_conv;
 
+    /**
+     * Read up to nb_packets packets at once, for av_read_frames().
+     * Optional, read_packet() is used if this is NULL or returns 0.
+     * @return number of packets read, or < 0 on error
+     */
+    int (*read_packets)(struct AVFormatContext *, AVPacket *pkts, int nb_packets);
+
+    /**
+     * Fill stats with the reception statistics of a stream received over
+     * the network. Optional.
+     */
+    int (*get_network_stats)(struct AVFormatContext *, int stream_index,
+                             struct AVStreamNetworkStats *stats);
+
     /* private fields */
     struct AVInputFormat *next;
 } AVInputFormat;
@@ -475,7 +491,7 @@ typedef struct AVStream {
     int probe_packets;
 
     /**
-     * last packet in packet_buffer for this stream when muxing.
+     * last packet in the interleaving queue for this stream when muxing.
      * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
      */
     struct AVPacketList *last_in_packet_buffer;
@@ -484,6 +500,47 @@ typedef struct AVStream {
      * Average framerate
      */
     AVRational avg_frame_rate;
+
+    /**
+     * delta coded index used instead of index_entries if enabled by the
+     * demuxer, access it through ff_index_get_entry().
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    struct CompactIndex *compact_index;
+
+    /**
+     * FF_PARAM_* flags of the codec parameters that the demuxer read from
+     * the container and that can be trusted without decoding.
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    int container_params;
+
+    /**
+     * timestamps found by read_timestamp() in earlier seeks
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    struct SeekPointCache *seek_cache;
+
+    /**
+     * Whether compute_pkt_fields() can take its path for streams without
+     * reordering, decided for simple_ts_codec_id.
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    int simple_ts;
+    enum CodecID simple_ts_codec_id;
+
+    /**
+     * index timestamp of the key frame returned by the last av_read_keyframe()
+     * call, AV_NOPTS_VALUE after a seek
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    int64_t trickplay_ts;
+
+    /**
+     * AVFormatContext.max_index_entries, set by av_new_stream()
+     * used internally, NOT PART OF PUBLIC API, dont read or write from outside of libav*
+     */
+    int max_index_entries;
 } AVStream;
 
 #define AV_PROGRAM_RUNNING 1
@@ -522,6 +579,75 @@ typedef struct AVChapter {
 
 #define MAX_STREAMS 20
 
+/**
+ * Phases of opening, analyzing and seeking that AVFormatTimings reports.
+ */
+enum AVFormatPhase {
+    AVFMT_PHASE_OPEN,           ///< opening the protocol in av_open_input_file()
+    AVFMT_PHASE_PROBE,          ///< reading and probing the data to detect the format
+    AVFMT_PHASE_READ_HEADER,
+    AVFMT_PHASE_STREAM_INFO,    ///< av_find_stream_info()
+    AVFMT_PHASE_DURATION,       ///< duration estimation at the end of av_find_stream_info()
+    AVFMT_PHASE_SEEK_INDEX,     ///< seek within the index of a demuxer without read_seek()
+    AVFMT_PHASE_SEEK_READ_SEEK, ///< seek by the demuxer's read_seek() or read_seek2()
+    AVFMT_PHASE_SEEK_BINARY,    ///< timestamp search with read_timestamp()
+    AVFMT_PHASE_SEEK_GENERIC,   ///< seek reading packets to extend the index
+    AVFMT_PHASE_SEEK_BYTE,      ///< AVSEEK_FLAG_BYTE seek
+    AVFMT_PHASE_NB
+};
+
+/**
+ * Time in microseconds spent in each AVFormatPhase.
+ */
+typedef struct AVFormatTimings {
+    int64_t total[AVFMT_PHASE_NB];  ///< summed time of the phase
+    int64_t last[AVFMT_PHASE_NB];   ///< time of its last occurrence
+    int count[AVFMT_PHASE_NB];      ///< number of occurrences
+    /**
+     * Time from the start of av_find_stream_info() until the parameters of
+     * each stream were found, 0 if they never were.
+     */
+    int64_t stream_info[MAX_STREAMS];
+} AVFormatTimings;
+
+/**
+ * Application supplied storage for the index cache, see
+ * AVFMT_FLAG_INDEX_CACHE. If not set, the cache of a local file is kept in
+ * a "<filename>.ffindex" file next to it.
+ */
+typedef struct AVIndexCacheIO {
+    /**
+     * Fetch the cache stored for filename.
+     * @param buf set to the cached data, allocated with av_malloc()
+     * @return size of the cached data, <= 0 if there is none
+     */
+    int (*load)(void *opaque, const char *filename, uint8_t **buf);
+    /**
+     * Store size bytes of cached data for filename, replacing older data.
+     */
+    int (*store)(void *opaque, const char *filename, const uint8_t *buf, int size);
+    void *opaque;
+} AVIndexCacheIO;
+
+/**
+ * Application supplied allocator of the payload of demuxed packets, for
+ * them to be read straight into memory the decoder uses, e.g. pinned or
+ * device visible memory. See AVFormatContext.packet_allocator.
+ * It must stay valid until the last packet allocated with it is freed.
+ */
+typedef struct AVPacketAllocator {
+    /**
+     * Allocate size bytes, FF_INPUT_BUFFER_PADDING_SIZE included.
+     * @return the buffer, NULL if out of memory
+     */
+    void *(*alloc)(void *opaque, int size);
+    /**
+     * Free a buffer returned by alloc().
+     */
+    void (*free)(void *opaque, void *buf);
+    void *opaque;
+} AVPacketAllocator;
+
 /**
  * Format I/O context.
  * New fields can be added to the end with minor version bumps.
@@ -600,6 +726,30 @@ typedef struct AVFormatContext {
 #define AVFMT_FLAG_GENPTS       0x0001 ///< Generate missing pts even if it requires parsing future frames.
 #define AVFMT_FLAG_IGNIDX       0x0002 ///< Ignore index.
 #define AVFMT_FLAG_NONBLOCK     0x0004 ///< Do not block when reading packets from input.
+#define AVFMT_FLAG_NOBUFFERCOPY 0x0008 ///< Allow demuxers to return packets pointing into the ByteIOContext buffer, their padding is not zeroed.
+#define AVFMT_FLAG_PACKET_POOL  0x0010 ///< Reuse payload buffers of packets that the interleaver has to copy.
+#define AVFMT_FLAG_COMPACT_INDEX 0x0020 ///< Keep the index of demuxers that support it delta coded in memory.
+#define AVFMT_FLAG_INDEX_CACHE  0x0040 ///< Keep indexes and stream parameters in a cache that is reused when the same file is opened again.
+#define AVFMT_FLAG_PROBE_STATS  0x0080 ///< Log the time spent in each read_probe() while opening the input.
+#define AVFMT_FLAG_TRUST_CONTAINER 0x0100 ///< Let av_find_stream_info() use the codec parameters of the container headers without reading packets.
+#define AVFMT_FLAG_LAZY_DURATION 0x0200 ///< Let av_find_stream_info() estimate the duration from the bit rate and refine it in the background, see av_update_duration().
+#define AVFMT_FLAG_SHARED_PAYLOAD 0x0400 ///< Let packets from av_read_frame() share the payload of the demuxed packet they were parsed from instead of copying it. Such packets own their payload already and must not be passed to av_dup_packet().
+#define AVFMT_FLAG_METADATA_ARENA 0x0800 ///< Store the metadata strings of the context, its streams, programs and chapters in per set arenas freed in bulk.
+#define AVFMT_FLAG_SINGLE_PROGRAM 0x1000 ///< Let demuxers of multi-program streams follow only the first program, ignoring service information and pids not listed in its program map.
+#define AVFMT_FLAG_LAZY_INDEX   0x2000 ///< Let demuxers with sample tables look samples up on demand, only the keyframes are added to the index. Not used together with AVFMT_FLAG_INDEX_CACHE.
+#define AVFMT_FLAG_FASTSTART    0x4000 ///< Let muxers writing their index in the trailer move it in front of the data, reading the output file back.
+#define AVFMT_FLAG_LIVE         0x8000 ///< Let demuxers of fragmented input drop the index of the fragments already read and wait for fragments still being written, instead of assuming the input is complete. Seeking is limited to the fragments in memory. Muxers write the output as it is produced, without seeking back or keeping an index of the whole file.
+#define AVFMT_FLAG_SCAN_INDEX   0x10000 ///< Let demuxers of files without an index build one in the background by scanning the file, seeks wait for the scan to reach their target.
+#define AVFMT_FLAG_ANALYZE_HEADER 0x20000 ///< Let muxers with header fields tuned to the packets buffer the first packets of each stream and fit their headers to them.
+#define AVFMT_FLAG_PACING       0x40000 ///< Let the RTP muxer spread the packets of each frame over the frame duration instead of sending them at once.
+#define AVFMT_FLAG_AVCC         0x80000 ///< Let the H.264 RTP depacketizer return NAL units with 4 byte size prefixes and avcC extradata instead of start codes.
+#define AVFMT_FLAG_SDP_CACHE    0x100000 ///< Let avf_sdp_create() keep the resolved destination and the media descriptions of the context to reuse them until its streams change.
+#define AVFMT_FLAG_FFM_PAGE_INDEX 0x200000 ///< Let the FFM muxer write the dts of each page to a "<filename>.ffpages" sidecar, and the demuxer seek with it and with the pages it has read.
+#define AVFMT_FLAG_LAZY_TAGS    0x400000 ///< Let demuxers keep ID3v2 text frames undecoded until the metadata is first accessed with av_metadata_get(), and skip binary APE tag items. The deprecated title, author and similar fields are then left empty.
+#define AVFMT_FLAG_CLOCK_RECOVERY 0x800000 ///< Let live demuxers (MPEG-TS, RTP) track the clock of the source against the local clock, see av_get_clock_estimate().
+#define AVFMT_FLAG_LOW_DELAY    0x1000000 ///< Return packets of live input as soon as possible, see av_find_stream_info() for what is given up.
+#define AVFMT_FLAG_NOPARSE      0x2000000 ///< Do not run parsers over the packets of streams whose demuxer returns whole frames with key flags and timestamps (Matroska video, frame wrapped intra MXF), for remuxing. Codec parameters are then not updated from the bitstream.
+#define AVFMT_FLAG_PROBE_CACHE  0x4000000 ///< Remember the format and the codec parameters found for the URL, and on the next open of the same URL skip the probe and take the parameters of the streams whose codec matches, see av_probe_cache_flush(). Set in a preallocated context for av_open_input_file() to see it.
 
     int loop_input;
     /** decoding: size of data to probe; encoding: unused. */
@@ -679,8 +829,397 @@ typedef struct AVFormatContext {
      */
 #define RAW_PACKET_BUFFER_SIZE 2500000
     int raw_packet_buffer_remaining_size;
+
+    /**
+     * Number of I/O buffers to read ahead in a separate thread,
+     * 0 disables read-ahead.
+     * - demuxing: set by user before av_open_input_file()
+     * - muxing: unused
+     */
+    int readahead;
+
+    /**
+     * Interrupt callback and deadline for the blocking I/O of this context,
+     * used besides the global url_interrupt_cb. The fields may be changed
+     * at any time, e.g. to set a new deadline before each av_read_frame().
+     * - demuxing: set by user before av_open_input_file()
+     * - muxing: unused
+     */
+    URLInterrupt interrupt;
+
+    /**
+     * Unused packet list nodes, reused by the packet queues.
+     * NOT PART OF PUBLIC API
+     */
+    struct AVPacketList *packet_list_pool;
+    int packet_list_pool_size;
+
+    /**
+     * Payload buffers for packets copied into the interleaving queue,
+     * used with AVFMT_FLAG_PACKET_POOL.
+     * NOT PART OF PUBLIC API
+     */
+    struct PacketPool *packet_pool;
+
+    /**
+     * Packets waiting in av_interleaved_write_frame() and the muxer
+     * specific interleaving functions.
+     * NOT PART OF PUBLIC API
+     */
+    struct InterleaveQueue *interleave_queue;
+
+    /**
+     * Storage for the index cache, used with AVFMT_FLAG_INDEX_CACHE.
+     * NULL keeps the cache of local files in a sidecar file.
+     * - demuxing: set by the user before av_open_input_stream()
+     * - muxing: unused
+     */
+    const AVIndexCacheIO *index_cache_io;
+
+    /**
+     * Index cache state of the opened file.
+     * NOT PART OF PUBLIC API
+     */
+    struct IndexCache *index_cache;
+
+    /**
+     * Maximum memory in bytes, including overhead, that av_find_stream_info()
+     * may buffer in packets, 0 for no limit besides probesize.
+     * - demuxing: set by the user
+     */
+    int max_analyze_buffer;
+
+    /**
+     * If nonzero, av_find_stream_info() stops once this many bytes were
+     * read without a stream becoming complete or a new stream appearing,
+     * provided that all streams with packets are complete. Streams that
+     * do not get packets then do not hold up the others, even for formats
+     * without a header.
+     * - demuxing: set by the user
+     */
+    int max_analyze_idle;
+
+    /**
+     * Number of threads av_find_stream_info() may use to decode streams in
+     * parallel when decoding is needed to find their parameters, 0 or 1
+     * to decode on the calling thread.
+     * - demuxing: set by the user
+     */
+    int analyze_threads;
+
+    /**
+     * Pending refinement of the duration, used with AVFMT_FLAG_LAZY_DURATION.
+     * NOT PART OF PUBLIC API
+     */
+    struct DurationEstimate *duration_estimate;
+
+    /**
+     * If nonzero, av_read_frame() returns packets demuxed ahead by a
+     * separate thread, which stops reading once this many payload bytes
+     * are queued. Seeking drops the queued packets, av_read_pause() and
+     * seeking stop the thread until the next av_read_frame(). The demuxer
+     * and ic->pb must not be accessed directly while the thread runs.
+     * - demuxing: set by the user before the first av_read_frame()
+     */
+    int demux_queue_size;
+
+    /**
+     * If nonzero, the thread of demux_queue_size also stops reading once
+     * the queued packets span this many microseconds.
+     * - demuxing: set by the user before the first av_read_frame()
+     */
+    int demux_queue_duration;
+
+    /**
+     * Reader thread state, used with demux_queue_size.
+     * NOT PART OF PUBLIC API
+     */
+    struct DemuxThread *demux_thread;
+
+    /**
+     * If nonzero, av_interleaved_write_frame() only queues the packets and
+     * a separate thread interleaves and writes them. The call blocks while
+     * this many payload bytes are queued. Errors of the muxer are returned
+     * by the following calls and by av_write_trailer().
+     * - muxing: set by the user before av_write_header()
+     * - demuxing: unused
+     */
+    int mux_queue_size;
+
+    /**
+     * If nonzero, av_interleaved_write_frame() with mux_queue_size also
+     * blocks while the queued packets span this many microseconds.
+     * - muxing: set by the user before av_write_header()
+     * - demuxing: unused
+     */
+    int mux_queue_duration;
+
+    /**
+     * Number of buffers of pb written by a separate thread, see
+     * url_fset_writebehind(); av_write_trailer() waits for them.
+     * - muxing: set by the user before av_write_header()
+     * - demuxing: unused
+     */
+    int write_behind;
+
+    /**
+     * Muxing thread state, used with mux_queue_size.
+     * NOT PART OF PUBLIC API
+     */
+    struct MuxThread *mux_thread;
+
+    /**
+     * Search strategy of the timestamp based seeking (av_gen_search()),
+     * one of AVSEEK_STRATEGY_*.
+     * - demuxing: set by the user
+     */
+    int seek_strategy;
+#define AVSEEK_STRATEGY_DEFAULT  0 ///< interpolation with bisection and linear search fallbacks
+#define AVSEEK_STRATEGY_ADAPTIVE 1 ///< Illinois regula falsi preferring positions that are buffered already
+
+    /**
+     * Maximum number of probes of a timestamp search, 0 for no limit.
+     * If the limit is hit, the search ends at the closest position found
+     * so far in the requested direction.
+     * - demuxing: set by the user
+     */
+    int seek_max_probes;
+
+    /**
+     * Number of read_timestamp() calls of the last av_seek_frame() or
+     * avformat_seek_file().
+     * - demuxing: set by libavformat
+     */
+    int seek_probes;
+
+    /**
+     * Bytes read from the protocol by the last av_seek_frame() or
+     * avformat_seek_file().
+     * - demuxing: set by libavformat
+     */
+    int64_t seek_bytes;
+
+    /**
+     * Time spent in the phases of opening and seeking.
+     * - demuxing: set by libavformat
+     */
+    AVFormatTimings timings;
+
+    /**
+     * If set, called at the end of each phase with its duration in
+     * microseconds. stream_index is -1, except for the
+     * AVFMT_PHASE_STREAM_INFO calls made when a single stream had its
+     * parameters found. AVFMT_PHASE_OPEN and AVFMT_PHASE_PROBE are reported
+     * after AVFMT_PHASE_READ_HEADER, once the context is open.
+     * - demuxing: set by the user on a preallocated context
+     */
+    void (*timing_callback)(void *opaque, struct AVFormatContext *s,
+                            int phase, int stream_index, int64_t duration);
+    void *timing_opaque;
+
+    /**
+     * Maximum number of bytes libavformat buffers in its packet queues and
+     * demuxer packet buffers, 0 for no limit. When it is reached, probing
+     * and stream analysis end early, interleaving flushes and threaded
+     * queues stop filling instead of growing further.
+     * - demuxing: set by the user
+     * - muxing: set by the user
+     */
+    int max_buffer_memory;
+
+    /**
+     * Number of bytes currently buffered, and its highest value so far.
+     * - demuxing: set by libavformat
+     * - muxing: set by libavformat
+     */
+    int64_t buffer_memory;
+    int64_t buffer_memory_peak;
+
+    /**
+     * NOT PART OF PUBLIC API
+     */
+    int buffer_memory_warned;
+
+    /**
+     * Packets read by AVInputFormat.read_packets() and not yet returned,
+     * and the number of packets the current av_read_frames() call wants.
+     * NOT PART OF PUBLIC API
+     */
+    AVPacket *packet_run;
+    int packet_run_pos, packet_run_count;
+    int packet_run_wanted;
+
+    /**
+     * Number of threads assembling the packets of the different programs
+     * of a multiplex in parallel, 0 to assemble them in the demuxer.
+     * Packets of different programs are then not returned in file order.
+     * Only used by the MPEG-TS demuxer.
+     * - demuxing: set by the user
+     */
+    int program_threads;
+
+    /**
+     * Minimum duration of a fragment in AV_TIME_BASE units, 0 to write
+     * unfragmented files. Fragmented files are written as a moov without
+     * samples followed by moof and mdat pairs, each starting at a keyframe
+     * of the first video track, and need no seekable output.
+     * Only used by the MOV/MP4 muxers.
+     * - muxing: set by the user
+     */
+    int fragment_duration;
+
+    /**
+     * Number of threads building the sample indexes of the tracks in
+     * parallel once the header has been parsed, 0 or 1 to build each
+     * index right after its track.
+     * Only used by the MOV/MP4 demuxer.
+     * - demuxing: set by the user
+     */
+    int trak_threads;
+
+    /**
+     * Max number of RTP packets received over UDP held back to put them
+     * back in sequence, 0 to parse packets in the order they arrive.
+     * - demuxing: set by the user
+     */
+    int reorder_queue_size;
+
+    /**
+     * Max time in AV_TIME_BASE units an RTP packet received out of sequence
+     * is held back waiting for the packets before it, 0 for no limit
+     * other than reorder_queue_size.
+     * - demuxing: set by the user
+     */
+    int reorder_delay;
+
+    /**
+     * Resolved destination and media descriptions kept by avf_sdp_create(),
+     * used with AVFMT_FLAG_SDP_CACHE. Freed by av_write_trailer() and
+     * av_close_input_stream().
+     */
+    struct SDPCache *sdp_cache;
+
+    /**
+     * Max size in bytes of the packets returned by demuxers of raw
+     * elementary streams, 0 for automatic. Inputs that cannot seek get at
+     * most what one read of the I/O buffer returns.
+     * - demuxing: set by the user
+     */
+    int raw_packet_size;
+
+    /**
+     * Number of threads reading the next images of a sequence ahead, or
+     * writing the images, 0 to read and write them synchronously.
+     * Only used by the image2 demuxer and muxer.
+     * - muxing: set by the user
+     * - demuxing: set by the user
+     */
+    int image_threads;
+
+    /**
+     * Duration in microseconds of the packets of uncompressed audio,
+     * rounded to whole blocks and where possible whole pages of 4096
+     * bytes, 0 for the default size of the demuxer.
+     * Used by the WAV, W64, AIFF, AU, raw PCM, AEA and OMA demuxers, and
+     * by the AMR demuxer to group frames.
+     * - demuxing: set by the user
+     */
+    int pcm_packet_duration;
+
+    /**
+     * Clocks of the source tracked with AVFMT_FLAG_CLOCK_RECOVERY.
+     * Freed by av_close_input_stream().
+     * NOT PART OF PUBLIC API
+     */
+    struct ClockRecovery *clock_recovery;
+
+    /**
+     * Target duration of a segment in AV_TIME_BASE units. Segments start
+     * at the first keyframe of the first video stream after it.
+     * Only used by the segment muxers.
+     * - muxing: set by the user
+     */
+    int segment_duration;
+
+    /**
+     * Number of segments listed in the playlist, the oldest being dropped
+     * from it, 0 to list them all.
+     * Only used by the segment muxers.
+     * - muxing: set by the user
+     */
+    int segment_list_size;
+
+    /**
+     * Allocator of the payload of the packets that demuxers read, NULL for
+     * av_malloc(). Packets parsers assemble are not allocated with it.
+     * The packets own their payload and must not be passed to
+     * av_dup_packet(), which would copy it.
+     * - demuxing: set by the user before av_open_input_stream()
+     */
+    AVPacketAllocator *packet_allocator;
+
+    /**
+     * Hash algorithm of the framehash muxer, one of AVHASH_*.
+     * - muxing: set by the user
+     */
+    int hash_algorithm;
+#define AVHASH_ADLER32 0
+#define AVHASH_CRC32   1
+#define AVHASH_MD5     2
+#define AVHASH_XXH32   3
+
+    /**
+     * Number of threads hashing the packets of the framehash muxer, 0 or 1
+     * to hash them in av_write_frame().
+     * - muxing: set by the user
+     */
+    int hash_threads;
+
+    /**
+     * Work limits against pathological input, 0 for no limit. Reaching one
+     * logs an error naming it and fails with AVERROR_WORK_LIMIT, except
+     * for max_index_entries.
+     *
+     * max_resync_size: bytes skipped looking for sync after losing it,
+     * by the MPEG-TS, Ogg (0: one page) and NUT demuxers.
+     * max_index_entries: index entries per stream, av_add_index_entry()
+     * fails beyond, which bounds the cost of out of order inserts.
+     * max_atoms: atoms parsed by the MOV/MP4 demuxer for the header or
+     * one fragment.
+     * max_work_time: microseconds spent reading the header in
+     * av_open_input_file() and in av_find_stream_info(), each.
+     * - demuxing: set by the user
+     */
+    int max_resync_size;
+    int max_index_entries;
+    int max_atoms;
+    int max_work_time;
+
+    /**
+     * av_gettime() at the start of the operation bounded by max_work_time,
+     * 0 outside of them.
+     * NOT PART OF PUBLIC API
+     */
+    int64_t work_start;
+
+    /**
+     * Storage of the parser state saved by demuxers around their seeks,
+     * kept from one seek to the next.
+     * NOT PART OF PUBLIC API
+     */
+    struct AVParserState *parser_state;
+
+    /**
+     * Reads the tags at the end of the input, set when a demuxer postponed
+     * reading them to save a seek at open, see av_read_tail_tags().
+     * - demuxing: set by libavformat
+     */
+    void (*read_tail_tags)(struct AVFormatContext *s);
 } AVFormatContext;
 
+/** error returned when a work limit of AVFormatContext is reached */
+#define AVERROR_WORK_LIMIT AVERROR(ERANGE)
+
 typedef struct AVPacketList {
     AVPacket pkt;
     struct AVPacketList *next;
@@ -872,6 +1411,26 @@ AVFormatContext *avformat_alloc_context(void);
  * The logical file position is not changed by this function;
  * examined packets may be buffered for later processing.
  *
+ * With AVFMT_FLAG_LOW_DELAY set, the latency added by each stage is cut
+ * down for live input:
+ * - stream analysis: a stream is done as soon as its codec parameters
+ *   (and extradata for parsers that split it) are known, instead of
+ *   reading up to 20 frames to guess the frame rate and waiting for a
+ *   dts. Input without header stops waiting for new streams once all
+ *   streams found are done. The delay is the time until a key frame with
+ *   the parameters arrives, only those packets are buffered.
+ * - duration estimation: av_estimate_timings() neither scans the end of
+ *   the file nor computes the duration from the bit rate, only the start
+ *   time is set (up to a few MB of reads or seeks saved).
+ * - parsing: video parsers take each demuxed packet as a whole frame
+ *   instead of holding it until the start of the next one (one frame of
+ *   delay), so the demuxer must return whole frames, as MPEG-TS and most
+ *   RTP depacketizers do.
+ * - AVFMT_FLAG_GENPTS is ignored, it holds packets until the next
+ *   reference frame.
+ * The format probe of av_open_input_file() already reads no more than
+ * 2 kB when the format is recognized with confidence.
+ *
  * @param ic media file handle
  * @return >=0 if OK, AVERROR_xxx on error
  * @todo Let the user decide somehow what information is needed so that
@@ -879,6 +1438,20 @@ AVFormatContext *avformat_alloc_context(void);
  */
 int av_find_stream_info(AVFormatContext *ic);
 
+/**
+ * Refines the durations that av_find_stream_info() estimated from the bit
+ * rate when AVFMT_FLAG_LAZY_DURATION is set. The end of the file is scanned
+ * for timestamps on a separate thread, or by this function if threads are
+ * not available; ic->duration, ic->bit_rate and the stream durations are
+ * updated by the call that finds the scan finished.
+ * The scan reopens ic->filename, so it does not disturb av_read_frame().
+ *
+ * @param ic media file handle
+ * @param wait if nonzero, block until the scan has finished
+ * @return 1 if the durations are final, 0 if they are still estimated
+ */
+int av_update_duration(AVFormatContext *ic, int wait);
+
 /**
  * Reads a transport packet from a media file.
  *
@@ -912,6 +1485,113 @@ int av_read_packet(AVFormatContext *s, AVPacket *pkt);
  */
 int av_read_frame(AVFormatContext *s, AVPacket *pkt);
 
+/**
+ * Heap memory used for an AVFormatContext, by subsystem, in bytes.
+ * Allocations made by demuxers and muxers on their own are only counted
+ * as far as they end up in the listed structures.
+ */
+typedef struct AVFormatMemoryUsage {
+    int64_t index;      ///< index entries, compact indexes and seek point caches
+    int64_t packets;    ///< queued and buffered packets, see AVFormatContext.buffer_memory
+    int64_t priv_data;  ///< private context of the demuxer or muxer
+    int64_t metadata;   ///< metadata of the context, streams, programs and chapters
+    int64_t streams;    ///< stream and codec contexts with their extradata
+    int64_t io;         ///< buffer of the ByteIOContext
+    int64_t total;
+} AVFormatMemoryUsage;
+
+/**
+ * Fill usage with the memory currently used by s.
+ */
+void av_format_memory_usage(AVFormatContext *s, AVFormatMemoryUsage *usage);
+
+/**
+ * Reception statistics of a stream received over the network, as far as
+ * the transport provides them. Times are in microseconds.
+ */
+typedef struct AVStreamNetworkStats {
+    int64_t packets_received;
+    int64_t packets_expected;   ///< from the first and highest sequence numbers
+    int64_t packets_lost;       ///< expected minus received, negative with duplicates
+    int64_t packets_reordered;  ///< received out of sequence and put back in order
+    int64_t packets_late;       ///< dropped as duplicates or for arriving after their turn
+    int64_t jitter;             ///< interarrival jitter (RFC 3550, 6.4.1)
+    int clock_rate;             ///< clock rate of the RTP timestamps
+    /**
+     * Last sender report: NTP time of the sender as 32.32 fixed point, RTP
+     * timestamp of that instant and av_gettime() when the report arrived,
+     * mapping the RTP timestamps to wallclock time and the local clock.
+     * All 0 if no sender report has arrived yet.
+     */
+    uint64_t sr_ntp_time;
+    uint32_t sr_rtp_timestamp;
+    int64_t sr_local_time;
+} AVStreamNetworkStats;
+
+/**
+ * Fill stats with the reception statistics of a stream of s.
+ * @return 0 on success, AVERROR(ENOSYS) if the demuxer keeps none,
+ *         AVERROR(EINVAL) for an invalid stream index
+ */
+int av_get_network_stats(AVFormatContext *s, int stream_index,
+                         AVStreamNetworkStats *stats);
+
+/**
+ * Clock of a live source recovered with AVFMT_FLAG_CLOCK_RECOVERY, mapping
+ * its timestamps to the local clock with the network jitter filtered out.
+ */
+typedef struct AVClockEstimate {
+    /**
+     * Last timestamp of the source clock in AV_TIME_BASE units, in the same
+     * (possibly wrapping) range as the timestamps of the clock: the PCR of
+     * an MPEG-TS program or the RTP timestamp of a stream.
+     */
+    int64_t source_time;
+    int64_t local_time;  ///< filtered av_gettime() at which source_time arrived
+    /**
+     * How much faster the source clock runs than the local one, e.g. 1e-5
+     * if the source gains 10 microseconds per second.
+     */
+    double drift;
+    int updates;         ///< timestamps since the clock last (re)started
+} AVClockEstimate;
+
+/**
+ * Fill est with the recovered clock of a stream of s, that of the stream
+ * itself or else that of a program containing it.
+ * @return 0 on success, AVERROR(ENOENT) if no clock was recovered for it
+ */
+int av_get_clock_estimate(AVFormatContext *s, int stream_index, AVClockEstimate *est);
+
+/**
+ * Returns the next frames of a stream, like as many av_read_frame() calls,
+ * but letting demuxers that support it read runs of packets at once.
+ *
+ * @param pkts array of at least max_packets packets to fill
+ * @param max_bytes stop after the packets read so far have this many
+ *                  payload bytes, 0 for no limit
+ * @return number of packets read (each must be freed with av_free_packet),
+ *         or < 0 on error or end of file if no packet could be read
+ */
+int av_read_frames(AVFormatContext *s, AVPacket *pkts, int max_packets, int max_bytes);
+
+/**
+ * Returns the stride-th key frame of a stream after the one returned by
+ * the previous call, for thumbnails and fast forward. When the index
+ * already lists that key frame (MOV stss, Matroska cues, AVI idx1, or
+ * the entries AVFMT_FLAG_SCAN_INDEX and earlier reads added), the
+ * demuxer seeks straight to it instead of reading the frames in between.
+ * Otherwise, and for the first call after opening or seeking, the
+ * packets are read up to the key frame.
+ *
+ * Packets of other streams read on the way are dropped, set their
+ * discard to AVDISCARD_ALL so that demuxers do not read them at all.
+ *
+ * @param stride 1 for every key frame, N for every Nth
+ * @return 0 if OK, < 0 on error or end of file
+ */
+int av_read_keyframe(AVFormatContext *s, int stream_index, int stride, AVPacket *pkt);
+
 /**
  * Seeks to the keyframe at timestamp.
  * 'timestamp' in 'stream_index'.
@@ -1168,6 +1848,113 @@ void dump_format(AVFormatContext *ic,
                  const char *url,
                  int is_output);
 
+/**
+ * Start recording the lifecycle of the packets: I/O reads, read_packet(),
+ * the parsers, the packet buffers, the interleaving queue and
+ * write_packet(). Each thread records into its own ring, without locking.
+ * Restarting discards the events recorded so far.
+ *
+ * @param nb_events number of the latest events kept per thread
+ * @return 0 on success, AVERROR(EINVAL) if nb_events is invalid
+ */
+int av_trace_start(int nb_events);
+
+/**
+ * Stop recording trace events, they are kept for av_trace_export().
+ */
+void av_trace_stop(void);
+
+/**
+ * Write the recorded events as Chrome trace event JSON, viewable in
+ * chrome://tracing. Stages of a packet are async events with the same id,
+ * derived from its stream and dts, or position before the parsers.
+ * Should be called while no thread records events.
+ *
+ * @return 0 on success, <0 on I/O error
+ */
+int av_trace_export(ByteIOContext *pb);
+
+/**
+ * Configure the threads shared by the threaded features of all contexts
+ * (trak_threads, program_threads, image_threads, hash_threads and the
+ * analyze_threads decoding of av_find_stream_info()). Those options now
+ * bound how many threads of the pool one context uses at the same time.
+ * Tasks of live input (AVFMT_FLAG_LOW_DELAY, AVFMT_FLAG_CLOCK_RECOVERY or
+ * streamed input) are run before the others. The pool is started when a
+ * context first uses it; without a call it has one thread per CPU.
+ *
+ * @param nb_threads size of the pool, 0 for one thread per CPU of cpus,
+ *                   or per CPU online if cpus is NULL
+ * @param cpus       comma separated CPU numbers or ranges, e.g. "0-3,8",
+ *                   the threads started afterwards are bound to in turn,
+ *                   e.g. the CPUs of the NUMA node of the input, or NULL
+ * @return 0 on success, AVERROR(EINVAL) if a parameter is invalid,
+ *         AVERROR(ENOSYS) without thread support
+ */
+int av_thread_pool_init(int nb_threads, const char *cpus);
+
+/**
+ * Files opened and probed concurrently, see av_batch_open_files().
+ */
+typedef struct AVBatchOpen AVBatchOpen;
+
+/**
+ * Start opening files with av_open_input_file() followed by
+ * av_find_stream_info() on the thread pool, so that the latency of the
+ * probe reads and seeks of many files overlaps.
+ *
+ * @param urls         files to open, copied
+ * @param fmt          if non-NULL, force the format of all files
+ * @param ap           parameters for all files, copied, NULL if default;
+ *                     prealloced_context is ignored
+ * @param max_parallel maximum number of files being opened at the same
+ *                     time, bounding the I/O parallelism, 0 for the size
+ *                     of the pool. One thread of the pool is left to the
+ *                     threaded features of the files being opened.
+ * @return the batch, to be freed with av_batch_open_close(), or NULL if
+ *         out of memory
+ */
+AVBatchOpen *av_batch_open_files(const char * const *urls, int nb_urls,
+                                 AVInputFormat *fmt, AVFormatParameters *ap,
+                                 int max_parallel);
+
+/**
+ * Wait for the next file of a batch to be opened, in completion order.
+ * Without threads, opens the next file.
+ *
+ * @param index set to the index of the file in urls
+ * @param ic    set to the file, with its streams and metadata, owned by
+ *              the caller and closed with av_close_input_file(), or to
+ *              NULL on error
+ * @return >= 0 on success, the error of the file else, AVERROR_EOF once
+ *         all files have been returned
+ */
+int av_batch_open_next(AVBatchOpen *b, int *index, AVFormatContext **ic);
+
+/**
+ * Free a batch and set *b to NULL. The files not started are not opened,
+ * the files opened and not returned are closed.
+ */
+void av_batch_open_close(AVBatchOpen **b);
+
+/**
+ * Forget the formats and codec parameters remembered for the URLs opened
+ * with AVFMT_FLAG_PROBE_CACHE. A cached format failing to open its URL,
+ * or an av_find_stream_info() failing with cached parameters, forgets
+ * the cache of that URL by itself.
+ */
+void av_probe_cache_flush(void);
+
+/**
+ * Read the tags stored at the end of the input, such as ID3v1 and APE
+ * tags, if the demuxer did not read them when the input was opened.
+ * They are read at open for local files only; for network input, where
+ * reaching the end of the file costs a new request, they are read when
+ * this is called or when the demuxer reaches the end of the input.
+ * @return 0 or AVERROR
+ */
+int av_read_tail_tags(AVFormatContext *s);
+
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 /**
  * Parses width and height out of string str.
@@ -1265,9 +2052,32 @@ int av_filename_number_test(const char *filename);
  *             the caller)
  * @param size the size of the buffer
  * @return 0 if OK, AVERROR_xxx on error
+ *
+ * With AVFMT_FLAG_SDP_CACHE set in a context, its destination is resolved
+ * only once per filename, and the description of each of its streams is
+ * rebuilt only when the codec parameters or the extradata change.
  */
 int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size);
 
+/**
+ * Send the output of an RTP muxer writing to an rtp: URL to another
+ * receiver as well. The packets are built once and sent to all receivers
+ * over the same sockets, each receiver gets its own SSRC and sequence
+ * numbers. Receivers can be added and removed while another thread writes
+ * packets.
+ *
+ * @param s the RTP muxer context, after url_fopen()
+ * @param uri rtp://host:port of the receiver, RTCP is sent to port + 1
+ * @return an id for av_rtp_remove_destination(), or AVERROR_xxx on error
+ */
+int av_rtp_add_destination(AVFormatContext *s, const char *uri);
+
+/**
+ * Stop sending to a receiver added with av_rtp_add_destination().
+ * @return 0 if OK, AVERROR(EINVAL) if there is no such receiver
+ */
+int av_rtp_remove_destination(AVFormatContext *s, int id);
+
 #ifdef HAVE_AV_CONFIG_H
 
 void ff_dynarray_add(intptr_t **tab_ptr, int *nb_ptr, intptr_t elem);
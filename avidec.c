@@ -25,6 +25,7 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/bswap.h"
 #include "avformat.h"
+#include "internal.h"
 #include "avi.h"
 #include "dv.h"
 #include "riff.h"
@@ -32,6 +33,12 @@
 #undef NDEBUG
 #include <assert.h>
 
+/* number of idx1 entries read per get_le32_array() call */
+#define INDEX_CHUNK 256
+
+/* bytes read at once from non-interleaved files, per stream */
+#define AVI_NI_REGION_SIZE (1 << 20)
+
 typedef struct AVIStream {
     int64_t frame_offset; /* current frame (video) or byte (audio) counter
                          (used to compute the pts) */
@@ -48,6 +55,16 @@ typedef struct AVIStream {
     int prefix_count;
     uint32_t pal[256];
     int has_pal;
+
+    uint8_t *ni_buf;                  ///< region of a non-interleaved file, see avi_ni_get_packet()
+    unsigned int ni_buf_size;
+    int64_t ni_buf_pos;
+    int ni_buf_len;
+
+    int64_t *odml_index;              ///< positions of the OpenDML standard indexes not loaded yet
+    unsigned int odml_index_size;
+    int odml_nb_index;
+    int odml_next;                    ///< next entry of odml_index to load
 } AVIStream;
 
 typedef struct {
@@ -61,6 +78,10 @@ typedef struct {
     int non_interleaved;
     int stream_index;
     DVDemuxContext* dv_demux;
+    int64_t ni_pos;     ///< next read of a non-interleaved file, -1 to read at the current position
+    int64_t ni_resume;  ///< end of the last read of a non-interleaved file, -1 if at the current position
+    int odml_lazy;      ///< leave the standard indexes of a super index for avi_load_odml_index()
+    int odml_loading;   ///< set while avi_load_odml_index() reads a standard index
 } AVIContext;
 
 static const char avi_headers[][8] = {
@@ -168,7 +189,7 @@ static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
             if(url_feof(pb))
                 return -1;
 
-            if(last_pos == pos || pos == base - 8)
+            if((last_pos == pos || pos == base - 8) && !avi->odml_loading)
                 avi->non_interleaved= 1;
             if(last_pos != pos && (len || !ast->sample_size))
                 av_add_index_entry(st, pos, ast->cum_len, len, 0, key ? AVINDEX_KEYFRAME : 0);
@@ -188,6 +209,16 @@ static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
             if(url_feof(pb))
                 return -1;
 
+            if(avi->odml_lazy){
+                int64_t *odml_index = av_fast_realloc(ast->odml_index, &ast->odml_index_size,
+                                                      (ast->odml_nb_index + 1) * sizeof(*odml_index));
+                if(!odml_index)
+                    return AVERROR(ENOMEM);
+                ast->odml_index = odml_index;
+                ast->odml_index[ast->odml_nb_index++] = offset;
+                continue;
+            }
+
             pos = url_ftell(pb);
 
             url_fseek(pb, offset+8, SEEK_SET);
@@ -201,6 +232,33 @@ static int read_braindead_odml_indx(AVFormatContext *s, int frame_num){
     return 0;
 }
 
+/**
+ * Read the standard indexes of st left by read_braindead_odml_indx(), in
+ * file order, until the index of st goes past timestamp.
+ * The super index durations are not reliable, so the indexes are always
+ * loaded one after another, the timestamps depend on all the previous ones.
+ */
+static void avi_load_odml_index(AVFormatContext *s, AVStream *st, int64_t timestamp)
+{
+    AVIContext *avi = s->priv_data;
+    AVIStream *ast = st->priv_data;
+    int64_t pos;
+
+    if(!ast || ast->odml_next >= ast->odml_nb_index)
+        return;
+
+    pos = url_ftell(s->pb);
+    avi->odml_loading = 1;
+    while(ast->odml_next < ast->odml_nb_index &&
+          (!st->nb_index_entries ||
+           st->index_entries[st->nb_index_entries - 1].timestamp <= timestamp)){
+        url_fseek(s->pb, ast->odml_index[ast->odml_next++] + 8, SEEK_SET);
+        read_braindead_odml_indx(s, 0);
+    }
+    avi->odml_loading = 0;
+    url_fseek(s->pb, pos, SEEK_SET);
+}
+
 static void clean_index(AVFormatContext *s){
     int i;
     int64_t j;
@@ -571,7 +629,10 @@ static int avi_read_header(AVFormatContext *s, AVFormatParameters *ap)
         case MKTAG('i', 'n', 'd', 'x'):
             i= url_ftell(pb);
             if(!url_is_streamed(pb) && !(s->flags & AVFMT_FLAG_IGNIDX)){
+                /* a stored index cache must hold the whole index */
+                avi->odml_lazy = !(s->flags & AVFMT_FLAG_INDEX_CACHE);
                 read_braindead_odml_indx(s, 0);
+                avi->odml_lazy = 0;
             }
             url_fseek(pb, i+size, SEEK_SET);
             break;
@@ -642,10 +703,14 @@ static int avi_read_header(AVFormatContext *s, AVFormatParameters *ap)
         return -1;
     }
 
-    if(!avi->index_loaded && !url_is_streamed(pb))
+    if(!avi->index_loaded && !url_is_streamed(pb) && !ff_index_cache_restore(s, NULL))
         avi_load_index(s);
     avi->index_loaded = 1;
+    for(i=0; i<s->nb_streams; i++)
+        avi_load_odml_index(s, s->streams[i], 0);
     avi->non_interleaved |= guess_ni_flag(s);
+    avi->ni_pos    =
+    avi->ni_resume = -1;
     if(avi->non_interleaved) {
         av_log(s, AV_LOG_INFO, "non-interleaved AVI\n");
         clean_index(s);
@@ -663,6 +728,55 @@ static int get_stream_idx(int *d){
     }
 }
 
+/**
+ * Read size bytes at avi->ni_pos of a non-interleaved file into pkt.
+ * The file is read in regions of up to AVI_NI_REGION_SIZE bytes, one kept
+ * per stream, so that the following chunks of all streams within them
+ * are read without seeking.
+ */
+static int avi_ni_get_packet(AVFormatContext *s, AVPacket *pkt, int size)
+{
+    AVIContext *avi = s->priv_data;
+    AVIStream *ast = s->streams[avi->stream_index]->priv_data;
+    int64_t pos = avi->ni_pos;
+    uint8_t *buf = NULL;
+    int i, len, ret;
+
+    avi->ni_pos = -1;
+    for (i = 0; i < s->nb_streams && !buf; i++) {
+        AVIStream *ast2 = s->streams[i]->priv_data;
+        if (ast2 && pos >= ast2->ni_buf_pos && pos + size <= ast2->ni_buf_pos + ast2->ni_buf_len)
+            buf = ast2->ni_buf + pos - ast2->ni_buf_pos;
+    }
+    if (!buf) {
+        len = FFMAX(size, AVI_NI_REGION_SIZE);
+        if (avi->fsize > pos && avi->fsize - pos < len)
+            len = FFMAX(avi->fsize - pos, size);
+        ast->ni_buf_len = 0;
+        buf = av_fast_realloc(ast->ni_buf, &ast->ni_buf_size, len);
+        if (!buf) {
+            ast->ni_buf_size = 0;
+            return AVERROR(ENOMEM);
+        }
+        ast->ni_buf = buf;
+        if (url_fseek(s->pb, pos, SEEK_SET) < 0)
+            return AVERROR(EIO);
+        len = get_buffer(s->pb, buf, len);
+        if (len <= 0)
+            return AVERROR(EIO);
+        ast->ni_buf_pos = pos;
+        ast->ni_buf_len = len;
+        size = FFMIN(size, len);
+    }
+
+    if ((ret = ff_new_packet(s, pkt, size)) < 0)
+        return ret;
+    memcpy(pkt->data, buf, size);
+    pkt->pos = pos;
+    avi->ni_resume = pos + size;
+    return size;
+}
+
 static int avi_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     AVIContext *avi = s->priv_data;
@@ -678,6 +792,12 @@ static int avi_read_packet(AVFormatContext *s, AVPacket *pkt)
             return size;
     }
 
+    for(n=0; n<s->nb_streams; n++){
+        AVIStream *ast = s->streams[n]->priv_data;
+        if(ast)
+            avi_load_odml_index(s, s->streams[n], ast->frame_offset);
+    }
+
     if(avi->non_interleaved){
         int best_stream_index = 0;
         AVStream *best_st= NULL;
@@ -691,7 +811,8 @@ static int avi_read_packet(AVFormatContext *s, AVPacket *pkt)
             int64_t ts= ast->frame_offset;
             int64_t last_ts;
 
-            if(!st->nb_index_entries)
+            /* discarded streams are not read at all */
+            if(!st->nb_index_entries || st->discard >= AVDISCARD_ALL)
                 continue;
 
             last_ts = st->index_entries[st->nb_index_entries - 1].timestamp;
@@ -724,7 +845,7 @@ static int avi_read_packet(AVFormatContext *s, AVPacket *pkt)
         if(i>=0){
             int64_t pos= best_st->index_entries[i].pos;
             pos += best_ast->packet_size - best_ast->remaining;
-            url_fseek(s->pb, pos + 8, SEEK_SET);
+            avi->ni_pos = pos + 8;
 //        av_log(s, AV_LOG_DEBUG, "pos=%"PRId64"\n", pos);
 
             assert(best_ast->remaining <= best_ast->packet_size);
@@ -733,6 +854,9 @@ static int avi_read_packet(AVFormatContext *s, AVPacket *pkt)
             if(!best_ast->remaining)
                 best_ast->packet_size=
                 best_ast->remaining= best_st->index_entries[i].size;
+        }else if(avi->ni_resume >= 0){
+            url_fseek(s->pb, avi->ni_resume, SEEK_SET);
+            avi->ni_resume = -1;
         }
     }
 
@@ -751,8 +875,15 @@ resync:
 
         if(size > ast->remaining)
             size= ast->remaining;
-        avi->last_pkt_pos= url_ftell(pb);
-        err= av_get_packet(pb, pkt, size);
+        if(avi->ni_pos >= 0){
+            avi->last_pkt_pos= avi->ni_pos;
+            err= avi_ni_get_packet(s, pkt, size);
+        }else{
+            avi->last_pkt_pos= url_ftell(pb);
+            /* the palette is appended with av_realloc() */
+            err= ast->has_pal ? av_get_packet(pb, pkt, size) :
+                                ff_get_packet(s, pb, pkt, size);
+        }
         if(err<0)
             return err;
 
@@ -882,7 +1013,7 @@ resync:
             if(   (st->discard >= AVDISCARD_DEFAULT && size==0)
                /*|| (st->discard >= AVDISCARD_NONKEY && !(pkt->flags & PKT_FLAG_KEY))*/ //FIXME needs a little reordering
                || st->discard >= AVDISCARD_ALL){
-                if(ast->sample_size) ast->frame_offset += pkt->size;
+                if(ast->sample_size) ast->frame_offset += size;
                 else                 ast->frame_offset++;
                 url_fskip(pb, size);
                 goto resync;
@@ -940,17 +1071,31 @@ static int avi_read_idx1(AVFormatContext *s, int size)
     AVIStream *ast;
     unsigned int index, tag, flags, pos, len;
     unsigned last_pos= -1;
+    uint32_t entries[4 * INDEX_CHUNK], *e, *end = entries;
 
     nb_index_entries = size / 16;
     if (nb_index_entries <= 0)
         return -1;
 
+    /* streams without a sample size have one chunk per frame */
+    for (i = 0; i < s->nb_streams; i++) {
+        st  = s->streams[i];
+        ast = st->priv_data;
+        if (!ast->sample_size && st->duration > 0)
+            ff_reserve_index_entries(st, FFMIN(st->duration, nb_index_entries));
+    }
+
     /* Read the entries and sort them in each stream component. */
     for(i = 0; i < nb_index_entries; i++) {
-        tag = get_le32(pb);
-        flags = get_le32(pb);
-        pos = get_le32(pb);
-        len = get_le32(pb);
+        e = entries + 4 * (i % INDEX_CHUNK);
+        if (e == entries)
+            end = entries + get_le32_array(pb, entries, 4 * FFMIN(nb_index_entries - i, INDEX_CHUNK));
+        if (e + 4 > end)
+            return -1;
+        tag   = e[0];
+        flags = e[1];
+        pos   = e[2];
+        len   = e[3];
 #if defined(DEBUG_SEEK)
         av_log(s, AV_LOG_DEBUG, "%d: tag=0x%x flags=0x%x pos=0x%x len=%d/",
                i, tag, flags, pos, len);
@@ -1079,6 +1224,7 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
 
     st = s->streams[stream_index];
     ast= st->priv_data;
+    avi_load_odml_index(s, st, timestamp * FFMAX(ast->sample_size, 1));
     index= av_index_search_timestamp(st, timestamp * FFMAX(ast->sample_size, 1), flags);
     if(index<0)
         return -1;
@@ -1111,6 +1257,8 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
         ast2->packet_size=
         ast2->remaining= 0;
 
+        avi_load_odml_index(s, st2,
+                            av_rescale_q(timestamp, st->time_base, st2->time_base) * FFMAX(ast2->sample_size, 1));
         if (st2->nb_index_entries <= 0)
             continue;
 
@@ -1138,6 +1286,8 @@ static int avi_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
     /* do the seek */
     url_fseek(s->pb, pos, SEEK_SET);
     avi->stream_index= -1;
+    avi->ni_pos    =
+    avi->ni_resume = -1;
     return 0;
 }
 
@@ -1148,7 +1298,12 @@ static int avi_read_close(AVFormatContext *s)
 
     for(i=0;i<s->nb_streams;i++) {
         AVStream *st = s->streams[i];
+        AVIStream *ast = st->priv_data;
         av_free(st->codec->palctrl);
+        if (ast) {
+            av_free(ast->ni_buf);
+            av_free(ast->odml_index);
+        }
     }
 
     if (avi->dv_demux)
@@ -33,11 +33,15 @@ typedef struct AVIIentry {
 
 #define AVI_INDEX_CLUSTER_SIZE 16384
 
+/* entries after which an OpenDML standard index is written in AVIX segments */
+#define AVI_IX_FLUSH_ENTRIES (4 * AVI_INDEX_CLUSTER_SIZE)
+
 typedef struct AVIIndex {
     int64_t     indx_start;
     int         entry;
     int         ents_allocated;
     AVIIentry** cluster;
+    int         master_entries; ///< entries of the OpenDML master index in use
 } AVIIndex;
 
 typedef struct {
@@ -57,6 +61,20 @@ static inline AVIIentry* avi_get_ientry(AVIIndex* idx, int ent_id)
     return &idx->cluster[cl][id];
 }
 
+/**
+ * Free the index clusters past the first nb_clusters ones.
+ */
+static void avi_trim_index(AVIIndex *idx, int nb_clusters)
+{
+    int j;
+
+    for (j = nb_clusters; j < idx->ents_allocated / AVI_INDEX_CLUSTER_SIZE; j++)
+        av_freep(&idx->cluster[j]);
+    idx->ents_allocated = FFMIN(idx->ents_allocated, nb_clusters * AVI_INDEX_CLUSTER_SIZE);
+    if (!nb_clusters)
+        av_freep(&idx->cluster);
+}
+
 static int64_t avi_start_new_riff(AVIContext *avi, ByteIOContext *pb,
                                   const char* riff_tag, const char* list_tag)
 {
@@ -378,63 +396,82 @@ static int avi_write_header(AVFormatContext *s)
     return 0;
 }
 
-static int avi_write_ix(AVFormatContext *s)
+/**
+ * Write the entries of the index of stream i not written yet as an OpenDML
+ * standard index at the current position, and add it to the master index.
+ */
+static int avi_write_ix_stream(AVFormatContext *s, int i)
 {
     ByteIOContext *pb = s->pb;
     AVIContext *avi = s->priv_data;
+    AVIIndex *idx = &avi->indexes[i];
     char tag[5];
     char ix_tag[] = "ix00";
-    int i, j;
-
-    assert(!url_is_streamed(pb));
+    int64_t ix, pos;
+    int j;
 
-    if (avi->riff_id > AVI_MASTER_INDEX_SIZE)
+    if (idx->master_entries >= AVI_MASTER_INDEX_SIZE)
         return -1;
 
-    for (i=0;i<s->nb_streams;i++) {
-         int64_t ix, pos;
-
-         avi_stream2fourcc(&tag[0], i, s->streams[i]->codec->codec_type);
-         ix_tag[3] = '0' + i;
-
-         /* Writing AVI OpenDML leaf index chunk */
-         ix = url_ftell(pb);
-         put_tag(pb, &ix_tag[0]);     /* ix?? */
-         put_le32(pb, avi->indexes[i].entry * 8 + 24);
-                                      /* chunk size */
-         put_le16(pb, 2);             /* wLongsPerEntry */
-         put_byte(pb, 0);             /* bIndexSubType (0 == frame index) */
-         put_byte(pb, 1);             /* bIndexType (1 == AVI_INDEX_OF_CHUNKS) */
-         put_le32(pb, avi->indexes[i].entry);
-                                      /* nEntriesInUse */
-         put_tag(pb, &tag[0]);        /* dwChunkId */
-         put_le64(pb, avi->movi_list);/* qwBaseOffset */
-         put_le32(pb, 0);             /* dwReserved_3 (must be 0) */
-
-         for (j=0; j<avi->indexes[i].entry; j++) {
-             AVIIentry* ie = avi_get_ientry(&avi->indexes[i], j);
-             put_le32(pb, ie->pos + 8);
-             put_le32(pb, ((uint32_t)ie->len & ~0x80000000) |
-                          (ie->flags & 0x10 ? 0 : 0x80000000));
-         }
-         put_flush_packet(pb);
-         pos = url_ftell(pb);
-
-         /* Updating one entry in the AVI OpenDML master index */
-         url_fseek(pb, avi->indexes[i].indx_start - 8, SEEK_SET);
-         put_tag(pb, "indx");                 /* enabling this entry */
-         url_fskip(pb, 8);
-         put_le32(pb, avi->riff_id);          /* nEntriesInUse */
-         url_fskip(pb, 16*avi->riff_id);
-         put_le64(pb, ix);                    /* qwOffset */
-         put_le32(pb, pos - ix);              /* dwSize */
-         put_le32(pb, avi->indexes[i].entry); /* dwDuration */
-
-         url_fseek(pb, pos, SEEK_SET);
+    avi_stream2fourcc(&tag[0], i, s->streams[i]->codec->codec_type);
+    ix_tag[3] = '0' + i;
+
+    /* Writing AVI OpenDML leaf index chunk */
+    ix = url_ftell(pb);
+    put_tag(pb, &ix_tag[0]);     /* ix?? */
+    put_le32(pb, idx->entry * 8 + 24);
+                                 /* chunk size */
+    put_le16(pb, 2);             /* wLongsPerEntry */
+    put_byte(pb, 0);             /* bIndexSubType (0 == frame index) */
+    put_byte(pb, 1);             /* bIndexType (1 == AVI_INDEX_OF_CHUNKS) */
+    put_le32(pb, idx->entry);    /* nEntriesInUse */
+    put_tag(pb, &tag[0]);        /* dwChunkId */
+    put_le64(pb, avi->movi_list);/* qwBaseOffset */
+    put_le32(pb, 0);             /* dwReserved_3 (must be 0) */
+
+    for (j=0; j<idx->entry; j++) {
+        AVIIentry* ie = avi_get_ientry(idx, j);
+        put_le32(pb, ie->pos + 8);
+        put_le32(pb, ((uint32_t)ie->len & ~0x80000000) |
+                     (ie->flags & 0x10 ? 0 : 0x80000000));
     }
+    put_flush_packet(pb);
+    pos = url_ftell(pb);
+
+    /* Updating one entry in the AVI OpenDML master index */
+    idx->master_entries++;
+    url_fseek(pb, idx->indx_start - 8, SEEK_SET);
+    put_tag(pb, "indx");             /* enabling this entry */
+    url_fskip(pb, 8);
+    put_le32(pb, idx->master_entries);/* nEntriesInUse */
+    url_fskip(pb, 16*idx->master_entries);
+    put_le64(pb, ix);                /* qwOffset */
+    put_le32(pb, pos - ix);          /* dwSize */
+    put_le32(pb, idx->entry);        /* dwDuration */
+
+    url_fseek(pb, pos, SEEK_SET);
     return 0;
 }
 
+static int avi_write_ix(AVFormatContext *s)
+{
+    AVIContext *avi = s->priv_data;
+    int i, ret = 0;
+
+    assert(!url_is_streamed(s->pb));
+
+    for (i=0;i<s->nb_streams;i++) {
+        AVIIndex *idx = &avi->indexes[i];
+
+        /* the entries may all be in a standard index written already */
+        if (!idx->entry && idx->master_entries)
+            continue;
+        if (avi_write_ix_stream(s, i) < 0)
+            ret = -1;
+    }
+    return ret;
+}
+
 static int avi_write_idx1(AVFormatContext *s)
 {
     ByteIOContext *pb = s->pb;
@@ -510,8 +547,15 @@ static int avi_write_packet(AVFormatContext *s, AVPacket *pkt)
         avi_write_ix(s);
         ff_end_tag(pb, avi->movi_list);
 
-        if (avi->riff_id == 1)
+        if (avi->riff_id == 1) {
+            int i;
+
             avi_write_idx1(s);
+            /* the following segments only keep the entries until their
+             * standard index is written, see below */
+            for (i = 0; i < s->nb_streams; i++)
+                avi_trim_index(&avi->indexes[i], AVI_IX_FLUSH_ENTRIES / AVI_INDEX_CLUSTER_SIZE);
+        }
 
         ff_end_tag(pb, avi->riff_start);
         avi->movi_list = avi_start_new_riff(avi, pb, "AVIX", "movi");
@@ -526,8 +570,22 @@ static int avi_write_packet(AVFormatContext *s, AVPacket *pkt)
 
     if (!url_is_streamed(s->pb)) {
         AVIIndex* idx = &avi->indexes[stream_index];
-        int cl = idx->entry / AVI_INDEX_CLUSTER_SIZE;
-        int id = idx->entry % AVI_INDEX_CLUSTER_SIZE;
+        int cl, id;
+
+        /* Past the first segment, which needs all its entries for idx1,
+         * standard indexes are written within the movi list whenever enough
+         * entries are gathered, so that the index does not grow with the
+         * length of the segment and is not all written at the end. */
+        if (avi->riff_id > 1 && idx->entry >= AVI_IX_FLUSH_ENTRIES) {
+            if (!avi_write_ix_stream(s, stream_index) &&
+                idx->master_entries == AVI_MASTER_INDEX_SIZE)
+                av_log(s, AV_LOG_WARNING, "OpenDML master index of stream %d full, "
+                       "the index will be incomplete\n", stream_index);
+            idx->entry = 0;
+        }
+
+        cl = idx->entry / AVI_INDEX_CLUSTER_SIZE;
+        id = idx->entry % AVI_INDEX_CLUSTER_SIZE;
         if (idx->ents_allocated <= idx->entry) {
             idx->cluster = av_realloc(idx->cluster, (cl+1)*sizeof(void*));
             if (!idx->cluster)
@@ -559,7 +617,7 @@ static int avi_write_trailer(AVFormatContext *s)
     AVIContext *avi = s->priv_data;
     ByteIOContext *pb = s->pb;
     int res = 0;
-    int i, j, n, nb_frames;
+    int i, n, nb_frames;
     int64_t file_size;
 
     if (!url_is_streamed(pb)){
@@ -597,10 +655,8 @@ static int avi_write_trailer(AVFormatContext *s)
     put_flush_packet(pb);
 
     for (i=0; i<MAX_STREAMS; i++) {
-         for (j=0; j<avi->indexes[i].ents_allocated/AVI_INDEX_CLUSTER_SIZE; j++)
-              av_free(avi->indexes[i].cluster[j]);
-         av_freep(&avi->indexes[i].cluster);
-         avi->indexes[i].ents_allocated = avi->indexes[i].entry = 0;
+         avi_trim_index(&avi->indexes[i], 0);
+         avi->indexes[i].entry = 0;
     }
 
     return res;
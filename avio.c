@@ -23,6 +23,10 @@
 #include "libavcodec/opt.h"
 #include "os_support.h"
 #include "avformat.h"
+#include "internal.h"
+#include "registry.h"
+#include <unistd.h>
+#include <fcntl.h>
 
 #if LIBAVFORMAT_VERSION_MAJOR >= 53
 /** @name Logging context. */
@@ -42,6 +46,10 @@ static const AVClass urlcontext_class =
 static int default_interrupt_cb(void);
 
 URLProtocol *first_protocol = NULL;
+/* names of the registered protocols, first_protocol is searched instead
+ * if one could not be added */
+static FFRegistry protocol_names;
+static int protocol_registry_failed;
 URLInterruptCB *url_interrupt_cb = default_interrupt_cb;
 
 URLProtocol *av_protocol_next(URLProtocol *p)
@@ -57,6 +65,9 @@ int av_register_protocol(URLProtocol *protocol)
     while (*p != NULL) p = &(*p)->next;
     *p = protocol;
     protocol->next = NULL;
+    if (ff_registry_add(&protocol_names, protocol->name, strlen(protocol->name),
+                        protocol, 0) < 0)
+        protocol_registry_failed = 1;
     return 0;
 }
 
@@ -67,8 +78,9 @@ int register_protocol(URLProtocol *protocol)
 }
 #endif
 
-int url_open_protocol (URLContext **puc, struct URLProtocol *up,
-                       const char *filename, int flags)
+static int open_protocol(URLContext **puc, struct URLProtocol *up,
+                         const char *filename, int flags,
+                         const URLInterrupt *intr)
 {
     URLContext *uc;
     int err;
@@ -87,6 +99,8 @@ int url_open_protocol (URLContext **puc, struct URLProtocol *up,
     uc->flags = flags;
     uc->is_streamed = 0; /* default = not streamed */
     uc->max_packet_size = 0; /* default: stream file */
+    memset(&uc->stats, 0, sizeof(uc->stats));
+    uc->interrupt = intr;
     err = up->url_open(uc, filename, flags);
     if (err < 0) {
         av_free(uc);
@@ -106,7 +120,14 @@ int url_open_protocol (URLContext **puc, struct URLProtocol *up,
     return err;
 }
 
-int url_open(URLContext **puc, const char *filename, int flags)
+int url_open_protocol (URLContext **puc, struct URLProtocol *up,
+                       const char *filename, int flags)
+{
+    return open_protocol(puc, up, filename, flags, NULL);
+}
+
+int url_open_interrupt(URLContext **puc, const char *filename, int flags,
+                       const URLInterrupt *intr)
 {
     URLProtocol *up;
     const char *p;
@@ -130,22 +151,43 @@ int url_open(URLContext **puc, const char *filename, int flags)
         *q = '\0';
     }
 
+    if (!protocol_registry_failed) {
+        FFRegistryEntry *e = ff_registry_find(&protocol_names, proto_str, 1, NULL);
+        if (e)
+            return open_protocol(puc, e->item, filename, flags, intr);
+        *puc = NULL;
+        return AVERROR(ENOENT);
+    }
     up = first_protocol;
     while (up != NULL) {
         if (!strcmp(proto_str, up->name))
-            return url_open_protocol (puc, up, filename, flags);
+            return open_protocol(puc, up, filename, flags, intr);
         up = up->next;
     }
     *puc = NULL;
     return AVERROR(ENOENT);
 }
 
+int url_open(URLContext **puc, const char *filename, int flags)
+{
+    return url_open_interrupt(puc, filename, flags, NULL);
+}
+
 int url_read(URLContext *h, unsigned char *buf, int size)
 {
     int ret;
+    int64_t t;
     if (h->flags & URL_WRONLY)
         return AVERROR(EIO);
+    t = av_gettime();
     ret = h->prot->url_read(h, buf, size);
+    h->stats.read_time += av_gettime() - t;
+    h->stats.read_calls++;
+    if (ret > 0) {
+        h->stats.bytes_read += ret;
+        if (ret < size)
+            h->stats.short_reads++;
+    }
     return ret;
 }
 
@@ -168,12 +210,18 @@ int url_read_complete(URLContext *h, unsigned char *buf, int size)
 int url_write(URLContext *h, unsigned char *buf, int size)
 {
     int ret;
+    int64_t t;
     if (!(h->flags & (URL_WRONLY | URL_RDWR)))
         return AVERROR(EIO);
     /* avoid sending too big packets */
     if (h->max_packet_size && size > h->max_packet_size)
         return AVERROR(EIO);
+    t = av_gettime();
     ret = h->prot->url_write(h, buf, size);
+    h->stats.write_time += av_gettime() - t;
+    h->stats.write_calls++;
+    if (ret > 0)
+        h->stats.bytes_written += ret;
     return ret;
 }
 
@@ -184,6 +232,8 @@ int64_t url_seek(URLContext *h, int64_t pos, int whence)
     if (!h->prot->url_seek)
         return AVERROR(EPIPE);
     ret = h->prot->url_seek(h, pos, whence);
+    if (whence != AVSEEK_SIZE)
+        h->stats.seeks++;
     return ret;
 }
 
@@ -252,6 +302,49 @@ void url_set_interrupt_cb(URLInterruptCB *interrupt_cb)
     url_interrupt_cb = interrupt_cb;
 }
 
+int ff_check_interrupt(const URLInterrupt *intr)
+{
+    if (url_interrupt_cb())
+        return AVERROR(EINTR);
+    if (intr) {
+        if (intr->callback && intr->callback(intr->opaque))
+            return AVERROR(EINTR);
+        if (intr->deadline && av_gettime() >= intr->deadline)
+            return AVERROR(ETIMEDOUT);
+    }
+    return 0;
+}
+
+static int wakeup_pipe[2] = { -1, -1 };
+
+int url_enable_interrupt_wakeup(void)
+{
+#if CONFIG_NETWORK && !HAVE_WINSOCK2_H
+    if (wakeup_pipe[0] >= 0)
+        return 0;
+    if (pipe(wakeup_pipe) < 0)
+        return AVERROR(errno);
+    fcntl(wakeup_pipe[0], F_SETFL, fcntl(wakeup_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wakeup_pipe[1], F_SETFL, fcntl(wakeup_pipe[1], F_GETFL) | O_NONBLOCK);
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+void url_interrupt_wakeup(void)
+{
+    if (wakeup_pipe[1] >= 0) {
+        int ret = write(wakeup_pipe[1], "", 1);
+        (void)ret; /* a full pipe is already readable */
+    }
+}
+
+int ff_interrupt_wakeup_fd(void)
+{
+    return wakeup_pipe[0];
+}
+
 int av_url_read_pause(URLContext *h, int pause)
 {
     if (!h->prot->url_read_pause)
@@ -41,6 +41,43 @@
  * version bump.
  * sizeof(URLContext) must not be used outside libav*.
  */
+/**
+ * I/O statistics of a URLContext or ByteIOContext, for finding out why
+ * opening or reading a file is slow. Times are in microseconds.
+ */
+typedef struct AVIOStats {
+    int64_t bytes_read;
+    int64_t bytes_written;
+    int64_t read_calls;     ///< calls of the underlying read function
+    int64_t write_calls;    ///< calls of the underlying write function
+    int64_t short_reads;    ///< reads returning less data than requested, but not EOF
+    int64_t read_time;      ///< time spent blocked in reads
+    int64_t write_time;     ///< time spent blocked in writes
+    int64_t seeks;          ///< seeks passed to the underlying protocol
+    int64_t buffered_seeks; ///< seeks served from the buffer, ByteIOContext only
+    int64_t refills;        ///< buffer refills, ByteIOContext only
+    int64_t dropped;        ///< datagrams lost before they were read, e.g. socket buffer overruns
+} AVIOStats;
+
+/**
+ * Interrupt settings for blocking I/O, per URLContext or AVFormatContext.
+ * Contexts keep a pointer to this structure, so the owner may change the
+ * fields, e.g. move the deadline forward, while the I/O is running.
+ */
+typedef struct URLInterrupt {
+    /**
+     * Called regularly in blocking network functions, which return
+     * AVERROR(EINTR) when it returns nonzero. May be NULL.
+     */
+    int (*callback)(void *opaque);
+    void *opaque;
+    /**
+     * Absolute time in av_gettime() units after which blocking network
+     * functions fail with AVERROR(ETIMEDOUT), 0 for no deadline.
+     */
+    int64_t deadline;
+} URLInterrupt;
+
 typedef struct URLContext {
 #if LIBAVFORMAT_VERSION_MAJOR >= 53
     const AVClass *av_class; ///< information for av_log(). Set by url_open().
@@ -51,6 +88,13 @@ typedef struct URLContext {
     int max_packet_size;  /**< if non zero, the stream is packetized with this max packet size */
     void *priv_data;
     char *filename; /**< specified filename */
+    AVIOStats stats;
+    /**
+     * interrupt settings, checked in addition to the global url_interrupt_cb,
+     * NULL if none. Contexts opened by a protocol for its own use share the
+     * settings of the outer context.
+     */
+    const URLInterrupt *interrupt;
 } URLContext;
 
 typedef struct URLPollEntry {
@@ -68,6 +112,12 @@ typedef int URLInterruptCB(void);
 int url_open_protocol (URLContext **puc, struct URLProtocol *up,
                        const char *filename, int flags);
 int url_open(URLContext **h, const char *filename, int flags);
+/**
+ * Like url_open(), but blocking operations of the new context, including
+ * the open itself, also test intr. intr must stay valid until url_close().
+ */
+int url_open_interrupt(URLContext **h, const char *filename, int flags,
+                       const URLInterrupt *intr);
 int url_read(URLContext *h, unsigned char *buf, int size);
 /**
  * Read as many bytes as possible (up to size), calling the
@@ -112,6 +162,22 @@ void url_get_filename(URLContext *h, char *buf, int buf_size);
  */
 void url_set_interrupt_cb(URLInterruptCB *interrupt_cb);
 
+/**
+ * Let blocking network functions sleep until data arrives instead of
+ * waking up every 100 ms to test the interrupt callback. The application
+ * must then call url_interrupt_wakeup() after its callback starts to
+ * return nonzero.
+ *
+ * @return 0 on success, a negative AVERROR code if not supported
+ */
+int url_enable_interrupt_wakeup(void);
+
+/**
+ * Wake up all threads blocked in network I/O so that they test the
+ * interrupt callback again.
+ */
+void url_interrupt_wakeup(void);
+
 /* not implemented */
 int url_poll(URLPollEntry *poll_table, int n, int timeout);
 
@@ -161,6 +227,14 @@ typedef struct URLProtocol {
     int64_t (*url_read_seek)(URLContext *h, int stream_index,
                              int64_t timestamp, int flags);
     int (*url_get_file_handle)(URLContext *h);
+    /**
+     * Return a read-only memory mapping of the whole resource, valid until
+     * url_close(). Optional; buffered I/O will then read from the mapping.
+     * Called again, it maps what was appended since; the previous mapping
+     * is then invalid unless the same one is returned.
+     * @return size of the mapping, or <0 if the resource is not mapped
+     */
+    int64_t (*url_get_map)(URLContext *h, const uint8_t **buf);
 } URLProtocol;
 
 #if LIBAVFORMAT_VERSION_MAJOR < 53
@@ -213,6 +287,11 @@ typedef struct {
     int (*read_pause)(void *opaque, int pause);
     int64_t (*read_seek)(void *opaque, int stream_index,
                          int64_t timestamp, int flags);
+    const uint8_t *map; ///< read-only mapping of the resource, buffer is a window over it if set
+    int64_t map_size;   ///< size of map in bytes
+    struct ReadAheadContext *readahead; ///< background reader, see url_fset_readahead()
+    AVIOStats stats;
+    struct WriteBehindContext *writebehind; ///< background writer, see url_fset_writebehind()
 } ByteIOContext;
 
 int init_put_byte(ByteIOContext *s,
@@ -314,6 +393,17 @@ int get_buffer(ByteIOContext *s, unsigned char *buf, int size);
  */
 int get_partial_buffer(ByteIOContext *s, unsigned char *buf, int size);
 
+/**
+ * Makes up to size bytes available in the ByteIOContext buffer and
+ * returns a pointer to them without copying or consuming them.
+ * The data stays valid until the next read or seek on s; use
+ * url_fskip() to consume it. At most buffer_size bytes can be peeked
+ * at once, packetized protocols may return less than requested.
+ * @param buf set to the start of the unread data
+ * @returns number of bytes available at *buf or AVERROR
+ */
+int url_fpeek(ByteIOContext *s, const unsigned char **buf, int size);
+
 /** @note return 0 if EOF, so you cannot use it if EOF handling is
     necessary */
 int get_byte(ByteIOContext *s);
@@ -328,6 +418,16 @@ unsigned int get_be24(ByteIOContext *s);
 unsigned int get_be32(ByteIOContext *s);
 uint64_t get_be64(ByteIOContext *s);
 
+/**
+ * Reads count 32 or 64-bit values into dst. Same as calling get_le32(),
+ * get_be32() or get_be64() count times, but converts the values in one
+ * pass over the buffer.
+ * @return number of values read, less than count only on EOF
+ */
+int get_le32_array(ByteIOContext *s, uint32_t *dst, int count);
+int get_be32_array(ByteIOContext *s, uint32_t *dst, int count);
+int get_be64_array(ByteIOContext *s, uint64_t *dst, int count);
+
 uint64_t ff_get_v(ByteIOContext *bc);
 
 static inline int url_is_streamed(ByteIOContext *s)
@@ -341,6 +441,40 @@ int url_fdopen(ByteIOContext **s, URLContext *h);
 
 /** @warning must be called before any I/O */
 int url_setbufsize(ByteIOContext *s, int buf_size);
+
+/**
+ * Map again a memory mapped resource, to read what was appended to it
+ * since it was opened. The position is kept.
+ * @return 0 on success, AVERROR(ENOSYS) if s is not mapped
+ */
+int url_fremap(ByteIOContext *s);
+
+/**
+ * Read ahead of the current position in a separate thread, so that
+ * reading overlaps with demuxing. Up to nb_buffers buffers of the current
+ * buffer size are prefetched; seeking discards them.
+ * Call it after url_setbufsize() if the buffer size is changed.
+ * @param nb_buffers number of buffers to prefetch, 0 disables read-ahead
+ * @return 0 on success, AVERROR(ENOSYS) if threads are not supported
+ */
+int url_fset_readahead(ByteIOContext *s, int nb_buffers);
+
+/**
+ * Write the buffers of s in a separate thread, so that muxing overlaps
+ * with the I/O. Up to nb_buffers buffers of the current buffer size are
+ * queued; seeking waits until they have been written. Write errors are
+ * reported by url_ferror() once they happened.
+ * @param nb_buffers number of buffers to queue, 0 writes the queued ones
+ *                   and disables write-behind
+ * @return 0 on success, AVERROR(ENOSYS) if threads are not supported
+ */
+int url_fset_writebehind(ByteIOContext *s, int nb_buffers);
+
+/**
+ * Log the I/O statistics of s and, if it was opened with url_fopen()
+ * or url_fdopen(), of its URLContext at the given log level.
+ */
+void url_fdump_stats(void *avcl, int level, ByteIOContext *s);
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 /** Reset the buffer for reading or writing.
  * @note Will drop any data currently in the buffer without transmitting it.
@@ -398,6 +532,23 @@ int url_open_dyn_packet_buf(ByteIOContext **s, int max_packet_size);
  */
 int url_close_dyn_buf(ByteIOContext *s, uint8_t **pbuffer);
 
+/**
+ * Return the written size and a pointer to the buffer without closing
+ * the stream. The buffer still belongs to s, it is valid until the next
+ * write to s or url_reset_dyn_buf().
+ * @param s IO context opened with url_open_dyn_buf() or url_open_dyn_packet_buf()
+ * @param pbuffer pointer to a byte buffer
+ * @return the length of the byte buffer
+ */
+int url_get_dyn_buf(ByteIOContext *s, uint8_t **pbuffer);
+
+/**
+ * Discard what was written to a dynamic buffer, keeping its memory for
+ * the next writes, so that a stream reused for each packet does not
+ * reallocate its buffer.
+ */
+void url_reset_dyn_buf(ByteIOContext *s);
+
 unsigned long ff_crc04C11DB7_update(unsigned long checksum, const uint8_t *buf,
                                     unsigned int len);
 unsigned long get_checksum(ByteIOContext *s);
@@ -408,6 +559,10 @@ void init_checksum(ByteIOContext *s,
 /* udp.c */
 int udp_set_remote_url(URLContext *h, const char *uri);
 int udp_get_local_port(URLContext *h);
+int udp_set_bitrate(URLContext *h, int64_t bitrate);
+int ff_udp_start_batch(URLContext *h);
+int ff_udp_end_batch(URLContext *h, int64_t duration);
+int64_t ff_udp_get_arrival_time(URLContext *h);
 #if (LIBAVFORMAT_VERSION_MAJOR <= 52)
 int udp_get_file_handle(URLContext *h);
 #endif
@@ -23,11 +23,19 @@
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
 #include "avio.h"
+#include "internal.h"
+#include "trace.h"
 #include <stdarg.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #define IO_BUFFER_SIZE 32768
+/** size of the buffer window over a memory mapped resource */
+#define MAP_WINDOW_SIZE (1 << 23)
 
 static void fill_buffer(ByteIOContext *s);
+static void map_window(ByteIOContext *s, int64_t pos);
 #if LIBAVFORMAT_VERSION_MAJOR >= 53
 static int url_resetbuf(ByteIOContext *s, int flags);
 #endif
@@ -62,6 +70,11 @@ int init_put_byte(ByteIOContext *s,
     }
     s->read_pause = NULL;
     s->read_seek  = NULL;
+    s->map        = NULL;
+    s->map_size   = 0;
+    s->readahead  = NULL;
+    s->writebehind = NULL;
+    memset(&s->stats, 0, sizeof(s->stats));
     return 0;
 }
 
@@ -80,14 +93,422 @@ ByteIOContext *av_alloc_put_byte(
     return s;
 }
 
+#if HAVE_PTHREADS
+typedef struct ReadAheadContext {
+    ByteIOContext *s;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t **blocks;
+    int *block_len;
+    int nb_blocks;
+    int block_size;
+    int rindex, windex, count; ///< ring of filled blocks
+    int roffset;               ///< bytes already returned from block rindex
+    int status;                ///< return value of the last read if <= 0, 1 otherwise
+    int pause, busy, abort;
+} ReadAheadContext;
+
+static void *readahead_thread(void *arg)
+{
+    ReadAheadContext *r = arg;
+    ByteIOContext *s = r->s;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        int idx, len;
+
+        while (!r->abort && (r->pause || r->status <= 0 || r->count == r->nb_blocks))
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->abort)
+            break;
+        idx = r->windex;
+        r->busy = 1;
+        pthread_mutex_unlock(&r->lock);
+
+        len = s->read_packet(s->opaque, r->blocks[idx], r->block_size);
+
+        pthread_mutex_lock(&r->lock);
+        r->busy = 0;
+        if (len > 0) {
+            r->block_len[idx] = len;
+            r->windex = (idx + 1) % r->nb_blocks;
+            r->count++;
+        } else
+            r->status = len;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+/**
+ * Wait until the read-ahead thread is idle and keep it from reading, so
+ * that the protocol can be accessed directly.
+ */
+static void readahead_pause(ReadAheadContext *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->pause = 1;
+    while (r->busy)
+        pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Let the read-ahead thread continue.
+ * @param flush discard the prefetched data, e.g. because the position changed
+ */
+static void readahead_resume(ReadAheadContext *r, int flush)
+{
+    pthread_mutex_lock(&r->lock);
+    if (flush) {
+        r->rindex = r->windex = r->count = r->roffset = 0;
+        r->status = 1;
+    }
+    r->pause = 0;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+static int readahead_read(ReadAheadContext *r, uint8_t *buf, int size)
+{
+    int len;
+    uint8_t *src;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->count && r->status > 0)
+        pthread_cond_wait(&r->cond, &r->lock);
+    if (!r->count) {
+        pthread_mutex_unlock(&r->lock);
+        return r->status;
+    }
+    src = r->blocks[r->rindex] + r->roffset;
+    len = FFMIN(size, r->block_len[r->rindex] - r->roffset);
+    pthread_mutex_unlock(&r->lock);
+
+    /* the thread does not touch filled blocks */
+    memcpy(buf, src, len);
+
+    pthread_mutex_lock(&r->lock);
+    r->roffset += len;
+    if (r->roffset == r->block_len[r->rindex]) {
+        r->rindex  = (r->rindex + 1) % r->nb_blocks;
+        r->roffset = 0;
+        r->count--;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return len;
+}
+
+static void readahead_close(ReadAheadContext *r)
+{
+    int i;
+
+    pthread_mutex_lock(&r->lock);
+    r->abort = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    for (i = 0; i < r->nb_blocks; i++)
+        av_free(r->blocks[i]);
+    av_free(r->blocks);
+    av_free(r->block_len);
+    av_free(r);
+}
+#endif
+
+int url_fset_readahead(ByteIOContext *s, int nb_buffers)
+{
+#if HAVE_PTHREADS
+    ReadAheadContext *r;
+    int i;
+
+    if (s->write_flag || !s->read_packet || nb_buffers < 0)
+        return AVERROR(EINVAL);
+    if (s->readahead) {
+        readahead_close(s->readahead);
+        s->readahead = NULL;
+    }
+    /* mapped resources are read without any I/O anyway */
+    if (!nb_buffers || s->map)
+        return 0;
+
+    r = av_mallocz(sizeof(ReadAheadContext));
+    if (!r)
+        return AVERROR(ENOMEM);
+    r->s          = s;
+    r->nb_blocks  = nb_buffers;
+    r->block_size = s->buffer_size;
+    r->status     = 1;
+    r->blocks     = av_mallocz(nb_buffers * sizeof(*r->blocks));
+    r->block_len  = av_mallocz(nb_buffers * sizeof(*r->block_len));
+    if (!r->blocks || !r->block_len)
+        goto fail;
+    for (i = 0; i < nb_buffers; i++)
+        if (!(r->blocks[i] = av_malloc(r->block_size)))
+            goto fail;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, readahead_thread, r)) {
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        goto fail;
+    }
+    s->readahead = r;
+    return 0;
+fail:
+    if (r->blocks)
+        for (i = 0; i < nb_buffers; i++)
+            av_free(r->blocks[i]);
+    av_free(r->blocks);
+    av_free(r->block_len);
+    av_free(r);
+    return AVERROR(ENOMEM);
+#else
+    return nb_buffers ? AVERROR(ENOSYS) : 0;
+#endif
+}
+
+#if HAVE_PTHREADS
+typedef struct WriteBehindContext {
+    ByteIOContext *s;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t **blocks;
+    int *block_len;
+    int nb_blocks;
+    int block_size;
+    int rindex, windex, count; ///< ring of blocks waiting to be written
+    int status;                ///< first error returned by write_packet
+    int busy, abort;
+} WriteBehindContext;
+
+static void *writebehind_thread(void *arg)
+{
+    WriteBehindContext *w = arg;
+    ByteIOContext *s = w->s;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        int idx, ret = 0;
+
+        while (!w->abort && !w->count)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->count)
+            break;
+        idx = w->rindex;
+        w->busy = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        /* nothing more is written after an error, as without the thread */
+        if (!w->status)
+            ret = s->write_packet(s->opaque, w->blocks[idx], w->block_len[idx]);
+
+        pthread_mutex_lock(&w->lock);
+        w->busy = 0;
+        if (ret < 0)
+            w->status = ret;
+        w->rindex = (idx + 1) % w->nb_blocks;
+        w->count--;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Wait until all queued blocks have been written, so that the protocol
+ * can be accessed directly.
+ * @return the first error of the writes
+ */
+static int writebehind_sync(WriteBehindContext *w)
+{
+    int ret;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->count)
+        pthread_cond_wait(&w->cond, &w->lock);
+    ret = w->status;
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+/**
+ * Queue buf for writing.
+ * @return the error of an earlier write, 0 otherwise
+ */
+static int writebehind_write(WriteBehindContext *w, uint8_t *buf, int size)
+{
+    int idx, ret;
+
+    /* the buffer size changed since the blocks were allocated */
+    if (size > w->block_size) {
+        if ((ret = writebehind_sync(w)) < 0)
+            return ret;
+        return w->s->write_packet(w->s->opaque, buf, size);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->count == w->nb_blocks)
+        pthread_cond_wait(&w->cond, &w->lock);
+    idx = w->windex;
+    pthread_mutex_unlock(&w->lock);
+
+    /* the thread does not touch free blocks */
+    memcpy(w->blocks[idx], buf, size);
+
+    pthread_mutex_lock(&w->lock);
+    w->block_len[idx] = size;
+    w->windex = (idx + 1) % w->nb_blocks;
+    w->count++;
+    ret = w->status;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return ret;
+}
+
+static int writebehind_close(WriteBehindContext *w)
+{
+    int i, ret;
+
+    pthread_mutex_lock(&w->lock);
+    w->abort = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    ret = w->status;
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    for (i = 0; i < w->nb_blocks; i++)
+        av_free(w->blocks[i]);
+    av_free(w->blocks);
+    av_free(w->block_len);
+    av_free(w);
+    return ret;
+}
+#endif
+
+int url_fset_writebehind(ByteIOContext *s, int nb_buffers)
+{
+#if HAVE_PTHREADS
+    WriteBehindContext *w;
+    int i, ret;
+
+    if (!s->write_flag || !s->write_packet || nb_buffers < 0)
+        return AVERROR(EINVAL);
+    if (s->writebehind) {
+        ret = writebehind_close(s->writebehind);
+        s->writebehind = NULL;
+        if (ret < 0 && !s->error)
+            s->error = ret;
+    }
+    if (!nb_buffers)
+        return 0;
+
+    w = av_mallocz(sizeof(WriteBehindContext));
+    if (!w)
+        return AVERROR(ENOMEM);
+    w->s          = s;
+    w->nb_blocks  = nb_buffers;
+    w->block_size = s->buffer_size;
+    w->blocks     = av_mallocz(nb_buffers * sizeof(*w->blocks));
+    w->block_len  = av_mallocz(nb_buffers * sizeof(*w->block_len));
+    if (!w->blocks || !w->block_len)
+        goto fail;
+    for (i = 0; i < nb_buffers; i++)
+        if (!(w->blocks[i] = av_malloc(w->block_size)))
+            goto fail;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if (pthread_create(&w->thread, NULL, writebehind_thread, w)) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        goto fail;
+    }
+    s->writebehind = w;
+    return 0;
+fail:
+    if (w->blocks)
+        for (i = 0; i < nb_buffers; i++)
+            av_free(w->blocks[i]);
+    av_free(w->blocks);
+    av_free(w->block_len);
+    av_free(w);
+    return AVERROR(ENOMEM);
+#else
+    return nb_buffers ? AVERROR(ENOSYS) : 0;
+#endif
+}
+
+static int io_read_packet(ByteIOContext *s, uint8_t *buf, int size)
+{
+    int64_t t = av_gettime();
+    int ret;
+
+#if HAVE_PTHREADS
+    if (s->readahead)
+        ret = readahead_read(s->readahead, buf, size);
+    else
+#endif
+    if (!s->read_packet)
+        return 0;
+    else
+        ret = s->read_packet(s->opaque, buf, size);
+    s->stats.read_time += av_gettime() - t;
+    s->stats.read_calls++;
+    if (ret > 0) {
+        s->stats.bytes_read += ret;
+        if (ret < size)
+            s->stats.short_reads++;
+    }
+    FF_TRACE('X', "io_read", t, 0, -1, AV_NOPTS_VALUE, s->pos, ret);
+    return ret;
+}
+
+static int64_t io_seek(ByteIOContext *s, int64_t offset, int whence)
+{
+    if (whence != AVSEEK_SIZE)
+        s->stats.seeks++;
+#if HAVE_PTHREADS
+    if (s->writebehind) {
+        int ret = writebehind_sync(s->writebehind);
+        if (ret < 0 && !s->error)
+            s->error = ret;
+    }
+    if (s->readahead) {
+        int64_t ret;
+        readahead_pause(s->readahead);
+        ret = s->seek(s->opaque, offset, whence);
+        readahead_resume(s->readahead, ret >= 0 && whence != AVSEEK_SIZE);
+        return ret;
+    }
+#endif
+    return s->seek(s->opaque, offset, whence);
+}
+
 static void flush_buffer(ByteIOContext *s)
 {
     if (s->buf_ptr > s->buffer) {
         if (s->write_packet && !s->error){
-            int ret= s->write_packet(s->opaque, s->buffer, s->buf_ptr - s->buffer);
+            int64_t t = av_gettime();
+            int ret;
+#if HAVE_PTHREADS
+            if (s->writebehind)
+                ret = writebehind_write(s->writebehind, s->buffer, s->buf_ptr - s->buffer);
+            else
+#endif
+            ret = s->write_packet(s->opaque, s->buffer, s->buf_ptr - s->buffer);
+            s->stats.write_time += av_gettime() - t;
+            s->stats.write_calls++;
             if(ret < 0){
                 s->error = ret;
-            }
+            } else
+                s->stats.bytes_written += s->buf_ptr - s->buffer;
         }
         if(s->update_checksum){
             s->checksum= s->update_checksum(s->checksum, s->checksum_ptr, s->buf_ptr - s->checksum_ptr);
@@ -150,8 +571,10 @@ int64_t url_fseek(ByteIOContext *s, int64_t offset, int whence)
         offset1 >= 0 && offset1 <= (s->buf_end - s->buffer)) {
         /* can do the seek inside the buffer */
         s->buf_ptr = s->buffer + offset1;
+        s->stats.buffered_seeks++;
     } else if(s->is_streamed && !s->write_flag &&
               offset1 >= 0 && offset1 < (s->buf_end - s->buffer) + (1<<16)){
+        s->stats.buffered_seeks++;
         while(s->pos < offset && !s->eof_reached)
             fill_buffer(s);
         if (s->eof_reached)
@@ -166,7 +589,15 @@ int64_t url_fseek(ByteIOContext *s, int64_t offset, int whence)
             s->must_flush = 1;
         }
 #endif /* CONFIG_MUXERS || CONFIG_NETWORK */
-        if (!s->seek || (res = s->seek(s->opaque, offset, SEEK_SET)) < 0)
+        if (s->map) {
+            if (offset < 0)
+                return AVERROR(EINVAL);
+            s->stats.seeks++;
+            map_window(s, offset);
+            s->eof_reached = 0;
+            return offset;
+        }
+        if (!s->seek || (res = io_seek(s, offset, SEEK_SET)) < 0)
             return res;
         if (!s->write_flag)
             s->buf_end = s->buffer;
@@ -196,12 +627,12 @@ int64_t url_fsize(ByteIOContext *s)
 
     if (!s->seek)
         return AVERROR(EPIPE);
-    size = s->seek(s->opaque, 0, AVSEEK_SIZE);
+    size = io_seek(s, 0, AVSEEK_SIZE);
     if(size<0){
-        if ((size = s->seek(s->opaque, -1, SEEK_END)) < 0)
+        if ((size = io_seek(s, -1, SEEK_END)) < 0)
             return size;
         size++;
-        s->seek(s->opaque, s->pos, SEEK_SET);
+        io_seek(s, s->pos, SEEK_SET);
     }
     return size;
 }
@@ -289,6 +720,18 @@ void put_tag(ByteIOContext *s, const char *tag)
 
 /* Input stream */
 
+/**
+ * Point the buffer window of a memory mapped context at pos.
+ */
+static void map_window(ByteIOContext *s, int64_t pos)
+{
+    pos = FFMIN(pos, s->map_size);
+    s->buffer  = (unsigned char *)s->map + pos;
+    s->buf_ptr = s->buffer;
+    s->buf_end = s->buffer + FFMIN(s->buffer_size, s->map_size - pos);
+    s->pos     = pos + (s->buf_end - s->buffer);
+}
+
 static void fill_buffer(ByteIOContext *s)
 {
     uint8_t *dst= !s->max_packet_size && s->buf_end - s->buffer < s->buffer_size ? s->buf_ptr : s->buffer;
@@ -300,16 +743,23 @@ static void fill_buffer(ByteIOContext *s)
     if (s->eof_reached)
         return;
 
-    if(s->update_checksum && dst == s->buffer){
+    s->stats.refills++;
+    if(s->update_checksum && (dst == s->buffer || s->map)){
         if(s->buf_end > s->checksum_ptr)
             s->checksum= s->update_checksum(s->checksum, s->checksum_ptr, s->buf_end - s->checksum_ptr);
         s->checksum_ptr= s->buffer;
     }
 
-    if(s->read_packet)
-        len = s->read_packet(s->opaque, dst, len);
-    else
-        len = 0;
+    if (s->map) {
+        /* just slide the window, the data is already in memory */
+        map_window(s, s->pos);
+        s->checksum_ptr = s->buffer;
+        if (s->buf_ptr == s->buf_end)
+            s->eof_reached = 1;
+        return;
+    }
+
+    len = io_read_packet(s, dst, len);
     if (len <= 0) {
         /* do not modify buffer if EOF reached so that a seek back can
            be done without rereading data */
@@ -326,7 +776,7 @@ static void fill_buffer(ByteIOContext *s)
 unsigned long ff_crc04C11DB7_update(unsigned long checksum, const uint8_t *buf,
                                     unsigned int len)
 {
-    return av_crc(av_crc_get_table(AV_CRC_32_IEEE), checksum, buf, len);
+    return ff_crc32_ieee(checksum, buf, len);
 }
 
 unsigned long get_checksum(ByteIOContext *s)
@@ -384,9 +834,8 @@ int get_buffer(ByteIOContext *s, unsigned char *buf, int size)
         if (len > size)
             len = size;
         if (len == 0) {
-            if(size > s->buffer_size && !s->update_checksum){
-                if(s->read_packet)
-                    len = s->read_packet(s->opaque, buf, size);
+            if(size > s->buffer_size && !s->update_checksum && !s->map){
+                len = io_read_packet(s, buf, size);
                 if (len <= 0) {
                     /* do not modify buffer if EOF reached so that a seek back can
                     be done without rereading data */
@@ -421,6 +870,63 @@ int get_buffer(ByteIOContext *s, unsigned char *buf, int size)
     return size1 - size;
 }
 
+int url_fpeek(ByteIOContext *s, const unsigned char **buf, int size)
+{
+    int len = s->buf_end - s->buf_ptr;
+
+    if (size < 0 || s->write_flag)
+        return AVERROR(EINVAL);
+
+    size = FFMIN(size, s->buffer_size);
+    if (len < size && s->map) {
+        if (s->update_checksum && s->buf_ptr > s->checksum_ptr)
+            s->checksum = s->update_checksum(s->checksum, s->checksum_ptr,
+                                             s->buf_ptr - s->checksum_ptr);
+        map_window(s, s->pos - len);
+        s->checksum_ptr = s->buffer;
+        len = s->buf_end - s->buf_ptr;
+        if (!len)
+            s->eof_reached = 1;
+    } else if (len < size) {
+        if (s->buf_ptr + size > s->buffer + s->buffer_size) {
+            /* move the unread data to the start of the buffer so that
+               the requested area fits in it */
+            if (s->update_checksum) {
+                if (s->buf_ptr > s->checksum_ptr)
+                    s->checksum = s->update_checksum(s->checksum, s->checksum_ptr,
+                                                     s->buf_ptr - s->checksum_ptr);
+                s->checksum_ptr = s->buffer;
+            }
+            memmove(s->buffer, s->buf_ptr, len);
+            s->buf_ptr = s->buffer;
+            s->buf_end = s->buffer + len;
+        }
+        while (len < size && !s->eof_reached) {
+            int ret, max = s->buffer_size - (s->buf_end - s->buffer);
+
+            /* packetized protocols need room for a whole packet */
+            if (s->max_packet_size && max < s->max_packet_size)
+                break;
+            ret = io_read_packet(s, s->buf_end, max);
+            if (ret <= 0) {
+                s->eof_reached = 1;
+                if (ret < 0)
+                    s->error = ret;
+                break;
+            }
+            s->pos     += ret;
+            s->buf_end += ret;
+            len        += ret;
+        }
+    }
+    *buf = s->buf_ptr;
+    if (!len) {
+        if (url_ferror(s)) return url_ferror(s);
+        if (url_feof(s))   return AVERROR_EOF;
+    }
+    return FFMIN(len, size);
+}
+
 int get_partial_buffer(ByteIOContext *s, unsigned char *buf, int size)
 {
     int len;
@@ -522,6 +1028,33 @@ uint64_t get_be64(ByteIOContext *s)
     return val;
 }
 
+#define GET_ARRAY(name, type, bytes, read, get)                         \
+int name(ByteIOContext *s, type *dst, int count)                        \
+{                                                                       \
+    int i = 0, j, n;                                                    \
+                                                                        \
+    while (i < count) {                                                 \
+        n = FFMIN((s->buf_end - s->buf_ptr) / bytes, count - i);        \
+        if (n > 0) {                                                    \
+            for (j = 0; j < n; j++)                                     \
+                dst[i + j] = read(s->buf_ptr + j * bytes);              \
+            s->buf_ptr += n * bytes;                                    \
+            i += n;                                                     \
+        } else {                                                        \
+            /* the value straddles the end of the buffer */             \
+            dst[i] = get(s);                                            \
+            if (s->eof_reached)                                         \
+                break;                                                  \
+            i++;                                                        \
+        }                                                               \
+    }                                                                   \
+    return i;                                                           \
+}
+
+GET_ARRAY(get_le32_array, uint32_t, 4, AV_RL32, get_le32)
+GET_ARRAY(get_be32_array, uint32_t, 4, AV_RB32, get_be32)
+GET_ARRAY(get_be64_array, uint64_t, 8, AV_RB64, get_be64)
+
 uint64_t ff_get_v(ByteIOContext *bc){
     uint64_t val = 0;
     int tmp;
@@ -562,6 +1095,18 @@ int url_fdopen(ByteIOContext **s, URLContext *h)
         av_freep(s);
         return AVERROR(EIO);
     }
+    if (!(*s)->write_flag && !max_packet_size && h->prot && h->prot->url_get_map) {
+        const uint8_t *map;
+        int64_t map_size = h->prot->url_get_map(h, &map);
+        if (map_size > 0) {
+            /* read directly from the mapping instead of the buffer */
+            av_free(buffer);
+            (*s)->map         = map;
+            (*s)->map_size    = map_size;
+            (*s)->buffer_size = MAP_WINDOW_SIZE;
+            map_window(*s, 0);
+        }
+    }
     (*s)->is_streamed = h->is_streamed;
     (*s)->max_packet_size = max_packet_size;
     if(h->prot) {
@@ -571,9 +1116,37 @@ int url_fdopen(ByteIOContext **s, URLContext *h)
     return 0;
 }
 
+int url_fremap(ByteIOContext *s)
+{
+    URLContext *h = s->opaque;
+    const uint8_t *map;
+    int64_t map_size, pos;
+
+    if (!s->map || !h->prot->url_get_map)
+        return AVERROR(ENOSYS);
+    pos = url_ftell(s);
+    map_size = h->prot->url_get_map(h, &map);
+    if (map_size < 0)
+        return map_size;
+    s->map         = map;
+    s->map_size    = map_size;
+    s->eof_reached = 0;
+    map_window(s, pos);
+    s->checksum_ptr = s->buffer;
+    return 0;
+}
+
 int url_setbufsize(ByteIOContext *s, int buf_size)
 {
     uint8_t *buffer;
+
+    if (s->map) {
+        int64_t pos = url_ftell(s);
+        s->buffer_size = buf_size;
+        map_window(s, pos);
+        return 0;
+    }
+
     buffer = av_malloc(buf_size);
     if (!buffer)
         return AVERROR(ENOMEM);
@@ -630,11 +1203,41 @@ int url_fclose(ByteIOContext *s)
 {
     URLContext *h = s->opaque;
 
-    av_free(s->buffer);
+#if HAVE_PTHREADS
+    if (s->readahead)
+        readahead_close(s->readahead);
+    if (s->writebehind)
+        writebehind_close(s->writebehind);
+#endif
+    if (!s->map)
+        av_free(s->buffer);
     av_free(s);
     return url_close(h);
 }
 
+static void dump_stats(void *avcl, int level, const char *name,
+                       const AVIOStats *st, int buffered)
+{
+    av_log(avcl, level, "  %s: %"PRId64" bytes read in %"PRId64" calls "
+           "(%"PRId64" short, %"PRId64" ms), %"PRId64" bytes written in %"PRId64" calls "
+           "(%"PRId64" ms), %"PRId64" seeks",
+           name, st->bytes_read, st->read_calls, st->short_reads, st->read_time / 1000,
+           st->bytes_written, st->write_calls, st->write_time / 1000, st->seeks);
+    if (buffered)
+        av_log(avcl, level, " + %"PRId64" in buffer, %"PRId64" refills",
+               st->buffered_seeks, st->refills);
+    if (st->dropped)
+        av_log(avcl, level, ", %"PRId64" datagrams dropped", st->dropped);
+    av_log(avcl, level, "\n");
+}
+
+void url_fdump_stats(void *avcl, int level, ByteIOContext *s)
+{
+    dump_stats(avcl, level, "buffer", &s->stats, 1);
+    if (s->read_packet == (int (*)(void *, uint8_t *, int))url_read)
+        dump_stats(avcl, level, "protocol", &url_fileno(s)->stats, 0);
+}
+
 URLContext *url_fileno(ByteIOContext *s)
 {
     return s->opaque;
@@ -695,11 +1298,19 @@ int64_t av_url_read_fseek(ByteIOContext *s, int stream_index,
     int64_t ret;
     if (!s->read_seek)
         return AVERROR(ENOSYS);
+#if HAVE_PTHREADS
+    if (s->readahead)
+        readahead_pause(s->readahead);
+#endif
     ret = s->read_seek(h, stream_index, timestamp, flags);
     if(ret >= 0) {
         s->buf_ptr = s->buf_end; // Flush buffer
         s->pos = s->seek(h, 0, SEEK_CUR);
     }
+#if HAVE_PTHREADS
+    if (s->readahead)
+        readahead_resume(s->readahead, ret >= 0);
+#endif
     return ret;
 }
 
@@ -837,6 +1448,27 @@ int url_open_dyn_packet_buf(ByteIOContext **s, int max_packet_size)
     return url_open_dyn_buf_internal(s, max_packet_size);
 }
 
+int url_get_dyn_buf(ByteIOContext *s, uint8_t **pbuffer)
+{
+    DynBuffer *d = s->opaque;
+
+    put_flush_packet(s);
+    *pbuffer = d->buffer;
+    return d->size;
+}
+
+void url_reset_dyn_buf(ByteIOContext *s)
+{
+    DynBuffer *d = s->opaque;
+
+    /* the bytes not flushed yet are dropped as well */
+    s->buf_ptr     = s->buffer;
+    s->pos         = 0;
+    s->eof_reached = 0;
+    s->error       = 0;
+    d->pos = d->size = 0;
+}
+
 int url_close_dyn_buf(ByteIOContext *s, uint8_t **pbuffer)
 {
     DynBuffer *d = s->opaque;
@@ -0,0 +1,199 @@
+/*
+ * Concurrent opening of many input files
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/batchopen.c
+ * Each file is opened and probed by one task of the thread pool, the
+ * queue bounding how many are in flight. Finished files are chained in
+ * completion order and handed out by av_batch_open_next(). Without
+ * threads the files are opened one by one by av_batch_open_next().
+ */
+
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include "threadpool.h"
+#endif
+
+typedef struct BatchOpenFile {
+    struct BatchOpenFile *next; ///< in the list of the files done
+    char *url;
+    int index;
+    AVFormatContext *ic;
+    int ret;
+} BatchOpenFile;
+
+struct AVBatchOpen {
+    AVInputFormat *fmt;
+    AVFormatParameters ap;
+    int has_ap;
+    BatchOpenFile *files;
+    int nb_files;
+    int nb_submitted;           ///< files opened by the pool, the first ones
+    int nb_returned;
+#if HAVE_PTHREADS
+    FFTaskQueue *queue;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        ///< signaled when a file is done
+    BatchOpenFile *done_first, *done_last;
+    int abort;
+#endif
+};
+
+static void open_file(AVBatchOpen *b, BatchOpenFile *f)
+{
+    f->ret = av_open_input_file(&f->ic, f->url, b->fmt, 0,
+                                b->has_ap ? &b->ap : NULL);
+    if (f->ret >= 0 && (f->ret = av_find_stream_info(f->ic)) < 0) {
+        av_close_input_file(f->ic);
+        f->ic = NULL;
+    }
+    if (f->ret < 0)
+        f->ic = NULL;
+}
+
+#if HAVE_PTHREADS
+static void open_task(void *opaque, void *job)
+{
+    AVBatchOpen *b = opaque;
+    BatchOpenFile *f = job;
+    int abort;
+
+    pthread_mutex_lock(&b->lock);
+    abort = b->abort;
+    pthread_mutex_unlock(&b->lock);
+    if (abort)
+        f->ret = AVERROR(EINTR);
+    else
+        open_file(b, f);
+
+    pthread_mutex_lock(&b->lock);
+    f->next = NULL;
+    if (b->done_last)
+        b->done_last->next = f;
+    else
+        b->done_first = f;
+    b->done_last = f;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+#endif
+
+AVBatchOpen *av_batch_open_files(const char * const *urls, int nb_urls,
+                                 AVInputFormat *fmt, AVFormatParameters *ap,
+                                 int max_parallel)
+{
+    AVBatchOpen *b;
+    int i;
+
+    if (nb_urls < 0 || max_parallel < 0 || !(b = av_mallocz(sizeof(*b))))
+        return NULL;
+    b->fmt = fmt;
+    if (ap) {
+        b->ap = *ap;
+        b->ap.prealloced_context = 0;
+        b->has_ap = 1;
+    }
+    if (nb_urls && !(b->files = av_mallocz(nb_urls * sizeof(*b->files))))
+        goto fail;
+    for (; b->nb_files < nb_urls; b->nb_files++) {
+        BatchOpenFile *f = &b->files[b->nb_files];
+        if (!(f->url = av_strdup(urls[b->nb_files])))
+            goto fail;
+        f->index = b->nb_files;
+    }
+
+#if HAVE_PTHREADS
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    /* leave a thread of the pool to the tasks of the files being opened */
+    if (!max_parallel)
+        max_parallel = ff_thread_pool_size();
+    max_parallel = FFMIN(max_parallel, ff_thread_pool_size() - 1);
+    if (max_parallel > 0 && b->nb_files > 1 &&
+        (b->queue = ff_task_queue_alloc(NULL, open_task, b, max_parallel))) {
+        /* the files not submitted are opened by av_batch_open_next() */
+        while (b->nb_submitted < b->nb_files &&
+               ff_task_queue_submit(b->queue, &b->files[b->nb_submitted]) >= 0)
+            b->nb_submitted++;
+    }
+#endif
+    return b;
+fail:
+    for (i = 0; i < b->nb_files; i++)
+        av_free(b->files[i].url);
+    av_free(b->files);
+    av_free(b);
+    return NULL;
+}
+
+int av_batch_open_next(AVBatchOpen *b, int *index, AVFormatContext **ic)
+{
+    BatchOpenFile *f;
+
+    if (b->nb_returned == b->nb_files)
+        return AVERROR_EOF;
+#if HAVE_PTHREADS
+    if (b->nb_returned < b->nb_submitted) {
+        pthread_mutex_lock(&b->lock);
+        while (!b->done_first)
+            pthread_cond_wait(&b->cond, &b->lock);
+        f = b->done_first;
+        if (!(b->done_first = f->next))
+            b->done_last = NULL;
+        pthread_mutex_unlock(&b->lock);
+    } else
+#endif
+    {
+        f = &b->files[b->nb_returned];
+        open_file(b, f);
+    }
+    b->nb_returned++;
+    *index = f->index;
+    *ic    = f->ic;
+    f->ic  = NULL;
+    return f->ret;
+}
+
+void av_batch_open_close(AVBatchOpen **pb)
+{
+    AVBatchOpen *b = *pb;
+    int i;
+
+    if (!b)
+        return;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&b->lock);
+    b->abort = 1;
+    pthread_mutex_unlock(&b->lock);
+    ff_task_queue_free(&b->queue);
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+#endif
+    for (i = 0; i < b->nb_files; i++) {
+        if (b->files[i].ic)
+            av_close_input_file(b->files[i].ic);
+        av_free(b->files[i].url);
+    }
+    av_free(b->files);
+    av_freep(pb);
+}
@@ -0,0 +1,246 @@
+/*
+ * Input cache protocol
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/cache.c
+ * Input cache protocol.
+ * cache:URL reads URL through a temporary file that keeps everything read
+ * so far, so that rereads during probing and seeks back into already read
+ * data are served locally and work even if URL is not seekable.
+ */
+
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "os_support.h"
+
+typedef struct CacheRange {
+    int64_t start, end;
+} CacheRange;
+
+typedef struct CacheContext {
+    URLContext *inner;
+    int fd;                 ///< temporary file, data is stored at its logical offset
+    CacheRange *ranges;     ///< cached byte ranges, sorted and not touching each other
+    int nb_ranges;
+    int64_t pos;            ///< current logical position
+    int64_t inner_pos;      ///< current position of the wrapped protocol
+    int64_t end;            ///< total size, -1 if unknown
+} CacheContext;
+
+/**
+ * @return index of the range containing pos, or -(index of the first
+ *         range after pos) - 1
+ */
+static int find_range(CacheContext *c, int64_t pos)
+{
+    int lo = 0, hi = c->nb_ranges - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        if (pos < c->ranges[mid].start)
+            hi = mid - 1;
+        else if (pos >= c->ranges[mid].end)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -lo - 1;
+}
+
+static int add_range(CacheContext *c, int64_t start, int64_t end)
+{
+    int i = 0, j;
+
+    while (i < c->nb_ranges && c->ranges[i].end < start)
+        i++;
+    for (j = i; j < c->nb_ranges && c->ranges[j].start <= end; j++) {
+        start = FFMIN(start, c->ranges[j].start);
+        end   = FFMAX(end,   c->ranges[j].end);
+    }
+    if (j == i) {
+        CacheRange *r = av_realloc(c->ranges, (c->nb_ranges + 1) * sizeof(*r));
+        if (!r)
+            return AVERROR(ENOMEM);
+        c->ranges = r;
+        memmove(r + i + 1, r + i, (c->nb_ranges - i) * sizeof(*r));
+        c->nb_ranges++;
+    } else if (j > i + 1) {
+        memmove(c->ranges + i + 1, c->ranges + j,
+                (c->nb_ranges - j) * sizeof(*c->ranges));
+        c->nb_ranges -= j - i - 1;
+    }
+    c->ranges[i].start = start;
+    c->ranges[i].end   = end;
+    return 0;
+}
+
+static void cache_store(CacheContext *c, int64_t pos, const uint8_t *buf, int size)
+{
+    if (lseek(c->fd, pos, SEEK_SET) != pos || write(c->fd, buf, size) != size) {
+        av_log(NULL, AV_LOG_WARNING, "cache: could not write to the cache file\n");
+        return;
+    }
+    add_range(c, pos, pos + size);
+}
+
+/**
+ * Read from the wrapped protocol at pos and cache what was read.
+ */
+static int inner_read(CacheContext *c, int64_t pos, uint8_t *buf, int size)
+{
+    int n;
+
+    if (c->inner_pos != pos) {
+        if (url_seek(c->inner, pos, SEEK_SET) == pos) {
+            c->inner_pos = pos;
+        } else if (pos < c->inner_pos) {
+            return AVERROR(EIO);
+        } else {
+            /* skip forward on a non seekable input, keeping the data */
+            while (c->inner_pos < pos) {
+                n = url_read(c->inner, buf, FFMIN(size, pos - c->inner_pos));
+                if (n <= 0)
+                    return n;
+                cache_store(c, c->inner_pos, buf, n);
+                c->inner_pos += n;
+            }
+        }
+    }
+    n = url_read(c->inner, buf, size);
+    if (n > 0) {
+        cache_store(c, pos, buf, n);
+        c->inner_pos += n;
+    } else if (!n && c->end < 0) {
+        c->end = pos;
+    }
+    return n;
+}
+
+static int cache_open(URLContext *h, const char *arg, int flags)
+{
+    CacheContext *c;
+    const char *tmpdir;
+    char tmpname[1024];
+    int ret;
+
+    if (flags & (URL_WRONLY | URL_RDWR))
+        return AVERROR(EINVAL);
+    av_strstart(arg, "cache:", &arg);
+
+    c = av_mallocz(sizeof(CacheContext));
+    if (!c)
+        return AVERROR(ENOMEM);
+
+    if (!(tmpdir = getenv("TMPDIR")))
+        tmpdir = "/tmp";
+    snprintf(tmpname, sizeof(tmpname), "%s/ffcacheXXXXXX", tmpdir);
+    c->fd = mkstemp(tmpname);
+    if (c->fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "cache: could not create %s\n", tmpname);
+        av_free(c);
+        return AVERROR(EIO);
+    }
+    unlink(tmpname);
+
+    if ((ret = url_open_interrupt(&c->inner, arg, flags, h->interrupt)) < 0) {
+        close(c->fd);
+        av_free(c);
+        return ret;
+    }
+    c->end = url_seek(c->inner, 0, AVSEEK_SIZE);
+    if (c->end < 0)
+        c->end = -1;
+
+    h->priv_data       = c;
+    h->is_streamed     = 0;
+    h->max_packet_size = url_get_max_packet_size(c->inner);
+    return 0;
+}
+
+static int cache_read(URLContext *h, uint8_t *buf, int size)
+{
+    CacheContext *c = h->priv_data;
+    int i = find_range(c, c->pos);
+    int n;
+
+    if (i >= 0) {
+        n = FFMIN(size, c->ranges[i].end - c->pos);
+        if (lseek(c->fd, c->pos, SEEK_SET) != c->pos ||
+            (n = read(c->fd, buf, n)) <= 0)
+            return AVERROR(EIO);
+    } else {
+        i = -i - 1;
+        /* do not fetch data that is cached already */
+        if (i < c->nb_ranges)
+            size = FFMIN(size, c->ranges[i].start - c->pos);
+        n = inner_read(c, c->pos, buf, size);
+        if (n <= 0)
+            return n;
+    }
+    c->pos += n;
+    return n;
+}
+
+static int64_t cache_seek(URLContext *h, int64_t pos, int whence)
+{
+    CacheContext *c = h->priv_data;
+
+    if (whence == AVSEEK_SIZE)
+        return c->end;
+    if (whence == SEEK_CUR) {
+        pos += c->pos;
+    } else if (whence == SEEK_END) {
+        if (c->end < 0)
+            return -1;
+        pos += c->end;
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    /* data before the wrapped protocol's position is only available if it
+     * is cached or the wrapped protocol can seek */
+    if (pos < c->inner_pos && find_range(c, pos) < 0 && c->inner->is_streamed)
+        return -1;
+    c->pos = pos;
+    return pos;
+}
+
+static int cache_close(URLContext *h)
+{
+    CacheContext *c = h->priv_data;
+
+    url_close(c->inner);
+    close(c->fd);
+    av_free(c->ranges);
+    av_free(c);
+    return 0;
+}
+
+URLProtocol cache_protocol = {
+    "cache",
+    cache_open,
+    cache_read,
+    NULL,
+    cache_seek,
+    cache_close,
+};
@@ -0,0 +1,170 @@
+/*
+ * Clock recovery for live inputs
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/clockrecovery.c
+ * Clock recovery for live inputs.
+ * With AVFMT_FLAG_CLOCK_RECOVERY demuxers feed the timestamps of the clock
+ * of the source, the PCRs of each MPEG-TS program or the RTP timestamps of
+ * each stream, with the local time they arrived at into a delay locked
+ * loop, see timefilter.h. The loop smooths out the network jitter of the
+ * arrival times and estimates the rate of the source clock against the
+ * local one, which av_get_clock_estimate() returns.
+ */
+
+#include <math.h>
+#include "avformat.h"
+#include "internal.h"
+#include "timefilter.h"
+
+#define CLOCK_BANDWIDTH   0.05  ///< of the loop in Hz, the jitter is filtered above it
+#define CLOCK_UPDATE_RATE 25    ///< expected timestamps per second
+#define CLOCK_MAX_GAP     5.0   ///< seconds between timestamps before the clock restarts
+#define CLOCK_MAX_ERROR   1.0   ///< seconds between arrival and estimate before the clock restarts
+
+typedef struct RecoveredClock {
+    int program_id;         ///< program the clock belongs to, -1 for a stream clock
+    int stream_index;       ///< stream the clock belongs to, -1 for a program clock
+    TimeFilter *tf;
+    AVRational time_base;
+    int64_t wrap;           ///< period of the source timestamps, 0 if they do not wrap
+    int64_t last_ts;        ///< last source timestamp, in time_base
+    double local_start;     ///< local time in seconds when the clock (re)started
+    double local_time;      ///< filtered arrival of last_ts, in seconds after local_start
+    int updates;            ///< since the clock (re)started
+} RecoveredClock;
+
+typedef struct ClockRecovery {
+    RecoveredClock *clocks;
+    int nb_clocks;
+} ClockRecovery;
+
+static RecoveredClock *find_clock(ClockRecovery *cr, int program_id, int stream_index)
+{
+    int i;
+
+    if (!cr)
+        return NULL;
+    for (i = 0; i < cr->nb_clocks; i++)
+        if (cr->clocks[i].program_id   == program_id &&
+            cr->clocks[i].stream_index == stream_index)
+            return &cr->clocks[i];
+    return NULL;
+}
+
+static RecoveredClock *add_clock(AVFormatContext *s, int program_id, int stream_index)
+{
+    ClockRecovery *cr = s->clock_recovery;
+    RecoveredClock *c;
+    double o = 2 * M_PI * CLOCK_BANDWIDTH / CLOCK_UPDATE_RATE;
+    void *tmp;
+
+    if (!cr && !(cr = s->clock_recovery = av_mallocz(sizeof(ClockRecovery))))
+        return NULL;
+    tmp = av_realloc(cr->clocks, (cr->nb_clocks + 1) * sizeof(*cr->clocks));
+    if (!tmp)
+        return NULL;
+    cr->clocks = tmp;
+    c = &cr->clocks[cr->nb_clocks];
+    memset(c, 0, sizeof(*c));
+    /* the source clock is assumed to run at the local rate at first */
+    if (!(c->tf = ff_timefilter_new(1.0, sqrt(2 * o), o * o)))
+        return NULL;
+    c->program_id   = program_id;
+    c->stream_index = stream_index;
+    cr->nb_clocks++;
+    return c;
+}
+
+void ff_clock_recovery_update(AVFormatContext *s, int program_id, int stream_index,
+                              int64_t ts, AVRational time_base, int64_t wrap,
+                              int64_t arrival)
+{
+    RecoveredClock *c = find_clock(s->clock_recovery, program_id, stream_index);
+    double now = arrival / 1000000.0, delta = 0;
+
+    if (ts == AV_NOPTS_VALUE || (!c && !(c = add_clock(s, program_id, stream_index))))
+        return;
+
+    if (c->updates) {
+        int64_t d = ts - c->last_ts;
+
+        if (c->wrap) {
+            d = (d % c->wrap + c->wrap) % c->wrap;
+            if (d > c->wrap / 2)
+                d -= c->wrap;
+        }
+        /* e.g. the packets of one frame */
+        if (!d)
+            return;
+        delta = d * av_q2d(c->time_base);
+        /* a discontinuity of the source or a stall of the input */
+        if (delta < 0 || delta > CLOCK_MAX_GAP ||
+            fabs(now - c->local_start - ff_timefilter_eval(c->tf, delta)) > CLOCK_MAX_ERROR) {
+            av_log(s, AV_LOG_DEBUG, "clock of program %d stream %d restarted\n",
+                   program_id, stream_index);
+            c->updates = 0;
+        }
+    }
+    if (!c->updates) {
+        ff_timefilter_reset(c->tf);
+        c->local_start = now;
+        c->time_base   = time_base;
+        c->wrap        = wrap;
+    }
+    c->local_time = ff_timefilter_update(c->tf, now - c->local_start, delta);
+    c->last_ts    = ts;
+    c->updates++;
+}
+
+void ff_clock_recovery_free(AVFormatContext *s)
+{
+    ClockRecovery *cr = s->clock_recovery;
+    int i;
+
+    if (!cr)
+        return;
+    for (i = 0; i < cr->nb_clocks; i++)
+        ff_timefilter_destroy(cr->clocks[i].tf);
+    av_free(cr->clocks);
+    av_freep(&s->clock_recovery);
+}
+
+int av_get_clock_estimate(AVFormatContext *s, int stream_index, AVClockEstimate *est)
+{
+    RecoveredClock *c = find_clock(s->clock_recovery, -1, stream_index);
+    int i, j;
+
+    for (i = 0; !c && i < s->nb_programs; i++)
+        for (j = 0; j < s->programs[i]->nb_stream_indexes; j++)
+            if (s->programs[i]->stream_index[j] == stream_index &&
+                (c = find_clock(s->clock_recovery, s->programs[i]->id, -1)))
+                break;
+    if (!c || !c->updates)
+        return AVERROR(ENOENT);
+
+    est->source_time = av_rescale_q(c->last_ts, c->time_base, AV_TIME_BASE_Q);
+    est->local_time  = llrint((c->local_start + c->local_time) * 1000000.0);
+    /* the loop tracks local seconds per source second */
+    est->drift       = 1.0 / (ff_timefilter_eval(c->tf, 1) - ff_timefilter_eval(c->tf, 0)) - 1;
+    est->updates     = c->updates;
+    return 0;
+}
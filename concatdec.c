@@ -0,0 +1,360 @@
+/*
+ * Concatenating demuxer
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/concatdec.c
+ * Concatenating demuxer.
+ * Reads a list of files or URLs, one per line, with empty lines and lines
+ * starting with '#' skipped, and returns their packets one file after the
+ * other, with the timestamps of each following on from the end of the one
+ * before. Relative paths are relative to the list.
+ *
+ * Every file is opened and analyzed by a separate thread while the one
+ * before is read, so that the packets go on without pause at the change.
+ * The streams of the first file are those of the demuxer; the streams of
+ * the following ones are matched to them by type and codec, the others
+ * are dropped.
+ */
+
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct ConcatContext {
+    char **urls;
+    int nb_urls;
+    int cur;                    ///< index of the file being read
+    AVFormatContext *avf;       ///< the file being read
+    int *stream_map;            ///< stream of the demuxer for each stream of avf, -1 to drop it
+    int64_t offset;             ///< start of avf on the timeline of the demuxer, in AV_TIME_BASE units
+    int64_t end;                ///< end of the packets read from avf, from its start
+    AVFormatContext *next;      ///< the following file, opened ahead
+    int next_ret;
+#if HAVE_PTHREADS
+    pthread_t thread;
+    int opening;                ///< set while the thread opens next
+#endif
+} ConcatContext;
+
+static int add_url(AVFormatContext *s, const char *line)
+{
+    ConcatContext *c = s->priv_data;
+    const char *dir_end = strrchr(s->filename, '/');
+    int dir_len = dir_end && line[0] != '/' && !strchr(line, ':') ?
+                  dir_end + 1 - s->filename : 0;
+    char *url;
+    void *tmp;
+
+    if (!(url = av_malloc(dir_len + strlen(line) + 1)))
+        return AVERROR(ENOMEM);
+    memcpy(url, s->filename, dir_len);
+    strcpy(url + dir_len, line);
+    tmp = av_realloc(c->urls, (c->nb_urls + 1) * sizeof(*c->urls));
+    if (!tmp) {
+        av_free(url);
+        return AVERROR(ENOMEM);
+    }
+    c->urls = tmp;
+    c->urls[c->nb_urls++] = url;
+    return 0;
+}
+
+static int open_file(AVFormatContext *s, int idx, AVFormatContext **avf)
+{
+    ConcatContext *c = s->priv_data;
+    int ret;
+
+    if ((ret = av_open_input_file(avf, c->urls[idx], NULL, 0, NULL)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not open '%s'\n", c->urls[idx]);
+        return ret;
+    }
+    if ((ret = av_find_stream_info(*avf)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not find the streams of '%s'\n", c->urls[idx]);
+        av_close_input_file(*avf);
+        *avf = NULL;
+    }
+    return ret;
+}
+
+#if HAVE_PTHREADS
+static void *open_thread(void *arg)
+{
+    AVFormatContext *s = arg;
+    ConcatContext *c = s->priv_data;
+
+    c->next_ret = open_file(s, c->cur + 1, &c->next);
+    return NULL;
+}
+#endif
+
+/**
+ * Start opening the file following the current one.
+ */
+static void open_ahead(AVFormatContext *s)
+{
+#if HAVE_PTHREADS
+    ConcatContext *c = s->priv_data;
+
+    if (c->cur + 1 >= c->nb_urls)
+        return;
+    c->next     = NULL;
+    c->next_ret = 0;
+    if (!pthread_create(&c->thread, NULL, open_thread, s))
+        c->opening = 1;
+#endif
+}
+
+static int open_next(AVFormatContext *s, AVFormatContext **avf)
+{
+    ConcatContext *c = s->priv_data;
+
+#if HAVE_PTHREADS
+    if (c->opening) {
+        pthread_join(c->thread, NULL);
+        c->opening = 0;
+        *avf    = c->next;
+        c->next = NULL;
+        return c->next_ret;
+    }
+#endif
+    return open_file(s, c->cur + 1, avf);
+}
+
+static int copy_codec_params(AVCodecContext *dst, AVCodecContext *src)
+{
+    dst->codec_type            = src->codec_type;
+    dst->codec_id              = src->codec_id;
+    dst->codec_tag             = src->codec_tag;
+    dst->bit_rate              = src->bit_rate;
+    dst->time_base             = src->time_base;
+    dst->ticks_per_frame       = src->ticks_per_frame;
+    dst->width                 = src->width;
+    dst->height                = src->height;
+    dst->pix_fmt               = src->pix_fmt;
+    dst->sample_aspect_ratio   = src->sample_aspect_ratio;
+    dst->has_b_frames          = src->has_b_frames;
+    dst->sample_rate           = src->sample_rate;
+    dst->channels              = src->channels;
+    dst->channel_layout        = src->channel_layout;
+    dst->sample_fmt            = src->sample_fmt;
+    dst->frame_size            = src->frame_size;
+    dst->block_align           = src->block_align;
+    dst->bits_per_coded_sample = src->bits_per_coded_sample;
+    if (src->extradata_size) {
+        dst->extradata = av_mallocz(src->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!dst->extradata)
+            return AVERROR(ENOMEM);
+        memcpy(dst->extradata, src->extradata, src->extradata_size);
+        dst->extradata_size = src->extradata_size;
+    }
+    return 0;
+}
+
+/**
+ * Match the streams of the current file to those of the demuxer, creating
+ * them for the first file.
+ */
+static int map_streams(AVFormatContext *s)
+{
+    ConcatContext *c = s->priv_data;
+    AVFormatContext *avf = c->avf;
+    int i, j, ret, used[MAX_STREAMS] = { 0 };
+
+    av_freep(&c->stream_map);
+    if (!(c->stream_map = av_malloc(avf->nb_streams * sizeof(*c->stream_map))))
+        return AVERROR(ENOMEM);
+    for (i = 0; i < avf->nb_streams; i++) {
+        AVStream *ist = avf->streams[i], *st;
+        AVMetadataTag *tag = NULL;
+
+        c->stream_map[i] = -1;
+        if (!c->cur) {
+            if (!(st = av_new_stream(s, ist->id)))
+                return AVERROR(ENOMEM);
+            if ((ret = copy_codec_params(st->codec, ist->codec)) < 0)
+                return ret;
+            st->sample_aspect_ratio = ist->sample_aspect_ratio;
+            st->r_frame_rate        = ist->r_frame_rate;
+            st->disposition         = ist->disposition;
+            while ((tag = av_metadata_get(ist->metadata, "", tag, AV_METADATA_IGNORE_SUFFIX)))
+                av_metadata_set2(&st->metadata, tag->key, tag->value, 0);
+            av_set_pts_info(st, 64, ist->time_base.num, ist->time_base.den);
+            c->stream_map[i] = st->index;
+            continue;
+        }
+        /* the stream at the same index first, then any matching one */
+        for (j = -1; j < s->nb_streams; j++) {
+            int k = j < 0 ? i : j;
+
+            if (k < s->nb_streams && !used[k] &&
+                s->streams[k]->codec->codec_type == ist->codec->codec_type &&
+                s->streams[k]->codec->codec_id   == ist->codec->codec_id) {
+                c->stream_map[i] = k;
+                used[k] = 1;
+                break;
+            }
+        }
+        if (c->stream_map[i] < 0)
+            av_log(s, AV_LOG_WARNING, "Stream %d of '%s' matches none of the first file, dropped\n",
+                   i, c->urls[c->cur]);
+    }
+    return 0;
+}
+
+static int concat_read_close(AVFormatContext *s);
+
+static int concat_read_header(AVFormatContext *s, AVFormatParameters *ap)
+{
+    ConcatContext *c = s->priv_data;
+    char line[1024];
+    int ret;
+
+    while (url_fgets(s->pb, line, sizeof(line))) {
+        int len = strlen(line);
+
+        while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = 0;
+        if (!len || line[0] == '#')
+            continue;
+        if ((ret = add_url(s, line)) < 0)
+            goto fail;
+    }
+    if (!c->nb_urls) {
+        av_log(s, AV_LOG_ERROR, "No files listed in '%s'\n", s->filename);
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    if ((ret = open_file(s, 0, &c->avf)) < 0 ||
+        (ret = map_streams(s)) < 0)
+        goto fail;
+    open_ahead(s);
+    return 0;
+fail:
+    concat_read_close(s);
+    return ret;
+}
+
+/**
+ * Go on with the file following the current one.
+ * @return AVERROR_EOF after the last one
+ */
+static int next_file(AVFormatContext *s)
+{
+    ConcatContext *c = s->priv_data;
+    AVFormatContext *avf;
+    int ret;
+
+    if (c->cur + 1 >= c->nb_urls)
+        return AVERROR_EOF;
+    if ((ret = open_next(s, &avf)) < 0)
+        return ret;
+    /* files whose packets have no timestamps are put back to back by duration */
+    if (!c->end && c->avf->duration != AV_NOPTS_VALUE)
+        c->end = c->avf->duration;
+    c->offset += c->end;
+    c->end     = 0;
+    av_close_input_file(c->avf);
+    c->avf = avf;
+    c->cur++;
+    if ((ret = map_streams(s)) < 0)
+        return ret;
+    open_ahead(s);
+    return 0;
+}
+
+static int concat_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    ConcatContext *c = s->priv_data;
+    AVStream *ist, *st;
+    int64_t start, delta;
+    int ret;
+
+    for (;;) {
+        if ((ret = av_read_frame(c->avf, pkt)) < 0) {
+            if (ret != AVERROR_EOF && !url_feof(c->avf->pb))
+                av_log(s, AV_LOG_WARNING, "Error %d reading '%s', going on with the next file\n",
+                       ret, c->urls[c->cur]);
+            if ((ret = next_file(s)) < 0)
+                return ret;
+            continue;
+        }
+        if (c->stream_map[pkt->stream_index] >= 0)
+            break;
+        av_free_packet(pkt);
+    }
+
+    ist = c->avf->streams[pkt->stream_index];
+    st  = s->streams[c->stream_map[pkt->stream_index]];
+    pkt->stream_index = st->index;
+    if (av_dup_packet(pkt) < 0) {
+        av_free_packet(pkt);
+        return AVERROR(ENOMEM);
+    }
+
+    start = c->avf->start_time != AV_NOPTS_VALUE ? c->avf->start_time : 0;
+    if (pkt->pts != AV_NOPTS_VALUE || pkt->dts != AV_NOPTS_VALUE) {
+        int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+
+        ts = av_rescale_q(ts + pkt->duration, ist->time_base, AV_TIME_BASE_Q) - start;
+        c->end = FFMAX(c->end, ts);
+    }
+    delta = av_rescale_q(c->offset - start, AV_TIME_BASE_Q, st->time_base);
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts = av_rescale_q(pkt->pts, ist->time_base, st->time_base) + delta;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts = av_rescale_q(pkt->dts, ist->time_base, st->time_base) + delta;
+    pkt->duration = av_rescale_q(pkt->duration, ist->time_base, st->time_base);
+    return 0;
+}
+
+static int concat_read_close(AVFormatContext *s)
+{
+    ConcatContext *c = s->priv_data;
+    int i;
+
+#if HAVE_PTHREADS
+    AVFormatContext *next;
+
+    if (c->opening && open_next(s, &next) >= 0)
+        av_close_input_file(next);
+#endif
+    if (c->avf)
+        av_close_input_file(c->avf);
+    for (i = 0; i < c->nb_urls; i++)
+        av_free(c->urls[i]);
+    av_freep(&c->urls);
+    av_freep(&c->stream_map);
+    return 0;
+}
+
+AVInputFormat concat_demuxer = {
+    "concat",
+    NULL_IF_CONFIG_SMALL("concatenated files"),
+    sizeof(ConcatContext),
+    NULL,
+    concat_read_header,
+    concat_read_packet,
+    concat_read_close,
+};
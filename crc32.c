@@ -0,0 +1,141 @@
+/*
+ * CRC-32 (IEEE 802.3 / MPEG-2) with slice-by-8 tables
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/crc32.c
+ * CRC-32 with the 0x04C11DB7 polynomial as used by MPEG-TS sections, NUT
+ * and Ogg, bit exact with av_crc(av_crc_get_table(AV_CRC_32_IEEE), ...)
+ * but processing 8 bytes per table round instead of 4.
+ */
+
+#include "config.h"
+#include "libavutil/bswap.h"
+#include "libavutil/intreadwrite.h"
+#include "internal.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+static uint32_t crc_table[8][256];
+
+static void crc_init_table(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        for (c = i << 24, j = 0; j < 8; j++)
+            c = (c << 1) ^ (0x04C11DB7 & (((int32_t)c) >> 31));
+        /* same byte swapped layout as the av_crc() big endian tables */
+        crc_table[0][i] = bswap_32(c);
+    }
+    for (j = 1; j < 8; j++)
+        for (i = 0; i < 256; i++)
+            crc_table[j][i] = (crc_table[j-1][i] >> 8) ^
+                              crc_table[0][crc_table[j-1][i] & 0xFF];
+}
+
+#if HAVE_PTHREADS
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+#else
+static int crc_inited;
+#endif
+
+uint32_t ff_crc32_ieee(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const uint8_t *end = buf + len;
+
+#if HAVE_PTHREADS
+    pthread_once(&crc_once, crc_init_table);
+#else
+    if (!crc_inited) {
+        crc_init_table();
+        crc_inited = 1;
+    }
+#endif
+
+    while (end - buf >= 8) {
+        uint32_t a = crc ^ AV_RL32(buf);
+        uint32_t b = AV_RL32(buf + 4);
+        crc = crc_table[7][ a        & 0xFF] ^
+              crc_table[6][(a >>  8) & 0xFF] ^
+              crc_table[5][(a >> 16) & 0xFF] ^
+              crc_table[4][ a >> 24        ] ^
+              crc_table[3][ b        & 0xFF] ^
+              crc_table[2][(b >>  8) & 0xFF] ^
+              crc_table[1][(b >> 16) & 0xFF] ^
+              crc_table[0][ b >> 24        ];
+        buf += 8;
+    }
+    while (buf < end)
+        crc = crc_table[0][(uint8_t)crc ^ *buf++] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef TEST
+#include <stdio.h>
+#include "libavutil/crc.h"
+#include "libavutil/lfg.h"
+#include "avformat.h"
+
+#define BUF_SIZE (1 << 20)
+#define ROUNDS   256
+
+int main(void)
+{
+    static uint8_t buf[BUF_SIZE];
+    const AVCRC *ctx = av_crc_get_table(AV_CRC_32_IEEE);
+    AVLFG prng;
+    uint32_t ref = 0, crc = 0;
+    int64_t t0, t1, t2;
+    int i, len;
+
+    av_lfg_init(&prng, 1);
+    for (i = 0; i < BUF_SIZE; i++)
+        buf[i] = av_lfg_get(&prng);
+
+    /* all lengths and alignments of the tail handling */
+    for (len = 0; len < 64; len++) {
+        for (i = 0; i < 8; i++) {
+            if (av_crc(ctx, -1, buf + i, len) != ff_crc32_ieee(-1, buf + i, len)) {
+                printf("mismatch for len %d offset %d\n", len, i);
+                return 1;
+            }
+        }
+    }
+
+    t0 = av_gettime();
+    for (i = 0; i < ROUNDS; i++)
+        ref = av_crc(ctx, ref, buf, BUF_SIZE);
+    t1 = av_gettime();
+    for (i = 0; i < ROUNDS; i++)
+        crc = ff_crc32_ieee(crc, buf, BUF_SIZE);
+    t2 = av_gettime();
+
+    if (ref != crc) {
+        printf("mismatch %08x != %08x\n", crc, ref);
+        return 1;
+    }
+    printf("av_crc:        %6.3f GB/s\n", ROUNDS * (double)BUF_SIZE / 1000 / FFMAX(t1 - t0, 1));
+    printf("ff_crc32_ieee: %6.3f GB/s\n", ROUNDS * (double)BUF_SIZE / 1000 / FFMAX(t2 - t1, 1));
+    return 0;
+}
+#endif
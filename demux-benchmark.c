@@ -0,0 +1,170 @@
+/*
+ * Demuxer throughput benchmark
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/demux-benchmark.c
+ * Opens each file given on the command line, reads all its packets with
+ * av_read_frame() and does a number of random seeks, then prints one line
+ * of key=value results per file, so that runs over the same corpus can be
+ * compared over time.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "config.h"
+#if HAVE_GETRUSAGE
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "libavutil/lfg.h"
+#include "libavformat/avformat.h"
+
+#undef exit
+
+typedef struct BenchResult {
+    int64_t open_time;          ///< av_open_input_file() and av_find_stream_info()
+    int64_t read_time;
+    int64_t packets;
+    int64_t bytes;
+    int seeks, seek_errors;
+    int64_t seek_time, seek_max;
+    int64_t buffer_peak;
+} BenchResult;
+
+static int64_t max_rss(void)
+{
+#if HAVE_GETRUSAGE
+    struct rusage rusage;
+
+    getrusage(RUSAGE_SELF, &rusage);
+    return rusage.ru_maxrss;
+#else
+    return -1;
+#endif
+}
+
+static int bench_file(const char *filename, int nb_seeks, AVLFG *prng,
+                      const char **format, BenchResult *r)
+{
+    AVFormatContext *ic;
+    AVPacket pkt;
+    int64_t t, start, duration;
+    int i, ret;
+
+    memset(r, 0, sizeof(*r));
+
+    t = av_gettime();
+    if ((ret = av_open_input_file(&ic, filename, NULL, 0, NULL)) < 0)
+        return ret;
+    if ((ret = av_find_stream_info(ic)) < 0) {
+        av_close_input_file(ic);
+        return ret;
+    }
+    r->open_time = av_gettime() - t;
+    *format = ic->iformat->name;
+
+    t = av_gettime();
+    while (av_read_frame(ic, &pkt) >= 0) {
+        r->packets++;
+        r->bytes += pkt.size;
+        av_free_packet(&pkt);
+    }
+    r->read_time = av_gettime() - t;
+
+    start    = ic->start_time != AV_NOPTS_VALUE ? ic->start_time : 0;
+    duration = ic->duration;
+    for (i = 0; i < nb_seeks && duration > 0; i++) {
+        int64_t ts = start + av_lfg_get(prng) * (double)duration / UINT32_MAX;
+
+        t = av_gettime();
+        ret = av_seek_frame(ic, -1, ts, AVSEEK_FLAG_BACKWARD);
+        /* a seek is only done once the packet after it is available */
+        if (ret >= 0 && (ret = av_read_frame(ic, &pkt)) >= 0)
+            av_free_packet(&pkt);
+        t = av_gettime() - t;
+
+        r->seeks++;
+        if (ret < 0)
+            r->seek_errors++;
+        r->seek_time += t;
+        r->seek_max   = FFMAX(r->seek_max, t);
+    }
+    r->buffer_peak = ic->buffer_memory_peak;
+
+    av_close_input_file(ic);
+    return 0;
+}
+
+static void usage(void)
+{
+    printf("usage: demux-benchmark [-n seeks] [-s seed] file...\n"
+           "Reads all packets of each file and seeks randomly in it, printing\n"
+           "one line of key=value results per file.\n");
+}
+
+int main(int argc, char **argv)
+{
+    AVLFG prng;
+    BenchResult r;
+    const char *format;
+    int nb_seeks = 20, seed = 1, c, ret, failed = 0;
+
+    while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+        switch (c) {
+        case 'n': nb_seeks = atoi(optarg); break;
+        case 's': seed     = atoi(optarg); break;
+        default:  usage(); return c != 'h';
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    av_register_all();
+    av_log_set_level(AV_LOG_ERROR);
+    av_lfg_init(&prng, seed);
+
+    for (; optind < argc; optind++) {
+        const char *filename = argv[optind];
+        double read_s;
+
+        if ((ret = bench_file(filename, nb_seeks, &prng, &format, &r)) < 0) {
+            printf("file=%s error=%d\n", filename, ret);
+            failed = 1;
+            continue;
+        }
+        read_s = FFMAX(r.read_time, 1) / 1000000.0;
+        printf("file=%s format=%s open_us=%"PRId64" packets=%"PRId64" bytes=%"PRId64
+               " packets_per_s=%.0f mb_per_s=%.3f seeks=%d seek_errors=%d"
+               " seek_avg_us=%"PRId64" seek_max_us=%"PRId64
+               " buffer_peak=%"PRId64" maxrss_kb=%"PRId64"\n",
+               filename, format, r.open_time, r.packets, r.bytes,
+               r.packets / read_s, r.bytes / read_s / (1 << 20),
+               r.seeks, r.seek_errors, r.seeks ? r.seek_time / r.seeks : 0,
+               r.seek_max, r.buffer_peak, max_rss());
+        fflush(stdout);
+    }
+    return failed;
+}
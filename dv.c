@@ -44,6 +44,7 @@ struct DVDemuxContext {
     int               ach;
     int               frames;
     uint64_t          abytes;
+    uint16_t          audio_12to16[4096]; /* 12bit sample -> 16bit linear, 0x800 silenced */
 };
 
 static inline uint16_t dv_audio_12to16(uint16_t sample)
@@ -100,13 +101,13 @@ static const uint8_t* dv_extract_pack(uint8_t* frame, enum dv_pack_type t)
  * 3. Audio is always returned as 16bit linear samples: 12bit nonlinear samples
  *    are converted into 16bit linear ones.
  */
-static int dv_extract_audio(uint8_t* frame, uint8_t* ppcm[4],
-                            const DVprofile *sys)
+static int dv_extract_audio(DVDemuxContext *c, uint8_t* frame, uint8_t* ppcm[4])
 {
-    int size, chan, i, j, d, of, smpls, freq, quant, half_ch;
-    uint16_t lc, rc;
+    const DVprofile *sys = c->sys;
+    int size, chan, i, j, k, n, of, smpls, freq, quant, half_ch, stride;
     const uint8_t* as_pack;
-    uint8_t *pcm, ipcm;
+    const uint8_t *src;
+    uint8_t *pcm, *dst, *dst2, ipcm;
 
     as_pack = dv_extract_pack(frame, dv_audio_source);
     if (!as_pack)    /* No audio ? */
@@ -121,6 +122,7 @@ static int dv_extract_audio(uint8_t* frame, uint8_t* ppcm[4],
 
     size = (sys->audio_min_samples[freq] + smpls) * 4; /* 2ch, 2bytes */
     half_ch = sys->difseg_size / 2;
+    stride  = sys->audio_stride;
 
     /* We work with 720p frames split in half, thus even frames have
      * channels 0,1 and odd 2,3. */
@@ -141,35 +143,25 @@ static int dv_extract_audio(uint8_t* frame, uint8_t* ppcm[4],
 
             /* for each AV sequence */
             for (j = 0; j < 9; j++) {
-                for (d = 8; d < 80; d += 2) {
-                    if (quant == 0) {  /* 16bit quantization */
-                        of = sys->audio_shuffle[i][j] + (d - 8) / 2 * sys->audio_stride;
-                        if (of*2 >= size)
-                            continue;
-
-                        pcm[of*2]   = frame[d+1]; // FIXME: maybe we have to admit
-                        pcm[of*2+1] = frame[d];   //        that DV is a big-endian PCM
-                        if (pcm[of*2+1] == 0x80 && pcm[of*2] == 0x00)
-                            pcm[of*2+1] = 0;
-                    } else {           /* 12bit quantization */
-                        lc = ((uint16_t)frame[d]   << 4) |
-                             ((uint16_t)frame[d+2] >> 4);
-                        rc = ((uint16_t)frame[d+1] << 4) |
-                             ((uint16_t)frame[d+2] & 0x0f);
-                        lc = (lc == 0x800 ? 0 : dv_audio_12to16(lc));
-                        rc = (rc == 0x800 ? 0 : dv_audio_12to16(rc));
-
-                        of = sys->audio_shuffle[i%half_ch][j] + (d - 8) / 3 * sys->audio_stride;
-                        if (of*2 >= size)
-                            continue;
-
-                        pcm[of*2]   = lc & 0xff; // FIXME: maybe we have to admit
-                        pcm[of*2+1] = lc >> 8;   //        that DV is a big-endian PCM
-                        of = sys->audio_shuffle[i%half_ch+half_ch][j] +
-                            (d - 8) / 3 * sys->audio_stride;
-                        pcm[of*2]   = rc & 0xff; // FIXME: maybe we have to admit
-                        pcm[of*2+1] = rc >> 8;   //        that DV is a big-endian PCM
-                        ++d;
+                src = frame + 8;
+                if (quant == 0) {  /* 16bit quantization */
+                    /* the samples of a DIF block are stride apart in the
+                       output, only those before size are stored */
+                    of = sys->audio_shuffle[i][j];
+                    n  = of*2 < size ? FFMIN(36, (size/2 - of + stride - 1) / stride) : 0;
+                    for (k = 0, dst = pcm + of*2; k < n; k++, src += 2, dst += 2*stride) {
+                        unsigned v = AV_RB16(src); // FIXME: maybe we have to admit
+                                                   //        that DV is a big-endian PCM
+                        AV_WL16(dst, v == 0x8000 ? 0 : v);
+                    }
+                } else {           /* 12bit quantization */
+                    of = sys->audio_shuffle[i%half_ch][j];
+                    n  = of*2 < size ? FFMIN(24, (size/2 - of + stride - 1) / stride) : 0;
+                    dst  = pcm + of*2;
+                    dst2 = pcm + sys->audio_shuffle[i%half_ch+half_ch][j]*2;
+                    for (k = 0; k < n; k++, src += 3, dst += 2*stride, dst2 += 2*stride) {
+                        AV_WL16(dst,  c->audio_12to16[(src[0] << 4) | (src[2] >> 4)]);
+                        AV_WL16(dst2, c->audio_12to16[(src[1] << 4) | (src[2] & 0x0f)]);
                     }
                 }
 
@@ -272,6 +264,7 @@ static int dv_extract_video_info(DVDemuxContext *c, uint8_t* frame)
 DVDemuxContext* dv_init_demux(AVFormatContext *s)
 {
     DVDemuxContext *c;
+    int i;
 
     c = av_mallocz(sizeof(DVDemuxContext));
     if (!c)
@@ -289,6 +282,8 @@ DVDemuxContext* dv_init_demux(AVFormatContext *s)
     c->ach    = 0;
     c->frames = 0;
     c->abytes = 0;
+    for (i = 0; i < 4096; i++)
+        c->audio_12to16[i] = i == 0x800 ? 0 : dv_audio_12to16(i);
 
     c->vst->codec->codec_type = CODEC_TYPE_VIDEO;
     c->vst->codec->codec_id   = CODEC_ID_DVVIDEO;
@@ -335,7 +330,7 @@ int dv_produce_packet(DVDemuxContext *c, AVPacket *pkt,
        c->audio_pkt[i].pts  = c->abytes * 30000*8 / c->ast[i]->codec->bit_rate;
        ppcm[i] = c->audio_buf[i];
     }
-    dv_extract_audio(buf, ppcm, c->sys);
+    dv_extract_audio(c, buf, ppcm);
 
     /* We work with 720p frames split in half, thus even frames have
      * channels 0,1 and odd 2,3. */
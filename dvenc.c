@@ -33,6 +33,10 @@
 #include "libavcodec/dvdata.h"
 #include "dv.h"
 #include "libavutil/fifo.h"
+#include "libavutil/intreadwrite.h"
+
+/** number of video frames that can wait for their audio */
+#define DV_FRAME_POOL 4
 
 struct DVMuxContext {
     const DVprofile*  sys;           /* current DV profile, e.g.: 525/60, 625/50 */
@@ -42,8 +46,10 @@ struct DVMuxContext {
     int               frames;        /* current frame number */
     time_t            start_time;    /* recording start time */
     int               has_audio;     /* frame under contruction has audio */
-    int               has_video;     /* frame under contruction has video */
-    uint8_t           frame_buf[DV_MAX_FRAME_SIZE]; /* frame under contruction */
+    int               has_video;     /* number of frames in the pool waiting for audio */
+    int               first_frame;   /* pool index of the oldest of them */
+    uint8_t          *frame_pool[DV_FRAME_POOL]; /* frames under construction, allocated on use */
+    uint8_t           audio_buf[8192]; /* audio of a frame wrapping around the end of its FIFO */
 };
 
 static const int dv_aaux_packs_dist[12][9] = {
@@ -177,21 +183,33 @@ static int dv_write_pack(enum dv_pack_type pack_id, DVMuxContext *c, uint8_t* bu
 
 static void dv_inject_audio(DVMuxContext *c, int channel, uint8_t* frame_ptr)
 {
-    int i, j, d, of, size;
+    AVFifoBuffer *fifo = c->audio_data[channel];
+    int i, j, k, n, of, size, stride = c->sys->audio_stride;
+    const uint8_t *pcm;
+
     size = 4 * dv_audio_frame_size(c->sys, c->frames);
+    /* read the samples in place unless they wrap around the end of the FIFO */
+    if (fifo->end - fifo->rptr >= size) {
+        pcm = fifo->rptr;
+    } else {
+        memcpy(c->audio_buf, fifo->rptr, fifo->end - fifo->rptr);
+        memcpy(c->audio_buf + (fifo->end - fifo->rptr), fifo->buffer,
+               size - (fifo->end - fifo->rptr));
+        pcm = c->audio_buf;
+    }
+
     frame_ptr += channel * c->sys->difseg_size * 150 * 80;
     for (i = 0; i < c->sys->difseg_size; i++) {
         frame_ptr += 6 * 80; /* skip DIF segment header */
         for (j = 0; j < 9; j++) {
             dv_write_pack(dv_aaux_packs_dist[i][j], c, &frame_ptr[3], i >= c->sys->difseg_size/2);
-            for (d = 8; d < 80; d+=2) {
-                of = c->sys->audio_shuffle[i][j] + (d - 8)/2 * c->sys->audio_stride;
-                if (of*2 >= size)
-                    continue;
-
-                frame_ptr[d]   = av_fifo_peek(c->audio_data[channel], of*2+1); // FIXME: maybe we have to admit
-                frame_ptr[d+1] = av_fifo_peek(c->audio_data[channel], of*2);   //        that DV is a big-endian PCM
-            }
+            /* the samples of a DIF block are stride apart in the input,
+               only those before size are written */
+            of = c->sys->audio_shuffle[i][j];
+            n  = of*2 < size ? FFMIN(36, (size/2 - of + stride - 1) / stride) : 0;
+            for (k = 0; k < n; k++)
+                AV_WB16(&frame_ptr[8 + 2*k], AV_RL16(pcm + (of + k*stride)*2)); // FIXME: maybe we have to admit
+                                                                                 //        that DV is a big-endian PCM
             frame_ptr += 16 * 80; /* 15 Video DIFs + 1 Audio DIF */
         }
     }
@@ -233,19 +251,26 @@ static void dv_inject_metadata(DVMuxContext *c, uint8_t* frame)
 int dv_assemble_frame(DVMuxContext *c, AVStream* st,
                       uint8_t* data, int data_size, uint8_t** frame)
 {
-    int i, reqasize;
+    int i, reqasize, slot;
 
-    *frame = &c->frame_buf[0];
     reqasize = 4 * dv_audio_frame_size(c->sys, c->frames);
 
     switch (st->codec->codec_type) {
     case CODEC_TYPE_VIDEO:
         /* FIXME: we have to have more sensible approach than this one */
-        if (c->has_video)
+        if (c->has_video == DV_FRAME_POOL) {
             av_log(st->codec, AV_LOG_ERROR, "Can't process DV frame #%d. Insufficient audio data or severe sync problem.\n", c->frames);
-
-        memcpy(*frame, data, c->sys->frame_size);
-        c->has_video = 1;
+            c->has_video--; /* replace the newest frame */
+        }
+        if (data_size < c->sys->frame_size)
+            return AVERROR(EINVAL);
+
+        slot = (c->first_frame + c->has_video) % DV_FRAME_POOL;
+        if (!c->frame_pool[slot] &&
+            !(c->frame_pool[slot] = av_malloc(c->sys->frame_size)))
+            return AVERROR(ENOMEM);
+        memcpy(c->frame_pool[slot], data, c->sys->frame_size);
+        c->has_video++;
         break;
     case CODEC_TYPE_AUDIO:
         for (i = 0; i < c->n_ast && st != c->ast[i]; i++);
@@ -264,16 +289,21 @@ int dv_assemble_frame(DVMuxContext *c, AVStream* st,
     }
 
     /* Let us see if we have enough data to construct one DV frame. */
-    if (c->has_video == 1 && c->has_audio + 1 == 1 << c->n_ast) {
+    if (c->has_video && c->has_audio + 1 == 1 << c->n_ast) {
+        *frame = c->frame_pool[c->first_frame];
         dv_inject_metadata(c, *frame);
         c->has_audio = 0;
         for (i=0; i < c->n_ast; i++) {
             dv_inject_audio(c, i, *frame);
             av_fifo_drain(c->audio_data[i], reqasize);
-            c->has_audio |= ((reqasize <= av_fifo_size(c->audio_data[i])) << i);
         }
 
-        c->has_video = 0;
+        c->has_video--;
+        c->first_frame = (c->first_frame + 1) % DV_FRAME_POOL;
+        /* the next frame may need a different amount of audio */
+        reqasize = 4 * dv_audio_frame_size(c->sys, c->frames + 1);
+        for (i=0; i < c->n_ast; i++)
+            c->has_audio |= ((reqasize <= av_fifo_size(c->audio_data[i])) << i);
 
         c->frames++;
 
@@ -334,6 +364,7 @@ DVMuxContext* dv_init_mux(AVFormatContext* s)
     c->frames     = 0;
     c->has_audio  = 0;
     c->has_video  = 0;
+    c->first_frame = 0;
     c->start_time = (time_t)s->timestamp;
 
     for (i=0; i < c->n_ast; i++) {
@@ -357,6 +388,8 @@ void dv_delete_mux(DVMuxContext *c)
     int i;
     for (i=0; i < c->n_ast; i++)
         av_fifo_free(c->audio_data[i]);
+    for (i=0; i < DV_FRAME_POOL; i++)
+        av_freep(&c->frame_pool[i]);
 }
 
 #if CONFIG_DV_MUXER
@@ -379,6 +412,8 @@ static int dv_write_packet(struct AVFormatContext *s, AVPacket *pkt)
 
     fsize = dv_assemble_frame(s->priv_data, s->streams[pkt->stream_index],
                               pkt->data, pkt->size, &frame);
+    if (fsize < 0)
+        return fsize;
     if (fsize > 0) {
         put_buffer(s->pb, frame, fsize);
         put_flush_packet(s->pb);
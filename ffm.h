@@ -35,6 +35,10 @@
 #define FLAG_KEY_FRAME       0x01
 #define FLAG_DTS             0x02
 
+/* page index sidecar: this header, then the be64 dts of page i at 8 * i */
+#define FFM_PAGE_INDEX_TAG    MKTAG('F', 'F', 'M', 'P')
+#define FFM_PAGE_INDEX_SUFFIX ".ffpages"
+
 enum {
     READ_HEADER,
     READ_DATA,
@@ -53,6 +57,11 @@ typedef struct FFMContext {
     int64_t dts;
     uint8_t *packet_ptr, *packet_end;
     uint8_t packet[FFM_PACKET_SIZE];
+
+    /* page index, with AVFMT_FLAG_FFM_PAGE_INDEX */
+    ByteIOContext *index_pb;    ///< writing: sidecar
+    int64_t *page_dts;          ///< reading: dts of each page, AV_NOPTS_VALUE if unknown
+    int nb_pages;
 } FFMContext;
 
 #endif /* AVFORMAT_FFM_H */
@@ -22,6 +22,67 @@
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
 #include "ffm.h"
+
+/* forget the dts of the pages the writer went over from write index from to to */
+static void ffm_invalidate_pages(FFMContext *ffm, int64_t from, int64_t to)
+{
+    int i, page;
+
+    if (!ffm->page_dts || from < FFM_PACKET_SIZE || to < FFM_PACKET_SIZE)
+        return;
+    page = from / FFM_PACKET_SIZE;
+    for (i = 0; i < ffm->nb_pages && page != to / FFM_PACKET_SIZE; i++) {
+        if (page < ffm->nb_pages)
+            ffm->page_dts[page] = AV_NOPTS_VALUE;
+        if (++page >= ffm->nb_pages)
+            page = 1;
+    }
+}
+
+static void ffm_set_page_dts(FFMContext *ffm, int64_t pos, int64_t dts)
+{
+    if (ffm->page_dts && !(pos % FFM_PACKET_SIZE) && pos / FFM_PACKET_SIZE < ffm->nb_pages)
+        ffm->page_dts[pos / FFM_PACKET_SIZE] = dts;
+}
+
+/**
+ * Loads the dts of the pages written by the muxer to the sidecar.
+ */
+static void ffm_load_page_index(AVFormatContext *s)
+{
+    FFMContext *ffm = s->priv_data;
+    ByteIOContext *pb;
+    char filename[1024];
+    int i, nb_entries;
+
+    snprintf(filename, sizeof(filename), "%s" FFM_PAGE_INDEX_SUFFIX, s->filename);
+    if (url_fopen(&pb, filename, URL_RDONLY) < 0)
+        return;
+    if (get_le32(pb) == FFM_PAGE_INDEX_TAG && get_be32(pb) == ffm->packet_size) {
+        nb_entries = FFMIN(url_fsize(pb) / 8, ffm->nb_pages);
+        for (i = 1; i < nb_entries && !url_feof(pb); i++)
+            ffm->page_dts[i] = get_be64(pb);
+    }
+    url_fclose(pb);
+}
+
+static int ffm_init_page_index(AVFormatContext *s)
+{
+    FFMContext *ffm = s->priv_data;
+    int64_t nb_pages = ffm->file_size / FFM_PACKET_SIZE;
+    int i;
+
+    if (nb_pages <= 1 || nb_pages > INT_MAX / sizeof(*ffm->page_dts))
+        return 0;
+    if (!(ffm->page_dts = av_malloc(nb_pages * sizeof(*ffm->page_dts))))
+        return AVERROR(ENOMEM);
+    ffm->nb_pages = nb_pages;
+    for (i = 0; i < nb_pages; i++)
+        ffm->page_dts[i] = AV_NOPTS_VALUE;
+    ffm_load_page_index(s);
+    return 0;
+}
+
 #if CONFIG_FFSERVER
 #include <unistd.h>
 
@@ -51,11 +112,46 @@ int ffm_write_write_index(int fd, int64_t pos)
 void ffm_set_write_index(AVFormatContext *s, int64_t pos, int64_t file_size)
 {
     FFMContext *ffm = s->priv_data;
+    ffm_invalidate_pages(ffm, ffm->write_index, pos);
     ffm->write_index = pos;
     ffm->file_size = file_size;
 }
 #endif // CONFIG_FFSERVER
 
+/**
+ * Reads the write index the writer publishes in the header of a feed read
+ * through a memory mapping, which costs no system call, and maps the feed
+ * again if the writer went past the end of the mapping.
+ */
+static void ffm_update_mapped_write_index(AVFormatContext *s)
+{
+    FFMContext *ffm = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    const volatile uint8_t *p = pb->map + 8;
+    uint8_t buf[8];
+    int64_t index, prev;
+    int i;
+
+    if (!ffm->write_index || pb->map_size < FFM_PACKET_SIZE)
+        return;
+    /* the writer updates it with a plain write(), so read it until two
+       reads give the same value */
+    index = -1;
+    do {
+        prev = index;
+        for (i = 0; i < 8; i++)
+            buf[i] = p[i];
+        index = AV_RB64(buf);
+    } while (index != prev);
+    if (index < FFM_PACKET_SIZE || index % FFM_PACKET_SIZE)
+        return;
+    if (index > pb->map_size && (url_fremap(pb) < 0 || index > pb->map_size))
+        return;
+    ffm->file_size   = FFMAX(ffm->file_size, pb->map_size);
+    ffm_invalidate_pages(ffm, ffm->write_index, index);
+    ffm->write_index = index;
+}
+
 static int ffm_is_avail_data(AVFormatContext *s, int size)
 {
     FFMContext *ffm = s->priv_data;
@@ -65,6 +161,8 @@ static int ffm_is_avail_data(AVFormatContext *s, int size)
     len = ffm->packet_end - ffm->packet_ptr;
     if (size <= len)
         return 1;
+    if (s->pb->map)
+        ffm_update_mapped_write_index(s);
     pos = url_ftell(s->pb);
     if (!ffm->write_index) {
         if (pos == ffm->file_size)
@@ -107,6 +205,7 @@ static int ffm_read_data(AVFormatContext *s,
     FFMContext *ffm = s->priv_data;
     ByteIOContext *pb = s->pb;
     int len, fill_size, size1, frame_offset, id;
+    int64_t pos;
 
     size1 = size;
     while (size > 0) {
@@ -120,12 +219,16 @@ static int ffm_read_data(AVFormatContext *s,
             if (url_ftell(pb) == ffm->file_size)
                 url_fseek(pb, ffm->packet_size, SEEK_SET);
     retry_read:
+            pos = url_ftell(pb);
             id = get_be16(pb); /* PACKET_ID */
-            if (id != PACKET_ID)
+            if (id != PACKET_ID) {
                 if (ffm_resync(s, id) < 0)
                     return -1;
+                pos = url_ftell(pb) - 2;
+            }
             fill_size = get_be16(pb);
             ffm->dts = get_be64(pb);
+            ffm_set_page_dts(ffm, pos, ffm->dts);
             frame_offset = get_be16(pb);
             get_buffer(pb, ffm->packet, ffm->packet_size - FFM_HEADER_SIZE);
             ffm->packet_end = ffm->packet + (ffm->packet_size - FFM_HEADER_SIZE - fill_size);
@@ -187,8 +290,10 @@ static int64_t get_dts(AVFormatContext *s, int64_t pos)
     int64_t dts;
 
     ffm_seek1(s, pos);
+    pos = url_ftell(pb);
     url_fskip(pb, 4);
     dts = get_be64(pb);
+    ffm_set_page_dts(s->priv_data, pos, dts);
 #ifdef DEBUG_SEEK
     av_log(s, AV_LOG_DEBUG, "dts=%0.6f\n", dts / 1000000.0);
 #endif
@@ -379,6 +484,8 @@ static int ffm_read_header(AVFormatContext *s, AVFormatParameters *ap)
     ffm->dts = 0;
     ffm->read_state = READ_HEADER;
     ffm->first_packet = 1;
+    if ((s->flags & AVFMT_FLAG_FFM_PAGE_INDEX) && !url_is_streamed(pb))
+        return ffm_init_page_index(s);
     return 0;
  fail:
     for(i=0;i<s->nb_streams;i++) {
@@ -451,6 +558,24 @@ static int ffm_read_packet(AVFormatContext *s, AVPacket *pkt)
     return 0;
 }
 
+/**
+ * Returns the dts of the page at pos from the page index if it is known,
+ * reading it otherwise.
+ */
+static int64_t get_page_dts(AVFormatContext *s, int64_t pos)
+{
+    FFMContext *ffm = s->priv_data;
+    int64_t page;
+
+    pos  = FFMIN(pos, ffm->file_size - FFM_PACKET_SIZE);
+    pos  = FFMAX(pos, FFM_PACKET_SIZE);
+    page = pos / FFM_PACKET_SIZE;
+    if (!(pos % FFM_PACKET_SIZE) && page < ffm->nb_pages &&
+        ffm->page_dts[page] != AV_NOPTS_VALUE)
+        return ffm->page_dts[page];
+    return get_dts(s, pos);
+}
+
 /* seek to a given time in the file. The file read pointer is
    positioned at or before pts. XXX: the following code is quite
    approximative */
@@ -460,17 +585,22 @@ static int ffm_seek(AVFormatContext *s, int stream_index, int64_t wanted_pts, in
     int64_t pos_min, pos_max, pos;
     int64_t pts_min, pts_max, pts;
     double pos1;
+    int i, retried = 0;
 
 #ifdef DEBUG_SEEK
     av_log(s, AV_LOG_DEBUG, "wanted_pts=%0.6f\n", wanted_pts / 1000000.0);
 #endif
+    /* pages added by the muxer since the last seek */
+    if (ffm->page_dts)
+        ffm_load_page_index(s);
+ redo:
     /* find the position using linear interpolation (better than
        dichotomy in typical cases) */
     pos_min = FFM_PACKET_SIZE;
     pos_max = ffm->file_size - FFM_PACKET_SIZE;
     while (pos_min <= pos_max) {
-        pts_min = get_dts(s, pos_min);
-        pts_max = get_dts(s, pos_max);
+        pts_min = get_page_dts(s, pos_min);
+        pts_max = get_page_dts(s, pos_max);
         /* linear interpolation */
         pos1 = (double)(pos_max - pos_min) * (double)(wanted_pts - pts_min) /
             (double)(pts_max - pts_min);
@@ -479,7 +609,7 @@ static int ffm_seek(AVFormatContext *s, int stream_index, int64_t wanted_pts, in
             pos = pos_min;
         else if (pos >= pos_max)
             pos = pos_max;
-        pts = get_dts(s, pos);
+        pts = get_page_dts(s, pos);
         /* check if we are lucky */
         if (pts == wanted_pts) {
             goto found;
@@ -492,6 +622,17 @@ static int ffm_seek(AVFormatContext *s, int stream_index, int64_t wanted_pts, in
     pos = (flags & AVSEEK_FLAG_BACKWARD) ? pos_min : pos_max;
 
  found:
+    /* the search only used the index if the page it found is still as
+       indexed, as the feed may have been rewritten since */
+    if (ffm->page_dts && !retried) {
+        pts = get_page_dts(s, pos);
+        if (get_dts(s, pos) != pts) {
+            for (i = 0; i < ffm->nb_pages; i++)
+                ffm->page_dts[i] = AV_NOPTS_VALUE;
+            retried = 1;
+            goto redo;
+        }
+    }
     ffm_seek1(s, pos);
 
     /* reset read state */
@@ -503,6 +644,15 @@ static int ffm_seek(AVFormatContext *s, int stream_index, int64_t wanted_pts, in
     return 0;
 }
 
+static int ffm_read_close(AVFormatContext *s)
+{
+    FFMContext *ffm = s->priv_data;
+
+    av_freep(&ffm->page_dts);
+    ffm->nb_pages = 0;
+    return 0;
+}
+
 static int ffm_probe(AVProbeData *p)
 {
     if (
@@ -519,6 +669,6 @@ AVInputFormat ffm_demuxer = {
     ffm_probe,
     ffm_read_header,
     ffm_read_packet,
-    NULL,
+    ffm_read_close,
     ffm_seek,
 };
@@ -35,6 +35,12 @@ static void flush_packet(AVFormatContext *s)
     if (url_ftell(pb) % ffm->packet_size)
         av_abort();
 
+    if (ffm->index_pb) {
+        url_fseek(ffm->index_pb, url_ftell(pb) / ffm->packet_size * 8, SEEK_SET);
+        put_be64(ffm->index_pb, ffm->dts);
+        put_flush_packet(ffm->index_pb);
+    }
+
     /* put header */
     put_be16(pb, PACKET_ID);
     put_be16(pb, fill_size);
@@ -90,6 +96,18 @@ static int ffm_write_header(AVFormatContext *s)
 
     ffm->packet_size = FFM_PACKET_SIZE;
 
+    if ((s->flags & AVFMT_FLAG_FFM_PAGE_INDEX) && !url_is_streamed(pb)) {
+        char filename[1024];
+
+        snprintf(filename, sizeof(filename), "%s" FFM_PAGE_INDEX_SUFFIX, s->filename);
+        if (url_fopen(&ffm->index_pb, filename, URL_WRONLY) < 0) {
+            av_log(s, AV_LOG_WARNING, "Could not open page index %s\n", filename);
+        } else {
+            put_le32(ffm->index_pb, FFM_PAGE_INDEX_TAG);
+            put_be32(ffm->index_pb, ffm->packet_size);
+        }
+    }
+
     /* header */
     put_le32(pb, MKTAG('F', 'F', 'M', '1'));
     put_be32(pb, ffm->packet_size);
@@ -237,6 +255,10 @@ static int ffm_write_trailer(AVFormatContext *s)
 
     put_flush_packet(pb);
 
+    if (ffm->index_pb) {
+        url_fclose(ffm->index_pb);
+        ffm->index_pb = NULL;
+    }
     return 0;
 }
 
@@ -28,6 +28,13 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#if HAVE_AIO_H
+#include <aio.h>
+#endif
 #include "os_support.h"
 
 
@@ -128,3 +135,498 @@ URLProtocol pipe_protocol = {
     file_write,
     .url_get_file_handle = file_get_handle,
 };
+
+/* memory mapped file protocol */
+
+typedef struct {
+    int fd;
+    uint8_t *data;  ///< mapping of the whole file, NULL if it could not be mapped
+    int64_t size;
+    int64_t pos;
+} MMapContext;
+
+static int mmap_open(URLContext *h, const char *filename, int flags)
+{
+    MMapContext *c;
+#if HAVE_MMAP
+    struct stat st;
+#endif
+
+    if (flags & (URL_WRONLY | URL_RDWR))
+        return AVERROR(EINVAL);
+
+    av_strstart(filename, "mmap:", &filename);
+
+    c = av_mallocz(sizeof(MMapContext));
+    if (!c)
+        return AVERROR(ENOMEM);
+    c->fd = open(filename, O_RDONLY);
+    if (c->fd == -1) {
+        av_free(c);
+        return AVERROR(ENOENT);
+    }
+#if HAVE_MMAP
+    /* fall back to plain reads for anything that cannot be mapped,
+       e.g. empty files or files larger than the address space */
+    if (!fstat(c->fd, &st) && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && st.st_size == (size_t)st.st_size) {
+        c->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (c->data == MAP_FAILED)
+            c->data = NULL;
+        else
+            c->size = st.st_size;
+    }
+#endif
+    h->priv_data = c;
+    return 0;
+}
+
+static int mmap_read(URLContext *h, unsigned char *buf, int size)
+{
+    MMapContext *c = h->priv_data;
+
+    if (!c->data)
+        return read(c->fd, buf, size);
+    size = FFMIN(size, c->size - c->pos);
+    if (size <= 0)
+        return 0;
+    memcpy(buf, c->data + c->pos, size);
+    c->pos += size;
+    return size;
+}
+
+static int64_t mmap_seek(URLContext *h, int64_t pos, int whence)
+{
+    MMapContext *c = h->priv_data;
+
+    if (!c->data)
+        return whence == AVSEEK_SIZE ? AVERROR(ENOSYS) : lseek(c->fd, pos, whence);
+
+    switch (whence) {
+    case AVSEEK_SIZE: return c->size;
+    case SEEK_SET:                  break;
+    case SEEK_CUR:    pos += c->pos;  break;
+    case SEEK_END:    pos += c->size; break;
+    default:          return AVERROR(EINVAL);
+    }
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    return c->pos = pos;
+}
+
+static int mmap_close(URLContext *h)
+{
+    MMapContext *c = h->priv_data;
+    int ret;
+
+#if HAVE_MMAP
+    if (c->data)
+        munmap(c->data, c->size);
+#endif
+    ret = close(c->fd);
+    av_free(c);
+    return ret;
+}
+
+static int mmap_get_handle(URLContext *h)
+{
+    MMapContext *c = h->priv_data;
+    return c->fd;
+}
+
+static int64_t mmap_get_map(URLContext *h, const uint8_t **buf)
+{
+    MMapContext *c = h->priv_data;
+#if HAVE_MMAP
+    struct stat st;
+#endif
+
+    if (!c->data)
+        return AVERROR(ENOSYS);
+#if HAVE_MMAP
+    /* map again files that grew, keeping the old mapping should that fail */
+    if (!fstat(c->fd, &st) && st.st_size > c->size &&
+        st.st_size == (size_t)st.st_size) {
+        uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (data != MAP_FAILED) {
+            munmap(c->data, c->size);
+            c->data = data;
+            c->size = st.st_size;
+        }
+    }
+#endif
+    *buf = c->data;
+    return c->size;
+}
+
+URLProtocol mmap_protocol = {
+    "mmap",
+    mmap_open,
+    mmap_read,
+    NULL,
+    mmap_seek,
+    mmap_close,
+    .url_get_file_handle = mmap_get_handle,
+    .url_get_map         = mmap_get_map,
+};
+
+/* asynchronous file protocol, keeps AIO_DEPTH reads queued ahead of the
+ * read position */
+
+#define AIO_BLOCK_SIZE (256 * 1024)
+#define AIO_DEPTH      8
+
+typedef struct {
+    int fd;
+    int64_t pos;        ///< logical read position
+    int64_t size;
+#if HAVE_AIO_H
+    struct aiocb cb[AIO_DEPTH];
+    uint8_t *buf[AIO_DEPTH];
+    int queued[AIO_DEPTH];  ///< a read was submitted for the block
+    int head;           ///< block containing base
+    int64_t base;       ///< file offset of the head block, -1 if nothing is queued
+#endif
+} AIOFileContext;
+
+#if HAVE_AIO_H
+static void aiofile_submit(AIOFileContext *c, int i, int64_t off)
+{
+    c->queued[i] = 0;
+    if (c->size >= 0 && off >= c->size)
+        return;
+    memset(&c->cb[i], 0, sizeof(c->cb[i]));
+    c->cb[i].aio_fildes = c->fd;
+    c->cb[i].aio_buf    = c->buf[i];
+    c->cb[i].aio_nbytes = AIO_BLOCK_SIZE;
+    c->cb[i].aio_offset = off;
+    c->queued[i] = !aio_read(&c->cb[i]);
+    if (!c->queued[i]) {
+        /* queue full or no AIO support at runtime, read synchronously */
+        ssize_t ret = pread(c->fd, c->buf[i], AIO_BLOCK_SIZE, off);
+        c->cb[i].aio_nbytes = FFMAX(ret, 0);
+    }
+}
+
+/**
+ * Wait for the read of block i and return its result.
+ */
+static int aiofile_wait(AIOFileContext *c, int i)
+{
+    const struct aiocb *list[1];
+
+    if (!c->queued[i])
+        return 0;
+    list[0] = &c->cb[i];
+    while (aio_error(&c->cb[i]) == EINPROGRESS)
+        aio_suspend(list, 1, NULL);
+    c->queued[i] = 0;
+    return aio_return(&c->cb[i]);
+}
+
+static void aiofile_reset(AIOFileContext *c, int64_t pos)
+{
+    int i;
+
+    aio_cancel(c->fd, NULL);
+    for (i = 0; i < AIO_DEPTH; i++)
+        aiofile_wait(c, i);
+    c->head = 0;
+    c->base = pos < 0 ? -1 : pos - pos % AIO_BLOCK_SIZE;
+    if (pos >= 0)
+        for (i = 0; i < AIO_DEPTH; i++)
+            aiofile_submit(c, i, c->base + (int64_t)i * AIO_BLOCK_SIZE);
+}
+#endif
+
+static int aiofile_open(URLContext *h, const char *filename, int flags)
+{
+    AIOFileContext *c;
+    struct stat st;
+#if HAVE_AIO_H
+    int i;
+#endif
+
+    if (flags & (URL_WRONLY | URL_RDWR))
+        return AVERROR(EINVAL);
+
+    av_strstart(filename, "aio:", &filename);
+
+    c = av_mallocz(sizeof(AIOFileContext));
+    if (!c)
+        return AVERROR(ENOMEM);
+    c->fd = open(filename, O_RDONLY);
+    if (c->fd == -1) {
+        av_free(c);
+        return AVERROR(ENOENT);
+    }
+    c->size = !fstat(c->fd, &st) && S_ISREG(st.st_mode) ? st.st_size : -1;
+#if HAVE_AIO_H
+    for (i = 0; i < AIO_DEPTH; i++) {
+        if (!(c->buf[i] = av_malloc(AIO_BLOCK_SIZE))) {
+            while (i--)
+                av_free(c->buf[i]);
+            close(c->fd);
+            av_free(c);
+            return AVERROR(ENOMEM);
+        }
+    }
+    aiofile_reset(c, 0);
+#endif
+    h->priv_data = c;
+    return 0;
+}
+
+static int aiofile_read(URLContext *h, unsigned char *buf, int size)
+{
+    AIOFileContext *c = h->priv_data;
+#if HAVE_AIO_H
+    int64_t end = c->base + (int64_t)AIO_DEPTH * AIO_BLOCK_SIZE;
+    int ret, len;
+
+    if (c->base < 0 || c->pos < c->base || c->pos >= end)
+        aiofile_reset(c, c->pos);
+    /* recycle the blocks before the read position */
+    while (c->pos >= c->base + AIO_BLOCK_SIZE) {
+        aiofile_wait(c, c->head);
+        aiofile_submit(c, c->head, c->base + (int64_t)AIO_DEPTH * AIO_BLOCK_SIZE);
+        c->head  = (c->head + 1) % AIO_DEPTH;
+        c->base += AIO_BLOCK_SIZE;
+    }
+    if (c->queued[c->head]) {
+        ret = aiofile_wait(c, c->head);
+        if (ret < 0)
+            return AVERROR(EIO);
+        /* keep the result in aio_nbytes until the block is recycled */
+        c->cb[c->head].aio_nbytes = ret;
+    } else if (c->size >= 0 && c->base >= c->size) {
+        return 0;
+    }
+    len = FFMIN(size, (int64_t)c->cb[c->head].aio_nbytes - (c->pos - c->base));
+    if (len <= 0)
+        return 0;
+    memcpy(buf, c->buf[c->head] + c->pos - c->base, len);
+    c->pos += len;
+    return len;
+#else
+    return read(c->fd, buf, size);
+#endif
+}
+
+static int64_t aiofile_seek(URLContext *h, int64_t pos, int whence)
+{
+    AIOFileContext *c = h->priv_data;
+
+    if (whence == AVSEEK_SIZE)
+        return c->size >= 0 ? c->size : AVERROR(ENOSYS);
+#if HAVE_AIO_H
+    if (whence == SEEK_CUR)
+        pos += c->pos;
+    else if (whence == SEEK_END)
+        pos += c->size;
+    if (pos < 0 || (whence == SEEK_END && c->size < 0))
+        return AVERROR(EINVAL);
+    c->pos = pos;
+    return pos;
+#else
+    return lseek(c->fd, pos, whence);
+#endif
+}
+
+static int aiofile_close(URLContext *h)
+{
+    AIOFileContext *c = h->priv_data;
+    int ret;
+#if HAVE_AIO_H
+    int i;
+
+    aiofile_reset(c, -1);
+    for (i = 0; i < AIO_DEPTH; i++)
+        av_free(c->buf[i]);
+#endif
+    ret = close(c->fd);
+    av_free(c);
+    return ret;
+}
+
+static int aiofile_get_handle(URLContext *h)
+{
+    AIOFileContext *c = h->priv_data;
+    return c->fd;
+}
+
+URLProtocol aio_protocol = {
+    "aio",
+    aiofile_open,
+    aiofile_read,
+    NULL,
+    aiofile_seek,
+    aiofile_close,
+    .url_get_file_handle = aiofile_get_handle,
+};
+
+/* output protocol writing through O_DIRECT, bypassing the page cache */
+
+#define DIRECT_ALIGN    4096
+#define DIRECT_BUF_SIZE (4 << 20)
+
+typedef struct {
+    int fd;             ///< O_DIRECT descriptor, same as bfd if not available
+    int bfd;            ///< buffered descriptor for unaligned writes
+    uint8_t *mem;
+    uint8_t *buf;       ///< DIRECT_ALIGN aligned window of DIRECT_BUF_SIZE bytes
+    int64_t buf_off;    ///< file offset of buf, multiple of DIRECT_BUF_SIZE
+    int buf_len;        ///< valid bytes in buf
+    int64_t pos;
+    int64_t size;
+} DirectContext;
+
+/**
+ * Write out the window, aligned whole blocks directly and the
+ * remainder through the page cache.
+ */
+static int direct_flush(DirectContext *c)
+{
+    int aligned = c->buf_len & ~(DIRECT_ALIGN - 1);
+
+    if (aligned && pwrite(c->fd, c->buf, aligned, c->buf_off) != aligned)
+        return AVERROR(EIO);
+    if (c->buf_len > aligned &&
+        pwrite(c->bfd, c->buf + aligned, c->buf_len - aligned,
+               c->buf_off + aligned) != c->buf_len - aligned)
+        return AVERROR(EIO);
+    return 0;
+}
+
+/**
+ * Set the window to the one containing pos, loading what the file
+ * already holds there so that it is not overwritten later.
+ */
+static int direct_load(DirectContext *c, int64_t pos)
+{
+    c->buf_off = pos - pos % DIRECT_BUF_SIZE;
+    c->buf_len = 0;
+    if (c->size > c->buf_off) {
+        c->buf_len = FFMIN(c->size - c->buf_off, DIRECT_BUF_SIZE);
+        if (pread(c->bfd, c->buf, c->buf_len, c->buf_off) != c->buf_len)
+            return AVERROR(EIO);
+    }
+    return 0;
+}
+
+static int direct_open(URLContext *h, const char *filename, int flags)
+{
+    DirectContext *c;
+
+    if (!(flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+
+    av_strstart(filename, "direct:", &filename);
+
+    c = av_mallocz(sizeof(DirectContext));
+    if (!c)
+        return AVERROR(ENOMEM);
+    c->mem = av_malloc(DIRECT_BUF_SIZE + DIRECT_ALIGN);
+    if (!c->mem) {
+        av_free(c);
+        return AVERROR(ENOMEM);
+    }
+    c->buf = c->mem + (-(intptr_t)c->mem & (DIRECT_ALIGN - 1));
+    c->bfd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (c->bfd == -1) {
+        av_free(c->mem);
+        av_free(c);
+        return AVERROR(ENOENT);
+    }
+    c->fd = -1;
+#ifdef O_DIRECT
+    c->fd = open(filename, O_WRONLY | O_DIRECT);
+#endif
+    /* e.g. tmpfs does not support O_DIRECT */
+    if (c->fd == -1)
+        c->fd = c->bfd;
+    h->priv_data = c;
+    return 0;
+}
+
+static int direct_write(URLContext *h, unsigned char *buf, int size)
+{
+    DirectContext *c = h->priv_data;
+    int done = 0, len, ret;
+
+    while (done < size) {
+        int64_t pos = c->pos + done;
+
+        if (pos < c->buf_off) {
+            /* patching data that has been written already */
+            len = FFMIN(size - done, c->buf_off - pos);
+            if (pwrite(c->bfd, buf + done, len, pos) != len)
+                return AVERROR(EIO);
+        } else {
+            if (pos >= c->buf_off + DIRECT_BUF_SIZE &&
+                ((ret = direct_flush(c)) < 0 || (ret = direct_load(c, pos)) < 0))
+                return ret;
+            len = FFMIN(size - done, c->buf_off + DIRECT_BUF_SIZE - pos);
+            /* a skipped range reads as zeroes like in a sparse file */
+            if (pos - c->buf_off > c->buf_len)
+                memset(c->buf + c->buf_len, 0, pos - c->buf_off - c->buf_len);
+            memcpy(c->buf + pos - c->buf_off, buf + done, len);
+            c->buf_len = FFMAX(c->buf_len, pos + len - c->buf_off);
+            c->size    = FFMAX(c->size, pos + len);
+            if (c->buf_len == DIRECT_BUF_SIZE) {
+                if (pwrite(c->fd, c->buf, DIRECT_BUF_SIZE, c->buf_off) != DIRECT_BUF_SIZE ||
+                    (ret = direct_load(c, c->buf_off + DIRECT_BUF_SIZE)) < 0)
+                    return AVERROR(EIO);
+            }
+        }
+        done += len;
+    }
+    c->pos += size;
+    return size;
+}
+
+static int64_t direct_seek(URLContext *h, int64_t pos, int whence)
+{
+    DirectContext *c = h->priv_data;
+
+    if (whence == AVSEEK_SIZE)
+        return c->size;
+    if (whence == SEEK_CUR)
+        pos += c->pos;
+    else if (whence == SEEK_END)
+        pos += c->size;
+    if (pos < 0)
+        return AVERROR(EINVAL);
+    c->pos = pos;
+    return pos;
+}
+
+static int direct_close(URLContext *h)
+{
+    DirectContext *c = h->priv_data;
+    int ret = direct_flush(c);
+
+    if (c->fd != c->bfd)
+        close(c->fd);
+    if (close(c->bfd) < 0 && !ret)
+        ret = AVERROR(EIO);
+    av_free(c->mem);
+    av_free(c);
+    return ret;
+}
+
+static int direct_get_handle(URLContext *h)
+{
+    DirectContext *c = h->priv_data;
+    return c->bfd;
+}
+
+URLProtocol direct_protocol = {
+    "direct",
+    direct_open,
+    NULL,
+    direct_write,
+    direct_seek,
+    direct_close,
+    .url_get_file_handle = direct_get_handle,
+};
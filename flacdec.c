@@ -19,19 +19,50 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavutil/crc.h"
+#include "libavutil/intreadwrite.h"
 #include "libavcodec/flac.h"
 #include "avformat.h"
 #include "raw.h"
 #include "id3v2.h"
 #include "oggdec.h"
 
+#define SEEKPOINT_SIZE          18
+#define SEEKPOINT_PLACEHOLDER   UINT64_C(0xFFFFFFFFFFFFFFFF)
+#define FRAME_HEADER_SIZE_MAX   16
+
+typedef struct {
+    int blocksize;      ///< of fixed blocksize streams, 0 without STREAMINFO
+} FLACDecContext;
+
+/**
+ * Add the points of a SEEKTABLE block to the index.
+ * @param offset position of the first frame, which the points are relative to
+ */
+static void flac_parse_seektable(AVStream *st, const uint8_t *buf, int size,
+                                 int64_t offset)
+{
+    const uint8_t *end = buf + size - SEEKPOINT_SIZE;
+
+    for (; buf <= end; buf += SEEKPOINT_SIZE) {
+        uint64_t sample = AV_RB64(buf);
+        if (sample == SEEKPOINT_PLACEHOLDER)
+            continue;
+        av_add_index_entry(st, offset + AV_RB64(buf + 8), sample, 0, 0,
+                           AVINDEX_KEYFRAME);
+    }
+}
+
 static int flac_read_header(AVFormatContext *s,
                              AVFormatParameters *ap)
 {
+    FLACDecContext *flac = s->priv_data;
     uint8_t buf[ID3v2_HEADER_SIZE];
     int ret, metadata_last=0, metadata_type, metadata_size, found_streaminfo=0;
     uint8_t header[4];
     uint8_t *buffer=NULL;
+    uint8_t *seektable = NULL;
+    int seektable_size = 0;
     AVStream *st = av_new_stream(s, 0);
     if (!st)
         return AVERROR(ENOMEM);
@@ -64,20 +95,25 @@ static int flac_read_header(AVFormatContext *s,
         /* allocate and read metadata block for supported types */
         case FLAC_METADATA_TYPE_STREAMINFO:
         case FLAC_METADATA_TYPE_VORBIS_COMMENT:
+        case FLAC_METADATA_TYPE_SEEKTABLE:
             buffer = av_mallocz(metadata_size + FF_INPUT_BUFFER_PADDING_SIZE);
             if (!buffer) {
+                av_freep(&seektable);
                 return AVERROR_NOMEM;
             }
             if (get_buffer(s->pb, buffer, metadata_size) != metadata_size) {
                 av_freep(&buffer);
+                av_freep(&seektable);
                 return AVERROR_IO;
             }
             break;
         /* skip metadata block for unsupported types */
         default:
             ret = url_fseek(s->pb, metadata_size, SEEK_CUR);
-            if (ret < 0)
+            if (ret < 0) {
+                av_freep(&seektable);
                 return ret;
+            }
         }
 
         if (metadata_type == FLAC_METADATA_TYPE_STREAMINFO) {
@@ -104,11 +140,13 @@ static int flac_read_header(AVFormatContext *s,
                 av_set_pts_info(st, 64, 1, si.samplerate);
                 if (si.samples > 0)
                     st->duration = si.samples;
+                flac->blocksize = si.max_blocksize;
             }
         } else {
             /* STREAMINFO must be the first block */
             if (!found_streaminfo) {
                 av_freep(&buffer);
+                av_freep(&seektable);
                 return AVERROR_INVALIDDATA;
             }
             /* process supported blocks other than STREAMINFO */
@@ -117,13 +155,99 @@ static int flac_read_header(AVFormatContext *s,
                     av_log(s, AV_LOG_WARNING, "error parsing VorbisComment metadata\n");
                 }
             }
+            /* the points are relative to the first frame, after the last block */
+            if (metadata_type == FLAC_METADATA_TYPE_SEEKTABLE && !seektable) {
+                seektable      = buffer;
+                seektable_size = metadata_size;
+                buffer = NULL;
+            }
             av_freep(&buffer);
         }
     }
 
+    if (seektable && flac->blocksize)
+        flac_parse_seektable(st, seektable, seektable_size, url_ftell(s->pb));
+    av_freep(&seektable);
     return 0;
 }
 
+/**
+ * Check a frame header with its CRC.
+ * @return the number of the first sample of the frame, or AV_NOPTS_VALUE
+ *         if buf does not start with a valid frame header
+ */
+static int64_t flac_frame_sample(FLACDecContext *flac, const uint8_t *buf, int size)
+{
+    int bs_code  = buf[2] >> 4;
+    int sr_code  = buf[2] & 0xF;
+    int ch_mode  = buf[3] >> 4;
+    int bps_code = buf[3] >> 1 & 7;
+    int variable = buf[1] & 1;
+    int i, len, n = 4;
+    uint64_t num;
+
+    if (!bs_code || sr_code == 15 || ch_mode > 10 ||
+        bps_code == 3 || bps_code == 7 || buf[3] & 1)
+        return AV_NOPTS_VALUE;
+
+    /* frame or sample number, coded like UTF-8 */
+    num = buf[n++];
+    if (num & 0x80) {
+        if ((num & 0xC0) == 0x80 || num == 0xFF)
+            return AV_NOPTS_VALUE;
+        for (len = 1; num & (0x80 >> len); len++);
+        num &= 0x7F >> len;
+        for (i = 1; i < len; i++, n++) {
+            if ((buf[n] & 0xC0) != 0x80)
+                return AV_NOPTS_VALUE;
+            num = num << 6 | (buf[n] & 0x3F);
+        }
+    }
+    if      (bs_code == 6) n += 1;
+    else if (bs_code == 7) n += 2;
+    if      (sr_code == 12) n += 1;
+    else if (sr_code == 13 || sr_code == 14) n += 2;
+
+    if (n >= size ||
+        av_crc(av_crc_get_table(AV_CRC_8_ATM), 0, buf, n) != buf[n])
+        return AV_NOPTS_VALUE;
+    return variable ? num : num * flac->blocksize;
+}
+
+/**
+ * Find the first frame at or after *ppos, for av_seek_frame_binary()
+ * bisecting on frame sync codes.
+ */
+static int64_t flac_read_timestamp(AVFormatContext *s, int stream_index,
+                                   int64_t *ppos, int64_t pos_limit)
+{
+    FLACDecContext *flac = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    uint8_t buf[FRAME_HEADER_SIZE_MAX];
+    unsigned state = 0;
+    int64_t pos, ts;
+    int len;
+
+    if (!flac->blocksize || url_fseek(pb, *ppos, SEEK_SET) < 0)
+        return AV_NOPTS_VALUE;
+
+    while (!url_feof(pb)) {
+        state = (state << 8 | get_byte(pb)) & 0xFFFF;
+        if ((state & 0xFFFE) != 0xFFF8)
+            continue;
+        pos = url_ftell(pb) - 2;
+        AV_WB16(buf, state);
+        len = get_buffer(pb, buf + 2, FRAME_HEADER_SIZE_MAX - 2) + 2;
+        if (len >= 6 && (ts = flac_frame_sample(flac, buf, len)) != AV_NOPTS_VALUE) {
+            *ppos = pos;
+            return ts;
+        }
+        url_fseek(pb, pos + 2, SEEK_SET);
+        state = 0;
+    }
+    return AV_NOPTS_VALUE;
+}
+
 static int flac_probe(AVProbeData *p)
 {
     uint8_t *bufptr = p->buf;
@@ -139,10 +263,13 @@ static int flac_probe(AVProbeData *p)
 AVInputFormat flac_demuxer = {
     "flac",
     NULL_IF_CONFIG_SMALL("raw FLAC"),
-    0,
+    sizeof(FLACDecContext),
     flac_probe,
     flac_read_header,
     ff_raw_read_partial_packet,
+    NULL,
+    NULL,
+    flac_read_timestamp,
     .flags= AVFMT_GENERIC_INDEX,
     .extensions = "flac",
     .value = CODEC_ID_FLAC,
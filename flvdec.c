@@ -28,6 +28,7 @@
 #include "libavcodec/bytestream.h"
 #include "libavcodec/mpeg4audio.h"
 #include "avformat.h"
+#include "internal.h"
 #include "flv.h"
 
 typedef struct {
@@ -118,6 +119,68 @@ static int amf_get_string(ByteIOContext *ioc, char *buffer, int buffsize) {
     return length;
 }
 
+/**
+ * Add the "filepositions" and "times" arrays of the "keyframes" object
+ * that many writers put in onMetaData to the index of the video stream.
+ * The object is read again by the caller to skip it.
+ */
+static void parse_keyframes_index(AVFormatContext *s, AVStream *vstream, int64_t max_pos) {
+    ByteIOContext *ioc = s->pb;
+    int64_t initial_pos = url_ftell(ioc);
+    int64_t *filepositions = NULL;
+    double *times = NULL;
+    unsigned int timeslen = 0, fileposlen = 0, arraylen, i;
+    char str_val[256];
+
+    while (url_ftell(ioc) < max_pos - 2 && amf_get_string(ioc, str_val, sizeof(str_val)) > 0) {
+        int is_times = !strcmp(str_val, "times");
+
+        if (!is_times && strcmp(str_val, "filepositions"))
+            break;
+        if (get_byte(ioc) != AMF_DATA_TYPE_ARRAY)
+            break;
+        arraylen = get_be32(ioc);
+        /* every element takes 9 bytes */
+        if (arraylen > (max_pos - url_ftell(ioc)) / 9 ||
+            (is_times && times) || (!is_times && filepositions))
+            break;
+
+        if (is_times) {
+            times = av_malloc(arraylen * sizeof(*times));
+            timeslen = arraylen;
+        } else {
+            filepositions = av_malloc(arraylen * sizeof(*filepositions));
+            fileposlen = arraylen;
+        }
+        if ((is_times && !times) || (!is_times && !filepositions))
+            break;
+
+        for (i = 0; i < arraylen; i++) {
+            if (get_byte(ioc) != AMF_DATA_TYPE_NUMBER)
+                goto end;
+            if (is_times)
+                times[i] = av_int2dbl(get_be64(ioc));
+            else
+                filepositions[i] = av_int2dbl(get_be64(ioc));
+        }
+        if (times && filepositions)
+            break;
+    }
+
+    if (times && filepositions && timeslen == fileposlen) {
+        /* index positions are those of the previous tag size, see flv_read_packet() */
+        for (i = 0; i < timeslen; i++)
+            if (filepositions[i] >= 4)
+                av_add_index_entry(vstream, filepositions[i] - 4, times[i] * 1000,
+                                   0, 0, AVINDEX_KEYFRAME);
+    }
+
+end:
+    av_free(times);
+    av_free(filepositions);
+    url_fseek(ioc, initial_pos, SEEK_SET);
+}
+
 static int amf_parse_object(AVFormatContext *s, AVStream *astream, AVStream *vstream, const char *key, int64_t max_pos, int depth) {
     AVCodecContext *acodec, *vcodec;
     ByteIOContext *ioc;
@@ -142,6 +205,10 @@ static int amf_parse_object(AVFormatContext *s, AVStream *astream, AVStream *vst
         case AMF_DATA_TYPE_OBJECT: {
             unsigned int keylen;
 
+            if (depth == 1 && key && vstream && !strcmp(key, "keyframes") &&
+                !(s->flags & AVFMT_FLAG_IGNIDX) && !url_is_streamed(ioc))
+                parse_keyframes_index(s, vstream, max_pos);
+
             while(url_ftell(ioc) < max_pos - 2 && (keylen = get_be16(ioc))) {
                 url_fskip(ioc, keylen); //skip key string
                 if(amf_parse_object(s, NULL, NULL, NULL, max_pos, depth + 1) < 0)
@@ -425,7 +492,7 @@ static int flv_read_packet(AVFormatContext *s, AVPacket *pkt)
     if (!size)
         return AVERROR(EAGAIN);
 
-    ret= av_get_packet(s->pb, pkt, size);
+    ret= ff_get_packet(s, s->pb, pkt, size);
     if (ret < 0) {
         return AVERROR(EIO);
     }
@@ -18,6 +18,7 @@
  * License along with FFmpeg; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
+#include "libavcodec/bytestream.h"
 #include "avformat.h"
 #include "flv.h"
 #include "riff.h"
@@ -54,6 +55,9 @@ typedef struct FLVContext {
     int64_t filesize_offset;
     int64_t duration;
     int delay; ///< first dts delay for AVC
+    int live;  ///< flush each tag and do not patch the header in the trailer
+    uint8_t *nal_buf;          ///< H.264 converted to length prefixed NAL units, kept across packets
+    unsigned int nal_buf_size;
 } FLVContext;
 
 static int get_audio_flags(AVCodecContext *enc){
@@ -155,14 +159,36 @@ static void put_amf_bool(ByteIOContext *pb, int b) {
     put_byte(pb, !!b);
 }
 
+/**
+ * Write a tag with timestamp 0 and the data of dyn_bc, which is freed.
+ * @return the position of the data of the tag
+ */
+static int64_t flv_write_dyn_tag(ByteIOContext *pb, int type, ByteIOContext *dyn_bc)
+{
+    uint8_t *buf;
+    int size = url_close_dyn_buf(dyn_bc, &buf);
+    int64_t pos;
+
+    put_byte(pb, type);
+    put_be24(pb, size);
+    put_be24(pb, 0); // ts
+    put_byte(pb, 0); // ts ext
+    put_be24(pb, 0); // streamid
+    pos = url_ftell(pb);
+    put_buffer(pb, buf, size);
+    put_be32(pb, size + 11); // previous tag size
+    av_free(buf);
+    return pos;
+}
+
 static int flv_write_header(AVFormatContext *s)
 {
-    ByteIOContext *pb = s->pb;
+    ByteIOContext *pb = s->pb, *dyn_bc;
     FLVContext *flv = s->priv_data;
     AVCodecContext *audio_enc = NULL, *video_enc = NULL;
-    int i;
+    int i, ret;
     double framerate = 0.0;
-    int metadata_size_pos, data_size;
+    int64_t pos, duration_offset = 0, filesize_offset = 0;
 
     for(i=0; i<s->nb_streams; i++){
         AVCodecContext *enc = s->streams[i]->codec;
@@ -184,6 +210,8 @@ static int flv_write_header(AVFormatContext *s)
         }
         av_set_pts_info(s->streams[i], 32, 1, 1000); /* 32 bit pts in ms */
     }
+    flv->live = (s->flags & AVFMT_FLAG_LIVE) || url_is_streamed(pb);
+
     put_tag(pb,"FLV");
     put_byte(pb,1);
     put_byte(pb,   FLV_HEADER_FLAG_HASAUDIO * !!audio_enc
@@ -202,14 +230,10 @@ static int flv_write_header(AVFormatContext *s)
         }
     }
 
-    /* write meta_tag */
-    put_byte(pb, 18);         // tag type META
-    metadata_size_pos= url_ftell(pb);
-    put_be24(pb, 0);          // size of data part (sum of all parts below)
-    put_be24(pb, 0);          // time stamp
-    put_be32(pb, 0);          // reserved
-
-    /* now data of data_size size */
+    /* write meta_tag, built in memory so that its size is known */
+    if ((ret = url_open_dyn_buf(&dyn_bc)) < 0)
+        return ret;
+    pb = dyn_bc;
 
     /* first event name as a string */
     put_byte(pb, AMF_DATA_TYPE_STRING);
@@ -217,11 +241,14 @@ static int flv_write_header(AVFormatContext *s)
 
     /* mixed array (hash) with size and string/type/data tuples */
     put_byte(pb, AMF_DATA_TYPE_MIXEDARRAY);
-    put_be32(pb, 5*!!video_enc + 5*!!audio_enc + 2); // +2 for duration and file size
+    put_be32(pb, 5*!!video_enc + 5*!!audio_enc + 2*!flv->live); // +2 for duration and file size
 
-    put_amf_string(pb, "duration");
-    flv->duration_offset= url_ftell(pb);
-    put_amf_double(pb, 0); // delayed write
+    /* live output has no size or duration to tell */
+    if (!flv->live) {
+        put_amf_string(pb, "duration");
+        duration_offset = url_ftell(pb);
+        put_amf_double(pb, 0); // delayed write
+    }
 
     if(video_enc){
         put_amf_string(pb, "width");
@@ -257,31 +284,26 @@ static int flv_write_header(AVFormatContext *s)
         put_amf_double(pb, audio_enc->codec_tag);
     }
 
-    put_amf_string(pb, "filesize");
-    flv->filesize_offset= url_ftell(pb);
-    put_amf_double(pb, 0); // delayed write
+    if (!flv->live) {
+        put_amf_string(pb, "filesize");
+        filesize_offset = url_ftell(pb);
+        put_amf_double(pb, 0); // delayed write
+    }
 
     put_amf_string(pb, "");
     put_byte(pb, AMF_END_OF_OBJECT);
 
-    /* write total size of tag */
-    data_size= url_ftell(pb) - metadata_size_pos - 10;
-    url_fseek(pb, metadata_size_pos, SEEK_SET);
-    put_be24(pb, data_size);
-    url_fseek(pb, data_size + 10 - 3, SEEK_CUR);
-    put_be32(pb, data_size + 11);
+    pb = s->pb;
+    pos = flv_write_dyn_tag(pb, FLV_TAG_TYPE_META, dyn_bc);
+    flv->duration_offset = pos + duration_offset;
+    flv->filesize_offset = pos + filesize_offset;
 
     for (i = 0; i < s->nb_streams; i++) {
         AVCodecContext *enc = s->streams[i]->codec;
         if (enc->codec_id == CODEC_ID_AAC || enc->codec_id == CODEC_ID_H264) {
-            int64_t pos;
-            put_byte(pb, enc->codec_type == CODEC_TYPE_VIDEO ?
-                     FLV_TAG_TYPE_VIDEO : FLV_TAG_TYPE_AUDIO);
-            put_be24(pb, 0); // size patched later
-            put_be24(pb, 0); // ts
-            put_byte(pb, 0); // ts ext
-            put_be24(pb, 0); // streamid
-            pos = url_ftell(pb);
+            if ((ret = url_open_dyn_buf(&dyn_bc)) < 0)
+                return ret;
+            pb = dyn_bc;
             if (enc->codec_id == CODEC_ID_AAC) {
                 put_byte(pb, get_audio_flags(enc));
                 put_byte(pb, 0); // AAC sequence header
@@ -292,14 +314,14 @@ static int flv_write_header(AVFormatContext *s)
                 put_be24(pb, 0); // composition time
                 ff_isom_write_avcc(pb, enc->extradata, enc->extradata_size);
             }
-            data_size = url_ftell(pb) - pos;
-            url_fseek(pb, -data_size - 10, SEEK_CUR);
-            put_be24(pb, data_size);
-            url_fseek(pb, data_size + 10 - 3, SEEK_CUR);
-            put_be32(pb, data_size + 11); // previous tag size
+            pb = s->pb;
+            flv_write_dyn_tag(pb, enc->codec_type == CODEC_TYPE_VIDEO ?
+                              FLV_TAG_TYPE_VIDEO : FLV_TAG_TYPE_AUDIO, dyn_bc);
         }
     }
 
+    put_flush_packet(pb);
+
     return 0;
 }
 
@@ -313,12 +335,16 @@ static int flv_write_trailer(AVFormatContext *s)
     file_size = url_ftell(pb);
 
     /* update informations */
-    url_fseek(pb, flv->duration_offset, SEEK_SET);
-    put_amf_double(pb, flv->duration / (double)1000);
-    url_fseek(pb, flv->filesize_offset, SEEK_SET);
-    put_amf_double(pb, file_size);
+    if (!flv->live) {
+        url_fseek(pb, flv->duration_offset, SEEK_SET);
+        put_amf_double(pb, flv->duration / (double)1000);
+        url_fseek(pb, flv->filesize_offset, SEEK_SET);
+        put_amf_double(pb, file_size);
 
-    url_fseek(pb, file_size, SEEK_SET);
+        url_fseek(pb, file_size, SEEK_SET);
+    }
+    put_flush_packet(pb);
+    av_freep(&flv->nal_buf);
     return 0;
 }
 
@@ -330,7 +356,8 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
     unsigned ts;
     int size= pkt->size;
     uint8_t *data= NULL;
-    int flags, flags_size;
+    uint8_t header[16], *p = header;
+    int flags, flags_size, type;
 
 //    av_log(s, AV_LOG_DEBUG, "type:%d pts: %"PRId64" size:%d\n", enc->codec_type, timestamp, size);
 
@@ -343,7 +370,7 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
         flags_size= 1;
 
     if (enc->codec_type == CODEC_TYPE_VIDEO) {
-        put_byte(pb, FLV_TAG_TYPE_VIDEO);
+        type = FLV_TAG_TYPE_VIDEO;
 
         flags = enc->codec_tag;
         if(flags == 0) {
@@ -358,44 +385,50 @@ static int flv_write_packet(AVFormatContext *s, AVPacket *pkt)
 
         assert(size);
 
-        put_byte(pb, FLV_TAG_TYPE_AUDIO);
+        type = FLV_TAG_TYPE_AUDIO;
     }
 
     if (enc->codec_id == CODEC_ID_H264) {
         /* check if extradata looks like mp4 formated */
         if (enc->extradata_size > 0 && *(uint8_t*)enc->extradata != 1) {
-            if (ff_avc_parse_nal_units_buf(pkt->data, &data, &size) < 0)
-                return -1;
+            if ((size = ff_avc_convert_nal_units(pkt->data, pkt->size,
+                                                 &flv->nal_buf, &flv->nal_buf_size)) < 0)
+                return size;
+            data = flv->nal_buf;
         }
         if (!flv->delay && pkt->dts < 0)
             flv->delay = -pkt->dts;
     }
 
+    /* the tag header is assembled first and written at once */
     ts = pkt->dts + flv->delay; // add delay to force positive dts
-    put_be24(pb,size + flags_size);
-    put_be24(pb,ts);
-    put_byte(pb,(ts >> 24) & 0x7F); // timestamps are 32bits _signed_
-    put_be24(pb,flv->reserved);
-    put_byte(pb,flags);
+    bytestream_put_byte(&p, type);
+    bytestream_put_be24(&p, size + flags_size);
+    bytestream_put_be24(&p, ts);
+    bytestream_put_byte(&p, (ts >> 24) & 0x7F); // timestamps are 32bits _signed_
+    bytestream_put_be24(&p, flv->reserved);
+    bytestream_put_byte(&p, flags);
     if (enc->codec_id == CODEC_ID_VP6)
-        put_byte(pb,0);
+        bytestream_put_byte(&p, 0);
     if (enc->codec_id == CODEC_ID_VP6F)
-        put_byte(pb, enc->extradata_size ? enc->extradata[0] : 0);
+        bytestream_put_byte(&p, enc->extradata_size ? enc->extradata[0] : 0);
     else if (enc->codec_id == CODEC_ID_AAC)
-        put_byte(pb,1); // AAC raw
+        bytestream_put_byte(&p, 1); // AAC raw
     else if (enc->codec_id == CODEC_ID_H264) {
-        put_byte(pb,1); // AVC NALU
-        put_be24(pb,pkt->pts - pkt->dts);
+        bytestream_put_byte(&p, 1); // AVC NALU
+        bytestream_put_be24(&p, pkt->pts - pkt->dts);
     }
+    put_buffer(pb, header, p - header);
 
     put_buffer(pb, data ? data : pkt->data, size);
 
     put_be32(pb,size+flags_size+11); // previous tag size
     flv->duration = FFMAX(flv->duration, pkt->pts + flv->delay + pkt->duration);
 
-    put_flush_packet(pb);
+    /* files are written in full I/O buffers, live output tag by tag */
+    if (flv->live)
+        put_flush_packet(pb);
 
-    av_free(data);
 
     return 0;
 }
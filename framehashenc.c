@@ -0,0 +1,298 @@
+/*
+ * frame hash muxer (for codec/format verification)
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/framehashenc.c
+ * Writes one line with the hash of each packet, like the framecrc muxer,
+ * with the algorithm chosen by AVFormatContext.hash_algorithm. With
+ * hash_threads the packets are hashed by the thread pool; the lines are
+ * still written in packet order. Output is not flushed per packet.
+ */
+
+#include "libavutil/adler32.h"
+#include "libavutil/crc.h"
+#include "libavutil/md5.h"
+#include "libavutil/intreadwrite.h"
+#include "avformat.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include "threadpool.h"
+#endif
+
+#define MAX_HASH_JOBS 64
+
+/* formatted hash, "0x" and 8 hex digits or 32 hex digits for MD5 */
+#define HASH_STRING_SIZE 33
+
+typedef struct HashJob {
+    int stream_index;
+    int64_t dts;
+    int size;
+    uint8_t *data;              ///< copy of the payload, reused across packets
+    unsigned int data_size;
+    char hash[HASH_STRING_SIZE];
+#if HAVE_PTHREADS
+    int done;
+#endif
+} HashJob;
+
+typedef struct FrameHashContext {
+    int algorithm;
+    const AVCRC *crc_table;
+    HashJob job;                ///< used without threads
+#if HAVE_PTHREADS
+    FFTaskQueue *queue;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        ///< signaled when a job is done
+    HashJob jobs[MAX_HASH_JOBS];
+    int nb_jobs;                ///< size of the queue
+    int first;                  ///< job of the next line written
+    int nb_queued;              ///< jobs queued, being hashed or done
+#endif
+} FrameHashContext;
+
+#define XXH_PRIME1 2654435761U
+#define XXH_PRIME2 2246822519U
+#define XXH_PRIME3 3266489917U
+#define XXH_PRIME4  668265263U
+#define XXH_PRIME5  374761393U
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static inline uint32_t xxh32_round(uint32_t acc, uint32_t v)
+{
+    acc += v * XXH_PRIME2;
+    return ROTL32(acc, 13) * XXH_PRIME1;
+}
+
+/**
+ * 32 bit xxHash with seed 0.
+ */
+static uint32_t xxh32(const uint8_t *p, int len)
+{
+    const uint8_t *end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = XXH_PRIME1 + XXH_PRIME2, v2 = XXH_PRIME2;
+        uint32_t v3 = 0, v4 = -XXH_PRIME1;
+        do {
+            v1 = xxh32_round(v1, AV_RL32(p));
+            v2 = xxh32_round(v2, AV_RL32(p +  4));
+            v3 = xxh32_round(v3, AV_RL32(p +  8));
+            v4 = xxh32_round(v4, AV_RL32(p + 12));
+            p += 16;
+        } while (p <= end - 16);
+        h = ROTL32(v1, 1) + ROTL32(v2, 7) + ROTL32(v3, 12) + ROTL32(v4, 18);
+    } else
+        h = XXH_PRIME5;
+    h += len;
+    for (; p + 4 <= end; p += 4)
+        h = ROTL32(h + AV_RL32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+    for (; p < end; p++)
+        h = ROTL32(h + *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    return h ^ (h >> 16);
+}
+
+static void hash_job(FrameHashContext *c, HashJob *job)
+{
+    uint8_t md5[16];
+    int i;
+
+    switch (c->algorithm) {
+    case AVHASH_CRC32:
+        snprintf(job->hash, sizeof(job->hash), "0x%08x",
+                 ~av_crc(c->crc_table, ~0U, job->data, job->size));
+        break;
+    case AVHASH_MD5:
+        av_md5_sum(md5, job->data, job->size);
+        for (i = 0; i < 16; i++)
+            snprintf(job->hash + 2 * i, 3, "%02x", md5[i]);
+        break;
+    case AVHASH_XXH32:
+        snprintf(job->hash, sizeof(job->hash), "0x%08x", xxh32(job->data, job->size));
+        break;
+    default:
+        snprintf(job->hash, sizeof(job->hash), "0x%08x",
+                 (uint32_t)av_adler32_update(0, job->data, job->size));
+    }
+}
+
+static int fill_job(HashJob *job, AVPacket *pkt)
+{
+    /* the packet is only valid until write_packet returns */
+    uint8_t *data = av_fast_realloc(job->data, &job->data_size, FFMAX(pkt->size, 1));
+    if (!data)
+        return AVERROR(ENOMEM);
+    job->data         = data;
+    job->stream_index = pkt->stream_index;
+    job->dts          = pkt->dts;
+    job->size         = pkt->size;
+    memcpy(job->data, pkt->data, pkt->size);
+    return 0;
+}
+
+static void write_line(AVFormatContext *s, HashJob *job)
+{
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "%d, %"PRId64", %d, %s\n",
+             job->stream_index, job->dts, job->size, job->hash);
+    put_buffer(s->pb, buf, strlen(buf));
+}
+
+#if HAVE_PTHREADS
+static void hash_task(void *opaque, void *arg)
+{
+    FrameHashContext *c = opaque;
+    HashJob *job = arg;
+
+    hash_job(c, job);
+
+    pthread_mutex_lock(&c->lock);
+    job->done = 1;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* writes the lines of the jobs done in order, must be called with the lock held */
+static void write_done_jobs(AVFormatContext *s, int wait_all)
+{
+    FrameHashContext *c = s->priv_data;
+
+    while (c->nb_queued) {
+        HashJob *job = &c->jobs[c->first];
+        if (!job->done) {
+            if (!wait_all && c->nb_queued < c->nb_jobs)
+                break;
+            pthread_cond_wait(&c->cond, &c->lock);
+            continue;
+        }
+        write_line(s, job);
+        job->done = 0;
+        c->first  = (c->first + 1) % c->nb_jobs;
+        c->nb_queued--;
+    }
+}
+
+static int hash_pool_write(AVFormatContext *s, AVPacket *pkt)
+{
+    FrameHashContext *c = s->priv_data;
+    HashJob *job;
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    /* wait for the oldest job if the queue is full */
+    write_done_jobs(s, 0);
+    job = &c->jobs[(c->first + c->nb_queued) % c->nb_jobs];
+    pthread_mutex_unlock(&c->lock);
+
+    /* the pool does not touch the job until it is submitted */
+    if ((ret = fill_job(job, pkt)) < 0 ||
+        (ret = ff_task_queue_submit(c->queue, job)) < 0)
+        return ret;
+
+    pthread_mutex_lock(&c->lock);
+    c->nb_queued++;
+    pthread_mutex_unlock(&c->lock);
+    return 0;
+}
+
+static void hash_pool_free(AVFormatContext *s)
+{
+    FrameHashContext *c = s->priv_data;
+    int i;
+
+    pthread_mutex_lock(&c->lock);
+    write_done_jobs(s, 1);
+    pthread_mutex_unlock(&c->lock);
+    ff_task_queue_free(&c->queue);
+    for (i = 0; i < c->nb_jobs; i++)
+        av_freep(&c->jobs[i].data);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+}
+#endif
+
+static int framehash_write_header(AVFormatContext *s)
+{
+    FrameHashContext *c = s->priv_data;
+
+    c->algorithm = s->hash_algorithm;
+    /* set up the table before the threads may use it */
+    c->crc_table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+
+#if HAVE_PTHREADS
+    if (s->hash_threads > 1 &&
+        (c->queue = ff_task_queue_alloc(s, hash_task, c, s->hash_threads))) {
+        c->nb_jobs = FFMIN(4 * s->hash_threads, MAX_HASH_JOBS);
+        pthread_mutex_init(&c->lock, NULL);
+        pthread_cond_init(&c->cond, NULL);
+    }
+#endif
+    return 0;
+}
+
+static int framehash_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    FrameHashContext *c = s->priv_data;
+    int ret;
+
+#if HAVE_PTHREADS
+    if (c->queue)
+        return hash_pool_write(s, pkt);
+#endif
+    if ((ret = fill_job(&c->job, pkt)) < 0)
+        return ret;
+    hash_job(c, &c->job);
+    write_line(s, &c->job);
+    return 0;
+}
+
+static int framehash_write_trailer(AVFormatContext *s)
+{
+    FrameHashContext *c = s->priv_data;
+
+#if HAVE_PTHREADS
+    if (c->queue)
+        hash_pool_free(s);
+#endif
+    av_freep(&c->job.data);
+    put_flush_packet(s->pb);
+    return 0;
+}
+
+AVOutputFormat framehash_muxer = {
+    "framehash",
+    NULL_IF_CONFIG_SMALL("frame hash verification format"),
+    NULL,
+    "",
+    sizeof(FrameHashContext),
+    CODEC_ID_PCM_S16LE,
+    CODEC_ID_RAWVIDEO,
+    framehash_write_header,
+    framehash_write_packet,
+    framehash_write_trailer,
+};
@@ -41,15 +41,12 @@
 
 #include "avformat.h"
 
-/* The GIF format uses reversed order for bitstreams... */
-/* at least they don't use PDP_ENDIAN :) */
-#define BITSTREAM_WRITER_LE
-
-#include "libavcodec/put_bits.h"
-
-/* bitstream minipacket size */
+/* number of pixels between two clear codes, keeps the codes 9 bits wide */
 #define GIF_CHUNKS 100
 
+/* largest data sub-block */
+#define GIF_BLOCK_SIZE 255
+
 /* slows down the decoding (and some browsers don't like it) */
 /* update on the 'some browsers don't like it issue from above: this was probably due to missing 'Data Sub-block Terminator' (byte 19) in the app_header */
 #define GIF_ADD_APP_HEADER // required to enable looping of animated gif
@@ -172,21 +169,83 @@ static int gif_image_write_header(ByteIOContext *pb,
     return 0;
 }
 
-/* this is maybe slow, but allows for extensions */
-static inline unsigned char gif_clut_index(uint8_t r, uint8_t g, uint8_t b)
+/**
+ * Map each component value to its contribution to the index in gif_clut,
+ * ((v / 47) % 6) times 36, 6 and 1 for red, green and blue.
+ */
+static void gif_init_clut_index(uint8_t clut_index[3][256])
+{
+    int v;
+
+    for (v = 0; v < 256; v++) {
+        int step = (v / 47) % 6;
+        clut_index[0][v] = step * 6 * 6;
+        clut_index[1][v] = step * 6;
+        clut_index[2][v] = step;
+    }
+}
+
+/**
+ * Writer of the LZW bitstream, the 9 bit codes are written LSB first
+ * straight into the data sub-blocks.
+ */
+typedef struct {
+    ByteIOContext *pb;
+    uint8_t *block;         ///< size byte of the current sub-block
+    uint8_t *ptr, *end;     ///< data of the current sub-block
+    int direct;             ///< the sub-block is in the buffer of pb
+    uint32_t bit_buf;
+    int bit_cnt;
+    uint8_t buf[GIF_BLOCK_SIZE + 1]; ///< sub-block if pb has no room left
+} GIFBitWriter;
+
+static void gif_start_block(GIFBitWriter *bw)
+{
+    ByteIOContext *pb = bw->pb;
+
+    /* put_byte() expects room in the buffer, so leave at least a byte */
+    bw->direct = pb->buf_end - pb->buf_ptr > GIF_BLOCK_SIZE + 1;
+    bw->block  = bw->direct ? pb->buf_ptr : bw->buf;
+    bw->ptr    = bw->block + 1;
+    bw->end    = bw->ptr + GIF_BLOCK_SIZE;
+}
+
+static void gif_end_block(GIFBitWriter *bw)
 {
-    return (((r) / 47) % 6) * 6 * 6 + (((g) / 47) % 6) * 6 + (((b) / 47) % 6);
+    int size = bw->ptr - bw->block - 1;
+
+    if (!size)
+        return;
+    bw->block[0] = size;
+    if (bw->direct)
+        bw->pb->buf_ptr = bw->ptr;
+    else
+        put_buffer(bw->pb, bw->block, size + 1);
 }
 
+static av_always_inline void gif_put_code(GIFBitWriter *bw, unsigned int code)
+{
+    bw->bit_buf |= code << bw->bit_cnt;
+    bw->bit_cnt += 9;
+    do {
+        *bw->ptr++ = bw->bit_buf;
+        bw->bit_buf >>= 8;
+        bw->bit_cnt  -= 8;
+        if (bw->ptr == bw->end) {
+            gif_end_block(bw);
+            gif_start_block(bw);
+        }
+    } while (bw->bit_cnt >= 8);
+}
 
 static int gif_image_write_image(ByteIOContext *pb,
                                  int x1, int y1, int width, int height,
-                                 const uint8_t *buf, int linesize, int pix_fmt)
+                                 const uint8_t *buf, int linesize, int pix_fmt,
+                                 uint8_t clut_index[3][256])
 {
-    PutBitContext p;
-    uint8_t buffer[200]; /* 100 * 9 / 8 = 113 */
-    int i, left, w, v;
-    const uint8_t *ptr;
+    GIFBitWriter bw;
+    const uint8_t *idx_r = clut_index[0], *idx_g = clut_index[1], *idx_b = clut_index[2];
+    int x, y, left;
     /* image block */
 
     put_byte(pb, 0x2c);
@@ -199,46 +258,38 @@ static int gif_image_write_image(ByteIOContext *pb,
 
     put_byte(pb, 0x08);
 
-    left= width * height;
-
-    init_put_bits(&p, buffer, 130);
-
 /*
  * the thing here is the bitstream is written as little packets, with a size byte before
  * but it's still the same bitstream between packets (no flush !)
  */
-    ptr = buf;
-    w = width;
-    while(left>0) {
-
-        put_bits(&p, 9, 0x0100); /* clear code */
-
-        for(i=(left<GIF_CHUNKS)?left:GIF_CHUNKS;i;i--) {
+    bw.pb      = pb;
+    bw.bit_buf = 0;
+    bw.bit_cnt = 0;
+    gif_start_block(&bw);
+
+    left = 0;
+    for (y = 0; y < height; y++) {
+        const uint8_t *ptr = buf;
+
+        for (x = 0; x < width; x++) {
+            if (!left--) {
+                gif_put_code(&bw, 0x100); /* clear code */
+                left = GIF_CHUNKS - 1;
+            }
             if (pix_fmt == PIX_FMT_RGB24) {
-                v = gif_clut_index(ptr[0], ptr[1], ptr[2]);
-                ptr+=3;
+                gif_put_code(&bw, idx_r[ptr[0]] + idx_g[ptr[1]] + idx_b[ptr[2]]);
+                ptr += 3;
             } else {
-                v = *ptr++;
-            }
-            put_bits(&p, 9, v);
-            if (--w == 0) {
-                w = width;
-                buf += linesize;
-                ptr = buf;
+                gif_put_code(&bw, *ptr++);
             }
         }
-
-        if(left<=GIF_CHUNKS) {
-            put_bits(&p, 9, 0x101); /* end of stream */
-            flush_put_bits(&p);
-        }
-        if(put_bits_ptr(&p) - p.buf > 0) {
-            put_byte(pb, put_bits_ptr(&p) - p.buf); /* byte count of the packet */
-            put_buffer(pb, p.buf, put_bits_ptr(&p) - p.buf); /* the actual buffer */
-            p.buf_ptr = p.buf; /* dequeue the bytes off the bitstream */
-        }
-        left-=GIF_CHUNKS;
+        buf += linesize;
     }
+
+    gif_put_code(&bw, 0x101); /* end of stream */
+    if (bw.bit_cnt)
+        *bw.ptr++ = bw.bit_buf;
+    gif_end_block(&bw);
     put_byte(pb, 0x00); /* end of image block */
 
     return 0;
@@ -246,7 +297,7 @@ static int gif_image_write_image(ByteIOContext *pb,
 
 typedef struct {
     int64_t time, file_time;
-    uint8_t buffer[100]; /* data chunks */
+    uint8_t clut_index[3][256]; ///< see gif_init_clut_index()
 } GIFContext;
 
 static int gif_write_header(AVFormatContext *s)
@@ -285,6 +336,7 @@ static int gif_write_header(AVFormatContext *s)
         return AVERROR(EIO);
     }
 
+    gif_init_clut_index(gif->clut_index);
     gif_image_write_header(pb, width, height, loop_count, NULL);
 
     put_flush_packet(s->pb);
@@ -320,7 +372,7 @@ static int gif_write_video(AVFormatContext *s,
     put_byte(pb, 0x00);
 
     gif_image_write_image(pb, 0, 0, enc->width, enc->height,
-                          buf, enc->width * 3, PIX_FMT_RGB24);
+                          buf, enc->width * 3, PIX_FMT_RGB24, gif->clut_index);
 
     put_flush_packet(s->pb);
     return 0;
@@ -98,7 +98,7 @@ static int gopher_open(URLContext *h, const char *uri, int flags)
     snprintf(buf, sizeof(buf), "tcp://%s:%d", hostname, port);
 
     s->hd = NULL;
-    err = url_open(&s->hd, buf, URL_RDWR);
+    err = url_open_interrupt(&s->hd, buf, URL_RDWR, h->interrupt);
     if (err < 0)
         goto fail;
 
@@ -21,6 +21,7 @@
 
 #include "libavutil/common.h"
 #include "avformat.h"
+#include "internal.h"
 #include "gxf.h"
 
 struct gxf_stream_info {
@@ -410,6 +411,46 @@ out:
     return cur_timestamp;
 }
 
+/**
+ * \brief add a media packet to the index of its stream
+ *
+ * Entries are keyed like the FLT ones, by field number from the start of
+ * the stream, and tell apart from them by their non-zero size.
+ */
+static void gxf_index_packet(AVFormatContext *s, AVStream *st, int64_t pos,
+                             int field_nr, int size) {
+    int64_t field = field_nr;
+    if (url_is_streamed(s->pb))
+        return;
+    if (st->start_time != AV_NOPTS_VALUE)
+        field -= st->start_time;
+    ff_reduce_index(s, st->index);
+    av_add_index_entry(st, pos, field, size, 0, 0);
+}
+
+/**
+ * \brief find the first media packet of a field from the packets indexed
+ * \return position of the packet, -1 if no stream has one for that field
+ */
+static int64_t gxf_field_pos(AVFormatContext *s, int64_t field) {
+    int64_t pos = -1;
+    int i, idx;
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+        int64_t rel = field;
+        const AVIndexEntry *e;
+        if (st->start_time != AV_NOPTS_VALUE)
+            rel -= st->start_time;
+        idx = av_index_search_timestamp(st, rel, AVSEEK_FLAG_ANY | AVSEEK_FLAG_BACKWARD);
+        if (idx < 0)
+            continue;
+        e = ff_index_get_entry(st, idx);
+        if (e->timestamp == rel && e->size > 0 && (pos < 0 || e->pos < pos))
+            pos = e->pos;
+    }
+    return pos;
+}
+
 static int gxf_packet(AVFormatContext *s, AVPacket *pkt) {
     ByteIOContext *pb = s->pb;
     GXFPktType pkt_type;
@@ -419,6 +460,7 @@ static int gxf_packet(AVFormatContext *s, AVPacket *pkt) {
         int track_type, track_id, ret;
         int field_nr, field_info, skip = 0;
         int stream_index;
+        int64_t pos = url_ftell(pb);
         if (!parse_packet_header(pb, &pkt_type, &pkt_len)) {
             if (!url_feof(pb))
                 av_log(s, AV_LOG_ERROR, "sync lost\n");
@@ -448,6 +490,7 @@ static int gxf_packet(AVFormatContext *s, AVPacket *pkt) {
         get_be32(pb); // "timeline" field number
         get_byte(pb); // flags
         get_byte(pb); // reserved
+        gxf_index_packet(s, st, pos, field_nr, pkt_len + 16);
         if (st->codec->codec_id == CODEC_ID_PCM_S24LE ||
             st->codec->codec_id == CODEC_ID_PCM_S16LE) {
             int first = field_info >> 16;
@@ -478,6 +521,11 @@ static int gxf_seek(AVFormatContext *s, int stream_index, int64_t timestamp, int
     int64_t found;
     int idx;
     if (timestamp < start_time) timestamp = start_time;
+    /* fields already read are found exactly */
+    if ((int64_t)(pos = gxf_field_pos(s, timestamp)) >= 0) {
+        url_fseek(s->pb, pos, SEEK_SET);
+        return 0;
+    }
     idx = av_index_search_timestamp(st, timestamp - start_time,
                                     AVSEEK_FLAG_ANY | AVSEEK_FLAG_BACKWARD);
     if (idx < 0)
@@ -26,6 +26,9 @@
 #include <strings.h>
 #include "network.h"
 #include "os_support.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 /* XXX: POST protocol is not completely implemented because ffmpeg uses
    only a subset of it. */
@@ -35,6 +38,16 @@
 #define URL_SIZE    4096
 #define MAX_REDIRECTS 8
 
+/* persistent connections */
+#define POOL_SIZE     4
+#define POOL_TIMEOUT  5000000   /* idle time in us after which a pooled connection is dropped */
+#define MAX_DRAIN     (64 * 1024) /* max unread response bytes skipped to keep a connection */
+
+/* chunked upload */
+#define CHUNK_SIZE      (64 * 1024)
+#define CHUNK_HDR_SIZE  10          /* 32-bit hex + CRLF */
+#define CHUNK_MAX_DELAY 100000      /* max time in us data is held back for coalescing */
+
 typedef struct {
     URLContext *hd;
     unsigned char buffer[BUFFER_SIZE], *buf_ptr, *buf_end;
@@ -43,11 +56,110 @@ typedef struct {
     int64_t chunksize;      /**< Used if "Transfer-Encoding: chunked" otherwise -1. */
     int64_t off, filesize;
     char location[URL_SIZE];
+    char tcp_url[1024];     /**< url of the underlying connection, pool key */
+    int64_t content_length; /**< Content-Length of the current response, -1 if unknown */
+    int64_t end_off;        /**< offset of the end of the current response body, -1 if unknown */
+    int willclose;          /**< the server closes the connection after this response */
+    uint8_t *chunk_buf;     /**< upload data not sent yet, preceded by room for the chunk header */
+    int chunk_len;
+    int64_t chunk_time;     /**< av_gettime() when the oldest data in chunk_buf was written */
 } HTTPContext;
 
+/* idle keep-alive connections, shared by all http: contexts */
+static struct {
+    char tcp_url[1024];
+    URLContext *hd;
+    int64_t time;
+} pool[POOL_SIZE];
+
+#if HAVE_PTHREADS
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define pool_lock()   pthread_mutex_lock(&pool_lock)
+#define pool_unlock() pthread_mutex_unlock(&pool_lock)
+#else
+#define pool_lock()
+#define pool_unlock()
+#endif
+
+/**
+ * Take an idle connection to tcp_url out of the pool.
+ * @return the connection or NULL if there is none
+ */
+static URLContext *pool_get(const char *tcp_url)
+{
+    URLContext *hd = NULL;
+    int64_t now = av_gettime();
+    int i;
+
+    pool_lock();
+    for (i = 0; i < POOL_SIZE; i++) {
+        if (!pool[i].hd)
+            continue;
+        if (now - pool[i].time > POOL_TIMEOUT) {
+            url_close(pool[i].hd);
+            pool[i].hd = NULL;
+        } else if (!hd && !strcmp(pool[i].tcp_url, tcp_url)) {
+            hd = pool[i].hd;
+            pool[i].hd = NULL;
+        }
+    }
+    pool_unlock();
+    return hd;
+}
+
+/**
+ * Hand an idle connection over to the pool, replacing the oldest entry
+ * if it is full.
+ */
+static void pool_put(const char *tcp_url, URLContext *hd)
+{
+    URLContext *old;
+    int i, slot = 0;
+
+    /* the settings belong to the URLContext that is being closed */
+    hd->interrupt = NULL;
+    pool_lock();
+    for (i = 0; i < POOL_SIZE; i++) {
+        if (!pool[i].hd) {
+            slot = i;
+            break;
+        }
+        if (pool[i].time < pool[slot].time)
+            slot = i;
+    }
+    old = pool[slot].hd;
+    av_strlcpy(pool[slot].tcp_url, tcp_url, sizeof(pool[slot].tcp_url));
+    pool[slot].hd   = hd;
+    pool[slot].time = av_gettime();
+    pool_unlock();
+    if (old)
+        url_close(old);
+}
+
 static int http_connect(URLContext *h, const char *path, const char *hoststr,
                         const char *auth, int *new_location);
 static int http_write(URLContext *h, uint8_t *buf, int size);
+static int http_read(URLContext *h, uint8_t *buf, int size);
+
+/**
+ * Skip the rest of the current response if it is short enough, so that
+ * the connection can send another request.
+ * @return 0 if the connection is ready for reuse, 1 if it cannot be reused
+ *         (nothing was read), <0 if it failed while skipping
+ */
+static int http_finish_response(URLContext *h)
+{
+    HTTPContext *s = h->priv_data;
+    uint8_t tmp[BUFFER_SIZE];
+
+    if (!s->hd || s->willclose || s->end_off < 0 || s->chunksize >= 0 ||
+        (h->flags & URL_WRONLY) || s->end_off - s->off > MAX_DRAIN)
+        return 1;
+    while (s->off < s->end_off)
+        if (http_read(h, tmp, sizeof(tmp)) <= 0)
+            return AVERROR(EIO);
+    return 0;
+}
 
 
 /* return non zero if error */
@@ -58,9 +170,10 @@ static int http_open_cnx(URLContext *h)
     char auth[1024];
     char path1[1024];
     char buf[1024];
-    int port, use_proxy, err, location_changed = 0, redirects = 0;
+    int port, use_proxy, err, location_changed = 0, redirects = 0, reused;
     HTTPContext *s = h->priv_data;
     URLContext *hd = NULL;
+    int64_t off = s->off;
 
     proxy_path = getenv("http_proxy");
     use_proxy = (proxy_path != NULL) && !getenv("no_proxy") &&
@@ -91,13 +204,30 @@ static int http_open_cnx(URLContext *h)
         port = 80;
 
     snprintf(buf, sizeof(buf), "tcp://%s:%d", hostname, port);
-    err = url_open(&hd, buf, URL_RDWR);
-    if (err < 0)
-        goto fail;
+    av_strlcpy(s->tcp_url, buf, sizeof(s->tcp_url));
+    hd = pool_get(buf);
+    reused = hd != NULL;
+    if (hd)
+        hd->interrupt = h->interrupt;
+ reconnect:
+    if (!hd) {
+        err = url_open_interrupt(&hd, buf, URL_RDWR, h->interrupt);
+        if (err < 0)
+            goto fail;
+    }
 
     s->hd = hd;
-    if (http_connect(h, path, hoststr, auth, &location_changed) < 0)
+    s->off = off;
+    if (http_connect(h, path, hoststr, auth, &location_changed) < 0) {
+        if (reused && !s->line_count) {
+            /* the server closed the idle connection, use a new one */
+            url_close(hd);
+            hd = NULL;
+            reused = 0;
+            goto reconnect;
+        }
         goto fail;
+    }
     if ((s->http_code == 302 || s->http_code == 303) && location_changed == 1) {
         /* url moved, get next */
         url_close(hd);
@@ -125,9 +255,13 @@ static int http_open(URLContext *h, const char *uri, int flags)
         return AVERROR(ENOMEM);
     }
     h->priv_data = s;
+    s->hd = NULL;
     s->filesize = -1;
     s->chunksize = -1;
     s->off = 0;
+    s->end_off = -1;
+    s->chunk_buf = NULL;
+    s->chunk_len = 0;
     av_strlcpy(s->location, uri, URL_SIZE);
 
     ret = http_open_cnx(h);
@@ -193,6 +327,8 @@ static int process_line(URLContext *h, char *line, int line_count,
         while (isspace(*p))
             p++;
         s->http_code = strtol(p, NULL, 10);
+        if (!strncmp(line, "HTTP/1.0", 8))
+            s->willclose = 1;
 
         dprintf(NULL, "http_code=%d\n", s->http_code);
 
@@ -213,8 +349,10 @@ static int process_line(URLContext *h, char *line, int line_count,
         if (!strcmp(tag, "Location")) {
             strcpy(s->location, p);
             *new_location = 1;
-        } else if (!strcmp (tag, "Content-Length") && s->filesize == -1) {
-            s->filesize = atoll(p);
+        } else if (!strcmp (tag, "Content-Length")) {
+            s->content_length = atoll(p);
+            if (s->filesize == -1)
+                s->filesize = s->content_length;
         } else if (!strcmp (tag, "Content-Range")) {
             /* "bytes $from-$to/$document_size" */
             const char *slash;
@@ -228,6 +366,8 @@ static int process_line(URLContext *h, char *line, int line_count,
         } else if (!strcmp (tag, "Transfer-Encoding") && !strncasecmp(p, "chunked", 7)) {
             s->filesize = -1;
             s->chunksize = 0;
+        } else if (!strcmp (tag, "Connection") && !strncasecmp(p, "close", 5)) {
+            s->willclose = 1;
         }
     }
     return 1;
@@ -255,7 +395,7 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
              "Range: bytes=%"PRId64"-\r\n"
              "Host: %s\r\n"
              "Authorization: Basic %s\r\n"
-             "Connection: close\r\n"
+             "Connection: %s\r\n"
              "%s"
              "\r\n",
              post ? "POST" : "GET",
@@ -264,9 +404,11 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
              s->off,
              hoststr,
              auth_b64,
+             post ? "close" : "keep-alive",
              post ? "Transfer-Encoding: chunked\r\n" : "");
 
     av_freep(&auth_b64);
+    s->chunksize = -1;
     if (http_write(h, s->buffer, strlen(s->buffer)) < 0)
         return AVERROR(EIO);
 
@@ -276,6 +418,9 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
     s->line_count = 0;
     s->off = 0;
     s->filesize = -1;
+    s->content_length = -1;
+    s->end_off = -1;
+    s->willclose = 0;
     if (post) {
         /* always use chunked encoding for upload data */
         s->chunksize = 0;
@@ -297,6 +442,9 @@ static int http_connect(URLContext *h, const char *path, const char *hoststr,
         s->line_count++;
     }
 
+    if (s->chunksize < 0 && s->content_length >= 0)
+        s->end_off = s->off + s->content_length;
+
     return (off == s->off) ? 0 : -1;
 }
 
@@ -306,6 +454,14 @@ static int http_read(URLContext *h, uint8_t *buf, int size)
     HTTPContext *s = h->priv_data;
     int len;
 
+    if (!s->hd)
+        return AVERROR(EIO);
+    /* a persistent connection does not signal the end of the response */
+    if (s->end_off >= 0) {
+        if (s->off >= s->end_off)
+            return 0;
+        size = FFMIN(size, s->end_off - s->off);
+    }
     if (s->chunksize >= 0) {
         if (!s->chunksize) {
             char line[32];
@@ -345,46 +501,99 @@ static int http_read(URLContext *h, uint8_t *buf, int size)
     return len;
 }
 
+/**
+ * Send the buffered upload data as one chunk with a single write.
+ */
+static int http_flush_chunk(HTTPContext *s)
+{
+    char temp[CHUNK_HDR_SIZE + 1];
+    uint8_t *p;
+    int len, ret;
+
+    if (!s->chunk_len)
+        return 0;
+    len = snprintf(temp, sizeof(temp), "%x\r\n", s->chunk_len);
+    p = s->chunk_buf + CHUNK_HDR_SIZE - len;
+    memcpy(p, temp, len);
+    memcpy(s->chunk_buf + CHUNK_HDR_SIZE + s->chunk_len, "\r\n", 2);
+    ret = url_write(s->hd, p, len + s->chunk_len + 2);
+    s->chunk_len = 0;
+    return ret < 0 ? ret : 0;
+}
+
 /* used only when posting data */
 static int http_write(URLContext *h, uint8_t *buf, int size)
 {
-    char temp[11];  /* 32-bit hex + CRLF + nul */
-    int ret;
-    char crlf[] = "\r\n";
     HTTPContext *s = h->priv_data;
+    int ret, len, size1 = size;
 
     if (s->chunksize == -1) {
         /* headers are sent without any special encoding */
         return url_write(s->hd, buf, size);
     }
 
-    /* silently ignore zero-size data since chunk encoding that would
-     * signal EOF */
-    if (size > 0) {
-        /* upload data using chunked encoding */
-        snprintf(temp, sizeof(temp), "%x\r\n", size);
-
-        if ((ret = url_write(s->hd, temp, strlen(temp))) < 0 ||
-            (ret = url_write(s->hd, buf, size)) < 0 ||
-            (ret = url_write(s->hd, crlf, sizeof(crlf) - 1)) < 0)
+    /* upload data using chunked encoding; small writes are coalesced
+     * into chunks of up to CHUNK_SIZE bytes. Zero-size data is silently
+     * ignored since in chunk encoding that would signal EOF */
+    if (!s->chunk_buf) {
+        s->chunk_buf = av_malloc(CHUNK_HDR_SIZE + CHUNK_SIZE + 2);
+        if (!s->chunk_buf)
+            return AVERROR(ENOMEM);
+    }
+    while (size > 0) {
+        if (!s->chunk_len)
+            s->chunk_time = av_gettime();
+        len = FFMIN(size, CHUNK_SIZE - s->chunk_len);
+        memcpy(s->chunk_buf + CHUNK_HDR_SIZE + s->chunk_len, buf, len);
+        s->chunk_len += len;
+        buf  += len;
+        size -= len;
+        if (s->chunk_len == CHUNK_SIZE &&
+            (ret = http_flush_chunk(s)) < 0)
             return ret;
     }
-    return size;
+    /* do not hold back live data for too long */
+    if (s->chunk_len && av_gettime() - s->chunk_time > CHUNK_MAX_DELAY &&
+        (ret = http_flush_chunk(s)) < 0)
+        return ret;
+    return size1;
 }
 
 static int http_close(URLContext *h)
 {
     int ret = 0;
     char footer[] = "0\r\n\r\n";
+    char line[1024];
     HTTPContext *s = h->priv_data;
 
     /* signal end of chunked encoding if used */
     if ((h->flags & URL_WRONLY) && s->chunksize != -1) {
-        ret = url_write(s->hd, footer, sizeof(footer) - 1);
+        ret = http_flush_chunk(s);
+        if (!ret)
+            ret = url_write(s->hd, footer, sizeof(footer) - 1);
         ret = ret > 0 ? 0 : ret;
+        /* check that the server accepted the upload */
+        if (!ret) {
+            int new_location = 0;
+            s->line_count = 0;
+            while (http_get_line(s, line, sizeof(line)) >= 0) {
+                int err = process_line(h, line, s->line_count++, &new_location);
+                if (err <= 0) {
+                    if (err < 0) {
+                        av_log(NULL, AV_LOG_ERROR, "HTTP upload failed: %d\n", s->http_code);
+                        ret = AVERROR(EIO);
+                    }
+                    break;
+                }
+            }
+        }
     }
+    av_free(s->chunk_buf);
 
-    url_close(s->hd);
+    if (!http_finish_response(h))
+        pool_put(s->tcp_url, s->hd);
+    else if (s->hd)
+        url_close(s->hd);
     av_free(s);
     return ret;
 }
@@ -394,22 +603,39 @@ static int64_t http_seek(URLContext *h, int64_t off, int whence)
     HTTPContext *s = h->priv_data;
     URLContext *old_hd = s->hd;
     int64_t old_off = s->off;
+    int64_t old_end_off = s->end_off;
     uint8_t old_buf[BUFFER_SIZE];
-    int old_buf_size;
+    int old_buf_size, old_willclose = s->willclose, ret;
 
     if (whence == AVSEEK_SIZE)
         return s->filesize;
     else if ((s->filesize == -1 && whence == SEEK_END) || h->is_streamed)
         return -1;
 
-    /* we save the old context in case the seek fails */
-    old_buf_size = s->buf_end - s->buf_ptr;
-    memcpy(old_buf, s->buf_ptr, old_buf_size);
-    s->hd = NULL;
     if (whence == SEEK_CUR)
         off += s->off;
     else if (whence == SEEK_END)
         off += s->filesize;
+
+    /* send the new range request on the current connection if possible */
+    if ((ret = http_finish_response(h)) <= 0) {
+        if (!ret)
+            pool_put(s->tcp_url, s->hd);
+        else
+            url_close(s->hd);
+        s->hd  = NULL;
+        s->off = off;
+        if (http_open_cnx(h) < 0) {
+            s->hd = NULL;
+            return -1;
+        }
+        return off;
+    }
+
+    /* we save the old context in case the seek fails */
+    old_buf_size = s->buf_end - s->buf_ptr;
+    memcpy(old_buf, s->buf_ptr, old_buf_size);
+    s->hd = NULL;
     s->off = off;
 
     /* if it fails, continue on old connection */
@@ -419,6 +645,8 @@ static int64_t http_seek(URLContext *h, int64_t off, int whence)
         s->buf_end = s->buffer + old_buf_size;
         s->hd = old_hd;
         s->off = old_off;
+        s->end_off = old_end_off;
+        s->willclose = old_willclose;
         return -1;
     }
     url_close(old_hd);
@@ -20,6 +20,7 @@
  */
 
 #include "id3v1.h"
+#include "metadata.h"
 #include "libavcodec/avcodec.h"
 #include "libavutil/avstring.h"
 
@@ -235,7 +236,12 @@ void ff_id3v1_read(AVFormatContext *s)
             if (ret == ID3v1_TAG_SIZE) {
                 parse_tag(s, buf);
             }
-            url_fseek(s->pb, 0, SEEK_SET);
         }
     }
 }
+
+void ff_id3v1_read_fallback(AVFormatContext *s)
+{
+    if (ff_metadata_is_empty(s->metadata))
+        ff_id3v1_read(s);
+}
@@ -38,5 +38,10 @@ extern const char * const ff_id3v1_genre_str[ID3v1_GENRE_MAX + 1];
  */
 void ff_id3v1_read(AVFormatContext *s);
 
+/**
+ * Read an ID3v1 tag if no other tag gave metadata
+ */
+void ff_id3v1_read_fallback(AVFormatContext *s);
+
 #endif /* AVFORMAT_ID3V1_H */
 
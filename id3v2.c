@@ -23,6 +23,10 @@
 #include "id3v1.h"
 #include "libavutil/avstring.h"
 
+/* read_ttag() decodes at most this much of a frame into its 512 byte
+ * buffer, 2 bytes per character in UTF-16 plus encoding and BOM */
+#define TTAG_SIZE_MAX 1040
+
 int ff_id3v2_match(const uint8_t *buf)
 {
     return  buf[0]         ==  'I' &&
@@ -76,8 +80,9 @@ static unsigned int get_size(ByteIOContext *s, int len)
     return v;
 }
 
-static void read_ttag(AVFormatContext *s, int taglen, const char *key)
+static void decode_ttag(AVMetadata **pm, const char *key, const uint8_t *buf, int taglen)
 {
+    ByteIOContext pb1, *pb = &pb1;
     char *q, dst[512];
     const char *val = NULL;
     int len, dstlen = sizeof(dst) - 1;
@@ -87,29 +92,30 @@ static void read_ttag(AVFormatContext *s, int taglen, const char *key)
     dst[0] = 0;
     if (taglen < 1)
         return;
+    init_put_byte(pb, (uint8_t *)buf, taglen, 0, NULL, NULL, NULL, NULL);
 
     taglen--; /* account for encoding type byte */
 
-    switch (get_byte(s->pb)) { /* encoding type */
+    switch (get_byte(pb)) { /* encoding type */
 
     case 0:  /* ISO-8859-1 (0 - 255 maps directly into unicode) */
         q = dst;
         while (taglen-- && q - dst < dstlen - 7) {
             uint8_t tmp;
-            PUT_UTF8(get_byte(s->pb), tmp, *q++ = tmp;)
+            PUT_UTF8(get_byte(pb), tmp, *q++ = tmp;)
         }
         *q = 0;
         break;
 
     case 1:  /* UTF-16 with BOM */
         taglen -= 2;
-        switch (get_be16(s->pb)) {
+        switch (get_be16(pb)) {
         case 0xfffe:
             get = get_le16;
         case 0xfeff:
             break;
         default:
-            av_log(s, AV_LOG_ERROR, "Incorrect BOM value in tag %s.\n", key);
+            av_log(NULL, AV_LOG_ERROR, "Incorrect BOM value in tag %s.\n", key);
             return;
         }
         // fall-through
@@ -120,7 +126,7 @@ static void read_ttag(AVFormatContext *s, int taglen, const char *key)
             uint32_t ch;
             uint8_t tmp;
 
-            GET_UTF16(ch, ((taglen -= 2) >= 0 ? get(s->pb) : 0), break;)
+            GET_UTF16(ch, ((taglen -= 2) >= 0 ? get(pb) : 0), break;)
             PUT_UTF8(ch, tmp, *q++ = tmp;)
         }
         *q = 0;
@@ -128,11 +134,11 @@ static void read_ttag(AVFormatContext *s, int taglen, const char *key)
 
     case 3:  /* UTF-8 */
         len = FFMIN(taglen, dstlen - 1);
-        get_buffer(s->pb, dst, len);
+        get_buffer(pb, dst, len);
         dst[len] = 0;
         break;
     default:
-        av_log(s, AV_LOG_WARNING, "Unknown encoding in tag %s\n.", key);
+        av_log(NULL, AV_LOG_WARNING, "Unknown encoding in tag %s\n.", key);
     }
 
     if (!(strcmp(key, "TCON") && strcmp(key, "TCO"))
@@ -150,7 +156,21 @@ static void read_ttag(AVFormatContext *s, int taglen, const char *key)
         val = dst;
 
     if (val)
-        av_metadata_set(&s->metadata, key, val);
+        av_metadata_set(pm, key, val);
+}
+
+static void read_ttag(AVFormatContext *s, int taglen, const char *key)
+{
+    uint8_t buf[TTAG_SIZE_MAX];
+
+    taglen = get_buffer(s->pb, buf, FFMIN(taglen, sizeof(buf)));
+    if (taglen < 1)
+        return;
+    /* the frame is kept as is, the caller skips to the next one */
+    if (s->flags & AVFMT_FLAG_LAZY_TAGS)
+        ff_metadata_set_lazy(&s->metadata, key, buf, taglen, decode_ttag);
+    else
+        decode_ttag(&s->metadata, key, buf, taglen);
 }
 
 void ff_id3v2_parse(AVFormatContext *s, int len, uint8_t version, uint8_t flags)
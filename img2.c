@@ -24,6 +24,12 @@
 #include "libavutil/avstring.h"
 #include "avformat.h"
 #include <strings.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include "threadpool.h"
+#endif
+
+#define MAX_IMAGE_JOBS 32
 
 typedef struct {
     int img_first;
@@ -32,8 +38,15 @@ typedef struct {
     int img_count;
     int is_pipe;
     char path[1024];
+#if HAVE_PTHREADS
+    struct ImagePool *pool;
+#endif
 } VideoData;
 
+#if HAVE_PTHREADS
+static int image_pool_init(AVFormatContext *s, int writing);
+#endif
+
 typedef struct {
     enum CodecID id;
     const char *str;
@@ -230,6 +243,13 @@ static int img_read_header(AVFormatContext *s1, AVFormatParameters *ap)
         /* compute duration */
         st->start_time = 0;
         st->duration = last_index - first_index + 1;
+#if HAVE_PTHREADS
+        if (s1->image_threads > 0) {
+            int ret = image_pool_init(s1, 0);
+            if (ret < 0)
+                return ret;
+        }
+#endif
     }
 
     if(ap->video_codec_id){
@@ -248,24 +268,22 @@ static int img_read_header(AVFormatContext *s1, AVFormatParameters *ap)
     return 0;
 }
 
-static int img_read_packet(AVFormatContext *s1, AVPacket *pkt)
+/**
+ * Reads image number of the sequence, or the next image of the pipe.
+ * @param psize set to the size of the first file
+ */
+static int read_image(AVFormatContext *s1, int number, AVPacket *pkt, int *psize)
 {
     VideoData *s = s1->priv_data;
     char filename[1024];
     int i;
     int size[3]={0}, ret[3]={0};
     ByteIOContext *f[3];
-    AVCodecContext *codec= s1->streams[0]->codec;
+    enum CodecID codec_id = s1->streams[0]->codec->codec_id;
 
     if (!s->is_pipe) {
-        /* loop over input */
-        if (s1->loop_input && s->img_number > s->img_last) {
-            s->img_number = s->img_first;
-        }
-        if (s->img_number > s->img_last)
-            return AVERROR_EOF;
         if (av_get_frame_filename(filename, sizeof(filename),
-                                  s->path, s->img_number)<0 && s->img_number > 1)
+                                  s->path, number)<0 && number > 1)
             return AVERROR(EIO);
         for(i=0; i<3; i++){
             if (url_fopen(&f[i], filename, URL_RDONLY) < 0) {
@@ -274,13 +292,10 @@ static int img_read_packet(AVFormatContext *s1, AVPacket *pkt)
             }
             size[i]= url_fsize(f[i]);
 
-            if(codec->codec_id != CODEC_ID_RAWVIDEO)
+            if(codec_id != CODEC_ID_RAWVIDEO)
                 break;
             filename[ strlen(filename) - 1 ]= 'U' + i;
         }
-
-        if(codec->codec_id == CODEC_ID_RAWVIDEO && !codec->width)
-            infer_size(&codec->width, &codec->height, size[0]);
     } else {
         f[0] = s1->pb;
         if (url_feof(f[0]))
@@ -306,13 +321,256 @@ static int img_read_packet(AVFormatContext *s1, AVPacket *pkt)
     if (ret[0] <= 0 || ret[1]<0 || ret[2]<0) {
         av_free_packet(pkt);
         return AVERROR(EIO); /* signal EOF */
-    } else {
-        s->img_count++;
-        s->img_number++;
+    }
+    *psize = size[0];
+    return 0;
+}
+
+#if HAVE_PTHREADS
+enum ImageJobState {
+    JOB_FREE,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+};
+
+typedef struct ImageJob {
+    enum ImageJobState state;
+    int number;                 ///< of the image in the sequence
+    AVPacket pkt;
+    int size;                   ///< size of the first file read
+    int ret;
+} ImageJob;
+
+/**
+ * Tasks of the thread pool reading the next images of the sequence into
+ * packets, or writing packets queued by the muxer into their files.
+ */
+typedef struct ImagePool {
+    AVFormatContext *s;
+    int writing;
+    FFTaskQueue *queue;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        ///< signaled when a job is done
+    ImageJob jobs[MAX_IMAGE_JOBS];
+    int nb_jobs;                ///< size of the queue
+    int first;                  ///< reading: job of the next image returned
+    int nb_queued;              ///< jobs not FREE
+    int next_number;            ///< reading: next image to queue
+    int error;                  ///< writing: first error, returned to the muxer
+} ImagePool;
+
+#if CONFIG_IMAGE2_MUXER
+static int write_image(AVFormatContext *s, int number, AVPacket *pkt);
+#endif
+
+static void image_task(void *opaque, void *arg)
+{
+    ImagePool *p = opaque;
+    ImageJob *job = arg;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    job->state = JOB_RUNNING;
+    pthread_mutex_unlock(&p->lock);
+
+#if CONFIG_IMAGE2_MUXER
+    if (p->writing) {
+        ret = write_image(p->s, job->number, &job->pkt);
+        av_free_packet(&job->pkt);
+    } else
+#endif
+        ret = read_image(p->s, job->number, &job->pkt, &job->size);
+
+    pthread_mutex_lock(&p->lock);
+    job->ret = ret;
+    if (p->writing) {
+        if (ret < 0 && !p->error)
+            p->error = ret;
+        job->state = JOB_FREE;
+        p->nb_queued--;
+    } else
+        job->state = JOB_DONE;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static int image_pool_init(AVFormatContext *s, int writing)
+{
+    VideoData *img = s->priv_data;
+    ImagePool *p;
+
+    if (!(p = av_mallocz(sizeof(*p))))
+        return AVERROR(ENOMEM);
+    if (!(p->queue = ff_task_queue_alloc(s, image_task, p, s->image_threads))) {
+        av_free(p);
         return 0;
     }
+    p->s           = s;
+    p->writing     = writing;
+    p->nb_jobs     = FFMIN(2 * s->image_threads, MAX_IMAGE_JOBS);
+    p->next_number = img->img_number;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    img->pool = p;
+    return 0;
 }
 
+/**
+ * Stops the jobs, after the queued ones when writing.
+ * @return the first error of writing
+ */
+static int image_pool_free(VideoData *img)
+{
+    ImagePool *p = img->pool;
+    int i, ret;
+
+    if (!p)
+        return 0;
+    if (p->writing)
+        ff_task_queue_wait(p->queue);
+    ff_task_queue_free(&p->queue);
+
+    for (i = 0; i < p->nb_jobs; i++)
+        if (p->jobs[i].state == JOB_DONE && p->jobs[i].ret >= 0)
+            av_free_packet(&p->jobs[i].pkt);
+    ret = p->error;
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    av_freep(&img->pool);
+    return ret;
+}
+
+/* queues the next images of the sequence, must be called with the lock held */
+static void queue_images(AVFormatContext *s1)
+{
+    VideoData *s = s1->priv_data;
+    ImagePool *p = s->pool;
+
+    while (p->nb_queued < p->nb_jobs) {
+        ImageJob *job = &p->jobs[(p->first + p->nb_queued) % p->nb_jobs];
+
+        /* loop over input */
+        if (s1->loop_input && p->next_number > s->img_last)
+            p->next_number = s->img_first;
+        if (p->next_number > s->img_last)
+            break;
+        job->number = p->next_number;
+        job->state  = JOB_QUEUED;
+        if (ff_task_queue_submit(p->queue, job) < 0) {
+            job->state = JOB_FREE;
+            break;
+        }
+        p->next_number++;
+        p->nb_queued++;
+    }
+}
+
+static int image_pool_read(AVFormatContext *s1, AVPacket *pkt, int *psize)
+{
+    VideoData *s = s1->priv_data;
+    ImagePool *p = s->pool;
+    ImageJob *job;
+    int ret;
+
+    pthread_mutex_lock(&p->lock);
+    queue_images(s1);
+    if (!p->nb_queued) {
+        pthread_mutex_unlock(&p->lock);
+        return AVERROR_EOF;
+    }
+    job = &p->jobs[p->first];
+    while (job->state != JOB_DONE)
+        pthread_cond_wait(&p->cond, &p->lock);
+    ret = job->ret;
+    if (ret >= 0) {
+        *pkt   = job->pkt;
+        *psize = job->size;
+    }
+    s->img_number = job->number;
+    job->state    = JOB_FREE;
+    p->first      = (p->first + 1) % p->nb_jobs;
+    p->nb_queued--;
+    queue_images(s1);
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+
+static int image_pool_write(AVFormatContext *s, AVPacket *pkt)
+{
+    VideoData *img = s->priv_data;
+    ImagePool *p = img->pool;
+    ImageJob *job = NULL;
+    int i, ret;
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->error && p->nb_queued == p->nb_jobs)
+        pthread_cond_wait(&p->cond, &p->lock);
+    if ((ret = p->error) < 0)
+        goto end;
+    for (i = 0; i < p->nb_jobs; i++)
+        if (p->jobs[i].state == JOB_FREE)
+            job = &p->jobs[i];
+    /* the packet is only valid until we return */
+    if ((ret = av_new_packet(&job->pkt, pkt->size)) < 0)
+        goto end;
+    memcpy(job->pkt.data, pkt->data, pkt->size);
+    job->pkt.stream_index = pkt->stream_index;
+    job->number = img->img_number;
+    job->state  = JOB_QUEUED;
+    if ((ret = ff_task_queue_submit(p->queue, job)) < 0) {
+        av_free_packet(&job->pkt);
+        job->state = JOB_FREE;
+        goto end;
+    }
+    img->img_number++;
+    p->nb_queued++;
+end:
+    pthread_mutex_unlock(&p->lock);
+    return ret;
+}
+#endif
+
+static int img_read_packet(AVFormatContext *s1, AVPacket *pkt)
+{
+    VideoData *s = s1->priv_data;
+    AVCodecContext *codec= s1->streams[0]->codec;
+    int ret, size;
+
+#if HAVE_PTHREADS
+    if (s->pool) {
+        ret = image_pool_read(s1, pkt, &size);
+    } else
+#endif
+    {
+        if (!s->is_pipe) {
+            /* loop over input */
+            if (s1->loop_input && s->img_number > s->img_last) {
+                s->img_number = s->img_first;
+            }
+            if (s->img_number > s->img_last)
+                return AVERROR_EOF;
+        }
+        ret = read_image(s1, s->img_number, pkt, &size);
+    }
+    if (ret < 0)
+        return ret;
+
+    if(!s->is_pipe && codec->codec_id == CODEC_ID_RAWVIDEO && !codec->width)
+        infer_size(&codec->width, &codec->height, size);
+    s->img_count++;
+    s->img_number++;
+    return 0;
+}
+
+#if HAVE_PTHREADS
+static int img_read_close(AVFormatContext *s1)
+{
+    image_pool_free(s1->priv_data);
+    return 0;
+}
+#endif
+
 #if CONFIG_IMAGE2_MUXER || CONFIG_IMAGE2PIPE_MUXER
 /******************************************************/
 /* image output */
@@ -330,10 +588,14 @@ static int img_write_header(AVFormatContext *s)
     else
         img->is_pipe = 1;
 
+#if HAVE_PTHREADS
+    if (!img->is_pipe && s->image_threads > 0)
+        return image_pool_init(s, 1);
+#endif
     return 0;
 }
 
-static int img_write_packet(AVFormatContext *s, AVPacket *pkt)
+static int write_image(AVFormatContext *s, int number, AVPacket *pkt)
 {
     VideoData *img = s->priv_data;
     ByteIOContext *pb[3];
@@ -343,7 +605,7 @@ static int img_write_packet(AVFormatContext *s, AVPacket *pkt)
 
     if (!img->is_pipe) {
         if (av_get_frame_filename(filename, sizeof(filename),
-                                  img->path, img->img_number) < 0 && img->img_number>1) {
+                                  img->path, number) < 0 && number>1) {
             av_log(s, AV_LOG_ERROR, "Could not get frame filename from pattern\n");
             return AVERROR(EIO);
         }
@@ -400,11 +662,33 @@ static int img_write_packet(AVFormatContext *s, AVPacket *pkt)
     if (!img->is_pipe) {
         url_fclose(pb[0]);
     }
+    return 0;
+}
+
+static int img_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    VideoData *img = s->priv_data;
+    int ret;
 
+#if HAVE_PTHREADS
+    if (img->pool)
+        return image_pool_write(s, pkt);
+#endif
+    if ((ret = write_image(s, img->img_number, pkt)) < 0)
+        return ret;
     img->img_number++;
     return 0;
 }
 
+#if HAVE_PTHREADS && CONFIG_IMAGE2_MUXER
+static int img_write_trailer(AVFormatContext *s)
+{
+    return image_pool_free(s->priv_data);
+}
+#else
+#define img_write_trailer NULL
+#endif
+
 #endif /* CONFIG_IMAGE2_MUXER || CONFIG_IMAGE2PIPE_MUXER */
 
 /* input */
@@ -416,7 +700,11 @@ AVInputFormat image2_demuxer = {
     image_probe,
     img_read_header,
     img_read_packet,
+#if HAVE_PTHREADS
+    img_read_close,
+#else
     NULL,
+#endif
     NULL,
     NULL,
     AVFMT_NOFILE,
@@ -445,7 +733,7 @@ AVOutputFormat image2_muxer = {
     CODEC_ID_MJPEG,
     img_write_header,
     img_write_packet,
-    NULL,
+    img_write_trailer,
     .flags= AVFMT_NOTIMESTAMPS | AVFMT_NOFILE
 };
 #endif
@@ -0,0 +1,506 @@
+/*
+ * Persistent index cache
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/indexcache.c
+ * Persistent index cache.
+ * With AVFMT_FLAG_INDEX_CACHE the stream indexes, parameters and durations
+ * found for a file are serialized when it is closed, either to a
+ * "<filename>.ffindex" sidecar or through AVFormatContext.index_cache_io.
+ * On the next open of the same file, identified by its size, modification
+ * time and a CRC of its first bytes, demuxers take their index from the
+ * cache instead of reading it again and av_find_stream_info() returns
+ * without reading any packets.
+ */
+
+#include <sys/stat.h>
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+
+#define INDEX_CACHE_TAG     MKTAG('F', 'F', 'I', 'X')
+#define INDEX_CACHE_VERSION 1
+#define INDEX_CACHE_CRC_LEN 4096
+
+typedef struct IndexCacheStream {
+    /* codec as known after read_header(), to check the cache still fits */
+    int hdr_codec_type, hdr_codec_id;
+
+    int codec_type, codec_id;
+    unsigned int codec_tag;
+    AVRational time_base, r_frame_rate, avg_frame_rate, sample_aspect_ratio;
+    int64_t start_time, duration, nb_frames;
+    AVRational codec_time_base, codec_sample_aspect_ratio;
+    int ticks_per_frame, bit_rate;
+    int width, height, pix_fmt, has_b_frames;
+    int sample_rate, channels, sample_fmt, frame_size, block_align;
+    int bits_per_coded_sample;
+    int64_t channel_layout;
+    uint8_t *extradata;
+    int extradata_size;
+
+    AVIndexEntry *entries;
+    int nb_entries;
+    int restored;       ///< entries have been added to the stream
+} IndexCacheStream;
+
+typedef struct IndexCache {
+    int64_t file_size;
+    int64_t mtime;
+    uint32_t crc;
+    char path[1024];    ///< sidecar file, empty if there is none
+
+    int valid;          ///< a cache matching the file was loaded
+    int have_info;      ///< the loaded cache holds the stream parameters
+    int info_done;      ///< av_find_stream_info() ran on this context
+    int64_t start_time, duration;
+    int bit_rate;
+    int nb_streams;
+    IndexCacheStream *streams;
+
+    int nb_hdr_streams;
+    int hdr_codec_type[MAX_STREAMS], hdr_codec_id[MAX_STREAMS];
+} IndexCache;
+
+static void free_streams(IndexCache *c)
+{
+    int i;
+
+    for (i = 0; i < c->nb_streams; i++) {
+        av_free(c->streams[i].extradata);
+        av_free(c->streams[i].entries);
+    }
+    av_freep(&c->streams);
+    c->nb_streams = 0;
+    c->valid      = 0;
+    c->have_info  = 0;
+}
+
+static AVRational get_rational(ByteIOContext *pb)
+{
+    AVRational q;
+    q.num = get_le32(pb);
+    q.den = get_le32(pb);
+    return q;
+}
+
+static void put_rational(ByteIOContext *pb, AVRational q)
+{
+    put_le32(pb, q.num);
+    put_le32(pb, q.den);
+}
+
+static int read_cache(IndexCache *c, ByteIOContext *pb)
+{
+    int i, j, nb_streams;
+
+    if (get_le32(pb) != INDEX_CACHE_TAG || get_le32(pb) != INDEX_CACHE_VERSION)
+        return AVERROR_INVALIDDATA;
+    if (get_le64(pb) != c->file_size || get_le64(pb) != c->mtime ||
+        get_le32(pb) != c->crc)
+        return AVERROR_INVALIDDATA;
+
+    c->have_info  = get_byte(pb);
+    c->start_time = get_le64(pb);
+    c->duration   = get_le64(pb);
+    c->bit_rate   = get_le32(pb);
+    nb_streams    = get_le32(pb);
+    if ((unsigned)nb_streams > MAX_STREAMS)
+        return AVERROR_INVALIDDATA;
+    c->streams = av_mallocz(nb_streams * sizeof(*c->streams));
+    if (nb_streams && !c->streams)
+        return AVERROR(ENOMEM);
+    c->nb_streams = nb_streams;
+
+    for (i = 0; i < c->nb_streams; i++) {
+        IndexCacheStream *cs = &c->streams[i];
+
+        cs->hdr_codec_type     = get_le32(pb);
+        cs->hdr_codec_id       = get_le32(pb);
+        cs->codec_type         = get_le32(pb);
+        cs->codec_id           = get_le32(pb);
+        cs->codec_tag          = get_le32(pb);
+        cs->time_base          = get_rational(pb);
+        cs->r_frame_rate       = get_rational(pb);
+        cs->avg_frame_rate     = get_rational(pb);
+        cs->sample_aspect_ratio= get_rational(pb);
+        cs->start_time         = get_le64(pb);
+        cs->duration           = get_le64(pb);
+        cs->nb_frames          = get_le64(pb);
+        cs->codec_time_base    = get_rational(pb);
+        cs->codec_sample_aspect_ratio = get_rational(pb);
+        cs->ticks_per_frame    = get_le32(pb);
+        cs->bit_rate           = get_le32(pb);
+        cs->width              = get_le32(pb);
+        cs->height             = get_le32(pb);
+        cs->pix_fmt            = get_le32(pb);
+        cs->has_b_frames       = get_le32(pb);
+        cs->sample_rate        = get_le32(pb);
+        cs->channels           = get_le32(pb);
+        cs->sample_fmt         = get_le32(pb);
+        cs->frame_size         = get_le32(pb);
+        cs->block_align        = get_le32(pb);
+        cs->bits_per_coded_sample = get_le32(pb);
+        cs->channel_layout     = get_le64(pb);
+
+        cs->extradata_size = get_le32(pb);
+        if ((unsigned)cs->extradata_size > (1 << 28))
+            return AVERROR_INVALIDDATA;
+        if (cs->extradata_size) {
+            cs->extradata = av_mallocz(cs->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+            if (!cs->extradata)
+                return AVERROR(ENOMEM);
+            if (get_buffer(pb, cs->extradata, cs->extradata_size) != cs->extradata_size)
+                return AVERROR_INVALIDDATA;
+        }
+
+        cs->nb_entries = get_le32(pb);
+        if ((unsigned)cs->nb_entries >= UINT_MAX / sizeof(AVIndexEntry))
+            return AVERROR_INVALIDDATA;
+        if (cs->nb_entries) {
+            cs->entries = av_malloc(cs->nb_entries * sizeof(AVIndexEntry));
+            if (!cs->entries)
+                return AVERROR(ENOMEM);
+        }
+        for (j = 0; j < cs->nb_entries; j++) {
+            AVIndexEntry *ie = &cs->entries[j];
+            unsigned int v;
+            ie->pos          = get_le64(pb);
+            ie->timestamp    = get_le64(pb);
+            v                = get_le32(pb);
+            ie->min_distance = get_le32(pb);
+            ie->size         = v >> 2;
+            ie->flags        = v & 3;
+            if (url_feof(pb))
+                return AVERROR_INVALIDDATA;
+        }
+    }
+    if (url_feof(pb))
+        return AVERROR_INVALIDDATA;
+    c->valid = 1;
+    return 0;
+}
+
+static void write_cache(AVFormatContext *s, IndexCache *c, ByteIOContext *pb)
+{
+    int i, j;
+
+    put_le32(pb, INDEX_CACHE_TAG);
+    put_le32(pb, INDEX_CACHE_VERSION);
+    put_le64(pb, c->file_size);
+    put_le64(pb, c->mtime);
+    put_le32(pb, c->crc);
+
+    put_byte(pb, c->info_done);
+    put_le64(pb, s->start_time);
+    put_le64(pb, s->duration);
+    put_le32(pb, s->bit_rate);
+    put_le32(pb, c->nb_hdr_streams);
+
+    for (i = 0; i < c->nb_hdr_streams; i++) {
+        AVStream *st = s->streams[i];
+        AVCodecContext *codec = st->codec;
+        int nb_entries = ff_index_nb_entries(st);
+
+        put_le32(pb, c->hdr_codec_type[i]);
+        put_le32(pb, c->hdr_codec_id[i]);
+        put_le32(pb, codec->codec_type);
+        put_le32(pb, codec->codec_id);
+        put_le32(pb, codec->codec_tag);
+        put_rational(pb, st->time_base);
+        put_rational(pb, st->r_frame_rate);
+        put_rational(pb, st->avg_frame_rate);
+        put_rational(pb, st->sample_aspect_ratio);
+        put_le64(pb, st->start_time);
+        put_le64(pb, st->duration);
+        put_le64(pb, st->nb_frames);
+        put_rational(pb, codec->time_base);
+        put_rational(pb, codec->sample_aspect_ratio);
+        put_le32(pb, codec->ticks_per_frame);
+        put_le32(pb, codec->bit_rate);
+        put_le32(pb, codec->width);
+        put_le32(pb, codec->height);
+        put_le32(pb, codec->pix_fmt);
+        put_le32(pb, codec->has_b_frames);
+        put_le32(pb, codec->sample_rate);
+        put_le32(pb, codec->channels);
+        put_le32(pb, codec->sample_fmt);
+        put_le32(pb, codec->frame_size);
+        put_le32(pb, codec->block_align);
+        put_le32(pb, codec->bits_per_coded_sample);
+        put_le64(pb, codec->channel_layout);
+
+        put_le32(pb, codec->extradata ? codec->extradata_size : 0);
+        if (codec->extradata)
+            put_buffer(pb, codec->extradata, codec->extradata_size);
+
+        put_le32(pb, nb_entries);
+        for (j = 0; j < nb_entries; j++) {
+            const AVIndexEntry *ie = ff_index_get_entry(st, j);
+            put_le64(pb, ie->pos);
+            put_le64(pb, ie->timestamp);
+            put_le32(pb, (unsigned)ie->size << 2 | (ie->flags & 3));
+            put_le32(pb, ie->min_distance);
+        }
+    }
+}
+
+/**
+ * Compute the identity of the file being opened, pb must be at its start.
+ */
+static int identify_file(AVFormatContext *s, IndexCache *c)
+{
+    ByteIOContext *pb = s->pb;
+    const char *path = s->filename;
+    uint8_t buf[INDEX_CACHE_CRC_LEN];
+    int64_t pos = url_ftell(pb);
+    struct stat sb;
+    int len;
+
+    c->file_size = url_fsize(pb);
+    if (c->file_size < 0)
+        return -1;
+
+    len = get_buffer(pb, buf, sizeof(buf));
+    if (url_fseek(pb, pos, SEEK_SET) != pos)
+        return -1;
+    c->crc = ff_crc32_ieee(0, buf, FFMAX(len, 0));
+
+    av_strstart(path, "file:", &path);
+    if (!stat(path, &sb)) {
+        c->mtime = sb.st_mtime;
+        snprintf(c->path, sizeof(c->path), "file:%s.ffindex", path);
+    } else if (!s->index_cache_io) {
+        /* there is nowhere to keep the cache */
+        return -1;
+    }
+    return 0;
+}
+
+int ff_index_cache_open(AVFormatContext *s)
+{
+    const AVIndexCacheIO *io = s->index_cache_io;
+    IndexCache *c;
+    ByteIOContext *pb = NULL, mem;
+    uint8_t *buf = NULL;
+    int ret, size;
+
+    c = av_mallocz(sizeof(IndexCache));
+    if (!c)
+        return AVERROR(ENOMEM);
+    if (identify_file(s, c) < 0) {
+        av_free(c);
+        return -1;
+    }
+    s->index_cache = c;
+
+    if (io) {
+        if ((size = io->load(io->opaque, s->filename, &buf)) <= 0)
+            return 0;
+        init_put_byte(&mem, buf, size, 0, NULL, NULL, NULL, NULL);
+        pb = &mem;
+    } else if (url_fopen(&pb, c->path, URL_RDONLY) < 0) {
+        return 0;
+    }
+
+    ret = read_cache(c, pb);
+    if (ret < 0) {
+        av_log(s, AV_LOG_DEBUG, "index cache of %s is not usable\n", s->filename);
+        free_streams(c);
+    }
+
+    if (io)
+        av_free(buf);
+    else
+        url_fclose(pb);
+    return 0;
+}
+
+int ff_index_cache_valid(AVFormatContext *s)
+{
+    return s->index_cache && s->index_cache->valid;
+}
+
+static int restore_stream(AVFormatContext *s, AVStream *st)
+{
+    IndexCache *c = s->index_cache;
+    IndexCacheStream *cs;
+    int i;
+
+    if (!c || !c->valid || st->index >= c->nb_streams)
+        return 0;
+    cs = &c->streams[st->index];
+    if (cs->restored)
+        return 1;
+    if (cs->hdr_codec_type != st->codec->codec_type ||
+        cs->hdr_codec_id   != st->codec->codec_id   ||
+        ff_index_nb_entries(st))
+        return 0;
+
+    ff_reserve_index_entries(st, cs->nb_entries);
+    for (i = 0; i < cs->nb_entries; i++) {
+        AVIndexEntry *ie = &cs->entries[i];
+        if (av_add_index_entry(st, ie->pos, ie->timestamp, ie->size,
+                               ie->min_distance, ie->flags) < 0)
+            return 0;
+    }
+    cs->restored = 1;
+    return 1;
+}
+
+int ff_index_cache_restore(AVFormatContext *s, AVStream *st)
+{
+    int i, ret = 1;
+
+    if (st)
+        return restore_stream(s, st);
+    for (i = 0; i < s->nb_streams; i++)
+        ret &= restore_stream(s, s->streams[i]);
+    return ret;
+}
+
+void ff_index_cache_header(AVFormatContext *s)
+{
+    IndexCache *c = s->index_cache;
+    int i;
+
+    c->nb_hdr_streams = s->nb_streams;
+    for (i = 0; i < s->nb_streams; i++) {
+        c->hdr_codec_type[i] = s->streams[i]->codec->codec_type;
+        c->hdr_codec_id[i]   = s->streams[i]->codec->codec_id;
+    }
+    if (!c->valid)
+        return;
+
+    if (c->nb_streams != s->nb_streams) {
+        free_streams(c);
+        return;
+    }
+    /* demuxers without a specific hook get their index here */
+    for (i = 0; i < s->nb_streams; i++)
+        restore_stream(s, s->streams[i]);
+}
+
+int ff_index_cache_apply_info(AVFormatContext *s)
+{
+    IndexCache *c = s->index_cache;
+    int i;
+
+    if (!c || !c->valid || !c->have_info || (s->ctx_flags & AVFMTCTX_NOHEADER) ||
+        c->nb_streams != s->nb_streams)
+        return 0;
+    for (i = 0; i < s->nb_streams; i++)
+        if (c->streams[i].hdr_codec_type != s->streams[i]->codec->codec_type ||
+            c->streams[i].hdr_codec_id   != s->streams[i]->codec->codec_id)
+            return 0;
+
+    for (i = 0; i < s->nb_streams; i++) {
+        IndexCacheStream *cs = &c->streams[i];
+        AVStream *st = s->streams[i];
+        AVCodecContext *codec = st->codec;
+
+        codec->codec_type            = cs->codec_type;
+        codec->codec_id              = cs->codec_id;
+        codec->codec_tag             = cs->codec_tag;
+        st->time_base                = cs->time_base;
+        st->r_frame_rate             = cs->r_frame_rate;
+        st->avg_frame_rate           = cs->avg_frame_rate;
+        st->sample_aspect_ratio      = cs->sample_aspect_ratio;
+        st->start_time               = cs->start_time;
+        st->duration                 = cs->duration;
+        st->nb_frames                = cs->nb_frames;
+        codec->time_base             = cs->codec_time_base;
+        codec->sample_aspect_ratio   = cs->codec_sample_aspect_ratio;
+        codec->ticks_per_frame       = cs->ticks_per_frame;
+        codec->bit_rate              = cs->bit_rate;
+        codec->width                 = cs->width;
+        codec->height                = cs->height;
+        codec->pix_fmt               = cs->pix_fmt;
+        codec->has_b_frames          = cs->has_b_frames;
+        codec->sample_rate           = cs->sample_rate;
+        codec->channels              = cs->channels;
+        codec->sample_fmt            = cs->sample_fmt;
+        codec->frame_size            = cs->frame_size;
+        codec->block_align           = cs->block_align;
+        codec->bits_per_coded_sample = cs->bits_per_coded_sample;
+        codec->channel_layout        = cs->channel_layout;
+        /* extradata split from the bitstream by av_find_stream_info() */
+        if (!codec->extradata && cs->extradata) {
+            codec->extradata      = cs->extradata;
+            codec->extradata_size = cs->extradata_size;
+            cs->extradata         = NULL;
+        }
+    }
+    s->start_time = c->start_time;
+    s->duration   = c->duration;
+    s->bit_rate   = c->bit_rate;
+    c->info_done  = 1;
+    return 1;
+}
+
+void ff_index_cache_info_done(AVFormatContext *s)
+{
+    if (s->index_cache)
+        s->index_cache->info_done = 1;
+}
+
+/**
+ * @return 1 if the state of s is not what the loaded cache holds
+ */
+static int cache_changed(AVFormatContext *s, IndexCache *c)
+{
+    int i;
+
+    if (!c->valid || c->info_done > c->have_info)
+        return 1;
+    for (i = 0; i < c->nb_hdr_streams; i++)
+        if (ff_index_nb_entries(s->streams[i]) != c->streams[i].nb_entries)
+            return 1;
+    return 0;
+}
+
+void ff_index_cache_close(AVFormatContext *s, int store)
+{
+    IndexCache *c = s->index_cache;
+    const AVIndexCacheIO *io = s->index_cache_io;
+    ByteIOContext *pb;
+    uint8_t *buf;
+    int size;
+
+    if (!c)
+        return;
+    if (store && c->nb_hdr_streams <= s->nb_streams && cache_changed(s, c) &&
+        url_open_dyn_buf(&pb) >= 0) {
+        write_cache(s, c, pb);
+        size = url_close_dyn_buf(pb, &buf);
+        if (io) {
+            io->store(io->opaque, s->filename, buf, size);
+        } else if (url_fopen(&pb, c->path, URL_WRONLY) >= 0) {
+            put_buffer(pb, buf, size);
+            url_fclose(pb);
+        } else {
+            av_log(s, AV_LOG_DEBUG, "could not write index cache %s\n", c->path);
+        }
+        av_free(buf);
+    }
+    free_streams(c);
+    av_freep(&s->index_cache);
+}
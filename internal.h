@@ -26,13 +26,324 @@
 
 char *ff_data_to_hex(char *buf, const uint8_t *src, int size);
 
+/**
+ * Flags for AVStream.container_params, set by demuxers whose headers
+ * fully describe a stream, see AVFMT_FLAG_TRUST_CONTAINER.
+ */
+#define FF_PARAM_CODEC      0x0001 ///< codec_type and codec_id
+#define FF_PARAM_DIMENSIONS 0x0002 ///< width and height
+#define FF_PARAM_AUDIO      0x0004 ///< sample_rate and channels
+#define FF_PARAM_EXTRADATA  0x0008 ///< extradata, if any, is in the header
+#define FF_PARAM_FRAME_RATE 0x0010 ///< avg_frame_rate or codec time_base is the frame rate
+#define FF_PARAM_FRAMING    0x0020 ///< packets are whole frames with key flags and timestamps, see AVFMT_FLAG_NOPARSE
+
+/**
+ * Update a CRC-32 with the 0x04C11DB7 polynomial, same result as
+ * av_crc(av_crc_get_table(AV_CRC_32_IEEE), crc, buf, len) but faster.
+ */
+uint32_t ff_crc32_ieee(uint32_t crc, const uint8_t *buf, size_t len);
+
+/**
+ * Test the global url_interrupt_cb and the given settings, which may be NULL.
+ * @return 0, AVERROR(EINTR) if interrupted or AVERROR(ETIMEDOUT) if the
+ *         deadline passed
+ */
+int ff_check_interrupt(const URLInterrupt *intr);
+
+/**
+ * @return the descriptor that becomes readable on url_interrupt_wakeup(),
+ *         or -1 if url_enable_interrupt_wakeup() was not called
+ */
+int ff_interrupt_wakeup_fd(void);
+
+/**
+ * Works like av_new_packet(), but allocates the payload with the
+ * packet_allocator of s if it is set.
+ */
+int ff_new_packet(AVFormatContext *s, AVPacket *pkt, int size);
+
+/**
+ * Works like av_get_packet(), but allocates the payload with the
+ * packet_allocator of s if it is set.
+ */
+int ff_get_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *pkt, int size);
+
+/**
+ * Works like ff_get_packet(), but if AVFMT_FLAG_NOBUFFERCOPY is set and
+ * the payload (plus FF_INPUT_BUFFER_PADDING_SIZE bytes) is available in
+ * the buffer of pb, the returned packet points into that buffer instead
+ * of being allocated and copied. Such a packet does not own its data and
+ * is only valid until the next read from pb, so this must be the last
+ * read done before returning it from AVInputFormat.read_packet().
+ */
+int ff_get_packet_nocopy(AVFormatContext *s, ByteIOContext *pb, AVPacket *pkt, int size);
+
+/**
+ * Get a zeroed packet list node, reusing the nodes freed with
+ * ff_packet_list_free() on s.
+ * @return the node, or NULL if out of memory
+ */
+AVPacketList *ff_packet_list_alloc(AVFormatContext *s);
+
+/**
+ * Give a packet list node from ff_packet_list_alloc() back to s for reuse.
+ * The packet in it is not freed.
+ */
+void ff_packet_list_free(AVFormatContext *s, AVPacketList *pktl);
+
+/**
+ * Add size bytes (negative to release) to the buffered memory of s.
+ */
+void ff_buffer_memory_add(AVFormatContext *s, int64_t size);
+
+/**
+ * Check whether buffering size more bytes would exceed
+ * AVFormatContext.max_buffer_memory, and warn once if so.
+ * @param what the buffering that degrades, for the warning
+ * @return 1 if the budget is exhausted, 0 otherwise
+ */
+int ff_buffer_memory_check(AVFormatContext *s, int64_t size, const char *what);
+
+/**
+ * Check AVFormatContext.max_work_time while reading the header or
+ * analyzing the streams, and log an error once it is exceeded.
+ * @return AVERROR_WORK_LIMIT if it is exceeded, 0 otherwise
+ */
+int ff_check_work_time(AVFormatContext *s);
+
+/**
+ * Account a queued packet list node from ff_packet_list_alloc() in the
+ * buffered memory of s, until it is given back with ff_packet_list_free().
+ */
+void ff_packet_list_account(AVFormatContext *s, AVPacketList *pktl);
+
+/**
+ * Free the unused packet list nodes and payload buffers of s. Buffers still
+ * in use are freed by their packets' destructors.
+ */
+void ff_packet_pool_uninit(AVFormatContext *s);
+
+/**
+ * Free what avf_sdp_create() cached in s.
+ */
+void ff_sdp_cache_free(AVFormatContext *s);
+
+/**
+ * Works like av_interleaved_write_frame(), but if the muxing thread of s
+ * (see mux_queue_size) has a full queue, drops the packet and returns
+ * AVERROR(EAGAIN) instead of waiting.
+ */
+int ff_interleaved_write_frame_nonblock(AVFormatContext *s, AVPacket *pkt);
+
+/**
+ * Feed a timestamp of the clock of a live source into its recovered clock,
+ * created on first use. A clock belongs to a program or to a stream, the
+ * other id being -1. Backward jumps and gaps of the timestamps restart it.
+ *
+ * @param wrap period of the timestamps in time_base, 0 if they do not wrap
+ * @param arrival av_gettime() when the timestamp arrived
+ */
+void ff_clock_recovery_update(AVFormatContext *s, int program_id, int stream_index,
+                              int64_t ts, AVRational time_base, int64_t wrap,
+                              int64_t arrival);
+
+/**
+ * Free the clocks recovered for s.
+ */
+void ff_clock_recovery_free(AVFormatContext *s);
+
+/**
+ * Works like av_dup_packet(), but copies into a reused buffer of s if
+ * AVFMT_FLAG_PACKET_POOL is set. Only for packets that are freed inside
+ * libavformat, as av_dup_packet() on the copy would leak the buffer.
+ */
+int ff_dup_packet(AVFormatContext *s, AVPacket *pkt);
+
+/**
+ * Works like av_new_packet(), but takes the payload from the reused
+ * buffers of s whatever AVFMT_FLAG_PACKET_POOL, with the same restriction
+ * as ff_dup_packet().
+ */
+int ff_packet_pool_new(AVFormatContext *s, AVPacket *pkt, int size);
+
+/**
+ * Make dst another reference to the payload of src, without copying it.
+ * The payload is freed with the last of the packets sharing it; src is
+ * changed to a shared packet if it was not one already, and a payload
+ * that src does not own is copied first. Only for packets that are freed
+ * inside libavformat or returned with AVFMT_FLAG_SHARED_PAYLOAD, as
+ * av_dup_packet() on a shared packet would leak the reference.
+ */
+int ff_packet_ref(AVPacket *dst, AVPacket *src);
+
+/**
+ * Make room for nb_entries more index entries in st, for demuxers that know
+ * the size of their index before adding it with av_add_index_entry().
+ * @return 0 on success, <0 if out of memory
+ */
+int ff_reserve_index_entries(AVStream *st, unsigned int nb_entries);
+
+/**
+ * Add nb_entries entries of strictly increasing timestamps to the index
+ * of st. They are copied at once when they all come after the existing
+ * entries, and added with av_add_index_entry() otherwise.
+ * @return 0 on success, <0 if out of memory
+ */
+int ff_add_index_entries(AVStream *st, const AVIndexEntry *entries, int nb_entries);
+
+/**
+ * Store the index of st delta coded, taking a fraction of the memory of
+ * index_entries on files with millions of samples. Must be called before
+ * the first av_add_index_entry(); afterwards index_entries stays empty and
+ * entries must be read with ff_index_get_entry().
+ * @return 0 on success, <0 on error
+ */
+int ff_index_enable_compact(AVStream *st);
+
+/**
+ * @return number of index entries of st, compact or not
+ */
+int ff_index_nb_entries(AVStream *st);
+
+/**
+ * @return index entry number index of st or NULL if out of range, the
+ *         pointer is only valid until the next index operation on st
+ */
+const AVIndexEntry *ff_index_get_entry(AVStream *st, int index);
+
+/**
+ * Load the index cache for the file opened in s, pb must be at the start
+ * of the file. Called before read_header() with AVFMT_FLAG_INDEX_CACHE.
+ * @return 0 if s->index_cache was set up, <0 if the file cannot be cached
+ */
+int ff_index_cache_open(AVFormatContext *s);
+
+/**
+ * @return nonzero if a cache matching the opened file was loaded, demuxers
+ *         may then skip reading their index
+ */
+int ff_index_cache_valid(AVFormatContext *s);
+
+/**
+ * Fill the empty index of st, or of all streams if st is NULL, from the
+ * index cache. Demuxers call this in place of reading their index.
+ * @return 1 if the index was restored, 0 if it has to be read
+ */
+int ff_index_cache_restore(AVFormatContext *s, AVStream *st);
+
+/**
+ * Check the index cache against the streams created by read_header() and
+ * restore the indexes not restored by the demuxer.
+ */
+void ff_index_cache_header(AVFormatContext *s);
+
+/**
+ * Set the stream parameters and durations from the index cache.
+ * @return 1 if they were set and av_find_stream_info() is not needed
+ */
+int ff_index_cache_apply_info(AVFormatContext *s);
+
+/**
+ * Signal that av_find_stream_info() completed, so that the stream
+ * parameters are cached.
+ */
+void ff_index_cache_info_done(AVFormatContext *s);
+
+/**
+ * Free the index cache of s, storing it first if store is set and the
+ * cached data is out of date.
+ */
+void ff_index_cache_close(AVFormatContext *s, int store);
+
+/**
+ * Format and codec parameters remembered for a URL, see
+ * AVFMT_FLAG_PROBE_CACHE.
+ */
+typedef struct ProbeCacheEntry ProbeCacheEntry;
+
+/**
+ * @return the input format cached for url, NULL if there is none
+ */
+AVInputFormat *ff_probe_cache_format(const char *url);
+
+/**
+ * @return a copy of the cache of the URL of s, if it was for the same
+ *         input format, to be freed with ff_probe_cache_free(), or NULL
+ */
+ProbeCacheEntry *ff_probe_cache_get(AVFormatContext *s);
+
+/**
+ * @return the number of streams found when the cache was stored
+ */
+int ff_probe_cache_nb_streams(const ProbeCacheEntry *e);
+
+/**
+ * Fill the unknown codec parameters of st from the cached stream of the
+ * same id, if the demuxer gave st the same codec type and codec id.
+ * @return 1 if the parameters were taken, 0 else
+ */
+int ff_probe_cache_apply_stream(ProbeCacheEntry *e, AVStream *st);
+
+void ff_probe_cache_free(ProbeCacheEntry **e);
+
+/**
+ * Remember the format and the codec parameters of the streams of s for
+ * its URL, replacing what was cached for it.
+ */
+void ff_probe_cache_store(AVFormatContext *s);
+
+/**
+ * Forget what was cached for url.
+ */
+void ff_probe_cache_drop(const char *url);
+
 void av_program_add_stream_index(AVFormatContext *ac, int progid, unsigned int idx);
 
 /**
- * Add packet to AVFormatContext->packet_buffer list, determining its
- * interleaved position using compare() function argument.
+ * Add packet to the interleaving queue of s, determining its interleaved
+ * position using compare() function argument. The packet is moved into the
+ * queue: pkt->destruct is cleared and non-alloced data is duplicated.
+ * @return 0 on success, AVERROR(ENOMEM) if the packet could not be queued
+ */
+int ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
+                             int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
+
+/**
+ * @return the next packet of the interleaving queue, which stays queued,
+ *         or NULL if the queue is empty
+ */
+AVPacket *ff_interleave_peek(AVFormatContext *s);
+
+/**
+ * Remove the next packet from the interleaving queue.
+ * @return 1 if a packet was output, 0 if the queue is empty
+ */
+int ff_interleave_get_packet(AVFormatContext *s, AVPacket *out);
+
+/**
+ * @return number of streams with packets in the interleaving queue
+ */
+int ff_interleave_queued_streams(AVFormatContext *s);
+
+/**
+ * @return number of packets of the given stream in the interleaving queue
+ */
+int ff_interleave_queued_packets(AVFormatContext *s, int stream_index);
+
+/**
+ * Build hashed lookup indexes for the codec tag tables referenced by the
+ * registered formats, used by ff_codec_get_id() and ff_codec_get_tag().
+ * Must be called once after format registration, before any lookup;
+ * tables not indexed are searched linearly.
+ */
+void ff_codec_tag_index_init(void);
+
+/**
+ * Read the tags at the end of the input of s with read_tags, which may
+ * seek; the position is restored afterwards. Done at once for local
+ * files, postponed to av_read_tail_tags() or the end of the input
+ * otherwise.
  */
-void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
-                              int (*compare)(AVFormatContext *, AVPacket *, AVPacket *));
+void ff_read_tail_tags(AVFormatContext *s, void (*read_tags)(AVFormatContext *s));
 
 #endif /* AVFORMAT_INTERNAL_H */
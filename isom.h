@@ -87,6 +87,21 @@ typedef struct {
     unsigned flags;
 } MOVTrackExt;
 
+/**
+ * Position in the sample tables of a track, for tracks whose index is
+ * looked up on demand instead of being built at open.
+ */
+typedef struct MOVSampleCursor {
+    unsigned int sample;       ///< sample number
+    unsigned int chunk;        ///< chunk holding the sample
+    unsigned int chunk_sample; ///< sample number within the chunk
+    unsigned int stsc_index;
+    unsigned int stts_index;
+    unsigned int stts_sample;  ///< sample number within the stts entry
+    int64_t pos;
+    int64_t dts;
+} MOVSampleCursor;
+
 typedef struct MOVStreamContext {
     ByteIOContext *pb;
     int ffindex;          ///< AVStream index
@@ -123,6 +138,19 @@ typedef struct MOVStreamContext {
     int width;            ///< tkhd width
     int height;           ///< tkhd height
     int dts_shift;        ///< dts shift when ctts is negative
+    int lazy;             ///< sample tables are kept and read on demand, the index only holds keyframes
+    unsigned int lazy_samples; ///< samples reachable through the sample tables
+    int64_t first_dts;    ///< dts of the first sample
+    MOVSampleCursor cursor;
+    AVIndexEntry lazy_entry; ///< last sample returned by mov_get_sample()
+    int64_t next_dts;     ///< dts of the current sample in AV_TIME_BASE
+    int64_t next_pos;     ///< position of the current sample
+    int heap_slot[2];     ///< position in MOVContext.sample_heap, -1 if not in it
+    uint8_t *chunk_buf;   ///< contiguous samples read at once, see mov_read_chunk()
+    int chunk_buf_size;
+    int64_t chunk_pos;    ///< position of chunk_buf in the file
+    int chunk_len;        ///< bytes of chunk_buf holding data
+    int index_pending;    ///< the index is built once the moov is parsed, see AVFormatContext.trak_threads
 } MOVStreamContext;
 
 typedef struct MOVContext {
@@ -138,10 +166,25 @@ typedef struct MOVContext {
     MOVTrackExt *trex_data;
     unsigned trex_count;
     int itunes_metadata;  ///< metadata are itunes style
+    int *sample_heap[2];  ///< streams with samples left, by dts and by position of their current sample
+    int nb_sample_heap[2];
+    int sample_heap_valid; ///< the heaps match the current samples, see mov_find_next_sample()
+    int live;             ///< only keep the samples of the fragments not read yet, see AVFMT_FLAG_LIVE
+    int64_t next_root_atom; ///< position of the top level atom following the last one parsed, for live input
+    int atom_depth;       ///< nesting level of the atom being parsed
+    int nb_atoms;         ///< atoms parsed since the top level, see AVFormatContext.max_atoms
 } MOVContext;
 
 int ff_mp4_read_descr_len(ByteIOContext *pb);
 int ff_mov_read_esds(AVFormatContext *fc, ByteIOContext *pb, MOVAtom atom);
+
+/**
+ * Make the MOV/MP4 muxer s, writing a fragmented file, go on writing to
+ * pb as a new file. The buffered fragment is written to the old output
+ * first and the new one starts with its own ftyp and moov, so that it can
+ * be played on its own.
+ */
+int ff_mov_switch_output(AVFormatContext *s, ByteIOContext *pb);
 enum CodecID ff_mov_get_lpcm_codec_id(int bps, int flags);
 
 #endif /* AVFORMAT_ISOM_H */
@@ -30,6 +30,7 @@
 
 #include <stdio.h>
 #include "avformat.h"
+#include "internal.h"
 /* For ff_codec_get_id(). */
 #include "riff.h"
 #include "isom.h"
@@ -39,6 +40,9 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/avstring.h"
 #include "libavutil/lzo.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #if CONFIG_ZLIB
 #include <zlib.h>
 #endif
@@ -74,6 +78,7 @@ typedef const struct EbmlSyntax {
 typedef struct {
     int nb_elem;
     void *elem;
+    unsigned int alloc_size;    ///< allocated bytes of elem
 } EbmlList;
 
 typedef struct {
@@ -143,6 +148,14 @@ typedef struct {
 
     AVStream *stream;
     int64_t end_timecode;
+
+    /* content decoding state kept across blocks */
+    uint8_t *decode_buf;
+    int      decode_buf_size;
+#if CONFIG_ZLIB
+    z_stream zstream;
+    int      zstream_init;
+#endif
 } MatroskaTrack;
 
 typedef struct {
@@ -204,6 +217,31 @@ typedef struct {
     uint64_t length;
 } MatroskaLevel;
 
+/* seek point found by the cluster scan */
+typedef struct {
+    int64_t  pos;               ///< position of the cluster
+    uint64_t timecode;          ///< of the first key frame of the track in the cluster
+    int      track;             ///< index in MatroskaDemuxContext.tracks
+} MatroskaScanEntry;
+
+/* scan for seek points in files without cues, see AVFMT_FLAG_SCAN_INDEX */
+typedef struct {
+    char filename[1024];
+    int64_t start;              ///< position of the first cluster
+    MatroskaScanEntry *entries;
+    unsigned int entries_size;
+    int nb_entries;
+    int nb_merged;              ///< entries added to the stream indexes
+    int done;
+    int abort_request;
+#if HAVE_PTHREADS
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        ///< signaled when entries are added or the scan is done
+#endif
+} MatroskaScan;
+
 typedef struct {
     AVFormatContext *ctx;
 
@@ -226,8 +264,8 @@ typedef struct {
     int64_t segment_start;
 
     /* the packet queue */
-    AVPacket **packets;
-    int num_packets;
+    AVPacketList *queue;
+    AVPacketList *queue_end;
     AVPacket *prev_pkt;
 
     int done;
@@ -236,6 +274,13 @@ typedef struct {
     /* What to skip before effectively reading a packet. */
     int skip_to_keyframe;
     uint64_t skip_to_timecode;
+
+    /* cluster being read, one element at a time */
+    int in_cluster;
+    uint64_t cluster_time;
+    int64_t cluster_pos;
+
+    MatroskaScan *scan;
 } MatroskaDemuxContext;
 
 typedef struct {
@@ -484,15 +529,21 @@ static EbmlSyntax matroska_blockgroup[] = {
     { 0 }
 };
 
+/* the blocks come first, as nearly all elements of a file are blocks */
 static EbmlSyntax matroska_cluster[] = {
-    { MATROSKA_ID_CLUSTERTIMECODE,EBML_UINT,0, offsetof(MatroskaCluster,timecode) },
-    { MATROSKA_ID_BLOCKGROUP,     EBML_NEST, sizeof(MatroskaBlock), offsetof(MatroskaCluster,blocks), {.n=matroska_blockgroup} },
     { MATROSKA_ID_SIMPLEBLOCK,    EBML_PASS, sizeof(MatroskaBlock), offsetof(MatroskaCluster,blocks), {.n=matroska_blockgroup} },
+    { MATROSKA_ID_BLOCKGROUP,     EBML_NEST, sizeof(MatroskaBlock), offsetof(MatroskaCluster,blocks), {.n=matroska_blockgroup} },
+    { MATROSKA_ID_CLUSTERTIMECODE,EBML_UINT,0, offsetof(MatroskaCluster,timecode) },
     { MATROSKA_ID_CLUSTERPOSITION,EBML_NONE },
     { MATROSKA_ID_CLUSTERPREVSIZE,EBML_NONE },
     { 0 }
 };
 
+static EbmlSyntax matroska_blockgroups[] = {
+    { MATROSKA_ID_BLOCKGROUP,     EBML_NEST, 0, 0, {.n=matroska_blockgroup} },
+    { 0 }
+};
+
 static EbmlSyntax matroska_clusters[] = {
     { MATROSKA_ID_CLUSTER,        EBML_NEST, 0, 0, {.n=matroska_cluster} },
     { MATROSKA_ID_INFO,           EBML_NONE },
@@ -758,7 +809,16 @@ static int ebml_parse_elem(MatroskaDemuxContext *matroska,
     data = (char *)data + syntax->data_offset;
     if (syntax->list_elem_size) {
         EbmlList *list = data;
-        list->elem = av_realloc(list->elem, (list->nb_elem+1)*syntax->list_elem_size);
+        void *elem;
+        if ((unsigned)list->nb_elem >= UINT_MAX / syntax->list_elem_size - 1)
+            return AVERROR(ENOMEM);
+        elem = av_fast_realloc(list->elem, &list->alloc_size,
+                               (list->nb_elem+1)*syntax->list_elem_size);
+        if (!elem) {
+            list->alloc_size = 0;
+            return AVERROR(ENOMEM);
+        }
+        list->elem = elem;
         data = (char*)list->elem + list->nb_elem*syntax->list_elem_size;
         memset(data, 0, syntax->list_elem_size);
         list->nb_elem++;
@@ -868,14 +928,39 @@ static MatroskaTrack *matroska_find_track_by_num(MatroskaDemuxContext *matroska,
     return NULL;
 }
 
+/**
+ * Make the decoding buffer of track hold at least size bytes, keeping its
+ * content. It is only ever grown, so that it ends up sized for the largest
+ * block of the track.
+ */
+static int matroska_decode_buf_grow(MatroskaTrack *track, int size)
+{
+    uint8_t *buf;
+
+    if (size <= track->decode_buf_size)
+        return 0;
+    if (!(buf = av_realloc(track->decode_buf, size + AV_LZO_OUTPUT_PADDING)))
+        return AVERROR(ENOMEM);
+    track->decode_buf      = buf;
+    track->decode_buf_size = size;
+    return 0;
+}
+
+/**
+ * Decode the content encoding of a block or of the codec private data.
+ * Compressed data is decoded into the buffer of the track, *buf then
+ * points to it until the next call; the zlib stream of the track is
+ * reset instead of being set up again for each block.
+ * @return the size of the stripped header to put in front of the data,
+ *         or <0 on error
+ */
 static int matroska_decode_buffer(uint8_t** buf, int* buf_size,
                                   MatroskaTrack *track)
 {
     MatroskaTrackEncoding *encodings = track->encodings.elem;
     uint8_t* data = *buf;
     int isize = *buf_size;
-    uint8_t* pkt_data = NULL;
-    int pkt_size = isize;
+    int pkt_size = FFMAX(3 * isize, track->decode_buf_size);
     int result = 0;
     int olen;
 
@@ -884,32 +969,39 @@ static int matroska_decode_buffer(uint8_t** buf, int* buf_size,
         return encodings[0].compression.settings.size;
     case MATROSKA_TRACK_ENCODING_COMP_LZO:
         do {
-            olen = pkt_size *= 3;
-            pkt_data = av_realloc(pkt_data, pkt_size+AV_LZO_OUTPUT_PADDING);
-            result = av_lzo1x_decode(pkt_data, &olen, data, &isize);
-        } while (result==AV_LZO_OUTPUT_FULL && pkt_size<10000000);
+            if (matroska_decode_buf_grow(track, pkt_size) < 0)
+                return -1;
+            olen  = track->decode_buf_size;
+            isize = *buf_size;
+            result = av_lzo1x_decode(track->decode_buf, &olen, data, &isize);
+            pkt_size = 3 * track->decode_buf_size;
+        } while (result==AV_LZO_OUTPUT_FULL && track->decode_buf_size<10000000);
         if (result)
-            goto failed;
-        pkt_size -= olen;
+            return -1;
+        pkt_size = track->decode_buf_size - olen;
         break;
 #if CONFIG_ZLIB
     case MATROSKA_TRACK_ENCODING_COMP_ZLIB: {
-        z_stream zstream = {0};
-        if (inflateInit(&zstream) != Z_OK)
+        z_stream *zstream = &track->zstream;
+        if (!track->zstream_init) {
+            if (inflateInit(zstream) != Z_OK)
+                return -1;
+            track->zstream_init = 1;
+        } else if (inflateReset(zstream) != Z_OK)
             return -1;
-        zstream.next_in = data;
-        zstream.avail_in = isize;
+        zstream->next_in = data;
+        zstream->avail_in = isize;
         do {
-            pkt_size *= 3;
-            pkt_data = av_realloc(pkt_data, pkt_size);
-            zstream.avail_out = pkt_size - zstream.total_out;
-            zstream.next_out = pkt_data + zstream.total_out;
-            result = inflate(&zstream, Z_NO_FLUSH);
-        } while (result==Z_OK && pkt_size<10000000);
-        pkt_size = zstream.total_out;
-        inflateEnd(&zstream);
+            if (matroska_decode_buf_grow(track, pkt_size) < 0)
+                return -1;
+            zstream->avail_out = track->decode_buf_size - zstream->total_out;
+            zstream->next_out = track->decode_buf + zstream->total_out;
+            result = inflate(zstream, Z_NO_FLUSH);
+            pkt_size = 3 * track->decode_buf_size;
+        } while (result==Z_OK && track->decode_buf_size<10000000);
         if (result != Z_STREAM_END)
-            goto failed;
+            return -1;
+        pkt_size = zstream->total_out;
         break;
     }
 #endif
@@ -921,16 +1013,17 @@ static int matroska_decode_buffer(uint8_t** buf, int* buf_size,
         bzstream.next_in = data;
         bzstream.avail_in = isize;
         do {
-            pkt_size *= 3;
-            pkt_data = av_realloc(pkt_data, pkt_size);
-            bzstream.avail_out = pkt_size - bzstream.total_out_lo32;
-            bzstream.next_out = pkt_data + bzstream.total_out_lo32;
+            if (matroska_decode_buf_grow(track, pkt_size) < 0)
+                break;
+            bzstream.avail_out = track->decode_buf_size - bzstream.total_out_lo32;
+            bzstream.next_out = track->decode_buf + bzstream.total_out_lo32;
             result = BZ2_bzDecompress(&bzstream);
-        } while (result==BZ_OK && pkt_size<10000000);
+            pkt_size = 3 * track->decode_buf_size;
+        } while (result==BZ_OK && track->decode_buf_size<10000000);
         pkt_size = bzstream.total_out_lo32;
         BZ2_bzDecompressEnd(&bzstream);
         if (result != BZ_STREAM_END)
-            goto failed;
+            return -1;
         break;
     }
 #endif
@@ -938,12 +1031,9 @@ static int matroska_decode_buffer(uint8_t** buf, int* buf_size,
         return -1;
     }
 
-    *buf = pkt_data;
+    *buf = track->decode_buf;
     *buf_size = pkt_size;
     return 0;
- failed:
-    av_free(pkt_data);
-    return -1;
 }
 
 static void matroska_fix_ass_packet(MatroskaDemuxContext *matroska,
@@ -971,19 +1061,40 @@ static void matroska_fix_ass_packet(MatroskaDemuxContext *matroska,
             return;
         snprintf(line,len,"Dialogue: %s,%d:%02d:%02d.%02d,%d:%02d:%02d.%02d,%s\r\n",
                  layer, sh, sm, ss, sc, eh, em, es, ec, ptr);
-        av_free(pkt->data);
-        pkt->data = line;
-        pkt->size = strlen(line);
+        av_free_packet(pkt);
+        pkt->data     = line;
+        pkt->size     = strlen(line);
+        pkt->destruct = av_destruct_packet;
     }
 }
 
 static void matroska_merge_packets(AVPacket *out, AVPacket *in)
 {
-    out->data = av_realloc(out->data, out->size+in->size);
-    memcpy(out->data+out->size, in->data, in->size);
-    out->size += in->size;
-    av_destruct_packet(in);
-    av_free(in);
+    /* either packet may be a slice of a shared block buffer */
+    int size = out->size + in->size;
+    uint8_t *data = av_malloc(size + FF_INPUT_BUFFER_PADDING_SIZE);
+
+    if (data) {
+        memcpy(data, out->data, out->size);
+        memcpy(data + out->size, in->data, in->size);
+        memset(data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        av_free_packet(out);
+        out->data     = data;
+        out->size     = size;
+        out->destruct = av_destruct_packet;
+    }
+    av_free_packet(in);
+}
+
+static void matroska_queue_packet(MatroskaDemuxContext *matroska,
+                                  AVPacketList *pktl)
+{
+    if (matroska->queue_end)
+        matroska->queue_end->next = pktl;
+    else
+        matroska->queue = pktl;
+    matroska->queue_end = pktl;
+    ff_packet_list_account(matroska->ctx, pktl);
 }
 
 static void matroska_convert_tag(AVFormatContext *s, EbmlList *list,
@@ -1061,6 +1172,10 @@ static void matroska_execute_seekhead(MatroskaDemuxContext *matroska)
             || seekhead[i].id == MATROSKA_ID_CLUSTER)
             continue;
 
+        /* the cues are restored from the index cache after the header */
+        if (seekhead[i].id == MATROSKA_ID_CUES && ff_index_cache_valid(matroska->ctx))
+            continue;
+
         /* seek */
         if (url_fseek(matroska->ctx->pb, offset, SEEK_SET) != offset)
             continue;
@@ -1094,6 +1209,297 @@ static void matroska_execute_seekhead(MatroskaDemuxContext *matroska)
     matroska->level_up = level_up;
 }
 
+/**
+ * Record that cluster_pos is a seek point of the track with the given
+ * index, at the timecode of its first key frame in the cluster.
+ */
+static int matroska_scan_add(MatroskaScan *scan, int64_t cluster_pos,
+                             uint64_t timecode, int track)
+{
+    MatroskaScanEntry *entries;
+    int res = 0;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+    entries = av_fast_realloc(scan->entries, &scan->entries_size,
+                              (scan->nb_entries + 1) * sizeof(*entries));
+    if (entries) {
+        scan->entries = entries;
+        entries[scan->nb_entries].pos      = cluster_pos;
+        entries[scan->nb_entries].timecode = timecode;
+        entries[scan->nb_entries].track    = track;
+        scan->nb_entries++;
+#if HAVE_PTHREADS
+        pthread_cond_broadcast(&scan->cond);
+#endif
+    } else {
+        scan->entries_size = 0;
+        res = AVERROR(ENOMEM);
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+    return res;
+}
+
+/**
+ * Read the header of the block at the current position of pb and add a
+ * seek point if it is the first key frame of its track in the cluster.
+ * @param keyframe 1 if the block is a key frame, -1 to use its flags
+ * @param seen     per track flags of the key frames found in the cluster
+ */
+static int matroska_scan_block(MatroskaDemuxContext *matroska, ByteIOContext *pb,
+                               int64_t cluster_pos, uint64_t cluster_time,
+                               int keyframe, uint8_t *seen)
+{
+    MatroskaTrack *track;
+    int16_t block_time;
+    uint64_t num;
+    int flags, res, i;
+
+    if ((res = ebml_read_num(matroska, pb, 8, &num)) < 0)
+        return res;
+    block_time = get_be16(pb);
+    flags      = get_byte(pb);
+    if (keyframe == -1)
+        keyframe = flags & 0x80;
+    if (!keyframe || cluster_time == (uint64_t)-1 ||
+        (block_time < 0 && cluster_time < -block_time) ||
+        !(track = matroska_find_track_by_num(matroska, num)))
+        return 0;
+    i = track - (MatroskaTrack *)matroska->tracks.elem;
+    if (seen[i])
+        return 0;
+    seen[i] = 1;
+    return matroska_scan_add(matroska->scan, cluster_pos,
+                             cluster_time + block_time, i);
+}
+
+/**
+ * Scan the BlockGroup ending at end, its block is a key frame if it has
+ * no reference.
+ */
+static int matroska_scan_group(MatroskaDemuxContext *matroska, ByteIOContext *pb,
+                               int64_t end, int64_t cluster_pos,
+                               uint64_t cluster_time, uint8_t *seen)
+{
+    int64_t block_pos = -1;
+    int reference = 0, res;
+    uint64_t id, length;
+
+    while (url_ftell(pb) < end) {
+        if ((res = ebml_read_num(matroska, pb, 4, &id)) < 0)
+            return res;
+        id |= 1 << 7*res;
+        if ((res = ebml_read_num(matroska, pb, 8, &length)) < 0)
+            return res;
+        if (id == MATROSKA_ID_BLOCK)
+            block_pos = url_ftell(pb);
+        else if (id == MATROSKA_ID_BLOCKREFERENCE)
+            reference = 1;
+        if (url_fseek(pb, length, SEEK_CUR) < 0)
+            return AVERROR(EIO);
+    }
+    if (block_pos < 0 || reference)
+        return 0;
+    if (url_fseek(pb, block_pos, SEEK_SET) < 0)
+        return AVERROR(EIO);
+    return matroska_scan_block(matroska, pb, cluster_pos, cluster_time, 1, seen);
+}
+
+static int matroska_scan_aborted(MatroskaScan *scan)
+{
+    int ret;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+    ret = scan->abort_request;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+    return ret;
+}
+
+/**
+ * Walk the clusters of the file from the first one on, reading only the
+ * element headers and the headers of the blocks and skipping the payloads,
+ * to find a seek point per track and cluster. Uses its own ByteIOContext so
+ * that it can run while packets are read.
+ */
+static void matroska_scan_clusters(MatroskaDemuxContext *matroska)
+{
+    MatroskaScan *scan = matroska->scan;
+    ByteIOContext *pb;
+    int64_t pos, end, cluster_pos = -1, cluster_end = 0;
+    uint64_t id, length, cluster_time = -1;
+    uint8_t *seen;
+    int res;
+
+    seen = av_malloc(matroska->tracks.nb_elem);
+    if (seen && url_fopen(&pb, scan->filename, URL_RDONLY) >= 0) {
+        url_fseek(pb, scan->start, SEEK_SET);
+        for (;;) {
+            pos = url_ftell(pb);
+            if (cluster_pos >= 0 && pos >= cluster_end)
+                cluster_pos = -1;
+            if ((res = ebml_read_num(matroska, pb, 4, &id)) < 0)
+                break;
+            id |= 1 << 7*res;
+            if ((res = ebml_read_num(matroska, pb, 8, &length)) < 0)
+                break;
+            if (length == (1ULL << 7*res) - 1)
+                length = UINT64_MAX;
+            else if (length > INT64_MAX - url_ftell(pb))
+                break;
+            end = url_ftell(pb) + length;
+
+            if (id == MATROSKA_ID_CLUSTER) {
+                /* a cluster of unknown size ends where the next one starts */
+                cluster_pos  = pos;
+                cluster_end  = length == UINT64_MAX ? INT64_MAX : end;
+                cluster_time = -1;
+                memset(seen, 0, matroska->tracks.nb_elem);
+                if (matroska_scan_aborted(scan))
+                    break;
+                continue;
+            }
+            /* stop at the next segment or at an element we cannot skip */
+            if (id == EBML_ID_HEADER || length == UINT64_MAX)
+                break;
+            if (cluster_pos >= 0) {
+                res = 0;
+                if (id == MATROSKA_ID_CLUSTERTIMECODE)
+                    res = ebml_read_uint(pb, length, &cluster_time);
+                else if (id == MATROSKA_ID_SIMPLEBLOCK)
+                    res = matroska_scan_block(matroska, pb, cluster_pos,
+                                              cluster_time, -1, seen);
+                else if (id == MATROSKA_ID_BLOCKGROUP)
+                    res = matroska_scan_group(matroska, pb, end, cluster_pos,
+                                              cluster_time, seen);
+                if (res < 0)
+                    break;
+            }
+            if (url_fseek(pb, end, SEEK_SET) != end)
+                break;
+        }
+        url_fclose(pb);
+    }
+    av_free(seen);
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+    scan->done = 1;
+#if HAVE_PTHREADS
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+#endif
+}
+
+#if HAVE_PTHREADS
+static void *matroska_scan_thread(void *arg)
+{
+    matroska_scan_clusters(arg);
+    return NULL;
+}
+#endif
+
+/**
+ * Start scanning the clusters for seek points with AVFMT_FLAG_SCAN_INDEX
+ * if the file has no usable cues and no cached index.
+ */
+static void matroska_scan_start(MatroskaDemuxContext *matroska)
+{
+    AVFormatContext *s = matroska->ctx;
+    MatroskaScan *scan;
+    int i;
+
+    if (!(s->flags & AVFMT_FLAG_SCAN_INDEX) || !s->filename[0] ||
+        url_is_streamed(s->pb) || !matroska->tracks.nb_elem ||
+        ff_index_cache_valid(s))
+        return;
+    for (i = 0; i < s->nb_streams; i++)
+        if (s->streams[i]->nb_index_entries)
+            return;
+    if (!(scan = av_mallocz(sizeof(MatroskaScan))))
+        return;
+    av_strlcpy(scan->filename, s->filename, sizeof(scan->filename));
+    /* the ID of the first cluster was read by the header parser */
+    scan->start = url_ftell(s->pb) - 4 * matroska->has_cluster_id;
+    matroska->scan = scan;
+#if HAVE_PTHREADS
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->cond, NULL);
+    if (!pthread_create(&scan->thread, NULL, matroska_scan_thread, matroska))
+        scan->thread_started = 1;
+#endif
+}
+
+/**
+ * Add the seek points found by the scan so far to the stream indexes.
+ * Without a scan thread, the scan is run first if a timestamp is given.
+ * @param timestamp if not AV_NOPTS_VALUE, wait until the scan found a seek
+ *                  point of st at or after it, or finished
+ */
+static void matroska_scan_merge(MatroskaDemuxContext *matroska, AVStream *st,
+                                int64_t timestamp)
+{
+    MatroskaScan *scan = matroska->scan;
+    MatroskaTrack *tracks = matroska->tracks.elem;
+    MatroskaScanEntry *e;
+
+    if (!scan)
+        return;
+#if HAVE_PTHREADS
+    if (!scan->thread_started)
+#endif
+        if (timestamp != AV_NOPTS_VALUE && !scan->done)
+            matroska_scan_clusters(matroska);
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+#endif
+    for (;;) {
+        for (; scan->nb_merged < scan->nb_entries; scan->nb_merged++) {
+            e = &scan->entries[scan->nb_merged];
+            if (tracks[e->track].stream)
+                av_add_index_entry(tracks[e->track].stream, e->pos, e->timecode,
+                                   0, 0, AVINDEX_KEYFRAME);
+        }
+        if (timestamp == AV_NOPTS_VALUE || scan->done ||
+            (st->nb_index_entries &&
+             st->index_entries[st->nb_index_entries-1].timestamp >= timestamp))
+            break;
+#if HAVE_PTHREADS
+        pthread_cond_wait(&scan->cond, &scan->lock);
+#endif
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&scan->lock);
+#endif
+}
+
+static void matroska_scan_free(MatroskaDemuxContext *matroska)
+{
+    MatroskaScan *scan = matroska->scan;
+
+    if (!scan)
+        return;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&scan->lock);
+    scan->abort_request = 1;
+    pthread_mutex_unlock(&scan->lock);
+    if (scan->thread_started)
+        pthread_join(scan->thread, NULL);
+    pthread_cond_destroy(&scan->cond);
+    pthread_mutex_destroy(&scan->lock);
+#endif
+    av_free(scan->entries);
+    av_freep(&matroska->scan);
+}
+
 static int matroska_aac_profile(char *codec_id)
 {
     static const char * const aac_profiles[] = { "MAIN", "LC", "SSR" };
@@ -1223,6 +1629,14 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
                     memcpy(track->codec_priv.data+offset, codec_priv,
                            track->codec_priv.size);
                     track->codec_priv.size += offset;
+                } else {
+                    /* copy it out of the decoding buffer of the track */
+                    uint8_t *decoded = track->codec_priv.data;
+                    track->codec_priv.data = av_malloc(track->codec_priv.size);
+                    if (track->codec_priv.data)
+                        memcpy(track->codec_priv.data, decoded, track->codec_priv.size);
+                    else
+                        track->codec_priv.size = 0;
                 }
                 if (codec_priv != track->codec_priv.data)
                     av_free(codec_priv);
@@ -1319,7 +1733,8 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
             track->audio.sub_packet_h    = get_be16(&b);
             track->audio.frame_size      = get_be16(&b);
             track->audio.sub_packet_size = get_be16(&b);
-            track->audio.buf = av_malloc(track->audio.frame_size * track->audio.sub_packet_h);
+            track->audio.buf = av_malloc(track->audio.frame_size * track->audio.sub_packet_h
+                                         + FF_INPUT_BUFFER_PADDING_SIZE);
             if (codec_id == CODEC_ID_RA_288) {
                 st->codec->block_align = track->audio.coded_framesize;
                 track->codec_priv.size = 0;
@@ -1379,10 +1794,15 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
                       255);
             if (st->codec->codec_id != CODEC_ID_H264)
             st->need_parsing = AVSTREAM_PARSE_HEADERS;
+            st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA | FF_PARAM_DIMENSIONS |
+                                   FF_PARAM_FRAMING;
+            if (track->default_duration)
+                st->container_params |= FF_PARAM_FRAME_RATE;
         } else if (track->type == MATROSKA_TRACK_TYPE_AUDIO) {
             st->codec->codec_type = CODEC_TYPE_AUDIO;
             st->codec->sample_rate = track->audio.out_samplerate;
             st->codec->channels = track->audio.channels;
+            st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA | FF_PARAM_AUDIO;
         } else if (track->type == MATROSKA_TRACK_TYPE_SUBTITLE) {
             st->codec->codec_type = CODEC_TYPE_SUBTITLE;
         }
@@ -1452,6 +1872,7 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
     }
 
     matroska_convert_tags(s);
+    matroska_scan_start(matroska);
 
     return 0;
 }
@@ -1463,19 +1884,16 @@ static int matroska_read_header(AVFormatContext *s, AVFormatParameters *ap)
 static int matroska_deliver_packet(MatroskaDemuxContext *matroska,
                                    AVPacket *pkt)
 {
-    if (matroska->num_packets > 0) {
-        memcpy(pkt, matroska->packets[0], sizeof(AVPacket));
-        av_free(matroska->packets[0]);
-        if (matroska->num_packets > 1) {
-            memmove(&matroska->packets[0], &matroska->packets[1],
-                    (matroska->num_packets - 1) * sizeof(AVPacket *));
-            matroska->packets =
-                av_realloc(matroska->packets, (matroska->num_packets - 1) *
-                           sizeof(AVPacket *));
-        } else {
-            av_freep(&matroska->packets);
-        }
-        matroska->num_packets--;
+    AVPacketList *pktl = matroska->queue;
+
+    if (pktl) {
+        *pkt = pktl->pkt;
+        matroska->queue = pktl->next;
+        if (!matroska->queue)
+            matroska->queue_end = NULL;
+        if (matroska->prev_pkt == &pktl->pkt)
+            matroska->prev_pkt = NULL;
+        ff_packet_list_free(matroska->ctx, pktl);
         return 0;
     }
 
@@ -1487,35 +1905,45 @@ static int matroska_deliver_packet(MatroskaDemuxContext *matroska,
  */
 static void matroska_clear_queue(MatroskaDemuxContext *matroska)
 {
-    if (matroska->packets) {
-        int n;
-        for (n = 0; n < matroska->num_packets; n++) {
-            av_free_packet(matroska->packets[n]);
-            av_free(matroska->packets[n]);
-        }
-        av_freep(&matroska->packets);
-        matroska->num_packets = 0;
+    AVPacketList *pktl;
+
+    while ((pktl = matroska->queue)) {
+        matroska->queue = pktl->next;
+        av_free_packet(&pktl->pkt);
+        ff_packet_list_free(matroska->ctx, pktl);
     }
+    matroska->queue_end = NULL;
+    matroska->prev_pkt  = NULL;
 }
 
+/**
+ * Queue the packets of a block.
+ * @param frame if not NULL, packet holding the payload of an unlaced block,
+ *              data then only holds the block header, or holding a whole
+ *              laced block that data points to, whose frames are then
+ *              returned as slices of it, see matroska_direct_block();
+ *              it is queued or freed
+ */
 static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
                                 int size, int64_t pos, uint64_t cluster_time,
                                 uint64_t duration, int is_keyframe,
-                                int64_t cluster_pos)
+                                int64_t cluster_pos, AVPacketList *frame)
 {
     uint64_t timecode = AV_NOPTS_VALUE;
     MatroskaTrack *track;
     int res = 0;
     AVStream *st;
+    AVPacketList *pktl;
     AVPacket *pkt;
     int16_t block_time;
     uint32_t *lace_size = NULL;
+    uint8_t *data_end;
     int n, flags, laces = 0;
     uint64_t num;
 
     if ((n = matroska_ebmlnum_uint(matroska, data, size, &num)) < 0) {
         av_log(matroska->ctx, AV_LOG_ERROR, "EBML block data error\n");
-        return res;
+        goto end;
     }
     data += n;
     size -= n;
@@ -1524,11 +1952,11 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
     if (size <= 3 || !track || !track->stream) {
         av_log(matroska->ctx, AV_LOG_INFO,
                "Invalid stream %"PRIu64" or size %u\n", num, size);
-        return res;
+        goto end;
     }
     st = track->stream;
     if (st->discard >= AVDISCARD_ALL)
-        return res;
+        goto end;
     if (duration == AV_NOPTS_VALUE)
         duration = track->default_duration / matroska->time_scale;
 
@@ -1552,7 +1980,7 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
 
     if (matroska->skip_to_keyframe && track->type != MATROSKA_TRACK_TYPE_SUBTITLE) {
         if (!is_keyframe || timecode < matroska->skip_to_timecode)
-            return res;
+            goto end;
         matroska->skip_to_keyframe = 0;
     }
 
@@ -1631,9 +2059,15 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
             }
             break;
     }
+    data_end = data + size;
 
     if (res == 0) {
         for (n = 0; n < laces; n++) {
+            if (lace_size[n] > data_end - data) {
+                av_log(matroska->ctx, AV_LOG_ERROR, "Invalid lace size\n");
+                res = AVERROR_INVALIDDATA;
+                break;
+            }
             if ((st->codec->codec_id == CODEC_ID_RA_288 ||
                  st->codec->codec_id == CODEC_ID_COOK ||
                  st->codec->codec_id == CODEC_ID_ATRAC3) &&
@@ -1647,6 +2081,11 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
                 int x;
 
                 if (!track->audio.pkt_cnt) {
+                    if (!track->audio.buf &&
+                        !(track->audio.buf = av_malloc(h*w + FF_INPUT_BUFFER_PADDING_SIZE))) {
+                        res = AVERROR(ENOMEM);
+                        goto end;
+                    }
                     if (st->codec->codec_id == CODEC_ID_RA_288)
                         for (x=0; x<h/2; x++)
                             memcpy(track->audio.buf+x*2*w+y*cfs,
@@ -1660,39 +2099,95 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
                         track->audio.pkt_cnt = h*w / a;
                     }
                 }
+                if (track->audio.pkt_cnt &&
+                    (matroska->ctx->flags & AVFMT_FLAG_SHARED_PAYLOAD)) {
+                    /* the packets are slices of the deinterleaved buffer,
+                       a new one is allocated for the next frames */
+                    AVPacket buf;
+                    av_init_packet(&buf);
+                    buf.data     = track->audio.buf;
+                    buf.size     = h*w;
+                    buf.destruct = av_destruct_packet;
+                    track->audio.buf = NULL;
+                    while (track->audio.pkt_cnt) {
+                        if (!(pktl = ff_packet_list_alloc(matroska->ctx)) ||
+                            ff_packet_ref(&pktl->pkt, &buf) < 0) {
+                            if (pktl)
+                                ff_packet_list_free(matroska->ctx, pktl);
+                            track->audio.pkt_cnt = 0;
+                            res = AVERROR(ENOMEM);
+                            break;
+                        }
+                        pkt = &pktl->pkt;
+                        pkt->data = buf.data + a * (h*w / a - track->audio.pkt_cnt--);
+                        pkt->size = a;
+                        pkt->pos = pos;
+                        pkt->stream_index = st->index;
+                        matroska_queue_packet(matroska, pktl);
+                    }
+                    av_free_packet(&buf);
+                    if (res < 0)
+                        goto end;
+                }
                 while (track->audio.pkt_cnt) {
-                    pkt = av_mallocz(sizeof(AVPacket));
-                    av_new_packet(pkt, a);
+                    if (!(pktl = ff_packet_list_alloc(matroska->ctx)) ||
+                        av_new_packet(&pktl->pkt, a) < 0) {
+                        if (pktl)
+                            ff_packet_list_free(matroska->ctx, pktl);
+                        res = AVERROR(ENOMEM);
+                        goto end;
+                    }
+                    pkt = &pktl->pkt;
                     memcpy(pkt->data, track->audio.buf
                            + a * (h*w / a - track->audio.pkt_cnt--), a);
                     pkt->pos = pos;
                     pkt->stream_index = st->index;
-                    dynarray_add(&matroska->packets,&matroska->num_packets,pkt);
+                    matroska_queue_packet(matroska, pktl);
                 }
             } else {
                 MatroskaTrackEncoding *encodings = track->encodings.elem;
                 int offset = 0, pkt_size = lace_size[n];
                 uint8_t *pkt_data = data;
 
-                if (encodings && encodings->scope & 1) {
-                    offset = matroska_decode_buffer(&pkt_data,&pkt_size, track);
-                    if (offset < 0)
-                        continue;
-                }
+                if (frame && (flags & 0x06)) {
+                    /* the frame is a slice of the block buffer */
+                    if (!(pktl = ff_packet_list_alloc(matroska->ctx))) {
+                        res = AVERROR(ENOMEM);
+                        break;
+                    }
+                    if ((res = ff_packet_ref(&pktl->pkt, &frame->pkt)) < 0) {
+                        ff_packet_list_free(matroska->ctx, pktl);
+                        break;
+                    }
+                    pkt       = &pktl->pkt;
+                    pkt->data = data;
+                    pkt->size = lace_size[n];
+                } else if (frame) {
+                    /* the payload has been read into it already */
+                    pktl  = frame;
+                    frame = NULL;
+                    pkt   = &pktl->pkt;
+                } else {
+                    if (encodings && encodings->scope & 1) {
+                        offset = matroska_decode_buffer(&pkt_data,&pkt_size, track);
+                        if (offset < 0)
+                            continue;
+                    }
 
-                pkt = av_mallocz(sizeof(AVPacket));
-                /* XXX: prevent data copy... */
-                if (av_new_packet(pkt, pkt_size+offset) < 0) {
-                    av_free(pkt);
-                    res = AVERROR(ENOMEM);
-                    break;
+                    if (!(pktl = ff_packet_list_alloc(matroska->ctx))) {
+                        res = AVERROR(ENOMEM);
+                        break;
+                    }
+                    pkt = &pktl->pkt;
+                    if (ff_new_packet(matroska->ctx, pkt, pkt_size+offset) < 0) {
+                        ff_packet_list_free(matroska->ctx, pktl);
+                        res = AVERROR(ENOMEM);
+                        break;
+                    }
+                    if (offset)
+                        memcpy (pkt->data, encodings->compression.settings.data, offset);
+                    memcpy (pkt->data+offset, pkt_data, pkt_size);
                 }
-                if (offset)
-                    memcpy (pkt->data, encodings->compression.settings.data, offset);
-                memcpy (pkt->data+offset, pkt_data, pkt_size);
-
-                if (pkt_data != data)
-                    av_free(pkt_data);
 
                 if (n == 0)
                     pkt->flags = is_keyframe;
@@ -1711,10 +2206,11 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
                 if (matroska->prev_pkt &&
                     timecode != AV_NOPTS_VALUE &&
                     matroska->prev_pkt->pts == timecode &&
-                    matroska->prev_pkt->stream_index == st->index)
+                    matroska->prev_pkt->stream_index == st->index) {
                     matroska_merge_packets(matroska->prev_pkt, pkt);
-                else {
-                    dynarray_add(&matroska->packets,&matroska->num_packets,pkt);
+                    ff_packet_list_free(matroska->ctx, pktl);
+                } else {
+                    matroska_queue_packet(matroska, pktl);
                     matroska->prev_pkt = pkt;
                 }
             }
@@ -1725,39 +2221,201 @@ static int matroska_parse_block(MatroskaDemuxContext *matroska, uint8_t *data,
         }
     }
 
+end:
+    if (frame) {
+        av_free_packet(&frame->pkt);
+        ff_packet_list_free(matroska->ctx, frame);
+    }
     av_free(lace_size);
     return res;
 }
 
+/**
+ * Whether the payload of the block of track with the given flags can be
+ * read directly into its packet, see matroska_parse_block(). The frames of
+ * laced blocks share the block buffer, with AVFMT_FLAG_SHARED_PAYLOAD only
+ * as av_dup_packet() cannot be used on them.
+ */
+static int matroska_direct_block(MatroskaDemuxContext *matroska,
+                                 MatroskaTrack *track, int flags)
+{
+    AVStream *st = track->stream;
+
+    return (!(flags & 0x06) ||
+            (matroska->ctx->flags & AVFMT_FLAG_SHARED_PAYLOAD)) &&
+           !track->encodings.nb_elem &&
+           st->codec->codec_id != CODEC_ID_RA_288 &&
+           st->codec->codec_id != CODEC_ID_COOK   &&
+           st->codec->codec_id != CODEC_ID_ATRAC3;
+}
+
+/**
+ * Read a SimpleBlock of the given length at the current position and
+ * queue its packets. The payload of unlaced blocks is read straight into
+ * the packet, other blocks are read into a temporary buffer first.
+ */
+static int matroska_read_simple_block(MatroskaDemuxContext *matroska, int length)
+{
+    ByteIOContext *pb = matroska->ctx->pb;
+    int64_t pos = url_ftell(pb);
+    const uint8_t *peek;
+    uint8_t hdr[11], *data;
+    AVPacketList *frame;
+    MatroskaTrack *track = NULL;
+    uint64_t num;
+    int n, res;
+
+    if (length <= 0)
+        return 0;
+    n = url_fpeek(pb, &peek, FFMIN(length, sizeof(hdr)));
+    if (n > 0) {
+        memcpy(hdr, peek, n);
+        res = matroska_ebmlnum_uint(matroska, hdr, n, &num);
+        if (res > 0 && res + 3 <= n && res + 3 < length)
+            track = matroska_find_track_by_num(matroska, num);
+    }
+    if (track && track->stream) {
+        int hdr_len = res + 3;
+
+        if (track->stream->discard >= AVDISCARD_ALL)
+            return url_fseek(pb, length, SEEK_CUR) < 0 ? AVERROR(EIO) : 0;
+        if (matroska_direct_block(matroska, track, hdr[res + 2])) {
+            /* laced blocks are read whole, their frames are slices of it */
+            int laced = hdr[res + 2] & 0x06;
+
+            if (!(frame = ff_packet_list_alloc(matroska->ctx)))
+                return AVERROR(ENOMEM);
+            if (ff_new_packet(matroska->ctx, &frame->pkt, laced ? length : length - hdr_len) < 0) {
+                ff_packet_list_free(matroska->ctx, frame);
+                return AVERROR(ENOMEM);
+            }
+            if (!laced)
+                url_fskip(pb, hdr_len);
+            if (get_buffer(pb, frame->pkt.data, frame->pkt.size) != frame->pkt.size) {
+                av_free_packet(&frame->pkt);
+                ff_packet_list_free(matroska->ctx, frame);
+                return AVERROR(EIO);
+            }
+            return matroska_parse_block(matroska, laced ? frame->pkt.data : hdr,
+                                        length, pos,
+                                        matroska->cluster_time, AV_NOPTS_VALUE,
+                                        -1, matroska->cluster_pos, frame);
+        }
+    }
+
+    if (!(data = av_malloc(length)))
+        return AVERROR(ENOMEM);
+    if (get_buffer(pb, data, length) != length) {
+        av_free(data);
+        return AVERROR(EIO);
+    }
+    res = matroska_parse_block(matroska, data, length, pos, matroska->cluster_time,
+                               AV_NOPTS_VALUE, -1, matroska->cluster_pos, NULL);
+    av_free(data);
+    return res;
+}
+
+static int matroska_enter_cluster(MatroskaDemuxContext *matroska)
+{
+    ByteIOContext *pb = matroska->ctx->pb;
+    uint64_t length;
+    int res;
+
+    if ((res = ebml_read_num(matroska, pb, 8, &length)) < 0)
+        return res;
+    if (matroska->num_levels >= EBML_MAX_DEPTH)
+        return AVERROR(ENOSYS);
+    matroska->levels[matroska->num_levels].start  = url_ftell(pb);
+    /* live streams may not know the size of their clusters */
+    matroska->levels[matroska->num_levels].length =
+        length == (1ULL << 7*res) - 1 ? UINT64_MAX : length;
+    matroska->num_levels++;
+    matroska->in_cluster   = 1;
+    matroska->cluster_time = 0;
+    matroska->prev_pkt     = NULL;
+    return 0;
+}
+
+/**
+ * Leave the cluster being read, when seeking or when the next one starts.
+ */
+static void matroska_leave_cluster(MatroskaDemuxContext *matroska)
+{
+    if (matroska->in_cluster) {
+        matroska->num_levels--;
+        matroska->in_cluster = 0;
+    }
+}
+
+/**
+ * Read the next element of the current cluster, entering the next
+ * cluster if there is none. Blocks are parsed as soon as they have been
+ * read, so only one block is held in memory at a time.
+ */
 static int matroska_parse_cluster(MatroskaDemuxContext *matroska)
 {
-    MatroskaCluster cluster = { 0 };
-    EbmlList *blocks_list;
-    MatroskaBlock *blocks;
-    int i, res;
-    int64_t pos = url_ftell(matroska->ctx->pb);
-    matroska->prev_pkt = NULL;
-    if (matroska->has_cluster_id){
+    ByteIOContext *pb = matroska->ctx->pb;
+    MatroskaBlock block = { 0 };
+    uint64_t id, length;
+    int res;
+
+    if (matroska->in_cluster && ebml_level_end(matroska)) {
+        matroska->in_cluster = 0;
+        return 0;
+    }
+    if (!matroska->in_cluster)
+        matroska->cluster_pos = url_ftell(pb);
+    if (matroska->has_cluster_id) {
         /* For the first cluster we parse, its ID was already read as
            part of matroska_read_header(), so don't read it again */
-        res = ebml_parse_id(matroska, matroska_clusters,
-                            MATROSKA_ID_CLUSTER, &cluster);
-        pos -= 4;  /* sizeof the ID which was already read */
+        id = MATROSKA_ID_CLUSTER;
+        matroska->cluster_pos -= 4;  /* sizeof the ID which was already read */
         matroska->has_cluster_id = 0;
-    } else
-        res = ebml_parse(matroska, matroska_clusters, &cluster);
-    blocks_list = &cluster.blocks;
-    blocks = blocks_list->elem;
-    for (i=0; i<blocks_list->nb_elem; i++)
-        if (blocks[i].bin.size > 0) {
-            int is_keyframe = blocks[i].non_simple ? !blocks[i].reference : -1;
-            res=matroska_parse_block(matroska,
-                                     blocks[i].bin.data, blocks[i].bin.size,
-                                     blocks[i].bin.pos,  cluster.timecode,
-                                     blocks[i].duration, is_keyframe,
-                                     pos);
+    } else {
+        if ((res = ebml_read_num(matroska, pb, 4, &id)) < 0)
+            goto end;
+        id |= 1 << 7*res;
+    }
+
+    if (id == MATROSKA_ID_CLUSTER) {
+        if (matroska->in_cluster) {
+            /* a cluster of unknown size ends where the next one starts */
+            matroska_leave_cluster(matroska);
+            matroska->cluster_pos = url_ftell(pb) - 4;
+        }
+        res = matroska_enter_cluster(matroska);
+    } else if (!matroska->in_cluster) {
+        /* skip the other top level elements */
+        res = ebml_parse_id(matroska, matroska_clusters, id, &block);
+    } else {
+        switch (id) {
+        case MATROSKA_ID_CLUSTERTIMECODE:
+            if ((res = ebml_read_num(matroska, pb, 8, &length)) >= 0)
+                res = ebml_read_uint(pb, length, &matroska->cluster_time);
+            break;
+        case MATROSKA_ID_SIMPLEBLOCK:
+            if ((res = ebml_read_num(matroska, pb, 8, &length)) >= 0)
+                res = length > INT_MAX ? AVERROR_INVALIDDATA :
+                      matroska_read_simple_block(matroska, length);
+            break;
+        case MATROSKA_ID_BLOCKGROUP:
+            /* its reference and duration may follow the block */
+            res = ebml_parse_id(matroska, matroska_blockgroups, id, &block);
+            if (res >= 0 && block.bin.size > 0) {
+                int is_keyframe = block.non_simple ? !block.reference : -1;
+                res = matroska_parse_block(matroska, block.bin.data, block.bin.size,
+                                           block.bin.pos, matroska->cluster_time,
+                                           block.duration, is_keyframe,
+                                           matroska->cluster_pos, NULL);
+            }
+            ebml_free(matroska_blockgroups, &block);
+            break;
+        default:
+            res = ebml_parse_id(matroska, matroska_cluster, id, &block);
+            break;
         }
-    ebml_free(matroska_cluster, &cluster);
+    }
+ end:
     if (res < 0)  matroska->done = 1;
     return res;
 }
@@ -1766,6 +2424,7 @@ static int matroska_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     MatroskaDemuxContext *matroska = s->priv_data;
 
+    matroska_scan_merge(matroska, NULL, AV_NOPTS_VALUE);
     while (matroska_deliver_packet(matroska, pkt)) {
         if (matroska->done)
             return AVERROR_EOF;
@@ -1783,11 +2442,13 @@ static int matroska_read_seek(AVFormatContext *s, int stream_index,
     AVStream *st = s->streams[stream_index];
     int i, index, index_sub, index_min;
 
+    matroska_scan_merge(matroska, st, timestamp);
     if (!st->nb_index_entries)
         return 0;
     timestamp = FFMAX(timestamp, st->index_entries[0].timestamp);
 
     if ((index = av_index_search_timestamp(st, timestamp, flags)) < 0) {
+        matroska_leave_cluster(matroska);
         url_fseek(s->pb, st->index_entries[st->nb_index_entries-1].pos, SEEK_SET);
         while ((index = av_index_search_timestamp(st, timestamp, flags)) < 0) {
             matroska_clear_queue(matroska);
@@ -1813,6 +2474,7 @@ static int matroska_read_seek(AVFormatContext *s, int stream_index,
         }
     }
 
+    matroska_leave_cluster(matroska);
     url_fseek(s->pb, st->index_entries[index_min].pos, SEEK_SET);
     matroska->skip_to_keyframe = !(flags & AVSEEK_FLAG_ANY);
     matroska->skip_to_timecode = st->index_entries[index].timestamp;
@@ -1827,11 +2489,18 @@ static int matroska_read_close(AVFormatContext *s)
     MatroskaTrack *tracks = matroska->tracks.elem;
     int n;
 
+    matroska_scan_free(matroska);
     matroska_clear_queue(matroska);
 
-    for (n=0; n < matroska->tracks.nb_elem; n++)
+    for (n=0; n < matroska->tracks.nb_elem; n++) {
         if (tracks[n].type == MATROSKA_TRACK_TYPE_AUDIO)
             av_free(tracks[n].audio.buf);
+        av_free(tracks[n].decode_buf);
+#if CONFIG_ZLIB
+        if (tracks[n].zstream_init)
+            inflateEnd(&tracks[n].zstream);
+#endif
+    }
     ebml_free(matroska_segment, matroska);
 
     return 0;
@@ -51,13 +51,16 @@ typedef struct mkv_seekhead {
 
 typedef struct {
     uint64_t        pts;
-    int             tracknum;
-    int64_t         cluster_pos;        ///< file offset of the cluster containing the block
+    uint64_t        pos_track;          ///< offset of the cluster containing the block in the segment << 8 | track number
 } mkv_cuepoint;
 
+#define CUE_POS(entry)   ((entry)->pos_track >> 8)
+#define CUE_TRACK(entry) ((entry)->pos_track & 0xff)
+
 typedef struct {
     int64_t         segment_offset;
     mkv_cuepoint    *entries;
+    unsigned int    entries_size;
     int             num_entries;
 } mkv_cues;
 
@@ -75,6 +78,13 @@ typedef struct MatroskaMuxContext {
     mkv_cues        *cues;
 
     struct AVMD5    *md5_ctx;
+
+    int             live;               ///< no seeking back and no index, see AVFMT_FLAG_LIVE
+    int             has_video;
+    ByteIOContext   *live_pb;           ///< output while writing to a live buffer
+    ByteIOContext   *live_buf;          ///< dynamic buffer reused for each live cluster
+    uint8_t         *nal_buf;           ///< H.264 converted to length prefixed NAL units, kept across packets
+    unsigned int    nal_buf_size;
 } MatroskaMuxContext;
 
 
@@ -82,12 +92,9 @@ typedef struct MatroskaMuxContext {
  * offset, 4 bytes for target EBML ID */
 #define MAX_SEEKENTRY_SIZE 21
 
-/** per-cuepoint-track - 3 1-byte EBML IDs, 3 1-byte EBML sizes, 2
- * 8-byte uint max */
-#define MAX_CUETRACKPOS_SIZE 22
-
-/** per-cuepoint - 2 1-byte EBML IDs, 2 1-byte EBML sizes, 8-byte uint max */
-#define MAX_CUEPOINT_SIZE(num_tracks) 12 + MAX_CUETRACKPOS_SIZE*num_tracks
+/** longest live cluster waiting for a video key frame, block timecodes
+ * relative to the cluster are 16 bit */
+#define MAX_LIVE_CLUSTER_DURATION 30000
 
 
 static int ebml_id_size(unsigned int id)
@@ -150,11 +157,27 @@ static void put_ebml_num(ByteIOContext *pb, uint64_t num, int bytes)
         put_byte(pb, num >> i*8);
 }
 
+/**
+ * Calculate how many bytes put_ebml_uint() uses for the value.
+ */
+static int ebml_uint_size(uint64_t val)
+{
+    int bytes = 1;
+    while (val>>=8) bytes++;
+    return bytes;
+}
+
+/**
+ * Calculate the size of an element with the given ID and payload size.
+ */
+static int64_t ebml_element_size(unsigned int elementid, int64_t size)
+{
+    return ebml_id_size(elementid) + ebml_num_size(size) + size;
+}
+
 static void put_ebml_uint(ByteIOContext *pb, unsigned int elementid, uint64_t val)
 {
-    int i, bytes = 1;
-    uint64_t tmp = val;
-    while (tmp>>=8) bytes++;
+    int i, bytes = ebml_uint_size(val);
 
     put_ebml_id(pb, elementid);
     put_ebml_num(pb, bytes, 0);
@@ -344,49 +367,77 @@ static mkv_cues * mkv_start_cues(int64_t segment_offset)
 
 static int mkv_add_cuepoint(mkv_cues *cues, AVPacket *pkt, int64_t cluster_pos)
 {
-    mkv_cuepoint *entries = cues->entries;
+    mkv_cuepoint *entries;
 
-    entries = av_realloc(entries, (cues->num_entries + 1) * sizeof(mkv_cuepoint));
+    entries = av_fast_realloc(cues->entries, &cues->entries_size,
+                              (cues->num_entries + 1) * sizeof(mkv_cuepoint));
     if (entries == NULL)
         return AVERROR(ENOMEM);
 
     entries[cues->num_entries  ].pts = pkt->pts;
-    entries[cues->num_entries  ].tracknum = pkt->stream_index + 1;
-    entries[cues->num_entries++].cluster_pos = cluster_pos - cues->segment_offset;
+    entries[cues->num_entries++].pos_track = (uint64_t)(cluster_pos - cues->segment_offset) << 8
+                                             | (pkt->stream_index + 1);
 
     cues->entries = entries;
     return 0;
 }
 
-static int64_t mkv_write_cues(ByteIOContext *pb, mkv_cues *cues, int num_tracks)
+static int mkv_cuetrackpos_size(mkv_cuepoint *entry)
 {
-    ebml_master cues_element;
-    int64_t currentpos;
-    int i, j;
+    return ebml_element_size(MATROSKA_ID_CUETRACK,           ebml_uint_size(CUE_TRACK(entry))) +
+           ebml_element_size(MATROSKA_ID_CUECLUSTERPOSITION, ebml_uint_size(CUE_POS(entry)));
+}
+
+/**
+ * Calculate the size of the CuePoint for the entries starting at entry,
+ * those with the same timestamp from different tracks share it.
+ *
+ * @param num_entries the entries left, set to those in the CuePoint
+ */
+static int64_t mkv_cuepoint_size(mkv_cuepoint *entry, int *num_entries)
+{
+    int64_t size = ebml_element_size(MATROSKA_ID_CUETIME, ebml_uint_size(entry->pts));
+    int j;
+
+    for (j = 0; j < *num_entries && entry[j].pts == entry->pts; j++)
+        size += ebml_element_size(MATROSKA_ID_CUETRACKPOSITION, mkv_cuetrackpos_size(&entry[j]));
+    *num_entries = j;
+    return size;
+}
+
+/**
+ * Write the cues and free them. All sizes are calculated first, so that
+ * the cues are written in one sequential pass.
+ */
+static int64_t mkv_write_cues(ByteIOContext *pb, mkv_cues *cues)
+{
+    int64_t currentpos, size = 0;
+    int i, j, n;
 
     currentpos = url_ftell(pb);
-    cues_element = start_ebml_master(pb, MATROSKA_ID_CUES, 0);
+    for (i = 0; i < cues->num_entries; i += n) {
+        n = cues->num_entries - i;
+        size += ebml_element_size(MATROSKA_ID_POINTENTRY,
+                                  mkv_cuepoint_size(&cues->entries[i], &n));
+    }
+    put_ebml_id(pb, MATROSKA_ID_CUES);
+    put_ebml_num(pb, size, 0);
 
-    for (i = 0; i < cues->num_entries; i++) {
-        ebml_master cuepoint, track_positions;
+    for (i = 0; i < cues->num_entries; i += n) {
         mkv_cuepoint *entry = &cues->entries[i];
-        uint64_t pts = entry->pts;
-
-        cuepoint = start_ebml_master(pb, MATROSKA_ID_POINTENTRY, MAX_CUEPOINT_SIZE(num_tracks));
-        put_ebml_uint(pb, MATROSKA_ID_CUETIME, pts);
-
-        // put all the entries from different tracks that have the exact same
-        // timestamp into the same CuePoint
-        for (j = 0; j < cues->num_entries - i && entry[j].pts == pts; j++) {
-            track_positions = start_ebml_master(pb, MATROSKA_ID_CUETRACKPOSITION, MAX_CUETRACKPOS_SIZE);
-            put_ebml_uint(pb, MATROSKA_ID_CUETRACK          , entry[j].tracknum   );
-            put_ebml_uint(pb, MATROSKA_ID_CUECLUSTERPOSITION, entry[j].cluster_pos);
-            end_ebml_master(pb, track_positions);
+
+        n = cues->num_entries - i;
+        put_ebml_id(pb, MATROSKA_ID_POINTENTRY);
+        put_ebml_num(pb, mkv_cuepoint_size(entry, &n), 0);
+        put_ebml_uint(pb, MATROSKA_ID_CUETIME, entry->pts);
+
+        for (j = 0; j < n; j++) {
+            put_ebml_id(pb, MATROSKA_ID_CUETRACKPOSITION);
+            put_ebml_num(pb, mkv_cuetrackpos_size(&entry[j]), 0);
+            put_ebml_uint(pb, MATROSKA_ID_CUETRACK          , CUE_TRACK(&entry[j]));
+            put_ebml_uint(pb, MATROSKA_ID_CUECLUSTERPOSITION, CUE_POS(&entry[j]));
         }
-        i += j - 1;
-        end_ebml_master(pb, cuepoint);
     }
-    end_ebml_master(pb, cues_element);
 
     av_free(cues->entries);
     av_free(cues);
@@ -664,17 +715,55 @@ static int mkv_write_chapters(AVFormatContext *s)
     return 0;
 }
 
+/**
+ * In live mode, elements are written into a dynamic buffer, where their
+ * sizes can be filled in, before being sent. Only the segment and the
+ * clusters are sent with an unknown size.
+ */
+static int mkv_start_live_buffer(AVFormatContext *s)
+{
+    MatroskaMuxContext *mkv = s->priv_data;
+    int ret;
+
+    if (!mkv->live_buf && (ret = url_open_dyn_buf(&mkv->live_buf)) < 0)
+        return ret;
+    mkv->live_pb = s->pb;
+    s->pb = mkv->live_buf;
+    return 0;
+}
+
+static void mkv_end_live_buffer(AVFormatContext *s)
+{
+    MatroskaMuxContext *mkv = s->priv_data;
+    uint8_t *buf;
+    int size = url_get_dyn_buf(s->pb, &buf);
+
+    s->pb = mkv->live_pb;
+    put_buffer(s->pb, buf, size);
+    url_reset_dyn_buf(mkv->live_buf);
+}
+
 static int mkv_write_header(AVFormatContext *s)
 {
     MatroskaMuxContext *mkv = s->priv_data;
     ByteIOContext *pb = s->pb;
     ebml_master ebml_header, segment_info;
     AVMetadataTag *tag;
-    int ret;
+    int i, ret;
 
     mkv->md5_ctx = av_mallocz(av_md5_size);
     av_md5_init(mkv->md5_ctx);
 
+    mkv->live = url_is_streamed(pb) || (s->flags & AVFMT_FLAG_LIVE);
+    for (i = 0; i < s->nb_streams; i++)
+        if (s->streams[i]->codec->codec_type == CODEC_TYPE_VIDEO)
+            mkv->has_video = 1;
+    if (mkv->live) {
+        if ((ret = mkv_start_live_buffer(s)) < 0)
+            return ret;
+        pb = s->pb;
+    }
+
     ebml_header = start_ebml_master(pb, EBML_ID_HEADER, 0);
     put_ebml_uint   (pb, EBML_ID_EBMLVERSION        ,           1);
     put_ebml_uint   (pb, EBML_ID_EBMLREADVERSION    ,           1);
@@ -693,13 +782,15 @@ static int mkv_write_header(AVFormatContext *s)
     // elements (including the seek head at the end of the file), which
     // isn't more than 10 elements if we only write one of each other
     // currently defined level 1 element
-    mkv->main_seekhead    = mkv_start_seekhead(pb, mkv->segment_offset, 10);
+    // live streams cannot point forward, their seek heads are not written
+    mkv->main_seekhead    = mkv_start_seekhead(pb, mkv->segment_offset, mkv->live ? 0 : 10);
     mkv->cluster_seekhead = mkv_start_seekhead(pb, mkv->segment_offset, 0);
+    ret = AVERROR(ENOMEM);
     if (mkv->main_seekhead == NULL || mkv->cluster_seekhead == NULL)
-        return AVERROR(ENOMEM);
+        goto fail;
 
     ret = mkv_add_seekhead_entry(mkv->main_seekhead, MATROSKA_ID_INFO, url_ftell(pb));
-    if (ret < 0) return ret;
+    if (ret < 0) goto fail;
 
     segment_info = start_ebml_master(pb, MATROSKA_ID_INFO, 0);
     put_ebml_uint(pb, MATROSKA_ID_TIMECODESCALE, 1000000);
@@ -710,47 +801,111 @@ static int mkv_write_header(AVFormatContext *s)
         put_ebml_string(pb, MATROSKA_ID_WRITINGAPP, LIBAVFORMAT_IDENT);
 
         // reserve space to write the segment UID later
-        mkv->segment_uid = url_ftell(pb);
-        put_ebml_void(pb, 19);
+        if (!mkv->live) {
+            mkv->segment_uid = url_ftell(pb);
+            put_ebml_void(pb, 19);
+        }
     }
 
     // reserve space for the duration
     mkv->duration = 0;
-    mkv->duration_offset = url_ftell(pb);
-    put_ebml_void(pb, 11);                  // assumes double-precision float to be written
+    if (!mkv->live) {
+        mkv->duration_offset = url_ftell(pb);
+        put_ebml_void(pb, 11);              // assumes double-precision float to be written
+    }
     end_ebml_master(pb, segment_info);
 
     ret = mkv_write_tracks(s);
-    if (ret < 0) return ret;
+    if (ret < 0) goto fail;
 
     ret = mkv_write_chapters(s);
-    if (ret < 0) return ret;
+    if (ret < 0) goto fail;
 
-    ret = mkv_add_seekhead_entry(mkv->cluster_seekhead, MATROSKA_ID_CLUSTER, url_ftell(pb));
-    if (ret < 0) return ret;
+    if (mkv->live) {
+        mkv_end_live_buffer(s);
+        pb = s->pb;
+    } else {
+        ret = mkv_add_seekhead_entry(mkv->cluster_seekhead, MATROSKA_ID_CLUSTER, url_ftell(pb));
+        if (ret < 0) return ret;
+
+        mkv->cues = mkv_start_cues(mkv->segment_offset);
+        if (mkv->cues == NULL)
+            return AVERROR(ENOMEM);
+    }
 
     mkv->cluster_pos = url_ftell(pb);
     mkv->cluster = start_ebml_master(pb, MATROSKA_ID_CLUSTER, 0);
     put_ebml_uint(pb, MATROSKA_ID_CLUSTERTIMECODE, 0);
     mkv->cluster_pts = 0;
 
-    mkv->cues = mkv_start_cues(mkv->segment_offset);
-    if (mkv->cues == NULL)
-        return AVERROR(ENOMEM);
-
     put_flush_packet(pb);
     return 0;
+fail:
+    if (mkv->live)
+        mkv_end_live_buffer(s);
+    return ret;
 }
 
-static int mkv_blockgroup_size(int pkt_size)
+/** longest block header: BlockGroup ID and size, Block ID and size,
+ * track number, timecode and flags */
+#define MAX_BLOCK_HEADER_SIZE (2 * (4 + 8) + 4)
+
+static uint8_t *buf_put_ebml_id(uint8_t *p, unsigned int id)
 {
-    int size = pkt_size + 4;
-    size += ebml_num_size(size);
-    size += 2;              // EBML ID for block and block duration
-    size += 8;              // max size of block duration
-    size += ebml_num_size(size);
-    size += 1;              // blockgroup EBML ID
-    return size;
+    int i = ebml_id_size(id);
+    while (i--)
+        *p++ = id >> (i*8);
+    return p;
+}
+
+static uint8_t *buf_put_ebml_num(uint8_t *p, uint64_t num)
+{
+    int i, bytes = ebml_num_size(num);
+
+    num |= 1ULL << bytes*7;
+    for (i = bytes - 1; i >= 0; i--)
+        *p++ = num >> i*8;
+    return p;
+}
+
+/**
+ * Calculate the payload size of a BlockGroup holding a Block with size
+ * bytes of data and a BlockDuration.
+ */
+static int mkv_blockgroup_size(int size, uint64_t duration)
+{
+    return ebml_element_size(MATROSKA_ID_BLOCK, size + 4) +
+           ebml_element_size(MATROSKA_ID_BLOCKDURATION, ebml_uint_size(duration));
+}
+
+/**
+ * Write a SimpleBlock, or a BlockGroup with a Block and a BlockDuration if
+ * blockid is MATROSKA_ID_BLOCKGROUP. All sizes are known up front, so the
+ * header goes out in one write followed by the data, without seeking back
+ * and also when streaming.
+ */
+static void mkv_put_block(ByteIOContext *pb, unsigned int blockid, int track,
+                          int timecode, int flags, const uint8_t *data, int size,
+                          uint64_t duration)
+{
+    uint8_t buf[MAX_BLOCK_HEADER_SIZE], *p = buf;
+    int group = blockid == MATROSKA_ID_BLOCKGROUP;
+
+    if (group) {
+        p = buf_put_ebml_id(p, MATROSKA_ID_BLOCKGROUP);
+        p = buf_put_ebml_num(p, mkv_blockgroup_size(size, duration));
+        blockid = MATROSKA_ID_BLOCK;
+    }
+    p = buf_put_ebml_id(p, blockid);
+    p = buf_put_ebml_num(p, size + 4);
+    *p++ = 0x80 | track;    // this assumes the track number is less than 127
+    AV_WB16(p, timecode);
+    p += 2;
+    *p++ = flags;
+    put_buffer(pb, buf, p - buf);
+    put_buffer(pb, data, size);
+    if (group)
+        put_ebml_uint(pb, MATROSKA_ID_BLOCKDURATION, duration);
 }
 
 static int ass_get_duration(const uint8_t *p)
@@ -772,7 +927,6 @@ static int mkv_write_ass_blocks(AVFormatContext *s, AVPacket *pkt)
     ByteIOContext *pb = s->pb;
     int i, layer = 0, max_duration = 0, size, line_size, data_size = pkt->size;
     uint8_t *start, *end, *data = pkt->data;
-    ebml_master blockgroup;
     char buffer[2048];
 
     while (data_size) {
@@ -795,15 +949,8 @@ static int mkv_write_ass_blocks(AVFormatContext *s, AVPacket *pkt)
         av_log(s, AV_LOG_DEBUG, "Writing block at offset %" PRIu64 ", size %d, "
                "pts %" PRId64 ", duration %d\n",
                url_ftell(pb), size, pkt->pts, duration);
-        blockgroup = start_ebml_master(pb, MATROSKA_ID_BLOCKGROUP, mkv_blockgroup_size(size));
-        put_ebml_id(pb, MATROSKA_ID_BLOCK);
-        put_ebml_num(pb, size+4, 0);
-        put_byte(pb, 0x80 | (pkt->stream_index + 1));     // this assumes stream_index is less than 126
-        put_be16(pb, pkt->pts - mkv->cluster_pts);
-        put_byte(pb, 0);
-        put_buffer(pb, buffer, size);
-        put_ebml_uint(pb, MATROSKA_ID_BLOCKDURATION, duration);
-        end_ebml_master(pb, blockgroup);
+        mkv_put_block(pb, MATROSKA_ID_BLOCKGROUP, pkt->stream_index + 1,
+                      pkt->pts - mkv->cluster_pts, 0, buffer, size, duration);
 
         data += line_size;
         data_size -= line_size;
@@ -812,7 +959,8 @@ static int mkv_write_ass_blocks(AVFormatContext *s, AVPacket *pkt)
     return max_duration;
 }
 
-static void mkv_write_block(AVFormatContext *s, unsigned int blockid, AVPacket *pkt, int flags)
+static void mkv_write_block(AVFormatContext *s, unsigned int blockid, AVPacket *pkt,
+                            int flags, uint64_t duration)
 {
     MatroskaMuxContext *mkv = s->priv_data;
     ByteIOContext *pb = s->pb;
@@ -824,18 +972,33 @@ static void mkv_write_block(AVFormatContext *s, unsigned int blockid, AVPacket *
            "pts %" PRId64 ", dts %" PRId64 ", duration %d, flags %d\n",
            url_ftell(pb), pkt->size, pkt->pts, pkt->dts, pkt->duration, flags);
     if (codec->codec_id == CODEC_ID_H264 && codec->extradata_size > 0 &&
-        (AV_RB24(codec->extradata) == 1 || AV_RB32(codec->extradata) == 1))
-        ff_avc_parse_nal_units_buf(pkt->data, &data, &size);
-    else
+        (AV_RB24(codec->extradata) == 1 || AV_RB32(codec->extradata) == 1) &&
+        (size = ff_avc_convert_nal_units(pkt->data, pkt->size,
+                                         &mkv->nal_buf, &mkv->nal_buf_size)) >= 0)
+        data = mkv->nal_buf;
+    else {
         data = pkt->data;
-    put_ebml_id(pb, blockid);
-    put_ebml_num(pb, size+4, 0);
-    put_byte(pb, 0x80 | (pkt->stream_index + 1));     // this assumes stream_index is less than 126
-    put_be16(pb, pkt->pts - mkv->cluster_pts);
-    put_byte(pb, flags);
-    put_buffer(pb, data, size);
-    if (data != pkt->data)
-        av_free(data);
+        size = pkt->size;
+    }
+    mkv_put_block(pb, blockid, pkt->stream_index + 1,
+                  pkt->pts - mkv->cluster_pts, flags, data, size, duration);
+}
+
+/**
+ * Start a new cluster every 5 MB or 5 sec. Live clusters with video start
+ * on video key frames, so that each can be decoded on its own.
+ */
+static int mkv_new_cluster(AVFormatContext *s, AVPacket *pkt)
+{
+    MatroskaMuxContext *mkv = s->priv_data;
+    AVCodecContext *codec = s->streams[pkt->stream_index]->codec;
+
+    if (!mkv->live || !mkv->has_video)
+        return url_ftell(s->pb) > mkv->cluster_pos + 5*1024*1024 ||
+               pkt->pts > mkv->cluster_pts + 5000;
+    return pkt->pts > mkv->cluster_pts + MAX_LIVE_CLUSTER_DURATION ||
+           (pkt->pts > mkv->cluster_pts + 5000 &&
+            codec->codec_type == CODEC_TYPE_VIDEO && (pkt->flags & PKT_FLAG_KEY));
 }
 
 static int mkv_write_packet(AVFormatContext *s, AVPacket *pkt)
@@ -847,14 +1010,18 @@ static int mkv_write_packet(AVFormatContext *s, AVPacket *pkt)
     int duration = pkt->duration;
     int ret;
 
-    // start a new cluster every 5 MB or 5 sec
-    if (url_ftell(pb) > mkv->cluster_pos + 5*1024*1024 || pkt->pts > mkv->cluster_pts + 5000) {
+    if (mkv_new_cluster(s, pkt)) {
         av_log(s, AV_LOG_DEBUG, "Starting new cluster at offset %" PRIu64
                " bytes, pts %" PRIu64 "\n", url_ftell(pb), pkt->pts);
-        end_ebml_master(pb, mkv->cluster);
+        if (mkv->live) {
+            // live clusters keep their unknown size, send the finished one
+            put_flush_packet(pb);
+        } else {
+            end_ebml_master(pb, mkv->cluster);
 
-        ret = mkv_add_seekhead_entry(mkv->cluster_seekhead, MATROSKA_ID_CLUSTER, url_ftell(pb));
-        if (ret < 0) return ret;
+            ret = mkv_add_seekhead_entry(mkv->cluster_seekhead, MATROSKA_ID_CLUSTER, url_ftell(pb));
+            if (ret < 0) return ret;
+        }
 
         mkv->cluster_pos = url_ftell(pb);
         mkv->cluster = start_ebml_master(pb, MATROSKA_ID_CLUSTER, 0);
@@ -864,18 +1031,15 @@ static int mkv_write_packet(AVFormatContext *s, AVPacket *pkt)
     }
 
     if (codec->codec_type != CODEC_TYPE_SUBTITLE) {
-        mkv_write_block(s, MATROSKA_ID_SIMPLEBLOCK, pkt, keyframe << 7);
+        mkv_write_block(s, MATROSKA_ID_SIMPLEBLOCK, pkt, keyframe << 7, 0);
     } else if (codec->codec_id == CODEC_ID_SSA) {
         duration = mkv_write_ass_blocks(s, pkt);
     } else {
-        ebml_master blockgroup = start_ebml_master(pb, MATROSKA_ID_BLOCKGROUP, mkv_blockgroup_size(pkt->size));
         duration = pkt->convergence_duration;
-        mkv_write_block(s, MATROSKA_ID_BLOCK, pkt, 0);
-        put_ebml_uint(pb, MATROSKA_ID_BLOCKDURATION, duration);
-        end_ebml_master(pb, blockgroup);
+        mkv_write_block(s, MATROSKA_ID_BLOCKGROUP, pkt, 0, duration);
     }
 
-    if (codec->codec_type == CODEC_TYPE_VIDEO && keyframe) {
+    if (codec->codec_type == CODEC_TYPE_VIDEO && keyframe && mkv->cues) {
         ret = mkv_add_cuepoint(mkv->cues, pkt, mkv->cluster_pos);
         if (ret < 0) return ret;
     }
@@ -891,36 +1055,51 @@ static int mkv_write_trailer(AVFormatContext *s)
     int64_t currentpos, second_seekhead, cuespos;
     int ret;
 
+    if (mkv->live) {
+        // nothing to seek back to, the segment keeps its unknown size
+        av_free(mkv->main_seekhead->entries);
+        av_free(mkv->main_seekhead);
+        av_free(mkv->cluster_seekhead);
+        av_free(mkv->md5_ctx);
+        av_freep(&mkv->nal_buf);
+        if (mkv->live_buf) {
+            uint8_t *buf;
+            url_close_dyn_buf(mkv->live_buf, &buf);
+            av_free(buf);
+            mkv->live_buf = NULL;
+        }
+        put_flush_packet(pb);
+        return 0;
+    }
+
     end_ebml_master(pb, mkv->cluster);
+    cuespos = mkv_write_cues(pb, mkv->cues);
+    second_seekhead = mkv_write_seekhead(pb, mkv->cluster_seekhead);
 
-    if (!url_is_streamed(pb)) {
-        cuespos = mkv_write_cues(pb, mkv->cues, s->nb_streams);
-        second_seekhead = mkv_write_seekhead(pb, mkv->cluster_seekhead);
+    ret = mkv_add_seekhead_entry(mkv->main_seekhead, MATROSKA_ID_CUES    , cuespos);
+    if (ret < 0) return ret;
+    ret = mkv_add_seekhead_entry(mkv->main_seekhead, MATROSKA_ID_SEEKHEAD, second_seekhead);
+    if (ret < 0) return ret;
+    mkv_write_seekhead(pb, mkv->main_seekhead);
 
-        ret = mkv_add_seekhead_entry(mkv->main_seekhead, MATROSKA_ID_CUES    , cuespos);
-        if (ret < 0) return ret;
-        ret = mkv_add_seekhead_entry(mkv->main_seekhead, MATROSKA_ID_SEEKHEAD, second_seekhead);
-        if (ret < 0) return ret;
-        mkv_write_seekhead(pb, mkv->main_seekhead);
-
-        // update the duration
-        av_log(s, AV_LOG_DEBUG, "end duration = %" PRIu64 "\n", mkv->duration);
-        currentpos = url_ftell(pb);
-        url_fseek(pb, mkv->duration_offset, SEEK_SET);
-        put_ebml_float(pb, MATROSKA_ID_DURATION, mkv->duration);
-
-        // write the md5sum of some frames as the segment UID
-        if (!(s->streams[0]->codec->flags & CODEC_FLAG_BITEXACT)) {
-            uint8_t segment_uid[16];
-            av_md5_final(mkv->md5_ctx, segment_uid);
-            url_fseek(pb, mkv->segment_uid, SEEK_SET);
-            put_ebml_binary(pb, MATROSKA_ID_SEGMENTUID, segment_uid, 16);
-        }
-        url_fseek(pb, currentpos, SEEK_SET);
+    // update the duration
+    av_log(s, AV_LOG_DEBUG, "end duration = %" PRIu64 "\n", mkv->duration);
+    currentpos = url_ftell(pb);
+    url_fseek(pb, mkv->duration_offset, SEEK_SET);
+    put_ebml_float(pb, MATROSKA_ID_DURATION, mkv->duration);
+
+    // write the md5sum of some frames as the segment UID
+    if (!(s->streams[0]->codec->flags & CODEC_FLAG_BITEXACT)) {
+        uint8_t segment_uid[16];
+        av_md5_final(mkv->md5_ctx, segment_uid);
+        url_fseek(pb, mkv->segment_uid, SEEK_SET);
+        put_ebml_binary(pb, MATROSKA_ID_SEGMENTUID, segment_uid, 16);
     }
+    url_fseek(pb, currentpos, SEEK_SET);
 
     end_ebml_master(pb, mkv->segment);
     av_free(mkv->md5_ctx);
+    av_freep(&mkv->nal_buf);
     put_flush_packet(pb);
     return 0;
 }
@@ -22,26 +22,252 @@
 #include "avformat.h"
 #include "metadata.h"
 
+#define METADATA_CHUNK_SIZE 4096
+
+typedef struct MetadataChunk {
+    struct MetadataChunk *next;
+    int size, used;
+} MetadataChunk;
+
+#define CHUNK_DATA(c) ((char *)((c) + 1))
+
+typedef struct MetadataPending {
+    struct MetadataPending *next;
+    void (*decode)(AVMetadata **pm, const char *key, const uint8_t *buf, int size);
+    int size;
+} MetadataPending;
+
+/* the key follows the header, then the undecoded value */
+#define PENDING_KEY(p)  ((char *)((p) + 1))
+#define PENDING_DATA(p) ((uint8_t *)PENDING_KEY(p) + strlen(PENDING_KEY(p)) + 1)
+
+static char *arena_strdup(AVMetadata *m, const char *str)
+{
+    MetadataChunk *c = m->arena;
+    int len = strlen(str) + 1;
+
+    if (!c || c->size - c->used < len) {
+        int size = FFMAX(METADATA_CHUNK_SIZE, len);
+        if (!(c = av_malloc(sizeof(*c) + size)))
+            return NULL;
+        c->size  = size;
+        c->used  = 0;
+        c->next  = m->arena;
+        m->arena = c;
+    }
+    memcpy(CHUNK_DATA(c) + c->used, str, len);
+    c->used += len;
+    return CHUNK_DATA(c) + c->used - len;
+}
+
+static int in_arena(AVMetadata *m, const char *str)
+{
+    MetadataChunk *c;
+
+    for (c = m->arena; c; c = c->next)
+        if (str >= CHUNK_DATA(c) && str < CHUNK_DATA(c) + c->size)
+            return 1;
+    return 0;
+}
+
+/**
+ * Free a key or value, unless it is stored in the arena of m.
+ */
+static void metadata_free_str(AVMetadata *m, const char *str)
+{
+    if (!in_arena(m, str))
+        av_free((void *)str);
+}
+
+static char *metadata_strdup(AVMetadata *m, const char *str)
+{
+    return m->use_arena ? arena_strdup(m, str) : av_strdup(str);
+}
+
+int ff_metadata_use_arena(AVMetadata **pm)
+{
+    if (!*pm && !(*pm = av_mallocz(sizeof(**pm))))
+        return AVERROR(ENOMEM);
+    (*pm)->use_arena = 1;
+    return 0;
+}
+
+int ff_metadata_set_lazy(AVMetadata **pm, const char *key, const uint8_t *buf, int size,
+                         void (*decode)(AVMetadata **pm, const char *key,
+                                        const uint8_t *buf, int size))
+{
+    AVMetadata *m = *pm;
+    MetadataPending *p;
+    int key_len = strlen(key) + 1;
+
+    if (!m && !(m = *pm = av_mallocz(sizeof(*m))))
+        return AVERROR(ENOMEM);
+    if (!(p = av_malloc(sizeof(*p) + key_len + size)))
+        return AVERROR(ENOMEM);
+    p->next   = NULL;
+    p->decode = decode;
+    p->size   = size;
+    memcpy(PENDING_KEY(p), key, key_len);
+    memcpy(PENDING_KEY(p) + key_len, buf, size);
+    if (m->pending)
+        m->pending_last->next = p;
+    else
+        m->pending = p;
+    m->pending_last = p;
+    return 0;
+}
+
+void ff_metadata_load(AVMetadata *m)
+{
+    MetadataPending *p, *next;
+
+    if (!m || !m->pending)
+        return;
+    /* detached first, the decoders set tags through av_metadata_set2() */
+    p = m->pending;
+    m->pending = m->pending_last = NULL;
+    for (; p; p = next) {
+        next = p->next;
+        p->decode(&m, PENDING_KEY(p), PENDING_DATA(p), p->size);
+        av_free(p);
+    }
+}
+
+int ff_metadata_is_empty(AVMetadata *m)
+{
+    return !m || (!m->count && !m->pending);
+}
+
+int64_t ff_metadata_memory(AVMetadata *m)
+{
+    MetadataChunk *c;
+    MetadataPending *p;
+    int64_t size;
+    int i;
+
+    if (!m)
+        return 0;
+    size = sizeof(*m) + m->count * sizeof(*m->elems) +
+           2 * m->hash_size * sizeof(*m->hash);
+    for (c = m->arena; c; c = c->next)
+        size += sizeof(*c) + c->size;
+    for (p = m->pending; p; p = p->next)
+        size += sizeof(*p) + strlen(PENDING_KEY(p)) + 1 + p->size;
+    for (i = 0; i < m->count; i++) {
+        if (!in_arena(m, m->elems[i].key))
+            size += strlen(m->elems[i].key) + 1;
+        if (!in_arena(m, m->elems[i].value))
+            size += strlen(m->elems[i].value) + 1;
+    }
+    return size;
+}
+
+/* tag sets smaller than this are only searched linearly */
+#define METADATA_HASH_MIN 16
+
+static unsigned int key_hash(const char *key)
+{
+    unsigned int h = 0;
+
+    while (*key)
+        h = h * 31 + toupper(*key++);
+    return h;
+}
+
+static int key_match(const char *s, const char *key, int flags)
+{
+    unsigned int j;
+
+    if(flags & AV_METADATA_MATCH_CASE) for(j=0;         s[j]  ==         key[j]  && key[j]; j++);
+    else                               for(j=0; toupper(s[j]) == toupper(key[j]) && key[j]; j++);
+    if(key[j])
+        return 0;
+    if(s[j] && !(flags & AV_METADATA_IGNORE_SUFFIX))
+        return 0;
+    return 1;
+}
+
+static void hash_insert(AVMetadata *m, int i)
+{
+    unsigned int h = key_hash(m->elems[i].key) & (m->hash_size - 1);
+
+    m->hash_next[i] = m->hash[h];
+    m->hash[h]      = i;
+}
+
+/**
+ * Replace element old by new (-1 to remove it) in its bucket.
+ */
+static void hash_replace(AVMetadata *m, int old, int new)
+{
+    int *p = &m->hash[key_hash(m->elems[old].key) & (m->hash_size - 1)];
+
+    while (*p != old)
+        p = &m->hash_next[*p];
+    if (new < 0) {
+        *p = m->hash_next[old];
+    } else {
+        *p = new;
+        m->hash_next[new] = m->hash_next[old];
+    }
+}
+
+static void hash_free(AVMetadata *m)
+{
+    av_freep(&m->hash);
+    av_freep(&m->hash_next);
+    m->hash_size = 0;
+}
+
+/**
+ * Make room in the index for one more element, (re)building it if needed.
+ * Without memory for it the set just keeps being searched linearly.
+ */
+static void hash_reserve(AVMetadata *m)
+{
+    int size, i;
+
+    if (m->count + 1 < METADATA_HASH_MIN || m->count + 1 <= m->hash_size)
+        return;
+    for (size = METADATA_HASH_MIN * 2; size < 2 * (m->count + 1); size <<= 1);
+    hash_free(m);
+    m->hash      = av_malloc(size * sizeof(*m->hash));
+    m->hash_next = av_malloc(size * sizeof(*m->hash_next));
+    if (!m->hash || !m->hash_next) {
+        hash_free(m);
+        return;
+    }
+    m->hash_size = size;
+    memset(m->hash, -1, size * sizeof(*m->hash));
+    for (i = 0; i < m->count; i++)
+        hash_insert(m, i);
+}
+
 AVMetadataTag *
 av_metadata_get(AVMetadata *m, const char *key, const AVMetadataTag *prev, int flags)
 {
-    unsigned int i, j;
+    unsigned int i;
 
     if(!m)
         return NULL;
+    ff_metadata_load(m);
 
     if(prev) i= prev - m->elems + 1;
     else     i= 0;
 
+    if (m->hash_size && !(flags & AV_METADATA_IGNORE_SUFFIX)) {
+        /* keep the order of the linear search: first match after prev */
+        int best = -1, k = m->hash[key_hash(key) & (m->hash_size - 1)];
+
+        for (; k >= 0; k = m->hash_next[k])
+            if (k >= (int)i && (best < 0 || k < best) && key_match(m->elems[k].key, key, flags))
+                best = k;
+        return best < 0 ? NULL : &m->elems[best];
+    }
+
     for(; i<m->count; i++){
-        const char *s= m->elems[i].key;
-        if(flags & AV_METADATA_MATCH_CASE) for(j=0;         s[j]  ==         key[j]  && key[j]; j++);
-        else                               for(j=0; toupper(s[j]) == toupper(key[j]) && key[j]; j++);
-        if(key[j])
-            continue;
-        if(s[j] && !(flags & AV_METADATA_IGNORE_SUFFIX))
-            continue;
-        return &m->elems[i];
+        if (key_match(m->elems[i].key, key, flags))
+            return &m->elems[i];
     }
     return NULL;
 }
@@ -55,8 +281,14 @@ int av_metadata_set2(AVMetadata **pm, const char *key, const char *value, int fl
         m=*pm= av_mallocz(sizeof(*m));
 
     if(tag){
-        av_free(tag->value);
-        av_free(tag->key);
+        int i = tag - m->elems;
+        if (m->hash_size) {
+            hash_replace(m, i, -1);
+            if (i != m->count - 1)
+                hash_replace(m, m->count - 1, i);
+        }
+        metadata_free_str(m, tag->value);
+        metadata_free_str(m, tag->key);
         *tag= m->elems[--m->count];
     }else{
         AVMetadataTag *tmp= av_realloc(m->elems, (m->count+1) * sizeof(*m->elems));
@@ -66,17 +298,21 @@ int av_metadata_set2(AVMetadata **pm, const char *key, const char *value, int fl
             return AVERROR(ENOMEM);
     }
     if(value){
+        hash_reserve(m);
         if(flags & AV_METADATA_DONT_STRDUP_KEY){
             m->elems[m->count].key  = key;
         }else
-        m->elems[m->count].key  = av_strdup(key  );
+        m->elems[m->count].key  = metadata_strdup(m, key  );
         if(flags & AV_METADATA_DONT_STRDUP_VAL){
             m->elems[m->count].value= value;
         }else
-        m->elems[m->count].value= av_strdup(value);
+        m->elems[m->count].value= metadata_strdup(m, value);
+        if (m->hash_size)
+            hash_insert(m, m->count);
         m->count++;
     }
-    if(!m->count) {
+    if(!m->count && !m->use_arena) {
+        hash_free(m);
         av_free(m->elems);
         av_freep(pm);
     }
@@ -97,10 +333,21 @@ void av_metadata_free(AVMetadata **pm)
 
     if(m){
         while(m->count--){
-            av_free(m->elems[m->count].key);
-            av_free(m->elems[m->count].value);
+            metadata_free_str(m, m->elems[m->count].key);
+            metadata_free_str(m, m->elems[m->count].value);
         }
         av_free(m->elems);
+        hash_free(m);
+        while (m->pending) {
+            MetadataPending *next = m->pending->next;
+            av_free(m->pending);
+            m->pending = next;
+        }
+        while (m->arena) {
+            MetadataChunk *next = m->arena->next;
+            av_free(m->arena);
+            m->arena = next;
+        }
     }
     av_freep(pm);
 }
@@ -115,6 +362,8 @@ static void metadata_conv(AVMetadata **pm, const AVMetadataConv *d_conv,
     AVMetadata *dst = NULL;
     const char *key;
 
+    if (*pm && (*pm)->use_arena)
+        ff_metadata_use_arena(&dst);
     while((mtag=av_metadata_get(*pm, "", mtag, AV_METADATA_IGNORE_SUFFIX))) {
         key = mtag->key;
         if (s_conv != d_conv) {
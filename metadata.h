@@ -33,6 +33,14 @@
 struct AVMetadata{
     int count;
     AVMetadataTag *elems;
+    /* case insensitive key index, only built for larger sets of tags */
+    int hash_size;          ///< number of buckets, a power of 2, 0 if no index
+    int *hash;              ///< first element of each bucket, -1 if empty
+    int *hash_next;         ///< next element in the same bucket, per element
+    int use_arena;          ///< copy keys and values into arena
+    struct MetadataChunk *arena; ///< most recent chunk first
+    struct MetadataPending *pending;      ///< tags still to be decoded, oldest first
+    struct MetadataPending *pending_last; ///< newest of pending
 };
 
 struct AVMetadataConv{
@@ -40,6 +48,40 @@ struct AVMetadataConv{
     const char *generic;
 };
 
+/**
+ * Make the tags set in *pm from now on copy their keys and values into
+ * chunks that are all freed together by av_metadata_free(), instead of
+ * allocating each string separately. An empty set is allocated if needed.
+ */
+int ff_metadata_use_arena(AVMetadata **pm);
+
+/**
+ * Add a tag to *pm whose value is only decoded when the tags of *pm are
+ * first looked up or changed, by calling decode() on a copy of buf.
+ * The tags keep the order in which they were added.
+ * @param decode sets the decoded tag or tags in *pm, buf is freed after it
+ * @return 0 on success, AVERROR(ENOMEM) if out of memory
+ */
+int ff_metadata_set_lazy(AVMetadata **pm, const char *key, const uint8_t *buf, int size,
+                         void (*decode)(AVMetadata **pm, const char *key,
+                                        const uint8_t *buf, int size));
+
+/**
+ * Decode the tags added to m with ff_metadata_set_lazy(), for the code
+ * going through m->elems directly.
+ */
+void ff_metadata_load(AVMetadata *m);
+
+/**
+ * @return 1 if m has no tags, decoded or not, without decoding them
+ */
+int ff_metadata_is_empty(AVMetadata *m);
+
+/**
+ * @return number of heap bytes used by m and its tags
+ */
+int64_t ff_metadata_memory(AVMetadata *m);
+
 #if LIBAVFORMAT_VERSION_MAJOR < 53
 void ff_metadata_demux_compat(AVFormatContext *s);
 void ff_metadata_mux_compat(AVFormatContext *s);
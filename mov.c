@@ -29,6 +29,7 @@
 #include "libavutil/intreadwrite.h"
 #include "libavutil/avstring.h"
 #include "avformat.h"
+#include "internal.h"
 #include "riff.h"
 #include "isom.h"
 #include "libavcodec/mpeg4audio.h"
@@ -38,6 +39,9 @@
 #if CONFIG_ZLIB
 #include <zlib.h>
 #endif
+#if HAVE_PTHREADS
+#include "threadpool.h"
+#endif
 
 /*
  * First version by Francois Revol revol@free.fr
@@ -65,6 +69,11 @@
 #undef NDEBUG
 #include <assert.h>
 
+/* number of sample table entries converted per get_be32_array() call */
+#define MOV_ARRAY_CHUNK 256
+/* deeper nesting only comes from broken or hostile files */
+#define MOV_MAX_ATOM_DEPTH 16
+
 /* XXX: it's the first time I make a recursive parser I think... sorry if it's ugly :P */
 
 /* those functions parse an atom */
@@ -79,6 +88,7 @@ typedef struct MOVParseTableEntry {
 } MOVParseTableEntry;
 
 static const MOVParseTableEntry mov_default_parse_table[];
+static void mov_build_pending_indexes(MOVContext *c);
 
 static int mov_metadata_trkn(MOVContext *c, ByteIOContext *pb, unsigned len)
 {
@@ -180,12 +190,25 @@ static int mov_read_default(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
     int64_t total_size = 0;
     MOVAtom a;
-    int i;
-
+    int i, err;
+
+    if (!c->atom_depth)
+        c->nb_atoms = 0;
+    if (c->atom_depth >= MOV_MAX_ATOM_DEPTH) {
+        av_log(c->fc, AV_LOG_ERROR, "Atoms nested more than %d levels deep\n",
+               MOV_MAX_ATOM_DEPTH);
+        return AVERROR_INVALIDDATA;
+    }
     if (atom.size < 0)
         atom.size = INT64_MAX;
     while (total_size + 8 < atom.size && !url_feof(pb)) {
         int (*parse)(MOVContext*, ByteIOContext*, MOVAtom) = NULL;
+        if (c->fc->max_atoms && ++c->nb_atoms > c->fc->max_atoms) {
+            av_log(c->fc, AV_LOG_ERROR, "Atom limit of %d reached\n", c->fc->max_atoms);
+            return AVERROR_WORK_LIMIT;
+        }
+        if ((err = ff_check_work_time(c->fc)) < 0)
+            return err;
         a.size = atom.size;
         a.type=0;
         if(atom.size >= 8) {
@@ -225,12 +248,16 @@ static int mov_read_default(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         } else {
             int64_t start_pos = url_ftell(pb);
             int64_t left;
-            int err = parse(c, pb, a);
+            c->atom_depth++;
+            err = parse(c, pb, a);
+            c->atom_depth--;
             if (err < 0)
                 return err;
             if (c->found_moov && c->found_mdat &&
-                (url_is_streamed(pb) || start_pos + a.size == url_fsize(pb)))
+                (url_is_streamed(pb) || c->live || start_pos + a.size == url_fsize(pb))) {
+                c->next_root_atom = start_pos + a.size;
                 return 0;
+            }
             left = a.size - url_ftell(pb) + start_pos;
             if (left > 0) /* skip garbage at atom end */
                 url_fskip(pb, left);
@@ -550,6 +577,7 @@ static int mov_read_moov(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
     if (mov_read_default(c, pb, atom) < 0)
         return -1;
+    mov_build_pending_indexes(c);
     /* we parsed the 'moov' atom, we can terminate the parsing as soon as we find the 'mdat' */
     /* so we don't parse the whole file if over a network */
     c->found_moov=1;
@@ -792,14 +820,22 @@ static int mov_read_stco(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->chunk_count = entries;
 
-    if      (atom.type == MKTAG('s','t','c','o'))
-        for(i=0; i<entries; i++)
-            sc->chunk_offsets[i] = get_be32(pb);
-    else if (atom.type == MKTAG('c','o','6','4'))
-        for(i=0; i<entries; i++)
-            sc->chunk_offsets[i] = get_be64(pb);
+    if      (atom.type == MKTAG('s','t','c','o')) {
+        uint32_t buf[MOV_ARRAY_CHUNK];
+        for (i = 0; i < entries; ) {
+            int j, n = FFMIN(entries - i, MOV_ARRAY_CHUNK);
+            int got = get_be32_array(pb, buf, n);
+            for (j = 0; j < got; j++)
+                sc->chunk_offsets[i + j] = buf[j];
+            i += got;
+            if (got < n)
+                break;
+        }
+    } else if (atom.type == MKTAG('c','o','6','4'))
+        i = get_be64_array(pb, (uint64_t *)sc->chunk_offsets, entries);
     else
         return -1;
+    sc->chunk_count = i;
 
     return 0;
 }
@@ -1201,11 +1237,20 @@ static int mov_read_stsc(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->stsc_count = entries;
 
-    for(i=0; i<entries; i++) {
-        sc->stsc_data[i].first = get_be32(pb);
-        sc->stsc_data[i].count = get_be32(pb);
-        sc->stsc_data[i].id = get_be32(pb);
+    for (i = 0; i < entries; ) {
+        uint32_t buf[3 * MOV_ARRAY_CHUNK];
+        int j, n = FFMIN(entries - i, MOV_ARRAY_CHUNK);
+        int got = get_be32_array(pb, buf, 3 * n) / 3;
+        for (j = 0; j < got; j++) {
+            sc->stsc_data[i + j].first = buf[3 * j    ];
+            sc->stsc_data[i + j].count = buf[3 * j + 1];
+            sc->stsc_data[i + j].id    = buf[3 * j + 2];
+        }
+        i += got;
+        if (got < n)
+            break;
     }
+    sc->stsc_count = i;
     return 0;
 }
 
@@ -1213,7 +1258,7 @@ static int mov_read_stps(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
     AVStream *st;
     MOVStreamContext *sc;
-    unsigned i, entries;
+    unsigned entries;
 
     if (c->fc->nb_streams < 1)
         return 0;
@@ -1230,10 +1275,7 @@ static int mov_read_stps(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->stps_count = entries;
 
-    for (i = 0; i < entries; i++) {
-        sc->stps_data[i] = get_be32(pb);
-        //dprintf(c->fc, "stps %d\n", sc->stps_data[i]);
-    }
+    sc->stps_count = get_be32_array(pb, sc->stps_data, entries);
 
     return 0;
 }
@@ -1242,7 +1284,7 @@ static int mov_read_stss(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
     AVStream *st;
     MOVStreamContext *sc;
-    unsigned int i, entries;
+    unsigned int entries;
 
     if (c->fc->nb_streams < 1)
         return 0;
@@ -1263,10 +1305,7 @@ static int mov_read_stss(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->keyframe_count = entries;
 
-    for(i=0; i<entries; i++) {
-        sc->keyframes[i] = get_be32(pb);
-        //dprintf(c->fc, "keyframes[]=%d\n", sc->keyframes[i]);
-    }
+    sc->keyframe_count = get_be32_array(pb, (uint32_t *)sc->keyframes, entries);
     return 0;
 }
 
@@ -1364,20 +1403,26 @@ static int mov_read_stts(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->stts_count = entries;
 
-    for(i=0; i<entries; i++) {
-        int sample_duration;
-        int sample_count;
-
-        sample_count=get_be32(pb);
-        sample_duration = get_be32(pb);
-        sc->stts_data[i].count= sample_count;
-        sc->stts_data[i].duration= sample_duration;
+    for (i = 0; i < entries; ) {
+        uint32_t buf[2 * MOV_ARRAY_CHUNK];
+        int j, n = FFMIN(entries - i, MOV_ARRAY_CHUNK);
+        int got = get_be32_array(pb, buf, 2 * n) / 2;
+        for (j = 0; j < got; j++) {
+            int sample_count    = buf[2 * j    ];
+            int sample_duration = buf[2 * j + 1];
+            sc->stts_data[i + j].count= sample_count;
+            sc->stts_data[i + j].duration= sample_duration;
 
-        dprintf(c->fc, "sample_count=%d, sample_duration=%d\n",sample_count,sample_duration);
+            dprintf(c->fc, "sample_count=%d, sample_duration=%d\n",sample_count,sample_duration);
 
-        duration+=(int64_t)sample_duration*sample_count;
-        total_sample_count+=sample_count;
+            duration+=(int64_t)sample_duration*sample_count;
+            total_sample_count+=sample_count;
+        }
+        i += got;
+        if (got < n)
+            break;
     }
+    sc->stts_count = i;
 
     st->nb_frames= total_sample_count;
     if(duration)
@@ -1409,37 +1454,41 @@ static int mov_read_ctts(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         return AVERROR(ENOMEM);
     sc->ctts_count = entries;
 
-    for(i=0; i<entries; i++) {
-        int count    =get_be32(pb);
-        int duration =get_be32(pb);
-
-        sc->ctts_data[i].count   = count;
-        sc->ctts_data[i].duration= duration;
-        if (duration < 0)
-            sc->dts_shift = FFMAX(sc->dts_shift, -duration);
+    for (i = 0; i < entries; ) {
+        uint32_t buf[2 * MOV_ARRAY_CHUNK];
+        int j, n = FFMIN(entries - i, MOV_ARRAY_CHUNK);
+        int got = get_be32_array(pb, buf, 2 * n) / 2;
+        for (j = 0; j < got; j++) {
+            int count    = buf[2 * j    ];
+            int duration = buf[2 * j + 1];
+
+            sc->ctts_data[i + j].count   = count;
+            sc->ctts_data[i + j].duration= duration;
+            if (duration < 0)
+                sc->dts_shift = FFMAX(sc->dts_shift, -duration);
+        }
+        i += got;
+        if (got < n)
+            break;
     }
+    sc->ctts_count = i;
 
     dprintf(c->fc, "dts shift %d\n", sc->dts_shift);
 
     return 0;
 }
 
-static void mov_build_index(MOVContext *mov, AVStream *st)
+/**
+ * @return dts of the first sample, adjusted according to the edit list
+ */
+static int64_t mov_first_dts(MOVContext *mov, AVStream *st)
 {
     MOVStreamContext *sc = st->priv_data;
-    int64_t current_offset;
-    int64_t current_dts = 0;
-    unsigned int stts_index = 0;
-    unsigned int stsc_index = 0;
-    unsigned int stss_index = 0;
-    unsigned int stps_index = 0;
-    unsigned int i, j;
-    uint64_t stream_size = 0;
+    int64_t dts = 0;
 
-    /* adjust first dts according to edit list */
     if (sc->time_offset) {
         int rescaled = sc->time_offset < 0 ? av_rescale(sc->time_offset, sc->time_scale, mov->time_scale) : sc->time_offset;
-        current_dts = -rescaled;
+        dts = -rescaled;
         if (sc->ctts_data && sc->ctts_data[0].duration / sc->stts_data[0].duration > 16) {
             /* more than 16 frames delay, dts are likely wrong
                this happens with files created by iMovie */
@@ -1447,6 +1496,20 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
             st->codec->has_b_frames = 1;
         }
     }
+    return dts;
+}
+
+static void mov_build_index(MOVContext *mov, AVStream *st)
+{
+    MOVStreamContext *sc = st->priv_data;
+    int64_t current_offset;
+    int64_t current_dts = mov_first_dts(mov, st);
+    unsigned int stts_index = 0;
+    unsigned int stsc_index = 0;
+    unsigned int stss_index = 0;
+    unsigned int stps_index = 0;
+    unsigned int i, j;
+    uint64_t stream_size = 0;
 
     /* only use old uncompressed audio chunk demuxing when stts specifies it */
     if (!(st->codec->codec_type == CODEC_TYPE_AUDIO &&
@@ -1459,6 +1522,9 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
 
         current_dts -= sc->dts_shift;
 
+        /* sample_sizes already holds that many entries, do the same here */
+        ff_reserve_index_entries(st, sc->sample_count);
+
         for (i = 0; i < sc->chunk_count; i++) {
             current_offset = sc->chunk_offsets[i];
             if (stsc_index + 1 < sc->stsc_count &&
@@ -1507,6 +1573,7 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
         if (st->duration > 0)
             st->codec->bit_rate = stream_size*8*sc->time_scale/st->duration;
     } else {
+        ff_reserve_index_entries(st, sc->chunk_count);
         for (i = 0; i < sc->chunk_count; i++) {
             unsigned chunk_samples;
 
@@ -1551,6 +1618,297 @@ static void mov_build_index(MOVContext *mov, AVStream *st)
     }
 }
 
+static void mov_free_sample_tables(MOVStreamContext *sc)
+{
+    av_freep(&sc->chunk_offsets);
+    av_freep(&sc->stsc_data);
+    av_freep(&sc->sample_sizes);
+    av_freep(&sc->keyframes);
+    av_freep(&sc->stts_data);
+    av_freep(&sc->stps_data);
+}
+
+/* lazy index: the sample tables are walked with a MOVSampleCursor when a
+ * sample is needed, following them the same way mov_build_index() does,
+ * and only the keyframes are added to the AVStream index */
+
+static unsigned int mov_sample_size(MOVStreamContext *sc, unsigned int sample)
+{
+    return sc->sample_size > 0 ? sc->sample_size : sc->sample_sizes[sample];
+}
+
+/**
+ * Set up cur for the first sample of chunk cur->chunk, or of the next
+ * chunk which is not empty. Must be called once for each chunk in order.
+ */
+static void mov_cursor_enter_chunk(MOVStreamContext *sc, MOVSampleCursor *cur)
+{
+    for (;;) {
+        if (cur->stsc_index + 1 < sc->stsc_count &&
+            cur->chunk + 1 == sc->stsc_data[cur->stsc_index + 1].first)
+            cur->stsc_index++;
+        if (sc->stsc_data[cur->stsc_index].count || cur->chunk + 1 >= sc->chunk_count)
+            break;
+        cur->chunk++;
+    }
+    cur->pos          = sc->chunk_offsets[cur->chunk];
+    cur->chunk_sample = 0;
+}
+
+static void mov_cursor_reset(MOVStreamContext *sc, MOVSampleCursor *cur)
+{
+    memset(cur, 0, sizeof(*cur));
+    cur->dts = sc->first_dts;
+    mov_cursor_enter_chunk(sc, cur);
+}
+
+/**
+ * Advance the dts of cur by n samples, one stts entry at a time.
+ */
+static void mov_cursor_skip_dts(MOVStreamContext *sc, MOVSampleCursor *cur, unsigned int n)
+{
+    while (n) {
+        const MOVStts *stts = &sc->stts_data[cur->stts_index];
+        int last = cur->stts_index + 1 >= sc->stts_count;
+        unsigned int step = n;
+
+        /* the last entry and empty ones last forever, as in mov_build_index() */
+        if (!last && stts->count > cur->stts_sample)
+            step = FFMIN(n, stts->count - cur->stts_sample);
+        cur->dts         += (int64_t)step * stts->duration;
+        cur->stts_sample += step;
+        n                -= step;
+        if (!last && cur->stts_sample == stts->count) {
+            cur->stts_index++;
+            cur->stts_sample = 0;
+        }
+    }
+}
+
+static void mov_cursor_next(MOVStreamContext *sc, MOVSampleCursor *cur)
+{
+    cur->pos += mov_sample_size(sc, cur->sample);
+    mov_cursor_skip_dts(sc, cur, 1);
+    cur->sample++;
+    if (++cur->chunk_sample >= sc->stsc_data[cur->stsc_index].count &&
+        cur->chunk + 1 < sc->chunk_count) {
+        cur->chunk++;
+        mov_cursor_enter_chunk(sc, cur);
+    }
+}
+
+/**
+ * Move cur to sample, skipping whole chunks before walking the samples
+ * of the chunk holding it. Seeking backwards restarts from the first sample.
+ */
+static void mov_cursor_seek(MOVStreamContext *sc, MOVSampleCursor *cur, unsigned int sample)
+{
+    if (sample < cur->sample)
+        mov_cursor_reset(sc, cur);
+    while (cur->chunk + 1 < sc->chunk_count) {
+        unsigned int left = sc->stsc_data[cur->stsc_index].count - cur->chunk_sample;
+        if (cur->sample + left > sample)
+            break;
+        mov_cursor_skip_dts(sc, cur, left);
+        cur->sample += left;
+        cur->chunk++;
+        mov_cursor_enter_chunk(sc, cur);
+    }
+    while (cur->sample < sample)
+        mov_cursor_next(sc, cur);
+}
+
+static int mov_find_table_entry(const unsigned int *tab, unsigned int n, unsigned int v)
+{
+    unsigned int a = 0, b = n;
+
+    while (a < b) {
+        unsigned int m = (a + b) >> 1;
+        if (tab[m] < v)
+            a = m + 1;
+        else
+            b = m;
+    }
+    return a < n && tab[a] == v;
+}
+
+static int mov_is_keyframe(MOVStreamContext *sc, unsigned int sample)
+{
+    unsigned int key;
+
+    if (!sc->keyframe_count)
+        return 1;
+    key = sample + (sc->keyframes[0] == 1);
+    return mov_find_table_entry((unsigned int *)sc->keyframes, sc->keyframe_count, key) ||
+           mov_find_table_entry(sc->stps_data, sc->stps_count, key);
+}
+
+/**
+ * @return number of the last sample with a dts <= dts, -1 if there is none
+ */
+static int64_t mov_dts_to_sample(MOVStreamContext *sc, int64_t dts)
+{
+    int64_t t = sc->first_dts, sample = 0;
+    unsigned int i;
+
+    if (dts < t)
+        return -1;
+    for (i = 0; i < sc->stts_count; i++) {
+        const MOVStts *stts = &sc->stts_data[i];
+        int64_t end = t + (int64_t)stts->count * stts->duration;
+
+        if (i + 1 == sc->stts_count || stts->count <= 0 || dts < end)
+            return stts->duration > 0 ? sample + (dts - t) / stts->duration : sample;
+        t       = end;
+        sample += stts->count;
+    }
+    return sample;
+}
+
+static int mov_nb_samples(AVStream *st)
+{
+    MOVStreamContext *sc = st->priv_data;
+
+    return sc->lazy ? sc->lazy_samples : ff_index_nb_entries(st);
+}
+
+/**
+ * @return sample number sample of st, or NULL if out of range; the
+ *         pointer is only valid until the next lookup in st
+ */
+static const AVIndexEntry *mov_get_sample(AVStream *st, int sample)
+{
+    MOVStreamContext *sc = st->priv_data;
+    AVIndexEntry *e = &sc->lazy_entry;
+
+    if (!sc->lazy)
+        return ff_index_get_entry(st, sample);
+    if (sample < 0 || sample >= sc->lazy_samples)
+        return NULL;
+    mov_cursor_seek(sc, &sc->cursor, sample);
+    e->pos          = sc->cursor.pos;
+    e->timestamp    = sc->cursor.dts;
+    e->size         = mov_sample_size(sc, sample);
+    e->min_distance = 0;
+    e->flags        = mov_is_keyframe(sc, sample) ? AVINDEX_KEYFRAME : 0;
+    return e;
+}
+
+/**
+ * Find the sample to seek to in a lazily indexed track, with the
+ * semantics of av_index_search_timestamp().
+ */
+static int mov_lazy_search(AVStream *st, int64_t timestamp, int flags)
+{
+    MOVStreamContext *sc = st->priv_data;
+    int64_t sample;
+
+    if (sc->keyframe_count && !(flags & AVSEEK_FLAG_ANY)) {
+        int index = av_index_search_timestamp(st, timestamp, flags);
+        if (index < 0)
+            return -1;
+        return mov_dts_to_sample(sc, ff_index_get_entry(st, index)->timestamp);
+    }
+    sample = mov_dts_to_sample(sc, timestamp);
+    if (sample >= sc->lazy_samples)
+        return flags & AVSEEK_FLAG_BACKWARD ? sc->lazy_samples - 1 : -1;
+    if (!(flags & AVSEEK_FLAG_BACKWARD) &&
+        (sample < 0 || mov_get_sample(st, sample)->timestamp < timestamp))
+        sample++;
+    return sample < sc->lazy_samples ? sample : -1;
+}
+
+static void mov_lazy_add_entry(AVStream *st, MOVSampleCursor *cur)
+{
+    MOVStreamContext *sc = st->priv_data;
+
+    av_add_index_entry(st, cur->pos, cur->dts, mov_sample_size(sc, cur->sample),
+                       0, AVINDEX_KEYFRAME);
+}
+
+/**
+ * Set up st for reading its samples from the sample tables, with an
+ * index of the keyframes only, or of the chunks if all samples are
+ * keyframes.
+ */
+static void mov_build_lazy_index(MOVContext *mov, AVStream *st)
+{
+    MOVStreamContext *sc = st->priv_data;
+    MOVSampleCursor *cur = &sc->cursor;
+    uint64_t stream_size = 0;
+    unsigned int i, total = 0;
+
+    sc->first_dts = mov_first_dts(mov, st) - sc->dts_shift;
+
+    /* samples beyond the chunks or the sample count do not exist */
+    mov_cursor_reset(sc, cur);
+    for (;;) {
+        total += sc->stsc_data[cur->stsc_index].count;
+        if (total >= sc->sample_count || cur->chunk + 1 >= sc->chunk_count)
+            break;
+        cur->chunk++;
+        mov_cursor_enter_chunk(sc, cur);
+    }
+    sc->lazy_samples = FFMIN(total, sc->sample_count);
+    if (total > sc->sample_count || sc->lazy_samples > INT_MAX) {
+        av_log(mov->fc, AV_LOG_ERROR, "wrong sample count\n");
+        sc->lazy_samples = FFMIN(sc->lazy_samples, INT_MAX);
+    }
+
+    if (sc->sample_size > 0)
+        stream_size = (uint64_t)sc->sample_size * sc->lazy_samples;
+    else
+        for (i = 0; i < sc->lazy_samples; i++)
+            stream_size += (unsigned)sc->sample_sizes[i];
+    if (st->duration > 0)
+        st->codec->bit_rate = stream_size*8*sc->time_scale/st->duration;
+
+    mov_cursor_reset(sc, cur);
+    if (sc->keyframe_count) {
+        unsigned int key_off = sc->keyframes[0] == 1;
+        unsigned int j = 0, next = 0;
+
+        /* stss and stps are both sorted, merge them */
+        i = 0;
+        while (i < sc->keyframe_count || j < sc->stps_count) {
+            unsigned int key = UINT_MAX, part = UINT_MAX, sample;
+            if (i < sc->keyframe_count)
+                key  = sc->keyframes[i] - key_off;
+            if (j < sc->stps_count)
+                part = sc->stps_data[j] - key_off;
+            sample = FFMIN(key, part);
+            i += sample == key;
+            j += sample == part;
+            if (sample < next || sample >= sc->lazy_samples)
+                continue;
+            mov_cursor_seek(sc, cur, sample);
+            mov_lazy_add_entry(st, cur);
+            next = sample + 1;
+        }
+    } else {
+        while (cur->sample < sc->lazy_samples) {
+            mov_lazy_add_entry(st, cur);
+            if (cur->chunk + 1 >= sc->chunk_count)
+                break;
+            mov_cursor_seek(sc, cur, cur->sample + sc->stsc_data[cur->stsc_index].count);
+        }
+    }
+    mov_cursor_reset(sc, cur);
+}
+
+/**
+ * Replace the lazy index of st by a full one, to append fragments to it.
+ */
+static void mov_expand_lazy_index(MOVContext *mov, AVStream *st)
+{
+    MOVStreamContext *sc = st->priv_data;
+
+    st->nb_index_entries = 0;
+    sc->lazy = 0;
+    mov_build_index(mov, st);
+    mov_free_sample_tables(sc);
+}
+
 static int mov_open_dref(ByteIOContext **pb, char *src, MOVDref *ref)
 {
     /* try absolute path */
@@ -1597,6 +1955,58 @@ static int mov_open_dref(ByteIOContext **pb, char *src, MOVDref *ref)
     return AVERROR(ENOENT);
 };
 
+/**
+ * Build the index of st if mov_read_trak() left it for later.
+ * Only touches st, so it may run for several streams in parallel.
+ */
+static void mov_build_pending_index(MOVContext *c, AVStream *st)
+{
+    MOVStreamContext *sc = st->priv_data;
+
+    if (!sc->index_pending)
+        return;
+    if (sc->lazy) {
+        mov_build_lazy_index(c, st);
+    } else {
+        mov_build_index(c, st);
+        mov_free_sample_tables(sc);
+    }
+    sc->index_pending = 0;
+}
+
+#if HAVE_PTHREADS
+static void mov_index_task(void *opaque, void *job)
+{
+    mov_build_pending_index(opaque, job);
+}
+#endif
+
+/**
+ * Build the indexes left pending by mov_read_trak(), with up to
+ * AVFormatContext.trak_threads threads of the pool, the calling one
+ * included.
+ */
+static void mov_build_pending_indexes(MOVContext *c)
+{
+    AVFormatContext *s = c->fc;
+    int i;
+#if HAVE_PTHREADS
+    FFTaskQueue *q;
+
+    if (FFMIN(s->trak_threads, s->nb_streams) > 1 &&
+        (q = ff_task_queue_alloc(s, mov_index_task, c, s->trak_threads))) {
+        for (i = 0; i < s->nb_streams; i++)
+            if (ff_task_queue_submit(q, s->streams[i]) < 0)
+                break;
+        ff_task_queue_wait(q);
+        ff_task_queue_free(&q);
+    }
+#endif
+    /* the streams not submitted */
+    for (i = 0; i < s->nb_streams; i++)
+        mov_build_pending_index(c, s->streams[i]);
+}
+
 static int mov_read_trak(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
     AVStream *st;
@@ -1639,7 +2049,24 @@ static int mov_read_trak(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         dprintf(c->fc, "frame size %d\n", st->codec->frame_size);
     }
 
-    mov_build_index(c, st);
+    /* the lazy index cannot be cached, tracks using old uncompressed
+       audio chunk demuxing or several sample descriptions need a full one */
+    sc->lazy = c->fc->flags & AVFMT_FLAG_LAZY_INDEX &&
+               !(c->fc->flags & AVFMT_FLAG_INDEX_CACHE) &&
+               sc->pseudo_stream_id == -1 && sc->sample_count && sc->chunk_count &&
+               !(st->codec->codec_type == CODEC_TYPE_AUDIO &&
+                 sc->stts_count == 1 && sc->stts_data[0].duration == 1);
+    if (sc->lazy) {
+        sc->index_pending = 1;
+    } else {
+        /* the samples read from live input are dropped from the index */
+        if (c->fc->flags & AVFMT_FLAG_COMPACT_INDEX && !c->live)
+            ff_index_enable_compact(st);
+        sc->index_pending = !ff_index_cache_restore(c->fc, st);
+    }
+    /* with several threads, the indexes are built once the moov is parsed */
+    if (!HAVE_PTHREADS || c->fc->trak_threads <= 1)
+        mov_build_pending_index(c, st);
 
     if (sc->dref_id-1 < sc->drefs_count && sc->drefs[sc->dref_id-1].path) {
         MOVDref *dref = &sc->drefs[sc->dref_id - 1];
@@ -1666,6 +2093,8 @@ static int mov_read_trak(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
                   sc->time_scale*st->nb_frames, st->duration, INT_MAX);
     }
 
+    /* the stsd dimensions are used as they are if the container is trusted */
+    if (!(c->fc->flags & AVFMT_FLAG_TRUST_CONTAINER))
     switch (st->codec->codec_id) {
 #if CONFIG_H261_DECODER
     case CODEC_ID_H261:
@@ -1684,13 +2113,17 @@ static int mov_read_trak(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
         break;
     }
 
+    st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA;
+    if (st->codec->codec_type == CODEC_TYPE_VIDEO) {
+        st->container_params |= FF_PARAM_DIMENSIONS;
+        if (sc->stts_count == 1)
+            st->container_params |= FF_PARAM_FRAME_RATE;
+    } else if (st->codec->codec_type == CODEC_TYPE_AUDIO)
+        st->container_params |= FF_PARAM_AUDIO;
+
     /* Do not need those anymore. */
-    av_freep(&sc->chunk_offsets);
-    av_freep(&sc->stsc_data);
-    av_freep(&sc->sample_sizes);
-    av_freep(&sc->keyframes);
-    av_freep(&sc->stts_data);
-    av_freep(&sc->stps_data);
+    if (!sc->lazy && !sc->index_pending)
+        mov_free_sample_tables(sc);
 
     return 0;
 }
@@ -1881,6 +2314,8 @@ static int mov_read_trun(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
     sc = st->priv_data;
     if (sc->pseudo_stream_id+1 != frag->stsd_id)
         return 0;
+    if (sc->lazy)
+        mov_expand_lazy_index(c, st);
     get_byte(pb); /* version */
     flags = get_be24(pb);
     entries = get_be32(pb);
@@ -1955,13 +2390,84 @@ static int mov_read_wide(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
     return err;
 }
 
+#if CONFIG_ZLIB
+#define MOV_INFLATE_BUF_SIZE 32768
+
+/** state of the streaming decompression of a cmov atom */
+typedef struct MOVInflate {
+    ByteIOContext *pb;    ///< compressed input
+    int64_t start;        ///< position of the compressed data in pb
+    int64_t size;         ///< size of the compressed data
+    int64_t left;         ///< compressed bytes not read yet
+    int64_t pos;          ///< uncompressed bytes returned so far
+    int64_t out_size;     ///< uncompressed size from the cmvd atom
+    z_stream zstream;
+    uint8_t in[MOV_INFLATE_BUF_SIZE];
+} MOVInflate;
+
+static int mov_inflate_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MOVInflate *inf = opaque;
+    z_stream *z = &inf->zstream;
+    int ret = Z_OK;
+
+    z->next_out  = buf;
+    z->avail_out = buf_size;
+    while (z->avail_out == buf_size && ret != Z_STREAM_END) {
+        if (!z->avail_in) {
+            int len = FFMIN(inf->left, sizeof(inf->in));
+            if (len <= 0 || (len = get_buffer(inf->pb, inf->in, len)) <= 0)
+                break;
+            inf->left  -= len;
+            z->next_in  = inf->in;
+            z->avail_in = len;
+        }
+        ret = inflate(z, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return -1;
+    }
+    inf->pos += buf_size - z->avail_out;
+    return buf_size - z->avail_out;
+}
+
+/** seeking back restarts the decompression, seeking forward skips output */
+static int64_t mov_inflate_seek(void *opaque, int64_t offset, int whence)
+{
+    MOVInflate *inf = opaque;
+    uint8_t buf[4096];
+
+    if (whence == AVSEEK_SIZE)
+        return inf->out_size;
+    if (whence != SEEK_SET || offset < 0)
+        return AVERROR(EINVAL);
+    if (offset < inf->pos) {
+        if (url_fseek(inf->pb, inf->start, SEEK_SET) != inf->start ||
+            inflateReset(&inf->zstream) != Z_OK)
+            return AVERROR(EPIPE);
+        inf->zstream.avail_in = 0;
+        inf->left = inf->size;
+        inf->pos  = 0;
+    }
+    while (inf->pos < offset) {
+        int ret = mov_inflate_read(inf, buf, FFMIN(offset - inf->pos, sizeof(buf)));
+        if (ret <= 0)
+            return AVERROR(EPIPE);
+    }
+    return offset;
+}
+#endif
+
+/**
+ * The compressed moov is inflated while it is parsed, through the read
+ * callback of a ByteIOContext, so neither the compressed nor the
+ * uncompressed header has to be held in memory as a whole.
+ */
 static int mov_read_cmov(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
 {
 #if CONFIG_ZLIB
     ByteIOContext ctx;
-    uint8_t *cmov_data;
-    uint8_t *moov_data; /* uncompressed data */
-    long cmov_len, moov_len;
+    MOVInflate *inf;
+    uint8_t *buf;
     int ret = -1;
 
     get_be32(pb); /* dcom atom */
@@ -1974,31 +2480,32 @@ static int mov_read_cmov(MOVContext *c, ByteIOContext *pb, MOVAtom atom)
     get_be32(pb); /* cmvd atom */
     if (get_le32(pb) != MKTAG('c','m','v','d'))
         return -1;
-    moov_len = get_be32(pb); /* uncompressed size */
-    cmov_len = atom.size - 6 * 4;
 
-    cmov_data = av_malloc(cmov_len);
-    if (!cmov_data)
+    inf = av_mallocz(sizeof(*inf));
+    if (!inf)
         return AVERROR(ENOMEM);
-    moov_data = av_malloc(moov_len);
-    if (!moov_data) {
-        av_free(cmov_data);
+    buf = av_malloc(MOV_INFLATE_BUF_SIZE);
+    if (!buf) {
+        av_free(inf);
         return AVERROR(ENOMEM);
     }
-    get_buffer(pb, cmov_data, cmov_len);
-    if(uncompress (moov_data, (uLongf *) &moov_len, (const Bytef *)cmov_data, cmov_len) != Z_OK)
-        goto free_and_return;
-    if(init_put_byte(&ctx, moov_data, moov_len, 0, NULL, NULL, NULL, NULL) != 0)
+    inf->out_size = get_be32(pb); /* uncompressed size */
+    inf->pb       = pb;
+    inf->start    = url_ftell(pb);
+    inf->size     = inf->left = atom.size - 6 * 4;
+    if (inflateInit(&inf->zstream) != Z_OK)
         goto free_and_return;
+    if (init_put_byte(&ctx, buf, MOV_INFLATE_BUF_SIZE, 0, inf,
+                      mov_inflate_read, NULL, mov_inflate_seek) != 0)
+        goto end_inflate;
     atom.type = MKTAG('m','o','o','v');
-    atom.size = moov_len;
-#ifdef DEBUG
-//    { int fd = open("/tmp/uncompheader.mov", O_WRONLY | O_CREAT); write(fd, moov_data, moov_len); close(fd); }
-#endif
+    atom.size = inf->out_size;
     ret = mov_read_default(c, &ctx, atom);
+end_inflate:
+    inflateEnd(&inf->zstream);
 free_and_return:
-    av_free(moov_data);
-    av_free(cmov_data);
+    av_free(buf);
+    av_free(inf);
     return ret;
 #else
     av_log(c->fc, AV_LOG_ERROR, "this file requires zlib support compiled in\n");
@@ -2145,6 +2652,7 @@ static int mov_read_header(AVFormatContext *s, AVFormatParameters *ap)
     MOVAtom atom = { 0 };
 
     mov->fc = s;
+    mov->live = !!(s->flags & AVFMT_FLAG_LIVE);
     /* .mov and .mp4 aren't streamable anyway (only progressive download if moov is before mdat) */
     if(!url_is_streamed(pb))
         atom.size = url_fsize(pb);
@@ -2160,66 +2668,399 @@ static int mov_read_header(AVFormatContext *s, AVFormatParameters *ap)
         av_log(s, AV_LOG_ERROR, "moov atom not found\n");
         return -1;
     }
+    if (!mov->found_mdat)
+        mov->next_root_atom = url_ftell(pb);
     dprintf(mov->fc, "on_parse_exit_offset=%lld\n", url_ftell(pb));
 
     return 0;
 }
 
-static AVIndexEntry *mov_find_next_sample(AVFormatContext *s, AVStream **st)
+/* sample selection: the streams with samples left are kept in two binary
+ * min-heaps of stream indexes, one by the dts of their next sample in
+ * AV_TIME_BASE and one by its position, streams reading from another
+ * file than s->pb are only in the first */
+#define MOV_HEAP_DTS 0
+#define MOV_HEAP_POS 1
+
+static int mov_heap_before(AVFormatContext *s, int h, int a, int b)
+{
+    MOVStreamContext *sa = s->streams[a]->priv_data;
+    MOVStreamContext *sb = s->streams[b]->priv_data;
+    int64_t ka = h == MOV_HEAP_POS ? sa->next_pos : sa->next_dts;
+    int64_t kb = h == MOV_HEAP_POS ? sb->next_pos : sb->next_dts;
+
+    /* ties go to the lower stream index, as with a scan of the streams */
+    return ka < kb || (ka == kb && a < b);
+}
+
+static void mov_heap_set(AVFormatContext *s, int h, int i, int st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVStreamContext *sc = s->streams[st]->priv_data;
+
+    mov->sample_heap[h][i] = st;
+    sc->heap_slot[h] = i;
+}
+
+static void mov_heap_up(AVFormatContext *s, int h, int i)
+{
+    MOVContext *mov = s->priv_data;
+    int st = mov->sample_heap[h][i];
+
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!mov_heap_before(s, h, st, mov->sample_heap[h][parent]))
+            break;
+        mov_heap_set(s, h, i, mov->sample_heap[h][parent]);
+        i = parent;
+    }
+    mov_heap_set(s, h, i, st);
+}
+
+static void mov_heap_down(AVFormatContext *s, int h, int i)
+{
+    MOVContext *mov = s->priv_data;
+    int *heap = mov->sample_heap[h];
+    int st = heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= mov->nb_sample_heap[h])
+            break;
+        if (child + 1 < mov->nb_sample_heap[h] &&
+            mov_heap_before(s, h, heap[child + 1], heap[child]))
+            child++;
+        if (!mov_heap_before(s, h, heap[child], st))
+            break;
+        mov_heap_set(s, h, i, heap[child]);
+        i = child;
+    }
+    mov_heap_set(s, h, i, st);
+}
+
+static void mov_heap_remove(AVFormatContext *s, int h, int st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVStreamContext *sc = s->streams[st]->priv_data;
+    MOVStreamContext *lsc;
+    int i = sc->heap_slot[h], last;
+
+    if (i < 0)
+        return;
+    sc->heap_slot[h] = -1;
+    last = mov->sample_heap[h][--mov->nb_sample_heap[h]];
+    if (i == mov->nb_sample_heap[h])
+        return;
+    lsc = s->streams[last]->priv_data;
+    mov_heap_set(s, h, i, last);
+    mov_heap_up(s, h, i);
+    mov_heap_down(s, h, lsc->heap_slot[h]);
+}
+
+/**
+ * Update the keys of stream st for its current sample.
+ * @return 0 on success, -1 if st has no samples left
+ */
+static int mov_update_next_sample(AVFormatContext *s, int st)
+{
+    AVStream *avst = s->streams[st];
+    MOVStreamContext *sc = avst->priv_data;
+    const AVIndexEntry *e;
+
+    if (!sc->pb || !(e = mov_get_sample(avst, sc->current_sample)))
+        return -1;
+    sc->next_dts = av_rescale(e->timestamp, AV_TIME_BASE, sc->time_scale);
+    sc->next_pos = e->pos;
+    return 0;
+}
+
+static int mov_in_pos_heap(AVFormatContext *s, MOVStreamContext *sc)
+{
+    return url_is_streamed(s->pb) || sc->pb == s->pb;
+}
+
+static int mov_build_sample_heaps(AVFormatContext *s)
+{
+    MOVContext *mov = s->priv_data;
+    int h, i;
+
+    for (h = 0; h < 2; h++) {
+        int *heap = av_realloc(mov->sample_heap[h], s->nb_streams * sizeof(*heap));
+        if (!heap && s->nb_streams)
+            return AVERROR(ENOMEM);
+        mov->sample_heap[h]    = heap;
+        mov->nb_sample_heap[h] = 0;
+    }
+    for (i = 0; i < s->nb_streams; i++) {
+        MOVStreamContext *sc = s->streams[i]->priv_data;
+
+        sc->heap_slot[MOV_HEAP_DTS] = sc->heap_slot[MOV_HEAP_POS] = -1;
+        if (mov_update_next_sample(s, i) < 0)
+            continue;
+        mov_heap_set(s, MOV_HEAP_DTS, mov->nb_sample_heap[MOV_HEAP_DTS], i);
+        mov_heap_up(s, MOV_HEAP_DTS, mov->nb_sample_heap[MOV_HEAP_DTS]++);
+        if (mov_in_pos_heap(s, sc)) {
+            mov_heap_set(s, MOV_HEAP_POS, mov->nb_sample_heap[MOV_HEAP_POS], i);
+            mov_heap_up(s, MOV_HEAP_POS, mov->nb_sample_heap[MOV_HEAP_POS]++);
+        }
+    }
+    mov->sample_heap_valid = 1;
+    return 0;
+}
+
+/**
+ * Reposition stream st in the heaps after its current sample changed.
+ */
+static void mov_heap_next_sample(AVFormatContext *s, int st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVStreamContext *sc = s->streams[st]->priv_data;
+    int h, ret;
+
+    if (!mov->sample_heap_valid)
+        return;
+    ret = mov_update_next_sample(s, st);
+    for (h = 0; h < 2; h++) {
+        if (sc->heap_slot[h] < 0)
+            continue;
+        if (ret < 0) {
+            mov_heap_remove(s, h, st);
+        } else {
+            mov_heap_up(s, h, sc->heap_slot[h]);
+            mov_heap_down(s, h, sc->heap_slot[h]);
+        }
+    }
+}
+
+static const AVIndexEntry *mov_find_next_sample(AVFormatContext *s, AVStream **st)
+{
+    MOVContext *mov = s->priv_data;
+    MOVStreamContext *sc;
+    int best;
+
+    if (!mov->sample_heap_valid && mov_build_sample_heaps(s) < 0)
+        return NULL;
+    if (url_is_streamed(s->pb)) {
+        /* file order, there is no seeking back */
+        if (!mov->nb_sample_heap[MOV_HEAP_POS])
+            return NULL;
+        best = mov->sample_heap[MOV_HEAP_POS][0];
+    } else {
+        if (!mov->nb_sample_heap[MOV_HEAP_DTS])
+            return NULL;
+        best = mov->sample_heap[MOV_HEAP_DTS][0];
+        /* read in file order as long as it stays within a second of
+           the earliest sample, to avoid seeking between tracks */
+        if (mov->nb_sample_heap[MOV_HEAP_POS]) {
+            int first = mov->sample_heap[MOV_HEAP_POS][0];
+            MOVStreamContext *fsc = s->streams[first]->priv_data;
+            sc = s->streams[best]->priv_data;
+            if (fsc->next_dts - sc->next_dts <= AV_TIME_BASE)
+                best = first;
+        }
+    }
+    *st = s->streams[best];
+    sc = (*st)->priv_data;
+    dprintf(s, "stream %d, sample %d, dts %"PRId64"\n", best, sc->current_sample, sc->next_dts);
+    return mov_get_sample(*st, sc->current_sample);
+}
+
+/**
+ * Drop the samples that have been read from the indexes of live input,
+ * so that only the fragments not consumed yet are kept in memory.
+ */
+static void mov_live_discard(AVFormatContext *s)
 {
-    AVIndexEntry *sample = NULL;
-    int64_t best_dts = INT64_MAX;
     int i;
+
     for (i = 0; i < s->nb_streams; i++) {
-        AVStream *avst = s->streams[i];
-        MOVStreamContext *msc = avst->priv_data;
-        if (msc->pb && msc->current_sample < avst->nb_index_entries) {
-            AVIndexEntry *current_sample = &avst->index_entries[msc->current_sample];
-            int64_t dts = av_rescale(current_sample->timestamp, AV_TIME_BASE, msc->time_scale);
-            dprintf(s, "stream %d, sample %d, dts %"PRId64"\n", i, msc->current_sample, dts);
-            if (!sample || (url_is_streamed(s->pb) && current_sample->pos < sample->pos) ||
-                (!url_is_streamed(s->pb) &&
-                 ((msc->pb != s->pb && dts < best_dts) || (msc->pb == s->pb &&
-                 ((FFABS(best_dts - dts) <= AV_TIME_BASE && current_sample->pos < sample->pos) ||
-                  (FFABS(best_dts - dts) > AV_TIME_BASE && dts < best_dts)))))) {
-                sample = current_sample;
-                best_dts = dts;
-                *st = avst;
-            }
+        AVStream *st = s->streams[i];
+        MOVStreamContext *sc = st->priv_data;
+        int n = FFMIN(sc->current_sample, st->nb_index_entries);
+
+        if (sc->lazy || st->compact_index || n <= 0)
+            continue;
+        memmove(st->index_entries, st->index_entries + n,
+                (st->nb_index_entries - n) * sizeof(*st->index_entries));
+        st->nb_index_entries -= n;
+        sc->current_sample   -= n;
+        if (sc->ctts_data && sc->ctts_index) {
+            sc->ctts_count -= sc->ctts_index;
+            memmove(sc->ctts_data, sc->ctts_data + sc->ctts_index,
+                    sc->ctts_count * sizeof(*sc->ctts_data));
+            sc->ctts_index = 0;
         }
     }
-    return sample;
+}
+
+/**
+ * Parse the next fragment of live input, one top level atom at a time
+ * up to its mdat, stopping at an atom that has not been written
+ * completely yet. The position of the next atom is kept, so the call
+ * can be repeated once more data is available.
+ * @return 0 on success, AVERROR(EAGAIN) if the fragment is incomplete
+ */
+static int mov_read_live_fragment(AVFormatContext *s)
+{
+    MOVContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int err;
+
+    if (url_is_streamed(pb)) {
+        /* the reads block until the data arrives */
+        mov->found_mdat = 0;
+        err = mov_read_default(mov, pb, (MOVAtom){ 0, INT64_MAX });
+        if (err < 0)
+            return err;
+        return url_feof(pb) ? AVERROR_EOF : 0;
+    }
+
+    mov->found_mdat = 0;
+    while (!mov->found_mdat) {
+        int64_t pos = mov->next_root_atom, fsize = url_fsize(pb), size;
+
+        if (pos + 8 > fsize || url_fseek(pb, pos, SEEK_SET) != pos)
+            return AVERROR(EAGAIN);
+        size = get_be32(pb);
+        get_le32(pb); /* type */
+        if (size == 1) {
+            if (pos + 16 > fsize)
+                return AVERROR(EAGAIN);
+            size = get_be64(pb);
+        } else if (!size) {
+            return AVERROR(EAGAIN); /* still being written */
+        }
+        if (size < 8)
+            return AVERROR_INVALIDDATA;
+        if (pos + size > fsize)
+            return AVERROR(EAGAIN);
+
+        url_fseek(pb, pos, SEEK_SET);
+        if ((err = mov_read_default(mov, pb, (MOVAtom){ 0, size })) < 0)
+            return err;
+        mov->next_root_atom = pos + size;
+    }
+    return 0;
+}
+
+#define MOV_CHUNK_READ_MAX (1 << 20)
+
+/**
+ * Read the sample at sample->pos and the samples of the same stream that
+ * follow it contiguously, up to MOV_CHUNK_READ_MAX bytes, into the chunk
+ * buffer of the stream with a single read, unless the sample is buffered
+ * in sc->pb already.
+ * @param next index of the sample following it in the stream
+ */
+static void mov_read_chunk(AVStream *st, const AVIndexEntry *sample, int next)
+{
+    MOVStreamContext *sc = st->priv_data;
+    ByteIOContext *pb = sc->pb;
+    const AVIndexEntry *e;
+    int64_t end = sample->pos + sample->size;
+    int len;
+
+    if (pb->map || (sample->pos >= pb->pos - (pb->buf_end - pb->buffer) && end <= pb->pos))
+        return;
+    while ((e = mov_get_sample(st, next++)) && e->pos == end &&
+           end + e->size - sample->pos <= MOV_CHUNK_READ_MAX)
+        end += e->size;
+    len = end - sample->pos;
+    if (len == sample->size)
+        return;
+
+    if (len + FF_INPUT_BUFFER_PADDING_SIZE > sc->chunk_buf_size) {
+        uint8_t *buf = av_realloc(sc->chunk_buf, len + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!buf)
+            return;
+        sc->chunk_buf      = buf;
+        sc->chunk_buf_size = len + FF_INPUT_BUFFER_PADDING_SIZE;
+    }
+    sc->chunk_len = 0;
+    if (url_fseek(pb, sample->pos, SEEK_SET) != sample->pos ||
+        (len = get_buffer(pb, sc->chunk_buf, len)) <= 0)
+        return;
+    sc->chunk_pos = sample->pos;
+    sc->chunk_len = len;
+}
+
+/**
+ * Read a sample into pkt, slicing it from the chunk buffer of the stream
+ * when it holds the sample.
+ */
+static int mov_read_sample(AVFormatContext *s, AVStream *st,
+                           const AVIndexEntry *sample, AVPacket *pkt)
+{
+    MOVStreamContext *sc = st->priv_data;
+    int ret;
+
+    if (sample->pos < sc->chunk_pos ||
+        sample->pos + sample->size > sc->chunk_pos + sc->chunk_len)
+        mov_read_chunk(st, sample, sc->current_sample);
+    if (sample->pos >= sc->chunk_pos &&
+        sample->pos + sample->size <= sc->chunk_pos + sc->chunk_len) {
+        if ((ret = ff_new_packet(s, pkt, sample->size)) < 0)
+            return ret;
+        memcpy(pkt->data, sc->chunk_buf + sample->pos - sc->chunk_pos, sample->size);
+        pkt->pos = sample->pos;
+        return sample->size;
+    }
+
+    if (url_fseek(sc->pb, sample->pos, SEEK_SET) != sample->pos) {
+        av_log(s, AV_LOG_ERROR, "stream %d, offset 0x%"PRIx64": partial file\n",
+               sc->ffindex, sample->pos);
+        return -1;
+    }
+    return ff_get_packet_nocopy(s, sc->pb, pkt, sample->size);
 }
 
 static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     MOVContext *mov = s->priv_data;
     MOVStreamContext *sc;
-    AVIndexEntry *sample;
+    const AVIndexEntry *next;
+    AVIndexEntry sample_entry, *sample = &sample_entry;
     AVStream *st = NULL;
     int ret;
  retry:
-    sample = mov_find_next_sample(s, &st);
-    if (!sample) {
+    next = mov_find_next_sample(s, &st);
+    if (!next && mov->live) {
+        mov_live_discard(s);
+        if ((ret = mov_read_live_fragment(s)) < 0)
+            return ret;
+        dprintf(s, "read live fragment, next atom 0x%"PRIx64"\n", mov->next_root_atom);
+        mov->sample_heap_valid = 0;
+        goto retry;
+    } else if (!next) {
         mov->found_mdat = 0;
         if (!url_is_streamed(s->pb) ||
             mov_read_default(mov, s->pb, (MOVAtom){ 0, INT64_MAX }) < 0 ||
             url_feof(s->pb))
             return AVERROR_EOF;
         dprintf(s, "read fragments, offset 0x%llx\n", url_ftell(s->pb));
+        /* fragments add samples to the streams */
+        mov->sample_heap_valid = 0;
         goto retry;
     }
+    /* copy it, looking up the next dts may invalidate a compact index entry */
+    sample_entry = *next;
     sc = st->priv_data;
     /* must be done just before reading, to avoid infinite loop on sample */
     sc->current_sample++;
+    mov_heap_next_sample(s, st->index);
 
     if (st->discard != AVDISCARD_ALL) {
-        if (url_fseek(sc->pb, sample->pos, SEEK_SET) != sample->pos) {
-            av_log(mov->fc, AV_LOG_ERROR, "stream %d, offset 0x%"PRIx64": partial file\n",
-                   sc->ffindex, sample->pos);
-            return -1;
-        }
-        ret = av_get_packet(sc->pb, pkt, sample->size);
+#if CONFIG_DV_DEMUXER
+        if (mov->dv_demux && sc->dv_audio_container) {
+            if (url_fseek(sc->pb, sample->pos, SEEK_SET) != sample->pos) {
+                av_log(mov->fc, AV_LOG_ERROR, "stream %d, offset 0x%"PRIx64": partial file\n",
+                       sc->ffindex, sample->pos);
+                return -1;
+            }
+            ret = av_get_packet(sc->pb, pkt, sample->size);
+        } else
+#endif
+            ret = mov_read_sample(s, st, sample, pkt);
         if (ret < 0)
             return ret;
 #if CONFIG_DV_DEMUXER
@@ -2248,8 +3089,8 @@ static int mov_read_packet(AVFormatContext *s, AVPacket *pkt)
         if (sc->wrong_dts)
             pkt->dts = AV_NOPTS_VALUE;
     } else {
-        int64_t next_dts = (sc->current_sample < st->nb_index_entries) ?
-            st->index_entries[sc->current_sample].timestamp : st->duration;
+        int64_t next_dts = (sc->current_sample < mov_nb_samples(st)) ?
+            mov_get_sample(st, sc->current_sample)->timestamp : st->duration;
         pkt->duration = next_dts - pkt->dts;
         pkt->pts = pkt->dts;
     }
@@ -2268,7 +3109,10 @@ static int mov_seek_stream(AVFormatContext *s, AVStream *st, int64_t timestamp,
     int sample, time_sample;
     int i;
 
-    sample = av_index_search_timestamp(st, timestamp, flags);
+    if (sc->lazy)
+        sample = mov_lazy_search(st, timestamp, flags);
+    else
+        sample = av_index_search_timestamp(st, timestamp, flags);
     dprintf(s, "stream %d, timestamp %"PRId64", sample %d\n", st->index, timestamp, sample);
     if (sample < 0) /* not sure what to do */
         return -1;
@@ -2292,6 +3136,7 @@ static int mov_seek_stream(AVFormatContext *s, AVStream *st, int64_t timestamp,
 
 static int mov_read_seek(AVFormatContext *s, int stream_index, int64_t sample_time, int flags)
 {
+    MOVContext *mov = s->priv_data;
     AVStream *st;
     int64_t seek_timestamp, timestamp;
     int sample;
@@ -2306,9 +3151,10 @@ static int mov_read_seek(AVFormatContext *s, int stream_index, int64_t sample_ti
     sample = mov_seek_stream(s, st, sample_time, flags);
     if (sample < 0)
         return -1;
+    mov->sample_heap_valid = 0;
 
     /* adjust seek timestamp to found sample timestamp */
-    seek_timestamp = st->index_entries[sample].timestamp;
+    seek_timestamp = mov_get_sample(st, sample)->timestamp;
 
     for (i = 0; i < s->nb_streams; i++) {
         st = s->streams[i];
@@ -2331,6 +3177,8 @@ static int mov_read_close(AVFormatContext *s)
         MOVStreamContext *sc = st->priv_data;
 
         av_freep(&sc->ctts_data);
+        av_freep(&sc->chunk_buf);
+        mov_free_sample_tables(sc);
         for (j = 0; j < sc->drefs_count; j++) {
             av_freep(&sc->drefs[j].path);
             av_freep(&sc->drefs[j].dir);
@@ -2352,6 +3200,8 @@ static int mov_read_close(AVFormatContext *s)
     }
 
     av_freep(&mov->trex_data);
+    av_freep(&mov->sample_heap[0]);
+    av_freep(&mov->sample_heap[1]);
 
     return 0;
 }
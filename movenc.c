@@ -44,17 +44,28 @@
 #define MODE_IPOD 0x20
 
 typedef struct MOVIentry {
-    unsigned int size;
     uint64_t     pos;
-    unsigned int samplesInChunk;
-    unsigned int entries;
+    unsigned int size;
     int          cts;
-    int64_t      dts;
+    int32_t      dts;           ///< offset from the dts of the block
+#define MOV_MAX_CHUNK_SAMPLES ((1 << 24) - 1)
+    unsigned int entries:24;    ///< samples in the chunk
 #define MOV_SYNC_SAMPLE         0x0001
 #define MOV_PARTIAL_SYNC_SAMPLE 0x0002
-    uint32_t     flags;
+    unsigned int flags:8;
 } MOVIentry;
 
+/**
+ * Sample entries are stored in blocks of MOV_INDEX_CLUSTER_SIZE that are
+ * never moved, so long recordings neither copy the index nor need twice
+ * its size while it grows.
+ */
+typedef struct MOVIblock {
+    int64_t     dts;            ///< dts of the first entry
+    int64_t     *wide_dts;      ///< full dts of all entries, once one does not fit in an offset
+    MOVIentry   entries[MOV_INDEX_CLUSTER_SIZE];
+} MOVIblock;
+
 typedef struct MOVIndex {
     int         mode;
     int         entry;
@@ -74,9 +85,16 @@ typedef struct MOVIndex {
 
     int         vosLen;
     uint8_t     *vosData;
-    MOVIentry   *cluster;
+    MOVIblock   **blocks;
+    int         nb_blocks;
     int         audio_vbr;
     int         height; ///< active picture (w/o VBI) height for D-10/IMX
+    int64_t     start_dts;      ///< dts of the first packet
+    int64_t     frag_time;      ///< duration of the samples of the previous fragments
+    int         last_duration;  ///< duration of the last packet
+    ByteIOContext *mdat_buf;    ///< payload of the current fragment
+    uint8_t     *nal_buf;       ///< H.264 packet converted from Annex B
+    unsigned int nal_buf_size;
 } MOVTrack;
 
 typedef struct MOVMuxContext {
@@ -86,8 +104,81 @@ typedef struct MOVMuxContext {
     int64_t mdat_pos;
     uint64_t mdat_size;
     MOVTrack *tracks;
+    int     frag_duration;  ///< fragment duration in AV_TIME_BASE, 0 if not fragmented
+    int     frag_track;     ///< track whose keyframes start fragments, -1 for any packet
+    int64_t frag_start;     ///< dts of the first packet of the fragment in AV_TIME_BASE
+    unsigned frag_seq;
+    ByteIOContext *hdr_buf; ///< ftyp of a fragmented file until the moov is written
 } MOVMuxContext;
 
+static inline MOVIentry *mov_entry(MOVTrack *track, int i)
+{
+    return &track->blocks[i / MOV_INDEX_CLUSTER_SIZE]->entries[i % MOV_INDEX_CLUSTER_SIZE];
+}
+
+static int64_t mov_entry_dts(MOVTrack *track, int i)
+{
+    MOVIblock *b = track->blocks[i / MOV_INDEX_CLUSTER_SIZE];
+
+    if (b->wide_dts)
+        return b->wide_dts[i % MOV_INDEX_CLUSTER_SIZE];
+    return b->dts + b->entries[i % MOV_INDEX_CLUSTER_SIZE].dts;
+}
+
+/**
+ * Make room for the next entry of the track and set its dts.
+ * Blocks are kept when a fragment resets the entries, and reused.
+ * @return the new entry, NULL on allocation failure
+ */
+static MOVIentry *mov_add_entry(MOVTrack *track, int64_t dts)
+{
+    int n = track->entry / MOV_INDEX_CLUSTER_SIZE, j = track->entry % MOV_INDEX_CLUSTER_SIZE;
+    MOVIblock *b;
+
+    if (n >= track->nb_blocks) {
+        MOVIblock **blocks;
+        if ((unsigned)n >= INT_MAX / sizeof(*blocks) - 1)
+            return NULL;
+        blocks = av_realloc(track->blocks, (n + 1) * sizeof(*blocks));
+        if (!blocks)
+            return NULL;
+        track->blocks = blocks;
+        if (!(blocks[n] = av_malloc(sizeof(**blocks))))
+            return NULL;
+        blocks[n]->wide_dts = NULL;
+        track->nb_blocks = n + 1;
+    }
+    b = track->blocks[n];
+    if (!j) {
+        b->dts = dts;
+        av_freep(&b->wide_dts);
+    }
+    if (!b->wide_dts && (dts - b->dts < INT32_MIN || dts - b->dts > INT32_MAX)) {
+        int k;
+        if (!(b->wide_dts = av_malloc(MOV_INDEX_CLUSTER_SIZE * sizeof(*b->wide_dts))))
+            return NULL;
+        for (k = 0; k < j; k++)
+            b->wide_dts[k] = b->dts + b->entries[k].dts;
+    }
+    if (b->wide_dts)
+        b->wide_dts[j] = dts;
+    else
+        b->entries[j].dts = dts - b->dts;
+    return &b->entries[j];
+}
+
+static void mov_free_entries(MOVTrack *track)
+{
+    int i;
+
+    for (i=0; i<track->nb_blocks; i++) {
+        av_free(track->blocks[i]->wide_dts);
+        av_free(track->blocks[i]);
+    }
+    av_freep(&track->blocks);
+    track->nb_blocks = 0;
+}
+
 //FIXME support 64 bit variant with wide placeholders
 static int64_t updateSize(ByteIOContext *pb, int64_t pos)
 {
@@ -106,7 +197,8 @@ static int mov_write_stco_tag(ByteIOContext *pb, MOVTrack *track)
     int mode64 = 0; //   use 32 bit size variant if possible
     int64_t pos = url_ftell(pb);
     put_be32(pb, 0); /* size */
-    if (pos > UINT32_MAX) {
+    if (pos > UINT32_MAX ||
+        (track->entry && mov_entry(track, track->entry-1)->pos > UINT32_MAX)) {
         mode64 = 1;
         put_tag(pb, "co64");
     } else
@@ -115,9 +207,9 @@ static int mov_write_stco_tag(ByteIOContext *pb, MOVTrack *track)
     put_be32(pb, track->entry); /* entry count */
     for (i=0; i<track->entry; i++) {
         if(mode64 == 1)
-            put_be64(pb, track->cluster[i].pos);
+            put_be64(pb, mov_entry(track, i)->pos);
         else
-            put_be32(pb, track->cluster[i].pos);
+            put_be32(pb, mov_entry(track, i)->pos);
     }
     return updateSize(pb, pos);
 }
@@ -134,15 +226,19 @@ static int mov_write_stsz_tag(ByteIOContext *pb, MOVTrack *track)
     put_be32(pb, 0); /* version & flags */
 
     for (i=0; i<track->entry; i++) {
-        tst = track->cluster[i].size/track->cluster[i].entries;
+        MOVIentry *e = mov_entry(track, i);
+        tst = e->size/e->entries;
         if(oldtst != -1 && tst != oldtst) {
             equalChunks = 0;
         }
         oldtst = tst;
-        entries += track->cluster[i].entries;
+        entries += e->entries;
     }
-    if (equalChunks) {
-        int sSize = track->cluster[0].size/track->cluster[0].entries;
+    if (equalChunks && !track->entry) {
+        put_be32(pb, 0); // sample size
+        put_be32(pb, 0); // sample count
+    } else if (equalChunks) {
+        int sSize = mov_entry(track, 0)->size/mov_entry(track, 0)->entries;
         put_be32(pb, sSize); // sample size
         put_be32(pb, entries); // sample count
     }
@@ -150,10 +246,9 @@ static int mov_write_stsz_tag(ByteIOContext *pb, MOVTrack *track)
         put_be32(pb, 0); // sample size
         put_be32(pb, entries); // sample count
         for (i=0; i<track->entry; i++) {
-            for (j=0; j<track->cluster[i].entries; j++) {
-                put_be32(pb, track->cluster[i].size /
-                         track->cluster[i].entries);
-            }
+            MOVIentry *e = mov_entry(track, i);
+            for (j=0; j<e->entries; j++)
+                put_be32(pb, e->size / e->entries);
         }
     }
     return updateSize(pb, pos);
@@ -172,12 +267,13 @@ static int mov_write_stsc_tag(ByteIOContext *pb, MOVTrack *track)
     entryPos = url_ftell(pb);
     put_be32(pb, track->entry); // entry count
     for (i=0; i<track->entry; i++) {
-        if(oldval != track->cluster[i].samplesInChunk)
+        int samplesInChunk = mov_entry(track, i)->entries;
+        if(oldval != samplesInChunk)
         {
             put_be32(pb, i+1); // first chunk
-            put_be32(pb, track->cluster[i].samplesInChunk); // samples per chunk
+            put_be32(pb, samplesInChunk); // samples per chunk
             put_be32(pb, 0x1); // sample description index
-            oldval = track->cluster[i].samplesInChunk;
+            oldval = samplesInChunk;
             index++;
         }
     }
@@ -201,7 +297,7 @@ static int mov_write_stss_tag(ByteIOContext *pb, MOVTrack *track, uint32_t flag)
     entryPos = url_ftell(pb);
     put_be32(pb, track->entry); // entry count
     for (i=0; i<track->entry; i++) {
-        if (track->cluster[i].flags & flag) {
+        if (mov_entry(track, i)->flags & flag) {
             put_be32(pb, i+1);
             index++;
         }
@@ -886,13 +982,13 @@ static int mov_write_ctts_tag(ByteIOContext *pb, MOVTrack *track)
 
     ctts_entries = av_malloc((track->entry + 1) * sizeof(*ctts_entries)); /* worst case */
     ctts_entries[0].count = 1;
-    ctts_entries[0].duration = track->cluster[0].cts;
+    ctts_entries[0].duration = mov_entry(track, 0)->cts;
     for (i=1; i<track->entry; i++) {
-        if (track->cluster[i].cts == ctts_entries[entries].duration) {
+        if (mov_entry(track, i)->cts == ctts_entries[entries].duration) {
             ctts_entries[entries].count++; /* compress */
         } else {
             entries++;
-            ctts_entries[entries].duration = track->cluster[i].cts;
+            ctts_entries[entries].duration = mov_entry(track, i)->cts;
             ctts_entries[entries].count = 1;
         }
     }
@@ -927,8 +1023,8 @@ static int mov_write_stts_tag(ByteIOContext *pb, MOVTrack *track)
         stts_entries = av_malloc(track->entry * sizeof(*stts_entries)); /* worst case */
         for (i=0; i<track->entry; i++) {
             int64_t duration = i + 1 == track->entry ?
-                track->trackDuration - track->cluster[i].dts + track->cluster[0].dts : /* readjusting */
-                track->cluster[i+1].dts - track->cluster[i].dts;
+                track->trackDuration - mov_entry_dts(track, i) + mov_entry_dts(track, 0) : /* readjusting */
+                mov_entry_dts(track, i+1) - mov_entry_dts(track, i);
             if (i && duration == stts_entries[entries].duration) {
                 stts_entries[entries].count++; /* compress */
             } else {
@@ -979,7 +1075,7 @@ static int mov_write_stbl_tag(ByteIOContext *pb, MOVTrack *track)
     if (track->mode == MODE_MOV && track->flags & MOV_TRACK_STPS)
         mov_write_stss_tag(pb, track, MOV_PARTIAL_SYNC_SAMPLE);
     if (track->enc->codec_type == CODEC_TYPE_VIDEO &&
-        track->flags & MOV_TRACK_CTTS)
+        track->flags & MOV_TRACK_CTTS && track->entry)
         mov_write_ctts_tag(pb, track);
     mov_write_stsc_tag(pb, track);
     mov_write_stsz_tag(pb, track);
@@ -1212,7 +1308,7 @@ static int mov_write_edts_tag(ByteIOContext *pb, MOVTrack *track)
     put_be32(pb, av_rescale_rnd(track->trackDuration, MOV_TIMESCALE,
                                 track->timescale, AV_ROUND_UP));
 
-    put_be32(pb, track->cluster[0].cts); /* first pts is cts since dts is 0 */
+    put_be32(pb, track->entry ? mov_entry(track, 0)->cts : 0); /* first pts is cts since dts is 0 */
     put_be32(pb, 0x00010000);
     return 0x24;
 }
@@ -1273,7 +1369,7 @@ static int mov_write_mvhd_tag(ByteIOContext *pb, MOVMuxContext *mov)
     int version;
 
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if(mov->tracks[i].entry > 0 || mov->frag_duration) {
             maxTrackLenTemp = av_rescale_rnd(mov->tracks[i].trackDuration,
                                              MOV_TIMESCALE,
                                              mov->tracks[i].timescale,
@@ -1616,6 +1712,25 @@ static int mov_write_uuidusmt_tag(ByteIOContext *pb, AVFormatContext *s)
     return 0;
 }
 
+static int mov_write_mvex_tag(ByteIOContext *pb, MOVMuxContext *mov)
+{
+    int i;
+    int64_t pos = url_ftell(pb);
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "mvex");
+    for (i=0; i<mov->nb_streams; i++) {
+        put_be32(pb, 32); /* size */
+        put_tag(pb, "trex");
+        put_be32(pb, 0); /* version & flags */
+        put_be32(pb, mov->tracks[i].trackID);
+        put_be32(pb, 1); /* default sample description index */
+        put_be32(pb, 0); /* default sample duration */
+        put_be32(pb, 0); /* default sample size */
+        put_be32(pb, 0); /* default sample flags */
+    }
+    return updateSize(pb, pos);
+}
+
 static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
                               AVFormatContext *s)
 {
@@ -1624,8 +1739,9 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     put_be32(pb, 0); /* size placeholder*/
     put_tag(pb, "moov");
 
+    /* the tracks of a fragmented file have their samples in fragments */
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry <= 0) continue;
+        if(mov->tracks[i].entry <= 0 && !mov->frag_duration) continue;
 
         mov->tracks[i].time = mov->time;
         mov->tracks[i].trackID = i+1;
@@ -1634,10 +1750,12 @@ static int mov_write_moov_tag(ByteIOContext *pb, MOVMuxContext *mov,
     mov_write_mvhd_tag(pb, mov);
     //mov_write_iods_tag(pb, mov);
     for (i=0; i<mov->nb_streams; i++) {
-        if(mov->tracks[i].entry > 0) {
+        if(mov->tracks[i].entry > 0 || mov->frag_duration) {
             mov_write_trak_tag(pb, &(mov->tracks[i]), s->streams[i]);
         }
     }
+    if (mov->frag_duration)
+        mov_write_mvex_tag(pb, mov);
 
     if (mov->mode == MODE_PSP)
         mov_write_uuidusmt_tag(pb, s);
@@ -1782,10 +1900,18 @@ static int mov_write_header(AVFormatContext *s)
     MOVMuxContext *mov = s->priv_data;
     int i;
 
-    if (url_is_streamed(s->pb)) {
+    mov->frag_duration = s->fragment_duration;
+    if (url_is_streamed(s->pb) && !mov->frag_duration) {
         av_log(s, AV_LOG_ERROR, "muxer does not support non seekable output\n");
         return -1;
     }
+    /* the ftyp of a fragmented file is kept until the moov can be written,
+       so that nothing needs to be rewritten in the output */
+    if (mov->frag_duration) {
+        if (url_open_dyn_buf(&mov->hdr_buf) < 0)
+            return AVERROR(ENOMEM);
+        pb = mov->hdr_buf;
+    }
 
     /* Default mode == MP4 */
     mov->mode = MODE_MP4;
@@ -1809,7 +1935,9 @@ static int mov_write_header(AVFormatContext *s)
 
     mov->tracks = av_mallocz(s->nb_streams*sizeof(*mov->tracks));
     if (!mov->tracks)
-        return AVERROR(ENOMEM);
+        goto error;
+    mov->frag_track = -1;
+    mov->frag_start = AV_NOPTS_VALUE;
 
     for(i=0; i<s->nb_streams; i++){
         AVStream *st= s->streams[i];
@@ -1817,6 +1945,7 @@ static int mov_write_header(AVFormatContext *s)
         AVMetadataTag *lang = av_metadata_get(st->metadata, "language", NULL,0);
 
         track->enc = st->codec;
+        track->start_dts = AV_NOPTS_VALUE;
         track->language = ff_mov_iso639_to_lang(lang?lang->value:"und", mov->mode!=MODE_MOV);
         if (track->language < 0)
             track->language = 0;
@@ -1838,6 +1967,8 @@ static int mov_write_header(AVFormatContext *s)
                 track->height = track->tag>>24 == 'n' ? 486 : 576;
             }
             track->timescale = st->codec->time_base.den;
+            if (mov->frag_track < 0)
+                mov->frag_track = i;
             if (track->mode == MODE_MOV && track->timescale > 100000)
                 av_log(s, AV_LOG_WARNING,
                        "WARNING codec timebase is very high. If duration is too long,\n"
@@ -1875,14 +2006,22 @@ static int mov_write_header(AVFormatContext *s)
         av_set_pts_info(st, 64, 1, track->timescale);
     }
 
-    mov_write_mdat_tag(pb, mov);
+    if (!mov->frag_duration)
+        mov_write_mdat_tag(pb, mov);
     mov->time = s->timestamp + 0x7C25B080; //1970 based -> 1904 based
     mov->nb_streams = s->nb_streams;
 
-    put_flush_packet(pb);
+    if (!mov->frag_duration)
+        put_flush_packet(pb);
 
     return 0;
  error:
+    if (mov->hdr_buf) {
+        uint8_t *buf;
+        url_close_dyn_buf(mov->hdr_buf, &buf);
+        av_free(buf);
+        mov->hdr_buf = NULL;
+    }
     av_freep(&mov->tracks);
     return -1;
 }
@@ -1908,16 +2047,217 @@ static int mov_parse_mpeg2_frame(AVPacket *pkt, uint32_t *flags)
     return 0;
 }
 
+/**
+ * Write the moov of a fragmented file after the ftyp, once the first
+ * fragment gave the tracks their codec data. Its sample tables are empty.
+ */
+static int mov_write_frag_moov(AVFormatContext *s)
+{
+    MOVMuxContext *mov = s->priv_data;
+    MOVTrack *saved;
+    uint8_t *buf;
+    int i, size;
+
+    saved = av_malloc(mov->nb_streams * sizeof(*saved));
+    if (!saved)
+        return AVERROR(ENOMEM);
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        saved[i] = *track;
+        track->entry         = 0;
+        track->sampleCount   = 0;
+        track->trackDuration = 0;
+        track->hasKeyframes  = 0;
+    }
+    mov_write_moov_tag(mov->hdr_buf, mov, s);
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        track->entry         = saved[i].entry;
+        track->sampleCount   = saved[i].sampleCount;
+        track->trackDuration = saved[i].trackDuration;
+        track->hasKeyframes  = saved[i].hasKeyframes;
+    }
+    av_free(saved);
+
+    size = url_close_dyn_buf(mov->hdr_buf, &buf);
+    mov->hdr_buf = NULL;
+    put_buffer(s->pb, buf, size);
+    av_free(buf);
+    return 0;
+}
+
+#define MOV_TRUN_DATA_OFFSET 0x001
+#define MOV_TRUN_DURATION    0x100
+#define MOV_TRUN_SIZE        0x200
+#define MOV_TRUN_FLAGS       0x400
+#define MOV_TRUN_CTS         0x800
+
+static int mov_write_traf_tag(ByteIOContext *pb, MOVTrack *track,
+                              int64_t *base_pos, uint32_t data_offset)
+{
+    int flags = MOV_TRUN_DATA_OFFSET | MOV_TRUN_DURATION | MOV_TRUN_SIZE | MOV_TRUN_FLAGS;
+    int64_t pos = url_ftell(pb), t = track->frag_time;
+    int i;
+
+    for (i=0; i<track->entry; i++)
+        if (mov_entry(track, i)->cts)
+            flags |= MOV_TRUN_CTS;
+
+    put_be32(pb, 0); /* size */
+    put_tag(pb, "traf");
+
+    put_be32(pb, 24); /* size */
+    put_tag(pb, "tfhd");
+    put_be32(pb, 0x000001); /* version & flags: base data offset present */
+    put_be32(pb, track->trackID);
+    *base_pos = url_ftell(pb);
+    put_be64(pb, 0); /* base data offset, rewritten once the moof size is known */
+
+    /* the decoding time of the fragment, for files starting with a later one */
+    put_be32(pb, 20); /* size */
+    put_tag(pb, "tfdt");
+    put_be32(pb, 0x01000000); /* version 1 & flags */
+    put_be64(pb, track->frag_time);
+
+    put_be32(pb, 20 + track->entry * (flags & MOV_TRUN_CTS ? 16 : 12)); /* size */
+    put_tag(pb, "trun");
+    put_be32(pb, flags); /* version & flags */
+    put_be32(pb, track->entry);
+    put_be32(pb, data_offset);
+    for (i=0; i<track->entry; i++) {
+        MOVIentry *e = mov_entry(track, i);
+        int64_t dts = mov_entry_dts(track, i), end;
+
+        /* the reader adds up the durations, so the first sample makes
+           up for an inexact duration of the last one of the previous
+           fragment */
+        if (i + 1 < track->entry)
+            end = mov_entry_dts(track, i+1) - track->start_dts;
+        else if (track->last_duration > 0)
+            end = dts - track->start_dts + track->last_duration;
+        else
+            end = dts - track->start_dts + (i ? dts - mov_entry_dts(track, i-1) : 0);
+        put_be32(pb, FFMAX(end - t, 0));
+        t = FFMAX(end, t);
+        put_be32(pb, e->size);
+        if (track->enc->codec_type == CODEC_TYPE_VIDEO && !(e->flags & MOV_SYNC_SAMPLE))
+            put_be32(pb, 0x01010000); /* depends on others, difference sample */
+        else
+            put_be32(pb, 0x02000000); /* does not depend on others */
+        if (flags & MOV_TRUN_CTS)
+            put_be32(pb, e->cts);
+    }
+    track->frag_time = t;
+    return updateSize(pb, pos);
+}
+
+/**
+ * Write the packets buffered since the last fragment as a moof and an
+ * mdat holding the payload of each track in turn, writing the moov
+ * first if it was not yet.
+ */
+static int mov_write_fragment(AVFormatContext *s)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *moof;
+    int64_t base_pos[MAX_STREAMS], base, moof_pos;
+    uint64_t mdat_size = 0;
+    uint32_t data_offset = 0;
+    uint8_t *buf;
+    int i, size, nb_trafs = 0, ret;
+
+    for (i=0; i<mov->nb_streams; i++)
+        if (mov->tracks[i].entry)
+            mdat_size += url_ftell(mov->tracks[i].mdat_buf);
+    if (!mdat_size)
+        return 0;
+    if (mov->hdr_buf && (ret = mov_write_frag_moov(s)) < 0)
+        return ret;
+
+    if ((ret = url_open_dyn_buf(&moof)) < 0)
+        return ret;
+    moof_pos = url_ftell(moof);
+    put_be32(moof, 0); /* size */
+    put_tag(moof, "moof");
+    put_be32(moof, 16); /* size */
+    put_tag(moof, "mfhd");
+    put_be32(moof, 0); /* version & flags */
+    put_be32(moof, ++mov->frag_seq);
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->entry)
+            continue;
+        mov_write_traf_tag(moof, track, &base_pos[nb_trafs++], data_offset);
+        data_offset += url_ftell(track->mdat_buf);
+    }
+    updateSize(moof, moof_pos);
+
+    /* the payload follows the moof and the mdat header */
+    base = url_ftell(s->pb) + url_ftell(moof) + (mdat_size + 8 > UINT32_MAX ? 16 : 8);
+    for (i=0; i<nb_trafs; i++) {
+        url_fseek(moof, base_pos[i], SEEK_SET);
+        put_be64(moof, base);
+    }
+    size = url_close_dyn_buf(moof, &buf);
+    put_buffer(s->pb, buf, size);
+    av_free(buf);
+
+    if (mdat_size + 8 > UINT32_MAX) {
+        put_be32(s->pb, 1); /* special value: real atom size will be 64 bit value after tag field */
+        put_tag(s->pb, "mdat");
+        put_be64(s->pb, mdat_size + 16);
+    } else {
+        put_be32(s->pb, mdat_size + 8);
+        put_tag(s->pb, "mdat");
+    }
+    for (i=0; i<mov->nb_streams; i++) {
+        MOVTrack *track = &mov->tracks[i];
+        if (!track->mdat_buf)
+            continue;
+        size = url_close_dyn_buf(track->mdat_buf, &buf);
+        track->mdat_buf = NULL;
+        put_buffer(s->pb, buf, size);
+        av_free(buf);
+        track->entry = 0;
+    }
+    mov->frag_start = AV_NOPTS_VALUE;
+    put_flush_packet(s->pb);
+    return 0;
+}
+
+int ff_mov_switch_output(AVFormatContext *s, ByteIOContext *pb)
+{
+    MOVMuxContext *mov = s->priv_data;
+    int ret;
+
+    if (!mov->frag_duration)
+        return AVERROR(EINVAL);
+    if ((ret = mov_write_fragment(s)) < 0)
+        return ret;
+    s->pb = pb;
+    /* the moov is still to be written if no fragment was */
+    if (mov->hdr_buf)
+        return 0;
+    if (url_open_dyn_buf(&mov->hdr_buf) < 0)
+        return AVERROR(ENOMEM);
+    mov_write_ftyp_tag(mov->hdr_buf, s);
+    if (mov->mode == MODE_PSP)
+        mov_write_uuidprof_tag(mov->hdr_buf, s);
+    return 0;
+}
+
 static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
 {
     MOVMuxContext *mov = s->priv_data;
     ByteIOContext *pb = s->pb;
     MOVTrack *trk = &mov->tracks[pkt->stream_index];
     AVCodecContext *enc = trk->enc;
+    MOVIentry *e;
     unsigned int samplesInChunk = 0;
+    uint32_t flags = 0;
     int size= pkt->size;
 
-    if (url_is_streamed(s->pb)) return 0; /* Can't handle that */
+    if (url_is_streamed(s->pb) && !mov->frag_duration) return 0; /* Can't handle that */
     if (!size) return 0; /* Discard 0 sized packets */
 
     if (enc->codec_id == CODEC_ID_AMR_NB) {
@@ -1938,6 +2278,28 @@ static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
         samplesInChunk = size/trk->sampleSize;
     else
         samplesInChunk = 1;
+    if (samplesInChunk > MOV_MAX_CHUNK_SAMPLES) {
+        av_log(s, AV_LOG_ERROR, "too many samples in one packet\n");
+        return AVERROR(EINVAL);
+    }
+
+    if (mov->frag_duration) {
+        int64_t dts = av_rescale_q(pkt->dts, s->streams[pkt->stream_index]->time_base,
+                                   AV_TIME_BASE_Q);
+        int ret;
+
+        /* start a new fragment at a keyframe of the first video track */
+        if (mov->frag_start != AV_NOPTS_VALUE && dts - mov->frag_start >= mov->frag_duration &&
+            (mov->frag_track < 0 ||
+             (pkt->stream_index == mov->frag_track && pkt->flags & PKT_FLAG_KEY)) &&
+            (ret = mov_write_fragment(s)) < 0)
+            return ret;
+        if (mov->frag_start == AV_NOPTS_VALUE)
+            mov->frag_start = dts;
+        if (!trk->mdat_buf && (ret = url_open_dyn_buf(&trk->mdat_buf)) < 0)
+            return ret;
+        pb = trk->mdat_buf;
+    }
 
     /* copy extradata if it exists */
     if (trk->vosLen == 0 && enc->extradata_size > 0) {
@@ -1949,7 +2311,10 @@ static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
     if (enc->codec_id == CODEC_ID_H264 && trk->vosLen > 0 && *(uint8_t *)trk->vosData != 1) {
         /* from x264 or from bytestream h264 */
         /* nal reformating needed */
-        size = ff_avc_parse_nal_units(pb, pkt->data, pkt->size);
+        size = ff_avc_convert_nal_units(pkt->data, pkt->size, &trk->nal_buf, &trk->nal_buf_size);
+        if (size < 0)
+            return size;
+        put_buffer(pb, trk->nal_buf, size);
     } else {
         put_buffer(pb, pkt->data, size);
     }
@@ -1964,18 +2329,15 @@ static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
         memcpy(trk->vosData, pkt->data, size);
     }
 
-    if (!(trk->entry % MOV_INDEX_CLUSTER_SIZE)) {
-        trk->cluster = av_realloc(trk->cluster, (trk->entry + MOV_INDEX_CLUSTER_SIZE) * sizeof(*trk->cluster));
-        if (!trk->cluster)
-            return -1;
-    }
-
-    trk->cluster[trk->entry].pos = url_ftell(pb) - size;
-    trk->cluster[trk->entry].samplesInChunk = samplesInChunk;
-    trk->cluster[trk->entry].size = size;
-    trk->cluster[trk->entry].entries = samplesInChunk;
-    trk->cluster[trk->entry].dts = pkt->dts;
-    trk->trackDuration = pkt->dts - trk->cluster[0].dts + pkt->duration;
+    if (!(e = mov_add_entry(trk, pkt->dts)))
+        return AVERROR(ENOMEM);
+    e->pos = url_ftell(pb) - size;
+    e->size = size;
+    e->entries = samplesInChunk;
+    if (trk->start_dts == AV_NOPTS_VALUE)
+        trk->start_dts = pkt->dts;
+    trk->trackDuration = pkt->dts - trk->start_dts + pkt->duration;
+    trk->last_duration = pkt->duration;
 
     if (pkt->pts == AV_NOPTS_VALUE) {
         av_log(s, AV_LOG_WARNING, "pts has no value\n");
@@ -1983,24 +2345,122 @@ static int mov_write_packet(AVFormatContext *s, AVPacket *pkt)
     }
     if (pkt->dts != pkt->pts)
         trk->flags |= MOV_TRACK_CTTS;
-    trk->cluster[trk->entry].cts = pkt->pts - pkt->dts;
-    trk->cluster[trk->entry].flags = 0;
+    e->cts = pkt->pts - pkt->dts;
     if (pkt->flags & PKT_FLAG_KEY) {
         if (mov->mode == MODE_MOV && enc->codec_id == CODEC_ID_MPEG2VIDEO) {
-            mov_parse_mpeg2_frame(pkt, &trk->cluster[trk->entry].flags);
-            if (trk->cluster[trk->entry].flags & MOV_PARTIAL_SYNC_SAMPLE)
+            mov_parse_mpeg2_frame(pkt, &flags);
+            if (flags & MOV_PARTIAL_SYNC_SAMPLE)
                 trk->flags |= MOV_TRACK_STPS;
         } else {
-            trk->cluster[trk->entry].flags = MOV_SYNC_SAMPLE;
+            flags = MOV_SYNC_SAMPLE;
         }
-        if (trk->cluster[trk->entry].flags & MOV_SYNC_SAMPLE)
+        if (flags & MOV_SYNC_SAMPLE)
             trk->hasKeyframes++;
     }
+    e->flags = flags;
     trk->entry++;
     trk->sampleCount += samplesInChunk;
     mov->mdat_size += size;
 
-    put_flush_packet(pb);
+    if (!mov->frag_duration)
+        put_flush_packet(pb);
+    return 0;
+}
+
+static void mov_shift_chunks(MOVMuxContext *mov, int64_t shift)
+{
+    int i, j;
+
+    for (i=0; i<mov->nb_streams; i++)
+        for (j=0; j<mov->tracks[i].entry; j++)
+            mov_entry(&mov->tracks[i], j)->pos += shift;
+}
+
+#define MOV_FASTSTART_BLOCK (1 << 20)
+
+/**
+ * Write the moov in front of the mdat, moving the data after the ftyp
+ * towards the end of the file by the size of the moov and adjusting the
+ * chunk offsets. The data is moved in large blocks from the end, reading
+ * it back through a second handle on the output file.
+ * @param moov_pos end of the mdat
+ * @return 0 on success, 1 if the moov has to be written at the end
+ *         instead as nothing could be moved, <0 on error
+ */
+static int mov_write_faststart(AVFormatContext *s, int64_t moov_pos)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *pb = s->pb, *read_pb, *moov_buf;
+    int64_t start = mov->mdat_pos - 8, shift = 0, pos;
+    uint8_t *moov = NULL, *buf;
+    int size, ret = 1;
+
+    if (url_fopen(&read_pb, s->filename, URL_RDONLY) < 0) {
+        av_log(s, AV_LOG_WARNING, "cannot read back %s, moov is written at the end\n",
+               s->filename);
+        return 1;
+    }
+    buf = av_malloc(MOV_FASTSTART_BLOCK);
+    if (!buf)
+        goto end;
+
+    /* the moov grows if the shifted offsets need co64, iterate */
+    for (;;) {
+        if (url_open_dyn_buf(&moov_buf) < 0) {
+            mov_shift_chunks(mov, -shift);
+            goto end;
+        }
+        mov_write_moov_tag(moov_buf, mov, s);
+        size = url_close_dyn_buf(moov_buf, &moov);
+        if (size == shift)
+            break;
+        av_freep(&moov);
+        mov_shift_chunks(mov, size - shift);
+        shift = size;
+    }
+
+    pos = moov_pos;
+    while (pos > start) {
+        int n = FFMIN(MOV_FASTSTART_BLOCK, pos - start);
+        pos -= n;
+        url_fseek(read_pb, pos, SEEK_SET);
+        if (get_buffer(read_pb, buf, n) != n) {
+            av_log(s, AV_LOG_ERROR, "error reading back %s at offset %"PRId64"\n",
+                   s->filename, pos);
+            ret = AVERROR(EIO);
+            goto end;
+        }
+        url_fseek(pb, pos + shift, SEEK_SET);
+        put_buffer(pb, buf, n);
+    }
+    url_fseek(pb, start, SEEK_SET);
+    put_buffer(pb, moov, size);
+    url_fseek(pb, moov_pos + shift, SEEK_SET);
+    ret = 0;
+ end:
+    av_free(moov);
+    av_free(buf);
+    url_fclose(read_pb);
+    return ret;
+}
+
+/**
+ * Write the moov through a dynamic buffer: the size updates of its atoms
+ * seek in memory, and the output gets the whole moov in a single write.
+ */
+static int mov_write_moov_buffered(AVFormatContext *s)
+{
+    MOVMuxContext *mov = s->priv_data;
+    ByteIOContext *moov_buf;
+    uint8_t *moov;
+    int size;
+
+    if (url_open_dyn_buf(&moov_buf) < 0)
+        return AVERROR(ENOMEM);
+    mov_write_moov_tag(moov_buf, mov, s);
+    size = url_close_dyn_buf(moov_buf, &moov);
+    put_buffer(s->pb, moov, size);
+    av_free(moov);
     return 0;
 }
 
@@ -2013,6 +2473,14 @@ static int mov_write_trailer(AVFormatContext *s)
 
     int64_t moov_pos = url_ftell(pb);
 
+    if (mov->frag_duration) {
+        res = mov_write_fragment(s);
+        /* no packets at all, still write a valid header */
+        if (res >= 0 && mov->hdr_buf)
+            res = mov_write_frag_moov(s);
+        goto end;
+    }
+
     /* Write size of mdat tag */
     if (mov->mdat_size+8 <= UINT32_MAX) {
         url_fseek(pb, mov->mdat_pos, SEEK_SET);
@@ -2026,15 +2494,31 @@ static int mov_write_trailer(AVFormatContext *s)
     }
     url_fseek(pb, moov_pos, SEEK_SET);
 
-    mov_write_moov_tag(pb, mov, s);
+    if (!(s->flags & AVFMT_FLAG_FASTSTART) ||
+        (res = mov_write_faststart(s, moov_pos)) > 0)
+        res = mov_write_moov_buffered(s);
 
+ end:
     for (i=0; i<mov->nb_streams; i++) {
-        av_freep(&mov->tracks[i].cluster);
+        mov_free_entries(&mov->tracks[i]);
+        av_freep(&mov->tracks[i].nal_buf);
+        if (mov->tracks[i].mdat_buf) {
+            uint8_t *buf;
+            url_close_dyn_buf(mov->tracks[i].mdat_buf, &buf);
+            av_free(buf);
+        }
 
         if(mov->tracks[i].vosLen) av_free(mov->tracks[i].vosData);
 
     }
 
+    if (mov->hdr_buf) {
+        uint8_t *buf;
+        url_close_dyn_buf(mov->hdr_buf, &buf);
+        av_free(buf);
+        mov->hdr_buf = NULL;
+    }
+
     put_flush_packet(pb);
 
     av_freep(&mov->tracks);
@@ -30,9 +30,22 @@
 
 #include "libavcodec/mpegaudio.h"
 #include "libavcodec/mpegaudiodecheader.h"
+#include "internal.h"
 
 /* mp3 read */
 
+#define XING_FLAG_FRAMES 0x01
+#define XING_FLAG_SIZE   0x02
+#define XING_FLAG_TOC    0x04
+#define XING_TOC_SIZE    100
+
+#define MP3_SYNC_WINDOW 4096 ///< bytes searched for a frame after a TOC position
+
+typedef struct {
+    int has_toc;        ///< index was built from a Xing or VBRI table
+    int sample_rate;    ///< of the VBR tag frame, which the other frames share
+} MP3DecContext;
+
 static int mp3_read_probe(AVProbeData *p)
 {
     int max_frames, first_frames = 0;
@@ -78,13 +91,73 @@ static int mp3_read_probe(AVProbeData *p)
 /**
  * Try to find Xing/Info/VBRI tags and compute duration from info therein
  */
+/**
+ * Add the 100 entry Xing TOC to the index, each entry giving the position
+ * of a percentile of the duration in 1/256th of the file size.
+ */
+static void mp3_parse_xing_toc(AVFormatContext *s, AVStream *st, int64_t base,
+                               int64_t size, const uint8_t *toc)
+{
+    MP3DecContext *mp3 = s->priv_data;
+    int64_t pos, last_pos = -1;
+    int i;
+
+    if (size <= 0 && (size = url_fsize(s->pb) - base) <= 0)
+        return;
+    for (i = 0; i < XING_TOC_SIZE; i++) {
+        pos = base + toc[i] * size / 256;
+        if (pos <= last_pos)
+            continue;
+        av_add_index_entry(st, pos, av_rescale(st->duration, i, XING_TOC_SIZE),
+                           0, 0, AVINDEX_KEYFRAME);
+        last_pos = pos;
+    }
+    mp3->has_toc = 1;
+}
+
+/**
+ * Add the VBRI seek table to the index, each entry giving the size in
+ * bytes of a fixed number of frames.
+ */
+static void mp3_parse_vbri_toc(AVFormatContext *s, AVStream *st, int64_t pos,
+                               const MPADecodeHeader *c)
+{
+    MP3DecContext *mp3 = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int entries     = get_be16(pb);
+    int scale       = get_be16(pb);
+    int entry_size  = get_be16(pb);
+    int frames_per_entry = get_be16(pb);
+    int spf = c->lsf ? 576 : 1152;
+    int i, j;
+
+    if (!entries || !frames_per_entry || entry_size < 1 || entry_size > 4)
+        return;
+    for (i = 0; i < entries && !url_feof(pb); i++) {
+        unsigned v = 0;
+
+        av_add_index_entry(st, pos, av_rescale_q((int64_t)i * frames_per_entry,
+                                                 (AVRational){spf, c->sample_rate},
+                                                 st->time_base),
+                           0, 0, AVINDEX_KEYFRAME);
+        for (j = 0; j < entry_size; j++)
+            v = v << 8 | get_byte(pb);
+        pos += (int64_t)v * scale;
+    }
+    mp3->has_toc = 1;
+}
+
 static int mp3_parse_vbr_tags(AVFormatContext *s, AVStream *st, int64_t base)
 {
+    MP3DecContext *mp3 = s->priv_data;
     uint32_t v, spf;
     int frames = -1; /* Total number of frames in file */
     const int64_t xing_offtbl[2][2] = {{32, 17}, {17,9}};
     MPADecodeHeader c;
     int vbrtag_size = 0;
+    int xing_flags = 0;
+    int64_t xing_size = 0;
+    uint8_t xing_toc[XING_TOC_SIZE];
 
     v = get_be32(s->pb);
     if(ff_mpa_check_header(v) < 0)
@@ -94,14 +167,19 @@ static int mp3_parse_vbr_tags(AVFormatContext *s, AVStream *st, int64_t base)
         vbrtag_size = c.frame_size;
     if(c.layer != 3)
         return -1;
+    mp3->sample_rate = c.sample_rate;
 
     /* Check for Xing / Info tag */
     url_fseek(s->pb, xing_offtbl[c.lsf == 1][c.nb_channels == 1], SEEK_CUR);
     v = get_be32(s->pb);
     if(v == MKBETAG('X', 'i', 'n', 'g') || v == MKBETAG('I', 'n', 'f', 'o')) {
-        v = get_be32(s->pb);
-        if(v & 0x1)
+        xing_flags = get_be32(s->pb);
+        if(xing_flags & XING_FLAG_FRAMES)
             frames = get_be32(s->pb);
+        if(xing_flags & XING_FLAG_SIZE)
+            xing_size = get_be32(s->pb);
+        if(xing_flags & XING_FLAG_TOC)
+            get_buffer(s->pb, xing_toc, XING_TOC_SIZE);
     }
 
     /* Check for VBRI tag (always 32 bytes after end of mpegaudio header) */
@@ -113,6 +191,9 @@ static int mp3_parse_vbr_tags(AVFormatContext *s, AVStream *st, int64_t base)
             /* skip delay, quality and total bytes */
             url_fseek(s->pb, 8, SEEK_CUR);
             frames = get_be32(s->pb);
+            if(frames >= 0 && !url_is_streamed(s->pb))
+                mp3_parse_vbri_toc(s, st, base + vbrtag_size, &c);
+            xing_flags = 0;
         }
     }
 
@@ -125,6 +206,8 @@ static int mp3_parse_vbr_tags(AVFormatContext *s, AVStream *st, int64_t base)
     spf = c.lsf ? 576 : 1152; /* Samples per frame, layer 3 */
     st->duration = av_rescale_q(frames, (AVRational){spf, c.sample_rate},
                                 st->time_base);
+    if ((xing_flags & XING_FLAG_TOC) && !url_is_streamed(s->pb))
+        mp3_parse_xing_toc(s, st, base, xing_size, xing_toc);
     return 0;
 }
 
@@ -147,8 +230,7 @@ static int mp3_read_header(AVFormatContext *s,
     av_set_pts_info(st, 64, 1, 14112000);
 
     ff_id3v2_read(s);
-    if (!av_metadata_get(s->metadata, "", NULL, AV_METADATA_IGNORE_SUFFIX))
-        ff_id3v1_read(s);
+    ff_read_tail_tags(s, ff_id3v1_read_fallback);
 
     off = url_ftell(s->pb);
     if (mp3_parse_vbr_tags(s, st, off) < 0)
@@ -160,6 +242,59 @@ static int mp3_read_header(AVFormatContext *s,
 
 #define MP3_PACKET_SIZE 1024
 
+/**
+ * Check for a frame header at p that is followed by another one, if the
+ * next frame starts before end.
+ */
+static int mp3_check_sync(const uint8_t *p, const uint8_t *end, int sample_rate)
+{
+    MPADecodeHeader c;
+    uint32_t v = AV_RB32(p);
+
+    if (ff_mpa_check_header(v) < 0 || ff_mpegaudio_decode_header(&c, v) ||
+        c.sample_rate != sample_rate)
+        return 0;
+    p += c.frame_size;
+    if (p + 4 > end)
+        return 1;
+    v = AV_RB32(p);
+    return ff_mpa_check_header(v) >= 0 && !ff_mpegaudio_decode_header(&c, v) &&
+           c.sample_rate == sample_rate;
+}
+
+static int mp3_read_seek(AVFormatContext *s, int stream_index,
+                         int64_t timestamp, int flags)
+{
+    MP3DecContext *mp3 = s->priv_data;
+    AVStream *st = s->streams[0];
+    const AVIndexEntry *ie;
+    const uint8_t *buf;
+    int64_t ts;
+    int index, len, i;
+
+    if (!mp3->has_toc)
+        return -1;
+    index = av_index_search_timestamp(st, timestamp, flags);
+    if (index < 0)
+        index = av_index_search_timestamp(st, timestamp, flags ^ AVSEEK_FLAG_BACKWARD);
+    if (index < 0 || !(ie = ff_index_get_entry(st, index)))
+        return -1;
+    ts = ie->timestamp;
+    if (url_fseek(s->pb, ie->pos, SEEK_SET) < 0)
+        return -1;
+
+    /* the table positions are approximate, start at the next frame */
+    len = url_fpeek(s->pb, &buf, MP3_SYNC_WINDOW);
+    for (i = 0; i + 4 <= len; i++)
+        if (mp3_check_sync(buf + i, buf + len, mp3->sample_rate))
+            break;
+    if (i + 4 <= len)
+        url_fskip(s->pb, i);
+
+    av_update_cur_dts(s, st, ts);
+    return 0;
+}
+
 static int mp3_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     int ret, size;
@@ -182,10 +317,12 @@ static int mp3_read_packet(AVFormatContext *s, AVPacket *pkt)
 AVInputFormat mp3_demuxer = {
     "mp3",
     NULL_IF_CONFIG_SMALL("MPEG audio layer 2/3"),
-    0,
+    sizeof(MP3DecContext),
     mp3_read_probe,
     mp3_read_header,
     mp3_read_packet,
+    NULL,
+    mp3_read_seek,
     .flags= AVFMT_GENERIC_INDEX,
     .extensions = "mp2,mp3,m2a", /* XXX: use probe */
     .metadata_conv = ff_id3v2_metadata_conv,
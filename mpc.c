@@ -21,6 +21,7 @@
 
 #include "libavcodec/get_bits.h"
 #include "avformat.h"
+#include "internal.h"
 #include "id3v2.h"
 #include "apetag.h"
 
@@ -119,11 +120,7 @@ static int mpc_read_header(AVFormatContext *s, AVFormatParameters *ap)
     st->duration = c->fcount;
 
     /* try to read APE tags */
-    if (!url_is_streamed(s->pb)) {
-        int64_t pos = url_ftell(s->pb);
-        ff_ape_parse_tag(s);
-        url_fseek(s->pb, pos, SEEK_SET);
-    }
+    ff_read_tail_tags(s, ff_ape_parse_tag);
 
     return 0;
 }
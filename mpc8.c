@@ -22,6 +22,7 @@
 #include "libavcodec/get_bits.h"
 #include "libavcodec/unary.h"
 #include "avformat.h"
+#include "internal.h"
 
 /// Two-byte MPC tag
 #define MKMPCTAG(a, b) (a | (b << 8))
@@ -49,6 +50,7 @@ typedef struct {
     int frame;
     int64_t header_pos;
     int64_t samples;
+    int64_t seektable_pos;  ///< seek table not read yet, 0 if none
 } MPCContext;
 
 static inline int64_t bs_get_v(uint8_t **bs)
@@ -126,18 +128,23 @@ static void mpc8_get_chunk_header(ByteIOContext *pb, int *tag, int64_t *size)
     *size -= url_ftell(pb) - pos;
 }
 
+/**
+ * Read the seek table found at open by its offset, it is only needed to
+ * seek and reading it at open would cost two seeks.
+ */
 static void mpc8_parse_seektable(AVFormatContext *s, int64_t off)
 {
     MPCContext *c = s->priv_data;
     int tag;
     int64_t size, pos, ppos[2];
     uint8_t *buf;
+    AVIndexEntry *entries;
     int i, t, seekd;
     GetBitContext gb;
 
     url_fseek(s->pb, off, SEEK_SET);
     mpc8_get_chunk_header(s->pb, &tag, &size);
-    if(tag != TAG_SEEKTABLE){
+    if(tag != TAG_SEEKTABLE || size <= 0 || size > INT_MAX / 8){
         av_log(s, AV_LOG_ERROR, "No seek table at given position\n");
         return;
     }
@@ -146,26 +153,36 @@ static void mpc8_parse_seektable(AVFormatContext *s, int64_t off)
     get_buffer(s->pb, buf, size);
     init_get_bits(&gb, buf, size * 8);
     size = gb_get_v(&gb);
-    if(size > UINT_MAX/4 || size > c->samples/1152){
+    if(size < 2 || size > UINT_MAX/4 || size > c->samples/1152 ||
+       !(entries = av_malloc(size * sizeof(*entries)))){
         av_log(s, AV_LOG_ERROR, "Seek table is too big\n");
+        av_free(buf);
         return;
     }
     seekd = get_bits(&gb, 4);
-    for(i = 0; i < 2; i++){
-        pos = gb_get_v(&gb) + c->header_pos;
-        ppos[1 - i] = pos;
-        av_add_index_entry(s->streams[0], pos, i, 0, 0, AVINDEX_KEYFRAME);
-    }
-    for(; i < size; i++){
-        t = get_unary(&gb, 1, 33) << 12;
-        t += get_bits(&gb, 12);
-        if(t & 1)
-            t = -(t & ~1);
-        pos = (t >> 1) + ppos[0]*2 - ppos[1];
-        av_add_index_entry(s->streams[0], pos, i << seekd, 0, 0, AVINDEX_KEYFRAME);
-        ppos[1] = ppos[0];
-        ppos[0] = pos;
+    /* decoded into one array added to the index at once */
+    for(i = 0; i < size; i++){
+        if(i < 2){
+            pos = gb_get_v(&gb) + c->header_pos;
+            ppos[1 - i] = pos;
+            entries[i].timestamp = i;
+        }else{
+            t = get_unary(&gb, 1, 33) << 12;
+            t += get_bits(&gb, 12);
+            if(t & 1)
+                t = -(t & ~1);
+            pos = (t >> 1) + ppos[0]*2 - ppos[1];
+            ppos[1] = ppos[0];
+            ppos[0] = pos;
+            entries[i].timestamp = i << seekd;
+        }
+        entries[i].pos          = pos;
+        entries[i].flags        = AVINDEX_KEYFRAME;
+        entries[i].size         = 0;
+        entries[i].min_distance = 0;
     }
+    ff_add_index_entries(s->streams[0], entries, size);
+    av_free(entries);
     av_free(buf);
 }
 
@@ -178,7 +195,9 @@ static void mpc8_handle_chunk(AVFormatContext *s, int tag, int64_t chunk_pos, in
     case TAG_SEEKTBLOFF:
         pos = url_ftell(pb) + size;
         off = ff_get_v(pb);
-        mpc8_parse_seektable(s, chunk_pos + off);
+        /* read by the first seek */
+        if (s->nb_streams && !ff_index_nb_entries(s->streams[0]))
+            ((MPCContext *)s->priv_data)->seektable_pos = chunk_pos + off;
         url_fseek(pb, pos, SEEK_SET);
         break;
     default:
@@ -270,8 +289,13 @@ static int mpc8_read_seek(AVFormatContext *s, int stream_index, int64_t timestam
 {
     AVStream *st = s->streams[stream_index];
     MPCContext *c = s->priv_data;
-    int index = av_index_search_timestamp(st, timestamp, flags);
+    int index;
 
+    if (c->seektable_pos) {
+        mpc8_parse_seektable(s, c->seektable_pos);
+        c->seektable_pos = 0;
+    }
+    index = av_index_search_timestamp(st, timestamp, flags);
     if(index < 0) return -1;
     url_fseek(s->pb, st->index_entries[index].pos, SEEK_SET);
     c->frame = st->index_entries[index].timestamp;
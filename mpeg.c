@@ -19,7 +19,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include "libavutil/intreadwrite.h"
 #include "avformat.h"
+#include "internal.h"
 #include "mpeg.h"
 
 //#define DEBUG_SEEK
@@ -32,6 +34,10 @@
 
 #define MAX_SYNC_SIZE 100000
 
+/** largest distance in seconds between index entries around a seek target
+    for mpegps_read_seek() to use them without the binary search */
+#define MAX_INDEX_GAP 1
+
 static int check_pes(uint8_t *p, uint8_t *end){
     int pes1;
     int pes2=      (p[3] & 0xC0) == 0x80
@@ -129,31 +135,65 @@ static int64_t get_pts(ByteIOContext *pb, int c)
     return ff_parse_pes_pts(buf);
 }
 
+/**
+ * Scans [p, end) for 00 00 01 xx, skipping up to 3 bytes at a time.
+ * @param state the last 4 bytes seen, updated
+ * @return the position after xx, or end if there is no start code
+ */
+static const uint8_t *find_start_code(const uint8_t *p, const uint8_t *end,
+                                      uint32_t *state)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        uint32_t tmp = *state << 8;
+        *state = tmp + *(p++);
+        if (tmp == 0x100 || p == end)
+            return p;
+    }
+    while (p < end) {
+        if      (p[-1] > 1)             p += 3;
+        else if (p[-2])                 p += 2;
+        else if (p[-3] | (p[-1] - 1))   p++;
+        else {
+            p++;
+            break;
+        }
+    }
+    p = FFMIN(p, end) - 4;
+    *state = AV_RB32(p);
+    return p + 4;
+}
+
 static int find_next_start_code(ByteIOContext *pb, int *size_ptr,
                                 int32_t *header_state)
 {
-    unsigned int state, v;
-    int val, n;
+    uint32_t state = *header_state & 0xffffff;
+    int n = *size_ptr, len;
 
-    state = *header_state;
-    n = *size_ptr;
     while (n > 0) {
-        if (url_feof(pb))
-            break;
-        v = get_byte(pb);
-        n--;
-        if (state == 0x000001) {
-            state = ((state << 8) | v) & 0xffffff;
-            val = state;
-            goto found;
+        if (pb->buf_ptr >= pb->buf_end) {
+            /* let get_byte() refill the buffer */
+            if (url_feof(pb))
+                break;
+            state = state << 8 | get_byte(pb);
+            n--;
+        } else {
+            len = find_start_code(pb->buf_ptr,
+                                  pb->buf_ptr + FFMIN(n, pb->buf_end - pb->buf_ptr),
+                                  &state) - pb->buf_ptr;
+            pb->buf_ptr += len;
+            n -= len;
+        }
+        if ((state & 0xffffff00) == 0x100) {
+            *header_state = state & 0xffffff;
+            *size_ptr = n;
+            return state & 0xffffff;
         }
-        state = ((state << 8) | v) & 0xffffff;
     }
-    val = -1;
- found:
-    *header_state = state;
+    *header_state = state & 0xffffff;
     *size_ptr = n;
-    return val;
+    return -1;
 }
 
 #if 0 /* unused, remove? */
@@ -237,6 +277,7 @@ static int mpegps_read_pes_header(AVFormatContext *s,
     int pes_ext, ext2_len, id_ext, skip;
     int64_t pts, dts;
     int64_t last_sync= url_ftell(s->pb);
+    int64_t pack_pos = -1, index_pos;
 
  error_redo:
         url_fseek(s->pb, last_sync, SEEK_SET);
@@ -249,8 +290,10 @@ static int mpegps_read_pes_header(AVFormatContext *s,
     //printf("startcode=%x pos=0x%"PRIx64"\n", startcode, url_ftell(s->pb));
     if (startcode < 0)
         return AVERROR(EIO);
-    if (startcode == PACK_START_CODE)
+    if (startcode == PACK_START_CODE) {
+        pack_pos = last_sync - 4;
         goto redo;
+    }
     if (startcode == SYSTEM_HEADER_START_CODE)
         goto redo;
     if (startcode == PADDING_STREAM) {
@@ -287,6 +330,9 @@ static int mpegps_read_pes_header(AVFormatContext *s,
     if (ppos) {
         *ppos = url_ftell(s->pb) - 4;
     }
+    /* index the pack of the first PES after it, so that seeking lands on
+       the SCR in front of the data */
+    index_pos = pack_pos >= 0 ? pack_pos : url_ftell(s->pb) - 4;
     len = get_be16(s->pb);
     pts =
     dts = AV_NOPTS_VALUE;
@@ -394,7 +440,7 @@ static int mpegps_read_pes_header(AVFormatContext *s,
             if(startcode == s->streams[i]->id &&
                !url_is_streamed(s->pb) /* index useless on streams anyway */) {
                 ff_reduce_index(s, i);
-                av_add_index_entry(s->streams[i], *ppos, dts, 0, 0, AVINDEX_KEYFRAME /* FIXME keyframe? */);
+                av_add_index_entry(s->streams[i], index_pos, dts, 0, 0, AVINDEX_KEYFRAME /* FIXME keyframe? */);
             }
         }
     }
@@ -553,7 +599,8 @@ static int mpegps_read_packet(AVFormatContext *s,
         else if (st->codec->bits_per_coded_sample == 28)
             return AVERROR(EINVAL);
     }
-    av_new_packet(pkt, len);
+    if (ff_new_packet(s, pkt, len) < 0)
+        return AVERROR(ENOMEM);
     get_buffer(s->pb, pkt->data, pkt->size);
     pkt->pts = pts;
     pkt->dts = dts;
@@ -600,6 +647,40 @@ static int64_t mpegps_read_dts(AVFormatContext *s, int stream_index,
     return dts;
 }
 
+/**
+ * Seeks with the index built while reading and bisecting, when it has
+ * entries close to each other on both sides of the target. Elsewhere the
+ * binary search over mpegps_read_dts() is used, which adds to the index.
+ */
+static int mpegps_read_seek(AVFormatContext *s, int stream_index,
+                            int64_t timestamp, int flags)
+{
+    AVStream *st = s->streams[stream_index];
+    const AVIndexEntry *e, *next;
+    int index, nb_entries = ff_index_nb_entries(st);
+
+    index = av_index_search_timestamp(st, timestamp, flags & AVSEEK_FLAG_BACKWARD);
+    if (index < 0)
+        return -1;
+    if (flags & AVSEEK_FLAG_BACKWARD) {
+        if (index + 1 >= nb_entries)
+            return -1;
+        next = ff_index_get_entry(st, index + 1);
+    } else {
+        if (index < 1)
+            return -1;
+        next = ff_index_get_entry(st, index - 1);
+    }
+    e = ff_index_get_entry(st, index);
+    if (FFABS(next->timestamp - e->timestamp) >
+        av_rescale(MAX_INDEX_GAP, st->time_base.den, st->time_base.num))
+        return -1;
+    if (url_fseek(s->pb, e->pos, SEEK_SET) < 0)
+        return -1;
+    av_update_cur_dts(s, st, e->timestamp);
+    return 0;
+}
+
 AVInputFormat mpegps_demuxer = {
     "mpeg",
     NULL_IF_CONFIG_SMALL("MPEG-PS format"),
@@ -608,7 +689,7 @@ AVInputFormat mpegps_demuxer = {
     mpegps_read_header,
     mpegps_read_packet,
     NULL,
-    NULL, //mpegps_read_seek,
+    mpegps_read_seek,
     mpegps_read_dts,
     .flags = AVFMT_SHOW_IDS|AVFMT_TS_DISCONT,
 };
@@ -53,8 +53,21 @@ typedef struct {
     int bytes_to_iframe;
     int align_iframe;
     int64_t vobu_start_pts;
+    int rel_space;  ///< free buffer space in 1/1024 of its size
+    int is_short;   ///< less than a packet of data buffered for a non-subtitle stream
 } StreamInfo;
 
+/**
+ * Binary heap of stream indexes, the first one is the one before() puts
+ * before all others.
+ */
+typedef struct StreamHeap {
+    int *streams;
+    int *pos;       ///< position of each stream in streams, -1 if not in the heap
+    int nb;
+    int (*before)(AVFormatContext *ctx, int a, int b);
+} StreamHeap;
+
 typedef struct {
     int packet_size; /* required packet size */
     int packet_number;
@@ -74,6 +87,11 @@ typedef struct {
     double vcd_padding_bitrate; //FIXME floats
     int64_t vcd_padding_bytes_written;
 
+    /* output scheduling, kept up to date by update_stream() */
+    StreamHeap sched;   ///< streams with buffered data, most free decoder buffer first
+    StreamHeap decode;  ///< streams with undecoded packets, earliest dts first
+    int nb_short;       ///< streams with less than a packet of data buffered
+    int *popped;        ///< streams taken out of a heap while searching it
 } MpegMuxContext;
 
 extern AVOutputFormat mpeg1vcd_muxer;
@@ -81,6 +99,155 @@ extern AVOutputFormat mpeg2dvd_muxer;
 extern AVOutputFormat mpeg2svcd_muxer;
 extern AVOutputFormat mpeg2vob_muxer;
 
+static void heap_swap(StreamHeap *h, int i, int j)
+{
+    FFSWAP(int, h->streams[i], h->streams[j]);
+    h->pos[h->streams[i]] = i;
+    h->pos[h->streams[j]] = j;
+}
+
+static void heap_sift(AVFormatContext *ctx, StreamHeap *h, int i)
+{
+    while (i > 0 && h->before(ctx, h->streams[i], h->streams[(i - 1) / 2])) {
+        heap_swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int c = 2 * i + 1, best = i;
+
+        if (c < h->nb && h->before(ctx, h->streams[c], h->streams[best]))
+            best = c;
+        if (c + 1 < h->nb && h->before(ctx, h->streams[c + 1], h->streams[best]))
+            best = c + 1;
+        if (best == i)
+            break;
+        heap_swap(h, i, best);
+        i = best;
+    }
+}
+
+/**
+ * Insert, move or remove stream i after its key changed.
+ * @param present whether the stream belongs in the heap
+ */
+static void heap_update(AVFormatContext *ctx, StreamHeap *h, int i, int present)
+{
+    int p = h->pos[i];
+
+    if (!present) {
+        if (p < 0)
+            return;
+        h->pos[i] = -1;
+        if (p != --h->nb) {
+            h->streams[p] = h->streams[h->nb];
+            h->pos[h->streams[p]] = p;
+            heap_sift(ctx, h, p);
+        }
+        return;
+    }
+    if (p < 0) {
+        p = h->nb++;
+        h->streams[p] = i;
+        h->pos[i] = p;
+    }
+    heap_sift(ctx, h, p);
+}
+
+static int heap_init(StreamHeap *h, int nb_streams,
+                     int (*before)(AVFormatContext *ctx, int a, int b))
+{
+    int i;
+
+    h->streams = av_malloc(nb_streams * sizeof(*h->streams));
+    h->pos     = av_malloc(nb_streams * sizeof(*h->pos));
+    if (!h->streams || !h->pos)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < nb_streams; i++)
+        h->pos[i] = -1;
+    h->nb     = 0;
+    h->before = before;
+    return 0;
+}
+
+static void heap_free(StreamHeap *h)
+{
+    av_freep(&h->streams);
+    av_freep(&h->pos);
+}
+
+/* the lowest index wins ties, as when scanning the streams in order */
+static int sched_before(AVFormatContext *ctx, int a, int b)
+{
+    StreamInfo *sa = ctx->streams[a]->priv_data;
+    StreamInfo *sb = ctx->streams[b]->priv_data;
+
+    if (sa->rel_space != sb->rel_space)
+        return sa->rel_space > sb->rel_space;
+    return a < b;
+}
+
+static int decode_before(AVFormatContext *ctx, int a, int b)
+{
+    StreamInfo *sa = ctx->streams[a]->priv_data;
+    StreamInfo *sb = ctx->streams[b]->priv_data;
+
+    if (sa->predecode_packet->dts != sb->predecode_packet->dts)
+        return sa->predecode_packet->dts < sb->predecode_packet->dts;
+    return a < b;
+}
+
+/**
+ * Update the scheduling state of stream i after its buffered data, buffer
+ * fullness or packets to decode changed.
+ */
+static void update_stream(AVFormatContext *ctx, int i)
+{
+    MpegMuxContext *s = ctx->priv_data;
+    AVStream *st = ctx->streams[i];
+    StreamInfo *stream = st->priv_data;
+    int avail_data = av_fifo_size(stream->fifo);
+    int is_short = st->codec->codec_type != CODEC_TYPE_SUBTITLE &&
+                   avail_data < s->packet_size;
+
+    s->nb_short += is_short - stream->is_short;
+    stream->is_short  = is_short;
+    stream->rel_space = 1024*(stream->max_buffer_size - stream->buffer_index) /
+                        stream->max_buffer_size;
+    heap_update(ctx, &s->sched,  i, avail_data > 0);
+    heap_update(ctx, &s->decode, i, stream->predecode_packet != NULL);
+}
+
+/**
+ * Find the stream with buffered data whose decoder buffer has the most free
+ * space relative to its size, among those that have room for a packet and
+ * whose next packet is not too far ahead of scr.
+ * @return the stream index, -1 if none qualifies
+ */
+static int select_stream(AVFormatContext *ctx, int64_t scr,
+                         int ignore_constraints, int64_t max_delay)
+{
+    MpegMuxContext *s = ctx->priv_data;
+    int best = -1, nb_popped = 0;
+
+    while (s->sched.nb) {
+        int i = s->sched.streams[0];
+        StreamInfo *stream = ctx->streams[i]->priv_data;
+        PacketDesc *next_pkt = stream->premux_packet;
+        int space = stream->max_buffer_size - stream->buffer_index;
+
+        if ((space >= s->packet_size || ignore_constraints) &&
+            !(next_pkt && next_pkt->dts - scr > max_delay)) {
+            best = i;
+            break;
+        }
+        s->popped[nb_popped++] = i;
+        heap_update(ctx, &s->sched, i, 0);
+    }
+    while (nb_popped--)
+        heap_update(ctx, &s->sched, s->popped[nb_popped], 1);
+    return best;
+}
+
 static int put_pack_header(AVFormatContext *ctx,
                            uint8_t *buf, int64_t timestamp)
 {
@@ -481,8 +648,18 @@ static int mpeg_mux_init(AVFormatContext *ctx)
     }
     s->system_header_size = get_system_header_size(ctx);
     s->last_scr = 0;
+
+    if (heap_init(&s->sched,  ctx->nb_streams, sched_before)  < 0 ||
+        heap_init(&s->decode, ctx->nb_streams, decode_before) < 0 ||
+        !(s->popped = av_malloc(ctx->nb_streams * sizeof(*s->popped))))
+        goto fail;
+    for(i=0;i<ctx->nb_streams;i++)
+        update_stream(ctx, i);
     return 0;
  fail:
+    heap_free(&s->sched);
+    heap_free(&s->decode);
+    av_freep(&s->popped);
     for(i=0;i<ctx->nb_streams;i++) {
         av_free(ctx->streams[i]->priv_data);
     }
@@ -995,29 +1172,36 @@ static int64_t get_vcd_scr(AVFormatContext *ctx,int stream_index,int64_t pts)
 #endif
 
 static int remove_decoded_packets(AVFormatContext *ctx, int64_t scr){
-//    MpegMuxContext *s = ctx->priv_data;
-    int i;
+    MpegMuxContext *s = ctx->priv_data;
+    int i, nb_popped = 0;
 
-    for(i=0; i<ctx->nb_streams; i++){
-        AVStream *st = ctx->streams[i];
-        StreamInfo *stream = st->priv_data;
+    /* the streams whose next packet to decode is the earliest come first */
+    while(s->decode.nb){
+        StreamInfo *stream;
         PacketDesc *pkt_desc;
 
-        while((pkt_desc= stream->predecode_packet)
-              && scr > pkt_desc->dts){ //FIXME > vs >=
-            if(stream->buffer_index < pkt_desc->size ||
-               stream->predecode_packet == stream->premux_packet){
-                av_log(ctx, AV_LOG_ERROR,
-                       "buffer underflow i=%d bufi=%d size=%d\n",
-                       i, stream->buffer_index, pkt_desc->size);
-                break;
-            }
-            stream->buffer_index -= pkt_desc->size;
-
-            stream->predecode_packet= pkt_desc->next;
-            av_freep(&pkt_desc);
+        i = s->decode.streams[0];
+        stream = ctx->streams[i]->priv_data;
+        pkt_desc = stream->predecode_packet;
+        if(scr <= pkt_desc->dts) //FIXME > vs >=
+            break;
+        if(stream->buffer_index < pkt_desc->size ||
+           stream->predecode_packet == stream->premux_packet){
+            av_log(ctx, AV_LOG_ERROR,
+                   "buffer underflow i=%d bufi=%d size=%d\n",
+                   i, stream->buffer_index, pkt_desc->size);
+            s->popped[nb_popped++] = i;
+            heap_update(ctx, &s->decode, i, 0);
+            continue;
         }
+        stream->buffer_index -= pkt_desc->size;
+
+        stream->predecode_packet= pkt_desc->next;
+        av_freep(&pkt_desc);
+        update_stream(ctx, i);
     }
+    while(nb_popped--)
+        heap_update(ctx, &s->decode, s->popped[nb_popped], 1);
 
     return 0;
 }
@@ -1026,54 +1210,31 @@ static int output_packet(AVFormatContext *ctx, int flush){
     MpegMuxContext *s = ctx->priv_data;
     AVStream *st;
     StreamInfo *stream;
-    int i, avail_space=0, es_size, trailer_size;
+    int avail_space=0, es_size, trailer_size;
     int best_i= -1;
-    int best_score= INT_MIN;
     int ignore_constraints=0;
     int64_t scr= s->last_scr;
     PacketDesc *timestamp_packet;
     const int64_t max_delay= av_rescale(ctx->max_delay, 90000, AV_TIME_BASE);
 
 retry:
-    for(i=0; i<ctx->nb_streams; i++){
-        AVStream *st = ctx->streams[i];
-        StreamInfo *stream = st->priv_data;
-        const int avail_data=  av_fifo_size(stream->fifo);
-        const int space= stream->max_buffer_size - stream->buffer_index;
-        int rel_space= 1024*space / stream->max_buffer_size;
-        PacketDesc *next_pkt= stream->premux_packet;
-
-        /* for subtitle, a single PES packet must be generated,
-           so we flush after every single subtitle packet */
-        if(s->packet_size > avail_data && !flush
-           && st->codec->codec_type != CODEC_TYPE_SUBTITLE)
-            return 0;
-        if(avail_data==0)
-            continue;
-        assert(avail_data>0);
-
-        if(space < s->packet_size && !ignore_constraints)
-            continue;
-
-        if(next_pkt && next_pkt->dts - scr > max_delay)
-            continue;
-
-        if(rel_space > best_score){
-            best_score= rel_space;
-            best_i = i;
-            avail_space= space;
-        }
+    /* for subtitle, a single PES packet must be generated,
+       so we flush after every single subtitle packet */
+    if(s->nb_short && !flush)
+        return 0;
+
+    best_i = select_stream(ctx, scr, ignore_constraints, max_delay);
+    if(best_i >= 0){
+        stream = ctx->streams[best_i]->priv_data;
+        avail_space = stream->max_buffer_size - stream->buffer_index;
     }
 
     if(best_i < 0){
         int64_t best_dts= INT64_MAX;
 
-        for(i=0; i<ctx->nb_streams; i++){
-            AVStream *st = ctx->streams[i];
-            StreamInfo *stream = st->priv_data;
-            PacketDesc *pkt_desc= stream->predecode_packet;
-            if(pkt_desc && pkt_desc->dts < best_dts)
-                best_dts= pkt_desc->dts;
+        if(s->decode.nb){
+            stream = ctx->streams[s->decode.streams[0]]->priv_data;
+            best_dts = stream->predecode_packet->dts;
         }
 
 #if 0
@@ -1138,6 +1299,7 @@ retry:
     }
     if(es_size)
         stream->premux_packet->unwritten_size -= es_size;
+    update_stream(ctx, best_i);
 
     if(remove_decoded_packets(ctx, s->last_scr) < 0)
         return -1;
@@ -1189,6 +1351,7 @@ static int mpeg_mux_write_packet(AVFormatContext *ctx, AVPacket *pkt)
     }
 
     av_fifo_generic_write(stream->fifo, buf, size, NULL);
+    update_stream(ctx, stream_index);
 
     for(;;){
         int ret= output_packet(ctx, 0);
@@ -1199,7 +1362,7 @@ static int mpeg_mux_write_packet(AVFormatContext *ctx, AVPacket *pkt)
 
 static int mpeg_mux_end(AVFormatContext *ctx)
 {
-//    MpegMuxContext *s = ctx->priv_data;
+    MpegMuxContext *s = ctx->priv_data;
     StreamInfo *stream;
     int i;
 
@@ -1210,6 +1373,9 @@ static int mpeg_mux_end(AVFormatContext *ctx)
         else if(ret==0)
             break;
     }
+    heap_free(&s->sched);
+    heap_free(&s->decode);
+    av_freep(&s->popped);
 
     /* End header according to MPEG1 systems standard. We do not write
        it as it is usually not needed by decoders and because it
@@ -30,6 +30,10 @@
 #include "mpegts.h"
 #include "internal.h"
 #include "seek.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include "threadpool.h"
+#endif
 
 /* 1.0 second at 24Mbit/s */
 #define MAX_SCAN_PACKETS 32000
@@ -47,7 +51,11 @@ enum MpegTSFilterType {
 
 typedef struct MpegTSFilter MpegTSFilter;
 
-typedef int PESCallback(MpegTSFilter *f, const uint8_t *buf, int len, int is_start, int64_t pos);
+/**
+ * @param random_access the TS packet has the random_access_indicator set
+ */
+typedef int PESCallback(MpegTSFilter *f, const uint8_t *buf, int len, int is_start,
+                        int random_access, int64_t pos);
 
 typedef struct MpegTSPESFilter {
     PESCallback *pes_cb;
@@ -66,6 +74,9 @@ typedef struct MpegTSSectionFilter {
     unsigned int end_of_section_reached:1;
     SectionCallback *section_cb;
     void *opaque;
+    /** length and CRC of the last section passed to section_cb, with check_crc */
+    int last_len;
+    uint32_t last_crc;
 } MpegTSSectionFilter;
 
 struct MpegTSFilter {
@@ -83,6 +94,7 @@ struct Program {
     unsigned int id; //program id/service id
     unsigned int nb_pids;
     unsigned int pids[MAX_PIDS_PER_PROGRAM];
+    int pcr_pid; ///< -1 until the PMT was parsed
 };
 
 typedef struct MpegTSContext {
@@ -93,9 +105,15 @@ typedef struct MpegTSContext {
 
     int pos47;
 
+    /** bytes skipped since synchronization was lost, see max_resync_size */
+    int resync_skipped;
+
     /** if true, all pids are analyzed to find streams       */
     int auto_guess;
 
+    /** only follow the first program of the PAT, see AVFMT_FLAG_SINGLE_PROGRAM */
+    int single_program;
+
     /** compute exact PCR for each transport stream packet   */
     int mpeg2ts_compute_pcr;
 
@@ -120,8 +138,44 @@ typedef struct MpegTSContext {
 
     /** filters for various streams specified by PMT + for the PAT and PMT */
     MpegTSFilter *pids[NB_PID_MAX];
+
+    /** what handle_packet() does with each pid, a PID_* value */
+    uint8_t pid_action[NB_PID_MAX];
+    /** pid_action must be rebuilt before the next packet */
+    int pid_action_dirty;
+    /** discard flags pid_action was built for */
+    uint8_t *prog_discard;
+    int nb_prog_discard;
+    uint8_t stream_discard[MAX_STREAMS];
+    int nb_stream_discard;
+
+    /** position of the last keyframe indexed in each stream if all packets
+        were read since, -1 otherwise */
+    int64_t index_pos[MAX_STREAMS];
+
+#if HAVE_PTHREADS
+    /** tasks assembling PES packets, see AVFormatContext.program_threads */
+    struct TSWorker *workers;
+    int nb_workers;
+    int workers_started;
+    /** worker of each pid, by the program it belongs to */
+    uint8_t pid_worker[NB_PID_MAX];
+    pthread_mutex_t worker_lock;
+    pthread_cond_t worker_cond;
+    /** assembled packets not returned yet */
+    AVPacketList *out_first, *out_last;
+    struct TSBatch *free_batches;
+    int worker_error;
+#endif
 } MpegTSContext;
 
+enum PidAction {
+    PID_NONE = 0,   ///< no filter
+    PID_SECTION,
+    PID_PES,
+    PID_DISCARD,    ///< all programs or the stream of the pid are discarded
+};
+
 /* TS stream handling */
 
 enum MpegTSState {
@@ -155,6 +209,10 @@ typedef struct PESContext {
     int64_t ts_packet_pos; /**< position of first TS packet of this PES packet */
     uint8_t header[MAX_PES_HEADER_SIZE];
     uint8_t *buffer;
+    int buffer_mem; /**< bytes of buffer accounted in the memory budget */
+    int buffer_size; /**< payload bytes buffer has room for */
+    int size_hint;  /**< recent size of the PES packets without a length, 0 if unknown */
+    int random_access; /**< the first TS packet of this PES packet is a random access point */
 } PESContext;
 
 extern AVInputFormat mpegts_demuxer;
@@ -166,12 +224,14 @@ static void clear_program(MpegTSContext *ts, unsigned int programid)
     for(i=0; i<ts->nb_prg; i++)
         if(ts->prg[i].id == programid)
             ts->prg[i].nb_pids = 0;
+    ts->pid_action_dirty = 1;
 }
 
 static void clear_programs(MpegTSContext *ts)
 {
     av_freep(&ts->prg);
     ts->nb_prg=0;
+    ts->pid_action_dirty = 1;
 }
 
 static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
@@ -184,7 +244,9 @@ static void add_pat_entry(MpegTSContext *ts, unsigned int programid)
     p = &ts->prg[ts->nb_prg];
     p->id = programid;
     p->nb_pids = 0;
+    p->pcr_pid = -1;
     ts->nb_prg++;
+    ts->pid_action_dirty = 1;
 }
 
 static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned int pid)
@@ -203,46 +265,217 @@ static void add_pid_to_pmt(MpegTSContext *ts, unsigned int programid, unsigned i
     if(p->nb_pids >= MAX_PIDS_PER_PROGRAM)
         return;
     p->pids[p->nb_pids++] = pid;
+    ts->pid_action_dirty = 1;
+}
+
+static void pes_free_buffer(PESContext *pes)
+{
+    ff_buffer_memory_add(pes->stream, -pes->buffer_mem);
+    pes->buffer_mem = 0;
+    pes->buffer_size = 0;
+    av_freep(&pes->buffer);
+}
+
+#if HAVE_PTHREADS
+/* PES packets of different programs are assembled by the thread pool. The
+ * demuxer thread classifies the TS packets and handles the tables, a
+ * worker owns the PES state of the pids it is given until the next
+ * workers_sync(); its batches are tasks of a queue running one at a time. */
+
+#define MAX_TS_WORKERS  16
+#define TS_WORKER_BATCH 64  ///< TS packets handed to a worker at once
+#define TS_WORKER_QUEUE 8   ///< max batches queued for a worker
+
+typedef struct TSWorkPacket {
+    MpegTSFilter *filter;
+    int64_t pos;            ///< position of the TS packet
+    int is_start;
+    int random_access;
+    int len;
+    uint8_t data[TS_PACKET_SIZE];
+} TSWorkPacket;
+
+typedef struct TSBatch {
+    struct TSBatch *next;
+    int nb;
+    TSWorkPacket pkts[TS_WORKER_BATCH];
+} TSBatch;
+
+typedef struct TSWorker {
+    MpegTSContext *ts;
+    FFTaskQueue *queue;
+    int nb_queued;          ///< batches submitted and not done, under worker_lock
+    TSBatch *pending;       ///< batch being filled by the demuxer thread
+} TSWorker;
+
+/* worker_lock must be held */
+static void worker_queue(MpegTSContext *ts, TSWorker *w)
+{
+    TSBatch *b = w->pending;
+
+    w->pending = NULL;
+    if (ff_task_queue_submit(w->queue, b) < 0) {
+        b->next = ts->free_batches;
+        ts->free_batches = b;
+        if (!ts->worker_error)
+            ts->worker_error = AVERROR(ENOMEM);
+        return;
+    }
+    w->nb_queued++;
 }
 
+static void worker_submit(MpegTSContext *ts, TSWorker *w)
+{
+    pthread_mutex_lock(&ts->worker_lock);
+    while (w->nb_queued >= TS_WORKER_QUEUE)
+        pthread_cond_wait(&ts->worker_cond, &ts->worker_lock);
+    worker_queue(ts, w);
+    pthread_mutex_unlock(&ts->worker_lock);
+}
+
+/**
+ * Hand out the partial batches and wait until the workers are idle, so
+ * that the PES state of all pids can be accessed.
+ */
+static void workers_sync(MpegTSContext *ts)
+{
+    int i;
+
+    if (!ts->nb_workers)
+        return;
+    for (i = 0; i < ts->nb_workers; i++)
+        if (ts->workers[i].pending)
+            worker_submit(ts, &ts->workers[i]);
+    for (i = 0; i < ts->nb_workers; i++)
+        ff_task_queue_wait(ts->workers[i].queue);
+}
+#else
+#define workers_sync(ts)
+#endif
+
 /**
- * \brief discard_pid() decides if the pid is to be discarded according
- *                      to caller's programs selection
- * \param ts    : - TS context
- * \param pid   : - pid
- * \return 1 if the pid is only comprised in programs that have .discard=AVDISCARD_ALL
- *         0 otherwise
+ * Note when the discard flags of the programs or streams changed since
+ * pid_action was built.
  */
-static int discard_pid(MpegTSContext *ts, unsigned int pid)
+static void check_discard(MpegTSContext *ts)
 {
+    AVFormatContext *s = ts->stream;
+    int i;
+
+    if (s->nb_programs != ts->nb_prog_discard) {
+        uint8_t *tmp = av_realloc(ts->prog_discard, FFMAX(s->nb_programs, 1));
+        if (!tmp)
+            return;
+        ts->prog_discard    = tmp;
+        ts->nb_prog_discard = s->nb_programs;
+        memset(ts->prog_discard, 0, s->nb_programs);
+        ts->pid_action_dirty = 1;
+    }
+    for (i = 0; i < s->nb_programs; i++) {
+        int discard = s->programs[i]->discard == AVDISCARD_ALL;
+        if (ts->prog_discard[i] != discard) {
+            ts->prog_discard[i]  = discard;
+            ts->pid_action_dirty = 1;
+        }
+    }
+    if (s->nb_streams != ts->nb_stream_discard) {
+        ts->nb_stream_discard = s->nb_streams;
+        ts->pid_action_dirty  = 1;
+    }
+    for (i = 0; i < s->nb_streams; i++) {
+        int discard = s->streams[i]->discard >= AVDISCARD_ALL;
+        if (ts->stream_discard[i] != discard) {
+            ts->stream_discard[i] = discard;
+            ts->pid_action_dirty  = 1;
+        }
+    }
+}
+
+/**
+ * Rebuild pid_action. A pid is discarded if it belongs only to programs
+ * set to be discarded, or if its PES stream is discarded.
+ */
+static void update_pid_actions(MpegTSContext *ts)
+{
+    AVFormatContext *s = ts->stream;
+    uint8_t used[NB_PID_MAX], discarded[NB_PID_MAX];
     int i, j, k;
-    int used = 0, discarded = 0;
-    struct Program *p;
+
+    /* partial PES packets of newly discarded pids are dropped below */
+    workers_sync(ts);
+
+    memset(used,      0, sizeof(used));
+    memset(discarded, 0, sizeof(discarded));
     for(i=0; i<ts->nb_prg; i++) {
-        p = &ts->prg[i];
-        for(j=0; j<p->nb_pids; j++) {
-            if(p->pids[j] != pid)
-                continue;
-            //is program with id p->id set to be discarded?
-            for(k=0; k<ts->stream->nb_programs; k++) {
-                if(ts->stream->programs[k]->id == p->id) {
-                    if(ts->stream->programs[k]->discard == AVDISCARD_ALL)
-                        discarded++;
-                    else
-                        used++;
-                }
+        struct Program *p = &ts->prg[i];
+        int prg_used = 0, prg_discarded = 0;
+        //is program with id p->id set to be discarded?
+        for(k=0; k<s->nb_programs; k++) {
+            if(s->programs[k]->id == p->id) {
+                if(s->programs[k]->discard == AVDISCARD_ALL)
+                    prg_discarded = 1;
+                else
+                    prg_used = 1;
             }
         }
+        for(j=0; j<p->nb_pids; j++) {
+            used     [p->pids[j]] |= prg_used;
+            discarded[p->pids[j]] |= prg_discarded;
+        }
+    }
+
+    for (i = 0; i < NB_PID_MAX; i++) {
+        MpegTSFilter *filter = ts->pids[i];
+        int action;
+
+        if (i && !used[i] && discarded[i]) {
+            action = PID_DISCARD;
+        } else if (!filter) {
+            action = PID_NONE;
+        } else if (filter->type == MPEGTS_SECTION) {
+            action = PID_SECTION;
+        } else {
+            PESContext *pes = filter->u.pes_filter.opaque;
+            if (pes->st && pes->st->discard >= AVDISCARD_ALL &&
+                (!pes->sub_st || pes->sub_st->discard >= AVDISCARD_ALL))
+                action = PID_DISCARD;
+            else
+                action = PID_PES;
+        }
+        if (action == PID_DISCARD && ts->pid_action[i] != PID_DISCARD &&
+            filter && filter->type == MPEGTS_PES) {
+            /* drop the partial PES packet, resume at the next PES header */
+            PESContext *pes = filter->u.pes_filter.opaque;
+            pes_free_buffer(pes);
+            pes->data_index = 0;
+            pes->state = MPEGTS_SKIP;
+            /* keyframes are missed from now on */
+            if (pes->st)
+                ts->index_pos[pes->st->index] = -1;
+            if (pes->sub_st)
+                ts->index_pos[pes->sub_st->index] = -1;
+        }
+        ts->pid_action[i] = action;
     }
 
-    return !used && discarded;
+#if HAVE_PTHREADS
+    if (ts->nb_workers) {
+        /* whole programs go to the same worker */
+        for (i = 0; i < NB_PID_MAX; i++)
+            ts->pid_worker[i] = i % ts->nb_workers;
+        for (i = 0; i < ts->nb_prg; i++)
+            for (j = 0; j < ts->prg[i].nb_pids; j++)
+                ts->pid_worker[ts->prg[i].pids[j]] = i % ts->nb_workers;
+    }
+#endif
+    ts->pid_action_dirty = 0;
 }
 
 /**
  *  Assembles PES packets out of TS packets, and then calls the "section_cb"
  *  function when they are complete.
  */
-static void write_section_data(AVFormatContext *s, MpegTSFilter *tss1,
+static void write_section_data(MpegTSContext *ts, MpegTSFilter *tss1,
                                const uint8_t *buf, int buf_size, int is_start)
 {
     MpegTSSectionFilter *tss = &tss1->u.section_filter;
@@ -272,11 +505,25 @@ static void write_section_data(AVFormatContext *s, MpegTSFilter *tss1,
     }
 
     if (tss->section_h_size != -1 && tss->section_index >= tss->section_h_size) {
+        len = tss->section_h_size;
         tss->end_of_section_reached = 1;
-        if (!tss->check_crc ||
-            av_crc(av_crc_get_table(AV_CRC_32_IEEE), -1,
-                   tss->section_buf, tss->section_h_size) == 0)
-            tss->section_cb(tss1, tss->section_buf, tss->section_h_size);
+        if (tss->check_crc) {
+            uint32_t crc;
+
+            if (len < 4)
+                return;
+            crc = AV_RB32(tss->section_buf + len - 4);
+            /* tables are repeated often, skip those identical to the last */
+            if (len == tss->last_len && crc == tss->last_crc)
+                return;
+            if (ff_crc32_ieee(-1, tss->section_buf, len) != 0)
+                return;
+            tss->last_len = len;
+            tss->last_crc = crc;
+        }
+        /* tables may change the pid filters and the streams */
+        workers_sync(ts);
+        tss->section_cb(tss1, tss->section_buf, len);
     }
 }
 
@@ -296,6 +543,7 @@ static MpegTSFilter *mpegts_open_section_filter(MpegTSContext *ts, unsigned int
     if (!filter)
         return NULL;
     ts->pids[pid] = filter;
+    ts->pid_action_dirty = 1;
     filter->type = MPEGTS_SECTION;
     filter->pid = pid;
     filter->last_cc = -1;
@@ -324,6 +572,7 @@ static MpegTSFilter *mpegts_open_pes_filter(MpegTSContext *ts, unsigned int pid,
     if (!filter)
         return NULL;
     ts->pids[pid] = filter;
+    ts->pid_action_dirty = 1;
     filter->type = MPEGTS_PES;
     filter->pid = pid;
     filter->last_cc = -1;
@@ -342,7 +591,7 @@ static void mpegts_close_filter(MpegTSContext *ts, MpegTSFilter *filter)
         av_freep(&filter->u.section_filter.section_buf);
     else if (filter->type == MPEGTS_PES) {
         PESContext *pes = filter->u.pes_filter.opaque;
-        av_freep(&pes->buffer);
+        pes_free_buffer(pes);
         /* referenced private data will be freed later in
          * av_close_input_stream */
         if (!((PESContext *)filter->u.pes_filter.opaque)->st) {
@@ -352,43 +601,64 @@ static void mpegts_close_filter(MpegTSContext *ts, MpegTSFilter *filter)
 
     av_free(filter);
     ts->pids[pid] = NULL;
+    ts->pid_action_dirty = 1;
 }
 
-static int analyze(const uint8_t *buf, int size, int packet_size, int *index){
-    int stat[TS_MAX_PACKET_SIZE];
-    int i;
-    int x=0;
-    int best_score=0;
+/* check whether a sync byte at p starts a plausible packet header */
+#define SYNC_CANDIDATE(p) (!((p)[1] & 0x80) && ((p)[3] & 0x30))
 
-    memset(stat, 0, packet_size*sizeof(int));
+/**
+ * Count the plausible packet headers at each offset modulo the given packet
+ * sizes, in a single pass over buf that jumps between sync bytes with
+ * memchr() instead of testing every byte.
+ * @param best_score set to the highest count for each packet size
+ */
+static void analyze_sizes(const uint8_t *buf, int size, const int *packet_size,
+                          int nb_sizes, int *best_score, int *index)
+{
+    int stat[3][TS_MAX_PACKET_SIZE];
+    const uint8_t *p = buf, *end = buf + size - 3;
+    int j;
 
-    for(x=i=0; i<size-3; i++){
-        if(buf[i] == 0x47 && !(buf[i+1] & 0x80) && (buf[i+3] & 0x30)){
-            stat[x]++;
-            if(stat[x] > best_score){
-                best_score= stat[x];
-                if(index) *index= x;
+    for (j = 0; j < nb_sizes; j++) {
+        memset(stat[j], 0, packet_size[j] * sizeof(int));
+        best_score[j] = 0;
+    }
+    while (p < end && (p = memchr(p, 0x47, end - p))) {
+        if (SYNC_CANDIDATE(p)) {
+            int i = p - buf;
+            for (j = 0; j < nb_sizes; j++) {
+                int x = i % packet_size[j];
+                if (++stat[j][x] > best_score[j]) {
+                    best_score[j] = stat[j][x];
+                    if (index) *index = x;
+                }
             }
         }
-
-        x++;
-        if(x == packet_size) x= 0;
+        p++;
     }
+}
+
+static int analyze(const uint8_t *buf, int size, int packet_size, int *index){
+    int best_score;
 
+    analyze_sizes(buf, size, &packet_size, 1, &best_score, index);
     return best_score;
 }
 
 /* autodetect fec presence. Must have at least 1024 bytes  */
 static int get_packet_size(const uint8_t *buf, int size)
 {
-    int score, fec_score, dvhs_score;
+    static const int sizes[3] = { TS_PACKET_SIZE, TS_DVHS_PACKET_SIZE, TS_FEC_PACKET_SIZE };
+    int scores[3], score, fec_score, dvhs_score;
 
     if (size < (TS_FEC_PACKET_SIZE * 5 + 1))
         return -1;
 
-    score    = analyze(buf, size, TS_PACKET_SIZE, NULL);
-    dvhs_score    = analyze(buf, size, TS_DVHS_PACKET_SIZE, NULL);
-    fec_score= analyze(buf, size, TS_FEC_PACKET_SIZE, NULL);
+    analyze_sizes(buf, size, sizes, 3, scores, NULL);
+    score      = scores[0];
+    dvhs_score = scores[1];
+    fec_score  = scores[2];
 //    av_log(NULL, AV_LOG_DEBUG, "score: %d, dvhs_score: %d, fec_score: %d \n", score, dvhs_score, fec_score);
 
     if     (score > fec_score && score > dvhs_score) return TS_PACKET_SIZE;
@@ -608,6 +878,62 @@ static int64_t get_pts(const uint8_t *p)
     return pts;
 }
 
+/* first allocation for PES packets without a length on a new pid */
+#define PES_INITIAL_PAYLOAD (32*1024)
+
+/**
+ * Allocate the PES buffer for total_size bytes, or for PES packets
+ * without a length (total_size MAX_PES_PAYLOAD) for about the size of the
+ * recent ones, growing it as needed in pes_grow_buffer().
+ * If the memory budget is exhausted no buffer is allocated and the
+ * PES packet is skipped.
+ */
+static int pes_alloc_buffer(PESContext *pes)
+{
+    int payload = pes->total_size, size;
+
+    if (payload == MAX_PES_PAYLOAD)
+        payload = FFMIN(pes->size_hint ? pes->size_hint + pes->size_hint / 8 :
+                        PES_INITIAL_PAYLOAD, MAX_PES_PAYLOAD);
+    size = payload + FF_INPUT_BUFFER_PADDING_SIZE;
+    if (ff_buffer_memory_check(pes->stream, size, "MPEG-TS PES buffering")) {
+        pes->state = MPEGTS_SKIP;
+        return 0;
+    }
+    pes->buffer = av_malloc(size);
+    if (!pes->buffer)
+        return AVERROR(ENOMEM);
+    pes->buffer_size = payload;
+    pes->buffer_mem  = size;
+    ff_buffer_memory_add(pes->stream, size);
+    return 0;
+}
+
+/**
+ * Make room for size payload bytes, at most total_size.
+ */
+static int pes_grow_buffer(PESContext *pes, int size)
+{
+    uint8_t *buffer;
+    int payload = FFMIN(FFMAX(size, 2 * pes->buffer_size), pes->total_size);
+    int grow = payload - pes->buffer_size;
+
+    if (ff_buffer_memory_check(pes->stream, grow, "MPEG-TS PES buffering")) {
+        pes_free_buffer(pes);
+        pes->data_index = 0;
+        pes->state = MPEGTS_SKIP;
+        return 0;
+    }
+    buffer = av_realloc(pes->buffer, payload + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!buffer)
+        return AVERROR(ENOMEM);
+    pes->buffer       = buffer;
+    pes->buffer_size  = payload;
+    pes->buffer_mem  += grow;
+    ff_buffer_memory_add(pes->stream, grow);
+    return 0;
+}
+
 static void new_pes_packet(PESContext *pes, AVPacket *pkt)
 {
     av_init_packet(pkt);
@@ -626,35 +952,84 @@ static void new_pes_packet(PESContext *pes, AVPacket *pkt)
     pkt->dts = pes->dts;
     /* store position of first TS packet of this PES packet */
     pkt->pos = pes->ts_packet_pos;
+    if (pes->random_access)
+        pkt->flags |= PKT_FLAG_KEY;
+
+    /* follow the size of PES packets without a length, shrinking slowly */
+    if (pes->total_size == MAX_PES_PAYLOAD)
+        pes->size_hint = FFMAX(pes->data_index, pes->size_hint - pes->size_hint / 16);
 
     /* reset pts values */
     pes->pts = AV_NOPTS_VALUE;
     pes->dts = AV_NOPTS_VALUE;
+    pes->random_access = 0;
     pes->buffer = NULL;
     pes->data_index = 0;
+    /* the buffer now belongs to the packet */
+    ff_buffer_memory_add(pes->stream, -pes->buffer_mem);
+    pes->buffer_mem = 0;
+    pes->buffer_size = 0;
+}
+
+/**
+ * Return the completed PES packet to the caller of handle_packets(), or
+ * queue it if workers assemble the packets.
+ */
+static int output_pes_packet(PESContext *pes)
+{
+    MpegTSContext *ts = pes->ts;
+
+#if HAVE_PTHREADS
+    if (ts->nb_workers) {
+        AVPacketList *pktl = av_mallocz(sizeof(AVPacketList));
+
+        if (!pktl) {
+            pes_free_buffer(pes);
+            pes->data_index = 0;
+            return AVERROR(ENOMEM);
+        }
+        new_pes_packet(pes, &pktl->pkt);
+        ff_buffer_memory_add(pes->stream, pktl->pkt.size);
+        pthread_mutex_lock(&ts->worker_lock);
+        if (ts->out_last)
+            ts->out_last->next = pktl;
+        else
+            ts->out_first = pktl;
+        ts->out_last = pktl;
+        pthread_mutex_unlock(&ts->worker_lock);
+        return 0;
+    }
+#endif
+    new_pes_packet(pes, ts->pkt);
+    ts->stop_parse = 1;
+    return 0;
 }
 
 /* return non zero if a packet could be constructed */
 static int mpegts_push_data(MpegTSFilter *filter,
                             const uint8_t *buf, int buf_size, int is_start,
-                            int64_t pos)
+                            int random_access, int64_t pos)
 {
     PESContext *pes = filter->u.pes_filter.opaque;
     MpegTSContext *ts = pes->ts;
     const uint8_t *p;
-    int len, code;
+    int len, code, ret;
 
+#if HAVE_PTHREADS
+    if (!ts->pkt && !ts->nb_workers)
+#else
     if(!ts->pkt)
+#endif
         return 0;
 
     if (is_start) {
-        if (pes->state == MPEGTS_PAYLOAD && pes->data_index > 0) {
-            new_pes_packet(pes, ts->pkt);
-            ts->stop_parse = 1;
-        }
+        if (pes->state == MPEGTS_PAYLOAD && pes->data_index > 0 &&
+            (ret = output_pes_packet(pes)) < 0)
+            return ret;
         pes->state = MPEGTS_HEADER;
         pes->data_index = 0;
         pes->ts_packet_pos = pos;
+        pes->random_access = random_access;
     }
     p = buf;
     while (buf_size > 0) {
@@ -699,9 +1074,10 @@ static int mpegts_push_data(MpegTSFilter *filter,
                         pes->total_size = MAX_PES_PAYLOAD;
 
                     /* allocate pes buffer */
-                    pes->buffer = av_malloc(pes->total_size+FF_INPUT_BUFFER_PADDING_SIZE);
+                    if ((ret = pes_alloc_buffer(pes)) < 0)
+                        return ret;
                     if (!pes->buffer)
-                        return AVERROR(ENOMEM);
+                        break;
 
                     if (code != 0x1bc && code != 0x1bf && /* program_stream_map, private_stream_2 */
                         code != 0x1f0 && code != 0x1f1 && /* ECM, EMM */
@@ -793,12 +1169,19 @@ static int mpegts_push_data(MpegTSFilter *filter,
         case MPEGTS_PAYLOAD:
             if (buf_size > 0 && pes->buffer) {
                 if (pes->data_index+buf_size > pes->total_size) {
-                    new_pes_packet(pes, ts->pkt);
+                    if ((ret = output_pes_packet(pes)) < 0)
+                        return ret;
                     pes->total_size = MAX_PES_PAYLOAD;
-                    pes->buffer = av_malloc(pes->total_size+FF_INPUT_BUFFER_PADDING_SIZE);
+                    if ((ret = pes_alloc_buffer(pes)) < 0)
+                        return ret;
+                    if (!pes->buffer)
+                        break;
+                }
+                if (pes->data_index+buf_size > pes->buffer_size) {
+                    if ((ret = pes_grow_buffer(pes, pes->data_index+buf_size)) < 0)
+                        return ret;
                     if (!pes->buffer)
-                        return AVERROR(ENOMEM);
-                    ts->stop_parse = 1;
+                        break;
                 }
                 memcpy(pes->buffer+pes->data_index, p, buf_size);
                 pes->data_index += buf_size;
@@ -845,7 +1228,7 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
     PESContext *pes;
     AVStream *st;
     const uint8_t *p, *p_end, *desc_list_end, *desc_end;
-    int program_info_length, pcr_pid, pid, stream_type;
+    int program_info_length, pcr_pid, pid, stream_type, i;
     int desc_list_len, desc_len, desc_tag;
     int comp_page, anc_page;
     char language[4];
@@ -866,12 +1249,17 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
 
     if (h->tid != PMT_TID)
         return;
+    if (ts->single_program && (!ts->nb_prg || h->id != ts->prg[0].id))
+        return;
 
     clear_program(ts, h->id);
     pcr_pid = get16(&p, p_end) & 0x1fff;
     if (pcr_pid < 0)
         return;
     add_pid_to_pmt(ts, h->id, pcr_pid);
+    for (i = 0; i < ts->nb_prg; i++)
+        if (ts->prg[i].id == h->id)
+            ts->prg[i].pcr_pid = pcr_pid;
 
     dprintf(ts->stream, "pcr_pid=0x%x\n", pcr_pid);
 
@@ -999,8 +1387,8 @@ static void pmt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
         }
         p = desc_list_end;
     }
-    /* all parameters are there */
-    mpegts_close_filter(ts, filter);
+    /* the filter stays open to follow changes of the PMT, repetitions
+       are skipped by write_section_data() */
 }
 
 static void pat_cb(MpegTSFilter *filter, const uint8_t *section, int section_len)
@@ -1036,10 +1424,15 @@ static void pat_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
             /* NIT info */
         } else {
             av_new_program(ts->stream, sid);
-            mpegts_open_section_filter(ts, pmt_pid, pmt_cb, ts, 1);
+            if (!mpegts_open_section_filter(ts, pmt_pid, pmt_cb, ts, 1) &&
+                ts->pids[pmt_pid] && ts->pids[pmt_pid]->type == MPEGTS_SECTION)
+                /* the program pids were cleared, parse the next PMT again */
+                ts->pids[pmt_pid]->u.section_filter.last_len = 0;
             add_pat_entry(ts, sid);
             add_pid_to_pmt(ts, sid, 0); //add pat pid to program
             add_pid_to_pmt(ts, sid, pmt_pid);
+            if (ts->single_program)
+                break;
         }
     }
 }
@@ -1122,18 +1515,225 @@ static void sdt_cb(MpegTSFilter *filter, const uint8_t *section, int section_len
     }
 }
 
-/* handle one TS packet */
-static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
+#if HAVE_PTHREADS
+static void ts_worker_task(void *opaque, void *job)
+{
+    TSWorker *w = opaque;
+    MpegTSContext *ts = w->ts;
+    TSBatch *b = job;
+    int i, ret = 0;
+
+    for (i = 0; i < b->nb && ret >= 0; i++) {
+        TSWorkPacket *p = &b->pkts[i];
+        ret = p->filter->u.pes_filter.pes_cb(p->filter, p->data, p->len,
+                                             p->is_start, p->random_access, p->pos);
+    }
+
+    pthread_mutex_lock(&ts->worker_lock);
+    b->next = ts->free_batches;
+    ts->free_batches = b;
+    if (ret < 0 && !ts->worker_error)
+        ts->worker_error = ret;
+    w->nb_queued--;
+    pthread_cond_broadcast(&ts->worker_cond);
+    pthread_mutex_unlock(&ts->worker_lock);
+}
+
+static int workers_start(MpegTSContext *ts, int nb_workers)
+{
+    int i;
+
+    ts->workers_started = 1;
+    nb_workers = FFMIN(nb_workers, MAX_TS_WORKERS);
+    ts->workers = av_mallocz(nb_workers * sizeof(TSWorker));
+    if (!ts->workers)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&ts->worker_lock, NULL);
+    pthread_cond_init(&ts->worker_cond, NULL);
+    for (i = 0; i < nb_workers; i++) {
+        ts->workers[i].ts = ts;
+        if (!(ts->workers[i].queue = ff_task_queue_alloc(ts->stream, ts_worker_task,
+                                                         &ts->workers[i], 1)))
+            break;
+    }
+    if (!i) {
+        pthread_cond_destroy(&ts->worker_cond);
+        pthread_mutex_destroy(&ts->worker_lock);
+        av_freep(&ts->workers);
+        return AVERROR(ENOMEM);
+    }
+    ts->nb_workers = i;
+    ts->pid_action_dirty = 1;
+    return 0;
+}
+
+static int workers_get_packet(MpegTSContext *ts, AVPacket *pkt)
+{
+    AVPacketList *pktl;
+
+    pthread_mutex_lock(&ts->worker_lock);
+    if ((pktl = ts->out_first) && !(ts->out_first = pktl->next))
+        ts->out_last = NULL;
+    pthread_mutex_unlock(&ts->worker_lock);
+    if (!pktl)
+        return 0;
+    *pkt = pktl->pkt;
+    ff_buffer_memory_add(ts->stream, -pkt->size);
+    av_free(pktl);
+    return 1;
+}
+
+/**
+ * Drop the packets assembled so far, e.g. because of a seek.
+ */
+static void workers_flush(MpegTSContext *ts)
+{
+    AVPacket pkt;
+
+    workers_sync(ts);
+    while (workers_get_packet(ts, &pkt))
+        av_free_packet(&pkt);
+    ts->worker_error = 0;
+}
+
+static void workers_stop(MpegTSContext *ts)
+{
+    TSBatch *b;
+    int i;
+
+    if (!ts->nb_workers)
+        return;
+    workers_flush(ts);
+    for (i = 0; i < ts->nb_workers; i++)
+        ff_task_queue_free(&ts->workers[i].queue);
+    while ((b = ts->free_batches)) {
+        ts->free_batches = b->next;
+        av_free(b);
+    }
+    pthread_cond_destroy(&ts->worker_cond);
+    pthread_mutex_destroy(&ts->worker_lock);
+    av_freep(&ts->workers);
+    ts->nb_workers = 0;
+}
+
+/**
+ * Queue the payload of a TS packet for the worker of its pid.
+ */
+static int workers_dispatch(MpegTSContext *ts, MpegTSFilter *filter,
+                            const uint8_t *buf, int len, int is_start,
+                            int random_access, int64_t pos)
+{
+    PESContext *pes = filter->u.pes_filter.opaque;
+    TSWorker *w;
+    TSWorkPacket *p;
+
+    /* streams are created and set up for probing in this thread */
+    if (!pes->st || pes->st->codec->codec_id == CODEC_ID_NONE)
+        return filter->u.pes_filter.pes_cb(filter, buf, len, is_start,
+                                           random_access, pos);
+
+    w = &ts->workers[ts->pid_worker[filter->pid]];
+    if (!w->pending) {
+        pthread_mutex_lock(&ts->worker_lock);
+        if ((w->pending = ts->free_batches))
+            ts->free_batches = w->pending->next;
+        pthread_mutex_unlock(&ts->worker_lock);
+        if (!w->pending && !(w->pending = av_malloc(sizeof(TSBatch))))
+            return AVERROR(ENOMEM);
+        w->pending->nb = 0;
+    }
+    p = &w->pending->pkts[w->pending->nb++];
+    p->filter   = filter;
+    p->pos      = pos;
+    p->is_start = is_start;
+    p->random_access = random_access;
+    p->len      = len;
+    memcpy(p->data, buf, len);
+    if (w->pending->nb == TS_WORKER_BATCH)
+        worker_submit(ts, w);
+    return 0;
+}
+
+/**
+ * Hand the partial batches to the idle workers.
+ * @return non zero if packets were assembled or a worker failed
+ */
+static int workers_poll(MpegTSContext *ts)
+{
+    int i, ready;
+
+    pthread_mutex_lock(&ts->worker_lock);
+    for (i = 0; i < ts->nb_workers; i++) {
+        TSWorker *w = &ts->workers[i];
+        if (w->pending && !w->nb_queued)
+            worker_queue(ts, w);
+    }
+    ready = ts->out_first || ts->worker_error;
+    pthread_mutex_unlock(&ts->worker_lock);
+    return ready;
+}
+#endif
+
+/**
+ * Handle one TS packet.
+ * @param pos position in the file right after the packet
+ */
+/* return the 90kHz PCR and the extension for the 27MHz PCR. return
+   (-1) if not available */
+static int parse_pcr(int64_t *ppcr_high, int *ppcr_low,
+                     const uint8_t *packet)
+{
+    int afc, len, flags;
+    const uint8_t *p;
+    unsigned int v;
+
+    afc = (packet[3] >> 4) & 3;
+    if (afc <= 1)
+        return -1;
+    p = packet + 4;
+    len = p[0];
+    p++;
+    if (len == 0)
+        return -1;
+    flags = *p++;
+    len--;
+    if (!(flags & 0x10))
+        return -1;
+    if (len < 6)
+        return -1;
+    v = AV_RB32(p);
+    *ppcr_high = ((int64_t)v << 1) | (p[4] >> 7);
+    *ppcr_low = ((p[4] & 1) << 8) | p[5];
+    return 0;
+}
+
+static int handle_packet(MpegTSContext *ts, const uint8_t *packet, int64_t pos)
 {
-    AVFormatContext *s = ts->stream;
     MpegTSFilter *tss;
-    int len, pid, cc, cc_ok, afc, is_start;
+    int len, pid, cc, cc_ok, afc, is_start, random_access = 0, i, pcr_l;
+    int64_t pcr_h;
     const uint8_t *p, *p_end;
-    int64_t pos;
 
     pid = AV_RB16(packet + 1) & 0x1fff;
-    if(pid && discard_pid(ts, pid))
+    if (ts->pid_action_dirty)
+        update_pid_actions(ts);
+    if (ts->pid_action[pid] == PID_DISCARD)
         return 0;
+    if ((ts->stream->flags & AVFMT_FLAG_CLOCK_RECOVERY) && (packet[3] & 0x20) &&
+        parse_pcr(&pcr_h, &pcr_l, packet) == 0) {
+        int64_t arrival = AV_NOPTS_VALUE;
+        /* packetized input reads one datagram per refill, so the arrival
+         * of the last one is that of the packets in the buffer */
+        if (ts->stream->pb->max_packet_size)
+            arrival = ff_udp_get_arrival_time(url_fileno(ts->stream->pb));
+        if (arrival == AV_NOPTS_VALUE)
+            arrival = av_gettime();
+        for (i = 0; i < ts->nb_prg; i++)
+            if (ts->prg[i].pcr_pid == pid)
+                ff_clock_recovery_update(ts->stream, ts->prg[i].id, -1,
+                                         pcr_h * 300 + pcr_l, (AVRational){1, 27000000},
+                                         (1LL << 33) * 300, arrival);
+    }
     is_start = packet[1] & 0x40;
     tss = ts->pids[pid];
     if (ts->auto_guess && tss == NULL && is_start) {
@@ -1156,6 +1756,7 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     if (afc == 2) /* adaptation field only */
         return 0;
     if (afc == 3) {
+        random_access = p[0] && (p[1] & 0x40);
         /* skip adapation field */
         p += p[0] + 1;
     }
@@ -1164,7 +1765,6 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     if (p >= p_end)
         return 0;
 
-    pos = url_ftell(ts->stream->pb);
     ts->pos47= pos % ts->raw_packet_size;
 
     if (tss->type == MPEGTS_SECTION) {
@@ -1175,7 +1775,7 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
                 return 0;
             if (len && cc_ok) {
                 /* write remaining section bytes */
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, len, 0);
                 /* check whether filter has been closed */
                 if (!ts->pids[pid])
@@ -1183,19 +1783,24 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
             }
             p += len;
             if (p < p_end) {
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, p_end - p, 1);
             }
         } else {
             if (cc_ok) {
-                write_section_data(s, tss,
+                write_section_data(ts, tss,
                                    p, p_end - p, 0);
             }
         }
     } else {
         int ret;
+#if HAVE_PTHREADS
+        if (ts->nb_workers)
+            return workers_dispatch(ts, tss, p, p_end - p, is_start,
+                                    random_access, pos - ts->raw_packet_size);
+#endif
         // Note: The position here points actually behind the current packet.
-        if ((ret = tss->u.pes_filter.pes_cb(tss, p, p_end - p, is_start,
+        if ((ret = tss->u.pes_filter.pes_cb(tss, p, p_end - p, is_start, random_access,
                                             pos - ts->raw_packet_size)) < 0)
             return ret;
     }
@@ -1203,73 +1808,148 @@ static int handle_packet(MpegTSContext *ts, const uint8_t *packet)
     return 0;
 }
 
-/* XXX: try to find a better synchro over several packets (use
-   get_packet_size() ?) */
-static int mpegts_resync(AVFormatContext *s)
+/**
+ * Skip to the next sync byte that is followed by another one a packet
+ * later, scanning the I/O buffer with memchr(). A sync byte too close to
+ * the end of the available data to be checked is accepted on its own.
+ */
+/**
+ * Skip to the next sync byte followed by another one a packet later.
+ * @return 0 if found, AVERROR_WORK_LIMIT once more than max_resync_size
+ *         bytes were skipped since sync was lost, -1 if not found
+ */
+static int mpegts_resync(AVFormatContext *s, int raw_packet_size)
 {
+    MpegTSContext *ts = s->priv_data;
     ByteIOContext *pb = s->pb;
-    int c, i;
+    const uint8_t *data, *p, *end;
+    int len, ret, scanned = 0, max_scan = MAX_RESYNC_SIZE;
 
-    for(i = 0;i < MAX_RESYNC_SIZE; i++) {
-        c = url_fgetc(pb);
-        if (c < 0)
+    if (s->max_resync_size) {
+        if (ts->resync_skipped >= s->max_resync_size) {
+            av_log(s, AV_LOG_ERROR, "Resync limit of %d bytes reached\n", s->max_resync_size);
+            return AVERROR_WORK_LIMIT;
+        }
+        max_scan = FFMIN(max_scan, s->max_resync_size - ts->resync_skipped);
+    }
+    if ((ret = ff_check_work_time(s)) < 0)
+        return ret;
+
+    while (scanned < max_scan) {
+        len = url_fpeek(pb, &data, FFMIN(pb->buffer_size, max_scan - scanned +
+                                         raw_packet_size + 1));
+        if (len <= 0)
             return -1;
-        if (c == 0x47) {
-            url_fseek(pb, -1, SEEK_CUR);
-            return 0;
+        end = data + len;
+        for (p = data; (p = memchr(p, 0x47, end - p)); p++) {
+            if (p + raw_packet_size < end && p[raw_packet_size] != 0x47)
+                continue;
+            if (p + raw_packet_size < end || p == data) {
+                url_fskip(pb, p - data);
+                ts->resync_skipped = 0;
+                return 0;
+            }
+            /* get the following packet into the buffer to check it */
+            break;
         }
+        if (!p)
+            p = end;
+        url_fskip(pb, p - data);
+        scanned += p - data;
     }
+    ts->resync_skipped += scanned;
     av_log(s, AV_LOG_ERROR, "max resync size reached, could not find sync byte\n");
     /* no sync found */
     return -1;
 }
 
-/* return -1 if error or EOF. Return 0 if OK. */
-static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size)
+/* return -1 if error or EOF. Return 0 if OK.
+ * *data is set to the packet, which either lies in the I/O buffer or has
+ * been copied to buf (TS_MAX_PACKET_SIZE bytes). It is valid until the next
+ * read from s->pb. */
+static int read_packet(AVFormatContext *s, uint8_t *buf, int raw_packet_size,
+                       const uint8_t **data)
 {
     ByteIOContext *pb = s->pb;
-    int skip, len;
+    int len;
 
     for(;;) {
-        len = get_buffer(pb, buf, TS_PACKET_SIZE);
-        if (len != TS_PACKET_SIZE)
-            return AVERROR(EIO);
-        /* check paquet sync byte */
-        if (buf[0] != 0x47) {
-            /* find a new packet start */
-            url_fseek(pb, -TS_PACKET_SIZE, SEEK_CUR);
-            if (mpegts_resync(s) < 0)
-                return AVERROR(EAGAIN);
-            else
-                continue;
-        } else {
-            skip = raw_packet_size - TS_PACKET_SIZE;
-            if (skip > 0)
-                url_fskip(pb, skip);
+        len = url_fpeek(pb, data, raw_packet_size);
+        if (len == raw_packet_size && (*data)[0] == 0x47) {
+            url_fskip(pb, raw_packet_size);
             break;
         }
+        if (len != raw_packet_size) {
+            /* the packet straddles a packetized buffer boundary */
+            len = get_buffer(pb, buf, raw_packet_size);
+            if (len != raw_packet_size)
+                return AVERROR(EIO);
+            *data = buf;
+            if (buf[0] == 0x47)
+                break;
+            url_fseek(pb, -raw_packet_size, SEEK_CUR);
+        }
+        /* find a new packet start */
+        if ((len = mpegts_resync(s, raw_packet_size)) < 0)
+            return len == AVERROR_WORK_LIMIT ? len : AVERROR(EAGAIN);
     }
     return 0;
 }
 
+/* max number of TS packets handled per look at the I/O buffer */
+#define TS_BATCH_PACKETS 64
+
 static int handle_packets(MpegTSContext *ts, int nb_packets)
 {
     AVFormatContext *s = ts->stream;
-    uint8_t packet[TS_PACKET_SIZE];
-    int packet_num, ret;
+    ByteIOContext *pb = s->pb;
+    uint8_t packet_buf[TS_MAX_PACKET_SIZE];
+    const uint8_t *packet, *data;
+    int packet_num, ret, len, i;
+    const int raw_packet_size = ts->raw_packet_size;
+    int64_t pos;
 
     ts->stop_parse = 0;
     packet_num = 0;
+    check_discard(ts);
     for(;;) {
         if (ts->stop_parse>0)
             break;
+#if HAVE_PTHREADS
+        if (ts->nb_workers && workers_poll(ts))
+            break;
+#endif
+
+        /* handle the whole packets in the I/O buffer in place, consuming
+         * them together afterwards */
+        len = url_fpeek(pb, &data, TS_BATCH_PACKETS * raw_packet_size);
+        pos = url_ftell(pb);
+        for (i = 0; i + raw_packet_size <= len && data[0] == 0x47 && ts->stop_parse <= 0; i += raw_packet_size) {
+            packet_num++;
+            if (nb_packets != 0 && packet_num >= nb_packets) {
+                url_fskip(pb, i);
+                return 0;
+            }
+            ret = handle_packet(ts, data, pos + i + raw_packet_size);
+            data += raw_packet_size;
+            if (ret != 0) {
+                url_fskip(pb, i + raw_packet_size);
+                return ret;
+            }
+        }
+        if (i) {
+            url_fskip(pb, i);
+            continue;
+        }
+
+        /* packet at the end of the buffer, or lost synchronization */
         packet_num++;
         if (nb_packets != 0 && packet_num >= nb_packets)
             break;
-        ret = read_packet(s, packet, ts->raw_packet_size);
+        ret = read_packet(s, packet_buf, raw_packet_size, &packet);
         if (ret != 0)
             return ret;
-        ret = handle_packet(ts, packet);
+        ret = handle_packet(ts, packet, url_ftell(pb));
         if (ret != 0)
             return ret;
     }
@@ -1306,42 +1986,13 @@ static int mpegts_probe(AVProbeData *p)
 #endif
 }
 
-/* return the 90kHz PCR and the extension for the 27MHz PCR. return
-   (-1) if not available */
-static int parse_pcr(int64_t *ppcr_high, int *ppcr_low,
-                     const uint8_t *packet)
-{
-    int afc, len, flags;
-    const uint8_t *p;
-    unsigned int v;
-
-    afc = (packet[3] >> 4) & 3;
-    if (afc <= 1)
-        return -1;
-    p = packet + 4;
-    len = p[0];
-    p++;
-    if (len == 0)
-        return -1;
-    flags = *p++;
-    len--;
-    if (!(flags & 0x10))
-        return -1;
-    if (len < 6)
-        return -1;
-    v = AV_RB32(p);
-    *ppcr_high = ((int64_t)v << 1) | (p[4] >> 7);
-    *ppcr_low = ((p[4] & 1) << 8) | p[5];
-    return 0;
-}
-
 static int mpegts_read_header(AVFormatContext *s,
                               AVFormatParameters *ap)
 {
     MpegTSContext *ts = s->priv_data;
     ByteIOContext *pb = s->pb;
     uint8_t buf[5*1024];
-    int len;
+    int len, i;
     int64_t pos;
 
     if (ap) {
@@ -1362,6 +2013,9 @@ static int mpegts_read_header(AVFormatContext *s,
         goto fail;
     ts->stream = s;
     ts->auto_guess = 0;
+    ts->single_program = !!(s->flags & AVFMT_FLAG_SINGLE_PROGRAM);
+    for (i = 0; i < MAX_STREAMS; i++)
+        ts->index_pos[i] = -1;
 
     if (s->iformat == &mpegts_demuxer) {
         /* normal demux */
@@ -1369,14 +2023,18 @@ static int mpegts_read_header(AVFormatContext *s,
         /* first do a scaning to get all the services */
         url_fseek(pb, pos, SEEK_SET);
 
-        mpegts_open_section_filter(ts, SDT_PID, sdt_cb, ts, 1);
+        /* a single program feed is locked onto its first PMT, which
+           ends the scan, no service names are needed */
+        if (!ts->single_program)
+            mpegts_open_section_filter(ts, SDT_PID, sdt_cb, ts, 1);
 
         mpegts_open_section_filter(ts, PAT_PID, pat_cb, ts, 1);
 
         handle_packets(ts, s->probesize / ts->raw_packet_size);
         /* if could not find service, enable auto_guess */
 
-        ts->auto_guess = 1;
+        if (!ts->single_program)
+            ts->auto_guess = 1;
 
         dprintf(ts->stream, "tuning done\n");
 
@@ -1386,7 +2044,8 @@ static int mpegts_read_header(AVFormatContext *s,
         int pcr_pid, pid, nb_packets, nb_pcrs, ret, pcr_l;
         int64_t pcrs[2], pcr_h;
         int packet_count[2];
-        uint8_t packet[TS_PACKET_SIZE];
+        uint8_t packet_buf[TS_MAX_PACKET_SIZE];
+        const uint8_t *packet;
 
         /* only read packets */
 
@@ -1402,7 +2061,7 @@ static int mpegts_read_header(AVFormatContext *s,
         nb_pcrs = 0;
         nb_packets = 0;
         for(;;) {
-            ret = read_packet(s, packet, ts->raw_packet_size);
+            ret = read_packet(s, packet_buf, ts->raw_packet_size, &packet);
             if (ret < 0)
                 return -1;
             pid = AV_RB16(packet + 1) & 0x1fff;
@@ -1447,15 +2106,18 @@ static int mpegts_raw_read_packet(AVFormatContext *s,
     int64_t pcr_h, next_pcr_h, pos;
     int pcr_l, next_pcr_l;
     uint8_t pcr_buf[12];
+    uint8_t packet_buf[TS_MAX_PACKET_SIZE];
+    const uint8_t *packet;
 
     if (av_new_packet(pkt, TS_PACKET_SIZE) < 0)
         return AVERROR(ENOMEM);
     pkt->pos= url_ftell(s->pb);
-    ret = read_packet(s, pkt->data, ts->raw_packet_size);
+    ret = read_packet(s, packet_buf, ts->raw_packet_size, &packet);
     if (ret < 0) {
         av_free_packet(pkt);
         return ret;
     }
+    memcpy(pkt->data, packet, TS_PACKET_SIZE);
     if (ts->mpeg2ts_compute_pcr) {
         /* compute exact PCR for each packet */
         if (parse_pcr(&pcr_h, &pcr_l, pkt->data) == 0) {
@@ -1483,6 +2145,44 @@ static int mpegts_raw_read_packet(AVFormatContext *s,
     return 0;
 }
 
+/**
+ * Add the keyframe or audio packet starting at a PES header to the index of
+ * its stream. An entry read on from the previous keyframe gets the
+ * distance to it, so that seeks between the two need no search.
+ */
+static void index_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    MpegTSContext *ts = s->priv_data;
+    AVStream *st = s->streams[pkt->stream_index];
+    int64_t timestamp = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    int64_t *last_pos = &ts->index_pos[pkt->stream_index];
+    int nb_entries = ff_index_nb_entries(st), distance = 0;
+
+    if (timestamp == AV_NOPTS_VALUE || pkt->pos < 0)
+        return;
+    if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
+        /* every audio frame is a keyframe, keep an entry per second */
+        if (nb_entries && ff_index_get_entry(st, nb_entries - 1)->timestamp >
+            timestamp - av_rescale(1, st->time_base.den, st->time_base.num))
+            return;
+        *last_pos = -1;
+    } else if (!(pkt->flags & PKT_FLAG_KEY))
+        return;
+    if (nb_entries) {
+        const AVIndexEntry *e = ff_index_get_entry(st, nb_entries - 1);
+        /* timestamp discontinuity or wraparound */
+        if (e->pos < pkt->pos && e->timestamp >= timestamp) {
+            *last_pos = -1;
+            return;
+        }
+    }
+    if (*last_pos >= 0 && *last_pos < pkt->pos)
+        distance = FFMIN(pkt->pos - *last_pos, INT_MAX);
+    ff_reduce_index(s, st->index);
+    av_add_index_entry(st, pkt->pos, timestamp, 0, distance, AVINDEX_KEYFRAME);
+    *last_pos = pkt->pos;
+}
+
 static int mpegts_read_packet(AVFormatContext *s,
                               AVPacket *pkt)
 {
@@ -1491,18 +2191,53 @@ static int mpegts_read_packet(AVFormatContext *s,
 
     if (url_ftell(s->pb) != ts->last_pos) {
         /* seek detected, flush pes buffer */
+#if HAVE_PTHREADS
+        if (ts->nb_workers)
+            workers_flush(ts);
+#endif
+        for (i = 0; i < MAX_STREAMS; i++)
+            ts->index_pos[i] = -1;
         for (i = 0; i < NB_PID_MAX; i++) {
             if (ts->pids[i] && ts->pids[i]->type == MPEGTS_PES) {
                 PESContext *pes = ts->pids[i]->u.pes_filter.opaque;
-                av_freep(&pes->buffer);
+                pes_free_buffer(pes);
                 pes->data_index = 0;
                 pes->state = MPEGTS_SKIP; /* skip until pes header */
             }
         }
     }
 
+#if HAVE_PTHREADS
+    if (s->program_threads > 0 && !ts->workers_started &&
+        workers_start(ts, s->program_threads) < 0)
+        av_log(s, AV_LOG_WARNING, "Could not start the program threads\n");
+    if (ts->nb_workers) {
+        ret = 0;
+        while (!workers_get_packet(ts, pkt)) {
+            if (ret < 0)
+                goto flush;
+            ret = handle_packets(ts, 0);
+            if (ret >= 0 && workers_get_packet(ts, pkt))
+                break;
+            /* end of input or a failed worker, wait for the packets
+               still being assembled */
+            workers_sync(ts);
+            if (ret >= 0) {
+                ret = ts->worker_error;
+                ts->worker_error = 0;
+            }
+        }
+        index_packet(s, pkt);
+        ts->last_pos = url_ftell(s->pb);
+        return 0;
+    }
+#endif
+
     ts->pkt = pkt;
     ret = handle_packets(ts, 0);
+#if HAVE_PTHREADS
+ flush:
+#endif
     if (ret < 0) {
         /* flush pes data left */
         for (i = 0; i < NB_PID_MAX; i++) {
@@ -1517,6 +2252,8 @@ static int mpegts_read_packet(AVFormatContext *s,
             }
         }
     }
+    if (!ret && (unsigned)pkt->stream_index < s->nb_streams)
+        index_packet(s, pkt);
 
     ts->last_pos = url_ftell(s->pb);
 
@@ -1528,7 +2265,11 @@ static int mpegts_read_close(AVFormatContext *s)
     MpegTSContext *ts = s->priv_data;
     int i;
 
+#if HAVE_PTHREADS
+    workers_stop(ts);
+#endif
     clear_programs(ts);
+    av_freep(&ts->prog_discard);
 
     for(i=0;i<NB_PID_MAX;i++)
         if (ts->pids[i]) mpegts_close_filter(ts, ts->pids[i]);
@@ -1713,6 +2454,7 @@ int mpegts_parse_packet(MpegTSContext *ts, AVPacket *pkt,
     len1 = len;
     ts->pkt = pkt;
     ts->stop_parse = 0;
+    check_discard(ts);
     for(;;) {
         if (ts->stop_parse>0)
             break;
@@ -1722,7 +2464,7 @@ int mpegts_parse_packet(MpegTSContext *ts, AVPacket *pkt,
             buf++;
             len--;
         } else {
-            handle_packet(ts, buf);
+            handle_packet(ts, buf, url_ftell(ts->stream->pb));
             buf += TS_PACKET_SIZE;
             len -= TS_PACKET_SIZE;
         }
@@ -1736,6 +2478,7 @@ void mpegts_parse_close(MpegTSContext *ts)
 
     for(i=0;i<NB_PID_MAX;i++)
         av_free(ts->pids[i]);
+    av_free(ts->prog_discard);
     av_free(ts);
 }
 
@@ -56,4 +56,12 @@
 #define STREAM_TYPE_AUDIO_AC3       0x81
 #define STREAM_TYPE_AUDIO_DTS       0x8a
 
+/**
+ * Make the MPEG-TS muxer s go on writing to pb, e.g. for the next segment
+ * of a stream. The packets buffered for the old output are written to it
+ * first, and the new one starts with the SDT, PAT and PMT and with a PCR,
+ * keeping the continuity counters.
+ */
+int ff_mpegts_switch_output(AVFormatContext *s, ByteIOContext *pb);
+
 #endif /* AVFORMAT_MPEGTS_H */
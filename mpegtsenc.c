@@ -21,8 +21,10 @@
 
 #include "libavutil/bswap.h"
 #include "libavutil/crc.h"
+#include "libavutil/avstring.h"
 #include "libavcodec/mpegvideo.h"
 #include "avformat.h"
+#include "internal.h"
 #include "mpegts.h"
 
 /* write DVB SI sections */
@@ -30,11 +32,17 @@
 /*********************************************/
 /* mpegts section writer */
 
+/* a section of at most 1024 bytes fits in 6 TS packets */
+#define MAX_SECTION_PACKETS 6
+
 typedef struct MpegTSSection {
     int pid;
     int cc;
     void (*write_packet)(struct MpegTSSection *s, const uint8_t *packet);
     void *opaque;
+    /** TS packets of the last section written, resent with new cc values */
+    uint8_t packets[MAX_SECTION_PACKETS][TS_PACKET_SIZE];
+    int nb_packets;
 } MpegTSSection;
 
 typedef struct MpegTSService {
@@ -60,37 +68,117 @@ typedef struct MpegTSWrite {
     int tsid;
     uint64_t cur_pcr;
     int mux_rate;
+
+    /* constant bitrate scheduling, used when a mux rate is given */
+    int cbr;
+    int64_t nb_packets;     ///< TS packets written, the clock of the cbr mode
+    int burst;              ///< TS packets per output packet, 0 if not packetized
+    int64_t last_pcr, last_pat, last_sdt; ///< 27 MHz time they were last sent
+
+    /* the TS packets are built in place in an output block, handed to the
+       output as a whole once full */
+    uint8_t *block;
+    int block_size;         ///< TS packets per block
+    int block_fill;         ///< TS packets in the block
+    int packetized;         ///< each full block is sent as one output packet
 } MpegTSWrite;
 
+/* 1024 TS packets are 47 times 4096 bytes */
+#define TS_BLOCK_PACKETS 1024
+#define TS_BURST_PACKETS 7  ///< TS packets per IP datagram
+
+/**
+ * Return the place of the next TS packet in the output block, the packet
+ * is written there and committed with ts_packet_done().
+ */
+static uint8_t *ts_get_packet(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+
+    return ts->block + ts->block_fill * TS_PACKET_SIZE;
+}
+
+/* hand the TS packets of the output block to the output */
+static void ts_write_block(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+
+    if (ts->block_fill) {
+        put_buffer(s->pb, ts->block, ts->block_fill * TS_PACKET_SIZE);
+        ts->block_fill = 0;
+    }
+}
+
+static void ts_flush(AVFormatContext *s)
+{
+    ts_write_block(s);
+    put_flush_packet(s->pb);
+}
+
+/**
+ * Commit the TS packet written at ts_get_packet(). A full block goes to
+ * the output, as one output packet if the output is packetized.
+ */
+static void ts_packet_done(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+
+    ts->nb_packets++;
+    if (++ts->block_fill == ts->block_size) {
+        if (ts->packetized)
+            ts_flush(s);
+        else
+            ts_write_block(s);
+    }
+}
+
+static void ts_write_packet(AVFormatContext *s, const uint8_t *packet)
+{
+    memcpy(ts_get_packet(s), packet, TS_PACKET_SIZE);
+    ts_packet_done(s);
+}
+
+/* send the cached packets of a section, with the next continuity counters */
+static void mpegts_send_section(MpegTSSection *s)
+{
+    MpegTSWrite *ts = ((AVFormatContext*)s->opaque)->priv_data;
+    int i;
+
+    for (i = 0; i < s->nb_packets; i++) {
+        s->packets[i][3] = 0x10 | s->cc;
+        s->cc = (s->cc + 1) & 0xf;
+        s->write_packet(s, s->packets[i]);
+        ts->cur_pcr += TS_PACKET_SIZE*8*90000LL/ts->mux_rate;
+    }
+}
+
 /* NOTE: 4 bytes must be left at the end for the crc32 */
 static void mpegts_write_section(MpegTSSection *s, uint8_t *buf, int len)
 {
-    MpegTSWrite *ts = ((AVFormatContext*)s->opaque)->priv_data;
     unsigned int crc;
-    unsigned char packet[TS_PACKET_SIZE];
     const unsigned char *buf_ptr;
-    unsigned char *q;
+    unsigned char *packet, *q;
     int first, b, len1, left;
 
-    crc = bswap_32(av_crc(av_crc_get_table(AV_CRC_32_IEEE), -1, buf, len - 4));
+    crc = bswap_32(ff_crc32_ieee(-1, buf, len - 4));
     buf[len - 4] = (crc >> 24) & 0xff;
     buf[len - 3] = (crc >> 16) & 0xff;
     buf[len - 2] = (crc >> 8) & 0xff;
     buf[len - 1] = (crc) & 0xff;
 
-    /* send each packet */
+    /* packetize, the continuity counters are set when sending */
     buf_ptr = buf;
+    s->nb_packets = 0;
     while (len > 0) {
         first = (buf == buf_ptr);
-        q = packet;
+        q = packet = s->packets[s->nb_packets++];
         *q++ = 0x47;
         b = (s->pid >> 8);
         if (first)
             b |= 0x40;
         *q++ = b;
         *q++ = s->pid;
-        *q++ = 0x10 | s->cc;
-        s->cc = (s->cc + 1) & 0xf;
+        *q++ = 0x10;
         if (first)
             *q++ = 0; /* 0 offset */
         len1 = TS_PACKET_SIZE - (q - packet);
@@ -103,13 +191,10 @@ static void mpegts_write_section(MpegTSSection *s, uint8_t *buf, int len)
         if (left > 0)
             memset(q, 0xff, left);
 
-        s->write_packet(s, packet);
-
         buf_ptr += len1;
         len -= len1;
-
-        ts->cur_pcr += TS_PACKET_SIZE*8*90000LL/ts->mux_rate;
     }
+    mpegts_send_section(s);
 }
 
 static inline void put16(uint8_t **q_ptr, int val)
@@ -168,6 +253,16 @@ static int mpegts_write_section1(MpegTSSection *s, int tid, int id,
 #define PAT_RETRANS_TIME 100
 #define PCR_RETRANS_TIME 20
 
+/* PES packet waiting to be sent by the cbr scheduler */
+typedef struct PESQueue {
+    struct PESQueue *next;
+    int64_t dts;            ///< 90 kHz decoding time, AV_NOPTS_VALUE if unknown
+    int size, pos;          ///< bytes in data, bytes already sent
+    uint8_t *data;          ///< PES header and payload
+} PESQueue;
+
+#define TB_SIZE 512         ///< size of the T-STD transport buffers
+
 typedef struct MpegTSWriteStream {
     struct MpegTSService *service;
     int pid; /* stream associated pid */
@@ -177,6 +272,12 @@ typedef struct MpegTSWriteStream {
     int64_t payload_pts;
     int64_t payload_dts;
     uint8_t payload[DEFAULT_PES_PAYLOAD_SIZE];
+
+    /* cbr mode */
+    PESQueue *queue, *queue_last;
+    int64_t tb_rate;        ///< bits/s leaving the transport buffer, 0 if unknown
+    int64_t tb_fullness;    ///< bits in the transport buffer at tb_time
+    int64_t tb_time;
 } MpegTSWriteStream;
 
 static void mpegts_write_pat(AVFormatContext *s)
@@ -186,6 +287,11 @@ static void mpegts_write_pat(AVFormatContext *s)
     uint8_t data[1012], *q;
     int i;
 
+    /* the services do not change after the header */
+    if (ts->pat.nb_packets) {
+        mpegts_send_section(&ts->pat);
+        return;
+    }
     q = data;
     for(i = 0; i < ts->nb_services; i++) {
         service = ts->services[i];
@@ -202,6 +308,10 @@ static void mpegts_write_pmt(AVFormatContext *s, MpegTSService *service)
     uint8_t data[1012], *q, *desc_length_ptr, *program_info_length_ptr;
     int val, stream_type, i;
 
+    if (service->pmt.nb_packets) {
+        mpegts_send_section(&service->pmt);
+        return;
+    }
     q = data;
     put16(&q, 0xe000 | service->pcr_pid);
 
@@ -321,6 +431,10 @@ static void mpegts_write_sdt(AVFormatContext *s)
     uint8_t data[1012], *q, *desc_list_len_ptr, *desc_len_ptr;
     int i, running_status, free_ca_mode, val;
 
+    if (ts->sdt.nb_packets) {
+        mpegts_send_section(&ts->sdt);
+        return;
+    }
     q = data;
     put16(&q, ts->onid);
     *q++ = 0xff;
@@ -374,7 +488,7 @@ static MpegTSService *mpegts_add_service(MpegTSWrite *ts,
 static void section_write_packet(MpegTSSection *s, const uint8_t *packet)
 {
     AVFormatContext *ctx = s->opaque;
-    put_buffer(ctx->pb, packet, TS_PACKET_SIZE);
+    ts_write_packet(ctx, packet);
 }
 
 static int mpegts_write_header(AVFormatContext *s)
@@ -387,6 +501,16 @@ static int mpegts_write_header(AVFormatContext *s)
     int i, total_bit_rate;
     const char *service_name;
     uint64_t sdt_size, pat_pmt_size, pos;
+    int max_packet_size = url_fget_max_packet_size(s->pb);
+
+    /* an output packet gets a whole number of TS packets */
+    if (max_packet_size >= TS_PACKET_SIZE) {
+        ts->block_size = FFMIN(max_packet_size / TS_PACKET_SIZE, TS_BURST_PACKETS);
+        ts->packetized = 1;
+    } else
+        ts->block_size = TS_BLOCK_PACKETS;
+    if (!(ts->block = av_malloc(ts->block_size * TS_PACKET_SIZE)))
+        return AVERROR(ENOMEM);
 
     ts->tsid = DEFAULT_TSID;
     ts->onid = DEFAULT_ONID;
@@ -461,15 +585,15 @@ static int mpegts_write_header(AVFormatContext *s)
 
     /* write info at the start of the file, so that it will be fast to
        find them */
-    pos = url_ftell(s->pb);
+    pos = ts->nb_packets;
     mpegts_write_sdt(s);
-    sdt_size = url_ftell(s->pb) - pos;
-    pos = url_ftell(s->pb);
+    sdt_size = (ts->nb_packets - pos) * TS_PACKET_SIZE;
+    pos = ts->nb_packets;
     mpegts_write_pat(s);
     for(i = 0; i < ts->nb_services; i++) {
         mpegts_write_pmt(s, ts->services[i]);
     }
-    pat_pmt_size = url_ftell(s->pb) - pos;
+    pat_pmt_size = (ts->nb_packets - pos) * TS_PACKET_SIZE;
 
     if (total_bit_rate <= 8 * 1024)
         total_bit_rate = 8 * 1024;
@@ -495,16 +619,39 @@ static int mpegts_write_header(AVFormatContext *s)
     // output a PCR as soon as possible
     service->pcr_packet_count = service->pcr_packet_period;
 
+    if (s->mux_rate) {
+        ts->cbr   = 1;
+        ts->burst = ts->packetized ? ts->block_size : 0;
+        ts->last_pcr = INT64_MIN / 2;
+        for (i = 0; i < s->nb_streams; i++) {
+            st = s->streams[i];
+            ts_st = st->priv_data;
+            /* transport buffer leak rates of the T-STD, 2.4.2.3 of 13818-1 */
+            if (st->codec->codec_type == CODEC_TYPE_VIDEO)
+                ts_st->tb_rate = FFMAX(st->codec->rc_max_rate, st->codec->bit_rate) * 6 / 5;
+            else if (st->codec->codec_type == CODEC_TYPE_AUDIO)
+                ts_st->tb_rate = 2000000;
+        }
+    }
+
     av_log(s, AV_LOG_DEBUG,
            "calculated bitrate %d bps, muxrate %d bps, "
            "sdt every %d, pat/pmt every %d pkts\n",
            total_bit_rate, ts->mux_rate, ts->sdt_packet_period,
            ts->pat_packet_period);
 
+#if CONFIG_UDP_PROTOCOL
+    /* a fixed mux rate means constant bitrate output, let udp: pace it */
+    if (s->mux_rate && av_strstart(s->filename, "udp:", NULL))
+        udp_set_bitrate(url_fileno(s->pb), s->mux_rate);
+#endif
+
     // adjust pcr
     ts->cur_pcr /= ts->mux_rate;
 
-    put_flush_packet(s->pb);
+    /* in bursts the tables go out with the first packets of data */
+    if (!ts->burst)
+        ts_flush(s);
 
     return 0;
 
@@ -513,6 +660,7 @@ static int mpegts_write_header(AVFormatContext *s)
         st = s->streams[i];
         av_free(st->priv_data);
     }
+    av_freep(&ts->block);
     return -1;
 }
 
@@ -539,8 +687,8 @@ static void retransmit_si_info(AVFormatContext *s)
 static void mpegts_insert_null_packet(AVFormatContext *s)
 {
     MpegTSWrite *ts = s->priv_data;
+    uint8_t *buf = ts_get_packet(s);
     uint8_t *q;
-    uint8_t buf[TS_PACKET_SIZE];
 
     q = buf;
     *q++ = 0x47;
@@ -548,18 +696,33 @@ static void mpegts_insert_null_packet(AVFormatContext *s)
     *q++ = 0xff;
     *q++ = 0x10;
     memset(q, 0x0FF, TS_PACKET_SIZE - (q - buf));
-    put_buffer(s->pb, buf, TS_PACKET_SIZE);
+    ts_packet_done(s);
     ts->cur_pcr += TS_PACKET_SIZE*8*90000LL/ts->mux_rate;
 }
 
+/**
+ * Write a 27 MHz PCR as its 90 kHz base and its extension.
+ */
+static void put_pcr(uint8_t *q, int64_t pcr)
+{
+    int64_t base = pcr / 300;
+    int ext = pcr % 300;
+
+    *q++ = base >> 25;
+    *q++ = base >> 17;
+    *q++ = base >> 9;
+    *q++ = base >> 1;
+    *q++ = (base & 1) << 7 | 0x7e | ext >> 8;
+    *q++ = ext;
+}
+
 /* Write a single transport stream packet with a PCR and no payload */
-static void mpegts_insert_pcr_only(AVFormatContext *s, AVStream *st)
+static void mpegts_insert_pcr_only(AVFormatContext *s, AVStream *st, int64_t pcr)
 {
     MpegTSWrite *ts = s->priv_data;
     MpegTSWriteStream *ts_st = st->priv_data;
+    uint8_t *buf = ts_get_packet(s);
     uint8_t *q;
-    uint64_t pcr = ts->cur_pcr;
-    uint8_t buf[TS_PACKET_SIZE];
 
     q = buf;
     *q++ = 0x47;
@@ -571,16 +734,12 @@ static void mpegts_insert_pcr_only(AVFormatContext *s, AVStream *st)
     *q++ = 0x10;               /* Adaptation flags: PCR present */
 
     /* PCR coded into 6 bytes */
-    *q++ = pcr >> 25;
-    *q++ = pcr >> 17;
-    *q++ = pcr >> 9;
-    *q++ = pcr >> 1;
-    *q++ = (pcr & 1) << 7;
-    *q++ = 0;
+    put_pcr(q, pcr);
+    q += 6;
 
     /* stuffing bytes */
     memset(q, 0xFF, TS_PACKET_SIZE - (q - buf));
-    put_buffer(s->pb, buf, TS_PACKET_SIZE);
+    ts_packet_done(s);
     ts->cur_pcr += TS_PACKET_SIZE*8*90000LL/ts->mux_rate;
 }
 
@@ -598,6 +757,280 @@ static void write_pts(uint8_t *q, int fourbits, int64_t pts)
     *q++ = val;
 }
 
+/**
+ * Write the PES header of a PES packet with payload_size bytes of payload.
+ * @return size of the header
+ */
+static int write_pes_header(AVStream *st, uint8_t *buf, int payload_size,
+                            int64_t pts, int64_t dts)
+{
+    uint8_t *q = buf;
+    int val, len, header_len, private_code, flags, pes_extension = 0;
+
+    /* write PES header */
+    *q++ = 0x00;
+    *q++ = 0x00;
+    *q++ = 0x01;
+    private_code = 0;
+    if (st->codec->codec_type == CODEC_TYPE_VIDEO) {
+        if (st->codec->codec_id == CODEC_ID_DIRAC) {
+            *q++ = 0xfd;
+        } else
+            *q++ = 0xe0;
+    } else if (st->codec->codec_type == CODEC_TYPE_AUDIO &&
+               (st->codec->codec_id == CODEC_ID_MP2 ||
+                st->codec->codec_id == CODEC_ID_MP3)) {
+        *q++ = 0xc0;
+    } else {
+        *q++ = 0xbd;
+        if (st->codec->codec_type == CODEC_TYPE_SUBTITLE) {
+            private_code = 0x20;
+        }
+    }
+    header_len = 0;
+    flags = 0;
+    if (pts != AV_NOPTS_VALUE) {
+        header_len += 5;
+        flags |= 0x80;
+    }
+    if (dts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && dts != pts) {
+        header_len += 5;
+        flags |= 0x40;
+    }
+    if (st->codec->codec_type == CODEC_TYPE_VIDEO &&
+        st->codec->codec_id == CODEC_ID_DIRAC) {
+        /* set PES_extension_flag */
+        pes_extension = 1;
+        flags |= 0x01;
+
+        /*
+        * One byte for PES2 extension flag +
+        * one byte for extension length +
+        * one byte for extension id
+        */
+        header_len += 3;
+    }
+    len = payload_size + header_len + 3;
+    if (private_code != 0)
+        len++;
+    if (len > 0xffff)
+        len = 0;
+    *q++ = len >> 8;
+    *q++ = len;
+    val = 0x80;
+    /* data alignment indicator is required for subtitle data */
+    if (st->codec->codec_type == CODEC_TYPE_SUBTITLE)
+        val |= 0x04;
+    *q++ = val;
+    *q++ = flags;
+    *q++ = header_len;
+    if (pts != AV_NOPTS_VALUE) {
+        write_pts(q, flags >> 6, pts);
+        q += 5;
+    }
+    if (dts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && dts != pts) {
+        write_pts(q, 1, dts);
+        q += 5;
+    }
+    if (pes_extension && st->codec->codec_id == CODEC_ID_DIRAC) {
+        flags = 0x01;  /* set PES_extension_flag_2 */
+        *q++ = flags;
+        *q++ = 0x80 | 0x01;  /* marker bit + extension length */
+        /*
+        * Set the stream id extension flag bit to 0 and
+        * write the extended stream id
+        */
+        *q++ = 0x00 | 0x60;
+    }
+    if (private_code != 0)
+        *q++ = private_code;
+    return q - buf;
+}
+
+/* largest header written by write_pes_header() */
+#define MAX_PES_HEADER_SIZE 24
+
+/**
+ * @return 27 MHz time at which TS packet number n starts in the cbr mode
+ */
+static int64_t cbr_clock(MpegTSWrite *ts, int64_t n)
+{
+    return av_rescale(n, TS_PACKET_SIZE * 8 * 27000000LL, ts->mux_rate);
+}
+
+/**
+ * Queue a PES packet for cbr_schedule().
+ */
+static int cbr_queue_pes(AVFormatContext *s, AVStream *st,
+                         const uint8_t *payload, int payload_size,
+                         int64_t pts, int64_t dts)
+{
+    MpegTSWriteStream *ts_st = st->priv_data;
+    PESQueue *pes = av_malloc(sizeof(PESQueue) + MAX_PES_HEADER_SIZE + payload_size);
+
+    if (!pes)
+        return AVERROR(ENOMEM);
+    pes->next = NULL;
+    pes->dts  = dts != AV_NOPTS_VALUE ? dts : pts;
+    pes->pos  = 0;
+    pes->data = (uint8_t *)(pes + 1);
+    pes->size = write_pes_header(st, pes->data, payload_size, pts, dts);
+    memcpy(pes->data + pes->size, payload, payload_size);
+    pes->size += payload_size;
+    ff_buffer_memory_add(s, pes->size);
+    if (ts_st->queue_last)
+        ts_st->queue_last->next = pes;
+    else
+        ts_st->queue = pes;
+    ts_st->queue_last = pes;
+    return 0;
+}
+
+/**
+ * @return nonzero if the next TS packet of the stream would overflow its
+ *         transport buffer at time t
+ */
+static int cbr_tb_full(MpegTSWriteStream *ts_st, int64_t t)
+{
+    if (!ts_st->tb_rate)
+        return 0;
+    ts_st->tb_fullness = FFMAX(ts_st->tb_fullness -
+                               av_rescale(t - ts_st->tb_time, ts_st->tb_rate, 27000000), 0);
+    ts_st->tb_time = t;
+    return ts_st->tb_fullness + TS_PACKET_SIZE * 8 > TB_SIZE * 8;
+}
+
+/**
+ * Send the next TS packet of the PES packet at the head of the queue of
+ * st, with a PCR if pcr is not negative.
+ */
+static void cbr_write_stream_packet(AVFormatContext *s, AVStream *st, int64_t pcr)
+{
+    MpegTSWrite *ts = s->priv_data;
+    MpegTSWriteStream *ts_st = st->priv_data;
+    PESQueue *pes = ts_st->queue;
+    uint8_t *buf = ts_get_packet(s);
+    int header_len = 4, len, stuffing_len;
+
+    if (!pes->pos && pes->dts != AV_NOPTS_VALUE &&
+        pes->dts * 300 < cbr_clock(ts, ts->nb_packets))
+        av_log(s, AV_LOG_WARNING, "dts < pcr, TS is invalid\n");
+    buf[0] = 0x47;
+    buf[1] = ts_st->pid >> 8 | (pes->pos ? 0 : 0x40);
+    buf[2] = ts_st->pid;
+    buf[3] = 0x10 | ts_st->cc;
+    ts_st->cc = (ts_st->cc + 1) & 0xf;
+    if (pcr >= 0) {
+        buf[3] |= 0x20;
+        buf[4] = 7;     /* AFC length */
+        buf[5] = 0x10;  /* flags: PCR present */
+        put_pcr(buf + 6, pcr);
+        header_len = 12;
+    }
+    len = FFMIN(TS_PACKET_SIZE - header_len, pes->size - pes->pos);
+    stuffing_len = TS_PACKET_SIZE - header_len - len;
+    if (stuffing_len > 0) {
+        if (buf[3] & 0x20) {
+            buf[4] += stuffing_len;
+        } else {
+            buf[3] |= 0x20;
+            buf[4] = stuffing_len - 1;
+            if (stuffing_len >= 2)
+                buf[5] = 0x00;
+            header_len += FFMIN(stuffing_len, 2);
+            stuffing_len -= FFMIN(stuffing_len, 2);
+        }
+        memset(buf + header_len, 0xff, stuffing_len);
+        header_len += stuffing_len;
+    }
+    memcpy(buf + header_len, pes->data + pes->pos, len);
+    pes->pos += len;
+    if (pes->pos == pes->size) {
+        if (!(ts_st->queue = pes->next))
+            ts_st->queue_last = NULL;
+        ff_buffer_memory_add(s, -pes->size);
+        av_free(pes);
+    }
+    ts_st->tb_fullness += TS_PACKET_SIZE * 8;
+    ts_packet_done(s);
+}
+
+/**
+ * Fill the TS packet slots of the mux rate timeline up to time until, or
+ * until all queued PES packets are sent if drain is set. Each slot gets
+ * the tables or a PCR when due, else the next packet of the stream with
+ * the earliest decoding time among those whose data may enter the T-STD,
+ * else a null packet.
+ */
+static void cbr_schedule(AVFormatContext *s, int64_t until, int drain)
+{
+    MpegTSWrite *ts = s->priv_data;
+    MpegTSService *service = ts->services[0];
+    const int64_t delay = av_rescale(s->max_delay, 27000000, AV_TIME_BASE);
+    int i;
+
+    for (;;) {
+        int64_t t = cbr_clock(ts, ts->nb_packets);
+        AVStream *best = NULL;
+        int64_t best_dts = INT64_MAX;
+        int queued = 0;
+
+        if (!drain && t >= until)
+            break;
+        if (t - ts->last_sdt >= SDT_RETRANS_TIME * 27000LL) {
+            ts->last_sdt = t;
+            mpegts_write_sdt(s);
+            continue;
+        }
+        if (t - ts->last_pat >= PAT_RETRANS_TIME * 27000LL) {
+            ts->last_pat = t;
+            mpegts_write_pat(s);
+            for (i = 0; i < ts->nb_services; i++)
+                mpegts_write_pmt(s, ts->services[i]);
+            continue;
+        }
+
+        for (i = 0; i < s->nb_streams; i++) {
+            MpegTSWriteStream *ts_st = s->streams[i]->priv_data;
+            PESQueue *pes = ts_st->queue;
+            int64_t dts;
+
+            if (!pes)
+                continue;
+            queued = 1;
+            dts = pes->dts != AV_NOPTS_VALUE ? pes->dts * 300 : t;
+            /* data enters the T-STD at most max_delay before its decoding */
+            if ((!drain && dts - delay > t) || cbr_tb_full(ts_st, t))
+                continue;
+            if (dts < best_dts) {
+                best     = s->streams[i];
+                best_dts = dts;
+            }
+        }
+        if (drain && !queued)
+            break;
+
+        if (t - ts->last_pcr >= PCR_RETRANS_TIME * 27000LL) {
+            /* the PCR references the arrival of its last base byte */
+            int64_t pcr = t + av_rescale(11 * 8, 27000000, ts->mux_rate);
+
+            ts->last_pcr = t;
+            if (best && ((MpegTSWriteStream *)best->priv_data)->pid == service->pcr_pid) {
+                cbr_write_stream_packet(s, best, pcr);
+            } else {
+                for (i = 0; i < s->nb_streams; i++)
+                    if (((MpegTSWriteStream *)s->streams[i]->priv_data)->pid == service->pcr_pid)
+                        mpegts_insert_pcr_only(s, s->streams[i], pcr);
+            }
+            continue;
+        }
+        if (best)
+            cbr_write_stream_packet(s, best, -1);
+        else
+            mpegts_insert_null_packet(s);
+    }
+}
+
 /* Add a pes header to the front of payload, and segment into an integer number of
  * ts packets. The final ts packet is padded using an over-sized adaptation header
  * to exactly fill the last ts packet.
@@ -609,13 +1042,19 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
 {
     MpegTSWriteStream *ts_st = st->priv_data;
     MpegTSWrite *ts = s->priv_data;
-    uint8_t buf[TS_PACKET_SIZE];
+    uint8_t *buf;
     uint8_t *q;
-    int val, is_start, len, header_len, write_pcr, private_code, flags;
+    int val, is_start, len, header_len, write_pcr;
     int afc_len, stuffing_len;
     int64_t pcr = -1; /* avoid warning */
     int64_t delay = av_rescale(s->max_delay, 90000, AV_TIME_BASE);
 
+    if (ts->cbr) {
+        if (cbr_queue_pes(s, st, payload, payload_size, pts, dts) < 0)
+            av_log(s, AV_LOG_ERROR, "Could not queue a PES packet\n");
+        return;
+    }
+
     is_start = 1;
     while (payload_size > 0) {
         retransmit_si_info(s);
@@ -633,14 +1072,14 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
         if (dts != AV_NOPTS_VALUE && (dts - (int64_t)ts->cur_pcr) > delay) {
             /* pcr insert gets priority over null packet insert */
             if (write_pcr)
-                mpegts_insert_pcr_only(s, st);
+                mpegts_insert_pcr_only(s, st, ts->cur_pcr * 300);
             else
                 mpegts_insert_null_packet(s);
             continue; /* recalculate write_pcr and possibly retransmit si_info */
         }
 
-        /* prepare packet header */
-        q = buf;
+        /* prepare packet header, in place in the output block */
+        q = buf = ts_get_packet(s);
         *q++ = 0x47;
         val = (ts_st->pid >> 8);
         if (is_start)
@@ -656,92 +1095,11 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
                 av_log(s, AV_LOG_WARNING, "dts < pcr, TS is invalid\n");
             *q++ = 7; /* AFC length */
             *q++ = 0x10; /* flags: PCR present */
-            *q++ = pcr >> 25;
-            *q++ = pcr >> 17;
-            *q++ = pcr >> 9;
-            *q++ = pcr >> 1;
-            *q++ = (pcr & 1) << 7;
-            *q++ = 0;
+            put_pcr(q, pcr * 300);
+            q += 6;
         }
         if (is_start) {
-            int pes_extension = 0;
-            /* write PES header */
-            *q++ = 0x00;
-            *q++ = 0x00;
-            *q++ = 0x01;
-            private_code = 0;
-            if (st->codec->codec_type == CODEC_TYPE_VIDEO) {
-                if (st->codec->codec_id == CODEC_ID_DIRAC) {
-                    *q++ = 0xfd;
-                } else
-                    *q++ = 0xe0;
-            } else if (st->codec->codec_type == CODEC_TYPE_AUDIO &&
-                       (st->codec->codec_id == CODEC_ID_MP2 ||
-                        st->codec->codec_id == CODEC_ID_MP3)) {
-                *q++ = 0xc0;
-            } else {
-                *q++ = 0xbd;
-                if (st->codec->codec_type == CODEC_TYPE_SUBTITLE) {
-                    private_code = 0x20;
-                }
-            }
-            header_len = 0;
-            flags = 0;
-            if (pts != AV_NOPTS_VALUE) {
-                header_len += 5;
-                flags |= 0x80;
-            }
-            if (dts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && dts != pts) {
-                header_len += 5;
-                flags |= 0x40;
-            }
-            if (st->codec->codec_type == CODEC_TYPE_VIDEO &&
-                st->codec->codec_id == CODEC_ID_DIRAC) {
-                /* set PES_extension_flag */
-                pes_extension = 1;
-                flags |= 0x01;
-
-                /*
-                * One byte for PES2 extension flag +
-                * one byte for extension length +
-                * one byte for extension id
-                */
-                header_len += 3;
-            }
-            len = payload_size + header_len + 3;
-            if (private_code != 0)
-                len++;
-            if (len > 0xffff)
-                len = 0;
-            *q++ = len >> 8;
-            *q++ = len;
-            val = 0x80;
-            /* data alignment indicator is required for subtitle data */
-            if (st->codec->codec_type == CODEC_TYPE_SUBTITLE)
-                val |= 0x04;
-            *q++ = val;
-            *q++ = flags;
-            *q++ = header_len;
-            if (pts != AV_NOPTS_VALUE) {
-                write_pts(q, flags >> 6, pts);
-                q += 5;
-            }
-            if (dts != AV_NOPTS_VALUE && pts != AV_NOPTS_VALUE && dts != pts) {
-                write_pts(q, 1, dts);
-                q += 5;
-            }
-            if (pes_extension && st->codec->codec_id == CODEC_ID_DIRAC) {
-                flags = 0x01;  /* set PES_extension_flag_2 */
-                *q++ = flags;
-                *q++ = 0x80 | 0x01;  /* marker bit + extension length */
-                /*
-                * Set the stream id extension flag bit to 0 and
-                * write the extended stream id
-                */
-                *q++ = 0x00 | 0x60;
-            }
-            if (private_code != 0)
-                *q++ = private_code;
+            q += write_pes_header(st, q, payload_size, pts, dts);
             is_start = 0;
         }
         /* header size */
@@ -775,10 +1133,13 @@ static void mpegts_write_pes(AVFormatContext *s, AVStream *st,
         memcpy(buf + TS_PACKET_SIZE - len, payload, len);
         payload += len;
         payload_size -= len;
-        put_buffer(s->pb, buf, TS_PACKET_SIZE);
+        ts_packet_done(s);
         ts->cur_pcr += TS_PACKET_SIZE*8*90000LL/ts->mux_rate;
     }
-    put_flush_packet(s->pb);
+    /* a seekable file is written a block at a time, other outputs get
+       each PES packet as soon as it is complete */
+    if (ts->packetized || url_is_streamed(s->pb))
+        ts_flush(s);
 }
 
 static int mpegts_write_packet(AVFormatContext *s, AVPacket *pkt)
@@ -788,9 +1149,15 @@ static int mpegts_write_packet(AVFormatContext *s, AVPacket *pkt)
     uint8_t *buf= pkt->data;
     uint8_t *data= NULL;
     MpegTSWriteStream *ts_st = st->priv_data;
+    MpegTSWrite *ts = s->priv_data;
     const uint64_t delay = av_rescale(s->max_delay, 90000, AV_TIME_BASE);
     int64_t dts = AV_NOPTS_VALUE, pts = AV_NOPTS_VALUE;
 
+    /* packets come in decoding order, so the timeline can be filled up to
+       the time this one may enter the T-STD */
+    if (ts->cbr && (pkt->dts != AV_NOPTS_VALUE || pkt->pts != AV_NOPTS_VALUE))
+        cbr_schedule(s, 300 * (pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts), 0);
+
     if (pkt->pts != AV_NOPTS_VALUE)
         pts = pkt->pts + delay;
     if (pkt->dts != AV_NOPTS_VALUE)
@@ -844,24 +1211,66 @@ static int mpegts_write_packet(AVFormatContext *s, AVPacket *pkt)
     return 0;
 }
 
-static int mpegts_write_end(AVFormatContext *s)
+/* write the audio buffered for the next PES packets and the queued ones */
+static void mpegts_flush_payloads(AVFormatContext *s)
 {
     MpegTSWrite *ts = s->priv_data;
     MpegTSWriteStream *ts_st;
-    MpegTSService *service;
     AVStream *st;
     int i;
 
-    /* flush current packets */
     for(i = 0; i < s->nb_streams; i++) {
         st = s->streams[i];
         ts_st = st->priv_data;
         if (ts_st->payload_index > 0) {
             mpegts_write_pes(s, st, ts_st->payload, ts_st->payload_index,
                              ts_st->payload_pts, ts_st->payload_dts);
+            ts_st->payload_index = 0;
         }
     }
-    put_flush_packet(s->pb);
+    if (ts->cbr)
+        cbr_schedule(s, 0, 1);
+}
+
+int ff_mpegts_switch_output(AVFormatContext *s, ByteIOContext *pb)
+{
+    MpegTSWrite *ts = s->priv_data;
+    int i;
+
+    mpegts_flush_payloads(s);
+    ts_flush(s);
+    s->pb = pb;
+
+    /* the new output starts with the tables and a PCR, the continuity
+       counters go on */
+    if (ts->cbr)
+        ts->last_sdt = ts->last_pat = cbr_clock(ts, ts->nb_packets);
+    mpegts_write_sdt(s);
+    mpegts_write_pat(s);
+    for(i = 0; i < ts->nb_services; i++) {
+        mpegts_write_pmt(s, ts->services[i]);
+        ts->services[i]->pcr_packet_count = ts->services[i]->pcr_packet_period;
+    }
+    ts->sdt_packet_count = 0;
+    ts->pat_packet_count = 0;
+    if (ts->cbr)
+        ts->last_pcr = INT64_MIN / 2;
+    return url_ferror(pb);
+}
+
+static int mpegts_write_end(AVFormatContext *s)
+{
+    MpegTSWrite *ts = s->priv_data;
+    MpegTSService *service;
+    int i;
+
+    mpegts_flush_payloads(s);
+    if (ts->cbr) {
+        /* complete the last burst */
+        while (ts->burst && ts->nb_packets % ts->burst)
+            mpegts_insert_null_packet(s);
+    }
+    ts_flush(s);
 
     for(i = 0; i < ts->nb_services; i++) {
         service = ts->services[i];
@@ -870,6 +1279,7 @@ static int mpegts_write_end(AVFormatContext *s)
         av_free(service);
     }
     av_free(ts->services);
+    av_freep(&ts->block);
 
     return 0;
 }
@@ -0,0 +1,270 @@
+/*
+ * Muxer throughput and latency benchmark
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/mux-benchmark.c
+ * Feeds synthetic video and audio packets at fixed rates into muxers that
+ * write to a protocol discarding the data, and prints one line of
+ * key=value results per muxer: time per packet, the most bytes handed to
+ * the muxer but not yet written out, and the time of av_write_trailer().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libavutil/lfg.h"
+#include "libavformat/avformat.h"
+
+#undef exit
+
+#define FRAME_RATE   25
+#define GOP_SIZE     12
+#define SAMPLE_RATE  44100
+#define FRAME_SIZE   1152       ///< audio samples per packet
+#define VIDEO_BYTES  2000       ///< size of an inter frame, 400 kb/s
+#define AUDIO_BYTES  418        ///< 64 kb/s
+
+static const char *default_formats[] = {
+    "mpegts", "mov", "matroska", "mxf", "avi", "nut", "flv", "gxf", NULL
+};
+
+/* null protocol, counting what the muxer writes */
+static int64_t null_pos, null_size, null_written;
+
+static int null_open(URLContext *h, const char *filename, int flags)
+{
+    null_pos = null_size = null_written = 0;
+    return 0;
+}
+
+static int null_write(URLContext *h, unsigned char *buf, int size)
+{
+    null_pos     += size;
+    null_size     = FFMAX(null_size, null_pos);
+    null_written += size;
+    return size;
+}
+
+static int64_t null_seek(URLContext *h, int64_t pos, int whence)
+{
+    if (whence == AVSEEK_SIZE)
+        return null_size;
+    if (whence == SEEK_CUR)
+        pos += null_pos;
+    else if (whence == SEEK_END)
+        pos += null_size;
+    return null_pos = pos;
+}
+
+static int null_close(URLContext *h)
+{
+    return 0;
+}
+
+static URLProtocol null_protocol = {
+    "benchnull",
+    null_open,
+    NULL,
+    null_write,
+    null_seek,
+    null_close,
+};
+
+typedef struct BenchResult {
+    int64_t packets;
+    int64_t bytes;
+    int64_t write_time;
+    int64_t max_buffered;       ///< bytes passed to the muxer but not written yet
+    int64_t trailer_time;
+    int64_t output_size;
+} BenchResult;
+
+static AVStream *add_stream(AVFormatContext *oc, enum CodecType type, enum CodecID codec_id)
+{
+    AVStream *st = av_new_stream(oc, oc->nb_streams);
+    AVCodecContext *c;
+
+    if (!st)
+        return NULL;
+    c = st->codec;
+    c->codec_id   = codec_id;
+    c->codec_type = type;
+    if (type == CODEC_TYPE_VIDEO) {
+        c->bit_rate      = VIDEO_BYTES * 8 * FRAME_RATE;
+        c->width         = 352;
+        c->height        = 288;
+        c->time_base     = (AVRational){1, FRAME_RATE};
+        c->gop_size      = GOP_SIZE;
+        c->pix_fmt       = PIX_FMT_YUV420P;
+    } else {
+        c->bit_rate      = 64000;
+        c->sample_rate   = SAMPLE_RATE;
+        c->channels      = 2;
+        c->frame_size    = FRAME_SIZE;
+        c->time_base     = (AVRational){1, SAMPLE_RATE};
+    }
+    // some formats want stream headers to be separate
+    if(oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= CODEC_FLAG_GLOBAL_HEADER;
+    return st;
+}
+
+static int bench_format(const char *name, int duration, AVLFG *prng, BenchResult *r)
+{
+    AVOutputFormat *fmt = av_guess_format(name, NULL, NULL);
+    AVFormatContext *oc;
+    AVStream *video = NULL, *audio = NULL;
+    AVPacket pkt;
+    uint8_t *payload;
+    int64_t fed = 0, t, video_frames = 0, audio_frames = 0;
+    int i, ret;
+
+    memset(r, 0, sizeof(*r));
+    if (!fmt)
+        return AVERROR(ENOENT);
+    if (!(oc = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+    oc->oformat = fmt;
+    snprintf(oc->filename, sizeof(oc->filename), "benchnull:%s", name);
+
+    ret = AVERROR(ENOMEM);
+    if (fmt->video_codec != CODEC_ID_NONE &&
+        !(video = add_stream(oc, CODEC_TYPE_VIDEO, fmt->video_codec)))
+        goto fail;
+    if (fmt->audio_codec != CODEC_ID_NONE &&
+        !(audio = add_stream(oc, CODEC_TYPE_AUDIO, fmt->audio_codec)))
+        goto fail;
+    if (!(payload = av_malloc(VIDEO_BYTES * 5)))
+        goto fail;
+    for (i = 0; i < VIDEO_BYTES * 5; i++)
+        payload[i] = av_lfg_get(prng);
+
+    if ((ret = av_set_parameters(oc, NULL)) < 0 ||
+        (ret = url_fopen(&oc->pb, oc->filename, URL_WRONLY)) < 0)
+        goto fail_payload;
+    if ((ret = av_write_header(oc)) < 0)
+        goto fail_close;
+
+    /* feed the streams in the order of their timestamps */
+    for (;;) {
+        double video_ts = video ? video_frames / (double)FRAME_RATE : duration;
+        double audio_ts = audio ? audio_frames * FRAME_SIZE / (double)SAMPLE_RATE : duration;
+
+        if (FFMIN(video_ts, audio_ts) >= duration)
+            break;
+        av_init_packet(&pkt);
+        pkt.data = payload;
+        if (video_ts <= audio_ts) {
+            pkt.stream_index = video->index;
+            pkt.size         = VIDEO_BYTES;
+            if (!(video_frames % GOP_SIZE)) {
+                pkt.flags |= PKT_FLAG_KEY;
+                pkt.size  *= 5;
+            }
+            pkt.pts = av_rescale_q(video_frames++, video->codec->time_base, video->time_base);
+        } else {
+            pkt.stream_index = audio->index;
+            pkt.size         = AUDIO_BYTES;
+            pkt.flags       |= PKT_FLAG_KEY;
+            pkt.pts = av_rescale_q(audio_frames++ * FRAME_SIZE, audio->codec->time_base,
+                                   audio->time_base);
+        }
+        pkt.dts = pkt.pts;
+        fed += pkt.size;
+
+        t = av_gettime();
+        ret = av_interleaved_write_frame(oc, &pkt);
+        r->write_time += av_gettime() - t;
+        if (ret < 0)
+            goto fail_close;
+        r->packets++;
+        r->bytes += pkt.size;
+        /* container overhead makes this an underestimate early on */
+        r->max_buffered = FFMAX(r->max_buffered, fed - null_written);
+    }
+
+    t = av_gettime();
+    ret = av_write_trailer(oc);
+    r->trailer_time = av_gettime() - t;
+    r->output_size  = null_size;
+
+fail_close:
+    url_fclose(oc->pb);
+fail_payload:
+    av_free(payload);
+fail:
+    for (i = 0; i < oc->nb_streams; i++) {
+        av_freep(&oc->streams[i]->codec);
+        av_freep(&oc->streams[i]);
+    }
+    av_freep(&oc->priv_data);
+    av_free(oc);
+    return ret;
+}
+
+static void usage(void)
+{
+    printf("usage: mux-benchmark [-d seconds] [-s seed] [format...]\n"
+           "Muxes synthetic packets with each format, by default with\n"
+           "mpegts, mov, matroska, mxf, avi, nut, flv and gxf, printing one\n"
+           "line of key=value results per format.\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char **formats = default_formats;
+    AVLFG prng;
+    BenchResult r;
+    int duration = 600, seed = 1, c, ret, failed = 0;
+
+    while ((c = getopt(argc, argv, "d:s:h")) != -1) {
+        switch (c) {
+        case 'd': duration = atoi(optarg); break;
+        case 's': seed     = atoi(optarg); break;
+        default:  usage(); return c != 'h';
+        }
+    }
+    if (optind < argc)
+        formats = (const char **)argv + optind;
+
+    av_register_all();
+    av_register_protocol(&null_protocol);
+    av_log_set_level(AV_LOG_ERROR);
+    av_lfg_init(&prng, seed);
+
+    for (; *formats; formats++) {
+        if ((ret = bench_format(*formats, duration, &prng, &r)) < 0) {
+            printf("format=%s error=%d\n", *formats, ret);
+            failed = 1;
+            continue;
+        }
+        printf("format=%s duration_s=%d packets=%"PRId64" bytes=%"PRId64
+               " ns_per_packet=%"PRId64" max_buffered=%"PRId64
+               " trailer_us=%"PRId64" output_size=%"PRId64"\n",
+               *formats, duration, r.packets, r.bytes,
+               r.packets ? r.write_time * 1000 / r.packets : 0,
+               r.max_buffered, r.trailer_time, r.output_size);
+        fflush(stdout);
+    }
+    return failed;
+}
@@ -48,6 +48,7 @@
 #include "libavutil/aes.h"
 #include "libavcodec/bytestream.h"
 #include "avformat.h"
+#include "internal.h"
 #include "mxf.h"
 
 typedef struct {
@@ -106,6 +107,15 @@ typedef struct {
 typedef struct {
     UID uid;
     enum MXFMetadataSetType type;
+    int edit_unit_byte_count;
+    int index_sid;
+    int body_sid;
+    AVRational index_edit_rate;     ///< inverted like MXFTrack.edit_rate, a time base
+    int64_t index_start_position;
+    int64_t index_duration;
+    int nb_index_entries;
+    uint8_t *flags;                 ///< flags of each entry, 0x80 for random access
+    int64_t *stream_offsets;        ///< offset of each entry in the essence container
 } MXFIndexTableSegment;
 
 typedef struct {
@@ -123,15 +133,31 @@ typedef struct {
     enum MXFMetadataSetType type;
 } MXFMetadataSet;
 
+typedef struct {
+    int64_t this_partition;         ///< relative to the header partition, like all partition offsets
+    int64_t previous_partition;
+    int64_t header_byte_count;
+    int64_t body_offset;            ///< offset of the essence of this partition in the essence container
+    int64_t essence_offset;         ///< file position of the essence of this partition, -1 if unknown
+    int body_sid;
+} MXFPartition;
+
 typedef struct {
     UID *packages_refs;
     int packages_count;
     MXFMetadataSet **metadata_sets;
     int metadata_sets_count;
+    int *uid_hash;                  ///< latest metadata set of each UID hash, -1 if none
+    int *uid_hash_next;             ///< previous metadata set with the same UID hash, -1 if none
     AVFormatContext *fc;
     struct AVAES *aesc;
     uint8_t *local_tags;
     int local_tags_count;
+    MXFPartition *partitions;
+    int partitions_count;
+    int current_partition;          ///< partition being read, -1 if none
+    int64_t run_in;                 ///< file position of the header partition
+    int64_t footer_partition;
 } MXFContext;
 
 enum MXFWrappingScheme {
@@ -148,6 +174,9 @@ typedef struct {
 
 /* partial keys to match */
 static const uint8_t mxf_header_partition_pack_key[]       = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x02,0x01,0x01,0x02 };
+static const uint8_t mxf_partition_pack_key[]              = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x02,0x01,0x01 };
+static const uint8_t mxf_primer_pack_key[]                 = { 0x06,0x0e,0x2b,0x34,0x02,0x05,0x01,0x01,0x0d,0x01,0x02,0x01,0x01,0x05,0x01 };
+static const uint8_t mxf_index_table_segment_key[]         = { 0x06,0x0e,0x2b,0x34,0x02,0x53,0x01,0x01,0x0d,0x01,0x02,0x01,0x01,0x10,0x01 };
 static const uint8_t mxf_essence_element_key[]             = { 0x06,0x0e,0x2b,0x34,0x01,0x02,0x01,0x01,0x0d,0x01,0x03,0x01 };
 static const uint8_t mxf_klv_key[]                         = { 0x06,0x0e,0x2b,0x34 };
 /* complete keys to match */
@@ -157,6 +186,8 @@ static const uint8_t mxf_encrypted_essence_container[]     = { 0x06,0x0e,0x2b,0x
 static const uint8_t mxf_sony_mpeg4_extradata[]            = { 0x06,0x0e,0x2b,0x34,0x04,0x01,0x01,0x01,0x0e,0x06,0x06,0x02,0x02,0x01,0x00,0x00 };
 
 #define IS_KLV_KEY(x, y) (!memcmp(x, y, sizeof(y)))
+/* header (0x02), body (0x03) and footer (0x04) partition packs */
+#define IS_PARTITION_PACK_KEY(x) (IS_KLV_KEY(x, mxf_partition_pack_key) && (x)[13] >= 0x02 && (x)[13] <= 0x04)
 
 static int64_t klv_decode_ber_length(ByteIOContext *pb)
 {
@@ -173,9 +204,30 @@ static int64_t klv_decode_ber_length(ByteIOContext *pb)
     return size;
 }
 
+/**
+ * Skip past the next occurrence of key, looking for its first byte in the
+ * I/O buffer with memchr() and comparing the rest with memcmp(), instead
+ * of reading the input a byte at a time.
+ * @return 1 with key just read, 0 if it was not found
+ */
 static int mxf_read_sync(ByteIOContext *pb, const uint8_t *key, unsigned size)
 {
-    int i, b;
+    const uint8_t *data, *p, *end;
+    int i, b, len;
+
+    while ((len = url_fpeek(pb, &data, pb->buffer_size)) >= (int)size) {
+        /* the last place the whole key fits at */
+        end = data + len - size + 1;
+        for (p = data; (p = memchr(p, key[0], end - p)); p++) {
+            if (!memcmp(p, key, size)) {
+                url_fskip(pb, p + size - data);
+                return 1;
+            }
+        }
+        url_fskip(pb, end - data);
+    }
+
+    /* the last bytes, or a protocol returning less than size bytes at once */
     for (i = 0; i < size && !url_feof(pb); i++) {
         b = get_byte(pb);
         if (b == key[0])
@@ -239,6 +291,11 @@ static int mxf_get_d10_aes3_packet(ByteIOContext *pb, AVStream *st, AVPacket *pk
     return 0;
 }
 
+/**
+ * Read an encrypted triplet into pkt, decrypting its payload in place.
+ * @return 0 on success, 1 if the stream of the triplet is discarded,
+ *         a negative value on error
+ */
 static int mxf_decrypt_triplet(AVFormatContext *s, AVPacket *pkt, KLVPacket *klv)
 {
     static const uint8_t checkv[16] = {0x43, 0x48, 0x55, 0x4b, 0x43, 0x48, 0x55, 0x4b, 0x43, 0x48, 0x55, 0x4b, 0x43, 0x48, 0x55, 0x4b};
@@ -250,7 +307,7 @@ static int mxf_decrypt_triplet(AVFormatContext *s, AVPacket *pkt, KLVPacket *klv
     uint64_t plaintext_size;
     uint8_t ivec[16];
     uint8_t tmpbuf[16];
-    int index;
+    int index, ret;
 
     if (!mxf->aesc && s->key && s->keylen == 16) {
         mxf->aesc = av_malloc(av_aes_size);
@@ -271,6 +328,10 @@ static int mxf_decrypt_triplet(AVFormatContext *s, AVPacket *pkt, KLVPacket *klv
     index = mxf_get_stream_index(s, klv);
     if (index < 0)
         return -1;
+    if (s->streams[index]->discard == AVDISCARD_ALL) {
+        url_fskip(pb, end - url_ftell(pb));
+        return 1;
+    }
     // source size
     klv_decode_ber_length(pb);
     orig_size = get_be64(pb);
@@ -287,13 +348,23 @@ static int mxf_decrypt_triplet(AVFormatContext *s, AVPacket *pkt, KLVPacket *klv
     if (memcmp(tmpbuf, checkv, 16))
         av_log(s, AV_LOG_ERROR, "probably incorrect decryption key\n");
     size -= 32;
-    av_get_packet(pb, pkt, size);
+    if (size > INT_MAX)
+        return -1;
+    ret = ff_get_packet(s, pb, pkt, size);
+    if (ret < 0)
+        return ret;
+    if (ret < size) {
+        av_free_packet(pkt);
+        return AVERROR(EIO);
+    }
+    // the whole encrypted part at once, in the packet buffer
     size -= plaintext_size;
     if (mxf->aesc)
         av_aes_crypt(mxf->aesc, &pkt->data[plaintext_size],
                      &pkt->data[plaintext_size], size >> 4, ivec, 1);
     pkt->size = orig_size;
     pkt->stream_index = index;
+    pkt->pos = klv->offset;
     url_fskip(pb, end - url_ftell(pb));
     return 0;
 }
@@ -313,6 +384,8 @@ static int mxf_read_packet(AVFormatContext *s, AVPacket *pkt)
                 av_log(s, AV_LOG_ERROR, "invalid encoded triplet\n");
                 return -1;
             }
+            if (res > 0) // discarded stream
+                continue;
             return 0;
         }
         if (IS_KLV_KEY(klv.key, mxf_essence_element_key)) {
@@ -330,7 +403,7 @@ static int mxf_read_packet(AVFormatContext *s, AVPacket *pkt)
                     return -1;
                 }
             } else
-                av_get_packet(s->pb, pkt, klv.length);
+                ff_get_packet(s, s->pb, pkt, klv.length);
             pkt->stream_index = index;
             pkt->pos = klv.offset;
             return 0;
@@ -361,13 +434,86 @@ static int mxf_read_primer_pack(MXFContext *mxf)
     return 0;
 }
 
+static int mxf_read_partition_pack(MXFContext *mxf, KLVPacket *klv)
+{
+    ByteIOContext *pb = mxf->fc->pb;
+    int64_t klv_end = url_ftell(pb) + klv->length;
+    MXFPartition partition;
+    int64_t footer_partition;
+    int i;
+
+    if (klv->length < 80)
+        return -1;
+    get_be16(pb); /* major version */
+    get_be16(pb); /* minor version */
+    get_be32(pb); /* KAG size */
+    partition.this_partition     = get_be64(pb);
+    partition.previous_partition = get_be64(pb);
+    footer_partition             = get_be64(pb);
+    partition.header_byte_count  = get_be64(pb);
+    get_be64(pb); /* index byte count */
+    get_be32(pb); /* index SID */
+    partition.body_offset        = get_be64(pb);
+    partition.body_sid           = get_be32(pb);
+    partition.essence_offset     = -1;
+    url_fseek(pb, klv_end, SEEK_SET);
+    dprintf(mxf->fc, "partition %#"PRIx64" previous %#"PRIx64" footer %#"PRIx64" body sid %d offset %#"PRIx64"\n",
+            partition.this_partition, partition.previous_partition, footer_partition,
+            partition.body_sid, partition.body_offset);
+
+    if (!mxf->partitions_count)
+        mxf->run_in = klv->offset - partition.this_partition;
+    if (footer_partition > 0)
+        mxf->footer_partition = footer_partition;
+
+    for (i = 0; i < mxf->partitions_count; i++)
+        if (mxf->partitions[i].this_partition == partition.this_partition)
+            break;
+    if (i == mxf->partitions_count) {
+        if (mxf->partitions_count >= INT_MAX / sizeof(*mxf->partitions))
+            return AVERROR(ENOMEM);
+        mxf->partitions = av_realloc(mxf->partitions, (mxf->partitions_count + 1) * sizeof(*mxf->partitions));
+        if (!mxf->partitions)
+            return AVERROR(ENOMEM);
+        mxf->partitions[mxf->partitions_count++] = partition;
+    }
+    mxf->current_partition = i;
+    return 0;
+}
+
+#define MXF_UID_HASH_BITS 12
+
+static unsigned mxf_uid_hash(const UID uid)
+{
+    unsigned h = 0;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        h = h * 31 + uid[i];
+    return (h ^ h >> MXF_UID_HASH_BITS ^ h >> 2 * MXF_UID_HASH_BITS) & ((1 << MXF_UID_HASH_BITS) - 1);
+}
+
 static int mxf_add_metadata_set(MXFContext *mxf, void *metadata_set)
 {
+    unsigned h;
+
     if (mxf->metadata_sets_count+1 >= UINT_MAX / sizeof(*mxf->metadata_sets))
         return AVERROR(ENOMEM);
     mxf->metadata_sets = av_realloc(mxf->metadata_sets, (mxf->metadata_sets_count + 1) * sizeof(*mxf->metadata_sets));
     if (!mxf->metadata_sets)
         return -1;
+    mxf->uid_hash_next = av_realloc(mxf->uid_hash_next, (mxf->metadata_sets_count + 1) * sizeof(*mxf->uid_hash_next));
+    if (!mxf->uid_hash_next)
+        return AVERROR(ENOMEM);
+    if (!mxf->uid_hash) {
+        mxf->uid_hash = av_malloc((1 << MXF_UID_HASH_BITS) * sizeof(*mxf->uid_hash));
+        if (!mxf->uid_hash)
+            return AVERROR(ENOMEM);
+        memset(mxf->uid_hash, -1, (1 << MXF_UID_HASH_BITS) * sizeof(*mxf->uid_hash));
+    }
+    h = mxf_uid_hash(((MXFMetadataSet *)metadata_set)->uid);
+    mxf->uid_hash_next[mxf->metadata_sets_count] = mxf->uid_hash[h];
+    mxf->uid_hash[h] = mxf->metadata_sets_count;
     mxf->metadata_sets[mxf->metadata_sets_count] = metadata_set;
     mxf->metadata_sets_count++;
     return 0;
@@ -505,15 +651,62 @@ static int mxf_read_source_package(MXFPackage *package, ByteIOContext *pb, int t
     return 0;
 }
 
-static int mxf_read_index_table_segment(MXFIndexTableSegment *segment, ByteIOContext *pb, int tag)
+static int mxf_read_index_table_segment(MXFIndexTableSegment *segment, ByteIOContext *pb, int tag, int size)
 {
+    int i, length;
+
     switch(tag) {
-    case 0x3F05: dprintf(NULL, "EditUnitByteCount %d\n", get_be32(pb)); break;
-    case 0x3F06: dprintf(NULL, "IndexSID %d\n", get_be32(pb)); break;
-    case 0x3F07: dprintf(NULL, "BodySID %d\n", get_be32(pb)); break;
-    case 0x3F0B: dprintf(NULL, "IndexEditRate %d/%d\n", get_be32(pb), get_be32(pb)); break;
-    case 0x3F0C: dprintf(NULL, "IndexStartPosition %lld\n", get_be64(pb)); break;
-    case 0x3F0D: dprintf(NULL, "IndexDuration %lld\n", get_be64(pb)); break;
+    case 0x3F05:
+        segment->edit_unit_byte_count = get_be32(pb);
+        dprintf(NULL, "EditUnitByteCount %d\n", segment->edit_unit_byte_count);
+        break;
+    case 0x3F06:
+        segment->index_sid = get_be32(pb);
+        dprintf(NULL, "IndexSID %d\n", segment->index_sid);
+        break;
+    case 0x3F07:
+        segment->body_sid = get_be32(pb);
+        dprintf(NULL, "BodySID %d\n", segment->body_sid);
+        break;
+    case 0x3F0B:
+        segment->index_edit_rate.den = get_be32(pb);
+        segment->index_edit_rate.num = get_be32(pb);
+        dprintf(NULL, "IndexEditRate %d/%d\n", segment->index_edit_rate.den, segment->index_edit_rate.num);
+        break;
+    case 0x3F0C:
+        segment->index_start_position = get_be64(pb);
+        dprintf(NULL, "IndexStartPosition %"PRId64"\n", segment->index_start_position);
+        break;
+    case 0x3F0D:
+        segment->index_duration = get_be64(pb);
+        dprintf(NULL, "IndexDuration %"PRId64"\n", segment->index_duration);
+        break;
+    case 0x3F0A: /* index entry array, SMPTE 377M 10.2.3 */
+        if (segment->nb_index_entries || size < 8)
+            break;
+        segment->nb_index_entries = get_be32(pb);
+        length = get_be32(pb);
+        if (segment->nb_index_entries <= 0 || length < 11 ||
+            segment->nb_index_entries > (size - 8) / length) {
+            segment->nb_index_entries = 0;
+            break;
+        }
+        segment->flags          = av_malloc(segment->nb_index_entries);
+        segment->stream_offsets = av_malloc(segment->nb_index_entries * sizeof(*segment->stream_offsets));
+        if (!segment->flags || !segment->stream_offsets) {
+            av_freep(&segment->flags);
+            av_freep(&segment->stream_offsets);
+            segment->nb_index_entries = 0;
+            return AVERROR(ENOMEM);
+        }
+        for (i = 0; i < segment->nb_index_entries; i++) {
+            get_byte(pb);                           /* temporal offset */
+            get_byte(pb);                           /* key frame offset */
+            segment->flags[i]          = get_byte(pb);
+            segment->stream_offsets[i] = get_be64(pb);
+            url_fskip(pb, length - 11);             /* slice offsets, pos table */
+        }
+        break;
     }
     return 0;
 }
@@ -629,17 +822,20 @@ static const MXFCodecUL *mxf_get_codec_ul(const MXFCodecUL *uls, UID *uid)
 
 static void *mxf_resolve_strong_ref(MXFContext *mxf, UID *strong_ref, enum MXFMetadataSetType type)
 {
+    MXFMetadataSet *found = NULL;
     int i;
 
-    if (!strong_ref)
+    if (!strong_ref || !mxf->uid_hash)
         return NULL;
-    for (i = 0; i < mxf->metadata_sets_count; i++) {
+    /* the chains go from the latest set to the first one, which is
+     * the one referenced when several sets have the same UID */
+    for (i = mxf->uid_hash[mxf_uid_hash(*strong_ref)]; i >= 0; i = mxf->uid_hash_next[i]) {
         if (!memcmp(*strong_ref, mxf->metadata_sets[i]->uid, 16) &&
             (type == AnyType || mxf->metadata_sets[i]->type == type)) {
-            return mxf->metadata_sets[i];
+            found = mxf->metadata_sets[i];
         }
     }
-    return NULL;
+    return found;
 }
 
 static const MXFCodecUL mxf_essence_container_uls[] = {
@@ -803,6 +999,14 @@ static int mxf_parse_structural_metadata(MXFContext *mxf)
             st->codec->height = descriptor->height;
             st->codec->bits_per_coded_sample = descriptor->bits_per_sample; /* Uncompressed */
             st->need_parsing = AVSTREAM_PARSE_HEADERS;
+            /* the edit rate is the frame rate */
+            st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA |
+                                   FF_PARAM_DIMENSIONS | FF_PARAM_FRAME_RATE;
+            /* key flags of long GOP essence are only known to the parser */
+            if (st->codec->codec_id != CODEC_ID_MPEG1VIDEO &&
+                st->codec->codec_id != CODEC_ID_MPEG2VIDEO &&
+                st->codec->codec_id != CODEC_ID_H264)
+                st->container_params |= FF_PARAM_FRAMING;
         } else if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
             container_ul = mxf_get_codec_ul(mxf_essence_container_uls, essence_container_ul);
             if (st->codec->codec_id == CODEC_ID_NONE)
@@ -810,6 +1014,7 @@ static int mxf_parse_structural_metadata(MXFContext *mxf)
             st->codec->channels = descriptor->channels;
             st->codec->bits_per_coded_sample = descriptor->bits_per_sample;
             st->codec->sample_rate = descriptor->sample_rate.num / descriptor->sample_rate.den;
+            st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA | FF_PARAM_AUDIO;
             /* TODO: implement CODEC_ID_RAWAUDIO */
             if (st->codec->codec_id == CODEC_ID_PCM_S16LE) {
                 if (descriptor->bits_per_sample == 24)
@@ -828,6 +1033,7 @@ static int mxf_parse_structural_metadata(MXFContext *mxf)
         if (st->codec->codec_type != CODEC_TYPE_DATA && (*essence_container_ul)[15] > 0x01) {
             av_log(mxf->fc, AV_LOG_WARNING, "only frame wrapped mappings are correctly supported\n");
             st->need_parsing = AVSTREAM_PARSE_FULL;
+            st->container_params &= ~FF_PARAM_FRAMING;
         }
     }
     return 0;
@@ -895,6 +1101,114 @@ static int mxf_read_local_tags(MXFContext *mxf, KLVPacket *klv, int (*read_child
     return ctx_size ? mxf_add_metadata_set(mxf, ctx) : 0;
 }
 
+/**
+ * Map an offset in the essence container body_sid to a file position.
+ * @return the position, -1 if it is not in a partition known to hold essence
+ */
+static int64_t mxf_essence_position(MXFContext *mxf, int body_sid, int64_t stream_offset)
+{
+    MXFPartition *best = NULL;
+    int i;
+
+    for (i = 0; i < mxf->partitions_count; i++) {
+        MXFPartition *p = &mxf->partitions[i];
+        if (p->essence_offset < 0 || (body_sid && p->body_sid != body_sid) ||
+            p->body_offset > stream_offset)
+            continue;
+        if (!best || p->body_offset > best->body_offset)
+            best = p;
+    }
+    return best ? best->essence_offset + stream_offset - best->body_offset : -1;
+}
+
+/**
+ * Read the partitions following the first essence, from the footer back,
+ * for their index table segments and the position of their essence.
+ * Repeated header metadata is skipped.
+ */
+static void mxf_read_partitions(MXFContext *mxf)
+{
+    ByteIOContext *pb = mxf->fc->pb;
+    int64_t pos = url_ftell(pb);
+    int64_t offset = mxf->footer_partition;
+    KLVPacket klv;
+    int i;
+
+    while (offset > 0) {
+        MXFPartition *partition;
+
+        for (i = 0; i < mxf->partitions_count; i++)
+            if (mxf->partitions[i].this_partition == offset)
+                break;
+        if (i < mxf->partitions_count)
+            break; /* read with the header already */
+
+        if (url_fseek(pb, mxf->run_in + offset, SEEK_SET) < 0 ||
+            klv_read_packet(&klv, pb) < 0 || !IS_PARTITION_PACK_KEY(klv.key) ||
+            mxf_read_partition_pack(mxf, &klv) < 0)
+            break;
+        partition = &mxf->partitions[mxf->current_partition];
+
+        while (!url_feof(pb) && klv_read_packet(&klv, pb) >= 0) {
+            if (IS_PARTITION_PACK_KEY(klv.key))
+                break;
+            if (IS_KLV_KEY(klv.key, mxf_essence_element_key) ||
+                IS_KLV_KEY(klv.key, mxf_encrypted_triplet_key)) {
+                partition->essence_offset = klv.offset;
+                break;
+            }
+            if (IS_KLV_KEY(klv.key, mxf_primer_pack_key) && partition->header_byte_count > 0) {
+                url_fseek(pb, klv.offset + partition->header_byte_count, SEEK_SET);
+            } else if (IS_KLV_KEY(klv.key, mxf_index_table_segment_key)) {
+                if (mxf_read_local_tags(mxf, &klv, mxf_read_index_table_segment,
+                                        sizeof(MXFIndexTableSegment), IndexTableSegment) < 0)
+                    break;
+            } else
+                url_fskip(pb, klv.length);
+        }
+
+        if (partition->previous_partition >= offset)
+            break;
+        offset = partition->previous_partition;
+    }
+    mxf->current_partition = -1;
+    url_fseek(pb, pos, SEEK_SET);
+}
+
+/**
+ * Add the entries of the index table segments to the index of each stream.
+ * All the essence elements of an edit unit are in the same content
+ * package, so the entries point to the content package for all streams.
+ */
+static void mxf_build_index(MXFContext *mxf)
+{
+    int i, j, k;
+
+    for (i = 0; i < mxf->fc->nb_streams; i++) {
+        AVStream *st = mxf->fc->streams[i];
+
+        for (j = 0; j < mxf->metadata_sets_count; j++) {
+            MXFIndexTableSegment *segment = (MXFIndexTableSegment *)mxf->metadata_sets[j];
+            AVRational time_base;
+
+            if (segment->type != IndexTableSegment)
+                continue;
+            time_base = segment->index_edit_rate.num && segment->index_edit_rate.den ?
+                        segment->index_edit_rate : st->time_base;
+            for (k = 0; k < segment->nb_index_entries; k++) {
+                int64_t pos = mxf_essence_position(mxf, segment->body_sid, segment->stream_offsets[k]);
+                int key = st->codec->codec_type != CODEC_TYPE_VIDEO || segment->flags[k] & 0x80;
+
+                if (pos < 0)
+                    continue;
+                av_add_index_entry(st, pos,
+                                   av_rescale_q(segment->index_start_position + k, time_base, st->time_base),
+                                   0, 0, key ? AVINDEX_KEYFRAME : 0);
+            }
+        }
+    }
+}
+
 static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
 {
     MXFContext *mxf = s->priv_data;
@@ -906,6 +1220,7 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
     }
     url_fseek(s->pb, -14, SEEK_CUR);
     mxf->fc = s;
+    mxf->current_partition = -1;
     while (!url_feof(s->pb)) {
         const MXFMetadataReadTableEntry *metadata;
 
@@ -915,10 +1230,19 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
         dprintf(s, "size %lld offset %#llx\n", klv.length, klv.offset);
         if (IS_KLV_KEY(klv.key, mxf_encrypted_triplet_key) ||
             IS_KLV_KEY(klv.key, mxf_essence_element_key)) {
+            if (mxf->current_partition >= 0)
+                mxf->partitions[mxf->current_partition].essence_offset = klv.offset;
             /* FIXME avoid seek */
             url_fseek(s->pb, klv.offset, SEEK_SET);
             break;
         }
+        if (IS_PARTITION_PACK_KEY(klv.key)) {
+            if (mxf_read_partition_pack(mxf, &klv) < 0) {
+                av_log(s, AV_LOG_ERROR, "error reading partition pack\n");
+                return -1;
+            }
+            continue;
+        }
 
         for (metadata = mxf_metadata_read_table; metadata->read; metadata++) {
             if (IS_KLV_KEY(klv.key, metadata->key)) {
@@ -933,7 +1257,14 @@ static int mxf_read_header(AVFormatContext *s, AVFormatParameters *ap)
         if (!metadata->read)
             url_fskip(s->pb, klv.length);
     }
-    return mxf_parse_structural_metadata(mxf);
+    mxf->current_partition = -1;
+    if (mxf_parse_structural_metadata(mxf) < 0)
+        return -1;
+    if (!url_is_streamed(s->pb) && !(s->flags & AVFMT_FLAG_IGNIDX)) {
+        mxf_read_partitions(mxf);
+        mxf_build_index(mxf);
+    }
+    return 0;
 }
 
 static int mxf_read_close(AVFormatContext *s)
@@ -958,14 +1289,21 @@ static int mxf_read_close(AVFormatContext *s)
         case MaterialPackage:
             av_freep(&((MXFPackage *)mxf->metadata_sets[i])->tracks_refs);
             break;
+        case IndexTableSegment:
+            av_freep(&((MXFIndexTableSegment *)mxf->metadata_sets[i])->flags);
+            av_freep(&((MXFIndexTableSegment *)mxf->metadata_sets[i])->stream_offsets);
+            break;
         default:
             break;
         }
         av_freep(&mxf->metadata_sets[i]);
     }
     av_freep(&mxf->metadata_sets);
+    av_freep(&mxf->uid_hash);
+    av_freep(&mxf->uid_hash_next);
     av_freep(&mxf->aesc);
     av_freep(&mxf->local_tags);
+    av_freep(&mxf->partitions);
     return 0;
 }
 
@@ -985,17 +1323,66 @@ static int mxf_probe(AVProbeData *p) {
     return 0;
 }
 
-/* rudimentary byte seek */
-/* XXX: use MXF Index */
+/**
+ * Find the position of the edit unit at sample_time in a constant bytes
+ * per edit unit index.
+ * @return the position, -1 if there is no such index
+ */
+static int64_t mxf_cbr_position(MXFContext *mxf, AVStream *st, int64_t *sample_time)
+{
+    int i;
+
+    for (i = 0; i < mxf->metadata_sets_count; i++) {
+        MXFIndexTableSegment *segment = (MXFIndexTableSegment *)mxf->metadata_sets[i];
+        AVRational time_base;
+        int64_t edit_unit, pos;
+
+        if (segment->type != IndexTableSegment || !segment->edit_unit_byte_count ||
+            segment->nb_index_entries)
+            continue;
+        time_base = segment->index_edit_rate.num && segment->index_edit_rate.den ?
+                    segment->index_edit_rate : st->time_base;
+        edit_unit = av_rescale_q(*sample_time, st->time_base, time_base);
+        if (edit_unit < segment->index_start_position ||
+            (segment->index_duration > 0 &&
+             edit_unit >= segment->index_start_position + segment->index_duration))
+            continue;
+        pos = mxf_essence_position(mxf, segment->body_sid,
+                                   edit_unit * segment->edit_unit_byte_count);
+        if (pos < 0)
+            continue;
+        *sample_time = av_rescale_q(edit_unit, time_base, st->time_base);
+        return pos;
+    }
+    return -1;
+}
+
 static int mxf_read_seek(AVFormatContext *s, int stream_index, int64_t sample_time, int flags)
 {
+    MXFContext *mxf = s->priv_data;
     AVStream *st = s->streams[stream_index];
-    int64_t seconds;
+    int64_t seconds, pos;
+    int index;
 
-    if (!s->bit_rate)
-        return -1;
     if (sample_time < 0)
         sample_time = 0;
+
+    /* the index table segments give the position of each edit unit */
+    if (st->nb_index_entries &&
+        (index = av_index_search_timestamp(st, sample_time, flags)) >= 0) {
+        url_fseek(s->pb, st->index_entries[index].pos, SEEK_SET);
+        av_update_cur_dts(s, st, st->index_entries[index].timestamp);
+        return 0;
+    }
+    if ((pos = mxf_cbr_position(mxf, st, &sample_time)) >= 0) {
+        url_fseek(s->pb, pos, SEEK_SET);
+        av_update_cur_dts(s, st, sample_time);
+        return 0;
+    }
+
+    /* rudimentary byte seek */
+    if (!s->bit_rate)
+        return -1;
     seconds = av_rescale(sample_time, st->time_base.num, st->time_base.den);
     url_fseek(s->pb, (s->bit_rate * seconds) >> 3, SEEK_SET);
     av_update_cur_dts(s, st, sample_time);
@@ -40,6 +40,7 @@
 #include "audiointerleave.h"
 #include "avformat.h"
 #include "mxf.h"
+#include "internal.h"
 
 static const int NTSC_samples_per_frame[] = { 1602, 1601, 1602, 1601, 1602, 0 };
 static const int PAL_samples_per_frame[]  = { 1920, 0 };
@@ -48,6 +49,7 @@ AVOutputFormat mxf_d10_muxer;
 
 #define EDIT_UNITS_PER_BODY 250
 #define KAG_SIZE 512
+#define SYSTEM_ITEM_SIZE (16+4+57 + 16+4+35)
 
 typedef struct {
     int local_tag;
@@ -190,6 +192,10 @@ typedef struct MXFContext {
     uint64_t body_offset;
     uint32_t instance_number;
     uint8_t umid[16];        ///< unique material identifier
+    int live;                ///< growing file: header metadata repeated in body partitions, no seeking back
+    uint8_t system_item[SYSTEM_ITEM_SIZE]; ///< system item of the edit units, built once
+    uint8_t *aes3_buf;       ///< d-10 audio element being packed
+    unsigned aes3_buf_size;
 } MXFContext;
 
 static const uint8_t uuid_base[]            = { 0xAD,0xAB,0x44,0x24,0x2f,0x25,0x4d,0xc7,0x92,0xff,0x29,0xbd };
@@ -207,6 +213,7 @@ static const uint8_t header_open_partition_key[]   = { 0x06,0x0E,0x2B,0x34,0x02,
 static const uint8_t header_closed_partition_key[] = { 0x06,0x0E,0x2B,0x34,0x02,0x05,0x01,0x01,0x0D,0x01,0x02,0x01,0x01,0x02,0x04,0x00 }; // ClosedComplete
 static const uint8_t klv_fill_key[]                = { 0x06,0x0E,0x2B,0x34,0x01,0x01,0x01,0x01,0x03,0x01,0x02,0x10,0x01,0x00,0x00,0x00 };
 static const uint8_t body_partition_key[]          = { 0x06,0x0E,0x2B,0x34,0x02,0x05,0x01,0x01,0x0D,0x01,0x02,0x01,0x01,0x03,0x04,0x00 }; // ClosedComplete
+static const uint8_t body_open_partition_key[]     = { 0x06,0x0E,0x2B,0x34,0x02,0x05,0x01,0x01,0x0D,0x01,0x02,0x01,0x01,0x03,0x01,0x00 }; // OpenIncomplete
 
 /**
  * partial key for header metadata
@@ -1168,6 +1175,17 @@ static void mxf_write_index_table_segment(AVFormatContext *s)
     }
 }
 
+static void mxf_write_zeros(ByteIOContext *pb, int size)
+{
+    static const uint8_t zeros[KAG_SIZE];
+
+    while (size > 0) {
+        int len = FFMIN(size, sizeof(zeros));
+        put_buffer(pb, zeros, len);
+        size -= len;
+    }
+}
+
 static void mxf_write_klv_fill(AVFormatContext *s)
 {
     unsigned pad = klv_fill_size(url_ftell(s->pb));
@@ -1175,21 +1193,23 @@ static void mxf_write_klv_fill(AVFormatContext *s)
         put_buffer(s->pb, klv_fill_key, 16);
         pad -= 16 + 4;
         klv_encode_ber4_length(s->pb, pad);
-        for (; pad; pad--)
-            put_byte(s->pb, 0);
+        mxf_write_zeros(s->pb, pad);
         assert(!(url_ftell(s->pb) & (KAG_SIZE-1)));
     }
 }
 
-static void mxf_write_partition(AVFormatContext *s, int bodysid,
+static int mxf_write_partition(AVFormatContext *s, int bodysid,
                                 int indexsid,
                                 const uint8_t *key, int write_metadata)
 {
     MXFContext *mxf = s->priv_data;
     ByteIOContext *pb = s->pb;
-    int64_t header_byte_count_offset;
     unsigned index_byte_count = 0;
     uint64_t partition_offset = url_ftell(pb);
+    int is_body = key[13] == 0x03;
+    uint8_t *metadata = NULL;
+    int metadata_size = 0;
+    unsigned header_byte_count = 0;
 
     if (!mxf->edit_unit_byte_count && mxf->edit_units_count)
         index_byte_count = 85 + 12+(s->nb_streams+1)*6 +
@@ -1203,11 +1223,29 @@ static void mxf_write_partition(AVFormatContext *s, int bodysid,
         index_byte_count += klv_fill_size(index_byte_count);
     }
 
-    if (!memcmp(key, body_partition_key, 16)) {
-        mxf->body_partition_offset =
-            av_realloc(mxf->body_partition_offset,
-                       (mxf->body_partitions_count+1)*
-                       sizeof(*mxf->body_partition_offset));
+    if (write_metadata) {
+        /* the header metadata is written first so that its size is known
+         * in the partition pack, which is not patched afterwards */
+        if (url_open_dyn_buf(&s->pb) < 0) {
+            s->pb = pb;
+            return AVERROR(ENOMEM);
+        }
+        mxf_write_primer_pack(s);
+        mxf_write_header_metadata_sets(s);
+        metadata_size = url_close_dyn_buf(s->pb, &metadata);
+        s->pb = pb;
+        header_byte_count = metadata_size + klv_fill_size(metadata_size);
+    }
+
+    if (is_body) {
+        uint64_t *offsets = av_realloc(mxf->body_partition_offset,
+                                       (mxf->body_partitions_count+1)*
+                                       sizeof(*mxf->body_partition_offset));
+        if (!offsets) {
+            av_free(metadata);
+            return AVERROR(ENOMEM);
+        }
+        mxf->body_partition_offset = offsets;
         mxf->body_partition_offset[mxf->body_partitions_count++] = partition_offset;
     }
 
@@ -1222,7 +1260,7 @@ static void mxf_write_partition(AVFormatContext *s, int bodysid,
 
     put_be64(pb, partition_offset); // ThisPartition
 
-    if (!memcmp(key, body_partition_key, 16) && mxf->body_partitions_count > 1)
+    if (is_body && mxf->body_partitions_count > 1)
         put_be64(pb, mxf->body_partition_offset[mxf->body_partitions_count-2]); // PreviousPartition
     else if (!memcmp(key, footer_partition_key, 16) && mxf->body_partitions_count)
         put_be64(pb, mxf->body_partition_offset[mxf->body_partitions_count-1]); // PreviousPartition
@@ -1231,9 +1269,7 @@ static void mxf_write_partition(AVFormatContext *s, int bodysid,
 
     put_be64(pb, mxf->footer_partition_offset); // footerPartition
 
-    // set offset
-    header_byte_count_offset = url_ftell(pb);
-    put_be64(pb, 0); // headerByteCount, update later
+    put_be64(pb, header_byte_count); // headerByteCount
 
     // indexTable
     put_be64(pb, index_byte_count); // indexByteCount
@@ -1254,24 +1290,13 @@ static void mxf_write_partition(AVFormatContext *s, int bodysid,
     mxf_write_essence_container_refs(s);
 
     if (write_metadata) {
-        // mark the start of the headermetadata and calculate metadata size
-        int64_t pos, start;
-        unsigned header_byte_count;
-
         mxf_write_klv_fill(s);
-        start = url_ftell(s->pb);
-        mxf_write_primer_pack(s);
-        mxf_write_header_metadata_sets(s);
-        pos = url_ftell(s->pb);
-        header_byte_count = pos - start + klv_fill_size(pos);
-
-        // update header_byte_count
-        url_fseek(pb, header_byte_count_offset, SEEK_SET);
-        put_be64(pb, header_byte_count);
-        url_fseek(pb, pos, SEEK_SET);
+        put_buffer(pb, metadata, metadata_size);
+        av_free(metadata);
     }
 
     put_flush_packet(pb);
+    return 0;
 }
 
 static const UID mxf_mpeg2_codec_uls[] = {
@@ -1470,6 +1495,10 @@ static int mxf_write_header(AVFormatContext *s)
                     st->codec->codec_id != CODEC_ID_PCM_S24LE) {
                     av_log(s, AV_LOG_ERROR, "MXF D-10 only support 16 or 24 bits le audio\n");
                 }
+                if (st->codec->channels < 1 || st->codec->channels > 8) {
+                    av_log(s, AV_LOG_ERROR, "MXF D-10 only support 1 to 8 audio channels\n");
+                    return -1;
+                }
                 sc->index = ((MXFStreamContext*)s->streams[0]->priv_data)->index + 1;
             } else
             mxf->slice_count = 1;
@@ -1512,6 +1541,7 @@ static int mxf_write_header(AVFormatContext *s)
     if (s->timestamp)
         mxf->timestamp = mxf_parse_timestamp(s->timestamp);
     mxf->duration = -1;
+    mxf->live = !!(s->flags & AVFMT_FLAG_LIVE);
 
     mxf->timecode_track = av_mallocz(sizeof(*mxf->timecode_track));
     if (!mxf->timecode_track)
@@ -1551,45 +1581,65 @@ static uint32_t ff_framenum_to_12m_time_code(unsigned frame, int drop, int fps)
            (  (frame / (fps * 3600) % 24)) % 10;          // units of hours
 }
 
-static void mxf_write_system_item(AVFormatContext *s)
+/**
+ * Build the system item, of which only the continuity count and the
+ * time code change from one edit unit to the next.
+ */
+static void mxf_init_system_item(AVFormatContext *s)
 {
     MXFContext *mxf = s->priv_data;
-    ByteIOContext *pb = s->pb;
-    unsigned frame;
-    uint32_t time_code;
-
-    frame = mxf->timecode_start + mxf->last_indexed_edit_unit + mxf->edit_units_count;
-
-    // write system metadata pack
-    put_buffer(pb, system_metadata_pack_key, 16);
-    klv_encode_ber4_length(pb, 57);
-    put_byte(pb, 0x5c); // UL, user date/time stamp, picture and sound item present
-    put_byte(pb, 0x04); // content package rate
-    put_byte(pb, 0x00); // content package type
-    put_be16(pb, 0x00); // channel handle
-    put_be16(pb, frame); // continuity count
+    ByteIOContext pb;
+
+    init_put_byte(&pb, mxf->system_item, sizeof(mxf->system_item), 1, NULL, NULL, NULL, NULL);
+
+    // system metadata pack
+    put_buffer(&pb, system_metadata_pack_key, 16);
+    klv_encode_ber4_length(&pb, 57);
+    put_byte(&pb, 0x5c); // UL, user date/time stamp, picture and sound item present
+    put_byte(&pb, 0x04); // content package rate
+    put_byte(&pb, 0x00); // content package type
+    put_be16(&pb, 0x00); // channel handle
+    put_be16(&pb, 0);    // continuity count
     if (mxf->essence_container_count > 1)
-        put_buffer(pb, multiple_desc_ul, 16);
+        put_buffer(&pb, multiple_desc_ul, 16);
     else {
         MXFStreamContext *sc = s->streams[0]->priv_data;
-        put_buffer(pb, mxf_essence_container_uls[sc->index].container_ul, 16);
+        put_buffer(&pb, mxf_essence_container_uls[sc->index].container_ul, 16);
     }
-    put_byte(pb, 0);
-    put_be64(pb, 0);
-    put_be64(pb, 0); // creation date/time stamp
+    put_byte(&pb, 0);
+    put_be64(&pb, 0);
+    put_be64(&pb, 0); // creation date/time stamp
+
+    put_byte(&pb, 0x81); // SMPTE 12M time code
+    put_be32(&pb, 0);
+    put_be32(&pb, 0); // binary group data
+    put_be64(&pb, 0);
+
+    // system metadata package set
+    put_buffer(&pb, system_metadata_package_set_key, 16);
+    klv_encode_ber4_length(&pb, 35);
+    put_byte(&pb, 0x83); // UMID
+    put_be16(&pb, 0x20);
+    put_buffer(&pb, umid_ul, 13);
+    put_be24(&pb, mxf->instance_number);
+    put_buffer(&pb, mxf->umid, 15);
+    put_byte(&pb, 1);
+}
 
-    put_byte(pb, 0x81); // SMPTE 12M time code
-    time_code = ff_framenum_to_12m_time_code(frame, mxf->timecode_drop_frame, mxf->timecode_base);
-    put_be32(pb, time_code);
-    put_be32(pb, 0); // binary group data
-    put_be64(pb, 0);
+static void mxf_write_system_item(AVFormatContext *s)
+{
+    MXFContext *mxf = s->priv_data;
+    unsigned frame;
 
-    // write system metadata package set
-    put_buffer(pb, system_metadata_package_set_key, 16);
-    klv_encode_ber4_length(pb, 35);
-    put_byte(pb, 0x83); // UMID
-    put_be16(pb, 0x20);
-    mxf_write_umid(s, 1);
+    if (!mxf->system_item[0])
+        mxf_init_system_item(s);
+
+    frame = mxf->timecode_start + mxf->last_indexed_edit_unit + mxf->edit_units_count;
+
+    AV_WB16(mxf->system_item + 25, frame); // continuity count
+    AV_WB32(mxf->system_item + 61, ff_framenum_to_12m_time_code(frame,
+            mxf->timecode_drop_frame, mxf->timecode_base));
+    put_buffer(s->pb, mxf->system_item, sizeof(mxf->system_item));
 }
 
 static void mxf_write_d10_video_packet(AVFormatContext *s, AVStream *st, AVPacket *pkt)
@@ -1612,46 +1662,55 @@ static void mxf_write_d10_video_packet(AVFormatContext *s, AVStream *st, AVPacke
         put_buffer(s->pb, klv_fill_key, 16);
         pad -= 16 + 4;
         klv_encode_ber4_length(s->pb, pad);
-        for (; pad; pad--)
-            put_byte(s->pb, 0);
+        mxf_write_zeros(s->pb, pad);
         assert(!(url_ftell(s->pb) & (KAG_SIZE-1)));
     } else {
         av_log(s, AV_LOG_WARNING, "cannot fill d-10 video packet\n");
-        for (; pad > 0; pad--)
-            put_byte(s->pb, 0);
+        mxf_write_zeros(s->pb, pad);
     }
 }
 
-static void mxf_write_d10_audio_packet(AVFormatContext *s, AVStream *st, AVPacket *pkt)
+/** AES3 sub frames of the 8 channels of a d-10 sample, with no audio */
+static const uint8_t aes3_silence[32] = {
+    0,0,0,0, 1,0,0,0, 2,0,0,0, 3,0,0,0, 4,0,0,0, 5,0,0,0, 6,0,0,0, 7,0,0,0,
+};
+
+static int mxf_write_d10_audio_packet(AVFormatContext *s, AVStream *st, AVPacket *pkt)
 {
     MXFContext *mxf = s->priv_data;
     ByteIOContext *pb = s->pb;
     int frame_size = pkt->size / st->codec->block_align;
-    uint8_t *samples = pkt->data;
-    uint8_t *end = pkt->data + pkt->size;
-    int i;
-
-    klv_encode_ber4_length(pb, 4 + frame_size*4*8);
-
-    put_byte(pb, (frame_size == 1920 ? 0 : (mxf->edit_units_count-1) % 5 + 1));
-    put_le16(pb, frame_size);
-    put_byte(pb, (1<<st->codec->channels)-1);
+    int channels = st->codec->channels;
+    const uint8_t *samples = pkt->data;
+    uint8_t *p;
+    int size = 4 + frame_size*4*8;
+    int i, j;
 
-    while (samples < end) {
-        for (i = 0; i < st->codec->channels; i++) {
-            uint32_t sample;
-            if (st->codec->codec_id == CODEC_ID_PCM_S24LE) {
-                sample = AV_RL24(samples)<< 4;
-                samples += 3;
-            } else {
-                sample = AV_RL16(samples)<<12;
-                samples += 2;
-            }
-            put_le32(pb, sample | i);
+    av_fast_malloc(&mxf->aes3_buf, &mxf->aes3_buf_size, size);
+    if (!mxf->aes3_buf)
+        return AVERROR(ENOMEM);
+    p = mxf->aes3_buf;
+
+    *p++ = frame_size == 1920 ? 0 : (mxf->edit_units_count-1) % 5 + 1;
+    AV_WL16(p, frame_size);
+    p += 2;
+    *p++ = (1<<channels)-1;
+
+    /* channel number in the low bits, the unused channels keep their silence */
+    for (j = 0; j < frame_size; j++, p += 32) {
+        memcpy(p, aes3_silence, 32);
+        if (st->codec->codec_id == CODEC_ID_PCM_S24LE) {
+            for (i = 0; i < channels; i++, samples += 3)
+                AV_WL32(p + 4*i, AV_RL24(samples) << 4 | i);
+        } else {
+            for (i = 0; i < channels; i++, samples += 2)
+                AV_WL32(p + 4*i, AV_RL16(samples) << 12 | i);
         }
-        for (; i < 8; i++)
-            put_le32(pb, i);
     }
+
+    klv_encode_ber4_length(pb, size);
+    put_buffer(pb, mxf->aes3_buf, size);
+    return 0;
 }
 
 static int mxf_write_packet(AVFormatContext *s, AVPacket *pkt)
@@ -1679,13 +1738,16 @@ static int mxf_write_packet(AVFormatContext *s, AVPacket *pkt)
     }
 
     if (!mxf->header_written) {
+        int ret;
         if (mxf->edit_unit_byte_count) {
-            mxf_write_partition(s, 1, 2, header_open_partition_key, 1);
+            ret = mxf_write_partition(s, 1, 2, header_open_partition_key, 1);
             mxf_write_klv_fill(s);
             mxf_write_index_table_segment(s);
         } else {
-            mxf_write_partition(s, 0, 0, header_open_partition_key, 1);
+            ret = mxf_write_partition(s, 0, 0, header_open_partition_key, 1);
         }
+        if (ret < 0)
+            return ret;
         mxf->header_written = 1;
     }
 
@@ -1693,11 +1755,26 @@ static int mxf_write_packet(AVFormatContext *s, AVPacket *pkt)
         if (!mxf->edit_unit_byte_count &&
             (!mxf->edit_units_count || mxf->edit_units_count > EDIT_UNITS_PER_BODY) &&
             !(flags & 0x33)) { // I frame, Gop start
+            /* a growing file repeats the header metadata with the duration
+             * so far, for readers that open the file while it is written */
+            if (mxf->live)
+                mxf->duration = mxf->last_indexed_edit_unit + mxf->edit_units_count;
             mxf_write_klv_fill(s);
-            mxf_write_partition(s, 1, 2, body_partition_key, 0);
+            if (mxf_write_partition(s, 1, 2, mxf->live ? body_open_partition_key :
+                                    body_partition_key, mxf->live) < 0)
+                return AVERROR(ENOMEM);
 
             mxf_write_klv_fill(s);
             mxf_write_index_table_segment(s);
+        } else if (mxf->live && mxf->edit_unit_byte_count && mxf->edit_units_count &&
+                   !(mxf->edit_units_count % EDIT_UNITS_PER_BODY)) {
+            /* constant edit unit size, the index of the header partition
+             * holds for the whole file */
+            mxf->duration    = mxf->edit_units_count;
+            mxf->body_offset = mxf->edit_units_count * (uint64_t)mxf->edit_unit_byte_count;
+            mxf_write_klv_fill(s);
+            if (mxf_write_partition(s, 1, 0, body_open_partition_key, 1) < 0)
+                return AVERROR(ENOMEM);
         }
 
         mxf_write_klv_fill(s);
@@ -1719,8 +1796,8 @@ static int mxf_write_packet(AVFormatContext *s, AVPacket *pkt)
     if (s->oformat == &mxf_d10_muxer) {
         if (st->codec->codec_type == CODEC_TYPE_VIDEO)
             mxf_write_d10_video_packet(s, st, pkt);
-        else
-            mxf_write_d10_audio_packet(s, st, pkt);
+        else if (mxf_write_d10_audio_packet(s, st, pkt) < 0)
+            return AVERROR(ENOMEM);
     } else {
         klv_encode_ber4_length(pb, pkt->size); // write length
         put_buffer(pb, pkt->data, pkt->size);
@@ -1768,10 +1845,12 @@ static int mxf_write_footer(AVFormatContext *s)
 
     mxf_write_klv_fill(s);
     mxf->footer_partition_offset = url_ftell(pb);
+    /* a growing file is not seeked back into, its final header metadata
+     * is in the footer */
     if (mxf->edit_unit_byte_count) { // no need to repeat index
-        mxf_write_partition(s, 0, 0, footer_partition_key, 0);
+        mxf_write_partition(s, 0, 0, footer_partition_key, mxf->live);
     } else {
-        mxf_write_partition(s, 0, 2, footer_partition_key, 0);
+        mxf_write_partition(s, 0, 2, footer_partition_key, mxf->live);
 
         mxf_write_klv_fill(s);
         mxf_write_index_table_segment(s);
@@ -1780,7 +1859,7 @@ static int mxf_write_footer(AVFormatContext *s)
     mxf_write_klv_fill(s);
     mxf_write_random_index_pack(s);
 
-    if (!url_is_streamed(s->pb)) {
+    if (!url_is_streamed(s->pb) && !mxf->live) {
         url_fseek(pb, 0, SEEK_SET);
         if (mxf->edit_unit_byte_count) {
             mxf_write_partition(s, 1, 2, header_closed_partition_key, 1);
@@ -1797,6 +1876,7 @@ static int mxf_write_footer(AVFormatContext *s)
 
     av_freep(&mxf->index_entries);
     av_freep(&mxf->body_partition_offset);
+    av_freep(&mxf->aes3_buf);
     av_freep(&mxf->timecode_track->priv_data);
     av_freep(&mxf->timecode_track);
 
@@ -1805,62 +1885,40 @@ static int mxf_write_footer(AVFormatContext *s)
     return 0;
 }
 
+static int mxf_compare_timestamps(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
+{
+    MXFStreamContext *sc  = s->streams[pkt ->stream_index]->priv_data;
+    MXFStreamContext *sc2 = s->streams[next->stream_index]->priv_data;
+
+    return next->dts > pkt->dts ||
+        (next->dts == pkt->dts && sc->order < sc2->order);
+}
+
 static int mxf_interleave_get_packet(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush)
 {
-    AVPacketList *pktl;
-    int stream_count = 0;
-    int streams[MAX_STREAMS];
-
-    memset(streams, 0, sizeof(streams));
-    pktl = s->packet_buffer;
-    while (pktl) {
-        //av_log(s, AV_LOG_DEBUG, "show st:%d dts:%lld\n", pktl->pkt.stream_index, pktl->pkt.dts);
-        if (!streams[pktl->pkt.stream_index])
-            stream_count++;
-        streams[pktl->pkt.stream_index]++;
-        pktl = pktl->next;
-    }
+    int stream_count = ff_interleave_queued_streams(s);
 
     if (stream_count && (s->nb_streams == stream_count || flush)) {
-        pktl = s->packet_buffer;
         if (s->nb_streams != stream_count) {
-            AVPacketList *last = NULL;
+            AVPacket kept[MAX_STREAMS], tmp, *next;
+            int i, nb_kept = 0;
             // find last packet in edit unit
-            while (pktl) {
-                if (!stream_count || pktl->pkt.stream_index == 0)
-                    break;
-                last = pktl;
-                pktl = pktl->next;
-                stream_count--;
-            }
+            while (nb_kept < stream_count && (next = ff_interleave_peek(s)) &&
+                   next->stream_index != 0)
+                ff_interleave_get_packet(s, &kept[nb_kept++]);
             // purge packet queue
-            while (pktl) {
-                AVPacketList *next = pktl->next;
-
-                if(s->streams[pktl->pkt.stream_index]->last_in_packet_buffer == pktl)
-                    s->streams[pktl->pkt.stream_index]->last_in_packet_buffer= NULL;
-                av_free_packet(&pktl->pkt);
-                av_freep(&pktl);
-                pktl = next;
-            }
-            if (last)
-                last->next = NULL;
-            else {
-                s->packet_buffer = NULL;
-                s->packet_buffer_end= NULL;
+            while (ff_interleave_get_packet(s, &tmp))
+                av_free_packet(&tmp);
+            if (!nb_kept)
                 goto out;
-            }
-            pktl = s->packet_buffer;
+            for (i = 1; i < nb_kept; i++)
+                ff_interleave_add_packet(s, &kept[i], mxf_compare_timestamps);
+            *out = kept[0];
+            return 1;
         }
 
-        *out = pktl->pkt;
+        ff_interleave_get_packet(s, out);
         //av_log(s, AV_LOG_DEBUG, "out st:%d dts:%lld\n", (*out).stream_index, (*out).dts);
-        s->packet_buffer = pktl->next;
-        if(s->streams[pktl->pkt.stream_index]->last_in_packet_buffer == pktl)
-            s->streams[pktl->pkt.stream_index]->last_in_packet_buffer= NULL;
-        if(!s->packet_buffer)
-            s->packet_buffer_end= NULL;
-        av_freep(&pktl);
         return 1;
     } else {
     out:
@@ -1869,15 +1927,6 @@ static int mxf_interleave_get_packet(AVFormatContext *s, AVPacket *out, AVPacket
     }
 }
 
-static int mxf_compare_timestamps(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
-{
-    MXFStreamContext *sc  = s->streams[pkt ->stream_index]->priv_data;
-    MXFStreamContext *sc2 = s->streams[next->stream_index]->priv_data;
-
-    return next->dts > pkt->dts ||
-        (next->dts == pkt->dts && sc->order < sc2->order);
-}
-
 static int mxf_interleave(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush)
 {
     return ff_audio_rechunk_interleave(s, out, pkt, flush,
@@ -46,6 +46,25 @@
 
 int ff_socket_nonblock(int socket, int enable);
 
+struct pollfd;
+struct URLInterrupt;
+
+/**
+ * Wait for events on the given descriptors like poll(), returning early
+ * when the I/O is interrupted through url_interrupt_cb or intr.
+ * If url_enable_interrupt_wakeup() succeeded, this sleeps until an event or
+ * url_interrupt_wakeup(), otherwise the callback is checked every 100 ms.
+ *
+ * @param intr interrupt settings of the context doing the I/O, may be NULL
+ * @param fds array with room for nfds + 1 entries, the last is used internally
+ * @param timeout maximum time to wait in milliseconds, -1 for no limit
+ * @return number of ready descriptors, 0 on timeout, AVERROR(EINTR) if
+ *         interrupted, AVERROR(ETIMEDOUT) if the deadline of intr passed,
+ *         AVERROR(EIO) on error
+ */
+int ff_network_poll(const struct URLInterrupt *intr, struct pollfd *fds, int nfds,
+                    int timeout);
+
 static inline int ff_network_init(void)
 {
 #if HAVE_WINSOCK2_H
@@ -152,4 +171,14 @@ int ff_getnameinfo(const struct sockaddr *sa, int salen,
 #define getnameinfo ff_getnameinfo
 #endif
 
+/**
+ * Same as getaddrinfo(), but answers repeated lookups of a node and
+ * service from a process wide cache for up to a minute; getaddrinfo()
+ * does not report the record TTL. Lookups without a node bypass the cache.
+ * The result must be freed with ff_freeaddrinfo_cached().
+ */
+int ff_getaddrinfo_cached(const char *node, const char *service,
+                          const struct addrinfo *hints, struct addrinfo **res);
+void ff_freeaddrinfo_cached(struct addrinfo *res);
+
 #endif /* AVFORMAT_NETWORK_H */
@@ -95,6 +95,11 @@ typedef struct {
     int header_count;
     AVRational *time_base;
     struct AVTreeNode *syncpoints;
+    AVPacketList *analyze_queue;  ///< packets buffered with AVFMT_FLAG_ANALYZE_HEADER until the headers are written (muxer)
+    AVPacketList **analyze_end;   ///< end of analyze_queue, NULL once the headers are written
+    int analyze_size;             ///< bytes in analyze_queue
+    uint8_t *elision_buf;         ///< elision headers found in analyze_queue
+    ByteIOContext *dyn_bc;        ///< reused to build the packets written with put_packet() (muxer)
 } NUTContext;
 
 extern const AVCodecTag ff_nut_subtitle_tags[];
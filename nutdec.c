@@ -23,8 +23,10 @@
 #include <strings.h>
 #include "libavutil/avstring.h"
 #include "libavutil/bswap.h"
+#include "libavutil/intreadwrite.h"
 #include "libavutil/tree.h"
 #include "nut.h"
+#include "internal.h"
 
 #undef NDEBUG
 #include <assert.h>
@@ -109,13 +111,49 @@ static int get_packetheader(NUTContext *nut, ByteIOContext *bc, int calculate_ch
     return size;
 }
 
-static uint64_t find_any_startcode(ByteIOContext *bc, int64_t pos){
+/**
+ * Find the next startcode, scanning no more than
+ * AVFormatContext.max_resync_size bytes if it is set.
+ * @returns the startcode or 0 if none was found
+ */
+static uint64_t find_any_startcode(AVFormatContext *s, int64_t pos){
+    ByteIOContext *bc= s->pb;
     uint64_t state=0;
+    const uint8_t *data, *p, *end;
+    int len;
+    int64_t scanned= 0;
 
+    if(ff_check_work_time(s) < 0)
+        return 0;
     if(pos >= 0)
         url_fseek(bc, pos, SEEK_SET); //note, this may fail if the stream is not seekable, but that should not matter, as in this case we simply start where we currently are
 
+    /* look for the 'N' of the startcodes in the I/O buffer */
+    while((len= url_fpeek(bc, &data, bc->buffer_size)) >= 8){
+        if(s->max_resync_size && scanned >= s->max_resync_size)
+            goto limit;
+        end= data + len - 7;
+        for(p= data; (p= memchr(p, 'N', end - p)); p++){
+            state= AV_RB64(p);
+            switch(state){
+            case MAIN_STARTCODE:
+            case STREAM_STARTCODE:
+            case SYNCPOINT_STARTCODE:
+            case INFO_STARTCODE:
+            case INDEX_STARTCODE:
+                url_fskip(bc, p + 8 - data);
+                return state;
+            }
+        }
+        url_fskip(bc, end - data);
+        scanned += end - data;
+    }
+
+    /* the last bytes, or a protocol returning less than 8 bytes at once */
+    state= 0;
     while(!url_feof(bc)){
+        if(s->max_resync_size && scanned++ >= s->max_resync_size)
+            goto limit;
         state= (state<<8) | get_byte(bc);
         if((state>>56) != 'N')
             continue;
@@ -129,6 +167,9 @@ static uint64_t find_any_startcode(ByteIOContext *bc, int64_t pos){
         }
     }
 
+    return 0;
+limit:
+    av_log(s, AV_LOG_ERROR, "Resync limit of %d bytes reached\n", s->max_resync_size);
     return 0;
 }
 
@@ -138,11 +179,11 @@ static uint64_t find_any_startcode(ByteIOContext *bc, int64_t pos){
  * @param pos the start position of the search, or -1 if the current position
  * @returns the position of the startcode or -1 if not found
  */
-static int64_t find_startcode(ByteIOContext *bc, uint64_t code, int64_t pos){
+static int64_t find_startcode(AVFormatContext *s, uint64_t code, int64_t pos){
     for(;;){
-        uint64_t startcode= find_any_startcode(bc, pos);
+        uint64_t startcode= find_any_startcode(s, pos);
         if(startcode == code)
-            return url_ftell(bc) - 8;
+            return url_ftell(s->pb) - 8;
         else if(startcode == 0)
             return -1;
         pos=-1;
@@ -370,6 +411,14 @@ static int decode_stream_header(NUTContext *nut){
     }
     stc->time_base= &nut->time_base[stc->time_base_id];
     av_set_pts_info(s->streams[stream_id], 63, stc->time_base->num, stc->time_base->den);
+
+    /* the stream header carries everything, video time bases are the
+       frame rate as written by the muxer */
+    st->container_params = FF_PARAM_CODEC | FF_PARAM_EXTRADATA;
+    if (st->codec->codec_type == CODEC_TYPE_VIDEO)
+        st->container_params |= FF_PARAM_DIMENSIONS | FF_PARAM_FRAME_RATE;
+    else if (st->codec->codec_type == CODEC_TYPE_AUDIO)
+        st->container_params |= FF_PARAM_AUDIO;
     return 0;
 }
 
@@ -600,7 +649,7 @@ static int nut_read_header(AVFormatContext *s, AVFormatParameters *ap)
     /* main header */
     pos=0;
     do{
-        pos= find_startcode(bc, MAIN_STARTCODE, pos)+1;
+        pos= find_startcode(s, MAIN_STARTCODE, pos)+1;
         if (pos<0+1){
             av_log(s, AV_LOG_ERROR, "No main startcode found.\n");
             return -1;
@@ -610,7 +659,7 @@ static int nut_read_header(AVFormatContext *s, AVFormatParameters *ap)
     /* stream headers */
     pos=0;
     for(initialized_stream_count=0; initialized_stream_count < s->nb_streams;){
-        pos= find_startcode(bc, STREAM_STARTCODE, pos)+1;
+        pos= find_startcode(s, STREAM_STARTCODE, pos)+1;
         if (pos<0+1){
             av_log(s, AV_LOG_ERROR, "Not all stream headers found.\n");
             return -1;
@@ -622,7 +671,7 @@ static int nut_read_header(AVFormatContext *s, AVFormatParameters *ap)
     /* info headers */
     pos=0;
     for(;;){
-        uint64_t startcode= find_any_startcode(bc, pos);
+        uint64_t startcode= find_any_startcode(s, pos);
         pos= url_ftell(bc);
 
         if(startcode==0){
@@ -747,7 +796,8 @@ static int decode_frame(NUTContext *nut, AVPacket *pkt, int frame_code){
         return 1;
     }
 
-    av_new_packet(pkt, size + nut->header_len[header_idx]);
+    if (ff_new_packet(s, pkt, size + nut->header_len[header_idx]) < 0)
+        return AVERROR(ENOMEM);
     memcpy(pkt->data, nut->header[header_idx], nut->header_len[header_idx]);
     pkt->pos= url_ftell(bc); //FIXME
     get_buffer(bc, pkt->data + nut->header_len[header_idx], size);
@@ -808,7 +858,7 @@ static int nut_read_packet(AVFormatContext *s, AVPacket *pkt)
         default:
 resync:
 av_log(s, AV_LOG_DEBUG, "syncing from %"PRId64"\n", pos);
-            tmp= find_any_startcode(bc, nut->last_syncpoint_pos+1);
+            tmp= find_any_startcode(s, nut->last_syncpoint_pos+1);
             if(tmp==0)
                 return -1;
 av_log(s, AV_LOG_DEBUG, "sync\n");
@@ -825,7 +875,7 @@ av_log(s, AV_LOG_DEBUG, "read_timestamp(X,%d,%"PRId64",%"PRId64")\n", stream_ind
 
     pos= *pos_arg;
     do{
-        pos= find_startcode(bc, SYNCPOINT_STARTCODE, pos)+1;
+        pos= find_startcode(s, SYNCPOINT_STARTCODE, pos)+1;
         if(pos < 1){
             assert(nut->next_startcode == 0);
             av_log(s, AV_LOG_ERROR, "read_timestamp failed.\n");
@@ -882,7 +932,7 @@ static int read_seek(AVFormatContext *s, int stream_index, int64_t pts, int flag
         pos2= sp->back_ptr  - 15;
     }
     av_log(NULL, AV_LOG_DEBUG, "SEEKTO: %"PRId64"\n", pos2);
-    pos= find_startcode(s->pb, SYNCPOINT_STARTCODE, pos2);
+    pos= find_startcode(s, SYNCPOINT_STARTCODE, pos2);
     url_fseek(s->pb, pos, SEEK_SET);
     av_log(NULL, AV_LOG_DEBUG, "SP: %"PRId64"\n", pos);
     if(pos2 > pos || pos2 + 15 < pos){
@@ -24,6 +24,26 @@
 #include "libavcodec/mpegaudiodata.h"
 #include "nut.h"
 
+#define ANALYZE_PACKETS    32      ///< packets per stream analyzed with AVFMT_FLAG_ANALYZE_HEADER
+#define ANALYZE_MAX_SIZE   (4<<20) ///< most bytes buffered for the analysis
+#define MAX_LEARNED_HEADER 16      ///< longest elision header taken from the packets
+
+/**
+ * What the first packets of a stream have in common, to fit the frame
+ * codes and elision headers to them.
+ */
+typedef struct {
+    int packets;
+    int keyframes;
+    int pred_count;
+    int pred_table[5];           ///< most frequent pts deltas
+    int size_count;
+    int sizes[2];                ///< most frequent packet sizes
+    int header_idx[2];           ///< elision header of non keyframes and keyframes, 0 if none
+    uint8_t header[2][MAX_LEARNED_HEADER];
+    int header_len[2];
+} StreamStats;
+
 static int find_expected_header(AVCodecContext *c, int size, int key_frame, uint8_t out[64]){
     int sample_rate= c->sample_rate;
 
@@ -104,9 +124,9 @@ static int find_header_idx(AVFormatContext *s, AVCodecContext *c, int size, int
     return 0;
 }
 
-static void build_elision_headers(AVFormatContext *s){
+static void build_elision_headers(AVFormatContext *s, StreamStats *stats){
     NUTContext *nut = s->priv_data;
-    int i;
+    int i, j, k;
     //FIXME this is lame
     //FIXME write a 2pass mode to find the maximal headers
     static const uint8_t headers[][5]={
@@ -123,9 +143,47 @@ static void build_elision_headers(AVFormatContext *s){
         nut->header_len[i]=  headers[i-1][0];
         nut->header    [i]= &headers[i-1][1];
     }
+
+    if(!stats)
+        return;
+    /* add the prefixes shared by the analyzed packets */
+    for(i=0; i<s->nb_streams; i++){
+        for(k=0; k<2; k++){
+            StreamStats *ss= &stats[i];
+            int len= ss->header_len[k];
+
+            if(!len)
+                continue;
+            for(j=1; j<nut->header_count; j++)
+                if(nut->header_len[j] == len && !memcmp(nut->header[j], ss->header[k], len))
+                    break;
+            if(j == nut->header_count){
+                uint8_t *buf= nut->elision_buf + (2*i + k)*MAX_LEARNED_HEADER;
+                if(nut->header_count >= 128)
+                    continue;
+                memcpy(buf, ss->header[k], len);
+                nut->header_len[j]= len;
+                nut->header    [j]= buf;
+                nut->header_count++;
+            }
+            ss->header_idx[k]= j;
+        }
+    }
+}
+
+/**
+ * Get the elision header for the frame codes of a stream.
+ */
+static int frame_code_header_idx(AVFormatContext *s, AVCodecContext *codec,
+                                 StreamStats *stats, int size, int key_frame){
+    if(stats && stats->header_idx[key_frame])
+        return stats->header_idx[key_frame];
+    if(codec->codec_type == CODEC_TYPE_AUDIO)
+        return find_header_idx(s, codec, size, key_frame);
+    return 0;
 }
 
-static void build_frame_code(AVFormatContext *s){
+static void build_frame_code(AVFormatContext *s, StreamStats *stats){
     NUTContext *nut = s->priv_data;
     int key_frame, index, pred, stream_id;
     int start=1;
@@ -152,10 +210,14 @@ static void build_frame_code(AVFormatContext *s){
         int start2= start + (end-start)*stream_id / s->nb_streams;
         int end2  = start + (end-start)*(stream_id+1) / s->nb_streams;
         AVCodecContext *codec = s->streams[stream_id]->codec;
+        StreamStats *ss= stats ? &stats[stream_id] : NULL;
         int is_audio= codec->codec_type == CODEC_TYPE_AUDIO;
         int intra_only= /*codec->intra_only || */is_audio;
         int pred_count;
 
+        if(ss && ss->packets && ss->keyframes == ss->packets)
+            intra_only= 1;
+
         for(key_frame=0; key_frame<2; key_frame++){
             if(intra_only && keyframe_0_esc && key_frame==0)
                 continue;
@@ -166,8 +228,7 @@ static void build_frame_code(AVFormatContext *s){
                 ft->flags|= FLAG_SIZE_MSB | FLAG_CODED_PTS;
                 ft->stream_id= stream_id;
                 ft->size_mul=1;
-                if(is_audio)
-                    ft->header_idx= find_header_idx(s, codec, -1, key_frame);
+                ft->header_idx= frame_code_header_idx(s, codec, ss, -1, key_frame);
                 start2++;
             }
         }
@@ -176,16 +237,25 @@ static void build_frame_code(AVFormatContext *s){
 #if 1
         if(is_audio){
             int frame_bytes= codec->frame_size*(int64_t)codec->bit_rate / (8*codec->sample_rate);
+            int size_mul= frame_bytes + 2;
+            int pts_delta= 1;
             int pts;
+
+            if(ss && ss->size_count)
+                size_mul= FFMAX(ss->sizes[0], ss->sizes[ss->size_count-1]) + 1;
+            if(ss && ss->pred_count)
+                pts_delta= ss->pred_table[0];
             for(pts=0; pts<2; pts++){
                 for(pred=0; pred<2; pred++){
                     FrameCode *ft= &nut->frame_code[start2];
+                    int size= ss && ss->size_count ? ss->sizes[FFMIN(pred, ss->size_count-1)]
+                                                   : frame_bytes + pred;
                     ft->flags= FLAG_KEY*key_frame;
                     ft->stream_id= stream_id;
-                    ft->size_mul=frame_bytes + 2;
-                    ft->size_lsb=frame_bytes + pred;
-                    ft->pts_delta=pts;
-                    ft->header_idx= find_header_idx(s, codec, frame_bytes + pred, key_frame);
+                    ft->size_mul=size_mul;
+                    ft->size_lsb=size;
+                    ft->pts_delta=pts ? pts_delta : 0;
+                    ft->header_idx= frame_code_header_idx(s, codec, ss, size, key_frame);
                     start2++;
                 }
             }
@@ -194,12 +264,16 @@ static void build_frame_code(AVFormatContext *s){
             ft->flags= FLAG_KEY | FLAG_SIZE_MSB;
             ft->stream_id= stream_id;
             ft->size_mul=1;
-            ft->pts_delta=1;
+            ft->pts_delta=ss && ss->pred_count ? ss->pred_table[0] : 1;
+            ft->header_idx= ss ? ss->header_idx[1] : 0;
             start2++;
         }
 #endif
 
-        if(codec->has_b_frames){
+        if(ss && ss->pred_count){
+            pred_count= ss->pred_count;
+            memcpy(pred_table, ss->pred_table, pred_count*sizeof(*pred_table));
+        }else if(codec->has_b_frames){
             pred_count=5;
             pred_table[0]=-2;
             pred_table[1]=-1;
@@ -229,8 +303,7 @@ static void build_frame_code(AVFormatContext *s){
                 ft->size_mul= end3-start3;
                 ft->size_lsb= index - start3;
                 ft->pts_delta= pred_table[pred];
-                if(is_audio)
-                    ft->header_idx= find_header_idx(s, codec, -1, key_frame);
+                ft->header_idx= frame_code_header_idx(s, codec, ss, -1, key_frame);
             }
         }
     }
@@ -297,10 +370,22 @@ static inline void put_s_trace(ByteIOContext *bc, int64_t v, char *file, char *f
 #define put_s(bc, v)  put_s_trace(bc, v, __FILE__, __PRETTY_FUNCTION__, __LINE__)
 #endif
 
+/**
+ * Get the dynamic buffer of nut, which put_packet() empties again.
+ */
+static int get_dyn_bc(NUTContext *nut, ByteIOContext **dyn_bc){
+    int ret;
+
+    if(!nut->dyn_bc && (ret = url_open_dyn_buf(&nut->dyn_bc)) < 0)
+        return ret;
+    *dyn_bc = nut->dyn_bc;
+    return 0;
+}
+
 //FIXME remove calculate_checksum
 static void put_packet(NUTContext *nut, ByteIOContext *bc, ByteIOContext *dyn_bc, int calculate_checksum, uint64_t startcode){
     uint8_t *dyn_buf=NULL;
-    int dyn_size= url_close_dyn_buf(dyn_bc, &dyn_buf);
+    int dyn_size= url_get_dyn_buf(dyn_bc, &dyn_buf);
     int forw_ptr= dyn_size + 4*calculate_checksum;
 
     if(forw_ptr > 4096)
@@ -316,7 +401,7 @@ static void put_packet(NUTContext *nut, ByteIOContext *bc, ByteIOContext *dyn_bc
     if(calculate_checksum)
         put_le32(bc, get_checksum(bc));
 
-    av_free(dyn_buf);
+    url_reset_dyn_buf(dyn_bc);
 }
 
 static void write_mainheader(NUTContext *nut, ByteIOContext *bc){
@@ -514,40 +599,28 @@ static int write_headers(NUTContext *nut, ByteIOContext *bc){
     ByteIOContext *dyn_bc;
     int i, ret;
 
-    ret = url_open_dyn_buf(&dyn_bc);
+    ret = get_dyn_bc(nut, &dyn_bc);
     if(ret < 0)
         return ret;
     write_mainheader(nut, dyn_bc);
     put_packet(nut, bc, dyn_bc, 1, MAIN_STARTCODE);
 
     for (i=0; i < nut->avf->nb_streams; i++){
-        ret = url_open_dyn_buf(&dyn_bc);
-        if(ret < 0)
-            return ret;
         write_streamheader(nut, dyn_bc, nut->avf->streams[i], i);
         put_packet(nut, bc, dyn_bc, 1, STREAM_STARTCODE);
     }
 
-    ret = url_open_dyn_buf(&dyn_bc);
-    if(ret < 0)
-        return ret;
     write_globalinfo(nut, dyn_bc);
     put_packet(nut, bc, dyn_bc, 1, INFO_STARTCODE);
 
     for (i = 0; i < nut->avf->nb_streams; i++) {
-        ret = url_open_dyn_buf(&dyn_bc);
-        if(ret < 0)
-            return ret;
         ret = write_streaminfo(nut, dyn_bc, i);
         if (ret < 0)
             return ret;
         if (ret > 0)
             put_packet(nut, bc, dyn_bc, 1, INFO_STARTCODE);
-        else {
-            uint8_t* buf;
-            url_close_dyn_buf(dyn_bc, &buf);
-            av_free(buf);
-        }
+        else
+            url_reset_dyn_buf(dyn_bc);
     }
 
     nut->last_syncpoint_pos= INT_MIN;
@@ -555,6 +628,147 @@ static int write_headers(NUTContext *nut, ByteIOContext *bc){
     return 0;
 }
 
+static int write_file_header(AVFormatContext *s, StreamStats *stats){
+    NUTContext *nut = s->priv_data;
+    ByteIOContext *bc = s->pb;
+    int ret;
+
+    build_elision_headers(s, stats);
+    build_frame_code(s, stats);
+    assert(nut->frame_code['N'].flags == FLAG_INVALID);
+
+    put_buffer(bc, ID_STRING, strlen(ID_STRING));
+    put_byte(bc, 0);
+
+    if((ret = write_headers(nut, bc)) < 0)
+        return ret;
+
+    put_flush_packet(bc);
+
+    //FIXME index
+
+    return 0;
+}
+
+/**
+ * Find up to max_out values of v, the most frequent ones first.
+ */
+static int most_frequent(const int *v, int n, int *out, int max_out){
+    uint8_t used[ANALYZE_PACKETS]= {0};
+    int count= 0, i, j;
+
+    while(count < max_out){
+        int best= -1, best_n= 0;
+        for(i=0; i<n; i++){
+            int m= 0;
+            if(used[i])
+                continue;
+            for(j=i; j<n; j++)
+                m+= v[j] == v[i];
+            if(m > best_n){
+                best  = i;
+                best_n= m;
+            }
+        }
+        if(best < 0)
+            break;
+        out[count++]= v[best];
+        for(i=best; i<n; i++)
+            if(v[i] == v[best])
+                used[i]= 1;
+    }
+    return count;
+}
+
+static void analyze_stream(AVFormatContext *s, int stream_id, StreamStats *ss){
+    NUTContext *nut = s->priv_data;
+    AVPacketList *pktl;
+    int deltas[ANALYZE_PACKETS], sizes[ANALYZE_PACKETS];
+    int prefixed[2]= {0};
+    int64_t last_pts= AV_NOPTS_VALUE;
+    int i;
+
+    for(pktl= nut->analyze_queue; pktl && ss->packets < ANALYZE_PACKETS; pktl= pktl->next){
+        AVPacket *pkt= &pktl->pkt;
+        int key= !!(pkt->flags & PKT_FLAG_KEY);
+
+        if(pkt->stream_index != stream_id)
+            continue;
+        /* pts_delta of the frame codes is 16 bits */
+        if(last_pts != AV_NOPTS_VALUE && FFABS(pkt->pts - last_pts) < 16384)
+            deltas[ss->packets-1]= pkt->pts - last_pts;
+        else if(ss->packets)
+            deltas[ss->packets-1]= 0;
+        last_pts= pkt->pts;
+        sizes[ss->packets++]= pkt->size;
+        ss->keyframes+= key;
+
+        /* frames larger than 4096 bytes never use elision headers */
+        if(pkt->size > 4096)
+            continue;
+        if(!prefixed[key]++){
+            ss->header_len[key]= FFMIN(pkt->size, MAX_LEARNED_HEADER);
+            memcpy(ss->header[key], pkt->data, ss->header_len[key]);
+        }else{
+            for(i=0; i<ss->header_len[key] && i<pkt->size; i++)
+                if(ss->header[key][i] != pkt->data[i])
+                    break;
+            ss->header_len[key]= i;
+        }
+    }
+
+    if(ss->packets > 1)
+        ss->pred_count= most_frequent(deltas, ss->packets-1, ss->pred_table,
+                                      FF_ARRAY_ELEMS(ss->pred_table));
+    /* a delta of 0 is left to the frame codes with coded pts */
+    for(i=0; i<ss->pred_count; i++)
+        if(!ss->pred_table[i])
+            ss->pred_table[i--]= ss->pred_table[--ss->pred_count];
+    if(s->streams[stream_id]->codec->codec_type == CODEC_TYPE_AUDIO){
+        ss->size_count= most_frequent(sizes, ss->packets, ss->sizes, 2);
+        for(i=0; i<ss->size_count; i++)
+            if(ss->sizes[i] >= 0xFFFF) // size_mul is 16 bits
+                ss->size_count= 0;
+    }
+    for(i=0; i<2; i++)
+        if(prefixed[i] < 2 || ss->header_len[i] < 2)
+            ss->header_len[i]= 0;
+}
+
+static int write_frame(AVFormatContext *s, AVPacket *pkt);
+
+/**
+ * Write the headers fitted to the buffered packets, then the packets.
+ */
+static int flush_analysis(AVFormatContext *s){
+    NUTContext *nut = s->priv_data;
+    StreamStats *stats;
+    int i, ret;
+
+    nut->analyze_end= NULL;
+    stats= av_mallocz(s->nb_streams * sizeof(*stats));
+    nut->elision_buf= av_malloc(s->nb_streams * 2 * MAX_LEARNED_HEADER);
+    if(!stats || !nut->elision_buf){
+        av_free(stats);
+        ret= AVERROR(ENOMEM);
+    }else{
+        for(i=0; i<s->nb_streams; i++)
+            analyze_stream(s, i, &stats[i]);
+        ret= write_file_header(s, stats);
+        av_free(stats);
+    }
+
+    while(nut->analyze_queue){
+        AVPacketList *pktl= nut->analyze_queue;
+        if(ret >= 0)
+            ret= write_frame(s, &pktl->pkt);
+        nut->analyze_queue= pktl->next;
+        av_free_packet(&pktl->pkt);
+        av_free(pktl);
+    }
+    return ret;
+}
+
 static int write_header(AVFormatContext *s){
     NUTContext *nut = s->priv_data;
     ByteIOContext *bc = s->pb;
@@ -591,20 +805,14 @@ static int write_header(AVFormatContext *s){
     }
 
     nut->max_distance = MAX_DISTANCE;
-    build_elision_headers(s);
-    build_frame_code(s);
-    assert(nut->frame_code['N'].flags == FLAG_INVALID);
-
-    put_buffer(bc, ID_STRING, strlen(ID_STRING));
-    put_byte(bc, 0);
-
-    write_headers(nut, bc);
-
-    put_flush_packet(bc);
 
-    //FIXME index
+    /* the headers are written once the first packets are known */
+    if(s->flags & AVFMT_FLAG_ANALYZE_HEADER){
+        nut->analyze_end= &nut->analyze_queue;
+        return 0;
+    }
 
-    return 0;
+    return write_file_header(s, NULL);
 }
 
 static int get_needed_flags(NUTContext *nut, StreamContext *nus, FrameCode *fc, AVPacket *pkt){
@@ -645,6 +853,43 @@ static int find_best_header_idx(NUTContext *nut, AVPacket *pkt){
 }
 
 static int write_packet(AVFormatContext *s, AVPacket *pkt){
+    NUTContext *nut = s->priv_data;
+    AVPacketList *pktl;
+    int i, done;
+
+    if(!nut->analyze_end)
+        return write_frame(s, pkt);
+
+    pktl= av_mallocz(sizeof(*pktl));
+    if(!pktl || av_new_packet(&pktl->pkt, pkt->size) < 0){
+        av_free(pktl);
+        return AVERROR(ENOMEM);
+    }
+    memcpy(pktl->pkt.data, pkt->data, pkt->size);
+    pktl->pkt.pts         = pkt->pts;
+    pktl->pkt.dts         = pkt->dts;
+    pktl->pkt.stream_index= pkt->stream_index;
+    pktl->pkt.flags       = pkt->flags;
+    pktl->pkt.duration    = pkt->duration;
+    pktl->pkt.pos         = pkt->pos;
+    *nut->analyze_end= pktl;
+    nut->analyze_end= &pktl->next;
+    nut->analyze_size+= pkt->size;
+
+    done= nut->analyze_size >= ANALYZE_MAX_SIZE;
+    for(i=0; i<s->nb_streams && !done; i++){
+        int count= 0;
+        for(pktl= nut->analyze_queue; pktl && count < ANALYZE_PACKETS; pktl= pktl->next)
+            count+= pktl->pkt.stream_index == i;
+        if(count < ANALYZE_PACKETS)
+            break;
+    }
+    if(done || i == s->nb_streams)
+        return flush_analysis(s);
+    return 0;
+}
+
+static int write_frame(AVFormatContext *s, AVPacket *pkt){
     NUTContext *nut = s->priv_data;
     StreamContext *nus= &nut->stream[pkt->stream_index];
     ByteIOContext *bc = s->pb, *dyn_bc;
@@ -687,7 +932,7 @@ static int write_packet(AVFormatContext *s, AVPacket *pkt){
         sp= av_tree_find(nut->syncpoints, &dummy, ff_nut_sp_pos_cmp, NULL);
 
         nut->last_syncpoint_pos= url_ftell(bc);
-        ret = url_open_dyn_buf(&dyn_bc);
+        ret = get_dyn_bc(nut, &dyn_bc);
         if(ret < 0)
             return ret;
         put_tt(nut, nus, dyn_bc, pkt->dts);
@@ -800,12 +1045,24 @@ static int write_packet(AVFormatContext *s, AVPacket *pkt){
 static int write_trailer(AVFormatContext *s){
     NUTContext *nut= s->priv_data;
     ByteIOContext *bc= s->pb;
+    int ret= 0;
+
+    if(nut->analyze_end)
+        ret= flush_analysis(s);
 
     while(nut->header_count<3)
         write_headers(nut, bc);
     put_flush_packet(bc);
 
-    return 0;
+    av_freep(&nut->elision_buf);
+    if(nut->dyn_bc){
+        uint8_t *buf;
+        url_close_dyn_buf(nut->dyn_bc, &buf);
+        av_free(buf);
+        nut->dyn_bc = NULL;
+    }
+
+    return ret;
 }
 
 AVOutputFormat nut_muxer = {
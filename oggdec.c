@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include "oggdec.h"
 #include "avformat.h"
+#include "internal.h"
 
 #define MAX_PAGE_SIZE 65307
 #define DECODER_BUFFER_SIZE MAX_PAGE_SIZE
@@ -52,27 +53,72 @@ static const struct ogg_codec * const ogg_codecs[] = {
     NULL
 };
 
-//FIXME We could avoid some structure duplication
+static void
+ogg_free_state (struct ogg_state *ost)
+{
+    int i;
+
+    if (!ost)
+        return;
+    for (i = 0; i < ost->nstreams; i++)
+        av_free (ost->streams[i].buf);
+    av_free (ost);
+}
+
+/**
+ * Save the stream states. The state and the stream buffers left over by
+ * the last ogg_restore() are reused, so repeated probes do not allocate.
+ */
 static int
 ogg_save (AVFormatContext * s)
 {
     struct ogg *ogg = s->priv_data;
-    struct ogg_state *ost =
-        av_malloc(sizeof (*ost) + (ogg->nstreams-1) * sizeof (*ogg->streams));
-    int i;
-    ost->pos = url_ftell (s->pb);
-    ost->curidx = ogg->curidx;
-    ost->next = ogg->state;
-    ost->nstreams = ogg->nstreams;
-    memcpy(ost->streams, ogg->streams, ogg->nstreams * sizeof(*ogg->streams));
+    struct ogg_state *ost = ogg->spare;
+    int i, nbufs = ost ? ost->nstreams : 0;
+
+    if (!ost || ost->nalloc < ogg->nstreams){
+        ost = av_realloc (ost, sizeof (*ost) + (ogg->nstreams-1) * sizeof (*ogg->streams));
+        if (!ost)
+            return AVERROR(ENOMEM);
+        ost->nalloc = ogg->nstreams;
+        ogg->spare = ost;
+    }
+    for (i = nbufs; i < ogg->nstreams; i++){
+        ost->streams[i].buf = NULL;
+        ost->streams[i].bufsize = 0;
+    }
+    ost->nstreams = FFMAX(nbufs, ogg->nstreams);
 
+    for (i = 0; i < ogg->nstreams; i++){
+        struct ogg_stream *spare = ost->streams + i;
+        if (spare->bufsize < ogg->streams[i].bufsize){
+            av_free (spare->buf);
+            spare->bufsize = 0;
+            if (!(spare->buf = av_malloc (ogg->streams[i].bufsize)))
+                return AVERROR(ENOMEM);
+            spare->bufsize = ogg->streams[i].bufsize;
+        }
+    }
+    for (; i < ost->nstreams; i++)
+        av_free (ost->streams[i].buf);
+    ogg->spare = NULL;
+
+    /* the saved state keeps the buffers, the streams go on with copies */
     for (i = 0; i < ogg->nstreams; i++){
         struct ogg_stream *os = ogg->streams + i;
-        os->buf = av_malloc (os->bufsize);
-        memset (os->buf, 0, os->bufsize);
+        uint8_t *buf = ost->streams[i].buf;
+        unsigned int bufsize = ost->streams[i].bufsize;
+
+        ost->streams[i] = *os;
+        os->buf = buf;
+        os->bufsize = bufsize;
         memcpy (os->buf, ost->streams[i].buf, os->bufpos);
     }
 
+    ost->pos = url_ftell (s->pb);
+    ost->curidx = ogg->curidx;
+    ost->next = ogg->state;
+    ost->nstreams = ogg->nstreams;
     ogg->state = ost;
 
     return 0;
@@ -92,17 +138,33 @@ ogg_restore (AVFormatContext * s, int discard)
     ogg->state = ost->next;
 
     if (!discard){
-        for (i = 0; i < ogg->nstreams; i++)
-            av_free (ogg->streams[i].buf);
+        /* swap the saved streams back in, their buffers become spares */
+        for (i = 0; i < ogg->nstreams; i++){
+            struct ogg_stream *os = ogg->streams + i;
+            uint8_t *buf = os->buf;
+            unsigned int bufsize = os->bufsize;
+
+            if (i < ost->nstreams){
+                *os = ost->streams[i];
+            } else if (i >= ost->nalloc){
+                av_free (buf);
+                continue;
+            }
+            ost->streams[i].buf = buf;
+            ost->streams[i].bufsize = bufsize;
+        }
 
         url_fseek (bc, ost->pos, SEEK_SET);
         ogg->curidx = ost->curidx;
+        i = ogg->nstreams;
         ogg->nstreams = ost->nstreams;
-        memcpy(ogg->streams, ost->streams,
-               ost->nstreams * sizeof(*ogg->streams));
+        ost->nstreams = FFMIN(i, ost->nalloc);
     }
 
-    av_free (ost);
+    if (ogg->spare)
+        ogg_free_state (ost);
+    else
+        ogg->spare = ost;
 
     return 0;
 }
@@ -198,6 +260,53 @@ ogg_new_buf(struct ogg *ogg, int idx)
     return 0;
 }
 
+static uint64_t
+ogg_gptopts (AVFormatContext * s, int i, uint64_t gp, int64_t *dts);
+
+/**
+ * Skip to the next capture pattern, scanning the I/O buffer with memchr(),
+ * up to AVFormatContext.max_resync_size bytes or a page if it is not set.
+ * @return 0 with the pattern at the current position, -1 if none was found,
+ *         AVERROR_WORK_LIMIT if max_resync_size or max_work_time was reached
+ */
+static int
+ogg_resync (AVFormatContext * s)
+{
+    ByteIOContext *bc = s->pb;
+    const uint8_t *data, *p, *end;
+    int len, ret, scanned = 0;
+    int max_scan = s->max_resync_size ? s->max_resync_size : MAX_PAGE_SIZE;
+
+    if ((ret = ff_check_work_time (s)) < 0)
+        return ret;
+
+    while (scanned < max_scan){
+        len = url_fpeek (bc, &data, FFMIN(bc->buffer_size, max_scan - scanned + 4));
+        if (len < 4)
+            return -1;
+        end = data + len;
+        for (p = data; (p = memchr (p, 'O', end - p)); p++){
+            if (p + 4 > end)
+                break;
+            if (!memcmp (p, "OggS", 4)){
+                url_fskip (bc, p - data);
+                return 0;
+            }
+        }
+        /* keep a partial pattern at the end for the next peek */
+        p = FFMAX(end - 3, data + 1);
+        url_fskip (bc, p - data);
+        scanned += p - data;
+    }
+
+    if (s->max_resync_size){
+        av_log (s, AV_LOG_ERROR, "Resync limit of %d bytes reached\n", s->max_resync_size);
+        return AVERROR_WORK_LIMIT;
+    }
+    av_log (s, AV_LOG_INFO, "ogg, can't find sync word\n");
+    return -1;
+}
+
 static int
 ogg_read_page (AVFormatContext * s, int *str)
 {
@@ -210,31 +319,13 @@ ogg_read_page (AVFormatContext * s, int *str)
     uint32_t serial;
     uint32_t seq;
     uint32_t crc;
-    int size, idx;
-    uint8_t sync[4];
-    int sp = 0;
+    int size, idx, ret;
+    int64_t page_pos;
 
-    if (get_buffer (bc, sync, 4) < 4)
-        return -1;
-
-    do{
-        int c;
-
-        if (sync[sp & 3] == 'O' &&
-            sync[(sp + 1) & 3] == 'g' &&
-            sync[(sp + 2) & 3] == 'g' && sync[(sp + 3) & 3] == 'S')
-            break;
-
-        c = url_fgetc (bc);
-        if (c < 0)
-            return -1;
-        sync[sp++ & 3] = c;
-    }while (i++ < MAX_PAGE_SIZE);
-
-    if (i >= MAX_PAGE_SIZE){
-        av_log (s, AV_LOG_INFO, "ogg, can't find sync word\n");
-        return -1;
-    }
+    if ((ret = ogg_resync (s)) < 0)
+        return ret;
+    page_pos = url_ftell (bc);
+    url_fskip (bc, 4);
 
     if (url_fgetc (bc) != 0)      /* version */
         return -1;
@@ -281,6 +372,17 @@ ogg_read_page (AVFormatContext * s, int *str)
         os->psize = 0;
     }
 
+    /* the payload of discarded streams is not read, their partial packets
+     * are dropped */
+    if (os->header > -1 && idx < s->nb_streams &&
+        s->streams[idx]->discard >= AVDISCARD_ALL){
+        url_fskip (bc, size);
+        os->bufpos = os->pstart = os->psize = 0;
+        os->segp = os->nsegs = 0;
+        os->lastpts = os->lastdts = AV_NOPTS_VALUE;
+        size = 0;
+    }
+
     if (os->bufsize - os->bufpos < size){
         uint8_t *nb = av_malloc (os->bufsize *= 2);
         memcpy (nb, os->buf, os->bufpos);
@@ -295,6 +397,11 @@ ogg_read_page (AVFormatContext * s, int *str)
     os->granule = gp;
     os->flags = flags;
 
+    /* pages seen while playing or bisecting narrow down later seeks */
+    if (gp != -1 && gp != 0 && os->codec && idx < s->nb_streams)
+        av_add_index_entry (s->streams[idx], page_pos,
+                            ogg_gptopts (s, idx, gp, NULL), 0, 0, AVINDEX_KEYFRAME);
+
     if (str)
         *str = idx;
 
@@ -305,7 +412,7 @@ static int
 ogg_packet (AVFormatContext * s, int *str, int *dstart, int *dsize)
 {
     struct ogg *ogg = s->priv_data;
-    int idx, i;
+    int idx, i, ret;
     struct ogg_stream *os;
     int complete = 0;
     int segp = 0, psize = 0;
@@ -318,8 +425,8 @@ ogg_packet (AVFormatContext * s, int *str, int *dstart, int *dsize)
         idx = ogg->curidx;
 
         while (idx < 0){
-            if (ogg_read_page (s, &idx) < 0)
-                return -1;
+            if ((ret = ogg_read_page (s, &idx)) < 0)
+                return ret;
         }
 
         os = ogg->streams + idx;
@@ -415,10 +522,11 @@ static int
 ogg_get_headers (AVFormatContext * s)
 {
     struct ogg *ogg = s->priv_data;
+    int ret;
 
     do{
-        if (ogg_packet (s, NULL, NULL, NULL) < 0)
-            return -1;
+        if ((ret = ogg_packet (s, NULL, NULL, NULL)) < 0)
+            return ret;
     }while (!ogg->headers);
 
 #if 0
@@ -466,7 +574,8 @@ ogg_get_length (AVFormatContext * s)
         return 0;
     end = size > MAX_PAGE_SIZE? size - MAX_PAGE_SIZE: 0;
 
-    ogg_save (s);
+    if (ogg_save (s) < 0)
+        return AVERROR(ENOMEM);
     url_fseek (s->pb, end, SEEK_SET);
 
     while (!ogg_read_page (s, &i)){
@@ -494,8 +603,8 @@ ogg_read_header (AVFormatContext * s, AVFormatParameters * ap)
     int i;
     ogg->curidx = -1;
     //linear headers seek from start
-    if (ogg_get_headers (s) < 0){
-        return -1;
+    if ((i = ogg_get_headers (s)) < 0){
+        return i == AVERROR_WORK_LIMIT ? i : -1;
     }
 
     for (i = 0; i < ogg->nstreams; i++)
@@ -516,12 +625,12 @@ ogg_read_packet (AVFormatContext * s, AVPacket * pkt)
     struct ogg *ogg;
     struct ogg_stream *os;
     int idx = -1;
-    int pstart, psize;
+    int pstart, psize, ret;
 
     //Get an ogg packet
     do{
-        if (ogg_packet (s, &idx, &pstart, &psize) < 0)
-            return AVERROR(EIO);
+        if ((ret = ogg_packet (s, &idx, &pstart, &psize)) < 0)
+            return ret == AVERROR_WORK_LIMIT ? ret : AVERROR(EIO);
     }while (idx < 0 || !s->streams[idx]);
 
     ogg = s->priv_data;
@@ -570,6 +679,12 @@ ogg_read_close (AVFormatContext * s)
         av_free (ogg->streams[i].private);
     }
     av_free (ogg->streams);
+    while (ogg->state){
+        struct ogg_state *ost = ogg->state;
+        ogg->state = ost->next;
+        ogg_free_state (ost);
+    }
+    ogg_free_state (ogg->spare);
     return 0;
 }
 
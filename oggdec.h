@@ -80,6 +80,7 @@ struct ogg_state {
     int curidx;
     struct ogg_state *next;
     int nstreams;
+    int nalloc;                 ///< number of streams there is room for
     struct ogg_stream streams[1];
 };
 
@@ -90,6 +91,7 @@ struct ogg {
     int curidx;
     uint64_t size;
     struct ogg_state *state;
+    struct ogg_state *spare;    ///< released by ogg_restore(), reused by ogg_save()
 };
 
 #define OGG_FLAG_CONT 1
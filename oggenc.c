@@ -36,51 +36,102 @@ typedef struct {
     int64_t last_kf_pts;
     int vrev;
     int eos;
+    /** page being filled */
+    uint8_t *page;
+    int page_size;
+    uint8_t segments[255];
+    int nb_segments;
+    int64_t page_granule;  ///< granule of the last packet completed in the page, -1 if none
+    int64_t page_start;    ///< pts of the first packet in the page
+    int continued;         ///< the page starts with the rest of a packet
 } OGGStreamContext;
 
-static void ogg_update_checksum(AVFormatContext *s, int64_t crc_offset)
+/**
+ * Write out the page being filled, with its checksum computed in memory
+ * so that the output is never seeked back into.
+ */
+static void ogg_write_page(AVFormatContext *s, int stream_index, int flags)
 {
-    int64_t pos = url_ftell(s->pb);
-    uint32_t checksum = get_checksum(s->pb);
-    url_fseek(s->pb, crc_offset, SEEK_SET);
-    put_be32(s->pb, checksum);
-    url_fseek(s->pb, pos, SEEK_SET);
+    OGGStreamContext *oggstream = s->streams[stream_index]->priv_data;
+    uint8_t header[27 + 255], *p = header;
+    uint32_t crc;
+
+    if (oggstream->continued)
+        flags |= 1;
+
+    bytestream_put_buffer(&p, "OggS", 4);
+    bytestream_put_byte(&p, 0);
+    bytestream_put_byte(&p, flags);
+    bytestream_put_le64(&p, oggstream->page_granule);
+    bytestream_put_le32(&p, stream_index);
+    bytestream_put_le32(&p, oggstream->page_counter++);
+    bytestream_put_le32(&p, 0); // crc
+    bytestream_put_byte(&p, oggstream->nb_segments);
+    bytestream_put_buffer(&p, oggstream->segments, oggstream->nb_segments);
+
+    crc = ff_crc04C11DB7_update(0, header, p - header);
+    crc = ff_crc04C11DB7_update(crc, oggstream->page, oggstream->page_size);
+    AV_WB32(header + 22, crc);
+
+    put_buffer(s->pb, header, p - header);
+    put_buffer(s->pb, oggstream->page, oggstream->page_size);
+    put_flush_packet(s->pb);
+
+    oggstream->page_size    = 0;
+    oggstream->nb_segments  = 0;
+    oggstream->page_granule = -1;
+    oggstream->continued    = 0;
 }
 
-static int ogg_write_page(AVFormatContext *s, const uint8_t *data, int size,
-                          int64_t granule, int stream_index, int flags)
+/**
+ * Add a packet to the page being filled, writing out the pages it fills up.
+ * A page filled up by the end of the packet is written with the next one.
+ */
+static void ogg_buffer_packet(AVFormatContext *s, int stream_index,
+                              const uint8_t *data, int size,
+                              int64_t granule, int64_t pts)
 {
     OGGStreamContext *oggstream = s->streams[stream_index]->priv_data;
-    int64_t crc_offset;
-    int page_segments, i;
-
-    if (size >= 255*255) {
-        granule = -1;
-        size = 255*255;
-    } else if (oggstream->eos)
-        flags |= 4;
-
-    page_segments = FFMIN((size/255)+!!size, 255);
-
-    init_checksum(s->pb, ff_crc04C11DB7_update, 0);
-    put_tag(s->pb, "OggS");
-    put_byte(s->pb, 0);
-    put_byte(s->pb, flags);
-    put_le64(s->pb, granule);
-    put_le32(s->pb, stream_index);
-    put_le32(s->pb, oggstream->page_counter++);
-    crc_offset = url_ftell(s->pb);
-    put_le32(s->pb, 0); // crc
-    put_byte(s->pb, page_segments);
-    for (i = 0; i < page_segments-1; i++)
-        put_byte(s->pb, 255);
-    if (size) {
-        put_byte(s->pb, size - (page_segments-1)*255);
-        put_buffer(s->pb, data, size);
+    int segments = size / 255 + 1; // lacing values, the last one is < 255
+    int started = 0;
+
+    while (segments) {
+        int n, len;
+
+        if (oggstream->nb_segments == 255) {
+            ogg_write_page(s, stream_index, 0);
+            oggstream->continued = started;
+        }
+        if (!oggstream->nb_segments)
+            oggstream->page_start = pts;
+
+        n   = FFMIN(segments, 255 - oggstream->nb_segments);
+        len = FFMIN(size, n * 255);
+        memset(oggstream->segments + oggstream->nb_segments, 255, n);
+        oggstream->nb_segments += n;
+        segments -= n;
+        if (!segments) {
+            oggstream->segments[oggstream->nb_segments-1] = len - (n-1) * 255;
+            oggstream->page_granule = granule;
+        }
+        memcpy(oggstream->page + oggstream->page_size, data, len);
+        oggstream->page_size += len;
+        data += len;
+        size -= len;
+        started = 1;
     }
-    ogg_update_checksum(s, crc_offset);
-    put_flush_packet(s->pb);
-    return size;
+}
+
+/**
+ * Write out the page being filled, if any.
+ */
+static void ogg_flush_page(AVFormatContext *s, int stream_index, int flags)
+{
+    OGGStreamContext *oggstream = s->streams[stream_index]->priv_data;
+
+    if (!oggstream->nb_segments)
+        return;
+    ogg_write_page(s, stream_index, flags);
 }
 
 static uint8_t *ogg_write_vorbiscomment(int offset, int bitexact,
@@ -193,12 +244,19 @@ static int ogg_write_header(AVFormatContext *s)
             return -1;
         }
         oggstream = av_mallocz(sizeof(*oggstream));
+        if (!oggstream)
+            return AVERROR(ENOMEM);
         st->priv_data = oggstream;
+        oggstream->page = av_malloc(255*255);
+        if (!oggstream->page)
+            return AVERROR(ENOMEM);
+        oggstream->page_granule = -1;
         if (st->codec->codec_id == CODEC_ID_FLAC) {
             int err = ogg_build_flac_headers(st->codec, oggstream,
                                              st->codec->flags & CODEC_FLAG_BITEXACT);
             if (err) {
                 av_log(s, AV_LOG_ERROR, "Error writing FLAC headers\n");
+                av_freep(&oggstream->page);
                 av_freep(&st->priv_data);
                 return err;
             }
@@ -207,6 +265,7 @@ static int ogg_write_header(AVFormatContext *s)
                                               st->codec->flags & CODEC_FLAG_BITEXACT);
             if (err) {
                 av_log(s, AV_LOG_ERROR, "Error writing Speex headers\n");
+                av_freep(&oggstream->page);
                 av_freep(&st->priv_data);
                 return err;
             }
@@ -215,6 +274,7 @@ static int ogg_write_header(AVFormatContext *s)
                                       st->codec->codec_id == CODEC_ID_VORBIS ? 30 : 42,
                                       oggstream->header, oggstream->header_len) < 0) {
                 av_log(s, AV_LOG_ERROR, "Extradata corrupted\n");
+                av_freep(&oggstream->page);
                 av_freep(&st->priv_data);
                 return -1;
             }
@@ -233,8 +293,9 @@ static int ogg_write_header(AVFormatContext *s)
             AVStream *st = s->streams[j];
             OGGStreamContext *oggstream = st->priv_data;
             if (oggstream && oggstream->header_len[i]) {
-                ogg_write_page(s, oggstream->header[i], oggstream->header_len[i],
-                               0, st->index, i ? 0 : 2); // bos
+                ogg_buffer_packet(s, st->index, oggstream->header[i],
+                                  oggstream->header_len[i], 0, 0);
+                ogg_flush_page(s, st->index, i ? 0 : 2); // bos
             }
         }
     }
@@ -245,9 +306,7 @@ static int ogg_write_packet(AVFormatContext *s, AVPacket *pkt)
 {
     AVStream *st = s->streams[pkt->stream_index];
     OGGStreamContext *oggstream = st->priv_data;
-    uint8_t *ptr = pkt->data;
-    int ret, size = pkt->size;
-    int64_t granule;
+    int64_t granule, delay;
 
     if (st->codec->codec_id == CODEC_ID_THEORA) {
         int64_t pts = oggstream->vrev < 1 ? pkt->pts : pkt->pts + pkt->duration;
@@ -264,10 +323,14 @@ static int ogg_write_packet(AVFormatContext *s, AVPacket *pkt)
     } else
         granule = pkt->pts + pkt->duration;
     oggstream->duration = granule;
-    do {
-        ret = ogg_write_page(s, ptr, size, granule, pkt->stream_index, ptr != pkt->data);
-        ptr  += ret; size -= ret;
-    } while (size > 0 || ret == 255*255); // need to output a last nil page
+
+    ogg_buffer_packet(s, pkt->stream_index, pkt->data, pkt->size, granule, pkt->pts);
+
+    /* with a muxing delay, pages collect the packets of up to that long */
+    delay = av_rescale_q(s->max_delay, AV_TIME_BASE_Q, st->time_base);
+    if (oggstream->eos || !delay ||
+        pkt->pts + pkt->duration - oggstream->page_start >= delay)
+        ogg_flush_page(s, pkt->stream_index, oggstream->eos ? 4 : 0);
 
     return 0;
 }
@@ -286,42 +349,31 @@ static int ogg_compare_granule(AVFormatContext *s, AVPacket *next, AVPacket *pkt
 
 static int ogg_interleave_per_granule(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush)
 {
-    AVPacketList *pktl;
-    int stream_count = 0;
-    int streams[MAX_STREAMS] = {0};
+    int stream_count;
     int interleaved = 0;
+    int i, ret;
 
     if (pkt) {
-        ff_interleave_add_packet(s, pkt, ogg_compare_granule);
+        if ((ret = ff_interleave_add_packet(s, pkt, ogg_compare_granule)) < 0)
+            return ret;
     }
 
-    pktl = s->packet_buffer;
-    while (pktl) {
-        if (streams[pktl->pkt.stream_index] == 0)
-            stream_count++;
-        streams[pktl->pkt.stream_index]++;
+    stream_count = ff_interleave_queued_streams(s);
+    for (i = 0; i < s->nb_streams; i++) {
         // need to buffer at least one packet to set eos flag
-        if (streams[pktl->pkt.stream_index] == 2)
+        if (ff_interleave_queued_packets(s, i) >= 2)
             interleaved++;
-        pktl = pktl->next;
     }
 
     if ((s->nb_streams == stream_count && interleaved == stream_count) ||
         (flush && stream_count)) {
-        pktl= s->packet_buffer;
-        *out= pktl->pkt;
-        s->packet_buffer = pktl->next;
-        if (flush && streams[out->stream_index] == 1) {
+        int last = ff_interleave_queued_packets(s, ff_interleave_peek(s)->stream_index) == 1;
+
+        ff_interleave_get_packet(s, out);
+        if (flush && last) {
             OGGStreamContext *ogg = s->streams[out->stream_index]->priv_data;
             ogg->eos = 1;
         }
-        if(!s->packet_buffer)
-            s->packet_buffer_end= NULL;
-
-        if(s->streams[out->stream_index]->last_in_packet_buffer == pktl)
-            s->streams[out->stream_index]->last_in_packet_buffer= NULL;
-
-        av_freep(&pktl);
         return 1;
     } else {
         av_init_packet(out);
@@ -335,6 +387,8 @@ static int ogg_write_trailer(AVFormatContext *s)
     for (i = 0; i < s->nb_streams; i++) {
         AVStream *st = s->streams[i];
         OGGStreamContext *oggstream = st->priv_data;
+        ogg_flush_page(s, i, 4);
+        av_free(oggstream->page);
         if (st->codec->codec_id == CODEC_ID_FLAC ||
             st->codec->codec_id == CODEC_ID_SPEEX) {
             av_free(oggstream->header[0]);
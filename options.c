@@ -46,6 +46,30 @@ static const AVOption options[]={
 {"fflags", NULL, OFFSET(flags), FF_OPT_TYPE_FLAGS, DEFAULT, INT_MIN, INT_MAX, D|E, "fflags"},
 {"ignidx", "ignore index", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_IGNIDX, INT_MIN, INT_MAX, D, "fflags"},
 {"genpts", "generate pts", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_GENPTS, INT_MIN, INT_MAX, D, "fflags"},
+{"nobuffercopy", "return packets pointing into the I/O buffer", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_NOBUFFERCOPY, INT_MIN, INT_MAX, D, "fflags"},
+{"pktpool", "reuse payload buffers of packets copied for interleaving", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PACKET_POOL, INT_MIN, INT_MAX, E, "fflags"},
+{"compactidx", "keep the index delta coded in memory", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_COMPACT_INDEX, INT_MIN, INT_MAX, D, "fflags"},
+{"idxcache", "reuse indexes and stream parameters cached from an earlier open", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_INDEX_CACHE, INT_MIN, INT_MAX, D, "fflags"},
+{"probestats", "log the cost of each format probe", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PROBE_STATS, INT_MIN, INT_MAX, D, "fflags"},
+{"trustcontainer", "use the codec parameters of the container without decoding", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_TRUST_CONTAINER, INT_MIN, INT_MAX, D, "fflags"},
+{"lazyduration", "estimate the duration from bitrate and refine it in the background", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_LAZY_DURATION, INT_MIN, INT_MAX, D, "fflags"},
+{"sharedpayload", "share payloads between demuxed and parsed packets", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_SHARED_PAYLOAD, INT_MIN, INT_MAX, D, "fflags"},
+{"metadataarena", "store metadata strings in bulk freed arenas", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_METADATA_ARENA, INT_MIN, INT_MAX, D, "fflags"},
+{"singleprogram", "follow only the first program of the stream", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_SINGLE_PROGRAM, INT_MIN, INT_MAX, D, "fflags"},
+{"lazyindex", "read sample tables on demand, index only keyframes", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_LAZY_INDEX, INT_MIN, INT_MAX, D, "fflags"},
+{"faststart", "move the index in front of the data when finishing the file", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FASTSTART, INT_MIN, INT_MAX, E, "fflags"},
+{"live", "read fragmented input as it is written, keeping only the fragments not read yet, or write output for live streaming", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_LIVE, INT_MIN, INT_MAX, E|D, "fflags"},
+{"scanindex", "build the index of files without one in the background", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_SCAN_INDEX, INT_MIN, INT_MAX, D, "fflags"},
+{"analyzeheader", "fit the header of the output to its first packets", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_ANALYZE_HEADER, INT_MIN, INT_MAX, E, "fflags"},
+{"pacing", "spread the RTP packets of each frame over its duration", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PACING, INT_MIN, INT_MAX, E, "fflags"},
+{"avcc", "return H.264 received over RTP with size prefixed NAL units", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_AVCC, INT_MIN, INT_MAX, D, "fflags"},
+{"ffmpages", "keep an index of the dts of the pages of FFM feeds", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_FFM_PAGE_INDEX, INT_MIN, INT_MAX, E|D, "fflags"},
+{"lazytags", "decode ID3v2 tags when the metadata is first accessed", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_LAZY_TAGS, INT_MIN, INT_MAX, D, "fflags"},
+{"lowdelay", "return packets of live input as soon as possible", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_LOW_DELAY, INT_MIN, INT_MAX, D, "fflags"},
+{"noparse", "do not parse streams the container already frames, for remuxing", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_NOPARSE, INT_MIN, INT_MAX, D, "fflags"},
+{"clockrecovery", "track the clock of live sources against the local clock", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_CLOCK_RECOVERY, INT_MIN, INT_MAX, D, "fflags"},
+{"sdpcache", "reuse the resolved destination and stream descriptions in SDPs", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_SDP_CACHE, INT_MIN, INT_MAX, E, "fflags"},
+{"probecache", "reuse the format and codec parameters found by an earlier open of the same URL", 0, FF_OPT_TYPE_CONST, AVFMT_FLAG_PROBE_CACHE, INT_MIN, INT_MAX, D, "fflags"},
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
 {"track", " set the track number", OFFSET(track), FF_OPT_TYPE_INT, DEFAULT, 0, INT_MAX, E},
 {"year", "set the year", OFFSET(year), FF_OPT_TYPE_INT, DEFAULT, INT_MIN, INT_MAX, E},
@@ -54,6 +78,40 @@ static const AVOption options[]={
 {"cryptokey", "decryption key", OFFSET(key), FF_OPT_TYPE_BINARY, 0, 0, 0, D},
 {"indexmem", "max memory used for timestamp index (per stream)", OFFSET(max_index_size), FF_OPT_TYPE_INT, 1<<20, 0, INT_MAX, D},
 {"rtbufsize", "max memory used for buffering real-time frames", OFFSET(max_picture_buffer), FF_OPT_TYPE_INT, 3041280, 0, INT_MAX, D}, /* defaults to 1s of 15fps 352x288 YUYV422 video */
+{"readahead", "number of I/O buffers read ahead in a separate thread", OFFSET(readahead), FF_OPT_TYPE_INT, 0, 0, 64, D},
+{"analyzebuffer", "max memory buffered in packets while analyzing streams", OFFSET(max_analyze_buffer), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"analyzeidle", "stop analyzing streams after reading this many bytes without new info", OFFSET(max_analyze_idle), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"analyzethreads", "number of threads decoding streams in parallel while analyzing them", OFFSET(analyze_threads), FF_OPT_TYPE_INT, 0, 0, MAX_STREAMS, D},
+{"pcmpacketduration", "microseconds of audio in each packet read from constant bitrate audio and AMR files, 0 for the default", OFFSET(pcm_packet_duration), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"rawpacketsize", "max size of the packets of raw elementary streams, 0 for automatic", OFFSET(raw_packet_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX - FF_INPUT_BUFFER_PADDING_SIZE, D},
+{"demuxqueue", "max bytes of packets demuxed ahead by a separate thread", OFFSET(demux_queue_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"demuxqueueduration", "max microseconds of packets demuxed ahead by a separate thread", OFFSET(demux_queue_duration), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"muxqueue", "max bytes of packets queued for a separate muxing thread", OFFSET(mux_queue_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX, E},
+{"muxqueueduration", "max microseconds of packets queued for a separate muxing thread", OFFSET(mux_queue_duration), FF_OPT_TYPE_INT, 0, 0, INT_MAX, E},
+{"writebehind", "number of I/O buffers written in a separate thread", OFFSET(write_behind), FF_OPT_TYPE_INT, 0, 0, 64, E},
+{"seekstrategy", "timestamp search strategy of seeking", OFFSET(seek_strategy), FF_OPT_TYPE_INT, AVSEEK_STRATEGY_DEFAULT, 0, AVSEEK_STRATEGY_ADAPTIVE, D, "seekstrategy"},
+{"default", "interpolation and bisection", 0, FF_OPT_TYPE_CONST, AVSEEK_STRATEGY_DEFAULT, INT_MIN, INT_MAX, D, "seekstrategy"},
+{"adaptive", "adaptive interpolation preferring buffered data", 0, FF_OPT_TYPE_CONST, AVSEEK_STRATEGY_ADAPTIVE, INT_MIN, INT_MAX, D, "seekstrategy"},
+{"seekprobes", "max number of probes of a timestamp search", OFFSET(seek_max_probes), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"programthreads", "number of threads assembling the packets of different programs", OFFSET(program_threads), FF_OPT_TYPE_INT, 0, 0, 16, D},
+{"trakthreads", "number of threads building the indexes of the tracks in parallel", OFFSET(trak_threads), FF_OPT_TYPE_INT, 0, 0, MAX_STREAMS, D},
+{"imagethreads", "number of threads reading ahead or writing the files of image sequences", OFFSET(image_threads), FF_OPT_TYPE_INT, 0, 0, 16, E|D},
+{"fragduration", "min microseconds of a fragment, write a fragmented file", OFFSET(fragment_duration), FF_OPT_TYPE_INT, 0, 0, INT_MAX, E},
+{"segmentduration", "target microseconds of a segment", OFFSET(segment_duration), FF_OPT_TYPE_INT, 10*AV_TIME_BASE, 1, INT_MAX, E},
+{"segmentlistsize", "number of segments listed in the playlist, 0 for all", OFFSET(segment_list_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX, E},
+{"reorderqueue", "max number of RTP packets held back to put them back in sequence", OFFSET(reorder_queue_size), FF_OPT_TYPE_INT, 10, 0, INT_MAX, D},
+{"reorderdelay", "max microseconds an RTP packet is held back waiting for the ones before it", OFFSET(reorder_delay), FF_OPT_TYPE_INT, 100000, 0, INT_MAX, D},
+{"maxbuffermem", "max bytes of packets buffered by libavformat", OFFSET(max_buffer_memory), FF_OPT_TYPE_INT, 0, 0, INT_MAX, E|D},
+{"hash", "hash algorithm of the framehash muxer", OFFSET(hash_algorithm), FF_OPT_TYPE_INT, AVHASH_ADLER32, 0, AVHASH_XXH32, E, "hash"},
+{"adler32", NULL, 0, FF_OPT_TYPE_CONST, AVHASH_ADLER32, INT_MIN, INT_MAX, E, "hash"},
+{"crc32", NULL, 0, FF_OPT_TYPE_CONST, AVHASH_CRC32, INT_MIN, INT_MAX, E, "hash"},
+{"md5", NULL, 0, FF_OPT_TYPE_CONST, AVHASH_MD5, INT_MIN, INT_MAX, E, "hash"},
+{"xxh32", NULL, 0, FF_OPT_TYPE_CONST, AVHASH_XXH32, INT_MIN, INT_MAX, E, "hash"},
+{"hashthreads", "number of threads hashing the packets of the framehash muxer", OFFSET(hash_threads), FF_OPT_TYPE_INT, 0, 0, 16, E},
+{"maxresync", "max bytes skipped looking for sync", OFFSET(max_resync_size), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"maxindexentries", "max index entries per stream", OFFSET(max_index_entries), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"maxatoms", "max atoms parsed by the MOV demuxer", OFFSET(max_atoms), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
+{"maxworktime", "max microseconds spent reading the header and analyzing the streams", OFFSET(max_work_time), FF_OPT_TYPE_INT, 0, 0, INT_MAX, D},
 {"fdebug", "print specific debug info", OFFSET(debug), FF_OPT_TYPE_FLAGS, DEFAULT, 0, INT_MAX, E|D, "fdebug"},
 {"ts", NULL, 0, FF_OPT_TYPE_CONST, FF_FDEBUG_TS, INT_MIN, INT_MAX, E|D, "fdebug"},
 {NULL},
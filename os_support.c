@@ -29,8 +29,13 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include "os_support.h"
+#include "internal.h"
+#include "libavutil/avstring.h"
 
 #if CONFIG_NETWORK
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #if !HAVE_POLL_H
 #if HAVE_WINSOCK2_H
 #include <winsock2.h>
@@ -174,6 +179,136 @@ int ff_getnameinfo(const struct sockaddr *sa, int salen,
 }
 #endif
 
+#define DNS_CACHE_SIZE     32
+#define DNS_CACHE_LIFETIME (60 * 1000000LL)
+
+typedef struct DNSCacheEntry {
+    char node[256];
+    char service[32];
+    int family, socktype, protocol, flags;
+    struct addrinfo *res;
+    int64_t expires;
+} DNSCacheEntry;
+
+static DNSCacheEntry dns_cache[DNS_CACHE_SIZE];
+#if HAVE_PTHREADS
+static pthread_mutex_t dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void ff_freeaddrinfo_cached(struct addrinfo *res)
+{
+    while (res) {
+        struct addrinfo *next = res->ai_next;
+        av_free(res);
+        res = next;
+    }
+}
+
+/**
+ * Copy an address list into single allocations per entry, so that it
+ * can outlive the resolver result. The canonical names are dropped.
+ */
+static struct addrinfo *copy_addrinfo(const struct addrinfo *ai)
+{
+    struct addrinfo *res = NULL, **tail = &res;
+
+    for (; ai; ai = ai->ai_next) {
+        struct addrinfo *cur = av_malloc(sizeof(*cur) + ai->ai_addrlen);
+        if (!cur) {
+            ff_freeaddrinfo_cached(res);
+            return NULL;
+        }
+        *cur              = *ai;
+        cur->ai_addr      = (struct sockaddr *)(cur + 1);
+        cur->ai_canonname = NULL;
+        cur->ai_next      = NULL;
+        memcpy(cur->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        *tail = cur;
+        tail  = &cur->ai_next;
+    }
+    return res;
+}
+
+static DNSCacheEntry *dns_cache_find(const char *node, const char *service,
+                                     const struct addrinfo *hints)
+{
+    int i;
+
+    for (i = 0; i < DNS_CACHE_SIZE; i++) {
+        DNSCacheEntry *e = &dns_cache[i];
+        if (e->res && !strcmp(e->node, node) && !strcmp(e->service, service) &&
+            e->family   == hints->ai_family   &&
+            e->socktype == hints->ai_socktype &&
+            e->protocol == hints->ai_protocol &&
+            e->flags    == hints->ai_flags)
+            return e;
+    }
+    return NULL;
+}
+
+int ff_getaddrinfo_cached(const char *node, const char *service,
+                          const struct addrinfo *hints, struct addrinfo **res)
+{
+    struct addrinfo *ai;
+    DNSCacheEntry *e;
+    int64_t now = av_gettime();
+    int i, ret;
+
+    /* passive and canonical name lookups are not worth caching */
+    if (!node || !service || !hints || hints->ai_flags & AI_CANONNAME ||
+        strlen(node) >= sizeof(e->node) || strlen(service) >= sizeof(e->service)) {
+        if ((ret = getaddrinfo(node, service, hints, &ai)))
+            return ret;
+        *res = copy_addrinfo(ai);
+        freeaddrinfo(ai);
+        return *res ? 0 : EAI_FAIL;
+    }
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&dns_cache_lock);
+#endif
+    e = dns_cache_find(node, service, hints);
+    *res = e && e->expires > now ? copy_addrinfo(e->res) : NULL;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&dns_cache_lock);
+#endif
+    if (*res)
+        return 0;
+
+    /* resolve without holding the lock, a slow lookup must not block
+     * connections to other hosts */
+    if ((ret = getaddrinfo(node, service, hints, &ai)))
+        return ret;
+    *res = copy_addrinfo(ai);
+    freeaddrinfo(ai);
+    if (!*res)
+        return EAI_FAIL;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&dns_cache_lock);
+#endif
+    if (!(e = dns_cache_find(node, service, hints))) {
+        /* take a free slot or evict the entry closest to expiry */
+        e = &dns_cache[0];
+        for (i = 1; i < DNS_CACHE_SIZE && e->res; i++)
+            if (!dns_cache[i].res || dns_cache[i].expires < e->expires)
+                e = &dns_cache[i];
+        av_strlcpy(e->node,    node,    sizeof(e->node));
+        av_strlcpy(e->service, service, sizeof(e->service));
+        e->family   = hints->ai_family;
+        e->socktype = hints->ai_socktype;
+        e->protocol = hints->ai_protocol;
+        e->flags    = hints->ai_flags;
+    }
+    ff_freeaddrinfo_cached(e->res);
+    e->res     = copy_addrinfo(*res);
+    e->expires = now + DNS_CACHE_LIFETIME;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&dns_cache_lock);
+#endif
+    return 0;
+}
+
 /* resolve host with also IP address parsing */
 int resolve_host(struct in_addr *sin_addr, const char *hostname)
 {
@@ -184,7 +319,7 @@ int resolve_host(struct in_addr *sin_addr, const char *hostname)
         struct addrinfo hints;
         memset(&hints, 0, sizeof(hints));
         hints.ai_family = AF_INET;
-        if (getaddrinfo(hostname, NULL, &hints, &ai))
+        if (ff_getaddrinfo_cached(hostname, "0", &hints, &ai))
             return -1;
         /* getaddrinfo returns a linked list of addrinfo structs.
          * Even if we set ai_family = AF_INET above, make sure
@@ -192,11 +327,11 @@ int resolve_host(struct in_addr *sin_addr, const char *hostname)
         for (cur = ai; cur; cur = cur->ai_next) {
             if (cur->ai_family == AF_INET) {
                 *sin_addr = ((struct sockaddr_in *)cur->ai_addr)->sin_addr;
-                freeaddrinfo(ai);
+                ff_freeaddrinfo_cached(ai);
                 return 0;
             }
         }
-        freeaddrinfo(ai);
+        ff_freeaddrinfo_cached(ai);
         return -1;
 #else
         struct hostent *hp;
@@ -222,7 +357,7 @@ int ff_socket_nonblock(int socket, int enable)
 }
 #endif /* CONFIG_NETWORK */
 
-#if CONFIG_FFSERVER
+#if CONFIG_NETWORK
 #if !HAVE_POLL_H
 int poll(struct pollfd *fds, nfds_t numfds, int timeout)
 {
@@ -280,7 +415,7 @@ int poll(struct pollfd *fds, nfds_t numfds, int timeout)
     if (rc < 0)
         return rc;
 
-    for(i = 0; i < (nfds_t) n; i++) {
+    for(i = 0; i < numfds; i++) {
         fds[i].revents = 0;
 
         if (FD_ISSET(fds[i].fd, &read_set))      fds[i].revents |= POLLIN;
@@ -291,5 +426,54 @@ int poll(struct pollfd *fds, nfds_t numfds, int timeout)
     return rc;
 }
 #endif /* HAVE_POLL_H */
-#endif /* CONFIG_FFSERVER */
+
+int ff_network_poll(const URLInterrupt *intr, struct pollfd *fds, int nfds,
+                    int timeout)
+{
+    int wakeup_fd = ff_interrupt_wakeup_fd();
+    int64_t deadline = timeout >= 0 ? av_gettime() + timeout * 1000LL : 0;
+    int n, ret, wait;
+
+    for (;;) {
+        if ((ret = ff_check_interrupt(intr)) < 0)
+            return ret;
+        n = nfds;
+        if (wakeup_fd >= 0) {
+            fds[n].fd      = wakeup_fd;
+            fds[n].events  = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+        /* without a wakeup descriptor the interrupt callback is polled */
+        wait = wakeup_fd >= 0 ? -1 : 100;
+        if (timeout >= 0) {
+            int left = FFMAX(deadline - av_gettime(), 0) / 1000;
+            if (wait < 0 || left < wait)
+                wait = left;
+        }
+        if (intr && intr->deadline) {
+            /* round up so that the deadline has passed when poll returns */
+            int left = FFMIN(FFMAX(intr->deadline - av_gettime() + 999, 0) / 1000, INT_MAX);
+            if (wait < 0 || left < wait)
+                wait = left;
+        }
+        ret = poll(fds, n, wait);
+        if (ret < 0) {
+            if (ff_neterrno() == FF_NETERROR(EINTR))
+                continue;
+            return AVERROR(EIO);
+        }
+        if (wakeup_fd >= 0 && fds[nfds].revents) {
+            /* drain before rechecking the callback so no wakeup is lost */
+            char tmp[16];
+            while (read(wakeup_fd, tmp, sizeof(tmp)) > 0);
+            ret--;
+        }
+        if (ret > 0)
+            return ret;
+        if (timeout >= 0 && av_gettime() >= deadline)
+            return 0;
+    }
+}
+#endif /* CONFIG_NETWORK */
 
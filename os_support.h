@@ -70,8 +70,9 @@ typedef int socklen_t;
 #define closesocket close
 #endif
 
-#if CONFIG_FFSERVER
-#if !HAVE_POLL_H
+#if HAVE_POLL_H
+#include <poll.h>
+#else
 typedef unsigned long nfds_t;
 
 struct pollfd {
@@ -97,7 +98,6 @@ struct pollfd {
 
 int poll(struct pollfd *fds, nfds_t numfds, int timeout);
 #endif /* HAVE_POLL_H */
-#endif /* CONFIG_FFSERVER */
 #endif /* CONFIG_NETWORK */
 
 #endif /* AVFORMAT_OS_SUPPORT_H */
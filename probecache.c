@@ -0,0 +1,332 @@
+/*
+ * Cache of the probe results of live sources
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/probecache.c
+ * Probe cache.
+ * With AVFMT_FLAG_PROBE_CACHE the input format and the codec parameters
+ * found by av_find_stream_info() are kept in memory, by URL, for the
+ * lifetime of the process. Reopening the same URL skips the format probe,
+ * and av_find_stream_info() gives the streams the cached parameters when
+ * the demuxer reports the same codecs, so it only waits for the first
+ * packet of each stream. Unlike the index cache nothing is written out,
+ * it is meant for live sources reconnected to after network errors.
+ */
+
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define PROBE_CACHE_MAX 32
+
+typedef struct ProbeCacheStream {
+    int id;
+    int codec_type, codec_id;
+    unsigned int codec_tag;
+    AVRational r_frame_rate, avg_frame_rate, sample_aspect_ratio;
+    AVRational codec_time_base, codec_sample_aspect_ratio;
+    int ticks_per_frame, bit_rate;
+    int width, height, pix_fmt, has_b_frames;
+    int sample_rate, channels, sample_fmt, frame_size, block_align;
+    int bits_per_coded_sample;
+    int64_t channel_layout;
+    uint8_t *extradata;
+    int extradata_size;
+} ProbeCacheStream;
+
+struct ProbeCacheEntry {
+    struct ProbeCacheEntry *next;
+    char *url;
+    AVInputFormat *iformat;
+    int nb_streams;
+    ProbeCacheStream *streams;
+};
+
+#if HAVE_PTHREADS
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK()   pthread_mutex_lock(&cache_lock)
+#define UNLOCK() pthread_mutex_unlock(&cache_lock)
+#else
+#define LOCK()
+#define UNLOCK()
+#endif
+
+/** most recently used first */
+static ProbeCacheEntry *cache;
+
+static void free_entry(ProbeCacheEntry *e)
+{
+    int i;
+
+    for (i = 0; i < e->nb_streams; i++)
+        av_free(e->streams[i].extradata);
+    av_free(e->streams);
+    av_free(e->url);
+    av_free(e);
+}
+
+static ProbeCacheEntry *dup_entry(const ProbeCacheEntry *e)
+{
+    ProbeCacheEntry *d = av_mallocz(sizeof(*d));
+
+    if (!d)
+        return NULL;
+    d->iformat = e->iformat;
+    if (!(d->url = av_strdup(e->url)) ||
+        !(d->streams = av_malloc(e->nb_streams * sizeof(*d->streams))))
+        goto fail;
+    for (; d->nb_streams < e->nb_streams; d->nb_streams++) {
+        ProbeCacheStream *cs = &d->streams[d->nb_streams];
+
+        *cs = e->streams[d->nb_streams];
+        if (cs->extradata) {
+            if (!(cs->extradata = av_malloc(cs->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE)))
+                goto fail;
+            memcpy(cs->extradata, e->streams[d->nb_streams].extradata,
+                   cs->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+        }
+    }
+    return d;
+fail:
+    free_entry(d);
+    return NULL;
+}
+
+/* unlinks and returns the entry of url, cache_lock must be held */
+static ProbeCacheEntry *take_entry(const char *url)
+{
+    ProbeCacheEntry **p, *e;
+
+    for (p = &cache; (e = *p); p = &e->next)
+        if (!strcmp(e->url, url)) {
+            *p = e->next;
+            return e;
+        }
+    return NULL;
+}
+
+AVInputFormat *ff_probe_cache_format(const char *url)
+{
+    AVInputFormat *fmt = NULL;
+    ProbeCacheEntry *e;
+
+    if (!url)
+        return NULL;
+    LOCK();
+    for (e = cache; e; e = e->next)
+        if (!strcmp(e->url, url)) {
+            fmt = e->iformat;
+            break;
+        }
+    UNLOCK();
+    return fmt;
+}
+
+ProbeCacheEntry *ff_probe_cache_get(AVFormatContext *s)
+{
+    ProbeCacheEntry *e, *d = NULL;
+
+    LOCK();
+    if ((e = take_entry(s->filename))) {
+        if (e->iformat == s->iformat)
+            d = dup_entry(e);
+        e->next = cache;
+        cache   = e;
+    }
+    UNLOCK();
+    return d;
+}
+
+int ff_probe_cache_nb_streams(const ProbeCacheEntry *e)
+{
+    return e->nb_streams;
+}
+
+int ff_probe_cache_apply_stream(ProbeCacheEntry *e, AVStream *st)
+{
+    AVCodecContext *codec = st->codec;
+    ProbeCacheStream *cs = NULL;
+    int i;
+
+    /* streams are matched by their id, or by their index for demuxers
+       leaving the ids at 0 */
+    for (i = 0; i < e->nb_streams; i++)
+        if (st->id ? e->streams[i].id == st->id : i == st->index) {
+            cs = &e->streams[i];
+            break;
+        }
+    if (!cs || cs->codec_type != codec->codec_type ||
+        (codec->codec_id != CODEC_ID_NONE && cs->codec_id != codec->codec_id))
+        return 0;
+
+    codec->codec_id = cs->codec_id;
+    if (!codec->codec_tag)
+        codec->codec_tag = cs->codec_tag;
+    if (!st->r_frame_rate.num)
+        st->r_frame_rate = cs->r_frame_rate;
+    if (!st->avg_frame_rate.num)
+        st->avg_frame_rate = cs->avg_frame_rate;
+    if (!st->sample_aspect_ratio.num)
+        st->sample_aspect_ratio = cs->sample_aspect_ratio;
+    if (!codec->sample_aspect_ratio.num)
+        codec->sample_aspect_ratio = cs->codec_sample_aspect_ratio;
+    if (!codec->bit_rate)
+        codec->bit_rate = cs->bit_rate;
+    if (codec->codec_type == CODEC_TYPE_VIDEO) {
+        codec->time_base       = cs->codec_time_base;
+        codec->ticks_per_frame = cs->ticks_per_frame;
+        codec->has_b_frames    = cs->has_b_frames;
+        if (!codec->width) {
+            codec->width  = cs->width;
+            codec->height = cs->height;
+        }
+        if (codec->pix_fmt == PIX_FMT_NONE)
+            codec->pix_fmt = cs->pix_fmt;
+    } else if (codec->codec_type == CODEC_TYPE_AUDIO) {
+        if (!codec->sample_rate)
+            codec->sample_rate = cs->sample_rate;
+        if (!codec->channels) {
+            codec->channels       = cs->channels;
+            codec->channel_layout = cs->channel_layout;
+        }
+        if (codec->sample_fmt == SAMPLE_FMT_NONE)
+            codec->sample_fmt = cs->sample_fmt;
+        if (!codec->frame_size)
+            codec->frame_size = cs->frame_size;
+        if (!codec->block_align)
+            codec->block_align = cs->block_align;
+    }
+    if (!codec->bits_per_coded_sample)
+        codec->bits_per_coded_sample = cs->bits_per_coded_sample;
+    if (!codec->extradata && cs->extradata) {
+        codec->extradata      = cs->extradata;
+        codec->extradata_size = cs->extradata_size;
+        cs->extradata         = NULL;
+    }
+    return 1;
+}
+
+void ff_probe_cache_free(ProbeCacheEntry **e)
+{
+    if (*e)
+        free_entry(*e);
+    *e = NULL;
+}
+
+void ff_probe_cache_store(AVFormatContext *s)
+{
+    ProbeCacheEntry *e, *old, **p;
+    int n;
+
+    if (!s->nb_streams || !s->filename[0])
+        return;
+    if (!(e = av_mallocz(sizeof(*e))) ||
+        !(e->url = av_strdup(s->filename)) ||
+        !(e->streams = av_mallocz(s->nb_streams * sizeof(*e->streams))))
+        goto fail;
+    e->iformat = s->iformat;
+    for (; e->nb_streams < s->nb_streams; e->nb_streams++) {
+        ProbeCacheStream *cs = &e->streams[e->nb_streams];
+        AVStream *st = s->streams[e->nb_streams];
+        AVCodecContext *codec = st->codec;
+
+        cs->id                        = st->id;
+        cs->codec_type                = codec->codec_type;
+        cs->codec_id                  = codec->codec_id;
+        cs->codec_tag                 = codec->codec_tag;
+        cs->r_frame_rate              = st->r_frame_rate;
+        cs->avg_frame_rate            = st->avg_frame_rate;
+        cs->sample_aspect_ratio       = st->sample_aspect_ratio;
+        cs->codec_time_base           = codec->time_base;
+        cs->codec_sample_aspect_ratio = codec->sample_aspect_ratio;
+        cs->ticks_per_frame           = codec->ticks_per_frame;
+        cs->bit_rate                  = codec->bit_rate;
+        cs->width                     = codec->width;
+        cs->height                    = codec->height;
+        cs->pix_fmt                   = codec->pix_fmt;
+        cs->has_b_frames              = codec->has_b_frames;
+        cs->sample_rate               = codec->sample_rate;
+        cs->channels                  = codec->channels;
+        cs->sample_fmt                = codec->sample_fmt;
+        cs->frame_size                = codec->frame_size;
+        cs->block_align               = codec->block_align;
+        cs->bits_per_coded_sample     = codec->bits_per_coded_sample;
+        cs->channel_layout            = codec->channel_layout;
+        if (codec->extradata && codec->extradata_size > 0) {
+            if (!(cs->extradata = av_mallocz(codec->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE))) {
+                e->nb_streams++;
+                goto fail;
+            }
+            memcpy(cs->extradata, codec->extradata, codec->extradata_size);
+            cs->extradata_size = codec->extradata_size;
+        }
+    }
+
+    LOCK();
+    if ((old = take_entry(e->url)))
+        free_entry(old);
+    e->next = cache;
+    cache   = e;
+    /* forget the least recently used sources */
+    for (p = &cache, n = 0; *p && n < PROBE_CACHE_MAX; p = &(*p)->next, n++)
+        ;
+    old = *p;
+    *p  = NULL;
+    UNLOCK();
+    while ((e = old)) {
+        old = e->next;
+        free_entry(e);
+    }
+    return;
+fail:
+    if (e)
+        free_entry(e);
+}
+
+void ff_probe_cache_drop(const char *url)
+{
+    ProbeCacheEntry *e;
+
+    if (!url)
+        return;
+    LOCK();
+    e = take_entry(url);
+    UNLOCK();
+    if (e)
+        free_entry(e);
+}
+
+void av_probe_cache_flush(void)
+{
+    ProbeCacheEntry *e, *next;
+
+    LOCK();
+    e     = cache;
+    cache = NULL;
+    UNLOCK();
+    for (; e; e = next) {
+        next = e->next;
+        free_entry(e);
+    }
+}
@@ -25,6 +25,7 @@
 #include "libavcodec/get_bits.h"
 #include "libavcodec/bytestream.h"
 #include "avformat.h"
+#include "internal.h"
 #include "raw.h"
 #include "id3v2.h"
 #include "id3v1.h"
@@ -108,14 +109,20 @@ static int raw_read_header(AVFormatContext *s, AVFormatParameters *ap)
 }
 
 #define RAW_PACKET_SIZE 1024
+#define RAW_PACKET_SIZE_MAX (128 << 10) ///< automatic size for seekable input
 #define RAW_SAMPLES     1024
 
 static int raw_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     int ret, size, bps;
-    //    AVStream *st = s->streams[0];
+    int block_align = s->streams[0]->codec->block_align;
 
-    size= RAW_SAMPLES*s->streams[0]->codec->block_align;
+    /* whole samples, the timestamps are derived from the position */
+    if (s->raw_packet_size > 0 && block_align > 0)
+        size = FFMAX(s->raw_packet_size / block_align, 1) * block_align;
+    else
+        size = RAW_SAMPLES * block_align;
+    size = ff_pcm_packet_size(s, s->streams[0], size);
 
     ret= av_get_packet(s->pb, pkt, size);
 
@@ -131,12 +138,35 @@ static int raw_read_packet(AVFormatContext *s, AVPacket *pkt)
     return ret;
 }
 
+static int raw_read_packets(AVFormatContext *s, AVPacket *pkts, int nb_packets)
+{
+    int i, ret;
+
+    for (i = 0; i < nb_packets; i++) {
+        av_init_packet(&pkts[i]);
+        if ((ret = raw_read_packet(s, &pkts[i])) < 0)
+            return i ? i : ret;
+    }
+    return i;
+}
+
 int ff_raw_read_partial_packet(AVFormatContext *s, AVPacket *pkt)
 {
     int ret, size;
 
-    size = RAW_PACKET_SIZE;
+    size = s->raw_packet_size > 0 ? s->raw_packet_size : RAW_PACKET_SIZE_MAX;
+
+    /* files are read in large blocks, the parser splits them into frames */
+    if (!url_is_streamed(s->pb)) {
+        ret = av_get_packet(s->pb, pkt, size);
+        pkt->stream_index = 0;
+        if (!ret)
+            return url_ferror(s->pb) ? url_ferror(s->pb) : AVERROR_EOF;
+        return ret;
+    }
 
+    /* live input: never wait for more than what one read returns */
+    size = FFMIN(size, FFMAX(s->pb->buffer_size, RAW_PACKET_SIZE));
     if (av_new_packet(pkt, size) < 0)
         return AVERROR(ENOMEM);
 
@@ -215,6 +245,60 @@ static int ingenient_read_packet(AVFormatContext *s, AVPacket *pkt)
 #endif
 
 #if CONFIG_DEMUXERS
+#define PCM_PAGE_SIZE 4096
+
+static void get_block_align_byte_rate(AVStream *st, int *block_align, int *byte_rate)
+{
+    *block_align = st->codec->block_align ? st->codec->block_align :
+        (av_get_bits_per_sample(st->codec->codec_id) * st->codec->channels) >> 3;
+    *byte_rate = st->codec->bit_rate ? st->codec->bit_rate >> 3 :
+        *block_align * st->codec->sample_rate;
+}
+
+int ff_pcm_packet_size(AVFormatContext *s, AVStream *st, int default_size)
+{
+    int block_align, byte_rate;
+    int64_t size = default_size, align;
+
+    get_block_align_byte_rate(st, &block_align, &byte_rate);
+    if (block_align <= 0)
+        return default_size;
+    align = block_align;
+
+    if (s->pcm_packet_duration > 0 && byte_rate > 0) {
+        int64_t page_align = block_align / av_gcd(block_align, PCM_PAGE_SIZE) * PCM_PAGE_SIZE;
+
+        size = av_rescale(s->pcm_packet_duration, byte_rate, 1000000);
+        /* reads larger than the I/O buffer bypass it, in whole pages if
+           that does not change the duration much */
+        if (page_align <= size / 2)
+            align = page_align;
+    }
+    size = FFMAX(size / align, 1) * align;
+    return FFMIN(size, INT_MAX / 2 / align * align);
+}
+
+int ff_pcm_read_packet(AVFormatContext *s, AVPacket *pkt, int default_size)
+{
+    AVStream *st = s->streams[0];
+    int block_align, byte_rate, ret;
+
+    ret = av_get_packet(s->pb, pkt, ff_pcm_packet_size(s, st, default_size));
+    pkt->stream_index = 0;
+    if (ret <= 0)
+        return ret < 0 ? ret : AVERROR_EOF;
+
+    /* the same arithmetic as pcm_read_seek() */
+    get_block_align_byte_rate(st, &block_align, &byte_rate);
+    if (byte_rate > 0 && pkt->pos >= s->data_offset) {
+        int64_t den = byte_rate * (int64_t)st->time_base.num;
+        pkt->pts      =
+        pkt->dts      = av_rescale(pkt->pos - s->data_offset, st->time_base.den, den);
+        pkt->duration = av_rescale(ret, st->time_base.den, den);
+    }
+    return ret;
+}
+
 int pcm_read_seek(AVFormatContext *s,
                   int stream_index, int64_t timestamp, int flags)
 {
@@ -224,10 +308,7 @@ int pcm_read_seek(AVFormatContext *s,
 
     st = s->streams[0];
 
-    block_align = st->codec->block_align ? st->codec->block_align :
-        (av_get_bits_per_sample(st->codec->codec_id) * st->codec->channels) >> 3;
-    byte_rate = st->codec->bit_rate ? st->codec->bit_rate >> 3 :
-        block_align * st->codec->sample_rate;
+    get_block_align_byte_rate(st, &block_align, &byte_rate);
 
     if (block_align <= 0 || byte_rate <= 0)
         return -1;
@@ -700,8 +781,8 @@ static int adts_aac_read_header(AVFormatContext *s,
     st->codec->codec_id = s->iformat->value;
     st->need_parsing = AVSTREAM_PARSE_FULL;
 
-    ff_id3v1_read(s);
     ff_id3v2_read(s);
+    ff_read_tail_tags(s, ff_id3v1_read);
 
     return 0;
 }
@@ -1259,6 +1340,7 @@ AVInputFormat pcm_ ## name ## _demuxer = {\
     .flags= AVFMT_GENERIC_INDEX,\
     .extensions = ext,\
     .value = codec,\
+    .read_packets = raw_read_packets,\
 };
 
 #define PCMOUTPUTDEF(name, long_name, ext, codec) \
@@ -29,4 +29,19 @@ int pcm_read_seek(AVFormatContext *s,
 
 int ff_raw_read_partial_packet(AVFormatContext *s, AVPacket *pkt);
 
+/**
+ * Returns the size of the packets of the PCM stream st: whole blocks
+ * lasting AVFormatContext.pcm_packet_duration, or default_size rounded
+ * down to whole blocks when it is not set.
+ */
+int ff_pcm_packet_size(AVFormatContext *s, AVStream *st, int default_size);
+
+/**
+ * Read a packet of the constant bitrate stream of s, sized by
+ * ff_pcm_packet_size(), and set its timestamps from its position so that
+ * pcm_read_seek() can seek by arithmetic alone.
+ * @return the packet size or AVERROR
+ */
+int ff_pcm_read_packet(AVFormatContext *s, AVPacket *pkt, int default_size);
+
 #endif /* AVFORMAT_RAW_H */
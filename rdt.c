@@ -300,16 +300,16 @@ rdt_parse_packet (AVFormatContext *ctx, PayloadContext *rdt, AVStream *st,
                   const uint8_t *buf, int len, int flags)
 {
     int seq = 1, res;
-    ByteIOContext pb;
 
+    /* cached audio frames may point into the superblock */
+    rdt->rmctx->flags = (rdt->rmctx->flags & ~AVFMT_FLAG_NOBUFFERCOPY) |
+                        (ctx->flags & AVFMT_FLAG_NOBUFFERCOPY);
     if (rdt->audio_pkt_cnt == 0) {
         int pos;
 
-        init_put_byte(&pb, buf, len, 0, NULL, NULL, NULL, NULL);
         flags = (flags & RTP_FLAG_KEY) ? 2 : 0;
-        res = ff_rm_parse_packet (rdt->rmctx, &pb, st, rdt->rmst[st->index], len, pkt,
-                                  &seq, flags, *timestamp);
-        pos = url_ftell(&pb);
+        res = ff_rm_parse_packet_buf (rdt->rmctx, buf, len, st, rdt->rmst[st->index],
+                                      pkt, &seq, flags, *timestamp, &pos);
         if (res < 0)
             return res;
         if (res > 0) {
@@ -0,0 +1,87 @@
+/*
+ * Hashed lookup of registered formats and protocols
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/registry.c
+ * Hash tables over the names, extensions and MIME types of the registered
+ * formats and protocols, filled at registration time so that lookups do not
+ * walk the registration lists.
+ */
+
+#include <ctype.h>
+#include <strings.h>
+#include "avformat.h"
+#include "registry.h"
+
+static unsigned int key_hash(const char *key, int len)
+{
+    unsigned int h = 0;
+
+    while (len--)
+        h = h * 31 + tolower((unsigned char)*key++);
+    return h & (FF_REGISTRY_BUCKETS - 1);
+}
+
+int ff_registry_add(FFRegistry *r, const char *key, int len, void *item, int index)
+{
+    FFRegistryEntry *e = av_mallocz(sizeof(*e)), **p;
+
+    if (!e)
+        return AVERROR(ENOMEM);
+    e->key   = key;
+    e->len   = len;
+    e->item  = item;
+    e->index = index;
+    /* keep registration order within the bucket */
+    p = &r->buckets[key_hash(key, len)];
+    while (*p)
+        p = &(*p)->next;
+    *p = e;
+    return 0;
+}
+
+int ff_registry_add_list(FFRegistry *r, const char *keys, void *item, int index)
+{
+    const char *p;
+    int ret;
+
+    while ((p = strchr(keys, ','))) {
+        if ((ret = ff_registry_add(r, keys, p - keys, item, index)) < 0)
+            return ret;
+        keys = p + 1;
+    }
+    return ff_registry_add(r, keys, strlen(keys), item, index);
+}
+
+FFRegistryEntry *ff_registry_find(FFRegistry *r, const char *key, int match_case,
+                                  FFRegistryEntry *prev)
+{
+    int len = strlen(key);
+    FFRegistryEntry *e = prev ? prev->next : r->buckets[key_hash(key, len)];
+
+    for (; e; e = e->next) {
+        if (e->len != len)
+            continue;
+        if (match_case ? !strncmp(e->key, key, len) : !strncasecmp(e->key, key, len))
+            return e;
+    }
+    return NULL;
+}
@@ -0,0 +1,63 @@
+/*
+ * Hashed lookup of registered formats and protocols
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_REGISTRY_H
+#define AVFORMAT_REGISTRY_H
+
+#define FF_REGISTRY_BUCKETS 256
+
+typedef struct FFRegistryEntry {
+    const char *key;
+    int len;                        ///< length of key
+    void *item;
+    int index;                      ///< registration order of item
+    struct FFRegistryEntry *next;   ///< next entry in the same bucket
+} FFRegistryEntry;
+
+/**
+ * Hash table from (case insensitively hashed) keys to registered items.
+ * Entries with the same key are found in the order they were added.
+ */
+typedef struct FFRegistry {
+    FFRegistryEntry *buckets[FF_REGISTRY_BUCKETS];
+} FFRegistry;
+
+/**
+ * Add item under the first len bytes of key, which must stay valid.
+ * @return 0 on success, a negative AVERROR code otherwise
+ */
+int ff_registry_add(FFRegistry *r, const char *key, int len, void *item, int index);
+
+/**
+ * Add item under each key of the comma separated list keys.
+ */
+int ff_registry_add_list(FFRegistry *r, const char *keys, void *item, int index);
+
+/**
+ * Find the next entry for key after prev.
+ * @param match_case compare keys case sensitively
+ * @param prev the previously found entry, or NULL for the first one
+ * @return the entry, or NULL if there is none
+ */
+FFRegistryEntry *ff_registry_find(FFRegistry *r, const char *key, int match_case,
+                                  FFRegistryEntry *prev);
+
+#endif /* AVFORMAT_REGISTRY_H */
@@ -71,6 +71,19 @@ int ff_rm_parse_packet (AVFormatContext *s, ByteIOContext *pb,
                         AVStream *st, RMStream *rst, int len,
                         AVPacket *pkt, int *seq, int flags, int64_t ts);
 
+/**
+ * Parse one rm-stream packet from a buffer. Works like
+ * ff_rm_parse_packet(), but interleaved audio is stored in its superblock
+ * straight from buf.
+ *
+ * @param buf the packet data
+ * @param len size of buf
+ * @param consumed set to the number of bytes of buf that were parsed
+ */
+int ff_rm_parse_packet_buf (AVFormatContext *s, const uint8_t *buf, int len,
+                            AVStream *st, RMStream *rst, AVPacket *pkt,
+                            int *seq, int flags, int64_t ts, int *consumed);
+
 /**
  * Retrieve one cached packet from the rm-context. The real container can
  * store several packets (as interpreted by the codec) in a single container
@@ -22,6 +22,7 @@
 #include "libavutil/avstring.h"
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
+#include "internal.h"
 #include "riff.h"
 #include "rm.h"
 
@@ -38,6 +39,11 @@ struct RMStream {
     int sub_packet_size, sub_packet_h, coded_framesize; ///< Descrambling parameters from container
     int audio_framesize; /// Audio frame size from container
     int sub_packet_lengths[16]; /// Length of each subpacket
+    /// Audio deinterleaving table: offsets in pkt of the chunks of each subpacket
+    int *deint_offsets;
+    int deint_chunks, deint_chunk_size;
+    int index_loaded;  ///< the INDX chunks of the stream have been looked up
+    int has_index;     ///< the file has an INDX chunk for the stream
 };
 
 typedef struct {
@@ -47,6 +53,8 @@ typedef struct {
     int remaining_len;
     int audio_stream_num; ///< Stream number for audio packets
     int audio_pkt_cnt; ///< Output packet counter
+    int64_t index_off; ///< position of the first INDX chunk, 0 if none
+    int64_t scan_pos;  ///< where the keyframe scan goes on, -1 once it reached the end
 } RMDemuxContext;
 
 static const AVCodecTag rm_codec_tags[] = {
@@ -135,6 +143,70 @@ RMStream *ff_rm_alloc_rmstream (void)
 void ff_rm_free_rmstream (RMStream *rms)
 {
     av_free_packet(&rms->pkt);
+    av_freep(&rms->deint_offsets);
+}
+
+/**
+ * Precompute where the chunks of each subpacket of an interleaved audio
+ * stream go in the deinterleaved superblock.
+ */
+static int rm_build_deint_table(AVFormatContext *s, AVStream *st, RMStream *ast)
+{
+    int sps = ast->sub_packet_size;
+    int cfs = ast->coded_framesize;
+    int h = ast->sub_packet_h;
+    int w = ast->audio_framesize;
+    int x, y, n, size, off;
+
+    switch (st->codec->codec_id) {
+    case CODEC_ID_RA_288:
+        n = h / 2;
+        size = cfs;
+        break;
+    case CODEC_ID_ATRAC3:
+    case CODEC_ID_COOK:
+        n = w / sps;
+        size = sps;
+        break;
+    case CODEC_ID_SIPR:
+        n = 1;
+        size = w;
+        break;
+    default:
+        return 0;
+    }
+
+    av_freep(&ast->deint_offsets);
+    ast->deint_chunks = ast->deint_chunk_size = 0;
+    if (h <= 0 || n <= 0 || size <= 0)
+        return 0;
+    if (n > INT_MAX / sizeof(*ast->deint_offsets) / h)
+        return AVERROR(EINVAL);
+    if (!(ast->deint_offsets = av_malloc(h * n * sizeof(*ast->deint_offsets))))
+        return AVERROR(ENOMEM);
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < n; x++) {
+            switch (st->codec->codec_id) {
+            case CODEC_ID_RA_288:
+                off = x*2*w+y*cfs;
+                break;
+            case CODEC_ID_SIPR:
+                off = y * w;
+                break;
+            default:
+                off = sps*(h*x+((h+1)/2)*(y&1)+(y>>1));
+            }
+            if (off + (int64_t)size > ast->pkt.size) {
+                av_log(s, AV_LOG_ERROR, "invalid audio interleaving parameters\n");
+                av_freep(&ast->deint_offsets);
+                return AVERROR_INVALIDDATA;
+            }
+            ast->deint_offsets[y * n + x] = off;
+        }
+    }
+    ast->deint_chunks     = n;
+    ast->deint_chunk_size = size;
+    return 0;
 }
 
 static int rm_read_audio_stream_info(AVFormatContext *s, ByteIOContext *pb,
@@ -274,6 +346,8 @@ static int rm_read_audio_stream_info(AVFormatContext *s, ByteIOContext *pb,
         default:
             av_strlcpy(st->codec->codec_name, buf, sizeof(st->codec->codec_name));
         }
+        if ((ret = rm_build_deint_table(s, st, ast)) < 0)
+            return ret;
         if (read_all) {
             get_byte(pb);
             get_byte(pb);
@@ -348,11 +422,16 @@ skip:
 
 /** this function assumes that the demuxer has already seeked to the start
  * of the INDX chunk, and will bail out if not. */
-static int rm_read_index(AVFormatContext *s)
+/**
+ * Read the entries of st from the INDX chunks, skipping the chunks of the
+ * other streams.
+ * @return the number of entries read, <0 on error
+ */
+static int rm_read_index(AVFormatContext *s, AVStream *st)
 {
     ByteIOContext *pb = s->pb;
     unsigned int size, n_pkts, str_id, next_off, n, pos, pts;
-    AVStream *st;
+    int count = 0;
 
     do {
         if (get_le32(pb) != MKTAG('I','N','D','X'))
@@ -364,12 +443,7 @@ static int rm_read_index(AVFormatContext *s)
         n_pkts   = get_be32(pb);
         str_id   = get_be16(pb);
         next_off = get_be32(pb);
-        for (n = 0; n < s->nb_streams; n++)
-            if (s->streams[n]->id == str_id) {
-                st = s->streams[n];
-                break;
-            }
-        if (n == s->nb_streams)
+        if (str_id != st->id)
             goto skip;
 
         for (n = 0; n < n_pkts; n++) {
@@ -380,6 +454,7 @@ static int rm_read_index(AVFormatContext *s)
 
             av_add_index_entry(st, pos, pts, 0, 0, AVINDEX_KEYFRAME);
         }
+        count += n_pkts;
 
 skip:
         if (next_off && url_ftell(pb) != next_off &&
@@ -387,7 +462,7 @@ skip:
             return -1;
     } while (next_off);
 
-    return 0;
+    return count;
 }
 
 static int rm_read_header_old(AVFormatContext *s, AVFormatParameters *ap)
@@ -499,12 +574,9 @@ static int rm_read_header(AVFormatContext *s, AVFormatParameters *ap)
         rm->nb_packets = 3600 * 25;
     get_be32(pb); /* next data header */
 
-    if (!data_off)
-        data_off = url_ftell(pb) - 18;
-    if (indx_off && url_fseek(pb, indx_off, SEEK_SET) >= 0) {
-        rm_read_index(s);
-        url_fseek(pb, data_off + 18, SEEK_SET);
-    }
+    /* the index is only read on the first seek, see rm_read_seek() */
+    rm->index_off = indx_off;
+    rm->scan_pos  = url_ftell(pb);
 
     return 0;
 }
@@ -694,13 +766,25 @@ rm_ac3_swap_bytes (AVStream *st, AVPacket *pkt)
 
 /**
  * Perform 4-bit block reordering for SIPR data.
- * @todo This can be optimized, e.g. use memcpy() if data blocks are aligned
  */
 static void
 rm_reorder_sipr_data (RMStream *ast)
 {
     int n, bs = ast->sub_packet_h * ast->audio_framesize * 2 / 96; // nibbles per subpacket
 
+    if (!(bs & 1)) {
+        /* the blocks start on byte boundaries, swap them bytewise */
+        for (n = 0; n < 38; n++) {
+            uint8_t *i = ast->pkt.data + bs * sipr_swaps[n][0] / 2;
+            uint8_t *o = ast->pkt.data + bs * sipr_swaps[n][1] / 2;
+            int j;
+
+            for (j = 0; j < bs / 2; j++)
+                FFSWAP(uint8_t, i[j], o[j]);
+        }
+        return;
+    }
+
     for (n = 0; n < 38; n++) {
         int j;
         int i = bs * sipr_swaps[n][0];
@@ -720,6 +804,80 @@ rm_reorder_sipr_data (RMStream *ast)
     }
 }
 
+/**
+ * Store one subpacket of an interleaved audio stream in its superblock.
+ * @return <0 if the superblock is not complete yet
+ */
+static int rm_deinterleave(AVFormatContext *s, AVStream *st, RMStream *ast,
+                           ByteIOContext *pb, const uint8_t *buf,
+                           int flags, int64_t timestamp)
+{
+    RMDemuxContext *rm = s->priv_data;
+    int n = ast->deint_chunks, size = ast->deint_chunk_size;
+    const int *offsets;
+    int x;
+
+    if (flags & 2)
+        ast->sub_packet_cnt = 0;
+    if (!ast->sub_packet_cnt)
+        ast->audiotimestamp = timestamp;
+
+    offsets = ast->deint_offsets + ast->sub_packet_cnt * n;
+    if (!buf && url_fpeek(pb, &buf, n * size) < n * size)
+        buf = NULL;
+    if (buf) {
+        for (x = 0; x < n; x++)
+            memcpy(ast->pkt.data + offsets[x], buf + x * size, size);
+        if (pb)
+            url_fskip(pb, n * size);
+    } else {
+        for (x = 0; x < n; x++)
+            get_buffer(pb, ast->pkt.data + offsets[x], size);
+    }
+
+    if (++(ast->sub_packet_cnt) < ast->sub_packet_h)
+        return -1;
+    if (st->codec->codec_id == CODEC_ID_SIPR)
+        rm_reorder_sipr_data(ast);
+
+    ast->sub_packet_cnt = 0;
+    rm->audio_stream_num = st->index;
+    rm->audio_pkt_cnt = ast->sub_packet_h * ast->audio_framesize / st->codec->block_align;
+    return 0;
+}
+
+static int rm_is_interleaved(AVStream *st)
+{
+    return st->codec->codec_type == CODEC_TYPE_AUDIO &&
+           (st->codec->codec_id == CODEC_ID_RA_288 ||
+            st->codec->codec_id == CODEC_ID_COOK   ||
+            st->codec->codec_id == CODEC_ID_ATRAC3 ||
+            st->codec->codec_id == CODEC_ID_SIPR);
+}
+
+int
+ff_rm_parse_packet_buf (AVFormatContext *s, const uint8_t *buf, int len,
+                        AVStream *st, RMStream *ast, AVPacket *pkt,
+                        int *seq, int flags, int64_t timestamp, int *consumed)
+{
+    ByteIOContext pb;
+    int res;
+
+    if (rm_is_interleaved(st) && ast->deint_offsets) {
+        int size = ast->deint_chunks * ast->deint_chunk_size;
+        if (len < size)
+            return AVERROR_INVALIDDATA;
+        *consumed = size;
+        return rm_deinterleave(s, st, ast, NULL, buf, flags, timestamp) < 0 ?
+               -1 : ((RMDemuxContext *)s->priv_data)->audio_pkt_cnt;
+    }
+
+    init_put_byte(&pb, (uint8_t *)buf, len, 0, NULL, NULL, NULL, NULL);
+    res = ff_rm_parse_packet(s, &pb, st, ast, len, pkt, seq, flags, timestamp);
+    *consumed = url_ftell(&pb);
+    return res;
+}
+
 int
 ff_rm_parse_packet (AVFormatContext *s, ByteIOContext *pb,
                     AVStream *st, RMStream *ast, int len, AVPacket *pkt,
@@ -732,45 +890,9 @@ ff_rm_parse_packet (AVFormatContext *s, ByteIOContext *pb,
         if(rm_assemble_video_frame(s, pb, rm, ast, pkt, len, seq))
             return -1; //got partial frame
     } else if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
-        if ((st->codec->codec_id == CODEC_ID_RA_288) ||
-            (st->codec->codec_id == CODEC_ID_COOK) ||
-            (st->codec->codec_id == CODEC_ID_ATRAC3) ||
-            (st->codec->codec_id == CODEC_ID_SIPR)) {
-            int x;
-            int sps = ast->sub_packet_size;
-            int cfs = ast->coded_framesize;
-            int h = ast->sub_packet_h;
-            int y = ast->sub_packet_cnt;
-            int w = ast->audio_framesize;
-
-            if (flags & 2)
-                y = ast->sub_packet_cnt = 0;
-            if (!y)
-                ast->audiotimestamp = timestamp;
-
-            switch(st->codec->codec_id) {
-                case CODEC_ID_RA_288:
-                    for (x = 0; x < h/2; x++)
-                        get_buffer(pb, ast->pkt.data+x*2*w+y*cfs, cfs);
-                    break;
-                case CODEC_ID_ATRAC3:
-                case CODEC_ID_COOK:
-                    for (x = 0; x < w/sps; x++)
-                        get_buffer(pb, ast->pkt.data+sps*(h*x+((h+1)/2)*(y&1)+(y>>1)), sps);
-                    break;
-                case CODEC_ID_SIPR:
-                    get_buffer(pb, ast->pkt.data + y * w, w);
-                    break;
-            }
-
-            if (++(ast->sub_packet_cnt) < h)
+        if (rm_is_interleaved(st)) {
+            if (!ast->deint_offsets || rm_deinterleave(s, st, ast, pb, NULL, flags, timestamp) < 0)
                 return -1;
-            if (st->codec->codec_id == CODEC_ID_SIPR)
-                rm_reorder_sipr_data(ast);
-
-             ast->sub_packet_cnt = 0;
-             rm->audio_stream_num = st->index;
-             rm->audio_pkt_cnt = h * w / st->codec->block_align;
         } else if (st->codec->codec_id == CODEC_ID_AAC) {
             int x;
             rm->audio_stream_num = st->index;
@@ -822,10 +944,17 @@ ff_rm_retrieve_cache (AVFormatContext *s, ByteIOContext *pb,
     if (st->codec->codec_id == CODEC_ID_AAC)
         av_get_packet(pb, pkt, ast->sub_packet_lengths[ast->sub_packet_cnt - rm->audio_pkt_cnt]);
     else {
-        av_new_packet(pkt, st->codec->block_align);
-        memcpy(pkt->data, ast->pkt.data + st->codec->block_align * //FIXME avoid this
-               (ast->sub_packet_h * ast->audio_framesize / st->codec->block_align - rm->audio_pkt_cnt),
-               st->codec->block_align);
+        uint8_t *frame = ast->pkt.data + st->codec->block_align *
+               (ast->sub_packet_h * ast->audio_framesize / st->codec->block_align - rm->audio_pkt_cnt);
+        if (s->flags & AVFMT_FLAG_NOBUFFERCOPY) {
+            /* valid until the next superblock is read */
+            av_init_packet(pkt);
+            pkt->data = frame;
+            pkt->size = st->codec->block_align;
+        } else {
+            av_new_packet(pkt, st->codec->block_align);
+            memcpy(pkt->data, frame, st->codec->block_align);
+        }
     }
     rm->audio_pkt_cnt--;
     if ((pkt->pts = ast->audiotimestamp) != AV_NOPTS_VALUE) {
@@ -870,6 +999,13 @@ static int rm_read_packet(AVFormatContext *s, AVPacket *pkt)
             if(len<0 || url_feof(s->pb))
                 return AVERROR(EIO);
 
+            /* do not read the payload of discarded streams */
+            if (!rm->old_format && st->discard >= AVDISCARD_ALL) {
+                url_fskip(s->pb, len);
+                rm->remaining_len = 0;
+                continue;
+            }
+
             res = ff_rm_parse_packet (s, s->pb, st, st->priv_data, len, pkt,
                                       &seq, flags, timestamp);
             if((flags&2) && (seq&0x7F) == 1)
@@ -954,6 +1090,84 @@ static int64_t rm_read_dts(AVFormatContext *s, int stream_index,
     return dts;
 }
 
+/**
+ * Scan the packets forward from where the last scan stopped, adding the
+ * keyframes of all streams to the index, until a keyframe of st at or
+ * after timestamp is found.
+ */
+static void rm_scan_keyframes(AVFormatContext *s, AVStream *st, int64_t timestamp)
+{
+    RMDemuxContext *rm = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int64_t pos, dts;
+    int stream_index, flags, len, h;
+
+    if (url_fseek(pb, rm->scan_pos, SEEK_SET) < 0)
+        return;
+    rm->remaining_len = 0;
+    for (;;) {
+        int seq = 1;
+        AVStream *st2;
+
+        len = sync(s, &dts, &flags, &stream_index, &pos);
+        if (len < 0) {
+            rm->scan_pos = -1;
+            return;
+        }
+        st2 = s->streams[stream_index];
+        if (st2->codec->codec_type == CODEC_TYPE_VIDEO) {
+            h = get_byte(pb); len--;
+            if (!(h & 0x40)) {
+                seq = get_byte(pb); len--;
+            }
+        }
+        url_fskip(pb, len);
+        if ((flags & 2) && (seq & 0x7F) == 1) {
+            av_add_index_entry(st2, pos, dts, 0, 0, AVINDEX_KEYFRAME);
+            if (st2 == st && dts >= timestamp) {
+                rm->scan_pos = url_ftell(pb);
+                return;
+            }
+        }
+    }
+}
+
+static int rm_read_seek(AVFormatContext *s, int stream_index,
+                        int64_t timestamp, int flags)
+{
+    RMDemuxContext *rm = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    AVStream *st = s->streams[stream_index];
+    RMStream *ast = st->priv_data;
+    const AVIndexEntry *ie;
+    int n, index;
+
+    if (rm->old_format || url_is_streamed(pb))
+        return -1;
+
+    if (!ast->index_loaded) {
+        ast->index_loaded = 1;
+        if (rm->index_off && url_fseek(pb, rm->index_off, SEEK_SET) >= 0)
+            ast->has_index = rm_read_index(s, st) > 0;
+    }
+    if (!ast->has_index && rm->scan_pos >= 0) {
+        n = ff_index_nb_entries(st);
+        if (!n || ff_index_get_entry(st, n - 1)->timestamp < timestamp)
+            rm_scan_keyframes(s, st, timestamp);
+    }
+
+    index = av_index_search_timestamp(st, timestamp, flags);
+    if (index < 0)
+        return -1;
+    ie = ff_index_get_entry(st, index);
+    if (url_fseek(pb, ie->pos, SEEK_SET) < 0)
+        return -1;
+    rm->remaining_len = 0;
+    rm->audio_pkt_cnt = 0;
+    av_update_cur_dts(s, st, ie->timestamp);
+    return 0;
+}
+
 AVInputFormat rm_demuxer = {
     "rm",
     NULL_IF_CONFIG_SMALL("RealMedia format"),
@@ -962,7 +1176,7 @@ AVInputFormat rm_demuxer = {
     rm_read_header,
     rm_read_packet,
     rm_read_close,
-    NULL,
+    rm_read_seek,
     rm_read_dts,
 };
 
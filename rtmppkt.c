@@ -71,6 +71,20 @@ void ff_amf_write_object_end(uint8_t **dst)
 
 int ff_rtmp_packet_read(URLContext *h, RTMPPacket *p,
                         int chunk_size, RTMPPacket *prev_pkt)
+{
+    uint8_t *buf = NULL;
+    unsigned int buf_size = 0;
+    int ret = ff_rtmp_packet_read_buf(h, p, chunk_size, prev_pkt,
+                                      &buf, &buf_size, 0, 0);
+    if (ret)
+        av_free(buf);
+    return ret;
+}
+
+int ff_rtmp_packet_read_buf(URLContext *h, RTMPPacket *p,
+                            int chunk_size, RTMPPacket *prev_pkt,
+                            uint8_t **pool, unsigned int *pool_size,
+                            int head, int tail)
 {
     uint8_t hdr, t, buf[16];
     int channel_id, timestamp, data_size, offset = 0;
@@ -120,9 +134,18 @@ int ff_rtmp_packet_read(URLContext *h, RTMPPacket *p,
     if (hdr != RTMP_PS_TWELVEBYTES)
         timestamp += prev_pkt[channel_id].timestamp;
 
-    if (ff_rtmp_packet_create(p, channel_id, type, timestamp, data_size))
+    if (data_size < 0 || data_size > INT_MAX - head - tail - FF_INPUT_BUFFER_PADDING_SIZE)
         return -1;
-    p->extra = extra;
+    av_fast_malloc(pool, pool_size, head + data_size + tail + FF_INPUT_BUFFER_PADDING_SIZE);
+    if (!*pool)
+        return AVERROR(ENOMEM);
+    p->data       = *pool + head;
+    p->data_size  = data_size;
+    p->channel_id = channel_id;
+    p->type       = type;
+    p->timestamp  = timestamp;
+    p->ts_delta   = 0;
+    p->extra      = extra;
     // save history
     prev_pkt[channel_id].channel_id = channel_id;
     prev_pkt[channel_id].type       = type;
@@ -132,14 +155,13 @@ int ff_rtmp_packet_read(URLContext *h, RTMPPacket *p,
     prev_pkt[channel_id].extra      = extra;
     while (data_size > 0) {
         int toread = FFMIN(data_size, chunk_size);
-        if (url_read_complete(h, p->data + offset, toread) != toread) {
-            ff_rtmp_packet_destroy(p);
+        if (url_read_complete(h, p->data + offset, toread) != toread)
             return AVERROR(EIO);
-        }
         data_size -= chunk_size;
         offset    += chunk_size;
         if (data_size > 0) {
-            url_read_complete(h, &t, 1); //marker
+            if (url_read_complete(h, &t, 1) != 1) //marker
+                return AVERROR(EIO);
             if (t != (0xC0 + channel_id))
                 return -1;
         }
@@ -150,9 +172,9 @@ int ff_rtmp_packet_read(URLContext *h, RTMPPacket *p,
 int ff_rtmp_packet_write(URLContext *h, RTMPPacket *pkt,
                          int chunk_size, RTMPPacket *prev_pkt)
 {
-    uint8_t pkt_hdr[16], *p = pkt_hdr;
+    uint8_t pkt_hdr[16], *p = pkt_hdr, *buf, *q;
     int mode = RTMP_PS_TWELVEBYTES;
-    int off = 0;
+    int off = 0, size, ret;
     pkt->ts_delta = pkt->timestamp - prev_pkt[pkt->channel_id].timestamp;
 
     //if channel_id = 0, this is first presentation of prev_pkt, send full hdr.
@@ -203,17 +225,25 @@ int ff_rtmp_packet_write(URLContext *h, RTMPPacket *pkt,
     }
     prev_pkt[pkt->channel_id].extra      = pkt->extra;
 
-    url_write(h, pkt_hdr, p-pkt_hdr);
+    /* assemble header, chunks and continuation markers so that the whole
+     * packet goes out with a single write */
+    size = p - pkt_hdr + pkt->data_size;
+    if (pkt->data_size > 0)
+        size += (pkt->data_size - 1) / chunk_size;
+    buf = q = av_malloc(size);
+    if (!buf)
+        return AVERROR(ENOMEM);
+    bytestream_put_buffer(&q, pkt_hdr, p - pkt_hdr);
     while (off < pkt->data_size) {
         int towrite = FFMIN(chunk_size, pkt->data_size - off);
-        url_write(h, pkt->data + off, towrite);
+        bytestream_put_buffer(&q, pkt->data + off, towrite);
         off += towrite;
-        if (off < pkt->data_size) {
-            uint8_t marker = 0xC0 | pkt->channel_id;
-            url_write(h, &marker, 1);
-        }
+        if (off < pkt->data_size)
+            bytestream_put_byte(&q, 0xC0 | pkt->channel_id);
     }
-    return 0;
+    ret = url_write(h, buf, size);
+    av_free(buf);
+    return ret < 0 ? ret : 0;
 }
 
 int ff_rtmp_packet_create(RTMPPacket *pkt, int channel_id, RTMPPacketType type,
@@ -115,6 +115,29 @@ void ff_rtmp_packet_destroy(RTMPPacket *pkt);
 int ff_rtmp_packet_read(URLContext *h, RTMPPacket *p,
                         int chunk_size, RTMPPacket *prev_pkt);
 
+/**
+ * Reads RTMP packet sent by the server into a caller-owned buffer, which
+ * is reused between calls and only grown when a message does not fit.
+ * The payload is reassembled at offset head, so that the caller can put
+ * its own header before it and tail bytes after it without copying.
+ * The packet data points into the buffer and must not be destroyed.
+ *
+ * @param h          reader context
+ * @param p          packet
+ * @param chunk_size current chunk size
+ * @param prev_pkt   previously read packet headers for all channels
+ *                   (may be needed for restoring incomplete packet header)
+ * @param pool       pointer to the buffer, may point to NULL
+ * @param pool_size  pointer to the allocated size of the buffer
+ * @param head       number of bytes to leave free before the payload
+ * @param tail       number of bytes to leave free after the payload
+ * @return zero on success, negative value otherwise
+ */
+int ff_rtmp_packet_read_buf(URLContext *h, RTMPPacket *p,
+                            int chunk_size, RTMPPacket *prev_pkt,
+                            uint8_t **pool, unsigned int *pool_size,
+                            int head, int tail);
+
 /**
  * Sends RTMP packet to the server.
  *
@@ -62,7 +62,8 @@ typedef enum {
 typedef struct RTMPContext {
     URLContext*   stream;                     ///< TCP stream used in interactions with RTMP server
     RTMPPacket    prev_pkt[2][RTMP_CHANNELS]; ///< packet history used when reading and sending packets
-    int           chunk_size;                 ///< size of the chunks RTMP packets are divided into
+    int           chunk_size;                 ///< size of the chunks incoming RTMP packets are divided into
+    int           out_chunk_size;             ///< size of the chunks outgoing RTMP packets are divided into
     int           is_input;                   ///< input/output flag
     char          playpath[256];              ///< path to filename to play (with possible "mp4:" prefix)
     char          app[128];                   ///< application
@@ -70,10 +71,14 @@ typedef struct RTMPContext {
     int           main_channel_id;            ///< an additional channel ID which is used for some invocations
     uint8_t*      flv_data;                   ///< buffer with data for demuxer
     int           flv_size;                   ///< current buffer size
+    unsigned int  flv_alloc;                  ///< allocated buffer size, incoming messages are reassembled in it
     int           flv_off;                    ///< number of bytes read from current buffer
     RTMPPacket    out_pkt;                    ///< rtmp packet, created from flv a/v or metadata (for output)
 } RTMPContext;
 
+/** size of the chunks outgoing packets are split into once publishing starts */
+#define RTMP_OUT_CHUNK_SIZE 4096
+
 #define PLAYER_KEY_OPEN_PART_LEN 30   ///< length of partial key used for first client digest signing
 /** Client key used for digest signing */
 static const uint8_t rtmp_player_key[] = {
@@ -145,7 +150,7 @@ static void gen_connect(URLContext *s, RTMPContext *rt, const char *proto,
 
     pkt.data_size = p - pkt.data;
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -168,7 +173,7 @@ static void gen_release_stream(URLContext *s, RTMPContext *rt)
     ff_amf_write_null(&p);
     ff_amf_write_string(&p, rt->playpath);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -191,7 +196,7 @@ static void gen_fcpublish_stream(URLContext *s, RTMPContext *rt)
     ff_amf_write_null(&p);
     ff_amf_write_string(&p, rt->playpath);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -214,7 +219,7 @@ static void gen_fcunpublish_stream(URLContext *s, RTMPContext *rt)
     ff_amf_write_null(&p);
     ff_amf_write_string(&p, rt->playpath);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -235,7 +240,7 @@ static void gen_create_stream(URLContext *s, RTMPContext *rt)
     ff_amf_write_number(&p, rt->is_input ? 3.0 : 4.0);
     ff_amf_write_null(&p);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -258,7 +263,7 @@ static void gen_delete_stream(URLContext *s, RTMPContext *rt)
     ff_amf_write_null(&p);
     ff_amf_write_number(&p, rt->main_channel_id);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -282,7 +287,7 @@ static void gen_play(URLContext *s, RTMPContext *rt)
     ff_amf_write_null(&p);
     ff_amf_write_string(&p, rt->playpath);
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 
     // set client buffer time disguised in ping packet
@@ -293,7 +298,7 @@ static void gen_play(URLContext *s, RTMPContext *rt)
     bytestream_put_be32(&p, 1);
     bytestream_put_be32(&p, 256); //TODO: what is a good value here?
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -317,7 +322,27 @@ static void gen_publish(URLContext *s, RTMPContext *rt)
     ff_amf_write_string(&p, rt->playpath);
     ff_amf_write_string(&p, "live");
 
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_destroy(&pkt);
+}
+
+/**
+ * Generates 'Set Chunk Size' message and sends it to the server, then
+ * uses the new size for all following outgoing packets.
+ */
+static void gen_chunk_size(URLContext *s, RTMPContext *rt, int chunk_size)
+{
+    RTMPPacket pkt;
+    uint8_t *p;
+
+    av_log(LOG_CONTEXT, AV_LOG_DEBUG, "Setting outgoing chunk size to %d\n", chunk_size);
+    ff_rtmp_packet_create(&pkt, RTMP_NETWORK_CHANNEL, RTMP_PT_CHUNK_SIZE, 0, 4);
+
+    p = pkt.data;
+    bytestream_put_be32(&p, chunk_size);
+
+    if (!ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]))
+        rt->out_chunk_size = chunk_size;
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -333,7 +358,7 @@ static void gen_pong(URLContext *s, RTMPContext *rt, RTMPPacket *ppkt)
     p = pkt.data;
     bytestream_put_be16(&p, 7);
     bytestream_put_be32(&p, AV_RB32(ppkt->data+2));
-    ff_rtmp_packet_write(rt->stream, &pkt, rt->chunk_size, rt->prev_pkt[1]);
+    ff_rtmp_packet_write(rt->stream, &pkt, rt->out_chunk_size, rt->prev_pkt[1]);
     ff_rtmp_packet_destroy(&pkt);
 }
 
@@ -542,8 +567,6 @@ static int rtmp_parse_result(URLContext *s, RTMPContext *rt, RTMPPacket *pkt)
                    "Chunk size change packet is not 4 bytes long (%d)\n", pkt->data_size);
             return -1;
         }
-        if (!rt->is_input)
-            ff_rtmp_packet_write(rt->stream, pkt, rt->chunk_size, rt->prev_pkt[1]);
         rt->chunk_size = AV_RB32(pkt->data);
         if (rt->chunk_size <= 0) {
             av_log(LOG_CONTEXT, AV_LOG_ERROR, "Incorrect chunk size %d\n", rt->chunk_size);
@@ -601,6 +624,7 @@ static int rtmp_parse_result(URLContext *s, RTMPContext *rt, RTMPPacket *pkt)
                 if (rt->is_input) {
                     gen_play(s, rt);
                 } else {
+                    gen_chunk_size(s, rt, RTMP_OUT_CHUNK_SIZE);
                     gen_publish(s, rt);
                 }
                 rt->state = STATE_READY;
@@ -661,8 +685,16 @@ static int get_packet(URLContext *s, int for_header)
 
     for (;;) {
         RTMPPacket rpkt;
-        if ((ret = ff_rtmp_packet_read(rt->stream, &rpkt,
-                                       rt->chunk_size, rt->prev_pkt[0])) != 0) {
+
+        /* the payload is read right behind room for the FLV tag header
+         * and followed by room for the previous tag size, so it can be
+         * handed to the demuxer where it is */
+        rt->flv_off  = 0;
+        rt->flv_size = 0;
+        if ((ret = ff_rtmp_packet_read_buf(rt->stream, &rpkt,
+                                           rt->chunk_size, rt->prev_pkt[0],
+                                           &rt->flv_data, &rt->flv_alloc,
+                                           11, 4)) != 0) {
             if (ret > 0) {
                 return AVERROR(EAGAIN);
             } else {
@@ -671,44 +703,33 @@ static int get_packet(URLContext *s, int for_header)
         }
 
         ret = rtmp_parse_result(s, rt, &rpkt);
-        if (ret < 0) {//serious error in current packet
-            ff_rtmp_packet_destroy(&rpkt);
+        if (ret < 0) //serious error in current packet
             return -1;
-        }
-        if (rt->state == STATE_STOPPED) {
-            ff_rtmp_packet_destroy(&rpkt);
+        if (rt->state == STATE_STOPPED)
             return AVERROR_EOF;
-        }
-        if (for_header && (rt->state == STATE_PLAYING || rt->state == STATE_PUBLISHING)) {
-            ff_rtmp_packet_destroy(&rpkt);
+        if (for_header && (rt->state == STATE_PLAYING || rt->state == STATE_PUBLISHING))
             return 0;
-        }
-        if (!rpkt.data_size || !rt->is_input) {
-            ff_rtmp_packet_destroy(&rpkt);
+        if (!rpkt.data_size || !rt->is_input)
             continue;
-        }
         if (rpkt.type == RTMP_PT_VIDEO || rpkt.type == RTMP_PT_AUDIO ||
            (rpkt.type == RTMP_PT_NOTIFY && !memcmp("\002\000\012onMetaData", rpkt.data, 13))) {
             ts = rpkt.timestamp;
 
-            // generate packet header and put data into buffer for FLV demuxer
-            rt->flv_off  = 0;
+            // generate packet header around the data for FLV demuxer
             rt->flv_size = rpkt.data_size + 15;
-            rt->flv_data = p = av_realloc(rt->flv_data, rt->flv_size);
+            p = rt->flv_data;
             bytestream_put_byte(&p, rpkt.type);
             bytestream_put_be24(&p, rpkt.data_size);
             bytestream_put_be24(&p, ts);
             bytestream_put_byte(&p, ts >> 24);
             bytestream_put_be24(&p, 0);
-            bytestream_put_buffer(&p, rpkt.data, rpkt.data_size);
+            p += rpkt.data_size;
             bytestream_put_be32(&p, 0);
-            ff_rtmp_packet_destroy(&rpkt);
             return 0;
         } else if (rpkt.type == RTMP_PT_METADATA) {
             // we got raw FLV data, make it available for FLV demuxer
-            rt->flv_off  = 0;
-            rt->flv_size = rpkt.data_size;
-            rt->flv_data = av_realloc(rt->flv_data, rt->flv_size);
+            rt->flv_off  = rpkt.data - rt->flv_data;
+            rt->flv_size = rt->flv_off + rpkt.data_size;
             /* rewrite timestamps */
             next = rpkt.data;
             ts = rpkt.timestamp;
@@ -726,11 +747,8 @@ static int get_packet(URLContext *s, int for_header)
                 bytestream_put_byte(&p, ts >> 24);
                 next += data_size + 3 + 4;
             }
-            memcpy(rt->flv_data, rpkt.data, rpkt.data_size);
-            ff_rtmp_packet_destroy(&rpkt);
             return 0;
         }
-        ff_rtmp_packet_destroy(&rpkt);
     }
     return 0;
 }
@@ -783,9 +801,9 @@ static int rtmp_open(URLContext *s, const char *uri, int flags)
 
     if (port < 0)
         port = RTMP_DEFAULT_PORT;
-    snprintf(buf, sizeof(buf), "tcp://%s:%d", hostname, port);
+    snprintf(buf, sizeof(buf), "tcp://%s:%d?tcp_nodelay=1", hostname, port);
 
-    if (url_open(&rt->stream, buf, URL_RDWR) < 0) {
+    if (url_open_interrupt(&rt->stream, buf, URL_RDWR, s->interrupt) < 0) {
         av_log(LOG_CONTEXT, AV_LOG_ERROR, "Cannot open connection %s\n", buf);
         goto fail;
     }
@@ -794,7 +812,8 @@ static int rtmp_open(URLContext *s, const char *uri, int flags)
     if (rtmp_handshake(s, rt))
         return -1;
 
-    rt->chunk_size = 128;
+    rt->chunk_size     = 128;
+    rt->out_chunk_size = 128;
     rt->state = STATE_HANDSHAKED;
     //extract "app" part from path
     if (!strncmp(path, "/ondemand/", 10)) {
@@ -839,12 +858,15 @@ static int rtmp_open(URLContext *s, const char *uri, int flags)
     if (rt->is_input) {
         // generate FLV header for demuxer
         rt->flv_size = 13;
-        rt->flv_data = av_realloc(rt->flv_data, rt->flv_size);
         rt->flv_off  = 0;
+        av_fast_malloc(&rt->flv_data, &rt->flv_alloc, rt->flv_size);
+        if (!rt->flv_data)
+            goto fail;
         memcpy(rt->flv_data, "FLV\1\5\0\0\0\011\0\0\0\0", rt->flv_size);
     } else {
         rt->flv_size = 0;
-        rt->flv_data = NULL;
+        av_freep(&rt->flv_data);
+        rt->flv_alloc = 0;
         rt->flv_off  = 0;
     }
 
@@ -940,7 +962,7 @@ static int rtmp_write(URLContext *h, uint8_t *buf, int size)
         if (rt->flv_off == rt->flv_size) {
             bytestream_get_be32(&buf_temp);
 
-            ff_rtmp_packet_write(rt->stream, &rt->out_pkt, rt->chunk_size, rt->prev_pkt[1]);
+            ff_rtmp_packet_write(rt->stream, &rt->out_pkt, rt->out_chunk_size, rt->prev_pkt[1]);
             ff_rtmp_packet_destroy(&rt->out_pkt);
             rt->flv_size = 0;
             rt->flv_off = 0;
@@ -142,10 +142,33 @@ static int asfrtp_parse_sdp_line(AVFormatContext *s, int stream_index,
 }
 
 struct PayloadContext {
-    ByteIOContext *pktbuf, pb;
-    char *buf;
+    ByteIOContext pb;
+    uint8_t *buf;               ///< ASF packet being reassembled or demuxed, reused
+    unsigned int buf_size;
+    int frag_len;               ///< bytes of the packet reassembled so far
 };
 
+/**
+ * Append data to the ASF packet being reassembled, growing the buffer to
+ * at least an ASF packet the first time.
+ */
+static int asfrtp_append(PayloadContext *asf, int min_size,
+                         const uint8_t *buf, int len)
+{
+    int size = FFMAX(asf->frag_len + len, min_size);
+
+    if (size > asf->buf_size) {
+        uint8_t *p = av_realloc(asf->buf, size + FF_INPUT_BUFFER_PADDING_SIZE);
+        if (!p)
+            return AVERROR(ENOMEM);
+        asf->buf      = p;
+        asf->buf_size = size;
+    }
+    memcpy(asf->buf + asf->frag_len, buf, len);
+    asf->frag_len += len;
+    return 0;
+}
+
 /**
  * @return 0 when a packet was written into /p pkt, and no more data is left;
  *         1 when a packet was written into /p pkt, and more packets might be left;
@@ -169,43 +192,41 @@ static int asfrtp_parse_packet(AVFormatContext *s, PayloadContext *asf,
         if (len < 4)
             return -1;
 
-        init_put_byte(pb, buf, len, 0, NULL, NULL, NULL, NULL);
-        mflags = get_byte(pb);
+        /* the payload header is parsed in place */
+        mflags = buf[0];
         if (mflags & 0x80)
             flags |= RTP_FLAG_KEY;
-        len_off = get_be24(pb);
+        len_off = AV_RB24(buf + 1);
+        off = 4;
         if (mflags & 0x20)   /**< relative timestamp */
-            url_fskip(pb, 4);
+            off += 4;
         if (mflags & 0x10)   /**< has duration */
-            url_fskip(pb, 4);
+            off += 4;
         if (mflags & 0x8)    /**< has location ID */
-            url_fskip(pb, 4);
-        off = url_ftell(pb);
+            off += 4;
+        if (off > len)
+            return -1;
 
-        av_freep(&asf->buf);
         if (!(mflags & 0x40)) {
             /**
              * If 0x40 is not set, the len_off field specifies an offset of this
              * packet's payload data in the complete (reassembled) ASF packet.
              * This is used to spread one ASF packet over multiple RTP packets.
+             * The fragments are gathered in asf->buf, kept from packet to
+             * packet.
              */
-            if (asf->pktbuf && len_off != url_ftell(asf->pktbuf)) {
-                uint8_t *p;
-                url_close_dyn_buf(asf->pktbuf, &p);
-                asf->pktbuf = NULL;
-                av_free(p);
+            if (len_off != asf->frag_len) {
+                asf->frag_len = 0;
+                if (len_off)
+                    return AVERROR(EIO);
             }
-            if (!len_off && !asf->pktbuf &&
-                !(res = url_open_dyn_packet_buf(&asf->pktbuf, rt->asf_ctx->packet_size)))
+            if ((res = asfrtp_append(asf, rt->asf_ctx->packet_size,
+                                     buf + off, len - off)) < 0)
                 return res;
-            if (!asf->pktbuf)
-                return AVERROR(EIO);
-
-            put_buffer(asf->pktbuf, buf + off, len - off);
             if (!(flags & RTP_FLAG_MARKER))
                 return -1;
-            out_len     = url_close_dyn_buf(asf->pktbuf, &asf->buf);
-            asf->pktbuf = NULL;
+            out_len       = asf->frag_len;
+            asf->frag_len = 0;
         } else {
             /**
              * If 0x40 is set, the len_off field specifies the length of the
@@ -219,9 +240,13 @@ static int asfrtp_parse_packet(AVFormatContext *s, PayloadContext *asf,
                     "RTSP-MS packet splitting", 1);
                 return -1;
             }
-            asf->buf = av_malloc(len - off);
-            out_len  = len - off;
-            memcpy(asf->buf, buf + off, len - off);
+            /* the RTP buffer does not outlive this call, copy it */
+            asf->frag_len = 0;
+            if ((res = asfrtp_append(asf, rt->asf_ctx->packet_size,
+                                     buf + off, len - off)) < 0)
+                return res;
+            out_len       = asf->frag_len;
+            asf->frag_len = 0;
         }
 
         init_packetizer(pb, asf->buf, out_len);
@@ -256,12 +281,6 @@ static PayloadContext *asfrtp_new_context(void)
 
 static void asfrtp_free_context(PayloadContext *asf)
 {
-    if (asf->pktbuf) {
-        uint8_t *p = NULL;
-        url_close_dyn_buf(asf->pktbuf, &p);
-        asf->pktbuf = NULL;
-        av_free(p);
-    }
     av_freep(&asf->buf);
     av_free(asf);
 }
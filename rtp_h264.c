@@ -38,6 +38,7 @@
 
 #include "libavutil/base64.h"
 #include "libavutil/avstring.h"
+#include "libavutil/intreadwrite.h"
 #include "libavcodec/get_bits.h"
 #include "avformat.h"
 #include "mpegts.h"
@@ -48,6 +49,7 @@
 
 #include "rtpdec.h"
 #include "rtp_h264.h"
+#include "avc.h"
 
 /**
     RTP/H264 specific private data.
@@ -63,8 +65,20 @@ struct PayloadContext {
 #ifdef DEBUG
     int packet_types_received[32];
 #endif
+
+    int initialized;            ///< output set up on the first packet
+    int avcc;                   ///< write 4 byte size prefixes instead of start codes
+    uint8_t *frame;             ///< access unit being reassembled
+    unsigned int frame_alloc;   ///< allocated size of frame
+    int frame_len;
+    int frame_avg;              ///< running average of the recent frame sizes
+    int frame_key;              ///< frame contains an IDR slice
+    int nal_start;              ///< offset of the NAL unit started last in frame, -1 if none
+    uint32_t frame_timestamp;
 };
 
+#define H264_MIN_FRAME_SIZE 4096
+
 #define MAGIC_COOKIE (0xdeadbeef)       ///< Cookie for the extradata; to verify we are what we think we are, and that we haven't been freed.
 #define DEAD_COOKIE (0xdeaddead)        ///< Cookie for the extradata; once it is freed.
 
@@ -158,25 +172,151 @@ static void sdp_parse_fmtp_config_h264(AVStream * stream,
     }
 }
 
-// return 0 on packet, no more left, 1 on packet, 1 on partial packet...
-static int h264_handle_packet(AVFormatContext *ctx,
-                              PayloadContext *data,
-                              AVStream *st,
-                              AVPacket * pkt,
-                              uint32_t * timestamp,
-                              const uint8_t * buf,
-                              int len, int flags)
+/**
+ * Sets up the output on the first packet: with AVFMT_FLAG_AVCC the
+ * parameter sets from the SDP become an avcC record and NAL units get
+ * 4 byte size prefixes. The packets are complete access units, so a
+ * parser is only needed for the headers, and not at all for AVCC.
+ */
+static void h264_init_output(AVFormatContext *ctx, PayloadContext *data,
+                             AVStream *st)
 {
-    uint8_t nal = buf[0];
-    uint8_t type = (nal & 0x1f);
-    int result= 0;
-    uint8_t start_sequence[]= {0, 0, 1};
+    AVCodecContext *codec = st->codec;
+
+    data->initialized = 1;
+    data->nal_start = -1;
+    data->avcc = !!(ctx->flags & AVFMT_FLAG_AVCC);
+    if (data->avcc && codec->extradata_size && codec->extradata[0] != 1) {
+        ByteIOContext *pb;
+        uint8_t *extradata;
+        int size;
+
+        if (url_open_dyn_buf(&pb) < 0)
+            return;
+        ff_isom_write_avcc(pb, codec->extradata, codec->extradata_size);
+        size = url_close_dyn_buf(pb, &extradata);
+        if (size <= 0 || !(extradata = av_realloc(extradata, size + FF_INPUT_BUFFER_PADDING_SIZE))) {
+            av_log(ctx, AV_LOG_ERROR, "Unable to convert extradata to avcC, "
+                   "returning start codes\n");
+            data->avcc = 0;
+            return;
+        }
+        memset(extradata + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        av_free(codec->extradata);
+        codec->extradata      = extradata;
+        codec->extradata_size = size;
+    } else if (data->avcc && !codec->extradata_size) {
+        av_log(ctx, AV_LOG_WARNING, "No parameter sets in the SDP, "
+               "returning start codes\n");
+        data->avcc = 0;
+    }
+    if (st->need_parsing == AVSTREAM_PARSE_FULL)
+        st->need_parsing = data->avcc ? AVSTREAM_PARSE_NONE : AVSTREAM_PARSE_HEADERS;
+}
+
+/**
+ * Makes room for size more bytes of the access unit. A new frame buffer is
+ * reserved from the average size of the recent frames so that most frames
+ * fit without reallocation.
+ */
+static int h264_reserve(PayloadContext *data, int size)
+{
+    unsigned int needed = data->frame_len + size + FF_INPUT_BUFFER_PADDING_SIZE;
+
+    if (needed > data->frame_alloc) {
+        unsigned int alloc = data->frame_alloc ? data->frame_alloc * 2 :
+                             data->frame_avg + data->frame_avg / 2;
+        uint8_t *frame;
+
+        alloc = FFMAX(alloc, FFMAX(needed, H264_MIN_FRAME_SIZE));
+        if (!(frame = av_realloc(data->frame, alloc)))
+            return AVERROR(ENOMEM);
+        data->frame       = frame;
+        data->frame_alloc = alloc;
+    }
+    return 0;
+}
 
+/**
+ * Starts a NAL unit in the access unit, writing a start code or, for AVCC,
+ * a size prefix that is updated as the NAL unit grows.
+ */
+static int h264_start_nal(PayloadContext *data, uint8_t nal, uint32_t timestamp)
+{
+    static const uint8_t start_sequence[]= {0, 0, 1};
+    int ret;
+
+    if ((ret = h264_reserve(data, 5)) < 0)
+        return ret;
+    if (!data->frame_len)
+        data->frame_timestamp = timestamp;
+    data->nal_start = data->frame_len;
+    if (data->avcc) {
+        AV_WB32(data->frame + data->frame_len, 1);
+        data->frame_len += 4;
+    } else {
+        memcpy(data->frame + data->frame_len, start_sequence, sizeof(start_sequence));
+        data->frame_len += sizeof(start_sequence);
+    }
+    data->frame[data->frame_len++] = nal;
+    if ((nal & 0x1f) == 5)
+        data->frame_key = 1;
 #ifdef DEBUG
-    assert(data);
-    assert(data->cookie == MAGIC_COOKIE);
+    data->packet_types_received[nal & 0x1f]++;
 #endif
-    assert(buf);
+    return 0;
+}
+
+/**
+ * Appends data to the NAL unit started last.
+ */
+static int h264_append_nal(PayloadContext *data, const uint8_t *buf, int len)
+{
+    int ret;
+
+    if ((ret = h264_reserve(data, len)) < 0)
+        return ret;
+    memcpy(data->frame + data->frame_len, buf, len);
+    data->frame_len += len;
+    if (data->avcc)
+        AV_WB32(data->frame + data->nal_start, data->frame_len - data->nal_start - 4);
+    return 0;
+}
+
+/**
+ * Hands the reassembled access unit over to pkt, which takes ownership of
+ * the frame buffer.
+ */
+static void h264_output_frame(PayloadContext *data, AVStream *st,
+                              AVPacket *pkt, uint32_t *timestamp)
+{
+    av_init_packet(pkt);
+    pkt->data         = data->frame;
+    pkt->size         = data->frame_len;
+    pkt->destruct     = av_destruct_packet;
+    pkt->stream_index = st->index;
+    if (data->frame_key)
+        pkt->flags   |= PKT_FLAG_KEY;
+    memset(pkt->data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    *timestamp = data->frame_timestamp;
+
+    data->frame_avg  += (data->frame_len - data->frame_avg) / 8;
+    data->frame       = NULL;
+    data->frame_alloc = 0;
+    data->frame_len   = 0;
+    data->frame_key   = 0;
+    data->nal_start   = -1;
+}
+
+/**
+ * Adds the NAL units of an RTP packet to the access unit being reassembled.
+ */
+static int h264_add_packet(AVFormatContext *ctx, PayloadContext *data,
+                           uint32_t timestamp, const uint8_t *buf, int len)
+{
+    uint8_t nal = buf[0];
+    uint8_t type = (nal & 0x1f);
+    int result= 0;
 
     if (type >= 1 && type <= 23)
         type = 1;              // simplify the case. (these are all the nal types used internally by the h264 codec)
@@ -186,72 +326,34 @@ static int h264_handle_packet(AVFormatContext *ctx,
         break;
 
     case 1:
-        av_new_packet(pkt, len+sizeof(start_sequence));
-        memcpy(pkt->data, start_sequence, sizeof(start_sequence));
-        memcpy(pkt->data+sizeof(start_sequence), buf, len);
-#ifdef DEBUG
-        data->packet_types_received[nal & 0x1f]++;
-#endif
+        if ((result = h264_start_nal(data, nal, timestamp)) < 0)
+            break;
+        result = h264_append_nal(data, buf + 1, len - 1);
         break;
 
     case 24:                   // STAP-A (one packet, multiple nals)
         // consume the STAP-A NAL
         buf++;
         len--;
-        // first we are going to figure out the total size....
-        {
-            int pass= 0;
-            int total_length= 0;
-            uint8_t *dst= NULL;
-
-            for(pass= 0; pass<2; pass++) {
-                const uint8_t *src= buf;
-                int src_len= len;
-
-                do {
-                    uint16_t nal_size = AV_RB16(src); // this going to be a problem if unaligned (can it be?)
-
-                    // consume the length of the aggregate...
-                    src += 2;
-                    src_len -= 2;
-
-                    if (nal_size <= src_len) {
-                        if(pass==0) {
-                            // counting...
-                            total_length+= sizeof(start_sequence)+nal_size;
-                        } else {
-                            // copying
-                            assert(dst);
-                            memcpy(dst, start_sequence, sizeof(start_sequence));
-                            dst+= sizeof(start_sequence);
-                            memcpy(dst, src, nal_size);
-#ifdef DEBUG
-                            data->packet_types_received[*src & 0x1f]++;
-#endif
-                            dst+= nal_size;
-                        }
-                    } else {
-                        av_log(ctx, AV_LOG_ERROR,
-                               "nal size exceeds length: %d %d\n", nal_size, src_len);
-                    }
+        while (len > 2) {      // because there could be rtp padding..
+            uint16_t nal_size = AV_RB16(buf);
 
-                    // eat what we handled...
-                    src += nal_size;
-                    src_len -= nal_size;
+            // consume the length of the aggregate...
+            buf += 2;
+            len -= 2;
 
-                    if (src_len < 0)
-                        av_log(ctx, AV_LOG_ERROR,
-                               "Consumed more bytes than we got! (%d)\n", src_len);
-                } while (src_len > 2);      // because there could be rtp padding..
-
-                if(pass==0) {
-                    // now we know the total size of the packet (with the start sequences added)
-                    av_new_packet(pkt, total_length);
-                    dst= pkt->data;
-                } else {
-                    assert(dst-pkt->data==total_length);
-                }
+            if (!nal_size || nal_size > len) {
+                av_log(ctx, AV_LOG_ERROR,
+                       "nal size exceeds length: %d %d\n", nal_size, len);
+                break;
             }
+            if ((result = h264_start_nal(data, buf[0], timestamp)) < 0 ||
+                (result = h264_append_nal(data, buf + 1, nal_size - 1)) < 0)
+                break;
+
+            // eat what we handled...
+            buf += nal_size;
+            len -= nal_size;
         }
         break;
 
@@ -266,39 +368,31 @@ static int h264_handle_packet(AVFormatContext *ctx,
         break;
 
     case 28:                   // FU-A (fragmented nal)
-        buf++;
-        len--;                  // skip the fu_indicator
+        if (len < 2) {
+            result = -1;
+            break;
+        }
         {
-            // these are the same as above, we just redo them here for clarity...
             uint8_t fu_indicator = nal;
-            uint8_t fu_header = *buf;   // read the fu_header.
+            uint8_t fu_header = buf[1];
             uint8_t start_bit = fu_header >> 7;
-//            uint8_t end_bit = (fu_header & 0x40) >> 6;
             uint8_t nal_type = (fu_header & 0x1f);
-            uint8_t reconstructed_nal;
 
-            // reconstruct this packet's true nal; only the data follows..
-            reconstructed_nal = fu_indicator & (0xe0);  // the original nal forbidden bit and NRI are stored in this packet's nal;
-            reconstructed_nal |= nal_type;
-
-            // skip the fu_header...
-            buf++;
-            len--;
-
-#ifdef DEBUG
-            if (start_bit)
-                data->packet_types_received[nal_type]++;
-#endif
-            if(start_bit) {
-                // copy in the start sequence, and the reconstructed nal....
-                av_new_packet(pkt, sizeof(start_sequence)+sizeof(nal)+len);
-                memcpy(pkt->data, start_sequence, sizeof(start_sequence));
-                pkt->data[sizeof(start_sequence)]= reconstructed_nal;
-                memcpy(pkt->data+sizeof(start_sequence)+sizeof(nal), buf, len);
-            } else {
-                av_new_packet(pkt, len);
-                memcpy(pkt->data, buf, len);
+            // skip the fu_indicator and fu_header...
+            buf += 2;
+            len -= 2;
+
+            if (start_bit) {
+                // the original nal forbidden bit and NRI are stored in the fu_indicator
+                result = h264_start_nal(data, (fu_indicator & 0xe0) | nal_type, timestamp);
+                if (result < 0)
+                    break;
+            } else if (data->nal_start < 0) {
+                // the start of this nal was lost, there is nothing to append to
+                result = -1;
+                break;
             }
+            result = h264_append_nal(data, buf, len);
         }
         break;
 
@@ -310,11 +404,60 @@ static int h264_handle_packet(AVFormatContext *ctx,
         break;
     }
 
-    pkt->stream_index = st->index;
-
     return result;
 }
 
+/**
+ * Reassembles the NAL units of one timestamp into a single packet, which is
+ * returned on the marker bit, or when a packet of the next access unit
+ * shows that the marker was lost.
+ * @return 0 on packet, 1 on packet with another access unit complete,
+ *         <0 while no access unit is complete
+ */
+static int h264_handle_packet(AVFormatContext *ctx,
+                              PayloadContext *data,
+                              AVStream *st,
+                              AVPacket * pkt,
+                              uint32_t * timestamp,
+                              const uint8_t * buf,
+                              int len, int flags)
+{
+    uint32_t packet_timestamp = *timestamp;
+    int have_packet = 0;
+
+#ifdef DEBUG
+    assert(data);
+    assert(data->cookie == MAGIC_COOKIE);
+#endif
+
+    if (!buf) {
+        // the access unit left complete by the previous call
+        if (!data->frame_len)
+            return -1;
+        h264_output_frame(data, st, pkt, timestamp);
+        return 0;
+    }
+    if (!data->initialized)
+        h264_init_output(ctx, data, st);
+    if (len < 1)
+        return -1;
+
+    if (data->frame_len && *timestamp != data->frame_timestamp) {
+        h264_output_frame(data, st, pkt, timestamp);
+        have_packet = 1;
+    }
+
+    h264_add_packet(ctx, data, packet_timestamp, buf, len);
+
+    if ((flags & RTP_FLAG_MARKER) && data->frame_len) {
+        if (have_packet)
+            return 1;
+        h264_output_frame(data, st, pkt, timestamp);
+        return 0;
+    }
+    return have_packet ? 0 : -1;
+}
+
 /* ---------------- public code */
 static PayloadContext *h264_new_context(void)
 {
@@ -347,6 +490,8 @@ static void h264_free_context(PayloadContext *data)
     // avoid stale pointers (assert)
     data->cookie = DEAD_COOKIE;
 
+    av_free(data->frame);
+
     // and clear out this...
     av_free(data);
 }
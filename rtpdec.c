@@ -24,6 +24,7 @@
 
 #include "libavcodec/get_bits.h"
 #include "avformat.h"
+#include "internal.h"
 #include "mpegts.h"
 
 #include <unistd.h>
@@ -76,6 +77,7 @@ static int rtcp_parse_packet(RTPDemuxContext *s, const unsigned char *buf, int l
     if (s->first_rtcp_ntp_time == AV_NOPTS_VALUE)
         s->first_rtcp_ntp_time = s->last_rtcp_ntp_time;
     s->last_rtcp_timestamp = AV_RB32(buf + 16);
+    s->last_rtcp_reception_time = av_gettime();
     return 0;
 }
 
@@ -155,21 +157,50 @@ static int rtp_valid_packet_in_sequence(RTPStatistics *s, uint16_t seq)
     return 1;
 }
 
-#if 0
 /**
-* This function is currently unused; without a valid local ntp time, I don't see how we could calculate the
-* difference between the arrival and sent timestamp.  As a result, the jitter and transit statistics values
-* never change.  I left this in in case someone else can see a way. (rdm)
+* Updates the interarrival jitter (RFC 3550, 6.4.1). Both timestamps are in
+* RTP clock units; the arrival time comes from the local clock, whose offset
+* to the sender clock cancels out in the difference of two transit times.
 */
 static void rtcp_update_jitter(RTPStatistics *s, uint32_t sent_timestamp, uint32_t arrival_timestamp)
 {
     uint32_t transit= arrival_timestamp - sent_timestamp;
     int d;
+    if (s->received > 1) {
+        d= FFABS((int32_t)(transit - s->transit));
+        s->jitter += d - ((s->jitter + 8)>>4);
+    }
     s->transit= transit;
-    d= FFABS(transit - s->transit);
-    s->jitter += d - ((s->jitter + 8)>>4);
 }
-#endif
+
+/** clock rate of the RTP timestamps of a stream */
+static int rtp_clock_rate(RTPDemuxContext *s)
+{
+    if (s->st && s->st->time_base.num == 1)
+        return s->st->time_base.den;
+    return 90000;
+}
+
+void ff_rtp_get_network_stats(RTPDemuxContext *s, AVStreamNetworkStats *stats)
+{
+    RTPStatistics *rs = &s->statistics;
+    int clock_rate = rtp_clock_rate(s);
+    uint32_t extended_max = rs->cycles + rs->max_seq;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->packets_received  = rs->received;
+    stats->packets_expected  = rs->received ? extended_max - rs->base_seq + 1 : 0;
+    stats->packets_lost      = stats->packets_expected - stats->packets_received;
+    stats->packets_reordered = s->reordered;
+    stats->packets_late      = s->late;
+    stats->jitter            = av_rescale(rs->jitter >> 4, 1000000, clock_rate);
+    stats->clock_rate        = clock_rate;
+    if (s->last_rtcp_ntp_time != AV_NOPTS_VALUE) {
+        stats->sr_ntp_time      = s->last_rtcp_ntp_time;
+        stats->sr_rtp_timestamp = s->last_rtcp_timestamp;
+        stats->sr_local_time    = s->last_rtcp_reception_time;
+    }
+}
 
 int rtp_check_and_send_back_rr(RTPDemuxContext *s, int count)
 {
@@ -313,6 +344,11 @@ RTPDemuxContext *rtp_parse_open(AVFormatContext *s1, AVStream *st, URLContext *r
     }
     // needed to send back RTCP RR in RTSP sessions
     s->rtp_ctx = rtpc;
+    /* only packets received over UDP come out of sequence */
+    if (rtpc) {
+        s->queue_size  = s1->reorder_queue_size;
+        s->queue_delay = s1->reorder_delay;
+    }
     gethostname(s->hostname, sizeof(s->hostname));
     return s;
 }
@@ -390,80 +426,75 @@ static void finalize_packet(RTPDemuxContext *s, AVPacket *pkt, uint32_t timestam
     }
 }
 
+static int has_next_packet(RTPDemuxContext *s)
+{
+    return s->queue && s->seq_valid && s->queue->seq == (uint16_t)(s->seq + 1);
+}
+
 /**
- * Parse an RTP or RTCP packet directly sent as a buffer.
- * @param s RTP parse context.
- * @param pkt returned packet
- * @param buf input buffer or NULL to read the next packets
- * @param len buffer len
- * @return 0 if a packet is returned, 1 if a packet is returned and more can follow
- * (use buf as NULL to read the next). -1 if no packet (error or no more packet).
+ * Inserts a copy of a packet received out of sequence in the reordering
+ * queue, in the order of the sequence numbers.
  */
-int rtp_parse_packet(RTPDemuxContext *s, AVPacket *pkt,
-                     const uint8_t *buf, int len)
+static int enqueue_packet(RTPDemuxContext *s, const uint8_t *buf, int len, uint16_t seq)
 {
-    unsigned int ssrc, h;
-    int payload_type, seq, ret, flags = 0;
-    AVStream *st;
-    uint32_t timestamp;
-    int rv= 0;
+    RTPPacket **cur = &s->queue, *packet;
 
-    if (!buf) {
-        /* return the next packets, if any */
-        if(s->st && s->parse_packet) {
-            timestamp= 0; ///< Should not be used if buf is NULL, but should be set to the timestamp of the packet returned....
-            rv= s->parse_packet(s->ic, s->dynamic_protocol_context,
-                                s->st, pkt, &timestamp, NULL, 0, flags);
-            finalize_packet(s, pkt, timestamp);
-            return rv;
-        } else {
-            // TODO: Move to a dynamic packet handler (like above)
-            if (s->read_buf_index >= s->read_buf_size)
-                return -1;
-            ret = mpegts_parse_packet(s->ts, pkt, s->buf + s->read_buf_index,
-                                      s->read_buf_size - s->read_buf_index);
-            if (ret < 0)
-                return -1;
-            s->read_buf_index += ret;
-            if (s->read_buf_index < s->read_buf_size)
-                return 1;
-            else
-                return 0;
+    while (*cur) {
+        int16_t diff = seq - (*cur)->seq;
+        if (diff < 0)
+            break;
+        if (!diff) {
+            s->late++;
+            return -1;
         }
+        cur = &(*cur)->next;
+    }
+    /* a later packet is already waiting, so this one got overtaken */
+    if (*cur)
+        s->reordered++;
+
+    packet = av_mallocz(sizeof(RTPPacket));
+    if (!packet)
+        return AVERROR(ENOMEM);
+    packet->buf = av_malloc(len);
+    if (!packet->buf) {
+        av_free(packet);
+        return AVERROR(ENOMEM);
     }
+    memcpy(packet->buf, buf, len);
+    packet->len      = len;
+    packet->seq      = seq;
+    packet->recvtime = av_gettime();
+    packet->next     = *cur;
+    *cur = packet;
+    s->queue_len++;
+    return 0;
+}
 
-    if (len < 12)
-        return -1;
+int64_t ff_rtp_queued_packet_time(RTPDemuxContext *s)
+{
+    return s->queue ? s->queue->recvtime : 0;
+}
+
+/**
+ * Parses the payload of an RTP packet whose header has been checked.
+ */
+static int rtp_parse_one_packet(RTPDemuxContext *s, AVPacket *pkt,
+                                const uint8_t *buf, int len)
+{
+    unsigned int h;
+    int seq, ret, flags = 0;
+    AVStream *st = s->st;
+    uint32_t timestamp;
+    int rv= 0;
 
-    if ((buf[0] & 0xc0) != (RTP_VERSION << 6))
-        return -1;
-    if (buf[1] >= 200 && buf[1] <= 204) {
-        rtcp_parse_packet(s, buf, len);
-        return -1;
-    }
-    payload_type = buf[1] & 0x7f;
     if (buf[1] & 0x80)
         flags |= RTP_FLAG_MARKER;
     seq  = AV_RB16(buf + 2);
     timestamp = AV_RB32(buf + 4);
-    ssrc = AV_RB32(buf + 8);
-    /* store the ssrc in the RTPDemuxContext */
-    s->ssrc = ssrc;
-
-    /* NOTE: we can handle only one payload type */
-    if (s->payload_type != payload_type)
-        return -1;
-
-    st = s->st;
-    // only do something with this if all the rtp checks pass...
-    if(!rtp_valid_packet_in_sequence(&s->statistics, seq))
-    {
-        av_log(st?st->codec:NULL, AV_LOG_ERROR, "RTP: PT=%02x: bad cseq %04x expected=%04x\n",
-               payload_type, seq, ((s->seq + 1) & 0xffff));
-        return -1;
-    }
 
     s->seq = seq;
+    s->seq_valid = 1;
     len -= 12;
     buf += 12;
 
@@ -552,8 +583,159 @@ int rtp_parse_packet(RTPDemuxContext *s, AVPacket *pkt,
     return rv;
 }
 
+
+static int rtp_parse_queued_packet(RTPDemuxContext *s, AVPacket *pkt);
+
+/**
+ * Remembers whether the payload parser has more packets for the caller,
+ * and makes the caller come back for packets of the reordering queue that
+ * are now in sequence.
+ */
+static int rtp_parse_return(RTPDemuxContext *s, AVPacket *pkt, int rv)
+{
+    s->prev_ret = rv;
+    if (has_next_packet(s)) {
+        if (rv < 0)
+            return rtp_parse_queued_packet(s, pkt);
+        return 1;
+    }
+    return rv;
+}
+
+/**
+ * Parses the first packet of the reordering queue, giving up on the
+ * packets before it if they have not been received.
+ */
+static int rtp_parse_queued_packet(RTPDemuxContext *s, AVPacket *pkt)
+{
+    RTPPacket *packet = s->queue;
+    int rv;
+
+    if (!packet)
+        return -1;
+    if (s->seq_valid && packet->seq != (uint16_t)(s->seq + 1)) {
+        uint16_t missed = packet->seq - s->seq - 1;
+        av_log(s->st ? s->st->codec : NULL, AV_LOG_WARNING,
+               "RTP: missed %d packets\n", missed);
+        s->skipped += missed;
+    }
+    s->queue = packet->next;
+    s->queue_len--;
+    rv = rtp_parse_one_packet(s, pkt, packet->buf, packet->len);
+    av_free(packet->buf);
+    av_free(packet);
+    return rtp_parse_return(s, pkt, rv);
+}
+
+/**
+ * Parse an RTP or RTCP packet directly sent as a buffer.
+ * Packets received out of sequence are held back until the packets before
+ * them arrive, the queue is full or they have waited for too long.
+ * @param s RTP parse context.
+ * @param pkt returned packet
+ * @param buf input buffer or NULL to read the next packets; if the last
+ * packet had no more, the first held back packet is released, whether the
+ * packets before it have been received or not
+ * @param len buffer len
+ * @return 0 if a packet is returned, 1 if a packet is returned and more can follow
+ * (use buf as NULL to read the next). -1 if no packet (error or no more packet).
+ */
+int rtp_parse_packet(RTPDemuxContext *s, AVPacket *pkt,
+                     const uint8_t *buf, int len)
+{
+    unsigned int ssrc;
+    int payload_type, seq, ret;
+    AVStream *st;
+    uint32_t timestamp;
+    int64_t arrival;
+    int rv= 0;
+
+    if (!buf) {
+        if (s->prev_ret != 1)
+            return rtp_parse_queued_packet(s, pkt);
+        /* return the next packets, if any */
+        if(s->st && s->parse_packet) {
+            timestamp= 0; ///< Should not be used if buf is NULL, but should be set to the timestamp of the packet returned....
+            rv= s->parse_packet(s->ic, s->dynamic_protocol_context,
+                                s->st, pkt, &timestamp, NULL, 0, 0);
+            finalize_packet(s, pkt, timestamp);
+            return rtp_parse_return(s, pkt, rv);
+        } else {
+            // TODO: Move to a dynamic packet handler (like above)
+            if (s->read_buf_index >= s->read_buf_size)
+                return rtp_parse_return(s, pkt, -1);
+            ret = mpegts_parse_packet(s->ts, pkt, s->buf + s->read_buf_index,
+                                      s->read_buf_size - s->read_buf_index);
+            if (ret < 0)
+                return rtp_parse_return(s, pkt, -1);
+            s->read_buf_index += ret;
+            return rtp_parse_return(s, pkt, s->read_buf_index < s->read_buf_size);
+        }
+    }
+
+    if (len < 12)
+        return -1;
+
+    if ((buf[0] & 0xc0) != (RTP_VERSION << 6))
+        return -1;
+    if (buf[1] >= 200 && buf[1] <= 204) {
+        rtcp_parse_packet(s, buf, len);
+        return -1;
+    }
+    payload_type = buf[1] & 0x7f;
+    seq  = AV_RB16(buf + 2);
+    ssrc = AV_RB32(buf + 8);
+    /* store the ssrc in the RTPDemuxContext */
+    s->ssrc = ssrc;
+
+    /* NOTE: we can handle only one payload type */
+    if (s->payload_type != payload_type)
+        return -1;
+
+    st = s->st;
+    // only do something with this if all the rtp checks pass...
+    if(!rtp_valid_packet_in_sequence(&s->statistics, seq))
+    {
+        av_log(st?st->codec:NULL, AV_LOG_ERROR, "RTP: PT=%02x: bad cseq %04x expected=%04x\n",
+               payload_type, seq, ((s->seq + 1) & 0xffff));
+        return -1;
+    }
+    arrival = av_gettime();
+    rtcp_update_jitter(&s->statistics, AV_RB32(buf + 4),
+                       av_rescale(arrival, rtp_clock_rate(s), 1000000));
+    /* the timestamps are sampled at the source, before the jitter buffer */
+    if (st && (s->ic->flags & AVFMT_FLAG_CLOCK_RECOVERY))
+        ff_clock_recovery_update(s->ic, -1, st->index, AV_RB32(buf + 4),
+                                 (AVRational){1, rtp_clock_rate(s)}, 1LL << 32, arrival);
+
+    if (!s->queue_size || !s->seq_valid ||
+        (!s->queue && seq == (uint16_t)(s->seq + 1)))
+        return rtp_parse_return(s, pkt, rtp_parse_one_packet(s, pkt, buf, len));
+
+    if ((int16_t)(seq - s->seq) <= 0) {
+        s->late++;
+        return -1;
+    }
+    if (enqueue_packet(s, buf, len, seq) < 0)
+        return -1;
+    if (has_next_packet(s) || s->queue_len > s->queue_size ||
+        (s->queue_delay && av_gettime() - s->queue->recvtime >= s->queue_delay))
+        return rtp_parse_queued_packet(s, pkt);
+    return -1;
+}
+
 void rtp_parse_close(RTPDemuxContext *s)
 {
+    while (s->queue) {
+        RTPPacket *next = s->queue->next;
+        av_free(s->queue->buf);
+        av_free(s->queue);
+        s->queue = next;
+    }
+    if (s->reordered || s->late || s->skipped)
+        av_log(s->ic, AV_LOG_VERBOSE,
+               "RTP: PT=%02x: %u packets reordered, %u dropped as late, %u lost\n",
+               s->payload_type, s->reordered, s->late, s->skipped);
     // TODO: fold this into the protocol specific data fields.
     if (!strcmp(ff_rtp_enc_name(s->payload_type), "MP2T")) {
         mpegts_parse_close(s->ts);
@@ -67,8 +67,20 @@ int rtp_parse_packet(RTPDemuxContext *s, AVPacket *pkt,
                      const uint8_t *buf, int len);
 void rtp_parse_close(RTPDemuxContext *s);
 
+/**
+ * Returns the time the oldest packet held back by the reordering queue
+ * was received at, or 0 if no packet is held back.
+ */
+int64_t ff_rtp_queued_packet_time(RTPDemuxContext *s);
+
+/**
+ * Fills stats with the reception statistics of an RTP stream.
+ */
+void ff_rtp_get_network_stats(RTPDemuxContext *s, AVStreamNetworkStats *stats);
+
 int rtp_get_local_port(URLContext *h);
 int rtp_set_remote_url(URLContext *h, const char *uri);
+int ff_rtp_buffered_packets(URLContext *h);
 #if (LIBAVFORMAT_VERSION_MAJOR <= 52)
 void rtp_get_file_handles(URLContext *h, int *prtp_fd, int *prtcp_fd);
 #endif
@@ -94,6 +106,15 @@ typedef struct {
     uint32_t jitter;            ///< estimated jitter.
 } RTPStatistics;
 
+/** packet held back by the reordering queue until the ones before it arrive */
+typedef struct RTPPacket {
+    uint16_t seq;
+    uint8_t *buf;
+    int len;
+    int64_t recvtime;           ///< av_gettime() when the packet was received
+    struct RTPPacket *next;
+} RTPPacket;
+
 #define RTP_FLAG_KEY    0x1 ///< RTP packet contains a keyframe
 #define RTP_FLAG_MARKER 0x2 ///< RTP marker bit was set for this packet
 /**
@@ -175,6 +196,19 @@ struct RTPDemuxContext {
     DynamicPayloadPacketHandlerProc parse_packet;     ///< This is also copied from the dynamic protocol handler structure
     PayloadContext *dynamic_protocol_context;        ///< This is a copy from the values setup from the sdp parsing, in rtsp.c don't free me.
     int max_frames_per_packet;
+
+    /* reordering of packets received out of sequence */
+    RTPPacket *queue;           ///< packets held back, sorted by sequence number
+    int queue_len;              ///< number of packets in the queue
+    int queue_size;             ///< max number of packets held back, 0 to parse them as they arrive
+    int64_t queue_delay;        ///< max time a packet is held back, in AV_TIME_BASE units
+    int seq_valid;              ///< seq holds the sequence number of the last parsed packet
+    int prev_ret;               ///< last return value of the payload parser, 1 if it has more packets
+    unsigned int reordered;     ///< packets received out of sequence and put back in order
+    unsigned int late;          ///< duplicate packets and packets received after their turn, dropped
+    unsigned int skipped;       ///< packets never received that parsing went on without
+
+    int64_t last_rtcp_reception_time; ///< av_gettime() when the last sender report arrived
 };
 
 extern RTPDynamicProtocolHandler *RTPFirstDynamicPayloadHandler;
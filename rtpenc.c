@@ -103,13 +103,13 @@ static int rtp_write_header(AVFormatContext *s1)
     s->max_payload_size = max_packet_size - 12;
 
     s->max_frames_per_packet = 0;
+    s->max_delay = 0;
     if (s1->max_delay) {
         if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
-            if (st->codec->frame_size == 0) {
-                av_log(s1, AV_LOG_ERROR, "Cannot respect max delay: frame size = 0\n");
-            } else {
+            /* the aggregating packetizers also check the timestamps */
+            s->max_delay = av_rescale(s1->max_delay, st->codec->sample_rate, AV_TIME_BASE);
+            if (st->codec->frame_size)
                 s->max_frames_per_packet = av_rescale_rnd(s1->max_delay, st->codec->sample_rate, AV_TIME_BASE * st->codec->frame_size, AV_ROUND_DOWN);
-            }
         }
         if (st->codec->codec_type == CODEC_TYPE_VIDEO) {
             /* FIXME: We should round down here... */
@@ -135,14 +135,16 @@ static int rtp_write_header(AVFormatContext *s1)
         break;
     case CODEC_ID_AMR_NB:
     case CODEC_ID_AMR_WB:
+        /* with a delay bound, as many frames as the MTU allows */
         if (!s->max_frames_per_packet)
-            s->max_frames_per_packet = 12;
+            s->max_frames_per_packet = s->max_delay ? s->max_payload_size / 2 : 12;
         if (st->codec->codec_id == CODEC_ID_AMR_NB)
             n = 31;
         else
             n = 61;
         /* max_header_toc_size + the largest AMR payload must fit */
-        if (1 + s->max_frames_per_packet + n > s->max_payload_size) {
+        s->max_frames_per_packet = FFMIN(s->max_frames_per_packet, s->max_payload_size - 1 - n);
+        if (s->max_frames_per_packet < 1) {
             av_log(s1, AV_LOG_ERROR, "RTP max payload size too small for AMR\n");
             return -1;
         }
@@ -150,7 +152,20 @@ static int rtp_write_header(AVFormatContext *s1)
             av_log(s1, AV_LOG_ERROR, "Only mono is supported\n");
             return -1;
         }
+        /* room for the TOC reserved in front of the frames */
+        n = 1 + s->max_frames_per_packet;
+        goto aggregate;
     case CODEC_ID_AAC:
+        /* each AU takes at least 3 bytes with its header */
+        if (!s->max_frames_per_packet)
+            s->max_frames_per_packet = s->max_delay ? (s->max_payload_size - 2) / 3 : 5;
+        s->max_frames_per_packet = FFMIN(s->max_frames_per_packet, (s->max_payload_size - 2) / 3);
+        /* room for the AU headers reserved in front of the frames */
+        n = 2 + 2 * s->max_frames_per_packet;
+    aggregate:
+        av_free(s->buf);
+        if (!(s->buf = av_malloc(max_packet_size + n)))
+            return AVERROR(ENOMEM);
         s->num_frames = 0;
     default:
         if (st->codec->codec_type == CODEC_TYPE_AUDIO) {
@@ -210,6 +225,13 @@ void ff_rtp_send_data(AVFormatContext *s1, const uint8_t *buf1, int len, int m)
     s->packet_count++;
 }
 
+int ff_rtp_aggregation_done(RTPMuxContext *s)
+{
+    /* the packet would last from s->timestamp to the end of the next frame */
+    return s->max_delay &&
+           s->cur_timestamp - s->timestamp + 2 * s->cur_duration > s->max_delay;
+}
+
 /* send an integer number of samples and compute time stamp and fill
    the rtp send buffer before sending. */
 static void rtp_send_samples(AVFormatContext *s1,
@@ -339,7 +361,7 @@ static int rtp_write_packet(AVFormatContext *s1, AVPacket *pkt)
 {
     RTPMuxContext *s = s1->priv_data;
     AVStream *st = s1->streams[0];
-    int rtcp_bytes;
+    int rtcp_bytes, batch;
     int size= pkt->size;
 
     dprintf(s1, "%d: write len=%d\n", pkt->stream_index, size);
@@ -353,6 +375,10 @@ static int rtp_write_packet(AVFormatContext *s1, AVPacket *pkt)
         s->first_packet = 0;
     }
     s->cur_timestamp = s->base_timestamp + pkt->pts;
+    s->cur_duration  = pkt->duration > 0 ? pkt->duration : st->codec->frame_size;
+
+    /* send all the RTP packets of the frame at once */
+    batch = !ff_rtp_start_batch(url_fileno(s1->pb));
 
     switch(st->codec->codec_id) {
     case CODEC_ID_PCM_MULAW:
@@ -397,6 +423,18 @@ static int rtp_write_packet(AVFormatContext *s1, AVPacket *pkt)
         rtp_send_raw(s1, pkt->data, size);
         break;
     }
+
+    if (batch) {
+        int64_t duration = 0;
+
+        if (s1->flags & AVFMT_FLAG_PACING) {
+            if (pkt->duration > 0)
+                duration = av_rescale_q(pkt->duration, st->time_base, AV_TIME_BASE_Q);
+            else if (st->codec->codec_type == CODEC_TYPE_VIDEO)
+                duration = av_rescale_q(1, st->codec->time_base, AV_TIME_BASE_Q);
+        }
+        ff_rtp_end_batch(url_fileno(s1->pb), duration);
+    }
     return 0;
 }
 
@@ -404,11 +442,35 @@ static int rtp_write_trailer(AVFormatContext *s1)
 {
     RTPMuxContext *s = s1->priv_data;
 
+    /* send the frames still waiting for more */
+    switch (s1->streams[0]->codec->codec_id) {
+    case CODEC_ID_AAC:
+        ff_rtp_flush_aac(s1);
+        break;
+    case CODEC_ID_AMR_NB:
+    case CODEC_ID_AMR_WB:
+        ff_rtp_flush_amr(s1);
+        break;
+    }
     av_freep(&s->buf);
 
     return 0;
 }
 
+int av_rtp_add_destination(AVFormatContext *s1, const char *uri)
+{
+    if (!s1->oformat || strcmp(s1->oformat->name, "rtp") || !s1->pb)
+        return AVERROR(EINVAL);
+    return ff_rtp_add_destination(url_fileno(s1->pb), uri);
+}
+
+int av_rtp_remove_destination(AVFormatContext *s1, int id)
+{
+    if (!s1->oformat || strcmp(s1->oformat->name, "rtp") || !s1->pb)
+        return AVERROR(EINVAL);
+    return ff_rtp_remove_destination(url_fileno(s1->pb), id);
+}
+
 AVOutputFormat rtp_muxer = {
     "rtp",
     NULL_IF_CONFIG_SMALL("RTP output format"),
@@ -50,16 +50,33 @@ struct RTPMuxContext {
     uint8_t *buf_ptr;
 
     int max_frames_per_packet;
+    uint32_t max_delay;    ///< AVFormatContext.max_delay in timestamp units, 0 if not set
+    uint32_t cur_duration; ///< duration of the frame being sent, 0 if unknown
 };
 
 typedef struct RTPMuxContext RTPMuxContext;
 
 void ff_rtp_send_data(AVFormatContext *s1, const uint8_t *buf1, int len, int m);
 
+/**
+ * @return nonzero if the packet aggregating frames since s->timestamp
+ *         must be sent with the current frame, as the next frame would
+ *         take it past s->max_delay
+ */
+int ff_rtp_aggregation_done(RTPMuxContext *s);
+
+/* rtpproto.c */
+int ff_rtp_start_batch(URLContext *h);
+int ff_rtp_end_batch(URLContext *h, int64_t duration);
+int ff_rtp_add_destination(URLContext *h, const char *uri);
+int ff_rtp_remove_destination(URLContext *h, int id);
+
 void ff_rtp_send_h264(AVFormatContext *s1, const uint8_t *buf1, int size);
 void ff_rtp_send_h263(AVFormatContext *s1, const uint8_t *buf1, int size);
 void ff_rtp_send_aac(AVFormatContext *s1, const uint8_t *buff, int size);
+void ff_rtp_flush_aac(AVFormatContext *s1);
 void ff_rtp_send_amr(AVFormatContext *s1, const uint8_t *buff, int size);
+void ff_rtp_flush_amr(AVFormatContext *s1);
 void ff_rtp_send_mpegvideo(AVFormatContext *s1, const uint8_t *buf1, int size);
 
 #endif /* AVFORMAT_RTPENC_H */
@@ -22,38 +22,54 @@
 #include "rtpenc.h"
 
 
+/**
+ * Send the AUs aggregated so far, if any.
+ */
+void ff_rtp_flush_aac(AVFormatContext *s1)
+{
+    RTPMuxContext *s = s1->priv_data;
+    const int max_au_headers_size = 2 + 2 * s->max_frames_per_packet;
+    int au_size = s->num_frames * 2;
+    uint8_t *p;
+
+    if (!s->num_frames)
+        return;
+    p = s->buf + max_au_headers_size - au_size - 2;
+    if (p != s->buf) {
+        memmove(p + 2, s->buf + 2, au_size);
+    }
+    /* Write the AU header size */
+    p[0] = (au_size * 8) >> 8;
+    p[1] = (au_size * 8) & 0xFF;
+
+    ff_rtp_send_data(s1, p, s->buf_ptr - p, 1);
+
+    s->num_frames = 0;
+}
+
+/**
+ * Aggregate AUs into packets of up to s->max_frames_per_packet AUs, s->max_delay
+ * of audio and the MTU, the AU headers being reserved in front of s->buf.
+ */
 void ff_rtp_send_aac(AVFormatContext *s1, const uint8_t *buff, int size)
 {
     RTPMuxContext *s = s1->priv_data;
     int len, max_packet_size;
     uint8_t *p;
-    const int max_frames_per_packet = s->max_frames_per_packet ? s->max_frames_per_packet : 5;
-    const int max_au_headers_size = 2 + 2 * max_frames_per_packet;
+    const int max_au_headers_size = 2 + 2 * s->max_frames_per_packet;
 
     /* skip ADTS header, if present */
     if ((s1->streams[0]->codec->extradata_size) == 0) {
         size -= 7;
         buff += 7;
     }
-    max_packet_size = s->max_payload_size - max_au_headers_size;
-
-    /* test if the packet must be sent */
-    len = (s->buf_ptr - s->buf);
-    if ((s->num_frames == max_frames_per_packet) || (len && (len + size) > s->max_payload_size)) {
-        int au_size = s->num_frames * 2;
+    /* largest AU sent whole, alone with its header */
+    max_packet_size = s->max_payload_size - 4;
 
-        p = s->buf + max_au_headers_size - au_size - 2;
-        if (p != s->buf) {
-            memmove(p + 2, s->buf + 2, au_size);
-        }
-        /* Write the AU header size */
-        p[0] = ((au_size * 8) & 0xFF) >> 8;
-        p[1] = (au_size * 8) & 0xFF;
-
-        ff_rtp_send_data(s1, p, s->buf_ptr - p, 1);
-
-        s->num_frames = 0;
-    }
+    /* test if the packet must be sent: AU headers length, AU headers and AUs */
+    len = s->buf_ptr - s->buf - max_au_headers_size;
+    if (s->num_frames && 2 + 2 * (s->num_frames + 1) + len + size > s->max_payload_size)
+        ff_rtp_flush_aac(s1);
     if (s->num_frames == 0) {
         s->buf_ptr = s->buf + max_au_headers_size;
         s->timestamp = s->cur_timestamp;
@@ -65,6 +81,8 @@ void ff_rtp_send_aac(AVFormatContext *s1, const uint8_t *buff, int size)
         *p = (size & 0x1F) << 3;
         memcpy(s->buf_ptr, buff, size);
         s->buf_ptr += size;
+        if (s->num_frames == s->max_frames_per_packet || ff_rtp_aggregation_done(s))
+            ff_rtp_flush_aac(s1);
     } else {
         int au_size = size;
 
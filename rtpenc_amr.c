@@ -24,28 +24,41 @@
 #include "rtpenc.h"
 
 /**
- * Packetize AMR frames into RTP packets according to RFC 3267,
- * in octet-aligned mode.
+ * Send the frames aggregated so far, if any.
  */
-void ff_rtp_send_amr(AVFormatContext *s1, const uint8_t *buff, int size)
+void ff_rtp_flush_amr(AVFormatContext *s1)
 {
     RTPMuxContext *s          = s1->priv_data;
     int max_header_toc_size   = 1 + s->max_frames_per_packet;
+    int header_size           = s->num_frames + 1;
     uint8_t *p;
-    int len;
 
-    /* Test if the packet must be sent. */
-    len = s->buf_ptr - s->buf;
-    if (s->num_frames == s->max_frames_per_packet || (len && len + size - 1 > s->max_payload_size)) {
-        int header_size = s->num_frames + 1;
-        p = s->buf + max_header_toc_size - header_size;
-        if (p != s->buf)
-            memmove(p, s->buf, header_size);
+    if (!s->num_frames)
+        return;
+    p = s->buf + max_header_toc_size - header_size;
+    if (p != s->buf)
+        memmove(p, s->buf, header_size);
 
-        ff_rtp_send_data(s1, p, s->buf_ptr - p, 1);
+    ff_rtp_send_data(s1, p, s->buf_ptr - p, 1);
 
-        s->num_frames = 0;
-    }
+    s->num_frames = 0;
+}
+
+/**
+ * Packetize AMR frames into RTP packets according to RFC 3267,
+ * in octet-aligned mode. Up to s->max_frames_per_packet frames, s->max_delay
+ * of audio and the MTU are aggregated in a packet.
+ */
+void ff_rtp_send_amr(AVFormatContext *s1, const uint8_t *buff, int size)
+{
+    RTPMuxContext *s          = s1->priv_data;
+    int max_header_toc_size   = 1 + s->max_frames_per_packet;
+    int len;
+
+    /* Test if the packet must be sent: CMR, TOC entries and frames. */
+    len = s->buf_ptr - s->buf - max_header_toc_size;
+    if (s->num_frames && 1 + s->num_frames + 1 + len + size - 1 > s->max_payload_size)
+        ff_rtp_flush_amr(s1);
 
     if (!s->num_frames) {
         s->buf[0]    = 0xf0;
@@ -62,5 +75,8 @@ void ff_rtp_send_amr(AVFormatContext *s1, const uint8_t *buff, int size)
     size--;
     memcpy(s->buf_ptr, buff, size);
     s->buf_ptr += size;
+
+    if (s->num_frames == s->max_frames_per_packet || ff_rtp_aggregation_done(s))
+        ff_rtp_flush_amr(s1);
 }
 
@@ -24,8 +24,14 @@
  * RTP protocol
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* Needed for recvmmsg() and sendmmsg() */
+#endif
 #include "libavutil/avstring.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/random_seed.h"
 #include "avformat.h"
+#include "rtpenc.h"
 
 #include <unistd.h>
 #include <stdarg.h>
@@ -35,13 +41,48 @@
 #if HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #define RTP_TX_BUF_SIZE  (64 * 1024)
 #define RTP_RX_BUF_SIZE  (128 * 1024)
+/** maximum number of RTP packets fetched by a single system call */
+#define RTP_RECV_BATCH   16
+/** maximum number of fan-out datagrams passed to a single system call */
+#define RTP_FANOUT_BATCH 64
+
+/**
+ * Additional receiver of an RTP output, getting the same packets with its
+ * own SSRC and sequence numbers.
+ */
+typedef struct RTPDestination {
+    int id;
+    struct sockaddr_storage rtp_addr, rtcp_addr;
+    int addr_len;
+    uint32_t ssrc;
+    uint16_t seq_offset;
+} RTPDestination;
 
 typedef struct RTPContext {
     URLContext *rtp_hd, *rtcp_hd;
     int rtp_fd, rtcp_fd;
+
+    /* RTP packets fetched at once, returned by the following reads */
+    uint8_t *recv_buf;
+    int recv_count, recv_index;
+#if HAVE_RECVMMSG
+    struct mmsghdr msgs[RTP_RECV_BATCH];
+    struct iovec iov[RTP_RECV_BATCH];
+#endif
+
+    /* fan-out to the receivers added with ff_rtp_add_destination() */
+    RTPDestination *dests;
+    int nb_dests;
+    int next_dest_id;
+#if HAVE_PTHREADS
+    pthread_mutex_t dest_mutex;
+#endif
 } RTPContext;
 
 /**
@@ -155,7 +196,7 @@ static int rtp_open(URLContext *h, const char *uri, int flags)
 
     build_udp_url(buf, sizeof(buf),
                   hostname, port, local_port, ttl, max_packet_size);
-    if (url_open(&s->rtp_hd, buf, flags) < 0)
+    if (url_open_interrupt(&s->rtp_hd, buf, flags, h->interrupt) < 0)
         goto fail;
     local_port = udp_get_local_port(s->rtp_hd);
     /* XXX: need to open another connection if the port is not even */
@@ -164,7 +205,7 @@ static int rtp_open(URLContext *h, const char *uri, int flags)
 
     build_udp_url(buf, sizeof(buf),
                   hostname, port + 1, local_port + 1, ttl, max_packet_size);
-    if (url_open(&s->rtcp_hd, buf, flags) < 0)
+    if (url_open_interrupt(&s->rtcp_hd, buf, flags, h->interrupt) < 0)
         goto fail;
 
     /* just to ease handle access. XXX: need to suppress direct handle
@@ -174,6 +215,9 @@ static int rtp_open(URLContext *h, const char *uri, int flags)
 
     h->max_packet_size = url_get_max_packet_size(s->rtp_hd);
     h->is_streamed = 1;
+#if HAVE_PTHREADS
+    pthread_mutex_init(&s->dest_mutex, NULL);
+#endif
     return 0;
 
  fail:
@@ -185,13 +229,52 @@ static int rtp_open(URLContext *h, const char *uri, int flags)
     return AVERROR(EIO);
 }
 
+#if HAVE_RECVMMSG
+/**
+ * Fetches all RTP packets waiting on the socket, up to RTP_RECV_BATCH.
+ * @return number of packets fetched, negative errno value on error
+ */
+static int rtp_recv_batch(URLContext *h)
+{
+    RTPContext *s = h->priv_data;
+    int i, n;
+
+    if (!s->recv_buf) {
+        s->recv_buf = av_malloc(RTP_RECV_BATCH * h->max_packet_size);
+        if (!s->recv_buf)
+            return AVERROR(ENOMEM);
+        for (i = 0; i < RTP_RECV_BATCH; i++) {
+            s->iov[i].iov_base = s->recv_buf + i * h->max_packet_size;
+            s->iov[i].iov_len  = h->max_packet_size;
+            s->msgs[i].msg_hdr.msg_iov    = &s->iov[i];
+            s->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+    n = recvmmsg(s->rtp_fd, s->msgs, RTP_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0)
+        return AVERROR(ff_neterrno());
+    s->recv_count = n;
+    s->recv_index = 0;
+    return n;
+}
+#endif
+
 static int rtp_read(URLContext *h, uint8_t *buf, int size)
 {
     RTPContext *s = h->priv_data;
     struct sockaddr_in from;
     socklen_t from_len;
-    int len, fd_max, n;
-    fd_set rfds;
+    int len, n;
+    struct pollfd p[3];
+
+#if HAVE_RECVMMSG
+    if (s->recv_index < s->recv_count) {
+        int i = s->recv_index++;
+        len = FFMIN(s->msgs[i].msg_len, size);
+        memcpy(buf, s->iov[i].iov_base, len);
+        return len;
+    }
+#endif
 #if 0
     for(;;) {
         from_len = sizeof(from);
@@ -207,17 +290,17 @@ static int rtp_read(URLContext *h, uint8_t *buf, int size)
     }
 #else
     for(;;) {
-        /* build fdset to listen to RTP and RTCP packets */
-        FD_ZERO(&rfds);
-        fd_max = s->rtp_fd;
-        FD_SET(s->rtp_fd, &rfds);
-        if (s->rtcp_fd > fd_max)
-            fd_max = s->rtcp_fd;
-        FD_SET(s->rtcp_fd, &rfds);
-        n = select(fd_max + 1, &rfds, NULL, NULL, NULL);
+        /* listen to RTP and RTCP packets */
+        p[0].fd     = s->rtp_fd;
+        p[0].events = POLLIN;
+        p[1].fd     = s->rtcp_fd;
+        p[1].events = POLLIN;
+        n = ff_network_poll(h->interrupt, p, 2, -1);
+        if (n < 0)
+            return n;
         if (n > 0) {
             /* first try RTCP */
-            if (FD_ISSET(s->rtcp_fd, &rfds)) {
+            if (p[1].revents & POLLIN) {
                 from_len = sizeof(from);
                 len = recvfrom (s->rtcp_fd, buf, size, 0,
                                 (struct sockaddr *)&from, &from_len);
@@ -230,7 +313,22 @@ static int rtp_read(URLContext *h, uint8_t *buf, int size)
                 break;
             }
             /* then RTP */
-            if (FD_ISSET(s->rtp_fd, &rfds)) {
+            if (p[0].revents & POLLIN) {
+#if HAVE_RECVMMSG
+                if (size >= h->max_packet_size) {
+                    n = rtp_recv_batch(h);
+                    if (n == AVERROR(EAGAIN) || n == AVERROR(EINTR))
+                        continue;
+                    if (n == AVERROR(ENOMEM))
+                        return n;
+                    if (n <= 0)
+                        return AVERROR(EIO);
+                    s->recv_index = 1;
+                    len = s->msgs[0].msg_len;
+                    memcpy(buf, s->recv_buf, len);
+                    break;
+                }
+#endif
                 from_len = sizeof(from);
                 len = recvfrom (s->rtp_fd, buf, size, 0,
                                 (struct sockaddr *)&from, &from_len);
@@ -248,13 +346,92 @@ static int rtp_read(URLContext *h, uint8_t *buf, int size)
     return len;
 }
 
+/**
+ * Send a packet to all the added destinations, rewriting the SSRC and the
+ * sequence number in a copy of its header. The payload is shared by all
+ * the datagrams.
+ */
+static int rtp_fanout(RTPContext *s, const uint8_t *buf, int size, int rtcp)
+{
+    uint8_t hdr[RTP_FANOUT_BATCH][12];
+    int hdr_size = rtcp ? 8 : 12;
+    int fd = rtcp ? s->rtcp_fd : s->rtp_fd;
+    int i, n;
+#if HAVE_SENDMMSG
+    struct mmsghdr msgs[RTP_FANOUT_BATCH];
+    struct iovec iov[RTP_FANOUT_BATCH][2];
+#else
+    uint8_t *tmp;
+#endif
+
+    if (size < hdr_size)
+        return 0;
+#if !HAVE_SENDMMSG
+    if (!(tmp = av_malloc(size)))
+        return AVERROR(ENOMEM);
+    memcpy(tmp, buf, size);
+#endif
+    for (i = 0; i < s->nb_dests; i += n) {
+        int j;
+
+        n = FFMIN(s->nb_dests - i, RTP_FANOUT_BATCH);
+        for (j = 0; j < n; j++) {
+            RTPDestination *d = &s->dests[i + j];
+
+            memcpy(hdr[j], buf, hdr_size);
+            if (rtcp) {
+                AV_WB32(hdr[j] + 4, d->ssrc);
+            } else {
+                AV_WB16(hdr[j] + 2, AV_RB16(buf + 2) + d->seq_offset);
+                AV_WB32(hdr[j] + 8, d->ssrc);
+            }
+#if HAVE_SENDMMSG
+            iov[j][0].iov_base = hdr[j];
+            iov[j][0].iov_len  = hdr_size;
+            iov[j][1].iov_base = (uint8_t *)buf + hdr_size;
+            iov[j][1].iov_len  = size - hdr_size;
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            msgs[j].msg_hdr.msg_name    = rtcp ? &d->rtcp_addr : &d->rtp_addr;
+            msgs[j].msg_hdr.msg_namelen = d->addr_len;
+            msgs[j].msg_hdr.msg_iov     = iov[j];
+            msgs[j].msg_hdr.msg_iovlen  = 2;
+#else
+            memcpy(tmp, hdr[j], hdr_size);
+            sendto(fd, tmp, size, 0,
+                   (struct sockaddr *)(rtcp ? &d->rtcp_addr : &d->rtp_addr),
+                   d->addr_len);
+#endif
+        }
+#if HAVE_SENDMMSG
+        j = 0;
+        while (j < n) {
+            int ret = sendmmsg(fd, msgs + j, n - j, 0);
+            if (ret < 0) {
+                if (ff_neterrno() != FF_NETERROR(EINTR) &&
+                    ff_neterrno() != FF_NETERROR(EAGAIN))
+                    /* skip the receiver we could not send to */
+                    ret = 1;
+                else
+                    continue;
+            }
+            j += ret;
+        }
+#endif
+    }
+#if !HAVE_SENDMMSG
+    av_free(tmp);
+#endif
+    return 0;
+}
+
 static int rtp_write(URLContext *h, uint8_t *buf, int size)
 {
     RTPContext *s = h->priv_data;
-    int ret;
+    int ret, rtcp;
     URLContext *hd;
 
-    if (buf[1] >= 200 && buf[1] <= 204) {
+    rtcp = buf[1] >= 200 && buf[1] <= 204;
+    if (rtcp) {
         /* RTCP payload type */
         hd = s->rtcp_hd;
     } else {
@@ -262,6 +439,15 @@ static int rtp_write(URLContext *h, uint8_t *buf, int size)
         hd = s->rtp_hd;
     }
 
+    if (s->nb_dests) {
+#if HAVE_PTHREADS
+        pthread_mutex_lock(&s->dest_mutex);
+#endif
+        rtp_fanout(s, buf, size, rtcp);
+#if HAVE_PTHREADS
+        pthread_mutex_unlock(&s->dest_mutex);
+#endif
+    }
     ret = url_write(hd, buf, size);
 #if 0
     {
@@ -280,6 +466,11 @@ static int rtp_close(URLContext *h)
 
     url_close(s->rtp_hd);
     url_close(s->rtcp_hd);
+    av_free(s->recv_buf);
+    av_free(s->dests);
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&s->dest_mutex);
+#endif
     av_free(s);
     return 0;
 }
@@ -296,6 +487,150 @@ int rtp_get_local_port(URLContext *h)
     return udp_get_local_port(s->rtp_hd);
 }
 
+/**
+ * Queue the RTP packets written to an rtp: or udp: output until
+ * ff_rtp_end_batch(), see ff_udp_start_batch().
+ * @return 0 on success, AVERROR(EINVAL) if h is neither
+ */
+
+int ff_rtp_start_batch(URLContext *h)
+{
+    RTPContext *s;
+
+    if (!h || strcmp(h->prot->name, "rtp"))
+        return ff_udp_start_batch(h);
+    s = h->priv_data;
+    return ff_udp_start_batch(s->rtp_hd);
+}
+
+/**
+ * Send the RTP packets queued since ff_rtp_start_batch(), see
+ * ff_udp_end_batch().
+ */
+
+int ff_rtp_end_batch(URLContext *h, int64_t duration)
+{
+    RTPContext *s;
+
+    if (!h || strcmp(h->prot->name, "rtp"))
+        return ff_udp_end_batch(h, duration);
+    s = h->priv_data;
+    return ff_udp_end_batch(s->rtp_hd, duration);
+}
+
+static int rtp_resolve(struct sockaddr_storage *addr, int family,
+                       const char *hostname, int port)
+{
+    struct addrinfo hints, *ai;
+    char sport[16];
+    int len;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(sport, sizeof(sport), "%d", port);
+    if (getaddrinfo(hostname, sport, &hints, &ai))
+        return AVERROR(EIO);
+    len = ai->ai_addrlen;
+    memcpy(addr, ai->ai_addr, len);
+    freeaddrinfo(ai);
+    return len;
+}
+
+/**
+ * Send the RTP and RTCP packets written to an rtp: output to another
+ * receiver as well, over the same sockets. The packets are built once for
+ * all receivers; each one gets its own SSRC and sequence numbers, rewritten
+ * in the header only. The added receivers are not paced or batched.
+ * This may be called while another thread writes to h.
+ * @param uri rtp://host:port of the receiver, RTCP goes to port + 1
+ * @return an id for ff_rtp_remove_destination(), or a negative value
+ */
+
+int ff_rtp_add_destination(URLContext *h, const char *uri)
+{
+    RTPContext *s;
+    RTPDestination d, *dests;
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    char hostname[256];
+    int port, len, ret;
+
+    if (!h || strcmp(h->prot->name, "rtp") || !(h->flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+    s = h->priv_data;
+
+    url_split(NULL, 0, NULL, 0, hostname, sizeof(hostname), &port, NULL, 0, uri);
+    if (port <= 0)
+        return AVERROR(EINVAL);
+    if (getsockname(s->rtp_fd, (struct sockaddr *)&local, &local_len) < 0)
+        return AVERROR(EIO);
+    memset(&d, 0, sizeof(d));
+    if ((len = rtp_resolve(&d.rtp_addr, local.ss_family, hostname, port)) < 0 ||
+        rtp_resolve(&d.rtcp_addr, local.ss_family, hostname, port + 1) != len)
+        return AVERROR(EIO);
+    d.addr_len   = len;
+    d.ssrc       = ff_random_get_seed();
+    d.seq_offset = ff_random_get_seed();
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&s->dest_mutex);
+#endif
+    dests = av_realloc(s->dests, (s->nb_dests + 1) * sizeof(*dests));
+    if (dests) {
+        d.id = ret = s->next_dest_id++;
+        s->dests = dests;
+        s->dests[s->nb_dests++] = d;
+    } else
+        ret = AVERROR(ENOMEM);
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&s->dest_mutex);
+#endif
+    return ret;
+}
+
+/**
+ * Stop sending to a receiver added with ff_rtp_add_destination().
+ * @return 0 on success, AVERROR(EINVAL) if there is no such receiver
+ */
+
+int ff_rtp_remove_destination(URLContext *h, int id)
+{
+    RTPContext *s;
+    int i, ret = AVERROR(EINVAL);
+
+    if (!h || strcmp(h->prot->name, "rtp"))
+        return AVERROR(EINVAL);
+    s = h->priv_data;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&s->dest_mutex);
+#endif
+    for (i = 0; i < s->nb_dests; i++) {
+        if (s->dests[i].id == id) {
+            s->dests[i] = s->dests[--s->nb_dests];
+            ret = 0;
+            break;
+        }
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&s->dest_mutex);
+#endif
+    return ret;
+}
+
+/**
+ * Return the number of RTP packets already fetched from the socket that
+ * rtp_read() has not returned yet. Their arrival is not signalled by the
+ * file handle any more, so they have to be read before waiting on it.
+ * @param h media file context
+ */
+
+int ff_rtp_buffered_packets(URLContext *h)
+{
+    RTPContext *s = h->priv_data;
+    return s->recv_count - s->recv_index;
+}
+
 #if (LIBAVFORMAT_VERSION_MAJOR <= 52)
 /**
  * Return the rtp and rtcp file handles for select() usage to wait for
@@ -33,6 +33,7 @@
 #endif
 #include <strings.h>
 #include "network.h"
+#include "os_support.h"
 #include "rtsp.h"
 
 #include "rtpdec.h"
@@ -802,6 +803,38 @@ void rtsp_parse_line(RTSPMessageHeader *reply, const char *buf)
     }
 }
 
+/**
+ * Read size bytes from the RTSP connection through its read buffer.
+ * Once the buffer is empty, reads of at least the buffer size go straight
+ * into buf.
+ * @return size, or less if the connection was closed or failed
+ */
+static int rtsp_read_complete(RTSPState *rt, uint8_t *buf, int size)
+{
+    int len = 0, ret;
+
+    while (len < size) {
+        int n = FFMIN(size - len, rt->recv_buf_len - rt->recv_buf_pos);
+
+        if (n > 0) {
+            memcpy(buf + len, rt->recv_buf + rt->recv_buf_pos, n);
+            rt->recv_buf_pos += n;
+            len += n;
+            continue;
+        }
+        if (size - len >= sizeof(rt->recv_buf)) {
+            ret = url_read_complete(rt->rtsp_hd, buf + len, size - len);
+            return ret > 0 ? len + ret : len;
+        }
+        ret = url_read(rt->rtsp_hd, rt->recv_buf, sizeof(rt->recv_buf));
+        if (ret <= 0)
+            break;
+        rt->recv_buf_pos = 0;
+        rt->recv_buf_len = ret;
+    }
+    return len;
+}
+
 /* skip a RTP/TCP interleaved packet */
 static void rtsp_skip_packet(AVFormatContext *s)
 {
@@ -809,7 +842,7 @@ static void rtsp_skip_packet(AVFormatContext *s)
     int ret, len, len1;
     uint8_t buf[1024];
 
-    ret = url_read_complete(rt->rtsp_hd, buf, 3);
+    ret = rtsp_read_complete(rt, buf, 3);
     if (ret != 3)
         return;
     len = AV_RB16(buf + 1);
@@ -821,7 +854,7 @@ static void rtsp_skip_packet(AVFormatContext *s)
         len1 = len;
         if (len1 > sizeof(buf))
             len1 = sizeof(buf);
-        ret = url_read_complete(rt->rtsp_hd, buf, len1);
+        ret = rtsp_read_complete(rt, buf, len1);
         if (ret != len1)
             return;
         len -= len1;
@@ -862,12 +895,12 @@ static int rtsp_read_reply(AVFormatContext *s, RTSPMessageHeader *reply,
 
     memset(reply, 0, sizeof(*reply));
 
-    /* parse reply (XXX: use buffers) */
+    /* parse reply */
     rt->last_reply[0] = '\0';
     for (;;) {
         q = buf;
         for (;;) {
-            ret = url_read_complete(rt->rtsp_hd, &ch, 1);
+            ret = rtsp_read_complete(rt, &ch, 1);
 #ifdef DEBUG_RTP_TCP
             dprintf(s, "ret=%d c=%02x [%c]\n", ret, ch, ch);
 #endif
@@ -914,7 +947,7 @@ static int rtsp_read_reply(AVFormatContext *s, RTSPMessageHeader *reply,
     if (content_length > 0) {
         /* leave some room for a trailing '\0' (useful for simple parsing) */
         content = av_malloc(content_length + 1);
-        (void)url_read_complete(rt->rtsp_hd, content, content_length);
+        (void)rtsp_read_complete(rt, content, content_length);
         content[content_length] = '\0';
     }
     if (content_ptr)
@@ -971,17 +1004,116 @@ static void rtsp_send_cmd(AVFormatContext *s,
 }
 
 /**
+ * Set up the transport of a stream from the reply to its SETUP request.
+ * @param i the number of the request in the session
+ * @returns 0 on success, <0 on error, 1 if protocol is unavailable.
+ */
+static int setup_stream(AVFormatContext *s, RTSPStream *rtsp_st,
+                        RTSPMessageHeader *reply, const char *host,
+                        int lower_transport, int i)
+{
+    RTSPState *rt = s->priv_data;
+
+    if (reply->status_code == 461 /* Unsupported protocol */ && i == 0)
+        return 1;
+    else if (reply->status_code != RTSP_STATUS_OK ||
+             reply->nb_transports != 1)
+        return AVERROR_INVALIDDATA;
+
+    /* XXX: same protocol for all streams is required */
+    if (i > 0) {
+        if (reply->transports[0].lower_transport != rt->lower_transport ||
+            reply->transports[0].transport != rt->transport)
+            return AVERROR_INVALIDDATA;
+    } else {
+        rt->lower_transport = reply->transports[0].lower_transport;
+        rt->transport = reply->transports[0].transport;
+    }
+
+    /* close RTP connection if not choosen */
+    if (reply->transports[0].lower_transport != RTSP_LOWER_TRANSPORT_UDP &&
+        (lower_transport == RTSP_LOWER_TRANSPORT_UDP)) {
+        url_close(rtsp_st->rtp_handle);
+        rtsp_st->rtp_handle = NULL;
+    }
+
+    switch(reply->transports[0].lower_transport) {
+    case RTSP_LOWER_TRANSPORT_TCP:
+        rtsp_st->interleaved_min = reply->transports[0].interleaved_min;
+        rtsp_st->interleaved_max = reply->transports[0].interleaved_max;
+        break;
+
+    case RTSP_LOWER_TRANSPORT_UDP: {
+        char url[1024];
+
+        /* XXX: also use address if specified */
+        snprintf(url, sizeof(url), "rtp://%s:%d",
+                 host, reply->transports[0].server_port_min);
+        if (!(rt->server_type == RTSP_SERVER_WMS && i > 1) &&
+            rtp_set_remote_url(rtsp_st->rtp_handle, url) < 0)
+            return AVERROR_INVALIDDATA;
+        break;
+    }
+    case RTSP_LOWER_TRANSPORT_UDP_MULTICAST: {
+        char url[1024];
+        struct in_addr in;
+        int port, ttl;
+
+        if (reply->transports[0].destination) {
+            in.s_addr = htonl(reply->transports[0].destination);
+            port      = reply->transports[0].port_min;
+            ttl       = reply->transports[0].ttl;
+        } else {
+            in        = rtsp_st->sdp_ip;
+            port      = rtsp_st->sdp_port;
+            ttl       = rtsp_st->sdp_ttl;
+        }
+        snprintf(url, sizeof(url), "rtp://%s:%d?ttl=%d",
+                 inet_ntoa(in), port, ttl);
+        if (url_open_interrupt(&rtsp_st->rtp_handle, url, URL_RDWR, &s->interrupt) < 0)
+            return AVERROR_INVALIDDATA;
+        break;
+    }
+    }
+
+    return rtsp_open_transport_ctx(s, rtsp_st);
+}
+
+static void rtsp_play_cmd(RTSPState *rt, char *cmd, int size)
+{
+    if (rt->state == RTSP_STATE_PAUSED) {
+        snprintf(cmd, size,
+                 "PLAY %s RTSP/1.0\r\n",
+                 rt->control_uri);
+    } else {
+        snprintf(cmd, size,
+                 "PLAY %s RTSP/1.0\r\n"
+                 "Range: npt=%0.3f-\r\n",
+                 rt->control_uri,
+                 (double)rt->seek_timestamp / AV_TIME_BASE);
+    }
+}
+
+/**
+ * @param play send PLAY along with the pipelined SETUP requests, the
+ *             session is then playing on success
  * @returns 0 on success, <0 on error, 1 if protocol is unavailable.
  */
 static int make_setup_request(AVFormatContext *s, const char *host, int port,
-                              int lower_transport, const char *real_challenge)
+                              int lower_transport, const char *real_challenge,
+                              int play)
 {
     RTSPState *rt = s->priv_data;
-    int rtx, j, i, err, interleave = 0;
+    int rtx, j, i, err, interleave = 0, first_seq = 0;
     RTSPStream *rtsp_st;
     RTSPMessageHeader reply1, *reply = &reply1;
     char cmd[2048];
     const char *trans_pref;
+    /* the WMS and Real setups depend on the previous replies */
+    int pipeline = rt->pipeline && rt->server_type == RTSP_SERVER_RTP &&
+                   rt->nb_rtsp_streams > 1;
+
+    play &= pipeline && rt->pipeline > 1;
 
     if (rt->transport == RTSP_TRANSPORT_RDT)
         trans_pref = "x-pn-tng";
@@ -1038,14 +1170,14 @@ static int make_setup_request(AVFormatContext *s, const char *host, int port,
                              host, j);
                     /* we will use two ports per rtp stream (rtp and rtcp) */
                     j += 2;
-                    if (url_open(&rtsp_st->rtp_handle, buf, URL_RDWR) == 0)
+                    if (url_open_interrupt(&rtsp_st->rtp_handle, buf, URL_RDWR, &s->interrupt) == 0)
                         goto rtp_opened;
                 }
             }
 
 #if 0
             /* then try on any port */
-            if (url_open(&rtsp_st->rtp_handle, "rtp://", URL_RDONLY) < 0) {
+            if (url_open_interrupt(&rtsp_st->rtp_handle, "rtp://", URL_RDONLY, &s->interrupt) < 0) {
                 err = AVERROR_INVALIDDATA;
                 goto fail;
             }
@@ -1104,85 +1236,49 @@ static int make_setup_request(AVFormatContext *s, const char *host, int port,
                         "RealChallenge2: %s, sd=%s\r\n",
                         rt->session_id, real_res, real_csum);
         }
+        /* once the session exists, the requests of the other streams
+           are sent without waiting for the replies */
+        if (pipeline && i > 0) {
+            rtsp_send_cmd_async(s, cmd);
+            continue;
+        }
         rtsp_send_cmd(s, cmd, reply, NULL);
-        if (reply->status_code == 461 /* Unsupported protocol */ && i == 0) {
-            err = 1;
-            goto fail;
-        } else if (reply->status_code != RTSP_STATUS_OK ||
-                   reply->nb_transports != 1) {
-            err = AVERROR_INVALIDDATA;
+        if ((err = setup_stream(s, rtsp_st, reply, host, lower_transport, i)))
             goto fail;
-        }
-
-        /* XXX: same protocol for all streams is required */
-        if (i > 0) {
-            if (reply->transports[0].lower_transport != rt->lower_transport ||
-                reply->transports[0].transport != rt->transport) {
-                err = AVERROR_INVALIDDATA;
-                goto fail;
-            }
-        } else {
-            rt->lower_transport = reply->transports[0].lower_transport;
-            rt->transport = reply->transports[0].transport;
-        }
+        first_seq = rt->seq + 1;
+    }
 
-        /* close RTP connection if not choosen */
-        if (reply->transports[0].lower_transport != RTSP_LOWER_TRANSPORT_UDP &&
-            (lower_transport == RTSP_LOWER_TRANSPORT_UDP)) {
-            url_close(rtsp_st->rtp_handle);
-            rtsp_st->rtp_handle = NULL;
+    if (pipeline) {
+        if (play) {
+            rtsp_play_cmd(rt, cmd, sizeof(cmd));
+            rtsp_send_cmd_async(s, cmd);
         }
-
-        switch(reply->transports[0].lower_transport) {
-        case RTSP_LOWER_TRANSPORT_TCP:
-            rtsp_st->interleaved_min = reply->transports[0].interleaved_min;
-            rtsp_st->interleaved_max = reply->transports[0].interleaved_max;
-            break;
-
-        case RTSP_LOWER_TRANSPORT_UDP: {
-            char url[1024];
-
-            /* XXX: also use address if specified */
-            snprintf(url, sizeof(url), "rtp://%s:%d",
-                     host, reply->transports[0].server_port_min);
-            if (!(rt->server_type == RTSP_SERVER_WMS && i > 1) &&
-                rtp_set_remote_url(rtsp_st->rtp_handle, url) < 0) {
+        /* the replies come in the order of the requests */
+        for (i = 1; i < rt->nb_rtsp_streams; i++) {
+            if (rtsp_read_reply(s, reply, NULL, 0) < 0 ||
+                reply->seq != first_seq + i - 1) {
                 err = AVERROR_INVALIDDATA;
                 goto fail;
             }
-            break;
-        }
-        case RTSP_LOWER_TRANSPORT_UDP_MULTICAST: {
-            char url[1024];
-            struct in_addr in;
-            int port, ttl;
-
-            if (reply->transports[0].destination) {
-                in.s_addr = htonl(reply->transports[0].destination);
-                port      = reply->transports[0].port_min;
-                ttl       = reply->transports[0].ttl;
-            } else {
-                in        = rtsp_st->sdp_ip;
-                port      = rtsp_st->sdp_port;
-                ttl       = rtsp_st->sdp_ttl;
-            }
-            snprintf(url, sizeof(url), "rtp://%s:%d?ttl=%d",
-                     inet_ntoa(in), port, ttl);
-            if (url_open(&rtsp_st->rtp_handle, url, URL_RDWR) < 0) {
-                err = AVERROR_INVALIDDATA;
+            if ((err = setup_stream(s, rt->rtsp_streams[i], reply, host,
+                                    lower_transport, i)))
                 goto fail;
-            }
-            break;
-        }
         }
-
-        if ((err = rtsp_open_transport_ctx(s, rtsp_st)))
-            goto fail;
     }
 
     if (reply->timeout > 0)
         rt->timeout = reply->timeout;
 
+    if (play) {
+        if (rtsp_read_reply(s, reply, NULL, 0) < 0 ||
+            reply->seq != first_seq + rt->nb_rtsp_streams - 1 ||
+            reply->status_code != RTSP_STATUS_OK) {
+            err = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+        rt->state = RTSP_STATE_PLAYING;
+    }
+
     if (rt->server_type == RTSP_SERVER_REAL)
         rt->need_subscription = 1;
 
@@ -1207,17 +1303,7 @@ static int rtsp_read_play(AVFormatContext *s)
     av_log(s, AV_LOG_DEBUG, "hello state=%d\n", rt->state);
 
     if (!(rt->server_type == RTSP_SERVER_REAL && rt->need_subscription)) {
-        if (rt->state == RTSP_STATE_PAUSED) {
-            snprintf(cmd, sizeof(cmd),
-                     "PLAY %s RTSP/1.0\r\n",
-                     rt->control_uri);
-        } else {
-            snprintf(cmd, sizeof(cmd),
-                     "PLAY %s RTSP/1.0\r\n"
-                     "Range: npt=%0.3f-\r\n",
-                     rt->control_uri,
-                     (double)rt->seek_timestamp / AV_TIME_BASE);
-        }
+        rtsp_play_cmd(rt, cmd, sizeof(cmd));
         rtsp_send_cmd(s, cmd, reply, NULL);
         if (reply->status_code != RTSP_STATUS_OK) {
             return -1;
@@ -1274,6 +1360,10 @@ redirect:
                 lower_transport_mask = (1<< RTSP_LOWER_TRANSPORT_UDP_MULTICAST);
             } else if (!strcmp(option, "tcp")) {
                 lower_transport_mask = (1<< RTSP_LOWER_TRANSPORT_TCP);
+            } else if (!strcmp(option, "pipeline")) {
+                rt->pipeline = 1;
+            } else if (!strcmp(option, "pipelineplay")) {
+                rt->pipeline = 2;
             } else {
                 strcpy(++filename, option);
                 filename += strlen(option);
@@ -1287,12 +1377,13 @@ redirect:
         lower_transport_mask = (1 << RTSP_LOWER_TRANSPORT_NB) - 1;
 
     /* open the tcp connexion */
-    snprintf(tcpname, sizeof(tcpname), "tcp://%s:%d", host, port);
-    if (url_open(&rtsp_hd, tcpname, URL_RDWR) < 0) {
+    snprintf(tcpname, sizeof(tcpname), "tcp://%s:%d?tcp_nodelay=1", host, port);
+    if (url_open_interrupt(&rtsp_hd, tcpname, URL_RDWR, &s->interrupt) < 0) {
         err = AVERROR(EIO);
         goto fail;
     }
     rt->rtsp_hd = rtsp_hd;
+    rt->recv_buf_pos = rt->recv_buf_len = 0;
     rt->seq = 0;
 
     /* request options supported by the server; this also detects server
@@ -1367,13 +1458,16 @@ redirect:
         goto fail;
     }
 
+    rt->state = RTSP_STATE_IDLE;
+    rt->seek_timestamp = 0; /* default is to start stream at position zero */
     do {
         int lower_transport = ff_log2_tab[lower_transport_mask &
                                   ~(lower_transport_mask - 1)];
 
         err = make_setup_request(s, host, port, lower_transport,
                                  rt->server_type == RTSP_SERVER_REAL ?
-                                     real_challenge : NULL);
+                                     real_challenge : NULL,
+                                 !ap->initial_pause);
         if (err < 0)
             goto fail;
         lower_transport_mask &= ~(1 << lower_transport);
@@ -1383,10 +1477,8 @@ redirect:
         }
     } while (err);
 
-    rt->state = RTSP_STATE_IDLE;
-    rt->seek_timestamp = 0; /* default is to start stream at position zero */
-    if (ap->initial_pause) {
-        /* do not start immediately */
+    if (ap->initial_pause || rt->state == RTSP_STATE_PLAYING) {
+        /* do not start immediately, or PLAY went with the SETUPs */
     } else {
         if (rtsp_read_play(s) < 0) {
             err = AVERROR_INVALIDDATA;
@@ -1408,56 +1500,86 @@ redirect:
     return err;
 }
 
+/**
+ * Reads the next RTP packet from the streams received over UDP.
+ *
+ * @param wait_end time to give up waiting at, 0 to wait until a packet
+ *                 arrives
+ * @return the size of the packet, 0 if the session ended, AVERROR(EAGAIN)
+ *         if wait_end was reached or another negative value on error
+ */
 static int udp_read_packet(AVFormatContext *s, RTSPStream **prtsp_st,
-                           uint8_t *buf, int buf_size)
+                           uint8_t *buf, int buf_size, int64_t wait_end)
 {
     RTSPState *rt = s->priv_data;
     RTSPStream *rtsp_st;
-    fd_set rfds;
-    int fd, fd_max, n, i, ret, tcp_fd;
-    struct timeval tv;
+    struct pollfd p[MAX_STREAMS + 2];
+    RTSPStream *p_st[MAX_STREAMS];
+    int n, i, ret, nb_fds, timeout = -1;
 
     for (;;) {
-        if (url_interrupt_cb())
-            return AVERROR(EINTR);
-        FD_ZERO(&rfds);
-        if (rt->rtsp_hd) {
-            tcp_fd = fd_max = url_get_file_handle(rt->rtsp_hd);
-            FD_SET(tcp_fd, &rfds);
-        } else {
-            fd_max = 0;
-            tcp_fd = -1;
-        }
+        /* packets fetched by an earlier batched read come first */
         for (i = 0; i < rt->nb_rtsp_streams; i++) {
+            rtsp_st = rt->rtsp_streams[i];
+            if (rtsp_st->rtp_handle && ff_rtp_buffered_packets(rtsp_st->rtp_handle)) {
+                ret = url_read(rtsp_st->rtp_handle, buf, buf_size);
+                if (ret > 0) {
+                    *prtsp_st = rtsp_st;
+                    return ret;
+                }
+            }
+        }
+#if CONFIG_RTSP_DEMUXER
+        /* data left in the read buffer does not wake up poll() */
+        if (rt->rtsp_hd && rt->recv_buf_pos < rt->recv_buf_len) {
+            RTSPMessageHeader reply;
+
+            rtsp_read_reply(s, &reply, NULL, 0);
+            if (rt->state != RTSP_STATE_PLAYING)
+                return 0;
+            continue;
+        }
+#endif
+        if (wait_end) {
+            int64_t left = wait_end - av_gettime();
+            if (left <= 0)
+                return AVERROR(EAGAIN);
+            timeout = FFMIN((left + 999) / 1000, INT_MAX);
+        }
+        nb_fds = 0;
+        for (i = 0; i < rt->nb_rtsp_streams && nb_fds < MAX_STREAMS; i++) {
             rtsp_st = rt->rtsp_streams[i];
             if (rtsp_st->rtp_handle) {
                 /* currently, we cannot probe RTCP handle because of
                  * blocking restrictions */
-                fd = url_get_file_handle(rtsp_st->rtp_handle);
-                if (fd > fd_max)
-                    fd_max = fd;
-                FD_SET(fd, &rfds);
+                p_st[nb_fds]      = rtsp_st;
+                p[nb_fds].fd      = url_get_file_handle(rtsp_st->rtp_handle);
+                p[nb_fds].events  = POLLIN;
+                p[nb_fds].revents = 0;
+                nb_fds++;
             }
         }
-        tv.tv_sec = 0;
-        tv.tv_usec = 100 * 1000;
-        n = select(fd_max + 1, &rfds, NULL, NULL, &tv);
+        /* the RTSP connection comes last, after the stream sockets */
+        if (rt->rtsp_hd) {
+            p[nb_fds].fd      = url_get_file_handle(rt->rtsp_hd);
+            p[nb_fds].events  = POLLIN;
+            p[nb_fds].revents = 0;
+        }
+        n = ff_network_poll(&s->interrupt, p, nb_fds + !!rt->rtsp_hd, timeout);
+        if (n < 0)
+            return n;
         if (n > 0) {
-            for (i = 0; i < rt->nb_rtsp_streams; i++) {
-                rtsp_st = rt->rtsp_streams[i];
-                if (rtsp_st->rtp_handle) {
-                    fd = url_get_file_handle(rtsp_st->rtp_handle);
-                    if (FD_ISSET(fd, &rfds)) {
-                        ret = url_read(rtsp_st->rtp_handle, buf, buf_size);
-                        if (ret > 0) {
-                            *prtsp_st = rtsp_st;
-                            return ret;
-                        }
+            for (i = 0; i < nb_fds; i++) {
+                if (p[i].revents & POLLIN) {
+                    ret = url_read(p_st[i]->rtp_handle, buf, buf_size);
+                    if (ret > 0) {
+                        *prtsp_st = p_st[i];
+                        return ret;
                     }
                 }
             }
 #if CONFIG_RTSP_DEMUXER
-            if (FD_ISSET(tcp_fd, &rfds)) {
+            if (rt->rtsp_hd && p[nb_fds].revents & POLLIN) {
                 RTSPMessageHeader reply;
 
                 rtsp_read_reply(s, &reply, NULL, 0);
@@ -1493,7 +1615,7 @@ redo:
         if (rt->state != RTSP_STATE_PLAYING)
             return 0;
     }
-    ret = url_read_complete(rt->rtsp_hd, buf, 3);
+    ret = rtsp_read_complete(rt, buf, 3);
     if (ret != 3)
         return -1;
     id  = buf[0];
@@ -1504,7 +1626,7 @@ redo:
     if (len > buf_size || len < 12)
         goto redo;
     /* get the data */
-    ret = url_read_complete(rt->rtsp_hd, buf, len);
+    ret = rtsp_read_complete(rt, buf, len);
     if (ret != len)
         return -1;
     if (rt->transport == RTSP_TRANSPORT_RDT &&
@@ -1527,9 +1649,10 @@ found:
 static int rtsp_fetch_packet(AVFormatContext *s, AVPacket *pkt)
 {
     RTSPState *rt = s->priv_data;
-    int ret, len;
+    int ret, len, i;
     uint8_t buf[10 * RTP_MAX_PACKET_LENGTH];
-    RTSPStream *rtsp_st;
+    RTSPStream *rtsp_st, *first_queue_st;
+    int64_t first_queue_time, wait_end;
 
     /* get next frames from the same RTP packet */
     if (rt->cur_transport_priv) {
@@ -1548,6 +1671,23 @@ static int rtsp_fetch_packet(AVFormatContext *s, AVPacket *pkt)
 
     /* read next RTP packet */
  redo:
+    /* wait no longer than the oldest packet held back for reordering may */
+    first_queue_st   = NULL;
+    first_queue_time = 0;
+    if (rt->transport == RTSP_TRANSPORT_RTP) {
+        for (i = 0; i < rt->nb_rtsp_streams; i++) {
+            RTPDemuxContext *rtpctx = rt->rtsp_streams[i]->transport_priv;
+            int64_t queue_time;
+
+            if (!rtpctx || !rtpctx->queue_delay)
+                continue;
+            queue_time = ff_rtp_queued_packet_time(rtpctx);
+            if (queue_time && (!first_queue_time || queue_time < first_queue_time)) {
+                first_queue_time = queue_time;
+                first_queue_st   = rt->rtsp_streams[i];
+            }
+        }
+    }
     switch(rt->lower_transport) {
     default:
 #if CONFIG_RTSP_DEMUXER
@@ -1557,7 +1697,18 @@ static int rtsp_fetch_packet(AVFormatContext *s, AVPacket *pkt)
 #endif
     case RTSP_LOWER_TRANSPORT_UDP:
     case RTSP_LOWER_TRANSPORT_UDP_MULTICAST:
-        len = udp_read_packet(s, &rtsp_st, buf, sizeof(buf));
+        wait_end = 0;
+        if (first_queue_st) {
+            RTPDemuxContext *rtpctx = first_queue_st->transport_priv;
+            wait_end = first_queue_time + rtpctx->queue_delay;
+        }
+        len = udp_read_packet(s, &rtsp_st, buf, sizeof(buf), wait_end);
+        if (len == AVERROR(EAGAIN)) {
+            /* give up on the packets missing before the oldest held back one */
+            rtsp_st = first_queue_st;
+            ret = rtp_parse_packet(rtsp_st->transport_priv, pkt, NULL, 0);
+            goto end;
+        }
         if (len >=0 && rtsp_st->transport_priv && rt->transport == RTSP_TRANSPORT_RTP)
             rtp_check_and_send_back_rr(rtsp_st->transport_priv, len);
         break;
@@ -1570,6 +1721,7 @@ static int rtsp_fetch_packet(AVFormatContext *s, AVPacket *pkt)
         ret = ff_rdt_parse_packet(rtsp_st->transport_priv, pkt, buf, len);
     } else
         ret = rtp_parse_packet(rtsp_st->transport_priv, pkt, buf, len);
+end:
     if (ret < 0)
         goto redo;
     if (ret == 1)
@@ -1579,6 +1731,24 @@ static int rtsp_fetch_packet(AVFormatContext *s, AVPacket *pkt)
     return ret;
 }
 
+static int rtsp_get_network_stats(AVFormatContext *s, int stream_index,
+                                  AVStreamNetworkStats *stats)
+{
+    RTSPState *rt = s->priv_data;
+    int i;
+
+    if (rt->transport != RTSP_TRANSPORT_RTP)
+        return AVERROR(ENOSYS);
+    for (i = 0; i < rt->nb_rtsp_streams; i++) {
+        RTSPStream *rtsp_st = rt->rtsp_streams[i];
+        if (rtsp_st->stream_index == stream_index && rtsp_st->transport_priv) {
+            ff_rtp_get_network_stats(rtsp_st->transport_priv, stats);
+            return 0;
+        }
+    }
+    return AVERROR(EINVAL);
+}
+
 static int rtsp_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     RTSPState *rt = s->priv_data;
@@ -1750,6 +1920,7 @@ AVInputFormat rtsp_demuxer = {
     .flags = AVFMT_NOFILE,
     .read_play = rtsp_read_play,
     .read_pause = rtsp_read_pause,
+    .get_network_stats = rtsp_get_network_stats,
 };
 #endif
 
@@ -1804,7 +1975,7 @@ static int sdp_read_header(AVFormatContext *s, AVFormatParameters *ap)
                  rtsp_st->sdp_port,
                  rtsp_st->sdp_port,
                  rtsp_st->sdp_ttl);
-        if (url_open(&rtsp_st->rtp_handle, url, URL_RDWR) < 0) {
+        if (url_open_interrupt(&rtsp_st->rtp_handle, url, URL_RDWR, &s->interrupt) < 0) {
             err = AVERROR_INVALIDDATA;
             goto fail;
         }
@@ -1832,4 +2003,5 @@ AVInputFormat sdp_demuxer = {
     sdp_read_header,
     rtsp_fetch_packet,
     sdp_read_close,
+    .get_network_stats = rtsp_get_network_stats,
 };
@@ -51,6 +51,7 @@ enum RTSPTransport {
 #define RTSP_DEFAULT_PORT   554
 #define RTSP_MAX_TRANSPORTS 8
 #define RTSP_TCP_MAX_PACKET_SIZE 1472
+#define RTSP_RECV_BUF_SIZE 16384
 #define RTSP_DEFAULT_NB_AUDIO_CHANNELS 2
 #define RTSP_DEFAULT_AUDIO_SAMPLERATE 44100
 #define RTSP_RTP_PORT_MIN 5000
@@ -271,6 +272,17 @@ typedef struct RTSPState {
      * for all subsequent RTSP requests, rather than the input URI; in
      * other cases, this is a copy of AVFormatContext->filename. */
     char control_uri[1024];
+
+    /** 1 to send the SETUP requests of all streams but the first without
+     * waiting for the replies ("?pipeline"), 2 to send PLAY along with
+     * them ("?pipelineplay") */
+    int pipeline;
+
+    /** data received on the RTSP connection and not parsed yet; replies
+     * and interleaved packets are parsed from it instead of being read
+     * from the connection in small pieces */
+    uint8_t recv_buf[RTSP_RECV_BUF_SIZE];
+    int recv_buf_pos, recv_buf_len;
 } RTSPState;
 
 /**
@@ -47,6 +47,29 @@ struct sdp_session_level {
     const char *name;     /**< session name (can be an empty string) */
 };
 
+/**
+ * Media description of a stream and the parameters it was written from.
+ */
+typedef struct SDPMediaCache {
+    enum CodecType codec_type;
+    enum CodecID codec_id;
+    int bit_rate, sample_rate, channels;
+    uint8_t *extradata;
+    int extradata_size;
+    char dst[32];
+    int port, ttl;
+    char *text;           /**< the m= line and its attributes, NULL if none */
+} SDPMediaCache;
+
+typedef struct SDPCache {
+    char filename[1024];  /**< filename the destination was resolved for */
+    int resolved;
+    char dst[32];
+    int port, ttl;
+    int nb_media;
+    SDPMediaCache *media;
+} SDPCache;
+
 static void sdp_write_address(char *buff, int size, const char *dest_addr, int ttl)
 {
     if (dest_addr) {
@@ -320,6 +343,120 @@ static void sdp_write_media(char *buff, int size, AVCodecContext *c, const char
     sdp_write_media_attributes(buff, size, c, payload_type);
 }
 
+static SDPCache *sdp_get_cache(AVFormatContext *ac)
+{
+    SDPCache *cache = ac->sdp_cache;
+
+    if (!(ac->flags & AVFMT_FLAG_SDP_CACHE))
+        return NULL;
+    if (!cache && !(cache = ac->sdp_cache = av_mallocz(sizeof(*cache))))
+        return NULL;
+    if (cache->nb_media < ac->nb_streams) {
+        SDPMediaCache *media = av_realloc(cache->media, ac->nb_streams * sizeof(*media));
+        if (!media)
+            return NULL;
+        memset(media + cache->nb_media, 0,
+               (ac->nb_streams - cache->nb_media) * sizeof(*media));
+        cache->media    = media;
+        cache->nb_media = ac->nb_streams;
+    }
+    return cache;
+}
+
+/**
+ * Gets the destination of ac, resolving its host name only if it was not
+ * resolved for the same filename before.
+ */
+static int sdp_get_destination(AVFormatContext *ac, SDPCache *cache,
+                               char *dest_addr, int size, int *ttl)
+{
+    int port;
+
+    if (cache && cache->resolved && !strcmp(cache->filename, ac->filename)) {
+        av_strlcpy(dest_addr, cache->dst, size);
+        *ttl = cache->ttl;
+        return cache->port;
+    }
+    port = sdp_get_address(dest_addr, size, ttl, ac->filename);
+    resolve_destination(dest_addr, size);
+    if (cache) {
+        av_strlcpy(cache->filename, ac->filename, sizeof(cache->filename));
+        av_strlcpy(cache->dst, dest_addr, sizeof(cache->dst));
+        cache->port     = port;
+        cache->ttl      = *ttl;
+        cache->resolved = 1;
+    }
+    return port;
+}
+
+static int sdp_media_cache_valid(SDPMediaCache *m, AVCodecContext *c,
+                                 const char *dest_addr, int port, int ttl)
+{
+    return m->text &&
+           m->codec_type  == c->codec_type  && m->codec_id == c->codec_id &&
+           m->bit_rate    == c->bit_rate    &&
+           m->sample_rate == c->sample_rate && m->channels == c->channels &&
+           m->port == port && m->ttl == ttl &&
+           !strcmp(m->dst, dest_addr ? dest_addr : "") &&
+           m->extradata_size == c->extradata_size &&
+           (!c->extradata_size || !memcmp(m->extradata, c->extradata, c->extradata_size));
+}
+
+/**
+ * Writes the media description of a stream, reusing the one in m if it was
+ * written from the same parameters.
+ */
+static void sdp_write_media_cached(char *buff, int size, SDPMediaCache *m, AVCodecContext *c,
+                                   const char *dest_addr, int port, int ttl)
+{
+    int len;
+
+    if (m && sdp_media_cache_valid(m, c, dest_addr, port, ttl)) {
+        av_strlcat(buff, m->text, size);
+        return;
+    }
+    len = strlen(buff);
+    sdp_write_media(buff, size, c, dest_addr, port, ttl);
+    if (!m)
+        return;
+
+    av_freep(&m->text);
+    av_freep(&m->extradata);
+    /* a truncated description must not be reused with a larger buffer */
+    if (strlen(buff) >= size - 1)
+        return;
+    if (c->extradata_size) {
+        if (!(m->extradata = av_malloc(c->extradata_size)))
+            return;
+        memcpy(m->extradata, c->extradata, c->extradata_size);
+    }
+    m->extradata_size = c->extradata_size;
+    m->codec_type     = c->codec_type;
+    m->codec_id       = c->codec_id;
+    m->bit_rate       = c->bit_rate;
+    m->sample_rate    = c->sample_rate;
+    m->channels       = c->channels;
+    m->port           = port;
+    m->ttl            = ttl;
+    av_strlcpy(m->dst, dest_addr ? dest_addr : "", sizeof(m->dst));
+    m->text = av_strdup(buff + len);
+}
+
+void ff_sdp_cache_free(AVFormatContext *s)
+{
+    SDPCache *cache = s->sdp_cache;
+    int i;
+
+    if (!cache)
+        return;
+    for (i = 0; i < cache->nb_media; i++) {
+        av_free(cache->media[i].text);
+        av_free(cache->media[i].extradata);
+    }
+    av_free(cache->media);
+    av_freep(&s->sdp_cache);
+}
+
 int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size)
 {
     AVMetadataTag *title = av_metadata_get(ac[0]->metadata, "title", NULL, 0);
@@ -336,8 +473,7 @@ int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size)
     port = 0;
     ttl = 0;
     if (n_files == 1) {
-        port = sdp_get_address(dst, sizeof(dst), &ttl, ac[0]->filename);
-        resolve_destination(dst, sizeof(dst));
+        port = sdp_get_destination(ac[0], sdp_get_cache(ac[0]), dst, sizeof(dst), &ttl);
         if (dst[0]) {
             s.dst_addr = dst;
             s.ttl = ttl;
@@ -347,14 +483,14 @@ int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size)
 
     dst[0] = 0;
     for (i = 0; i < n_files; i++) {
-        if (n_files != 1) {
-            port = sdp_get_address(dst, sizeof(dst), &ttl, ac[i]->filename);
-            resolve_destination(dst, sizeof(dst));
-        }
+        SDPCache *cache = sdp_get_cache(ac[i]);
+
+        if (n_files != 1)
+            port = sdp_get_destination(ac[i], cache, dst, sizeof(dst), &ttl);
         for (j = 0; j < ac[i]->nb_streams; j++) {
-            sdp_write_media(buff, size,
-                                  ac[i]->streams[j]->codec, dst[0] ? dst : NULL,
-                                  (port > 0) ? port + j * 2 : 0, ttl);
+            sdp_write_media_cached(buff, size, cache ? &cache->media[j] : NULL,
+                                   ac[i]->streams[j]->codec, dst[0] ? dst : NULL,
+                                   (port > 0) ? port + j * 2 : 0, ttl);
             if (port <= 0) {
                 av_strlcatf(buff, size,
                                    "a=control:streamid=%d\r\n", i + j);
@@ -369,4 +505,8 @@ int avf_sdp_create(AVFormatContext *ac[], int n_files, char *buff, int size)
 {
     return AVERROR(ENOSYS);
 }
+
+void ff_sdp_cache_free(AVFormatContext *s)
+{
+}
 #endif
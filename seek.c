@@ -22,6 +22,7 @@
 
 #include "seek.h"
 #include "libavutil/mem.h"
+#include "internal.h"
 
 // NOTE: implementation should be moved here in another patch, to keep patches
 // separated.
@@ -280,7 +281,7 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
                                 int64_t ts_max,
                                 int flags)
 {
-    AVSyncPoint *sync, *sp;
+    AVSyncPoint sync[MAX_STREAMS], *sp;
     AVStream *st;
     int i;
     int keyframes_to_find = 0;
@@ -309,11 +310,6 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
     }
 
     // Initialize syncpoint structures for each stream.
-    sync = av_malloc(s->nb_streams * sizeof(AVSyncPoint));
-    if (!sync)
-        // cannot allocate helper structure
-        return -1;
-
     for (i = 0; i < s->nb_streams; ++i) {
         st = s->streams[i];
         sp = &sync[i];
@@ -336,7 +332,6 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
 
     if (!keyframes_to_find) {
         // no stream active, error
-        av_free(sync);
         return -1;
     }
 
@@ -409,7 +404,6 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
             }
             if (min_distance == INT64_MAX) {
                 // no timestamp is in range, cannot seek
-                av_free(sync);
                 return -1;
             }
             if (min_pos < pos)
@@ -418,7 +412,6 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
     }
 
     url_fseek(s->pb, pos, SEEK_SET);
-    av_free(sync);
     return pos;
 }
 
@@ -427,27 +420,29 @@ AVParserState *ff_store_parser_state(AVFormatContext *s)
     int i;
     AVStream *st;
     AVParserStreamState *ss;
-    AVParserState *state = av_malloc(sizeof(AVParserState));
-    if (!state)
-        return NULL;
+    AVParserState *state = s->parser_state;
 
-    state->stream_states = av_malloc(sizeof(AVParserStreamState) * s->nb_streams);
-    if (!state->stream_states) {
-        av_free(state);
+    if (!state && !(state = s->parser_state = av_malloc(sizeof(AVParserState))))
         return NULL;
-    }
+    if (state->in_use && !(state = av_malloc(sizeof(AVParserState))))
+        return NULL;
+    state->in_use = 1;
 
     state->fpos = url_ftell(s->pb);
 
-    // copy context structures
+    // move the packet lists over to the stored state
     state->cur_st                           = s->cur_st;
     state->packet_buffer                    = s->packet_buffer;
+    state->packet_buffer_end                = s->packet_buffer_end;
     state->raw_packet_buffer                = s->raw_packet_buffer;
+    state->raw_packet_buffer_end            = s->raw_packet_buffer_end;
     state->raw_packet_buffer_remaining_size = s->raw_packet_buffer_remaining_size;
 
     s->cur_st                               = NULL;
     s->packet_buffer                        = NULL;
+    s->packet_buffer_end                    = NULL;
     s->raw_packet_buffer                    = NULL;
+    s->raw_packet_buffer_end                = NULL;
     s->raw_packet_buffer_remaining_size     = RAW_PACKET_BUFFER_SIZE;
 
     // copy stream structures
@@ -478,6 +473,15 @@ AVParserState *ff_store_parser_state(AVFormatContext *s)
     return state;
 }
 
+/* give back the storage of a state no longer holding anything */
+static void release_parser_state(AVFormatContext *s, AVParserState *state)
+{
+    if (state == s->parser_state)
+        state->in_use = 0;
+    else
+        av_free(state);
+}
+
 void ff_restore_parser_state(AVFormatContext *s, AVParserState *state)
 {
     int i;
@@ -490,10 +494,12 @@ void ff_restore_parser_state(AVFormatContext *s, AVParserState *state)
 
     url_fseek(s->pb, state->fpos, SEEK_SET);
 
-    // copy context structures
+    // move the packet lists back, the ones read since were flushed above
     s->cur_st                           = state->cur_st;
     s->packet_buffer                    = state->packet_buffer;
+    s->packet_buffer_end                = state->packet_buffer_end;
     s->raw_packet_buffer                = state->raw_packet_buffer;
+    s->raw_packet_buffer_end            = state->raw_packet_buffer_end;
     s->raw_packet_buffer_remaining_size = state->raw_packet_buffer_remaining_size;
 
     // copy stream structures
@@ -511,18 +517,17 @@ void ff_restore_parser_state(AVFormatContext *s, AVParserState *state)
         st->cur_pkt       = ss->cur_pkt;
     }
 
-    av_free(state->stream_states);
-    av_free(state);
+    release_parser_state(s, state);
 }
 
-static void free_packet_list(AVPacketList *pktl)
+static void free_packet_list(AVFormatContext *s, AVPacketList *pktl)
 {
     AVPacketList *cur;
     while (pktl) {
         cur = pktl;
         pktl = cur->next;
         av_free_packet(&cur->pkt);
-        av_free(cur);
+        ff_packet_list_free(s, cur);
     }
 }
 
@@ -541,10 +546,9 @@ void ff_free_parser_state(AVFormatContext *s, AVParserState *state)
         av_free_packet(&ss->cur_pkt);
     }
 
-    free_packet_list(state->packet_buffer);
-    free_packet_list(state->raw_packet_buffer);
+    free_packet_list(s, state->packet_buffer);
+    free_packet_list(s, state->raw_packet_buffer);
 
-    av_free(state->stream_states);
-    av_free(state);
+    release_parser_state(s, state);
 }
 
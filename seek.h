@@ -49,12 +49,16 @@ typedef struct AVParserState {
     // saved members of AVFormatContext
     AVStream       *cur_st;                 ///< current stream.
     AVPacketList   *packet_buffer;          ///< packet buffer of original state
+    AVPacketList   *packet_buffer_end;
     AVPacketList   *raw_packet_buffer;      ///< raw packet buffer of original state
+    AVPacketList   *raw_packet_buffer_end;
     int raw_packet_buffer_remaining_size;   ///< remaining space in raw_packet_buffer
 
     // saved info for streams
     int                  nb_streams;        ///< number of streams with stored state
-    AVParserStreamState *stream_states;     ///< states of individual streams (array)
+    AVParserStreamState  stream_states[MAX_STREAMS]; ///< states of individual streams
+
+    int             in_use;                 ///< holds a stored state, for the one kept in the context
 } AVParserState;
 
 /**
@@ -98,6 +102,10 @@ int64_t ff_gen_syncpoint_search(AVFormatContext *s,
  *       are relinked to the stored state instead of being deeply-copied (for
  *       performance reasons and to keep the code simple).
  *
+ * The state is kept in AVFormatContext.parser_state, allocated by the first
+ * call, so that seeking does not allocate. Only a state stored while that
+ * one is in use is allocated.
+ *
  * @param s context from which to save state
  * @return parser state object or NULL if memory could not be allocated
  */
@@ -0,0 +1,488 @@
+/*
+ * Segmenting muxers for HTTP streaming
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/segment.c
+ * Segmenting muxers for HTTP streaming.
+ * The filename is that of an M3U8 playlist, e.g. "live.m3u8", listing the
+ * segments "live0.ts", "live1.ts"... or "live0.mp4"... written next to it.
+ * A single MPEG-TS or fragmented MP4 muxer writes all segments, switching
+ * its output at the first keyframe after segment_duration, so that the
+ * continuity counters, the tables and the timestamps go on across them.
+ *
+ * A separate thread opens each segment ahead and closes the finished
+ * ones, adding them to the playlist as soon as they are complete, so
+ * that slow outputs do not stall the muxing.
+ */
+
+#include <unistd.h>
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+#include "mpegts.h"
+#include "isom.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#define MAX_CLOSING_SEGMENTS 4
+
+typedef struct SegmentEntry {
+    ByteIOContext *pb;      ///< while waiting to be closed
+    int number;
+    int64_t duration;       ///< in AV_TIME_BASE units
+} SegmentEntry;
+
+typedef struct SegmentContext {
+    AVFormatContext *avf;   ///< muxer writing the segments
+    int (*switch_output)(AVFormatContext *s, ByteIOContext *pb);
+    const char *ext;        ///< of the segment filenames
+    char base[1024];        ///< playlist filename without its extension
+    int ref_stream;         ///< stream whose keyframes start segments, -1 for any
+    int number;             ///< of the current segment
+    int64_t start;          ///< time of the current segment in AV_TIME_BASE units
+    int64_t end;            ///< end of the last packet written
+    SegmentEntry *list;     ///< closed segments listed in the playlist
+    int nb_list;
+    int64_t max_duration;
+    int error;              ///< first error closing a segment or writing the playlist
+#if HAVE_PTHREADS
+    pthread_t thread;
+    int has_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    SegmentEntry closing[MAX_CLOSING_SEGMENTS];
+    int nb_closing;
+    int open_number;        ///< segment to open ahead, -1 if none
+    int opening;            ///< set until the segment asked for is opened
+    ByteIOContext *next_pb; ///< segment opened ahead
+    int next_number;
+    int next_ret;
+    int quit;
+#endif
+} SegmentContext;
+
+static void segment_name(AVFormatContext *s, char *buf, int size, int number)
+{
+    SegmentContext *seg = s->priv_data;
+
+    snprintf(buf, size, "%s%d.%s", seg->base, number, seg->ext);
+}
+
+static int open_segment(AVFormatContext *s, int number, ByteIOContext **pb)
+{
+    char name[1024];
+    int ret;
+
+    segment_name(s, name, sizeof(name), number);
+    if ((ret = url_fopen(pb, name, URL_WRONLY)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not open segment '%s'\n", name);
+        return ret;
+    }
+    if (s->write_behind > 0 && url_fset_writebehind(*pb, s->write_behind) < 0)
+        av_log(s, AV_LOG_WARNING, "Could not start the writing thread\n");
+    return 0;
+}
+
+/**
+ * Remove a segment opened ahead but not needed, if it is a local file.
+ */
+static void discard_segment(AVFormatContext *s, int number, ByteIOContext *pb)
+{
+    char name[1024];
+    const char *path = name;
+
+    url_fclose(pb);
+    segment_name(s, name, sizeof(name), number);
+    if (!strchr(name, ':') || av_strstart(name, "file:", &path))
+        unlink(path);
+}
+
+static int write_playlist(AVFormatContext *s, int final)
+{
+    SegmentContext *seg = s->priv_data;
+    ByteIOContext *pb;
+    char name[1024];
+    const char *p;
+    int i, ret;
+
+    if ((ret = url_fopen(&pb, s->filename, URL_WRONLY)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not open playlist '%s'\n", s->filename);
+        return ret;
+    }
+    url_fprintf(pb, "#EXTM3U\n");
+    url_fprintf(pb, "#EXT-X-TARGETDURATION:%d\n",
+                (int)((seg->max_duration + AV_TIME_BASE - 1) / AV_TIME_BASE));
+    if (seg->nb_list)
+        url_fprintf(pb, "#EXT-X-MEDIA-SEQUENCE:%d\n", seg->list[0].number);
+    for (i = 0; i < seg->nb_list; i++) {
+        segment_name(s, name, sizeof(name), seg->list[i].number);
+        /* segments are listed relative to the playlist */
+        p = strrchr(name, '/');
+        url_fprintf(pb, "#EXTINF:%d,\n%s\n",
+                    (int)((seg->list[i].duration + AV_TIME_BASE / 2) / AV_TIME_BASE),
+                    p ? p + 1 : name);
+    }
+    if (final)
+        url_fprintf(pb, "#EXT-X-ENDLIST\n");
+    put_flush_packet(pb);
+    ret = url_ferror(pb);
+    url_fclose(pb);
+    return ret;
+}
+
+/**
+ * Close a finished segment and list it in the playlist.
+ */
+static int finish_segment(AVFormatContext *s, SegmentEntry *e)
+{
+    SegmentContext *seg = s->priv_data;
+    int ret;
+
+    put_flush_packet(e->pb);
+    ret = url_ferror(e->pb);
+    url_fclose(e->pb);
+    e->pb = NULL;
+    if (ret < 0)
+        return ret;
+
+    if (s->segment_list_size > 0 && seg->nb_list >= s->segment_list_size) {
+        seg->nb_list--;
+        memmove(seg->list, seg->list + 1, seg->nb_list * sizeof(*seg->list));
+    } else {
+        void *tmp = av_realloc(seg->list, (seg->nb_list + 1) * sizeof(*seg->list));
+        if (!tmp)
+            return AVERROR(ENOMEM);
+        seg->list = tmp;
+    }
+    seg->list[seg->nb_list++] = *e;
+    seg->max_duration = FFMAX(seg->max_duration, e->duration);
+    return write_playlist(s, 0);
+}
+
+#if HAVE_PTHREADS
+static void *segment_thread(void *arg)
+{
+    AVFormatContext *s = arg;
+    SegmentContext *seg = s->priv_data;
+
+    pthread_mutex_lock(&seg->lock);
+    for (;;) {
+        while (!seg->quit && !seg->nb_closing && seg->open_number < 0)
+            pthread_cond_wait(&seg->cond, &seg->lock);
+        /* finished segments go first, they are awaited by the clients */
+        if (seg->nb_closing) {
+            SegmentEntry e = seg->closing[0];
+            int ret;
+
+            pthread_mutex_unlock(&seg->lock);
+            ret = finish_segment(s, &e);
+            pthread_mutex_lock(&seg->lock);
+            if (ret < 0 && !seg->error)
+                seg->error = ret;
+            seg->nb_closing--;
+            memmove(seg->closing, seg->closing + 1, seg->nb_closing * sizeof(*seg->closing));
+        } else if (seg->open_number >= 0) {
+            ByteIOContext *pb = NULL;
+            int number = seg->open_number, ret;
+
+            seg->open_number = -1;
+            pthread_mutex_unlock(&seg->lock);
+            ret = open_segment(s, number, &pb);
+            pthread_mutex_lock(&seg->lock);
+            seg->next_pb     = pb;
+            seg->next_number = number;
+            seg->next_ret    = ret;
+            seg->opening     = 0;
+        } else
+            break;
+        pthread_cond_broadcast(&seg->cond);
+    }
+    pthread_mutex_unlock(&seg->lock);
+    return NULL;
+}
+#endif
+
+/**
+ * Get the output of the next segment, opened ahead if possible.
+ */
+static int next_segment(AVFormatContext *s, ByteIOContext **pb)
+{
+    SegmentContext *seg = s->priv_data;
+    int ret;
+
+#if HAVE_PTHREADS
+    if (seg->has_thread) {
+        pthread_mutex_lock(&seg->lock);
+        while (seg->opening)
+            pthread_cond_wait(&seg->cond, &seg->lock);
+        *pb = seg->next_pb;
+        ret = seg->next_ret;
+        seg->next_pb  = NULL;
+        seg->next_ret = 0;
+        if (ret >= 0) {
+            /* open the one after while this one is written */
+            seg->open_number = seg->number + 2;
+            seg->opening     = 1;
+            pthread_cond_broadcast(&seg->cond);
+        }
+        pthread_mutex_unlock(&seg->lock);
+        return ret;
+    }
+#endif
+    return open_segment(s, seg->number + 1, pb);
+}
+
+static int close_segment(AVFormatContext *s, ByteIOContext *pb, int64_t duration)
+{
+    SegmentContext *seg = s->priv_data;
+    SegmentEntry e = { pb, seg->number, duration };
+    int ret;
+
+#if HAVE_PTHREADS
+    if (seg->has_thread) {
+        pthread_mutex_lock(&seg->lock);
+        while (seg->nb_closing == MAX_CLOSING_SEGMENTS)
+            pthread_cond_wait(&seg->cond, &seg->lock);
+        seg->closing[seg->nb_closing++] = e;
+        ret = seg->error;
+        pthread_cond_broadcast(&seg->cond);
+        pthread_mutex_unlock(&seg->lock);
+        return ret;
+    }
+#endif
+    if ((ret = finish_segment(s, &e)) < 0 && !seg->error)
+        seg->error = ret;
+    return ret;
+}
+
+static void stop_thread(AVFormatContext *s)
+{
+#if HAVE_PTHREADS
+    SegmentContext *seg = s->priv_data;
+
+    if (!seg->has_thread)
+        return;
+    pthread_mutex_lock(&seg->lock);
+    seg->quit = 1;
+    pthread_cond_broadcast(&seg->cond);
+    pthread_mutex_unlock(&seg->lock);
+    pthread_join(seg->thread, NULL);
+    if (seg->next_pb)
+        discard_segment(s, seg->next_number, seg->next_pb);
+    pthread_cond_destroy(&seg->cond);
+    pthread_mutex_destroy(&seg->lock);
+    seg->has_thread = 0;
+#endif
+}
+
+static void free_muxer(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    AVFormatContext *avf = seg->avf;
+    int i;
+
+    if (!avf)
+        return;
+    for (i = 0; i < avf->nb_streams; i++) {
+        av_metadata_free(&avf->streams[i]->metadata);
+        av_freep(&avf->streams[i]->priv_data);
+        av_freep(&avf->streams[i]->codec);
+        av_freep(&avf->streams[i]);
+    }
+    av_metadata_free(&avf->metadata);
+    av_freep(&avf->priv_data);
+    av_freep(&seg->avf);
+    av_freep(&seg->list);
+}
+
+static int segment_write_header(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    AVFormatContext *avf;
+    AVMetadataTag *tag = NULL;
+    char *p;
+    int i, ret;
+
+#if CONFIG_SEGMENT_MP4_MUXER
+    if (!strcmp(s->oformat->name, "segment_mp4")) {
+        seg->ext           = "mp4";
+        seg->switch_output = ff_mov_switch_output;
+    } else
+#endif
+    {
+        seg->ext           = "ts";
+        seg->switch_output = ff_mpegts_switch_output;
+    }
+    if (s->segment_duration <= 0)
+        s->segment_duration = 10 * AV_TIME_BASE;
+    av_strlcpy(seg->base, s->filename, sizeof(seg->base));
+    if ((p = strrchr(seg->base, '.')) && !strchr(p, '/'))
+        *p = 0;
+
+    if (!(avf = seg->avf = avformat_alloc_context()))
+        return AVERROR(ENOMEM);
+    avf->oformat   = av_guess_format(seg->ext, NULL, NULL);
+    avf->flags     = s->flags;
+    avf->max_delay = s->max_delay;
+    avf->mux_rate  = s->mux_rate;
+    /* one fragment per segment unless shorter ones are asked for */
+    avf->fragment_duration = s->fragment_duration > 0 ? s->fragment_duration
+                                                      : s->segment_duration;
+    av_strlcpy(avf->filename, s->filename, sizeof(avf->filename));
+    while ((tag = av_metadata_get(s->metadata, "", tag, AV_METADATA_IGNORE_SUFFIX)))
+        av_metadata_set2(&avf->metadata, tag->key, tag->value, 0);
+    ret = AVERROR(ENOMEM);
+    if (!avf->oformat)
+        goto fail;
+
+    seg->ref_stream = -1;
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *ist = s->streams[i], *st;
+
+        if (!(st = av_new_stream(avf, ist->id)))
+            goto fail;
+        /* the codec settings are shared, not copied */
+        *st->codec              = *ist->codec;
+        st->time_base           = ist->time_base;
+        st->sample_aspect_ratio = ist->sample_aspect_ratio;
+        st->r_frame_rate        = ist->r_frame_rate;
+        while ((tag = av_metadata_get(ist->metadata, "", tag, AV_METADATA_IGNORE_SUFFIX)))
+            av_metadata_set2(&st->metadata, tag->key, tag->value, 0);
+        if (seg->ref_stream < 0 && ist->codec->codec_type == CODEC_TYPE_VIDEO)
+            seg->ref_stream = i;
+    }
+
+    seg->start = AV_NOPTS_VALUE;
+    if ((ret = av_set_parameters(avf, NULL)) < 0 ||
+        (ret = open_segment(s, 0, &avf->pb)) < 0)
+        goto fail;
+    if ((ret = av_write_header(avf)) < 0) {
+        url_fclose(avf->pb);
+        goto fail;
+    }
+
+#if HAVE_PTHREADS
+    seg->open_number = 1;
+    seg->opening     = 1;
+    pthread_mutex_init(&seg->lock, NULL);
+    pthread_cond_init(&seg->cond, NULL);
+    if (pthread_create(&seg->thread, NULL, segment_thread, s)) {
+        av_log(s, AV_LOG_WARNING, "Could not start the segment thread\n");
+        pthread_cond_destroy(&seg->cond);
+        pthread_mutex_destroy(&seg->lock);
+    } else
+        seg->has_thread = 1;
+#endif
+    return 0;
+fail:
+    free_muxer(s);
+    return ret;
+}
+
+static int segment_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    SegmentContext *seg = s->priv_data;
+    AVStream *ist = s->streams[pkt->stream_index];
+    AVStream *st  = seg->avf->streams[pkt->stream_index];
+    AVPacket opkt = *pkt;
+    int64_t t = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    int ret;
+
+    if (t != AV_NOPTS_VALUE) {
+        t = av_rescale_q(t, ist->time_base, AV_TIME_BASE_Q);
+        if (seg->start == AV_NOPTS_VALUE)
+            seg->start = t;
+        if ((seg->ref_stream < 0 || pkt->stream_index == seg->ref_stream) &&
+            (pkt->flags & PKT_FLAG_KEY) && t - seg->start >= s->segment_duration) {
+            ByteIOContext *pb, *old_pb = seg->avf->pb;
+
+            if ((ret = next_segment(s, &pb)) < 0)
+                return ret;
+            if ((ret = seg->switch_output(seg->avf, pb)) < 0) {
+                url_fclose(seg->avf->pb == pb ? old_pb : pb);
+                return ret;
+            }
+            if ((ret = close_segment(s, old_pb, t - seg->start)) < 0)
+                return ret;
+            seg->number++;
+            seg->start = t;
+        }
+        seg->end = FFMAX(seg->end, t + av_rescale_q(pkt->duration, ist->time_base,
+                                                    AV_TIME_BASE_Q));
+    }
+
+    if (opkt.pts != AV_NOPTS_VALUE)
+        opkt.pts = av_rescale_q(opkt.pts, ist->time_base, st->time_base);
+    if (opkt.dts != AV_NOPTS_VALUE)
+        opkt.dts = av_rescale_q(opkt.dts, ist->time_base, st->time_base);
+    opkt.duration = av_rescale_q(opkt.duration, ist->time_base, st->time_base);
+    /* the packets are interleaved already */
+    return av_write_frame(seg->avf, &opkt);
+}
+
+static int segment_write_trailer(AVFormatContext *s)
+{
+    SegmentContext *seg = s->priv_data;
+    ByteIOContext *pb = seg->avf->pb;
+    int ret = av_write_trailer(seg->avf);
+    int ret2;
+
+    ret2 = close_segment(s, pb, seg->start != AV_NOPTS_VALUE ? seg->end - seg->start : 0);
+    stop_thread(s);
+    if (ret >= 0)
+        ret = ret2 < 0 ? ret2 : seg->error;
+    if (ret >= 0)
+        ret = write_playlist(s, 1);
+    free_muxer(s);
+    return ret;
+}
+
+#if CONFIG_SEGMENT_MUXER
+AVOutputFormat segment_muxer = {
+    "segment",
+    NULL_IF_CONFIG_SMALL("MPEG-TS segments and M3U8 playlist"),
+    "application/vnd.apple.mpegurl",
+    "m3u8",
+    sizeof(SegmentContext),
+    CODEC_ID_MP2,
+    CODEC_ID_MPEG2VIDEO,
+    segment_write_header,
+    segment_write_packet,
+    segment_write_trailer,
+    .flags = AVFMT_NOFILE,
+};
+#endif
+#if CONFIG_SEGMENT_MP4_MUXER
+AVOutputFormat segment_mp4_muxer = {
+    "segment_mp4",
+    NULL_IF_CONFIG_SMALL("fragmented MP4 segments and M3U8 playlist"),
+    "application/vnd.apple.mpegurl",
+    NULL,
+    sizeof(SegmentContext),
+    CODEC_ID_AAC,
+    CODEC_ID_MPEG4,
+    segment_write_header,
+    segment_write_packet,
+    segment_write_trailer,
+    .flags = AVFMT_NOFILE | AVFMT_GLOBALHEADER,
+};
+#endif
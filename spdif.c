@@ -41,6 +41,7 @@
  */
 
 #include "avformat.h"
+#include "libavutil/intreadwrite.h"
 #include "libavcodec/ac3.h"
 #include "libavcodec/dca.h"
 #include "libavcodec/aac_parser.h"
@@ -48,6 +49,7 @@
 #define SYNCWORD1 0xF872
 #define SYNCWORD2 0x4E1F
 #define BURST_HEADER_SIZE 0x8
+#define BSWAP16_MASK UINT64_C(0x00FF00FF00FF00FF)
 
 enum IEC958DataType {
     IEC958_AC3                = 0x01,          ///< AC-3 data
@@ -69,7 +71,7 @@ typedef struct IEC958Context {
     enum IEC958DataType data_type;  ///< burst info - reference to type of payload of the data-burst
     int pkt_size;                   ///< length code in bits
     int pkt_offset;                 ///< data burst repetition period in bytes
-    uint8_t *buffer;                ///< allocated buffer, used for swap bytes
+    uint8_t *buffer;                ///< allocated buffer, used to assemble the burst
     int buffer_size;                ///< size of allocated buffer
 
     /// function, which generates codec dependent header information.
@@ -78,22 +80,22 @@ typedef struct IEC958Context {
 } IEC958Context;
 
 //TODO move to DSP
-static void bswap_buf16(uint16_t *dst, const uint16_t *src, int w)
+/**
+ * Swap the bytes of w 16 bit words, four words at a time.
+ * dst and src need not be aligned.
+ */
+static void bswap_buf16(uint8_t *dst, const uint8_t *src, int w)
 {
     int i;
 
     for (i = 0; i + 8 <= w; i += 8) {
-        dst[i + 0] = bswap_16(src[i + 0]);
-        dst[i + 1] = bswap_16(src[i + 1]);
-        dst[i + 2] = bswap_16(src[i + 2]);
-        dst[i + 3] = bswap_16(src[i + 3]);
-        dst[i + 4] = bswap_16(src[i + 4]);
-        dst[i + 5] = bswap_16(src[i + 5]);
-        dst[i + 6] = bswap_16(src[i + 6]);
-        dst[i + 7] = bswap_16(src[i + 7]);
+        uint64_t a = AV_RN64(src + 2 * i);
+        uint64_t b = AV_RN64(src + 2 * i + 8);
+        AV_WN64(dst + 2 * i,     (a >> 8 & BSWAP16_MASK) | (a & BSWAP16_MASK) << 8);
+        AV_WN64(dst + 2 * i + 8, (b >> 8 & BSWAP16_MASK) | (b & BSWAP16_MASK) << 8);
     }
     for (; i < w; i++)
-        dst[i + 0] = bswap_16(src[i + 0]);
+        AV_WN16(dst + 2 * i, bswap_16(AV_RN16(src + 2 * i)));
 }
 
 static int spdif_header_ac3(AVFormatContext *s, AVPacket *pkt)
@@ -255,7 +257,8 @@ static int spdif_write_trailer(AVFormatContext *s)
 static int spdif_write_packet(struct AVFormatContext *s, AVPacket *pkt)
 {
     IEC958Context *ctx = s->priv_data;
-    int ret, padding;
+    int ret, padding, burst_size;
+    uint8_t *buf;
 
     ctx->pkt_size = FFALIGN(pkt->size, 2) << 3;
     ret = ctx->header_info(s, pkt);
@@ -268,26 +271,33 @@ static int spdif_write_packet(struct AVFormatContext *s, AVPacket *pkt)
         return -1;
     }
 
-    put_le16(s->pb, SYNCWORD1);      //Pa
-    put_le16(s->pb, SYNCWORD2);      //Pb
-    put_le16(s->pb, ctx->data_type); //Pc
-    put_le16(s->pb, ctx->pkt_size);  //Pd
+    /* assemble the whole burst and hand it over in one call */
+    burst_size = BURST_HEADER_SIZE + FFALIGN(pkt->size, 2) + 2 * padding;
+    av_fast_malloc(&ctx->buffer, &ctx->buffer_size, burst_size);
+    if (!ctx->buffer)
+        return AVERROR(ENOMEM);
+    buf = ctx->buffer;
+
+    AV_WL16(buf + 0, SYNCWORD1);       //Pa
+    AV_WL16(buf + 2, SYNCWORD2);       //Pb
+    AV_WL16(buf + 4, ctx->data_type);  //Pc
+    AV_WL16(buf + 6, ctx->pkt_size);   //Pd
+    buf += BURST_HEADER_SIZE;
 
 #if HAVE_BIGENDIAN
-    put_buffer(s->pb, pkt->data, pkt->size & ~1);
+    memcpy(buf, pkt->data, pkt->size & ~1);
 #else
-    av_fast_malloc(&ctx->buffer, &ctx->buffer_size, pkt->size + FF_INPUT_BUFFER_PADDING_SIZE);
-    if (!ctx->buffer)
-        return AVERROR(ENOMEM);
-    bswap_buf16((uint16_t *)ctx->buffer, (uint16_t *)pkt->data, pkt->size >> 1);
-    put_buffer(s->pb, ctx->buffer, pkt->size & ~1);
+    bswap_buf16(buf, pkt->data, pkt->size >> 1);
 #endif
+    buf += pkt->size & ~1;
 
-    if (pkt->size & 1)
-        put_be16(s->pb, pkt->data[pkt->size - 1]);
+    if (pkt->size & 1) {
+        AV_WB16(buf, pkt->data[pkt->size - 1]);
+        buf += 2;
+    }
 
-    for (; padding > 0; padding--)
-        put_be16(s->pb, 0);
+    memset(buf, 0, 2 * padding);
+    put_buffer(s->pb, ctx->buffer, burst_size);
 
     av_log(s, AV_LOG_DEBUG, "type=%x len=%i pkt_offset=%i\n",
            ctx->data_type, pkt->size, ctx->pkt_offset);
@@ -55,6 +55,7 @@
 #define FLAG_SETFILL1    0x04
 
 #define AUDIO_FIFO_SIZE 65536
+#define AUDIO_MAX_FRAMES 256 /* MP3 frames waiting in the audio FIFO */
 
 /* character id used */
 #define BITMAP_ID 0
@@ -69,7 +70,8 @@ typedef struct {
     int64_t tag_pos;
     int64_t vframes_pos;
     int samples_per_frame;
-    int sound_samples;
+    int audio_frame_size[AUDIO_MAX_FRAMES]; ///< sizes of the frames in audio_fifo
+    int audio_frame_first, audio_nb_frames;
     int swf_frame_number;
     int video_frame_number;
     int frame_rate;
@@ -24,20 +24,25 @@
 #include "avformat.h"
 #include "swf.h"
 
+/* the largest short tag, header included */
+#define SWF_MAX_SHORT_TAG (2 + 0x3e)
+
+/**
+ * Start a short tag, its length is patched by put_swf_end_tag().
+ * The whole tag is kept in the I/O buffer, so that patching it never
+ * seeks in the output and works with pipes.
+ */
 static void put_swf_tag(AVFormatContext *s, int tag)
 {
     SWFContext *swf = s->priv_data;
     ByteIOContext *pb = s->pb;
 
+    if (pb->buf_end - pb->buf_ptr <= SWF_MAX_SHORT_TAG)
+        put_flush_packet(pb);
     swf->tag_pos = url_ftell(pb);
     swf->tag = tag;
     /* reserve some room for the tag */
-    if (tag & TAG_LONG) {
-        put_le16(pb, 0);
-        put_le32(pb, 0);
-    } else {
-        put_le16(pb, 0);
-    }
+    put_le16(pb, 0);
 }
 
 static void put_swf_end_tag(AVFormatContext *s)
@@ -51,17 +56,20 @@ static void put_swf_end_tag(AVFormatContext *s)
     tag_len = pos - swf->tag_pos - 2;
     tag = swf->tag;
     url_fseek(pb, swf->tag_pos, SEEK_SET);
-    if (tag & TAG_LONG) {
-        tag &= ~TAG_LONG;
-        put_le16(pb, (tag << 6) | 0x3f);
-        put_le32(pb, tag_len - 4);
-    } else {
-        assert(tag_len < 0x3f);
-        put_le16(pb, (tag << 6) | tag_len);
-    }
+    assert(tag_len < 0x3f);
+    put_le16(pb, (tag << 6) | tag_len);
     url_fseek(pb, pos, SEEK_SET);
 }
 
+/**
+ * Write the header of a long tag of len bytes, the caller writes them.
+ */
+static void put_swf_long_tag(ByteIOContext *pb, int tag, int len)
+{
+    put_le16(pb, (tag << 6) | 0x3f);
+    put_le32(pb, len);
+}
+
 static inline void max_nbits(int *nbits_ptr, int val)
 {
     int n;
@@ -179,7 +187,6 @@ static int swf_write_header(AVFormatContext *s)
     int i, width, height, rate, rate_base;
     int version;
 
-    swf->sound_samples = 0;
     swf->swf_frame_number = 0;
     swf->video_frame_number = 0;
 
@@ -330,6 +337,34 @@ static int swf_write_header(AVFormatContext *s)
     return 0;
 }
 
+/**
+ * Move the MP3 frames of about one SWF frame from the audio FIFO to a
+ * sound block, or all of them if less are waiting.
+ */
+static void swf_write_sound_block(AVFormatContext *s)
+{
+    SWFContext *swf = s->priv_data;
+    ByteIOContext *pb = s->pb;
+    int i = swf->audio_frame_first, nb_frames = 0, block_size = 0;
+
+    if (!swf->audio_nb_frames)
+        return;
+    do {
+        block_size += swf->audio_frame_size[i];
+        i = (i + 1) % AUDIO_MAX_FRAMES;
+        nb_frames++;
+    } while (nb_frames < swf->audio_nb_frames &&
+             nb_frames * swf->audio_enc->frame_size < swf->samples_per_frame);
+
+    put_swf_long_tag(pb, TAG_STREAMBLOCK, 4 + block_size);
+    put_le16(pb, nb_frames * swf->audio_enc->frame_size);
+    put_le16(pb, 0); // seek samples
+    av_fifo_generic_read(swf->audio_fifo, pb, block_size, &put_buffer);
+
+    swf->audio_frame_first = i;
+    swf->audio_nb_frames  -= nb_frames;
+}
+
 static int swf_write_video(AVFormatContext *s,
                            AVCodecContext *enc, const uint8_t *buf, int size)
 {
@@ -374,11 +409,10 @@ static int swf_write_video(AVFormatContext *s,
         }
 
         /* set video frame data */
-        put_swf_tag(s, TAG_VIDEOFRAME | TAG_LONG);
+        put_swf_long_tag(pb, TAG_VIDEOFRAME, 4 + size);
         put_le16(pb, VIDEO_ID);
         put_le16(pb, swf->video_frame_number++);
         put_buffer(pb, buf, size);
-        put_swf_end_tag(s);
     } else if (enc->codec_id == CODEC_ID_MJPEG) {
         if (swf->swf_frame_number > 0) {
             /* remove the shape */
@@ -393,7 +427,7 @@ static int swf_write_video(AVFormatContext *s,
             put_swf_end_tag(s);
         }
 
-        put_swf_tag(s, TAG_JPEG2 | TAG_LONG);
+        put_swf_long_tag(pb, TAG_JPEG2, 6 + size);
 
         put_le16(pb, BITMAP_ID); /* ID of the image */
 
@@ -402,8 +436,6 @@ static int swf_write_video(AVFormatContext *s,
         /* write the jpeg image */
         put_buffer(pb, buf, size);
 
-        put_swf_end_tag(s);
-
         /* draw the shape */
 
         put_swf_tag(s, TAG_PLACEOBJECT);
@@ -416,17 +448,8 @@ static int swf_write_video(AVFormatContext *s,
     swf->swf_frame_number++;
 
     /* streaming sound always should be placed just before showframe tags */
-    if (swf->audio_enc && av_fifo_size(swf->audio_fifo)) {
-        int frame_size = av_fifo_size(swf->audio_fifo);
-        put_swf_tag(s, TAG_STREAMBLOCK | TAG_LONG);
-        put_le16(pb, swf->sound_samples);
-        put_le16(pb, 0); // seek samples
-        av_fifo_generic_read(swf->audio_fifo, pb, frame_size, &put_buffer);
-        put_swf_end_tag(s);
-
-        /* update FIFO */
-        swf->sound_samples = 0;
-    }
+    if (swf->audio_enc)
+        swf_write_sound_block(s);
 
     /* output the frame */
     put_swf_tag(s, TAG_SHOWFRAME);
@@ -441,18 +464,31 @@ static int swf_write_audio(AVFormatContext *s,
                            AVCodecContext *enc, uint8_t *buf, int size)
 {
     SWFContext *swf = s->priv_data;
+    int dropped = 0;
 
     /* Flash Player limit */
     if (swf->swf_frame_number == 16000)
         av_log(enc, AV_LOG_INFO, "warning: Flash Player limit of 16000 frames reached\n");
 
-    if (av_fifo_size(swf->audio_fifo) + size > AUDIO_FIFO_SIZE) {
+    if (size > AUDIO_FIFO_SIZE) {
         av_log(s, AV_LOG_ERROR, "audio fifo too small to mux audio essence\n");
         return -1;
     }
 
+    /* audio running ahead of the video drops its oldest frames, so that
+       the buffering and the delay stay bounded */
+    while (swf->audio_nb_frames == AUDIO_MAX_FRAMES ||
+           av_fifo_size(swf->audio_fifo) + size > AUDIO_FIFO_SIZE) {
+        av_fifo_drain(swf->audio_fifo, swf->audio_frame_size[swf->audio_frame_first]);
+        swf->audio_frame_first = (swf->audio_frame_first + 1) % AUDIO_MAX_FRAMES;
+        swf->audio_nb_frames--;
+        dropped++;
+    }
+    if (dropped)
+        av_log(s, AV_LOG_WARNING, "audio ahead of video, %d frames dropped\n", dropped);
+
     av_fifo_generic_write(swf->audio_fifo, buf, size, NULL);
-    swf->sound_samples += enc->frame_size;
+    swf->audio_frame_size[(swf->audio_frame_first + swf->audio_nb_frames++) % AUDIO_MAX_FRAMES] = size;
 
     /* if audio only stream make sure we add swf frames */
     if (!swf->video_enc)
@@ -482,8 +518,17 @@ static int swf_write_trailer(AVFormatContext *s)
         enc = s->streams[i]->codec;
         if (enc->codec_type == CODEC_TYPE_VIDEO)
             video_enc = enc;
-        else
-            av_fifo_free(swf->audio_fifo);
+    }
+
+    /* the audio left after the last video frame gets frames of its own */
+    if (swf->audio_enc) {
+        while (swf->audio_nb_frames) {
+            swf_write_sound_block(s);
+            put_swf_tag(s, TAG_SHOWFRAME);
+            put_swf_end_tag(s);
+            swf->swf_frame_number++;
+        }
+        av_fifo_free(swf->audio_fifo);
     }
 
     put_swf_tag(s, TAG_END);
@@ -26,23 +26,180 @@
 #include <sys/select.h>
 #endif
 #include <sys/time.h>
+#if !HAVE_WINSOCK2_H
+#include <netinet/tcp.h>
+#endif
 
 typedef struct TCPContext {
     int fd;
+    int send_buffer_size;       ///< SO_SNDBUF, 0 leaves the system default and autotuning
+    int recv_buffer_size;       ///< SO_RCVBUF, 0 leaves the system default and autotuning
+    int tcp_nodelay;            ///< disable Nagle, for request/response control connections
+    int busy_poll;              ///< SO_BUSY_POLL in microseconds, 0 for none
 } TCPContext;
 
-/* return non zero if error */
+/** delay before racing the next address against the pending connects */
+#define CONNECT_ATTEMPT_DELAY 250
+#define MAX_CONNECT_ADDRS      16
+#define MAX_CONNECT_ATTEMPTS    4
+
+/**
+ * Order the resolved addresses alternating between the address families,
+ * starting with the family preferred by the resolver.
+ */
+static int sort_addrs(struct addrinfo *ai, struct addrinfo **addrs)
+{
+    struct addrinfo *cur, *first[MAX_CONNECT_ADDRS], *rest[MAX_CONNECT_ADDRS];
+    int nb_first = 0, nb_rest = 0, nb = 0, i;
+
+    for (cur = ai; cur; cur = cur->ai_next) {
+        if (cur->ai_family == ai->ai_family) {
+            if (nb_first < MAX_CONNECT_ADDRS)
+                first[nb_first++] = cur;
+        } else if (nb_rest < MAX_CONNECT_ADDRS)
+            rest[nb_rest++] = cur;
+    }
+    for (i = 0; i < FFMAX(nb_first, nb_rest); i++) {
+        if (i < nb_first && nb < MAX_CONNECT_ADDRS)
+            addrs[nb++] = first[i];
+        if (i < nb_rest  && nb < MAX_CONNECT_ADDRS)
+            addrs[nb++] = rest[i];
+    }
+    return nb;
+}
+
+/**
+ * Apply the socket options given in the URL. The buffer sizes must be set
+ * before connecting for the window scale to account for them.
+ */
+static void set_socket_options(URLContext *h, int fd)
+{
+    TCPContext *s = h->priv_data;
+
+    if (s->send_buffer_size > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &s->send_buffer_size, sizeof(s->send_buffer_size)))
+        av_log(h, AV_LOG_WARNING, "setsockopt(SO_SNDBUF): %s\n", strerror(errno));
+    if (s->recv_buffer_size > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &s->recv_buffer_size, sizeof(s->recv_buffer_size)))
+        av_log(h, AV_LOG_WARNING, "setsockopt(SO_RCVBUF): %s\n", strerror(errno));
+#ifdef TCP_NODELAY
+    if (s->tcp_nodelay &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &s->tcp_nodelay, sizeof(s->tcp_nodelay)))
+        av_log(h, AV_LOG_WARNING, "setsockopt(TCP_NODELAY): %s\n", strerror(errno));
+#endif
+#ifdef SO_BUSY_POLL
+    if (s->busy_poll > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &s->busy_poll, sizeof(s->busy_poll)))
+        av_log(h, AV_LOG_WARNING, "setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
+#endif
+}
+
+/**
+ * Start a non blocking connect.
+ * @return 1 if connected, 0 if in progress, <0 on error
+ */
+static int start_connect(URLContext *h, struct addrinfo *ai, int *fdp)
+{
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+    *fdp = -1;
+    if (fd < 0)
+        return AVERROR(EIO);
+    ff_socket_nonblock(fd, 1);
+    set_socket_options(h, fd);
+
+    while (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        if (ff_neterrno() == FF_NETERROR(EINTR))
+            continue;
+        if (ff_neterrno() != FF_NETERROR(EINPROGRESS) &&
+            ff_neterrno() != FF_NETERROR(EAGAIN)) {
+            closesocket(fd);
+            return AVERROR(EIO);
+        }
+        *fdp = fd;
+        return 0;
+    }
+    *fdp = fd;
+    return 1;
+}
+
+/**
+ * Connect to the first of the addresses that answers. A new attempt is
+ * started whenever the pending ones did not complete within
+ * CONNECT_ATTEMPT_DELAY ms or one of them failed, so that an unreachable
+ * address family or host does not hold up the connection.
+ * @return the connected socket or <0 on error
+ */
+static int connect_parallel(URLContext *h, struct addrinfo **addrs, int nb_addrs)
+{
+    struct pollfd p[MAX_CONNECT_ATTEMPTS + 1];
+    int nb_pending = 0, next = 0, fd = -1, ret, err, i;
+    socklen_t optlen;
+
+    for (;;) {
+        if (next < nb_addrs && nb_pending < MAX_CONNECT_ATTEMPTS) {
+            ret = start_connect(h, addrs[next++], &fd);
+            if (ret > 0)
+                break;
+            if (ret == 0) {
+                p[nb_pending].fd     = fd;
+                p[nb_pending].events = POLLOUT;
+                nb_pending++;
+            }
+            fd = -1;
+            if (ret < 0 || !nb_pending)
+                continue;
+        }
+        if (!nb_pending) {
+            ret = AVERROR(EIO);
+            break;
+        }
+
+        for (i = 0; i < nb_pending; i++)
+            p[i].revents = 0;
+        ret = ff_network_poll(h->interrupt, p, nb_pending,
+                              next < nb_addrs && nb_pending < MAX_CONNECT_ATTEMPTS ?
+                              CONNECT_ATTEMPT_DELAY : -1);
+        if (ret < 0)
+            break;
+
+        for (i = 0; i < nb_pending && fd < 0; i++) {
+            if (!p[i].revents)
+                continue;
+            optlen = sizeof(err);
+            if (getsockopt(p[i].fd, SOL_SOCKET, SO_ERROR, &err, &optlen) || err) {
+                closesocket(p[i].fd);
+                p[i--] = p[--nb_pending];
+                continue;
+            }
+            fd = p[i].fd;
+            p[i] = p[--nb_pending];
+        }
+        if (fd >= 0)
+            break;
+    }
+
+    for (i = 0; i < nb_pending; i++)
+        closesocket(p[i].fd);
+    return fd >= 0 ? fd : ret;
+}
+
+/**
+ * Open a TCP connection. Options can be appended to the URL:
+ * tcp://host:port?send_buffer_size=n&recv_buffer_size=n&tcp_nodelay=1&busy_poll=us
+ * By default the system buffer sizes and autotuning, which suit bulk
+ * transfers, are kept; low latency request/response protocols enable
+ * tcp_nodelay.
+ * @return non zero if error
+ */
 static int tcp_open(URLContext *h, const char *uri, int flags)
 {
-    struct addrinfo hints, *ai, *cur_ai;
-    int port, fd = -1;
+    struct addrinfo hints, *ai, *addrs[MAX_CONNECT_ADDRS];
+    int port, fd, nb_addrs;
     TCPContext *s = NULL;
-    fd_set wfds;
-    int fd_max, ret;
-    struct timeval tv;
-    socklen_t optlen;
     char hostname[1024],proto[1024],path[1024];
-    char portstr[10];
+    char portstr[10], buf[256];
+    const char *p;
 
     if(!ff_network_init())
         return AVERROR(EIO);
@@ -56,134 +213,84 @@ static int tcp_open(URLContext *h, const char *uri, int flags)
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     snprintf(portstr, sizeof(portstr), "%d", port);
-    if (getaddrinfo(hostname, portstr, &hints, &ai))
+    if (ff_getaddrinfo_cached(hostname, portstr, &hints, &ai))
         return AVERROR(EIO);
 
-    cur_ai = ai;
-
- restart:
-    fd = socket(cur_ai->ai_family, cur_ai->ai_socktype, cur_ai->ai_protocol);
-    if (fd < 0)
-        goto fail;
-    ff_socket_nonblock(fd, 1);
-
- redo:
-    ret = connect(fd, cur_ai->ai_addr, cur_ai->ai_addrlen);
-    if (ret < 0) {
-        if (ff_neterrno() == FF_NETERROR(EINTR))
-            goto redo;
-        if (ff_neterrno() != FF_NETERROR(EINPROGRESS) &&
-            ff_neterrno() != FF_NETERROR(EAGAIN))
-            goto fail;
-
-        /* wait until we are connected or until abort */
-        for(;;) {
-            if (url_interrupt_cb()) {
-                ret = AVERROR(EINTR);
-                goto fail1;
-            }
-            fd_max = fd;
-            FD_ZERO(&wfds);
-            FD_SET(fd, &wfds);
-            tv.tv_sec = 0;
-            tv.tv_usec = 100 * 1000;
-            ret = select(fd_max + 1, NULL, &wfds, NULL, &tv);
-            if (ret > 0 && FD_ISSET(fd, &wfds))
-                break;
-        }
-
-        /* test error */
-        optlen = sizeof(ret);
-        getsockopt (fd, SOL_SOCKET, SO_ERROR, &ret, &optlen);
-        if (ret != 0)
-            goto fail;
-    }
-    s = av_malloc(sizeof(TCPContext));
+    s = av_mallocz(sizeof(TCPContext));
     if (!s) {
-        freeaddrinfo(ai);
+        ff_freeaddrinfo_cached(ai);
         return AVERROR(ENOMEM);
     }
     h->priv_data = s;
+
+    p = strchr(uri, '?');
+    if (p) {
+        if (find_info_tag(buf, sizeof(buf), "send_buffer_size", p))
+            s->send_buffer_size = strtol(buf, NULL, 10);
+        if (find_info_tag(buf, sizeof(buf), "recv_buffer_size", p))
+            s->recv_buffer_size = strtol(buf, NULL, 10);
+        if (find_info_tag(buf, sizeof(buf), "tcp_nodelay", p))
+            s->tcp_nodelay = !!strtol(buf, NULL, 10);
+        if (find_info_tag(buf, sizeof(buf), "busy_poll", p))
+            s->busy_poll = strtol(buf, NULL, 10);
+    }
+
+    nb_addrs = sort_addrs(ai, addrs);
+    fd = connect_parallel(h, addrs, nb_addrs);
+    ff_freeaddrinfo_cached(ai);
+    if (fd < 0) {
+        av_freep(&h->priv_data);
+        return fd;
+    }
+
     h->is_streamed = 1;
     s->fd = fd;
-    freeaddrinfo(ai);
     return 0;
-
- fail:
-    if (cur_ai->ai_next) {
-        /* Retry with the next sockaddr */
-        cur_ai = cur_ai->ai_next;
-        if (fd >= 0)
-            closesocket(fd);
-        goto restart;
-    }
-    ret = AVERROR(EIO);
- fail1:
-    if (fd >= 0)
-        closesocket(fd);
-    freeaddrinfo(ai);
-    return ret;
 }
 
 static int tcp_read(URLContext *h, uint8_t *buf, int size)
 {
     TCPContext *s = h->priv_data;
-    int len, fd_max, ret;
-    fd_set rfds;
-    struct timeval tv;
+    int len, ret;
+    struct pollfd p[2];
 
     for (;;) {
-        if (url_interrupt_cb())
-            return AVERROR(EINTR);
-        fd_max = s->fd;
-        FD_ZERO(&rfds);
-        FD_SET(s->fd, &rfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100 * 1000;
-        ret = select(fd_max + 1, &rfds, NULL, NULL, &tv);
-        if (ret > 0 && FD_ISSET(s->fd, &rfds)) {
-            len = recv(s->fd, buf, size, 0);
-            if (len < 0) {
-                if (ff_neterrno() != FF_NETERROR(EINTR) &&
-                    ff_neterrno() != FF_NETERROR(EAGAIN))
-                    return AVERROR(ff_neterrno());
-            } else return len;
-        } else if (ret < 0) {
-            return -1;
-        }
+        p[0].fd     = s->fd;
+        p[0].events = POLLIN;
+        ret = ff_network_poll(h->interrupt, p, 1, -1);
+        if (ret < 0)
+            return ret;
+        len = recv(s->fd, buf, size, 0);
+        if (len < 0) {
+            if (ff_neterrno() != FF_NETERROR(EINTR) &&
+                ff_neterrno() != FF_NETERROR(EAGAIN))
+                return AVERROR(ff_neterrno());
+        } else return len;
     }
 }
 
 static int tcp_write(URLContext *h, uint8_t *buf, int size)
 {
     TCPContext *s = h->priv_data;
-    int ret, size1, fd_max, len;
-    fd_set wfds;
-    struct timeval tv;
+    int ret, size1, len;
+    struct pollfd p[2];
 
     size1 = size;
     while (size > 0) {
-        if (url_interrupt_cb())
-            return AVERROR(EINTR);
-        fd_max = s->fd;
-        FD_ZERO(&wfds);
-        FD_SET(s->fd, &wfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100 * 1000;
-        ret = select(fd_max + 1, NULL, &wfds, NULL, &tv);
-        if (ret > 0 && FD_ISSET(s->fd, &wfds)) {
-            len = send(s->fd, buf, size, 0);
-            if (len < 0) {
-                if (ff_neterrno() != FF_NETERROR(EINTR) &&
-                    ff_neterrno() != FF_NETERROR(EAGAIN))
-                    return AVERROR(ff_neterrno());
-                continue;
-            }
-            size -= len;
-            buf += len;
-        } else if (ret < 0) {
-            return -1;
+        p[0].fd     = s->fd;
+        p[0].events = POLLOUT;
+        ret = ff_network_poll(h->interrupt, p, 1, -1);
+        if (ret < 0)
+            return ret;
+        len = send(s->fd, buf, size, 0);
+        if (len < 0) {
+            if (ff_neterrno() != FF_NETERROR(EINTR) &&
+                ff_neterrno() != FF_NETERROR(EAGAIN))
+                return AVERROR(ff_neterrno());
+            continue;
         }
+        size -= len;
+        buf += len;
     }
     return size1 - size;
 }
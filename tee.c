@@ -0,0 +1,303 @@
+/*
+ * Tee pseudo-muxer
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/tee.c
+ * Tee pseudo-muxer, writing the same packets to several outputs.
+ *
+ * The filename lists the outputs separated by '|', each optionally
+ * preceded by options in brackets separated by ':', e.g.
+ * "[f=mpegts]udp://239.0.0.1:1234|[f=mp4:block=1]out.mp4". Options are
+ * f, the format of the output, queue, the bytes of packets queued for its
+ * muxing thread, and block=1 to wait for a full queue to drain rather
+ * than drop packets, for outputs that must be complete.
+ *
+ * Every output shares the payload of the packets and is muxed by its own
+ * thread (see mux_queue_size), so that a slow output only drops its own
+ * packets, until the next key frame of the stream, instead of stalling
+ * the others. An output that fails is closed and the others go on.
+ */
+
+#include "libavutil/avstring.h"
+#include "avformat.h"
+#include "internal.h"
+
+#define TEE_QUEUE_SIZE (4 << 20)
+
+typedef struct TeeSlave {
+    AVFormatContext *avf;
+    int block;          ///< wait while the queue of the output is full
+    int *need_key;      ///< per stream, set after a dropped packet
+    int64_t dropped;
+    int error;          ///< first error of the output, which is not written to anymore
+} TeeSlave;
+
+typedef struct TeeContext {
+    TeeSlave *slaves;
+    int nb_slaves;
+} TeeContext;
+
+static void copy_metadata(AVMetadata **dst, AVMetadata *src)
+{
+    AVMetadataTag *tag = NULL;
+
+    while ((tag = av_metadata_get(src, "", tag, AV_METADATA_IGNORE_SUFFIX)))
+        av_metadata_set2(dst, tag->key, tag->value, 0);
+}
+
+/**
+ * Parses the options in brackets at the start of spec.
+ * @return the filename following them
+ */
+static char *parse_slave_options(AVFormatContext *s, char *spec,
+                                 const char **format, int *queue, int *block)
+{
+    char *end, *opt, *val;
+
+    if (*spec != '[')
+        return spec;
+    if (!(end = strchr(spec, ']')))
+        return NULL;
+    *end = 0;
+    for (opt = spec + 1; opt && *opt; opt = val) {
+        char *next = strchr(opt, ':');
+
+        if (next)
+            *next++ = 0;
+        if ((val = strchr(opt, '=')))
+            *val++ = 0;
+        if (!val) {
+            av_log(s, AV_LOG_ERROR, "Missing value of tee option '%s'\n", opt);
+            return NULL;
+        }
+        if (!strcmp(opt, "f"))
+            *format = val;
+        else if (!strcmp(opt, "queue"))
+            *queue = atoi(val);
+        else if (!strcmp(opt, "block"))
+            *block = atoi(val);
+        else
+            av_log(s, AV_LOG_WARNING, "Unknown tee option '%s'\n", opt);
+        val = next;
+    }
+    return end + 1;
+}
+
+static int open_slave(AVFormatContext *s, TeeSlave *sl, char *spec)
+{
+    AVFormatContext *avf;
+    AVOutputFormat *fmt;
+    const char *format = NULL;
+    char *filename;
+    int queue = TEE_QUEUE_SIZE, i, ret;
+
+    if (!(filename = parse_slave_options(s, spec, &format, &queue, &sl->block)))
+        return AVERROR(EINVAL);
+    if (!(fmt = av_guess_format(format, format ? NULL : filename, NULL))) {
+        av_log(s, AV_LOG_ERROR, "Could not find the format of tee output '%s'\n", filename);
+        return AVERROR(EINVAL);
+    }
+    if (!(avf = sl->avf = avformat_alloc_context()) ||
+        !(sl->need_key = av_mallocz(s->nb_streams * sizeof(*sl->need_key))))
+        return AVERROR(ENOMEM);
+    avf->oformat            = fmt;
+    avf->flags              = s->flags;
+    avf->max_delay          = s->max_delay;
+    avf->mux_queue_size     = queue;
+    avf->mux_queue_duration = s->mux_queue_duration;
+    av_strlcpy(avf->filename, filename, sizeof(avf->filename));
+    copy_metadata(&avf->metadata, s->metadata);
+
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *ist = s->streams[i], *st;
+
+        if (!(st = av_new_stream(avf, ist->id)))
+            return AVERROR(ENOMEM);
+        /* the payload and the codec settings are shared, not copied */
+        *st->codec              = *ist->codec;
+        st->time_base           = ist->time_base;
+        st->sample_aspect_ratio = ist->sample_aspect_ratio;
+        st->r_frame_rate        = ist->r_frame_rate;
+        st->disposition         = ist->disposition;
+        copy_metadata(&st->metadata, ist->metadata);
+    }
+
+    if ((ret = av_set_parameters(avf, NULL)) < 0)
+        return ret;
+    if (!(fmt->flags & AVFMT_NOFILE) &&
+        (ret = url_fopen(&avf->pb, filename, URL_WRONLY)) < 0) {
+        av_log(s, AV_LOG_ERROR, "Could not open tee output '%s'\n", filename);
+        return ret;
+    }
+    return av_write_header(avf);
+}
+
+static void close_slave(TeeSlave *sl)
+{
+    AVFormatContext *avf = sl->avf;
+    int i;
+
+    if (!avf)
+        return;
+    if (avf->pb && !(avf->oformat->flags & AVFMT_NOFILE))
+        url_fclose(avf->pb);
+    for (i = 0; i < avf->nb_streams; i++) {
+        av_metadata_free(&avf->streams[i]->metadata);
+        av_freep(&avf->streams[i]->priv_data);
+        av_freep(&avf->streams[i]->codec);
+        av_freep(&avf->streams[i]);
+    }
+    av_metadata_free(&avf->metadata);
+    av_freep(&avf->priv_data);
+    av_freep(&sl->avf);
+    av_freep(&sl->need_key);
+}
+
+static int tee_write_trailer(AVFormatContext *s)
+{
+    TeeContext *tee = s->priv_data;
+    int i, ret, err = 0;
+
+    for (i = 0; i < tee->nb_slaves; i++) {
+        TeeSlave *sl = &tee->slaves[i];
+
+        if (sl->avf && (ret = av_write_trailer(sl->avf)) < 0 && !sl->error)
+            sl->error = ret;
+        if (sl->error && !err)
+            err = sl->error;
+        if (sl->dropped)
+            av_log(s, AV_LOG_INFO, "%"PRId64" packets dropped for tee output '%s'\n",
+                   sl->dropped, sl->avf ? sl->avf->filename : "");
+        close_slave(sl);
+    }
+    av_freep(&tee->slaves);
+    tee->nb_slaves = 0;
+    return err;
+}
+
+static int tee_write_header(AVFormatContext *s)
+{
+    TeeContext *tee = s->priv_data;
+    char *specs, *spec, *next;
+    int ret = 0;
+
+    if (!(specs = av_strdup(s->filename)))
+        return AVERROR(ENOMEM);
+    for (spec = specs; spec; spec = next) {
+        TeeSlave *sl;
+        void *tmp;
+
+        if ((next = strchr(spec, '|')))
+            *next++ = 0;
+        if (!*spec)
+            continue;
+        tmp = av_realloc(tee->slaves, (tee->nb_slaves + 1) * sizeof(*tee->slaves));
+        if (!tmp) {
+            ret = AVERROR(ENOMEM);
+            break;
+        }
+        tee->slaves = tmp;
+        sl = &tee->slaves[tee->nb_slaves++];
+        memset(sl, 0, sizeof(*sl));
+        if ((ret = open_slave(s, sl, spec)) < 0) {
+            /* only the outputs whose header was written get a trailer */
+            close_slave(sl);
+            tee->nb_slaves--;
+            break;
+        }
+    }
+    av_free(specs);
+    if (!ret && !tee->nb_slaves) {
+        av_log(s, AV_LOG_ERROR, "No tee outputs in '%s'\n", s->filename);
+        ret = AVERROR(EINVAL);
+    }
+    if (ret < 0)
+        tee_write_trailer(s);
+    return ret;
+}
+
+static int tee_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    TeeContext *tee = s->priv_data;
+    AVStream *ist = s->streams[pkt->stream_index];
+    int i, ret, alive = 0, err = 0;
+
+    for (i = 0; i < tee->nb_slaves; i++) {
+        TeeSlave *sl = &tee->slaves[i];
+        AVStream *st;
+        AVPacket ref;
+
+        if (sl->error) {
+            err = sl->error;
+            continue;
+        }
+        alive++;
+        /* the following frames would not decode without the dropped ones */
+        if (sl->need_key[pkt->stream_index] && !(pkt->flags & PKT_FLAG_KEY)) {
+            sl->dropped++;
+            continue;
+        }
+        if ((ret = ff_packet_ref(&ref, pkt)) < 0)
+            return ret;
+        st = sl->avf->streams[pkt->stream_index];
+        if (ref.pts != AV_NOPTS_VALUE)
+            ref.pts = av_rescale_q(ref.pts, ist->time_base, st->time_base);
+        if (ref.dts != AV_NOPTS_VALUE)
+            ref.dts = av_rescale_q(ref.dts, ist->time_base, st->time_base);
+        ref.duration = av_rescale_q(ref.duration, ist->time_base, st->time_base);
+
+        if (sl->block)
+            ret = av_interleaved_write_frame(sl->avf, &ref);
+        else
+            ret = ff_interleaved_write_frame_nonblock(sl->avf, &ref);
+        /* frees the reference unless the muxer took it */
+        av_free_packet(&ref);
+
+        if (ret == AVERROR(EAGAIN)) {
+            if (!sl->dropped)
+                av_log(s, AV_LOG_WARNING, "Tee output '%s' is too slow, dropping packets\n",
+                       sl->avf->filename);
+            sl->dropped++;
+            sl->need_key[pkt->stream_index] = 1;
+        } else if (ret < 0) {
+            av_log(s, AV_LOG_ERROR, "Error %d writing tee output '%s', closing it\n",
+                   ret, sl->avf->filename);
+            sl->error = err = ret;
+            alive--;
+        } else
+            sl->need_key[pkt->stream_index] = 0;
+    }
+    return alive ? 0 : err;
+}
+
+AVOutputFormat tee_muxer = {
+    "tee",
+    NULL_IF_CONFIG_SMALL("multiple outputs"),
+    NULL,
+    "",
+    sizeof(TeeContext),
+    CODEC_ID_NONE,
+    CODEC_ID_NONE,
+    tee_write_header,
+    tee_write_packet,
+    tee_write_trailer,
+    .flags = AVFMT_NOFILE,
+};
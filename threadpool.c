@@ -0,0 +1,347 @@
+/*
+ * Worker threads shared by the threaded features
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/threadpool.c
+ * One pool of threads runs the tasks of all contexts. Every context has
+ * its own task queue; a thread going idle looks at the live queues first
+ * and starts from the queue after the last one served, so that no context
+ * starves another one of the same priority. The threads are detached, a
+ * thread exits by itself when the pool is made smaller.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* Needed for pthread_setaffinity_np() */
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include "avformat.h"
+#include "threadpool.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+
+#define MAX_POOL_THREADS 64
+#define MAX_POOL_CPUS    256
+
+typedef struct FFTask {
+    struct FFTask *next;
+    void *job;
+} FFTask;
+
+struct FFTaskQueue {
+    struct FFTaskQueue *next;   ///< in the list of the queues of its priority
+    enum FFTaskPriority priority;
+    void (*func)(void *opaque, void *job);
+    void *opaque;
+    int max_running;
+    int nb_running;
+    FFTask *first, *last;       ///< tasks not started yet
+    FFTask *free_tasks;
+    pthread_cond_t cond;        ///< signaled when a task of the queue is done
+};
+
+/** protects everything below and the task lists of all queues */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/** signaled when a task is queued or the pool is made smaller */
+static pthread_cond_t  pool_cond = PTHREAD_COND_INITIALIZER;
+static FFTaskQueue *queues[FF_TASK_NB_PRIORITIES];
+/** queue looked at first by the next idle thread, NULL for the first one */
+static FFTaskQueue *next_queue[FF_TASK_NB_PRIORITIES];
+static int pool_size;           ///< threads wanted, 0 until set
+static int nb_threads;          ///< threads running
+static int nb_started;
+static int cpus[MAX_POOL_CPUS]; ///< the threads are bound to these in turn
+static int nb_cpus;
+
+static int default_pool_size(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0)
+        return FFMIN(n, MAX_POOL_THREADS);
+#endif
+    return 4;
+}
+
+static void set_affinity(pthread_t thread, int cpu)
+{
+#ifdef CPU_SET
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+#endif
+}
+
+/* pool_lock must be held */
+static FFTaskQueue *pick_queue(void)
+{
+    int i;
+
+    for (i = 0; i < FF_TASK_NB_PRIORITIES; i++) {
+        FFTaskQueue *start = next_queue[i] ? next_queue[i] : queues[i];
+        FFTaskQueue *q = start;
+
+        if (!q)
+            continue;
+        do {
+            if (q->first && q->nb_running < q->max_running) {
+                next_queue[i] = q->next;
+                return q;
+            }
+            q = q->next ? q->next : queues[i];
+        } while (q != start);
+    }
+    return NULL;
+}
+
+/* runs the first task of q, pool_lock must be held */
+static void run_task(FFTaskQueue *q)
+{
+    FFTask *t = q->first;
+    void *job = t->job;
+
+    if (!(q->first = t->next))
+        q->last = NULL;
+    t->next       = q->free_tasks;
+    q->free_tasks = t;
+    q->nb_running++;
+    pthread_mutex_unlock(&pool_lock);
+
+    q->func(q->opaque, job);
+
+    pthread_mutex_lock(&pool_lock);
+    q->nb_running--;
+    pthread_cond_broadcast(&q->cond);
+}
+
+static void *pool_worker(void *arg)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (nb_threads <= pool_size) {
+        FFTaskQueue *q = pick_queue();
+        if (q)
+            run_task(q);
+        else
+            pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    nb_threads--;
+    /* the wakeup may have been meant for a task */
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/* starts or stops threads to match pool_size, pool_lock must be held */
+static void resize_pool(void)
+{
+    pthread_attr_t attr;
+
+    if (!pool_size)
+        pool_size = default_pool_size();
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (nb_threads < pool_size) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, &attr, pool_worker, NULL))
+            break;
+        if (nb_cpus)
+            set_affinity(thread, cpus[nb_started % nb_cpus]);
+        nb_started++;
+        nb_threads++;
+    }
+    pthread_attr_destroy(&attr);
+    if (nb_threads > pool_size)
+        pthread_cond_broadcast(&pool_cond);
+}
+
+static int parse_cpus(int *list, const char *p)
+{
+    int n = 0;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+
+        if (end == p || first < 0)
+            return AVERROR(EINVAL);
+        if (*end == '-') {
+            p    = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return AVERROR(EINVAL);
+        }
+        for (; first <= last; first++) {
+            if (n == MAX_POOL_CPUS)
+                return AVERROR(EINVAL);
+            list[n++] = first;
+        }
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return AVERROR(EINVAL);
+    }
+    return n;
+}
+
+static enum FFTaskPriority task_priority(AVFormatContext *s)
+{
+    if (s && (s->flags & (AVFMT_FLAG_LOW_DELAY | AVFMT_FLAG_CLOCK_RECOVERY) ||
+              (s->iformat && s->pb && url_is_streamed(s->pb))))
+        return FF_TASK_LIVE;
+    return FF_TASK_BATCH;
+}
+
+FFTaskQueue *ff_task_queue_alloc(AVFormatContext *s,
+                                 void (*func)(void *opaque, void *job),
+                                 void *opaque, int max_running)
+{
+    FFTaskQueue *q = av_mallocz(sizeof(*q));
+
+    if (!q)
+        return NULL;
+    q->priority    = task_priority(s);
+    q->func        = func;
+    q->opaque      = opaque;
+    q->max_running = FFMAX(max_running, 1);
+    pthread_cond_init(&q->cond, NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    resize_pool();
+    if (!nb_threads) {
+        pthread_mutex_unlock(&pool_lock);
+        pthread_cond_destroy(&q->cond);
+        av_free(q);
+        return NULL;
+    }
+    q->next = queues[q->priority];
+    queues[q->priority] = q;
+    pthread_mutex_unlock(&pool_lock);
+    return q;
+}
+
+int ff_task_queue_submit(FFTaskQueue *q, void *job)
+{
+    FFTask *t;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((t = q->free_tasks))
+        q->free_tasks = t->next;
+    else if (!(t = av_malloc(sizeof(*t)))) {
+        pthread_mutex_unlock(&pool_lock);
+        return AVERROR(ENOMEM);
+    }
+    t->job  = job;
+    t->next = NULL;
+    if (q->last)
+        q->last->next = t;
+    else
+        q->first = t;
+    q->last = t;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+}
+
+void ff_task_queue_wait(FFTaskQueue *q)
+{
+    pthread_mutex_lock(&pool_lock);
+    while (q->first || q->nb_running) {
+        if (q->first && q->nb_running < q->max_running)
+            run_task(q);
+        else
+            pthread_cond_wait(&q->cond, &pool_lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+int ff_thread_pool_size(void)
+{
+    int size;
+
+    pthread_mutex_lock(&pool_lock);
+    size = pool_size ? pool_size : default_pool_size();
+    pthread_mutex_unlock(&pool_lock);
+    return size;
+}
+
+void ff_task_queue_free(FFTaskQueue **pq)
+{
+    FFTaskQueue *q = *pq, **p;
+    FFTask *t;
+
+    if (!q)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    while ((t = q->first)) {
+        q->first = t->next;
+        av_free(t);
+    }
+    q->last = NULL;
+    while (q->nb_running)
+        pthread_cond_wait(&q->cond, &pool_lock);
+    for (p = &queues[q->priority]; *p != q; p = &(*p)->next)
+        ;
+    *p = q->next;
+    if (next_queue[q->priority] == q)
+        next_queue[q->priority] = q->next;
+    pthread_mutex_unlock(&pool_lock);
+
+    while ((t = q->free_tasks)) {
+        q->free_tasks = t->next;
+        av_free(t);
+    }
+    pthread_cond_destroy(&q->cond);
+    av_freep(pq);
+}
+#endif
+
+int av_thread_pool_init(int threads, const char *cpu_list)
+{
+#if HAVE_PTHREADS
+    int list[MAX_POOL_CPUS], n = 0;
+
+    if (threads < 0)
+        return AVERROR(EINVAL);
+    if (cpu_list && (n = parse_cpus(list, cpu_list)) < 0)
+        return n;
+
+    pthread_mutex_lock(&pool_lock);
+    memcpy(cpus, list, n * sizeof(*list));
+    nb_cpus    = n;
+    nb_started = 0;
+    if (threads)
+        pool_size = FFMIN(threads, MAX_POOL_THREADS);
+    else
+        pool_size = n ? FFMIN(n, MAX_POOL_THREADS) : default_pool_size();
+    /* the pool is started by the first queue */
+    if (nb_threads)
+        resize_pool();
+    pthread_mutex_unlock(&pool_lock);
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
@@ -0,0 +1,80 @@
+/*
+ * Worker threads shared by the threaded features
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_THREADPOOL_H
+#define AVFORMAT_THREADPOOL_H
+
+#include "avformat.h"
+
+enum FFTaskPriority {
+    FF_TASK_LIVE,               ///< tasks of live input, run first
+    FF_TASK_BATCH,
+    FF_TASK_NB_PRIORITIES,
+};
+
+/**
+ * Queue of the tasks of one context. The tasks of a queue are started in
+ * the order they were submitted, on any thread of the pool; idle threads
+ * take the tasks of the live queues first, and of the queues of the same
+ * priority in turn.
+ */
+typedef struct FFTaskQueue FFTaskQueue;
+
+/**
+ * Allocate a task queue, starting the threads of the pool if needed.
+ * Only available with HAVE_PTHREADS.
+ * @param s           context the tasks work for, it gives their priority,
+ *                    NULL for batch priority
+ * @param func        run for each task with opaque and the job submitted,
+ *                    must not wait for other tasks
+ * @param max_running maximum number of tasks of the queue run at the same
+ *                    time, 1 runs them one after the other
+ * @return NULL if out of memory or if no thread could be started, the
+ *         caller should do the work itself then
+ */
+FFTaskQueue *ff_task_queue_alloc(AVFormatContext *s,
+                                 void (*func)(void *opaque, void *job),
+                                 void *opaque, int max_running);
+
+/**
+ * Queue a task running func(opaque, job).
+ * @return 0 or AVERROR(ENOMEM)
+ */
+int ff_task_queue_submit(FFTaskQueue *q, void *job);
+
+/**
+ * Wait until all tasks submitted to q are done. The calling thread runs
+ * the tasks not started yet itself.
+ */
+void ff_task_queue_wait(FFTaskQueue *q);
+
+/**
+ * @return the number of threads of the pool once started
+ */
+int ff_thread_pool_size(void);
+
+/**
+ * Free a task queue and set *q to NULL. The tasks not started yet are
+ * dropped, the running ones are waited for.
+ */
+void ff_task_queue_free(FFTaskQueue **q);
+
+#endif /* AVFORMAT_THREADPOOL_H */
@@ -89,6 +89,17 @@ double ff_timefilter_update(TimeFilter *self, double system_time, double period)
  */
 void ff_timefilter_reset(TimeFilter *);
 
+/**
+ * Evaluate the filtered time at a moment relative to the last update
+ *
+ * @param delta the time since the last update, in clock_periods
+ *
+ * @return the filtered time ff_timefilter_update() would return for an
+ * update delta clock_periods after the last one, in seconds, without
+ * updating the filter
+ */
+double ff_timefilter_eval(TimeFilter *self, double delta);
+
 /**
  * Free all resources associated with the filter
  */
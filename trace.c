@@ -0,0 +1,209 @@
+/*
+ * Packet lifecycle tracing
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file libavformat/trace.c
+ * Trace events are recorded into a ring per thread, written only by that
+ * thread, so recording takes no lock. A ring is taken from the list of
+ * rings once per thread and given back when the thread exits, keeping its
+ * events for export.
+ */
+
+#include "avformat.h"
+#include "trace.h"
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+typedef struct TraceEvent {
+    int64_t ts;
+    int64_t dur;
+    int64_t id;
+    int64_t dts;
+    int64_t pos;
+    const char *name;
+    int stream_index;
+    int size;
+    char ph;
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent *events;
+    unsigned int size;
+    volatile unsigned int count; ///< events recorded, the last size of them are kept
+    int tid;
+    int in_use;                 ///< owned by a running thread
+    struct TraceRing *next;
+} TraceRing;
+
+int ff_trace_enabled;
+
+static unsigned int ring_size;
+static TraceRing *rings;
+static int nb_rings;
+
+#if HAVE_PTHREADS
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+static void release_ring(void *arg)
+{
+    TraceRing *r = arg;
+
+    pthread_mutex_lock(&rings_lock);
+    r->in_use = 0;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+}
+#else
+static TraceRing *thread_ring;
+#endif
+
+static TraceRing *get_ring(void)
+{
+    TraceRing *r;
+
+#if HAVE_PTHREADS
+    pthread_once(&key_once, make_key);
+    if ((r = pthread_getspecific(ring_key)))
+        return r;
+    pthread_mutex_lock(&rings_lock);
+#else
+    if (thread_ring)
+        return thread_ring;
+#endif
+    /* reuse the ring of a thread that exited */
+    for (r = rings; r && (r->in_use || r->size != ring_size); r = r->next);
+    if (r) {
+        r->count = 0;
+    } else if ((r = av_mallocz(sizeof(*r)))) {
+        if ((r->events = av_malloc(ring_size * sizeof(*r->events)))) {
+            r->size = ring_size;
+            r->tid  = ++nb_rings;
+            r->next = rings;
+            rings   = r;
+        } else
+            av_freep(&r);
+    }
+    if (r)
+        r->in_use = 1;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&rings_lock);
+    if (r)
+        pthread_setspecific(ring_key, r);
+#else
+    thread_ring = r;
+#endif
+    return r;
+}
+
+void ff_trace_event(char ph, const char *name, int64_t start, int64_t id,
+                    int stream_index, int64_t dts, int64_t pos, int size)
+{
+    TraceRing *r = get_ring();
+    TraceEvent *e;
+    int64_t now = av_gettime();
+
+    if (!r)
+        return;
+    e = &r->events[r->count % r->size];
+    e->ts           = ph == 'X' ? start : now;
+    e->dur          = ph == 'X' ? now - start : 0;
+    e->id           = id;
+    e->dts          = dts;
+    e->pos          = pos;
+    e->name         = name;
+    e->stream_index = stream_index;
+    e->size         = size;
+    e->ph           = ph;
+    r->count++;
+}
+
+int av_trace_start(int nb_events)
+{
+    TraceRing *r;
+
+    if (nb_events <= 0 || nb_events > INT_MAX / sizeof(TraceEvent))
+        return AVERROR(EINVAL);
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&rings_lock);
+#endif
+    ring_size = nb_events;
+    for (r = rings; r; r = r->next)
+        r->count = 0;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&rings_lock);
+#endif
+    ff_trace_enabled = 1;
+    return 0;
+}
+
+void av_trace_stop(void)
+{
+    ff_trace_enabled = 0;
+}
+
+int av_trace_export(ByteIOContext *pb)
+{
+    TraceRing *r;
+    unsigned int i, n;
+    int first = 1;
+
+    url_fprintf(pb, "{\"traceEvents\":[");
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&rings_lock);
+#endif
+    for (r = rings; r; r = r->next) {
+        unsigned int count = r->count;
+
+        n = FFMIN(count, r->size);
+        for (i = count - n; i != count; i++) {
+            const TraceEvent *e = &r->events[i % r->size];
+
+            url_fprintf(pb, "%s\n{\"name\":\"%s\",\"cat\":\"lavf\",\"ph\":\"%c\","
+                        "\"ts\":%"PRId64",\"pid\":1,\"tid\":%d",
+                        first ? "" : ",", e->name, e->ph, e->ts, r->tid);
+            if (e->ph == 'X')
+                url_fprintf(pb, ",\"dur\":%"PRId64, e->dur);
+            else if (e->ph == 'i')
+                url_fprintf(pb, ",\"s\":\"t\"");
+            else
+                url_fprintf(pb, ",\"id\":\"0x%"PRIx64"\"", e->id);
+            url_fprintf(pb, ",\"args\":{\"stream\":%d,\"size\":%d,\"pos\":%"PRId64,
+                        e->stream_index, e->size, e->pos);
+            if (e->dts != AV_NOPTS_VALUE)
+                url_fprintf(pb, ",\"dts\":%"PRId64, e->dts);
+            url_fprintf(pb, "}}");
+            first = 0;
+        }
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&rings_lock);
+#endif
+    url_fprintf(pb, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    put_flush_packet(pb);
+    return url_ferror(pb);
+}
@@ -0,0 +1,69 @@
+/*
+ * Packet lifecycle tracing
+ * Copyright (c) 2009 The FFmpeg Project
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_TRACE_H
+#define AVFORMAT_TRACE_H
+
+#include <stdint.h>
+#include "avformat.h"
+
+/** nonzero between av_trace_start() and av_trace_stop() */
+extern int ff_trace_enabled;
+
+/**
+ * Record a trace event into the ring of the calling thread.
+ * @param ph          Chrome trace event phase: 'X' for a span starting at
+ *                    start and ending now, 'b'/'e' for the begin and end of
+ *                    a packet stage matched by id, 'i' for an instant
+ * @param name        stage name, must be a static string
+ * @param start       av_gettime() at the start of an 'X' span, ignored else
+ * @param id          packet identifier, see ff_trace_id()
+ * @param stream_index stream of the packet, -1 if none
+ */
+void ff_trace_event(char ph, const char *name, int64_t start, int64_t id,
+                    int stream_index, int64_t dts, int64_t pos, int size);
+
+/**
+ * Identify a packet across the stages by its stream and dts, or the file
+ * position for stages before the timestamps are known.
+ */
+static inline int64_t ff_trace_id(int stream_index, int64_t key)
+{
+    return ((int64_t)(stream_index + 1) << 48) ^ (key & ((1LL << 48) - 1));
+}
+
+#define FF_TRACE(ph, name, start, id, stream_index, dts, pos, size)     \
+    do {                                                                \
+        if (ff_trace_enabled)                                           \
+            ff_trace_event(ph, name, start, id, stream_index, dts, pos, size); \
+    } while (0)
+
+/** trace a stage of a packet identified by its dts, or position if it has none */
+#define FF_TRACE_PACKET(ph, name, start, pkt)                           \
+    FF_TRACE(ph, name, start,                                           \
+             ff_trace_id((pkt)->stream_index, (pkt)->dts != AV_NOPTS_VALUE ? \
+                                              (pkt)->dts : (pkt)->pos), \
+             (pkt)->stream_index, (pkt)->dts, (pkt)->pos, (pkt)->size)
+
+/** av_gettime() if tracing, for the start of an 'X' span */
+#define FF_TRACE_START() (ff_trace_enabled ? av_gettime() : 0)
+
+#endif /* AVFORMAT_TRACE_H */
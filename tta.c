@@ -21,6 +21,7 @@
 
 #include "libavcodec/get_bits.h"
 #include "avformat.h"
+#include "internal.h"
 #include "id3v2.h"
 #include "id3v1.h"
 
@@ -51,8 +52,7 @@ static int tta_read_header(AVFormatContext *s, AVFormatParameters *ap)
     uint64_t framepos, start_offset;
 
     ff_id3v2_read(s);
-    if (!av_metadata_get(s->metadata, "", NULL, AV_METADATA_IGNORE_SUFFIX))
-        ff_id3v1_read(s);
+    ff_read_tail_tags(s, ff_id3v1_read_fallback);
 
     start_offset = url_ftell(s->pb);
     if (get_le32(s->pb) != AV_RL32("TTA1"))
@@ -94,6 +94,10 @@ static int tta_read_header(AVFormatContext *s, AVFormatParameters *ap)
 
     framepos = url_ftell(s->pb) + 4*c->totalframes + 4;
 
+    /* one entry per frame with a constant duration, delta coding keeps
+     * the seek table of long files small */
+    if (ff_index_enable_compact(st) < 0)
+        return AVERROR(ENOMEM);
     for (i = 0; i < c->totalframes; i++) {
         uint32_t size = get_le32(s->pb);
         av_add_index_entry(st, framepos, i*framelen, size, 0, AVINDEX_KEYFRAME);
@@ -124,16 +128,16 @@ static int tta_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     TTAContext *c = s->priv_data;
     AVStream *st = s->streams[0];
-    int size, ret;
-
-    // FIXME!
-    if (c->currentframe > c->totalframes)
-        return -1;
+    const AVIndexEntry *ie;
+    int ret;
 
-    size = st->index_entries[c->currentframe].size;
+    if (c->currentframe >= c->totalframes ||
+        !(ie = ff_index_get_entry(st, c->currentframe)))
+        return AVERROR(EIO);
 
-    ret = av_get_packet(s->pb, pkt, size);
-    pkt->dts = st->index_entries[c->currentframe++].timestamp;
+    ret = av_get_packet(s->pb, pkt, ie->size);
+    pkt->dts = ie->timestamp;
+    c->currentframe++;
     return ret;
 }
 
@@ -142,11 +146,12 @@ static int tta_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp
     TTAContext *c = s->priv_data;
     AVStream *st = s->streams[stream_index];
     int index = av_index_search_timestamp(st, timestamp, flags);
-    if (index < 0)
+    const AVIndexEntry *ie = ff_index_get_entry(st, index);
+    if (!ie)
         return -1;
 
     c->currentframe = index;
-    url_fseek(s->pb, st->index_entries[index].pos, SEEK_SET);
+    url_fseek(s->pb, ie->pos, SEEK_SET);
 
     return 0;
 }
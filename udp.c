@@ -25,14 +25,23 @@
  */
 
 #define _BSD_SOURCE     /* Needed for using struct ip_mreq with recent glibc */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* Needed for recvmmsg() and sendmmsg() */
+#endif
 #include "avformat.h"
+#include "libavutil/fifo.h"
+#include "libavutil/intreadwrite.h"
 #include <unistd.h>
 #include "network.h"
 #include "os_support.h"
+#include "internal.h"
 #if HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
 #include <sys/time.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #ifndef IPV6_ADD_MEMBERSHIP
 #define IPV6_ADD_MEMBERSHIP IPV6_JOIN_GROUP
@@ -45,19 +54,63 @@
 #define IN6_IS_ADDR_MULTICAST(a) (((uint8_t *) (a))[0] == 0xff)
 #endif
 
+#define UDP_TX_BUF_SIZE 32768
+#define UDP_MAX_PKT_SIZE 65536
+/** maximum number of datagrams fetched at once by the receiver thread */
+#define UDP_RECV_BATCH 32
+/** maximum number of datagrams queued for a single sendmmsg() */
+#define UDP_SEND_BATCH_MAX 64
+/** size of the datagram and arrival time stored in front of each fifo entry */
+#define UDP_FIFO_HDR_SIZE 12
+
+#if !HAVE_WINSOCK2_H && (defined(SO_TIMESTAMPNS) || defined(SO_RXQ_OVFL))
+#define UDP_RX_INFO 1
+/** room for the SO_TIMESTAMPNS and SO_RXQ_OVFL control messages, in uint64_t */
+#define UDP_CMSG_SIZE 16
+#else
+#define UDP_RX_INFO 0
+#endif
+
 typedef struct {
     int udp_fd;
     int ttl;
     int buffer_size;
+    int busy_poll;
     int is_multicast;
     int local_port;
     int reuse_socket;
     struct sockaddr_storage dest_addr;
     int dest_addr_len;
-} UDPContext;
 
-#define UDP_TX_BUF_SIZE 32768
-#define UDP_MAX_PKT_SIZE 65536
+    /* receiver thread and circular buffer */
+    int fifo_size;
+    AVFifoBuffer *fifo;
+    int fifo_error;
+    int dropped, dropped_reported;
+
+    /* kernel receive information */
+    int rx_info;                ///< request arrival times and overrun counts from the kernel
+    uint32_t kernel_dropped;    ///< datagrams dropped in the socket buffer, from SO_RXQ_OVFL
+    int64_t arrival_time;       ///< arrival of the datagram last returned by udp_read()
+#if HAVE_PTHREADS
+    pthread_t receiver;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int receiver_started;
+    int exit_receiver;
+#endif
+
+    /* batched and paced sending */
+    int burst;                  ///< number of datagrams sent per system call
+    int batch;                  ///< queue datagrams until ff_udp_end_batch()
+    uint8_t *tx_buf;
+    int tx_max;                 ///< number of datagrams tx_buf can hold
+    int tx_len[UDP_SEND_BATCH_MAX];
+    int tx_count;
+    int64_t bitrate;            ///< output pacing rate in bits per second, 0 to disable
+    int64_t tx_start;           ///< av_gettime() of the start of the pacing period
+    int64_t tx_bytes;           ///< bytes sent since tx_start
+} UDPContext;
 
 static int udp_set_multicast_ttl(int sockfd, int mcastTTL,
                                  struct sockaddr *addr)
@@ -158,7 +211,7 @@ static struct addrinfo* udp_resolve_host(const char *hostname, int port,
     hints.ai_socktype = type;
     hints.ai_family   = family;
     hints.ai_flags = flags;
-    if ((error = getaddrinfo(node, service, &hints, &res))) {
+    if ((error = ff_getaddrinfo_cached(node, service, &hints, &res))) {
         av_log(NULL, AV_LOG_ERROR, "udp_resolve_host: %s\n", gai_strerror(error));
     }
 
@@ -175,7 +228,7 @@ static int udp_set_url(struct sockaddr_storage *addr,
     if (res0 == 0) return AVERROR(EIO);
     memcpy(addr, res0->ai_addr, res0->ai_addrlen);
     addr_len = res0->ai_addrlen;
-    freeaddrinfo(res0);
+    ff_freeaddrinfo_cached(res0);
 
     return addr_len;
 }
@@ -218,7 +271,7 @@ static int udp_socket_create(UDPContext *s,
     memcpy(addr, res->ai_addr, res->ai_addrlen);
     *addr_len = res->ai_addrlen;
 
-    freeaddrinfo(res0);
+    ff_freeaddrinfo_cached(res0);
 
     return udp_fd;
 
@@ -226,7 +279,7 @@ static int udp_socket_create(UDPContext *s,
     if (udp_fd >= 0)
         closesocket(udp_fd);
     if(res0)
-        freeaddrinfo(res0);
+        ff_freeaddrinfo_cached(res0);
     return -1;
 }
 
@@ -243,6 +296,221 @@ static int udp_port(struct sockaddr_storage *addr, int addr_len)
 }
 
 
+#if UDP_RX_INFO
+/**
+ * Take the arrival time and the socket buffer overrun count from the
+ * control messages of a received datagram.
+ */
+static void udp_parse_rx_info(UDPContext *s, struct msghdr *msg, int64_t *arrival)
+{
+    struct cmsghdr *cm;
+
+    for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET)
+            continue;
+#ifdef SO_TIMESTAMPNS
+        if (cm->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            *arrival = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+        }
+#endif
+#ifdef SO_RXQ_OVFL
+        if (cm->cmsg_type == SO_RXQ_OVFL)
+            memcpy(&s->kernel_dropped, CMSG_DATA(cm), sizeof(s->kernel_dropped));
+#endif
+    }
+}
+#endif
+
+/**
+ * Receive one datagram, with its kernel arrival time if rx_info is set.
+ */
+static int udp_recv(UDPContext *s, uint8_t *buf, int size, int64_t *arrival)
+{
+    int len;
+#if UDP_RX_INFO
+    if (s->rx_info) {
+        uint64_t cmsg[UDP_CMSG_SIZE];
+        struct iovec iov;
+        struct msghdr msg;
+
+        iov.iov_base = buf;
+        iov.iov_len  = size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = cmsg;
+        msg.msg_controllen = sizeof(cmsg);
+        len = recvmsg(s->udp_fd, &msg, 0);
+        *arrival = av_gettime();
+        if (len >= 0)
+            udp_parse_rx_info(s, &msg, arrival);
+        return len;
+    }
+#endif
+    len = recv(s->udp_fd, buf, size, 0);
+    *arrival = av_gettime();
+    return len;
+}
+
+#if HAVE_PTHREADS
+static void *udp_receiver_thread(void *arg)
+{
+    URLContext *h = arg;
+    UDPContext *s = h->priv_data;
+    int slot_size = h->max_packet_size;
+    uint8_t *buf = av_malloc(UDP_RECV_BATCH * slot_size);
+    int lens[UDP_RECV_BATCH];
+    int64_t arrivals[UDP_RECV_BATCH];
+    int i;
+#if HAVE_RECVMMSG
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iov[UDP_RECV_BATCH];
+#if UDP_RX_INFO
+    uint64_t cmsgs[UDP_RECV_BATCH][UDP_CMSG_SIZE];
+#endif
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < UDP_RECV_BATCH; i++) {
+        iov[i].iov_base = buf + i * slot_size;
+        iov[i].iov_len  = slot_size;
+        msgs[i].msg_hdr.msg_iov    = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    if (!buf) {
+        pthread_mutex_lock(&s->mutex);
+        s->fifo_error = AVERROR(ENOMEM);
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+        return NULL;
+    }
+
+    while (!s->exit_receiver) {
+        fd_set rfds;
+        struct timeval tv;
+        int n, ret;
+
+        FD_ZERO(&rfds);
+        FD_SET(s->udp_fd, &rfds);
+        tv.tv_sec  = 0;
+        tv.tv_usec = 100 * 1000;
+        ret = select(s->udp_fd + 1, &rfds, NULL, NULL, &tv);
+        if (ret < 0 && ff_neterrno() != FF_NETERROR(EINTR))
+            goto fail;
+        if (ret <= 0)
+            continue;
+
+#if HAVE_RECVMMSG
+#if UDP_RX_INFO
+        for (i = 0; i < UDP_RECV_BATCH && s->rx_info; i++) {
+            msgs[i].msg_hdr.msg_control    = cmsgs[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
+        }
+#endif
+        n = recvmmsg(s->udp_fd, msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+        for (i = 0; i < n; i++) {
+            lens[i]     = msgs[i].msg_len;
+            arrivals[i] = av_gettime();
+#if UDP_RX_INFO
+            if (s->rx_info)
+                udp_parse_rx_info(s, &msgs[i].msg_hdr, &arrivals[i]);
+#endif
+        }
+#else
+        lens[0] = udp_recv(s, buf, slot_size, &arrivals[0]);
+        n = lens[0] < 0 ? lens[0] : 1;
+#endif
+        if (n < 0) {
+            if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
+                ff_neterrno() != FF_NETERROR(EINTR))
+                goto fail;
+            continue;
+        }
+
+        pthread_mutex_lock(&s->mutex);
+        for (i = 0; i < n; i++) {
+            int len = lens[i];
+            uint8_t hdr[UDP_FIFO_HDR_SIZE];
+
+            /* datagrams are stored with their size and arrival in front */
+            if (av_fifo_space(s->fifo) < len + UDP_FIFO_HDR_SIZE) {
+                s->dropped++;
+                continue;
+            }
+            AV_WL32(hdr, len);
+            AV_WL64(hdr + 4, arrivals[i]);
+            av_fifo_generic_write(s->fifo, hdr, UDP_FIFO_HDR_SIZE, NULL);
+            av_fifo_generic_write(s->fifo, buf + i * slot_size, len, NULL);
+        }
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->mutex);
+    }
+    av_free(buf);
+    return NULL;
+
+fail:
+    pthread_mutex_lock(&s->mutex);
+    s->fifo_error = AVERROR(EIO);
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    av_free(buf);
+    return NULL;
+}
+
+static int udp_read_fifo(URLContext *h, uint8_t *buf, int size)
+{
+    UDPContext *s = h->priv_data;
+    int ret;
+
+    pthread_mutex_lock(&s->mutex);
+    for (;;) {
+        if (av_fifo_size(s->fifo)) {
+            uint8_t hdr[UDP_FIFO_HDR_SIZE];
+            int len;
+
+            av_fifo_generic_read(s->fifo, hdr, UDP_FIFO_HDR_SIZE, NULL);
+            len = AV_RL32(hdr);
+            s->arrival_time = AV_RL64(hdr + 4);
+            ret = FFMIN(len, size);
+            av_fifo_generic_read(s->fifo, buf, ret, NULL);
+            av_fifo_drain(s->fifo, len - ret);
+            break;
+        }
+        if (s->fifo_error) {
+            ret = s->fifo_error;
+            break;
+        }
+        if ((ret = ff_check_interrupt(h->interrupt)) < 0) {
+            break;
+        } else {
+            struct timeval now;
+            struct timespec t;
+            int64_t wake;
+
+            gettimeofday(&now, NULL);
+            wake = now.tv_sec * 1000000LL + now.tv_usec + 100000;
+            if (h->interrupt && h->interrupt->deadline)
+                wake = FFMIN(wake, h->interrupt->deadline);
+            t.tv_sec  = wake / 1000000;
+            t.tv_nsec = wake % 1000000 * 1000;
+            pthread_cond_timedwait(&s->cond, &s->mutex, &t);
+        }
+    }
+    if (s->dropped != s->dropped_reported) {
+        av_log(NULL, AV_LOG_WARNING,
+               "udp: circular buffer full, %d datagrams dropped\n",
+               s->dropped - s->dropped_reported);
+        s->dropped_reported = s->dropped;
+    }
+    h->stats.dropped = s->dropped + s->kernel_dropped;
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+#endif
+
 /**
  * If no filename is given to av_open_input_file because you want to
  * get the local port first, then you must call this function to set
@@ -253,6 +521,15 @@ static int udp_port(struct sockaddr_storage *addr, int addr_len)
  *         'localport=n' : set the local port
  *         'pkt_size=n'  : set max packet size
  *         'reuse=1'     : enable reusing the socket
+ *         'fifo_size=n' : receive in a separate thread into a circular
+ *                         buffer of n 188 byte units (input only)
+ *         'burst=n'     : queue n datagrams and send them at once (output only)
+ *         'bitrate=n'   : pace the output to n bits per second
+ *         'buffer_size=n' : set the socket send or receive buffer size
+ *         'busy_poll=n' : busy poll the device queue for n microseconds
+ *                         on blocking receives (Linux only)
+ *         'timestamps=1': take the datagram arrival times from the kernel and
+ *                         count socket buffer overruns (input only, Linux only)
  *
  * @param s1 media file context
  * @param uri of the remote server
@@ -328,6 +605,7 @@ static int udp_open(URLContext *h, const char *uri, int flags)
 
     h->priv_data = s;
     s->ttl = 16;
+    s->arrival_time = AV_NOPTS_VALUE;
     s->buffer_size = is_output ? UDP_TX_BUF_SIZE : UDP_MAX_PKT_SIZE;
 
     p = strchr(uri, '?');
@@ -345,6 +623,21 @@ static int udp_open(URLContext *h, const char *uri, int flags)
         if (find_info_tag(buf, sizeof(buf), "buffer_size", p)) {
             s->buffer_size = strtol(buf, NULL, 10);
         }
+        if (find_info_tag(buf, sizeof(buf), "fifo_size", p)) {
+            s->fifo_size = strtol(buf, NULL, 10) * 188;
+        }
+        if (find_info_tag(buf, sizeof(buf), "burst", p)) {
+            s->burst = av_clip(strtol(buf, NULL, 10), 1, UDP_SEND_BATCH_MAX);
+        }
+        if (find_info_tag(buf, sizeof(buf), "bitrate", p)) {
+            s->bitrate = strtoll(buf, NULL, 10);
+        }
+        if (find_info_tag(buf, sizeof(buf), "busy_poll", p)) {
+            s->busy_poll = strtol(buf, NULL, 10);
+        }
+        if (find_info_tag(buf, sizeof(buf), "timestamps", p)) {
+            s->rx_info = !!strtol(buf, NULL, 10);
+        }
     }
 
     /* fill the dest addr */
@@ -411,13 +704,57 @@ static int udp_open(URLContext *h, const char *uri, int flags)
         }
         /* make the socket non-blocking */
         ff_socket_nonblock(udp_fd, 1);
+#if UDP_RX_INFO
+        if (s->rx_info) {
+            tmp = 1;
+#ifdef SO_TIMESTAMPNS
+            if (setsockopt(udp_fd, SOL_SOCKET, SO_TIMESTAMPNS, &tmp, sizeof(tmp)) < 0)
+                av_log(NULL, AV_LOG_WARNING, "setsockopt(SO_TIMESTAMPNS): %s\n", strerror(errno));
+#endif
+#ifdef SO_RXQ_OVFL
+            if (setsockopt(udp_fd, SOL_SOCKET, SO_RXQ_OVFL, &tmp, sizeof(tmp)) < 0)
+                av_log(NULL, AV_LOG_WARNING, "setsockopt(SO_RXQ_OVFL): %s\n", strerror(errno));
+#endif
+        }
+#endif
     }
+#ifdef SO_BUSY_POLL
+    if (s->busy_poll > 0 &&
+        setsockopt(udp_fd, SOL_SOCKET, SO_BUSY_POLL, &s->busy_poll, sizeof(s->busy_poll)) < 0)
+        av_log(NULL, AV_LOG_WARNING, "setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
+#endif
 
     s->udp_fd = udp_fd;
+
+    if (is_output && s->burst > 1) {
+        s->tx_buf = av_malloc(s->burst * h->max_packet_size);
+        if (!s->tx_buf)
+            goto fail;
+        s->tx_max = s->burst;
+    }
+
+#if HAVE_PTHREADS
+    if (!is_output && s->fifo_size > 0) {
+        s->fifo = av_fifo_alloc(s->fifo_size);
+        if (!s->fifo)
+            goto fail;
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        if (pthread_create(&s->receiver, NULL, udp_receiver_thread, h)) {
+            av_log(NULL, AV_LOG_ERROR, "udp: could not start receiver thread\n");
+            pthread_cond_destroy(&s->cond);
+            pthread_mutex_destroy(&s->mutex);
+            goto fail;
+        }
+        s->receiver_started = 1;
+    }
+#endif
     return 0;
  fail:
     if (udp_fd >= 0)
         closesocket(udp_fd);
+    av_fifo_free(s->fifo);
+    av_free(s->tx_buf);
     av_free(s);
     return AVERROR(EIO);
 }
@@ -426,23 +763,21 @@ static int udp_read(URLContext *h, uint8_t *buf, int size)
 {
     UDPContext *s = h->priv_data;
     int len;
-    fd_set rfds;
+    struct pollfd p[2];
     int ret;
-    struct timeval tv;
+
+#if HAVE_PTHREADS
+    if (s->receiver_started)
+        return udp_read_fifo(h, buf, size);
+#endif
 
     for(;;) {
-        if (url_interrupt_cb())
-            return AVERROR(EINTR);
-        FD_ZERO(&rfds);
-        FD_SET(s->udp_fd, &rfds);
-        tv.tv_sec = 0;
-        tv.tv_usec = 100 * 1000;
-        ret = select(s->udp_fd + 1, &rfds, NULL, NULL, &tv);
+        p[0].fd     = s->udp_fd;
+        p[0].events = POLLIN;
+        ret = ff_network_poll(h->interrupt, p, 1, -1);
         if (ret < 0)
-            return AVERROR(EIO);
-        if (!(ret > 0 && FD_ISSET(s->udp_fd, &rfds)))
-            continue;
-        len = recv(s->udp_fd, buf, size, 0);
+            return ret;
+        len = udp_recv(s, buf, size, &s->arrival_time);
         if (len < 0) {
             if (ff_neterrno() != FF_NETERROR(EAGAIN) &&
                 ff_neterrno() != FF_NETERROR(EINTR))
@@ -451,12 +786,70 @@ static int udp_read(URLContext *h, uint8_t *buf, int size)
             break;
         }
     }
+    h->stats.dropped = s->kernel_dropped;
     return len;
 }
 
-static int udp_write(URLContext *h, uint8_t *buf, int size)
+/**
+ * Get the arrival time of the datagram last read from an udp: input.
+ * It is the kernel receive time with the timestamps URL option, the time
+ * it was fetched from the socket otherwise.
+ * @return time in av_gettime() units, AV_NOPTS_VALUE if h is not an udp
+ *         input or nothing was read yet
+ */
+int64_t ff_udp_get_arrival_time(URLContext *h)
+{
+    UDPContext *s;
+
+    if (!h || !h->prot || strcmp(h->prot->name, "udp") || (h->flags & URL_WRONLY))
+        return AV_NOPTS_VALUE;
+    s = h->priv_data;
+    return s->arrival_time;
+}
+
+/**
+ * Set the output pacing rate of an udp: URLContext, e.g. from the
+ * mux rate of a constant bitrate muxer, unless one was given in the URL.
+ * @return 0 on success, AVERROR(EINVAL) if h is not an udp output
+ */
+int udp_set_bitrate(URLContext *h, int64_t bitrate)
+{
+    UDPContext *s;
+
+    if (!h || strcmp(h->prot->name, "udp") || !(h->flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+    s = h->priv_data;
+    if (!s->bitrate)
+        s->bitrate = bitrate;
+    return 0;
+}
+
+/**
+ * Sleep until size more bytes can be sent without exceeding the
+ * configured bitrate.
+ */
+static void udp_pace(UDPContext *s, int size)
+{
+    int64_t now, target;
+
+    if (s->bitrate <= 0)
+        return;
+    now = av_gettime();
+    if (!s->tx_start)
+        s->tx_start = now;
+    target = s->tx_start + s->tx_bytes * 8000000 / s->bitrate;
+    if (target > now) {
+        usleep(target - now);
+    } else if (now - target > 1000000) {
+        /* the writer stalled, do not try to catch up with a burst */
+        s->tx_start = now;
+        s->tx_bytes = 0;
+    }
+    s->tx_bytes += size;
+}
+
+static int udp_send(UDPContext *s, const uint8_t *buf, int size)
 {
-    UDPContext *s = h->priv_data;
     int ret;
 
     for(;;) {
@@ -474,14 +867,166 @@ static int udp_write(URLContext *h, uint8_t *buf, int size)
     return size;
 }
 
+/**
+ * Send count queued datagrams, starting with the first one.
+ */
+static int udp_send_queue(URLContext *h, int first, int count)
+{
+    UDPContext *s = h->priv_data;
+    int i;
+#if HAVE_SENDMMSG
+    struct mmsghdr msgs[UDP_SEND_BATCH_MAX];
+    struct iovec iov[UDP_SEND_BATCH_MAX];
+
+    memset(msgs, 0, count * sizeof(*msgs));
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = s->tx_buf + (first + i) * h->max_packet_size;
+        iov[i].iov_len  = s->tx_len[first + i];
+        msgs[i].msg_hdr.msg_name    = &s->dest_addr;
+        msgs[i].msg_hdr.msg_namelen = s->dest_addr_len;
+        msgs[i].msg_hdr.msg_iov     = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen  = 1;
+    }
+    i = 0;
+    while (i < count) {
+        int ret = sendmmsg(s->udp_fd, msgs + i, count - i, 0);
+        if (ret < 0) {
+            if (ff_neterrno() != FF_NETERROR(EINTR) &&
+                ff_neterrno() != FF_NETERROR(EAGAIN))
+                return AVERROR(EIO);
+        } else {
+            i += ret;
+        }
+    }
+#else
+    for (i = first; i < first + count; i++) {
+        if (udp_send(s, s->tx_buf + i * h->max_packet_size, s->tx_len[i]) < 0)
+            return AVERROR(EIO);
+    }
+#endif
+    return 0;
+}
+
+static int udp_flush_queue(URLContext *h)
+{
+    UDPContext *s = h->priv_data;
+    int i, ret, total = 0;
+
+    if (!s->tx_count)
+        return 0;
+    for (i = 0; i < s->tx_count; i++)
+        total += s->tx_len[i];
+    udp_pace(s, total);
+
+    ret = udp_send_queue(h, 0, s->tx_count);
+    s->tx_count = 0;
+    return ret;
+}
+
+/**
+ * Queue the datagrams written to an udp: output from now on, so that
+ * ff_udp_end_batch() sends them with as few system calls as possible.
+ * Datagrams are sent earlier only if UDP_SEND_BATCH_MAX are queued.
+ * @return 0 on success, AVERROR(EINVAL) if h is not an udp output
+ */
+int ff_udp_start_batch(URLContext *h)
+{
+    UDPContext *s;
+    int ret;
+
+    if (!h || strcmp(h->prot->name, "udp") || !(h->flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+    s = h->priv_data;
+    if (s->tx_max < UDP_SEND_BATCH_MAX) {
+        if ((ret = udp_flush_queue(h)) < 0)
+            return ret;
+        av_free(s->tx_buf);
+        s->tx_max = 0;
+        s->tx_buf = av_malloc(UDP_SEND_BATCH_MAX * h->max_packet_size);
+        if (!s->tx_buf)
+            return AVERROR(ENOMEM);
+        s->tx_max = UDP_SEND_BATCH_MAX;
+    }
+    s->batch = 1;
+    return 0;
+}
+
+/**
+ * Send the datagrams queued since ff_udp_start_batch().
+ * @param duration if positive, spread the datagrams evenly over that many
+ *                 microseconds instead of sending them at once; the call
+ *                 then returns when the last ones have been sent
+ * @return 0 on success, a negative value on error
+ */
+int ff_udp_end_batch(URLContext *h, int64_t duration)
+{
+    UDPContext *s;
+    int64_t start;
+    int i, n, group, ret = 0;
+
+    if (!h || strcmp(h->prot->name, "udp") || !(h->flags & URL_WRONLY))
+        return AVERROR(EINVAL);
+    s = h->priv_data;
+    s->batch = 0;
+    if (duration <= 0 || s->tx_count < 2)
+        return udp_flush_queue(h);
+
+    /* datagrams due in the same millisecond go out together */
+    start = av_gettime();
+    group = FFMAX(1, s->tx_count * 1000LL / duration);
+    for (i = 0; i < s->tx_count; i += n) {
+        int64_t target = start + duration * i / s->tx_count;
+        int64_t now    = av_gettime();
+        if (target > now)
+            usleep(target - now);
+        n = FFMIN(group, s->tx_count - i);
+        if ((ret = udp_send_queue(h, i, n)) < 0)
+            break;
+    }
+    s->tx_count = 0;
+    return ret;
+}
+
+static int udp_write(URLContext *h, uint8_t *buf, int size)
+{
+    UDPContext *s = h->priv_data;
+    int ret;
+
+    if (!s->tx_buf || (!s->batch && s->burst < 2) || size > h->max_packet_size) {
+        if ((ret = udp_flush_queue(h)) < 0)
+            return ret;
+        udp_pace(s, size);
+        return udp_send(s, buf, size);
+    }
+
+    memcpy(s->tx_buf + s->tx_count * h->max_packet_size, buf, size);
+    s->tx_len[s->tx_count++] = size;
+    if ((s->tx_count == s->tx_max || (!s->batch && s->tx_count == s->burst)) &&
+        (ret = udp_flush_queue(h)) < 0)
+        return ret;
+    return size;
+}
+
 static int udp_close(URLContext *h)
 {
     UDPContext *s = h->priv_data;
 
+#if HAVE_PTHREADS
+    if (s->receiver_started) {
+        s->exit_receiver = 1;
+        pthread_join(s->receiver, NULL);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mutex);
+    }
+#endif
+    if (s->tx_buf)
+        udp_flush_queue(h);
     if (s->is_multicast && !(h->flags & URL_WRONLY))
         udp_leave_multicast_group(s->udp_fd, (struct sockaddr *)&s->dest_addr);
     closesocket(s->udp_fd);
     ff_network_close();
+    av_fifo_free(s->fifo);
+    av_free(s->tx_buf);
     av_free(s);
     return 0;
 }
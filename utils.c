@@ -22,11 +22,17 @@
 #include "internal.h"
 #include "libavcodec/opt.h"
 #include "metadata.h"
+#include "registry.h"
 #include "libavutil/avstring.h"
 #include "riff.h"
+#include "threadpool.h"
+#include "trace.h"
 #include <sys/time.h>
 #include <time.h>
 #include <strings.h>
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
 
 #undef NDEBUG
 #include <assert.h>
@@ -107,6 +113,13 @@ AVInputFormat *first_iformat = NULL;
 /** head of registered output format linked list */
 AVOutputFormat *first_oformat = NULL;
 
+/* lookup tables over the registered formats, the lists are searched
+ * instead if an entry could not be added */
+static FFRegistry iformat_names;
+static FFRegistry oformat_names, oformat_mime_types, oformat_extensions;
+static int nb_iformats, nb_oformats;
+static int iformat_registry_failed, oformat_registry_failed;
+
 AVInputFormat  *av_iformat_next(AVInputFormat  *f)
 {
     if(f) return f->next;
@@ -126,6 +139,11 @@ void av_register_input_format(AVInputFormat *format)
     while (*p != NULL) p = &(*p)->next;
     *p = format;
     format->next = NULL;
+
+    if (format->name &&
+        ff_registry_add_list(&iformat_names, format->name, format, nb_iformats) < 0)
+        iformat_registry_failed = 1;
+    nb_iformats++;
 }
 
 void av_register_output_format(AVOutputFormat *format)
@@ -135,6 +153,18 @@ void av_register_output_format(AVOutputFormat *format)
     while (*p != NULL) p = &(*p)->next;
     *p = format;
     format->next = NULL;
+
+    if ((format->name &&
+         ff_registry_add(&oformat_names, format->name, strlen(format->name),
+                         format, nb_oformats) < 0) ||
+        (format->mime_type &&
+         ff_registry_add(&oformat_mime_types, format->mime_type,
+                         strlen(format->mime_type), format, nb_oformats) < 0) ||
+        (format->extensions &&
+         ff_registry_add_list(&oformat_extensions, format->extensions,
+                              format, nb_oformats) < 0))
+        oformat_registry_failed = 1;
+    nb_oformats++;
 }
 
 #if LIBAVFORMAT_VERSION_MAJOR < 53
@@ -197,6 +227,44 @@ AVOutputFormat *guess_format(const char *short_name, const char *filename,
 }
 #endif
 
+static int guess_format_score(AVOutputFormat *fmt, const char *short_name,
+                              const char *filename, const char *mime_type)
+{
+    int score = 0;
+
+    if (fmt->name && short_name && !strcmp(fmt->name, short_name))
+        score += 100;
+    if (fmt->mime_type && mime_type && !strcmp(fmt->mime_type, mime_type))
+        score += 10;
+    if (filename && fmt->extensions &&
+        av_match_ext(filename, fmt->extensions)) {
+        score += 5;
+    }
+    return score;
+}
+
+/**
+ * Score the formats of the registry entries matching key, keeping the
+ * first registered of the best ones like the list walk does.
+ */
+static void guess_format_entries(FFRegistry *r, const char *key, int match_case,
+                                 const char *short_name, const char *filename,
+                                 const char *mime_type, AVOutputFormat **fmt_found,
+                                 int *score_max, int *index_found)
+{
+    FFRegistryEntry *e = NULL;
+
+    while ((e = ff_registry_find(r, key, match_case, e))) {
+        int score = guess_format_score(e->item, short_name, filename, mime_type);
+        if (score > *score_max ||
+            (score == *score_max && score && e->index < *index_found)) {
+            *score_max   = score;
+            *fmt_found   = e->item;
+            *index_found = e->index;
+        }
+    }
+}
+
 AVOutputFormat *av_guess_format(const char *short_name, const char *filename,
                                 const char *mime_type)
 {
@@ -214,17 +282,24 @@ AVOutputFormat *av_guess_format(const char *short_name, const char *filename,
     /* Find the proper file type. */
     fmt_found = NULL;
     score_max = 0;
+    if (!oformat_registry_failed) {
+        const char *ext = filename ? strrchr(filename, '.') : NULL;
+        int index_found = INT_MAX;
+
+        if (short_name)
+            guess_format_entries(&oformat_names, short_name, 1, short_name,
+                                 filename, mime_type, &fmt_found, &score_max, &index_found);
+        if (mime_type)
+            guess_format_entries(&oformat_mime_types, mime_type, 1, short_name,
+                                 filename, mime_type, &fmt_found, &score_max, &index_found);
+        if (ext)
+            guess_format_entries(&oformat_extensions, ext + 1, 0, short_name,
+                                 filename, mime_type, &fmt_found, &score_max, &index_found);
+        return fmt_found;
+    }
     fmt = first_oformat;
     while (fmt != NULL) {
-        score = 0;
-        if (fmt->name && short_name && !strcmp(fmt->name, short_name))
-            score += 100;
-        if (fmt->mime_type && mime_type && !strcmp(fmt->mime_type, mime_type))
-            score += 10;
-        if (filename && fmt->extensions &&
-            av_match_ext(filename, fmt->extensions)) {
-            score += 5;
-        }
+        score = guess_format_score(fmt, short_name, filename, mime_type);
         if (score > score_max) {
             score_max = score;
             fmt_found = fmt;
@@ -277,6 +352,14 @@ enum CodecID av_guess_codec(AVOutputFormat *fmt, const char *short_name,
 AVInputFormat *av_find_input_format(const char *short_name)
 {
     AVInputFormat *fmt;
+
+    if (!iformat_registry_failed) {
+        FFRegistryEntry *e;
+        if (!short_name)
+            return NULL;
+        e = ff_registry_find(&iformat_names, short_name, 0, NULL);
+        return e ? e->item : NULL;
+    }
     for(fmt = first_iformat; fmt != NULL; fmt = fmt->next) {
         if (match_format(short_name, fmt->name))
             return fmt;
@@ -305,6 +388,79 @@ int av_get_packet(ByteIOContext *s, AVPacket *pkt, int size)
     return ret;
 }
 
+static void packet_allocator_destruct(AVPacket *pkt)
+{
+    AVPacketAllocator *allocator = pkt->priv;
+
+    allocator->free(allocator->opaque, pkt->data);
+    pkt->data = NULL;
+    pkt->size = 0;
+}
+
+int ff_new_packet(AVFormatContext *s, AVPacket *pkt, int size)
+{
+    AVPacketAllocator *allocator = s->packet_allocator;
+    uint8_t *data;
+
+    if (!allocator)
+        return av_new_packet(pkt, size);
+    if ((unsigned)size >= (unsigned)size + FF_INPUT_BUFFER_PADDING_SIZE ||
+        !(data = allocator->alloc(allocator->opaque, size + FF_INPUT_BUFFER_PADDING_SIZE)))
+        return AVERROR(ENOMEM);
+    av_init_packet(pkt);
+    memset(data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data     = data;
+    pkt->size     = size;
+    pkt->priv     = allocator;
+    pkt->destruct = packet_allocator_destruct;
+    return 0;
+}
+
+int ff_get_packet(AVFormatContext *s, ByteIOContext *pb, AVPacket *pkt, int size)
+{
+    int ret;
+
+    if (!s->packet_allocator)
+        return av_get_packet(pb, pkt, size);
+    if ((ret = ff_new_packet(s, pkt, size)) < 0)
+        return ret;
+
+    pkt->pos= url_ftell(pb);
+
+    ret= get_buffer(pb, pkt->data, size);
+    if(ret<=0)
+        av_free_packet(pkt);
+    else
+        av_shrink_packet(pkt, ret);
+
+    return ret;
+}
+
+int ff_get_packet_nocopy(AVFormatContext *s, ByteIOContext *pb, AVPacket *pkt, int size)
+{
+    const unsigned char *buf;
+    int64_t pos;
+
+    /* the payload is wanted in the memory of the allocator */
+    if (!(s->flags & AVFMT_FLAG_NOBUFFERCOPY) || pb->update_checksum ||
+        s->packet_allocator ||
+        size <= 0 || size + FF_INPUT_BUFFER_PADDING_SIZE > pb->buffer_size)
+        return ff_get_packet(s, pb, pkt, size);
+
+    pos = url_ftell(pb);
+    /* the padding must be readable too, so it has to be buffered as well */
+    if (url_fpeek(pb, &buf, size + FF_INPUT_BUFFER_PADDING_SIZE) <
+        size + FF_INPUT_BUFFER_PADDING_SIZE)
+        return ff_get_packet(s, pb, pkt, size);
+
+    av_init_packet(pkt);
+    pkt->data = (uint8_t *)buf;
+    pkt->size = size;
+    pkt->pos  = pos;
+    url_fskip(pb, size);
+    return size;
+}
+
 
 int av_filename_number_test(const char *filename)
 {
@@ -312,18 +468,133 @@ int av_filename_number_test(const char *filename)
     return filename && (av_get_frame_filename(buf, sizeof(buf), filename, 1)>=0);
 }
 
-static AVInputFormat *av_probe_input_format2(AVProbeData *pd, int is_opened, int *score_max)
+/** per format probing cost, gathered with AVFMT_FLAG_PROBE_STATS */
+typedef struct ProbeStats {
+    AVInputFormat *fmt;
+    int calls;
+    int score;              ///< best score returned
+    int64_t time;           ///< total time spent in read_probe in microseconds
+} ProbeStats;
+
+/**
+ * Leading bytes that identify a format, the formats they belong to are
+ * probed before all others.
+ */
+typedef struct ProbeMagic {
+    const char *name;
+    uint8_t offset, len;
+    const char *magic;
+} ProbeMagic;
+
+static const ProbeMagic probe_magic[] = {
+    { "matroska", 0, 4, "\x1A\x45\xDF\xA3" },
+    { "ogg",      0, 4, "OggS" },
+    { "flac",     0, 4, "fLaC" },
+    { "avi",      8, 4, "AVI " },
+    { "wav",      8, 4, "WAVE" },
+    { "aiff",     8, 4, "AIFF" },
+    { "aiff",     8, 4, "AIFC" },
+    { "asf",      0, 4, "\x30\x26\xB2\x75" },
+    { "flv",      0, 3, "FLV" },
+    { "mov,mp4,m4a,3gp,3g2,mj2", 4, 4, "ftyp" },
+    { "mov,mp4,m4a,3gp,3g2,mj2", 4, 4, "moov" },
+    { "mov,mp4,m4a,3gp,3g2,mj2", 4, 4, "mdat" },
+    { "mxf",      0, 4, "\x06\x0E\x2B\x34" },
+    { "mpeg",     0, 4, "\x00\x00\x01\xBA" },
+    { "rm",       0, 4, ".RMF" },
+    { "ape",      0, 4, "MAC " },
+    { "wv",       0, 4, "wvpk" },
+    { "mpc8",     0, 4, "MPCK" },
+    { "mpc",      0, 3, "MP+" },
+    { "tta",      0, 4, "TTA1" },
+    { "au",       0, 4, ".snd" },
+    { "nut",      0, 8, "nut/mult" },
+    { "swf",      0, 3, "FWS" },
+    { "swf",      0, 3, "CWS" },
+    { "amr",      0, 5, "#!AMR" },
+    { "nsv",      0, 4, "NSVf" },
+};
+
+#define MAX_PROBE_CANDIDATES 8
+
+static int run_probe(AVInputFormat *fmt, AVProbeData *pd, ProbeStats *stats)
 {
-    AVInputFormat *fmt1, *fmt;
+    int64_t t;
     int score;
 
+    if (!stats)
+        return fmt->read_probe(pd);
+    t = av_gettime();
+    score = fmt->read_probe(pd);
+    stats->fmt   = fmt;
+    stats->time += av_gettime() - t;
+    stats->calls++;
+    stats->score = FFMAX(stats->score, score);
+    return score;
+}
+
+/**
+ * @param stats NULL or one entry per registered input format
+ */
+static AVInputFormat *av_probe_input_format2(AVProbeData *pd, int is_opened, int *score_max,
+                                             ProbeStats *stats)
+{
+    AVInputFormat *fmt1, *fmt;
+    AVInputFormat *cand[MAX_PROBE_CANDIDATES];
+    int cand_score[MAX_PROBE_CANDIDATES];
+    const char *magic[FF_ARRAY_ELEMS(probe_magic)];
+    int nb_cand = 0, nb_magic = 0;
+    int score, i, n;
+
+    /* first probe the formats the buffer starts like or the extension
+     * names; a certain match among them ends probing early */
+    if (is_opened) {
+        for (i = 0; i < FF_ARRAY_ELEMS(probe_magic); i++) {
+            const ProbeMagic *m = &probe_magic[i];
+            if (pd->buf_size >= m->offset + m->len &&
+                !memcmp(pd->buf + m->offset, m->magic, m->len))
+                magic[nb_magic++] = m->name;
+        }
+        for (fmt1 = first_iformat, n = 0; fmt1 && nb_cand < MAX_PROBE_CANDIDATES; fmt1 = fmt1->next, n++) {
+            if ((fmt1->flags & AVFMT_NOFILE) || !fmt1->read_probe)
+                continue;
+            for (i = 0; i < nb_magic; i++)
+                if (!strcmp(fmt1->name, magic[i]))
+                    break;
+            if (i == nb_magic && !(fmt1->extensions && av_match_ext(pd->filename, fmt1->extensions)))
+                continue;
+            cand[nb_cand]       = fmt1;
+            cand_score[nb_cand] = run_probe(fmt1, pd, stats ? &stats[n] : NULL);
+            nb_cand++;
+        }
+        fmt = NULL;
+        for (i = 0; i < nb_cand; i++) {
+            if (cand_score[i] == AVPROBE_SCORE_MAX) {
+                if (fmt) {
+                    fmt = NULL;
+                    break;
+                }
+                fmt = cand[i];
+            }
+        }
+        if (fmt && AVPROBE_SCORE_MAX > *score_max) {
+            *score_max = AVPROBE_SCORE_MAX;
+            return fmt;
+        }
+    }
+
     fmt = NULL;
-    for(fmt1 = first_iformat; fmt1 != NULL; fmt1 = fmt1->next) {
+    for(fmt1 = first_iformat, n = 0; fmt1 != NULL; fmt1 = fmt1->next, n++) {
         if (!is_opened == !(fmt1->flags & AVFMT_NOFILE))
             continue;
         score = 0;
         if (fmt1->read_probe) {
-            score = fmt1->read_probe(pd);
+            for (i = 0; i < nb_cand && cand[i] != fmt1; i++)
+                ;
+            if (i < nb_cand)
+                score = cand_score[i];
+            else
+                score = run_probe(fmt1, pd, stats ? &stats[n] : NULL);
         } else if (fmt1->extensions) {
             if (av_match_ext(pd->filename, fmt1->extensions)) {
                 score = 50;
@@ -340,13 +611,13 @@ static AVInputFormat *av_probe_input_format2(AVProbeData *pd, int is_opened, int
 
 AVInputFormat *av_probe_input_format(AVProbeData *pd, int is_opened){
     int score=0;
-    return av_probe_input_format2(pd, is_opened, &score);
+    return av_probe_input_format2(pd, is_opened, &score, NULL);
 }
 
 static int set_codec_from_probe_data(AVFormatContext *s, AVStream *st, AVProbeData *pd, int score)
 {
     AVInputFormat *fmt;
-    fmt = av_probe_input_format2(pd, 1, &score);
+    fmt = av_probe_input_format2(pd, 1, &score, NULL);
 
     if (fmt) {
         av_log(s, AV_LOG_DEBUG, "Probe with size=%d, packets=%d detected %s with score=%d\n",
@@ -383,6 +654,22 @@ static int set_codec_from_probe_data(AVFormatContext *s, AVStream *st, AVProbeDa
 /**
  * Open a media file from an IO stream. 'fmt' must be specified.
  */
+static void record_timing(AVFormatContext *s, int phase, int stream_index, int64_t duration)
+{
+    AVFormatTimings *t = &s->timings;
+
+    if (stream_index >= 0) {
+        if (stream_index < MAX_STREAMS)
+            t->stream_info[stream_index] = duration;
+    } else {
+        t->total[phase] += duration;
+        t->last[phase]   = duration;
+        t->count[phase]++;
+    }
+    if (s->timing_callback)
+        s->timing_callback(s->timing_opaque, s, phase, stream_index, duration);
+}
+
 int av_open_input_stream(AVFormatContext **ic_ptr,
                          ByteIOContext *pb, const char *filename,
                          AVInputFormat *fmt, AVFormatParameters *ap)
@@ -421,12 +708,25 @@ int av_open_input_stream(AVFormatContext **ic_ptr,
         ic->priv_data = NULL;
     }
 
+    if (pb && (ic->flags & AVFMT_FLAG_INDEX_CACHE))
+        ff_index_cache_open(ic);
+
+    if (ic->flags & AVFMT_FLAG_METADATA_ARENA)
+        ff_metadata_use_arena(&ic->metadata);
+
     if (ic->iformat->read_header) {
+        int64_t start_time = av_gettime();
+        ic->work_start = start_time;
         err = ic->iformat->read_header(ic, ap);
+        ic->work_start = 0;
         if (err < 0)
             goto fail;
+        record_timing(ic, AVFMT_PHASE_READ_HEADER, -1, av_gettime() - start_time);
     }
 
+    if (ic->index_cache)
+        ff_index_cache_header(ic);
+
     if (pb && !ic->data_offset)
         ic->data_offset = url_ftell(ic->pb);
 
@@ -441,6 +741,7 @@ int av_open_input_stream(AVFormatContext **ic_ptr,
  fail:
     if (ic) {
         int i;
+        ff_index_cache_close(ic, 0);
         av_freep(&ic->priv_data);
         for(i=0;i<ic->nb_streams;i++) {
             AVStream *st = ic->streams[i];
@@ -460,6 +761,35 @@ int av_open_input_stream(AVFormatContext **ic_ptr,
 #define PROBE_BUF_MIN 2048
 #define PROBE_BUF_MAX (1<<20)
 
+static void dump_probe_stats(void *logctx, ProbeStats *stats)
+{
+    AVInputFormat *fmt1;
+    int64_t total = 0;
+    int n;
+
+    for (fmt1 = first_iformat, n = 0; fmt1; fmt1 = fmt1->next, n++) {
+        if (!stats[n].calls)
+            continue;
+        av_log(logctx, AV_LOG_INFO, "probe %-16s %2d calls %8"PRId64" us score %3d\n",
+               fmt1->name, stats[n].calls, stats[n].time, stats[n].score);
+        total += stats[n].time;
+    }
+    av_log(logctx, AV_LOG_INFO, "probing took %"PRId64" us\n", total);
+}
+
+static int open_input_pb(ByteIOContext **pb, const char *filename,
+                         const URLInterrupt *intr)
+{
+    URLContext *h;
+    int err;
+
+    if ((err = url_open_interrupt(&h, filename, URL_RDONLY, intr)) < 0)
+        return err;
+    if ((err = url_fdopen(pb, h)) < 0)
+        url_close(h);
+    return err;
+}
+
 int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
                        AVInputFormat *fmt,
                        int buf_size,
@@ -469,6 +799,11 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
     AVProbeData probe_data, *pd = &probe_data;
     ByteIOContext *pb = NULL;
     void *logctx= ap && ap->prealloced_context ? *ic_ptr : NULL;
+    int readahead = logctx ? (*ic_ptr)->readahead : 0;
+    const URLInterrupt *intr = logctx ? &(*ic_ptr)->interrupt : NULL;
+    ProbeStats *stats = NULL;
+    int64_t open_time = 0, probe_time = 0, start_time;
+    int cached_fmt = 0;
 
     pd->filename = "";
     if (filename)
@@ -476,6 +811,12 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
     pd->buf = NULL;
     pd->buf_size = 0;
 
+    if (!fmt && logctx && ((*ic_ptr)->flags & AVFMT_FLAG_PROBE_CACHE) &&
+        (fmt = ff_probe_cache_format(filename))) {
+        av_log(logctx, AV_LOG_DEBUG, "Using the cached format %s\n", fmt->name);
+        cached_fmt = 1;
+    }
+
     if (!fmt) {
         /* guess format if no file can be opened */
         fmt = av_probe_input_format(pd, 0);
@@ -485,13 +826,25 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
        hack needed to handle RTSP/TCP */
     if (!fmt || !(fmt->flags & AVFMT_NOFILE)) {
         /* if no file needed do not try to open one */
-        if ((err=url_fopen(&pb, filename, URL_RDONLY)) < 0) {
+        start_time = av_gettime();
+        if ((err=open_input_pb(&pb, filename, intr)) < 0) {
             goto fail;
         }
+        open_time = av_gettime() - start_time;
         if (buf_size > 0) {
             url_setbufsize(pb, buf_size);
         }
+        if (readahead > 0 && url_fset_readahead(pb, readahead) < 0)
+            av_log(logctx, AV_LOG_WARNING, "Could not enable read-ahead\n");
+        if (logctx && ((*ic_ptr)->flags & AVFMT_FLAG_PROBE_STATS)) {
+            AVInputFormat *fmt1;
+            int nb_formats = 0;
+            for (fmt1 = first_iformat; fmt1; fmt1 = fmt1->next)
+                nb_formats++;
+            stats = av_mallocz(nb_formats * sizeof(*stats));
+        }
 
+        start_time = av_gettime();
         for(probe_size= PROBE_BUF_MIN; probe_size<=PROBE_BUF_MAX && !fmt; probe_size<<=1){
             int score= probe_size < PROBE_BUF_MAX ? AVPROBE_SCORE_MAX/4 : 0;
             /* read probe data */
@@ -506,14 +859,16 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
             memset(pd->buf+pd->buf_size, 0, AVPROBE_PADDING_SIZE);
             if (url_fseek(pb, 0, SEEK_SET) < 0) {
                 url_fclose(pb);
-                if (url_fopen(&pb, filename, URL_RDONLY) < 0) {
+                if (open_input_pb(&pb, filename, intr) < 0) {
                     pb = NULL;
                     err = AVERROR(EIO);
                     goto fail;
                 }
+                if (readahead > 0)
+                    url_fset_readahead(pb, readahead);
             }
             /* guess file format */
-            fmt = av_probe_input_format2(pd, 1, &score);
+            fmt = av_probe_input_format2(pd, 1, &score, stats);
             if(fmt){
                 if(score <= AVPROBE_SCORE_MAX/4){ //this can only be true in the last iteration
                     av_log(logctx, AV_LOG_WARNING, "Format detected only with low score of %d, misdetection possible!\n", score);
@@ -521,7 +876,12 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
                     av_log(logctx, AV_LOG_DEBUG, "Probed with size=%d and score=%d\n", probe_size, score);
             }
         }
+        probe_time = av_gettime() - start_time;
         av_freep(&pd->buf);
+        if (stats) {
+            dump_probe_stats(logctx, stats);
+            av_freep(&stats);
+        }
     }
 
     /* if still no format found, error */
@@ -538,11 +898,21 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
         }
     }
     err = av_open_input_stream(ic_ptr, pb, filename, fmt, ap);
-    if (err)
+    if (err) {
+        /* the source changed, probe it again next time */
+        if (cached_fmt)
+            ff_probe_cache_drop(filename);
         goto fail;
+    }
+    /* reported once there is a context to report them to */
+    if (pb) {
+        record_timing(*ic_ptr, AVFMT_PHASE_OPEN,  -1, open_time);
+        record_timing(*ic_ptr, AVFMT_PHASE_PROBE, -1, probe_time);
+    }
     return 0;
  fail:
     av_freep(&pd->buf);
+    av_free(stats);
     if (pb)
         url_fclose(pb);
     if (ap && ap->prealloced_context)
@@ -554,9 +924,307 @@ int av_open_input_file(AVFormatContext **ic_ptr, const char *filename,
 
 /*******************************************************/
 
-static AVPacket *add_to_pktbuf(AVPacketList **packet_buffer, AVPacket *pkt,
-                               AVPacketList **plast_pktl){
-    AVPacketList *pktl = av_mallocz(sizeof(AVPacketList));
+#define PACKET_LIST_POOL_MAX 1024
+
+/* all nodes carry a sequence number for the interleaving queue */
+typedef struct PacketListNode {
+    AVPacketList list;
+    int64_t seq;
+    int mem;                ///< bytes accounted in buffer_memory for the node
+} PacketListNode;
+
+#if HAVE_PTHREADS
+/* buffers are also filled and drained by the demuxing and muxing threads */
+static pthread_mutex_t buffer_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void ff_buffer_memory_add(AVFormatContext *s, int64_t size)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&buffer_memory_lock);
+#endif
+    s->buffer_memory += size;
+    if (s->buffer_memory > s->buffer_memory_peak)
+        s->buffer_memory_peak = s->buffer_memory;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&buffer_memory_lock);
+#endif
+}
+
+int ff_buffer_memory_check(AVFormatContext *s, int64_t size, const char *what)
+{
+    if (s->max_buffer_memory <= 0 || s->buffer_memory + size <= s->max_buffer_memory)
+        return 0;
+    av_log(s, s->buffer_memory_warned ? AV_LOG_DEBUG : AV_LOG_WARNING,
+           "Buffer memory limit of %d bytes reached, %s degrades\n",
+           s->max_buffer_memory, what);
+    s->buffer_memory_warned = 1;
+    return 1;
+}
+
+int ff_check_work_time(AVFormatContext *s)
+{
+    if (!s->max_work_time || !s->work_start ||
+        av_gettime() - s->work_start <= s->max_work_time)
+        return 0;
+    av_log(s, AV_LOG_ERROR, "Work time limit of %d us reached\n", s->max_work_time);
+    return AVERROR_WORK_LIMIT;
+}
+
+void ff_packet_list_account(AVFormatContext *s, AVPacketList *pktl)
+{
+    PacketListNode *node = (PacketListNode *)pktl;
+
+    node->mem = sizeof(PacketListNode) + pktl->pkt.size;
+    ff_buffer_memory_add(s, node->mem);
+}
+
+AVPacketList *ff_packet_list_alloc(AVFormatContext *s)
+{
+    AVPacketList *pktl = s->packet_list_pool;
+
+    if (!pktl)
+        return av_mallocz(sizeof(PacketListNode));
+    s->packet_list_pool = pktl->next;
+    s->packet_list_pool_size--;
+    memset(pktl, 0, sizeof(PacketListNode));
+    return pktl;
+}
+
+void ff_packet_list_free(AVFormatContext *s, AVPacketList *pktl)
+{
+    PacketListNode *node = (PacketListNode *)pktl;
+
+    if (node->mem)
+        ff_buffer_memory_add(s, -node->mem);
+    if (s->packet_list_pool_size >= PACKET_LIST_POOL_MAX) {
+        av_free(pktl);
+        return;
+    }
+    pktl->next = s->packet_list_pool;
+    s->packet_list_pool = pktl;
+    s->packet_list_pool_size++;
+}
+
+#define PACKET_POOL_MIN_BITS 8  ///< smallest buffer is 256 bytes
+#define PACKET_POOL_CLASSES  13 ///< largest buffer is 1 MiB
+#define PACKET_POOL_DEPTH    16 ///< unused buffers kept per size class
+
+typedef struct PacketPoolBuffer {
+    struct PacketPool *pool;
+    struct PacketPoolBuffer *next;
+    int size_class;
+} PacketPoolBuffer;
+
+/* the payload follows the header, keeping the malloc alignment */
+#define PACKET_POOL_HDR_SIZE ((sizeof(PacketPoolBuffer) + 15) & ~15)
+
+typedef struct PacketPool {
+    PacketPoolBuffer *free[PACKET_POOL_CLASSES];
+    int nb_free[PACKET_POOL_CLASSES];
+    int refcount;   ///< one for the owning context and one per buffer in use
+} PacketPool;
+
+static void packet_pool_unref(PacketPool *pool)
+{
+    PacketPoolBuffer *buf;
+    int i;
+
+    if (--pool->refcount)
+        return;
+    for (i = 0; i < PACKET_POOL_CLASSES; i++) {
+        while ((buf = pool->free[i])) {
+            pool->free[i] = buf->next;
+            av_free(buf);
+        }
+    }
+    av_free(pool);
+}
+
+static void packet_pool_destruct(AVPacket *pkt)
+{
+    PacketPoolBuffer *buf = pkt->priv;
+    PacketPool *pool = buf->pool;
+    int c = buf->size_class;
+
+    if (pool->nb_free[c] < PACKET_POOL_DEPTH) {
+        buf->next = pool->free[c];
+        pool->free[c] = buf;
+        pool->nb_free[c]++;
+    } else
+        av_free(buf);
+    packet_pool_unref(pool);
+    pkt->data = NULL;
+    pkt->size = 0;
+}
+
+/**
+ * Payload shared by several packets, see ff_packet_ref().
+ */
+typedef struct PacketRef {
+    int refcount;
+    AVPacket orig;      ///< the packet that owned the payload, freed with the last reference
+} PacketRef;
+
+#if HAVE_PTHREADS
+/* references may be dropped on any thread, e.g. with demux_queue_size */
+static pthread_mutex_t packet_ref_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void packet_ref_destruct(AVPacket *pkt)
+{
+    PacketRef *ref = pkt->priv;
+    int last;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&packet_ref_lock);
+#endif
+    last = !--ref->refcount;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&packet_ref_lock);
+#endif
+    if (last) {
+        av_free_packet(&ref->orig);
+        av_free(ref);
+    }
+    pkt->data = NULL;
+    pkt->size = 0;
+}
+
+int ff_packet_ref(AVPacket *dst, AVPacket *src)
+{
+    PacketRef *ref;
+    int ret;
+
+    if (src->destruct != packet_ref_destruct) {
+        /* a payload that src does not own has to be copied once */
+        if (!src->destruct && (ret = av_dup_packet(src)) < 0)
+            return ret;
+        if (!(ref = av_malloc(sizeof(PacketRef))))
+            return AVERROR(ENOMEM);
+        ref->refcount = 1;
+        ref->orig     = *src;
+        src->priv     = ref;
+        src->destruct = packet_ref_destruct;
+    }
+    ref = src->priv;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&packet_ref_lock);
+#endif
+    ref->refcount++;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&packet_ref_lock);
+#endif
+    *dst = *src;
+    return 0;
+}
+
+/**
+ * Make the payload of pkt persistent like av_dup_packet(), keeping
+ * shared payloads shared.
+ */
+static int dup_packet(AVPacket *pkt)
+{
+    if (pkt->destruct == packet_ref_destruct ||
+        pkt->destruct == packet_allocator_destruct)
+        return 0;
+    return av_dup_packet(pkt);
+}
+
+/**
+ * Get a buffer of the pool of s for a payload of size bytes.
+ * @return the payload, or NULL if out of memory
+ */
+static uint8_t *packet_pool_get(AVFormatContext *s, int size, PacketPoolBuffer **pbuf)
+{
+    PacketPool *pool = s->packet_pool;
+    PacketPoolBuffer *buf;
+    int c;
+
+    if (!pool) {
+        if (!(pool = av_mallocz(sizeof(PacketPool))))
+            return NULL;
+        pool->refcount = 1;
+        s->packet_pool = pool;
+    }
+    for (c = 0; size + FF_INPUT_BUFFER_PADDING_SIZE >
+                1 << (PACKET_POOL_MIN_BITS + c); c++);
+    if ((buf = pool->free[c])) {
+        pool->free[c] = buf->next;
+        pool->nb_free[c]--;
+    } else {
+        buf = av_malloc(PACKET_POOL_HDR_SIZE + (1 << (PACKET_POOL_MIN_BITS + c)));
+        if (!buf)
+            return NULL;
+        buf->pool       = pool;
+        buf->size_class = c;
+    }
+    pool->refcount++;
+    *pbuf = buf;
+    return (uint8_t *)buf + PACKET_POOL_HDR_SIZE;
+}
+
+#define PACKET_POOL_MAX_SIZE (1U << (PACKET_POOL_MIN_BITS + PACKET_POOL_CLASSES - 1))
+
+int ff_dup_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    PacketPoolBuffer *buf;
+    uint8_t *data;
+
+    if (pkt->destruct == packet_pool_destruct ||
+        pkt->destruct == packet_ref_destruct ||
+        pkt->destruct == packet_allocator_destruct)
+        return 0;
+    if (!(s->flags & AVFMT_FLAG_PACKET_POOL) ||
+        pkt->destruct == av_destruct_packet || !pkt->data ||
+        (unsigned)pkt->size + FF_INPUT_BUFFER_PADDING_SIZE > PACKET_POOL_MAX_SIZE)
+        return av_dup_packet(pkt);
+
+    if (!(data = packet_pool_get(s, pkt->size, &buf)))
+        return AVERROR(ENOMEM);
+    memcpy(data, pkt->data, pkt->size);
+    memset(data + pkt->size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data     = data;
+    pkt->priv     = buf;
+    pkt->destruct = packet_pool_destruct;
+    return 0;
+}
+
+int ff_packet_pool_new(AVFormatContext *s, AVPacket *pkt, int size)
+{
+    PacketPoolBuffer *buf;
+    uint8_t *data;
+
+    if ((unsigned)size + FF_INPUT_BUFFER_PADDING_SIZE > PACKET_POOL_MAX_SIZE)
+        return av_new_packet(pkt, size);
+    if (!(data = packet_pool_get(s, size, &buf)))
+        return AVERROR(ENOMEM);
+    av_init_packet(pkt);
+    memset(data + size, 0, FF_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data     = data;
+    pkt->size     = size;
+    pkt->priv     = buf;
+    pkt->destruct = packet_pool_destruct;
+    return 0;
+}
+
+void ff_packet_pool_uninit(AVFormatContext *s)
+{
+    AVPacketList *pktl;
+
+    while ((pktl = s->packet_list_pool)) {
+        s->packet_list_pool = pktl->next;
+        av_free(pktl);
+    }
+    s->packet_list_pool_size = 0;
+    if (s->packet_pool)
+        packet_pool_unref(s->packet_pool);
+    s->packet_pool = NULL;
+}
+
+static AVPacket *add_to_pktbuf(AVFormatContext *s, AVPacketList **packet_buffer,
+                               AVPacket *pkt, AVPacketList **plast_pktl){
+    AVPacketList *pktl = ff_packet_list_alloc(s);
     if (!pktl)
         return NULL;
 
@@ -568,13 +1236,50 @@ static AVPacket *add_to_pktbuf(AVPacketList **packet_buffer, AVPacket *pkt,
     /* add the packet in the buffered packet list */
     *plast_pktl = pktl;
     pktl->pkt= *pkt;
+    ff_packet_list_account(s, pktl);
+    FF_TRACE_PACKET('b', packet_buffer == &s->packet_buffer ?
+                    "packet_buffer" : "raw_packet_buffer", 0, pkt);
     return &pktl->pkt;
 }
 
+/* max number of packets a demuxer reads at once for av_read_frames() */
+#define MAX_PACKET_RUN 64
+
+/**
+ * Get the next packet from the demuxer, reading a run of packets when
+ * av_read_frames() wants several and the demuxer supports it.
+ */
+static int read_packet_run(AVFormatContext *s, AVPacket *pkt)
+{
+    int ret;
+
+    if (s->packet_run_pos < s->packet_run_count) {
+        *pkt = s->packet_run[s->packet_run_pos++];
+        return 0;
+    }
+    if (s->iformat->read_packets && s->packet_run_wanted > 1) {
+        if (!s->packet_run &&
+            !(s->packet_run = av_malloc(MAX_PACKET_RUN * sizeof(*s->packet_run))))
+            return AVERROR(ENOMEM);
+        ret = s->iformat->read_packets(s, s->packet_run,
+                                       FFMIN(s->packet_run_wanted, MAX_PACKET_RUN));
+        if (ret < 0)
+            return ret;
+        if (ret > 0) {
+            s->packet_run_count = ret;
+            s->packet_run_pos   = 1;
+            *pkt = s->packet_run[0];
+            return 0;
+        }
+    }
+    return s->iformat->read_packet(s, pkt);
+}
+
 int av_read_packet(AVFormatContext *s, AVPacket *pkt)
 {
     int ret, i;
     AVStream *st;
+    int64_t t;
 
     for(;;){
         AVPacketList *pktl = s->raw_packet_buffer;
@@ -583,20 +1288,28 @@ int av_read_packet(AVFormatContext *s, AVPacket *pkt)
             *pkt = pktl->pkt;
             if(s->streams[pkt->stream_index]->codec->codec_id != CODEC_ID_PROBE ||
                !s->streams[pkt->stream_index]->probe_packets ||
-               s->raw_packet_buffer_remaining_size < pkt->size){
+               s->raw_packet_buffer_remaining_size < pkt->size ||
+               ff_buffer_memory_check(s, 0, "stream probing")){
                 AVProbeData *pd = &s->streams[pkt->stream_index]->probe_data;
                 av_freep(&pd->buf);
                 pd->buf_size = 0;
                 s->raw_packet_buffer = pktl->next;
                 s->raw_packet_buffer_remaining_size += pkt->size;
-                av_free(pktl);
+                ff_packet_list_free(s, pktl);
+                FF_TRACE_PACKET('e', "raw_packet_buffer", 0, pkt);
                 return 0;
             }
         }
 
         av_init_packet(pkt);
-        ret= s->iformat->read_packet(s, pkt);
+        t = FF_TRACE_START();
+        ret= read_packet_run(s, pkt);
+        if (ret >= 0)
+            FF_TRACE_PACKET('X', "read_packet", t, pkt);
         if (ret < 0) {
+            /* the tail tags are next to where the demuxer stopped */
+            if (s->read_tail_tags && (ret == AVERROR_EOF || url_feof(s->pb)))
+                av_read_tail_tags(s);
             if (!pktl || ret == AVERROR(EAGAIN))
                 return ret;
             for (i = 0; i < s->nb_streams; i++)
@@ -621,7 +1334,10 @@ int av_read_packet(AVFormatContext *s, AVPacket *pkt)
                      !st->probe_packets))
             return ret;
 
-        add_to_pktbuf(&s->raw_packet_buffer, pkt, &s->raw_packet_buffer_end);
+        /* the packet may point into the demuxer or I/O buffer */
+        if(dup_packet(add_to_pktbuf(s, &s->raw_packet_buffer, pkt,
+                                       &s->raw_packet_buffer_end)) < 0)
+            return AVERROR(ENOMEM);
         s->raw_packet_buffer_remaining_size -= pkt->size;
 
         if(st->codec->codec_id == CODEC_ID_PROBE){
@@ -802,13 +1518,77 @@ static void update_initial_durations(AVFormatContext *s, AVStream *st, AVPacket
         st->cur_dts= cur_dts;
 }
 
+/**
+ * Check whether pkt can take the path of compute_pkt_fields_simple().
+ * This is the case for audio and intra only video, which never reorder
+ * frames, once their initial timestamps are known, as long as pkt has
+ * the same pts and dts and nothing in the parser state needs to adjust
+ * them.
+ */
+static int pkt_fields_simple(AVStream *st, AVCodecParserContext *pc, AVPacket *pkt)
+{
+    if (st->simple_ts_codec_id != st->codec->codec_id || !st->simple_ts_codec_id) {
+        st->simple_ts_codec_id = st->codec->codec_id;
+        st->simple_ts = st->codec->codec_id != CODEC_ID_H264 && is_intra_only(st->codec);
+    }
+    return st->simple_ts && !st->codec->has_b_frames &&
+           st->first_dts != AV_NOPTS_VALUE && st->cur_dts != AV_NOPTS_VALUE &&
+           pkt->dts != AV_NOPTS_VALUE &&
+           (pkt->pts == pkt->dts || pkt->pts == AV_NOPTS_VALUE) &&
+           (!pc || (pc->pict_type != FF_B_TYPE && pc->dts_sync_point < 0 &&
+                    st->need_parsing != AVSTREAM_PARSE_TIMESTAMPS));
+}
+
+/**
+ * What compute_pkt_fields() does for packets accepted by
+ * pkt_fields_simple(), without the reordering and initial timestamp code.
+ */
+static void compute_pkt_fields_simple(AVFormatContext *s, AVStream *st,
+                                      AVCodecParserContext *pc, AVPacket *pkt)
+{
+    int num, den;
+
+    if (pkt->duration == 0) {
+        compute_frame_duration(&num, &den, st, pc, pkt);
+        if (den && num) {
+            pkt->duration = av_rescale(1, num * (int64_t)st->time_base.den, den * (int64_t)st->time_base.num);
+
+            if(pkt->duration != 0 && s->packet_buffer)
+                update_initial_durations(s, st, pkt);
+        }
+    }
+
+    if (pkt->pts == AV_NOPTS_VALUE) {
+        pkt->pts = pkt->dts;
+    } else if (pkt->duration) {
+        int64_t old_diff= FFABS(st->cur_dts - pkt->duration - pkt->pts);
+        int64_t new_diff= FFABS(st->cur_dts - pkt->pts);
+        if(old_diff < new_diff && old_diff < (pkt->duration>>3))
+            pkt->pts += pkt->duration;
+    }
+    pkt->dts = pkt->pts;
+    st->cur_dts = pkt->pts + pkt->duration;
+    st->pts_buffer[0] = pkt->pts;
+    if (pkt->dts > st->cur_dts)
+        st->cur_dts = pkt->dts;
+
+    pkt->flags |= PKT_FLAG_KEY;
+    if (pc)
+        pkt->convergence_duration = pc->convergence_duration;
+}
+
 static void compute_pkt_fields(AVFormatContext *s, AVStream *st,
                                AVCodecParserContext *pc, AVPacket *pkt)
 {
     int num, den, presentation_delayed, delay, i;
     int64_t offset;
 
-    if (st->codec->codec_id != CODEC_ID_H264 && pc && pc->pict_type == FF_B_TYPE)
+    if (pkt_fields_simple(st, pc, pkt)) {
+        compute_pkt_fields_simple(s, st, pc, pkt);
+        return;
+    }
+
+    if (st->codec->codec_id != CODEC_ID_H264 && pc && pc->pict_type == FF_B_TYPE)
         //FIXME Set low_delay = 0 when has_b_frames = 1
         st->codec->has_b_frames = 1;
 
@@ -954,6 +1734,18 @@ static void compute_pkt_fields(AVFormatContext *s, AVStream *st,
 }
 
 
+/**
+ * @return nonzero if the parser of st gets whole frames from the demuxer.
+ * With AVFMT_FLAG_LOW_DELAY video parsers output every packet at once
+ * instead of waiting for the start of the next frame.
+ */
+static int parser_complete_frames(AVFormatContext *s, AVStream *st)
+{
+    return st->need_parsing == AVSTREAM_PARSE_HEADERS ||
+           ((s->flags & AVFMT_FLAG_LOW_DELAY) &&
+            st->codec->codec_type == CODEC_TYPE_VIDEO);
+}
+
 static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
 {
     AVStream *st;
@@ -996,7 +1788,21 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
                     pkt->pts = st->parser->pts;
                     pkt->dts = st->parser->dts;
                     pkt->pos = st->parser->pos;
+                    FF_TRACE('e', "parser", 0, ff_trace_id(st->index, pkt->pos),
+                             st->index, AV_NOPTS_VALUE, pkt->pos, pkt->size);
                     pkt->destruct = NULL;
+                    /* a frame that the parser did not have to assemble can
+                       share the payload of the demuxed packet */
+                    if ((s->flags & AVFMT_FLAG_SHARED_PAYLOAD) && st->cur_pkt.data &&
+                        st->cur_pkt.destruct &&
+                        pkt->data >= st->cur_pkt.data &&
+                        pkt->data + pkt->size <= st->cur_pkt.data + st->cur_pkt.size) {
+                        AVPacket ref;
+                        if (ff_packet_ref(&ref, &st->cur_pkt) >= 0) {
+                            pkt->priv     = ref.priv;
+                            pkt->destruct = ref.destruct;
+                        }
+                    }
                     compute_pkt_fields(s, st, st->parser, pkt);
 
                     if((s->iformat->flags & AVFMT_GENERIC_INDEX) && pkt->flags & PKT_FLAG_KEY){
@@ -1037,6 +1843,11 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
             }
             st = s->streams[cur_pkt.stream_index];
             st->cur_pkt= cur_pkt;
+            /* the demuxer vouches for the packets, the parser would only
+               split them again */
+            if (st->need_parsing && (s->flags & AVFMT_FLAG_NOPARSE) &&
+                (st->container_params & FF_PARAM_FRAMING))
+                st->need_parsing = AVSTREAM_PARSE_NONE;
 
             if(st->cur_pkt.pts != AV_NOPTS_VALUE &&
                st->cur_pkt.dts != AV_NOPTS_VALUE &&
@@ -1062,12 +1873,17 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
             s->cur_st = st;
             st->cur_ptr = st->cur_pkt.data;
             st->cur_len = st->cur_pkt.size;
+            /* frames output by the parser keep the position of the packet
+               they started in */
+            if (st->need_parsing)
+                FF_TRACE('b', "parser", 0, ff_trace_id(st->index, st->cur_pkt.pos),
+                         st->index, st->cur_pkt.dts, st->cur_pkt.pos, st->cur_pkt.size);
             if (st->need_parsing && !st->parser) {
                 st->parser = av_parser_init(st->codec->codec_id);
                 if (!st->parser) {
                     /* no parser available: just output the raw packets */
                     st->need_parsing = AVSTREAM_PARSE_NONE;
-                }else if(st->need_parsing == AVSTREAM_PARSE_HEADERS){
+                }else if(parser_complete_frames(s, st)){
                     st->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
                 }
                 if(st->parser && (s->iformat->flags & AVFMT_GENERIC_INDEX)){
@@ -1089,11 +1905,12 @@ static int av_read_frame_internal(AVFormatContext *s, AVPacket *pkt)
     return 0;
 }
 
-int av_read_frame(AVFormatContext *s, AVPacket *pkt)
+static int read_frame(AVFormatContext *s, AVPacket *pkt)
 {
     AVPacketList *pktl;
     int eof=0;
-    const int genpts= s->flags & AVFMT_FLAG_GENPTS;
+    /* generating pts holds packets until the next reference frame */
+    const int genpts= (s->flags & AVFMT_FLAG_GENPTS) && !(s->flags & AVFMT_FLAG_LOW_DELAY);
 
     for(;;){
         pktl = s->packet_buffer;
@@ -1119,12 +1936,19 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
                 /* read packet from packet buffer, if there is data */
                 *pkt = *next_pkt;
                 s->packet_buffer = pktl->next;
-                av_free(pktl);
+                ff_packet_list_free(s, pktl);
+                FF_TRACE_PACKET('e', "packet_buffer", 0, pkt);
                 return 0;
             }
         }
         if(genpts){
-            int ret= av_read_frame_internal(s, pkt);
+            int ret;
+            /* return what is buffered without waiting for the pts */
+            if(pktl && ff_buffer_memory_check(s, 0, "pts generation")){
+                eof=1;
+                continue;
+            }
+            ret= av_read_frame_internal(s, pkt);
             if(ret<0){
                 if(pktl && ret != AVERROR(EAGAIN)){
                     eof=1;
@@ -1133,7 +1957,7 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
                     return ret;
             }
 
-            if(av_dup_packet(add_to_pktbuf(&s->packet_buffer, pkt,
+            if(dup_packet(add_to_pktbuf(s, &s->packet_buffer, pkt,
                                            &s->packet_buffer_end)) < 0)
                 return AVERROR(ENOMEM);
         }else{
@@ -1143,6 +1967,324 @@ int av_read_frame(AVFormatContext *s, AVPacket *pkt)
     }
 }
 
+#if HAVE_PTHREADS
+/**
+ * Packet queue between the caller and a demuxing or muxing thread, bounded
+ * by payload size and by the span of its timestamps.
+ */
+typedef struct ThreadPacketQueue {
+    AVPacketList *first, *last;
+    int nb_bytes;               ///< payload size of the queued packets
+    int64_t first_ts, last_ts;  ///< AV_TIME_BASE timestamps spanned by the queue
+} ThreadPacketQueue;
+
+static int64_t queue_packet_ts(AVFormatContext *s, AVPacket *pkt)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    if (ts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+    return av_rescale_q(ts, s->streams[pkt->stream_index]->time_base, AV_TIME_BASE_Q);
+}
+
+static int queue_full(AVFormatContext *s, ThreadPacketQueue *q, int max_size, int max_duration)
+{
+    if (!q->first)
+        return 0;
+    if (q->nb_bytes >= max_size || ff_buffer_memory_check(s, 0, "threaded queueing"))
+        return 1;
+    return max_duration > 0 &&
+           q->first_ts != AV_NOPTS_VALUE && q->last_ts != AV_NOPTS_VALUE &&
+           q->last_ts - q->first_ts >= max_duration;
+}
+
+/**
+ * Append a packet whose data has been duplicated already.
+ */
+static int queue_put(AVFormatContext *s, ThreadPacketQueue *q, AVPacket *pkt)
+{
+    AVPacketList *pktl = av_mallocz(sizeof(AVPacketList));
+    int64_t ts = queue_packet_ts(s, pkt);
+
+    if (!pktl)
+        return AVERROR(ENOMEM);
+    pktl->pkt = *pkt;
+    if (q->last)
+        q->last->next = pktl;
+    else {
+        q->first    = pktl;
+        q->first_ts = ts;
+    }
+    q->last      = pktl;
+    q->nb_bytes += pkt->size;
+    if (ts != AV_NOPTS_VALUE)
+        q->last_ts = ts;
+    ff_buffer_memory_add(s, sizeof(AVPacketList) + pkt->size);
+    FF_TRACE_PACKET('b', "thread_queue", 0, pkt);
+    return 0;
+}
+
+static void queue_get(AVFormatContext *s, ThreadPacketQueue *q, AVPacket *pkt)
+{
+    AVPacketList *pktl = q->first;
+
+    *pkt = pktl->pkt;
+    FF_TRACE_PACKET('e', "thread_queue", 0, pkt);
+    q->first     = pktl->next;
+    q->nb_bytes -= pkt->size;
+    ff_buffer_memory_add(s, -(int64_t)(sizeof(AVPacketList) + pkt->size));
+    if (q->first)
+        q->first_ts = queue_packet_ts(s, &q->first->pkt);
+    else {
+        q->last     = NULL;
+        q->first_ts = q->last_ts = AV_NOPTS_VALUE;
+    }
+    av_free(pktl);
+}
+
+static void queue_flush(AVFormatContext *s, ThreadPacketQueue *q)
+{
+    AVPacketList *pktl;
+
+    while ((pktl = q->first)) {
+        q->first = pktl->next;
+        ff_buffer_memory_add(s, -(int64_t)(sizeof(AVPacketList) + pktl->pkt.size));
+        av_free_packet(&pktl->pkt);
+        av_free(pktl);
+    }
+    q->last     = NULL;
+    q->nb_bytes = 0;
+    q->first_ts = q->last_ts = AV_NOPTS_VALUE;
+}
+
+/**
+ * Reader thread demuxing ahead of av_read_frame(), started by its first
+ * call if demux_queue_size is set.
+ */
+typedef struct DemuxThread {
+    AVFormatContext *s;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ThreadPacketQueue queue;
+    int status;                 ///< error that stopped the reader, 0 while reading
+    int pause, busy, abort;
+} DemuxThread;
+
+static void *demux_thread(void *arg)
+{
+    DemuxThread *t = arg;
+    AVFormatContext *s = t->s;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        AVPacket pkt;
+        int ret;
+
+        while (!t->abort && (t->pause || t->status < 0 ||
+                             queue_full(s, &t->queue, s->demux_queue_size, s->demux_queue_duration)))
+            pthread_cond_wait(&t->cond, &t->lock);
+        if (t->abort)
+            break;
+        t->busy = 1;
+        pthread_mutex_unlock(&t->lock);
+
+        ret = read_frame(s, &pkt);
+        /* the packet must outlive the next read */
+        if (!ret && dup_packet(&pkt) < 0) {
+            av_free_packet(&pkt);
+            ret = AVERROR(ENOMEM);
+        }
+
+        pthread_mutex_lock(&t->lock);
+        t->busy = 0;
+        if (!ret) {
+            if ((ret = queue_put(s, &t->queue, &pkt)) < 0) {
+                av_free_packet(&pkt);
+                t->status = ret;
+            }
+        } else if (ret == AVERROR(EAGAIN)) {
+            /* nonblocking input without data, poll again later */
+            int64_t wake = av_gettime() + 10000;
+            struct timespec ts = { wake / 1000000, wake % 1000000 * 1000 };
+            pthread_cond_timedwait(&t->cond, &t->lock, &ts);
+        } else
+            t->status = ret;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static int demux_thread_start(AVFormatContext *s)
+{
+    DemuxThread *t = av_mallocz(sizeof(DemuxThread));
+
+    if (!t)
+        return AVERROR(ENOMEM);
+    t->s              = s;
+    t->queue.first_ts = t->queue.last_ts = AV_NOPTS_VALUE;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, demux_thread, t)) {
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        av_free(t);
+        return AVERROR(ENOMEM);
+    }
+    s->demux_thread = t;
+    return 0;
+}
+
+/**
+ * Wait until the reader thread is idle and keep it from reading, so that
+ * the demuxer can be accessed directly. The next av_read_frame() lets it
+ * continue.
+ * @param flush discard the queued packets, e.g. because of a seek
+ */
+static void demux_thread_pause(AVFormatContext *s, int flush)
+{
+    DemuxThread *t = s->demux_thread;
+
+    if (!t || pthread_equal(pthread_self(), t->thread))
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->pause = 1;
+    while (t->busy)
+        pthread_cond_wait(&t->cond, &t->lock);
+    if (flush) {
+        queue_flush(s, &t->queue);
+        t->status = 0;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static int demux_thread_get(DemuxThread *t, AVPacket *pkt)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->pause) {
+        t->pause = 0;
+        pthread_cond_broadcast(&t->cond);
+    }
+    while (!t->queue.first && !t->status) {
+        if (t->s->flags & AVFMT_FLAG_NONBLOCK) {
+            pthread_mutex_unlock(&t->lock);
+            return AVERROR(EAGAIN);
+        }
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    if (t->queue.first) {
+        queue_get(t->s, &t->queue, pkt);
+        pthread_cond_broadcast(&t->cond);
+    } else
+        ret = t->status;
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+static void demux_thread_stop(AVFormatContext *s)
+{
+    DemuxThread *t = s->demux_thread;
+
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->abort = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    queue_flush(s, &t->queue);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    av_freep(&s->demux_thread);
+}
+#else
+#define demux_thread_pause(s, flush)
+#define demux_thread_stop(s)
+#endif
+
+int av_read_frame(AVFormatContext *s, AVPacket *pkt)
+{
+    int ret;
+
+#if HAVE_PTHREADS
+    if (s->demux_queue_size > 0 && !s->demux_thread &&
+        demux_thread_start(s) < 0)
+        av_log(s, AV_LOG_WARNING, "Could not start the demuxing thread\n");
+    if (s->demux_thread)
+        ret = demux_thread_get(s->demux_thread, pkt);
+    else
+#endif
+    ret = read_frame(s, pkt);
+    if (ret >= 0)
+        FF_TRACE_PACKET('i', "av_read_frame", 0, pkt);
+    return ret;
+}
+
+int av_read_frames(AVFormatContext *s, AVPacket *pkts, int max_packets, int max_bytes)
+{
+    int n = 0, bytes = 0, ret = 0;
+
+    while (n < max_packets && (max_bytes <= 0 || bytes < max_bytes)) {
+        /* a demuxing thread reads ahead already */
+        if (s->demux_queue_size <= 0)
+            s->packet_run_wanted = max_packets - n;
+        ret = av_read_frame(s, &pkts[n]);
+        if (ret < 0)
+            break;
+        bytes += pkts[n++].size;
+    }
+    s->packet_run_wanted = 0;
+    return n ? n : ret;
+}
+
+int av_read_keyframe(AVFormatContext *s, int stream_index, int stride, AVPacket *pkt)
+{
+    AVStream *st;
+    int64_t target = AV_NOPTS_VALUE, ts;
+    int i, n, ret;
+
+    if (stream_index < 0 || stream_index >= s->nb_streams)
+        return AVERROR(EINVAL);
+    st = s->streams[stream_index];
+    stride = FFMAX(stride, 1);
+
+    /* jump to the key frame if the index goes that far */
+    if (st->trickplay_ts != AV_NOPTS_VALUE && !(s->flags & AVFMT_FLAG_IGNIDX)) {
+        ts = st->trickplay_ts;
+        for (n = 0; n < stride; n++) {
+            if ((i = av_index_search_timestamp(st, ts + 1, 0)) < 0)
+                break;
+            ts = ff_index_get_entry(st, i)->timestamp;
+        }
+        if (n == stride && av_seek_frame(s, stream_index, ts, AVSEEK_FLAG_BACKWARD) >= 0) {
+            target = ts;
+            stride = 1;
+        }
+    }
+
+    for (n = 0;;) {
+        if ((ret = av_read_frame(s, pkt)) < 0)
+            return ret;
+        ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        if (pkt->stream_index == stream_index && (pkt->flags & PKT_FLAG_KEY) &&
+            (target == AV_NOPTS_VALUE || ts == AV_NOPTS_VALUE || ts >= target) &&
+            ++n == stride)
+            break;
+        av_free_packet(pkt);
+    }
+
+    /* the index may use the dts, the last key frame entry up to the pts
+       is the one of this frame */
+    if (target == AV_NOPTS_VALUE && ts != AV_NOPTS_VALUE &&
+        (i = av_index_search_timestamp(st, ts, AVSEEK_FLAG_BACKWARD)) >= 0)
+        target = ff_index_get_entry(st, i)->timestamp;
+    st->trickplay_ts = target != AV_NOPTS_VALUE ? target : ts;
+    return 0;
+}
+
 /* XXX: suppress the packet queue */
 static void flush_packet_queue(AVFormatContext *s)
 {
@@ -1154,17 +2296,21 @@ static void flush_packet_queue(AVFormatContext *s)
             break;
         s->packet_buffer = pktl->next;
         av_free_packet(&pktl->pkt);
-        av_free(pktl);
+        ff_packet_list_free(s, pktl);
     }
     while(s->raw_packet_buffer){
         pktl = s->raw_packet_buffer;
         s->raw_packet_buffer = pktl->next;
         av_free_packet(&pktl->pkt);
-        av_free(pktl);
+        ff_packet_list_free(s, pktl);
     }
     s->packet_buffer_end=
     s->raw_packet_buffer_end= NULL;
     s->raw_packet_buffer_remaining_size = RAW_PACKET_BUFFER_SIZE;
+
+    while (s->packet_run_pos < s->packet_run_count)
+        av_free_packet(&s->packet_run[s->packet_run_pos++]);
+    s->packet_run_pos = s->packet_run_count = 0;
 }
 
 /*******************************************************/
@@ -1197,6 +2343,7 @@ void av_read_frame_flush(AVFormatContext *s)
     AVStream *st;
     int i, j;
 
+    demux_thread_pause(s, 1);
     flush_packet_queue(s);
 
     s->cur_st = NULL;
@@ -1213,6 +2360,7 @@ void av_read_frame_flush(AVFormatContext *s)
         st->last_IP_pts = AV_NOPTS_VALUE;
         st->cur_dts = AV_NOPTS_VALUE; /* we set the current DTS to an unspecified origin */
         st->reference_dts = AV_NOPTS_VALUE;
+        st->trickplay_ts = AV_NOPTS_VALUE;
         /* fail safe */
         st->cur_ptr = NULL;
         st->cur_len = 0;
@@ -1249,25 +2397,385 @@ void ff_reduce_index(AVFormatContext *s, int stream_index)
     }
 }
 
+static int grow_index_entries(AVStream *st, unsigned int nb_entries)
+{
+    unsigned int allocated = st->index_entries_allocated_size / sizeof(AVIndexEntry);
+    AVIndexEntry *entries;
+
+    if (nb_entries <= allocated)
+        return 0;
+    if (nb_entries >= UINT_MAX / sizeof(AVIndexEntry))
+        return -1;
+    /* grow by half so that appending stays O(1) amortized even for very
+     * long recordings */
+    allocated = FFMIN(FFMAX(nb_entries, allocated + allocated / 2 + 64),
+                      UINT_MAX / sizeof(AVIndexEntry) - 1);
+    entries = av_realloc(st->index_entries, allocated * sizeof(AVIndexEntry));
+    if (!entries)
+        return -1;
+    st->index_entries = entries;
+    st->index_entries_allocated_size = allocated * sizeof(AVIndexEntry);
+    return 0;
+}
+
+int ff_reserve_index_entries(AVStream *st, unsigned int nb_entries)
+{
+    if (st->compact_index)
+        return 0;
+    if (nb_entries >= UINT_MAX / sizeof(AVIndexEntry) - st->nb_index_entries)
+        return -1;
+    return grow_index_entries(st, st->nb_index_entries + nb_entries);
+}
+
+int ff_add_index_entries(AVStream *st, const AVIndexEntry *entries, int nb_entries)
+{
+    int i;
+
+    if (nb_entries <= 0)
+        return 0;
+    if (st->max_index_entries)
+        nb_entries = FFMIN(nb_entries, FFMAX(st->max_index_entries - ff_index_nb_entries(st), 0));
+    if (!st->compact_index &&
+        (!st->nb_index_entries ||
+         st->index_entries[st->nb_index_entries - 1].timestamp < entries[0].timestamp)) {
+        if (ff_reserve_index_entries(st, nb_entries) < 0)
+            return AVERROR(ENOMEM);
+        memcpy(st->index_entries + st->nb_index_entries, entries,
+               nb_entries * sizeof(*entries));
+        st->nb_index_entries += nb_entries;
+        return 0;
+    }
+    for (i = 0; i < nb_entries; i++)
+        av_add_index_entry(st, entries[i].pos, entries[i].timestamp, entries[i].size,
+                           entries[i].min_distance, entries[i].flags);
+    return 0;
+}
+
+/* compact index: entries are stored in blocks of COMPACT_INDEX_BLOCK,
+ * each coded as variable length deltas against the previous entry so that
+ * a typical entry takes 5-6 bytes instead of sizeof(AVIndexEntry). The
+ * newest entries are kept uncoded in tail until a full block is
+ * available, the most recently decoded block is cached. */
+#define COMPACT_INDEX_BLOCK 64
+#define COMPACT_INDEX_MAX_ENTRY_SIZE 40 ///< 4 varints of up to 10 bytes
+
+typedef struct CompactIndexBlock {
+    int64_t timestamp;          ///< timestamp of the first entry
+    unsigned int offset;        ///< offset of the coded entries in data
+} CompactIndexBlock;
+
+typedef struct CompactIndex {
+    CompactIndexBlock *blocks;
+    int nb_blocks;
+    unsigned int blocks_allocated;
+    uint8_t *data;
+    unsigned int data_size;
+    unsigned int data_allocated;
+    AVIndexEntry tail[COMPACT_INDEX_BLOCK];
+    int nb_tail;
+    AVIndexEntry cache[COMPACT_INDEX_BLOCK];
+    int cache_block;            ///< block decoded into cache, -1 if none
+} CompactIndex;
+
+static uint8_t *compact_put_v(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static uint64_t compact_get_v(const uint8_t **pp)
+{
+    const uint8_t *p = *pp;
+    uint64_t v = 0;
+    int shift = 0;
+
+    do {
+        v |= (uint64_t)(*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *pp = p;
+    return v;
+}
+
+/* zigzag mapping of signed deltas, done in unsigned arithmetic so that
+ * wrapping differences round trip */
+static uint64_t compact_zigzag(uint64_t d)
+{
+    return (d << 1) ^ (0 - (d >> 63));
+}
+
+static uint64_t compact_unzigzag(uint64_t v)
+{
+    return (v >> 1) ^ (0 - (v & 1));
+}
+
+static void compact_index_decode(CompactIndex *ci, int block, AVIndexEntry *out)
+{
+    const uint8_t *p = ci->data + ci->blocks[block].offset;
+    uint64_t pos = 0, ts = ci->blocks[block].timestamp, delta = 0, v;
+    int size = 0, i;
+
+    for (i = 0; i < COMPACT_INDEX_BLOCK; i++) {
+        int new_size = (uint32_t)compact_get_v(&p);
+        pos   += size + compact_unzigzag(compact_get_v(&p));
+        delta += compact_unzigzag(compact_get_v(&p));
+        ts    += delta;
+        v      = compact_get_v(&p);
+        out[i].pos          = pos;
+        out[i].timestamp    = ts;
+        out[i].size         = new_size;
+        out[i].min_distance = v >> 2;
+        out[i].flags        = v & 3;
+        size = new_size;
+    }
+}
+
+/**
+ * Code the full tail as a new block.
+ */
+static int compact_index_flush(CompactIndex *ci)
+{
+    uint64_t pos = 0, ts, delta = 0;
+    int size = 0, i;
+    uint8_t *p;
+
+    if (ci->data_size > UINT_MAX - COMPACT_INDEX_BLOCK * COMPACT_INDEX_MAX_ENTRY_SIZE ||
+        ci->nb_blocks >= INT_MAX / COMPACT_INDEX_BLOCK - 1)
+        return -1;
+    if (ci->data_size + COMPACT_INDEX_BLOCK * COMPACT_INDEX_MAX_ENTRY_SIZE > ci->data_allocated) {
+        unsigned int allocated = FFMAX(ci->data_allocated + ci->data_allocated / 2,
+                                       ci->data_size + COMPACT_INDEX_BLOCK * COMPACT_INDEX_MAX_ENTRY_SIZE);
+        uint8_t *data;
+        if (allocated < ci->data_allocated)
+            allocated = UINT_MAX;
+        data = av_realloc(ci->data, allocated);
+        if (!data)
+            return -1;
+        ci->data           = data;
+        ci->data_allocated = allocated;
+    }
+    if (ci->nb_blocks + 1 > ci->blocks_allocated) {
+        unsigned int allocated = ci->blocks_allocated + ci->blocks_allocated / 2 + 16;
+        CompactIndexBlock *blocks;
+        if (allocated >= UINT_MAX / sizeof(CompactIndexBlock))
+            return -1;
+        blocks = av_realloc(ci->blocks, allocated * sizeof(CompactIndexBlock));
+        if (!blocks)
+            return -1;
+        ci->blocks           = blocks;
+        ci->blocks_allocated = allocated;
+    }
+
+    ts = ci->tail[0].timestamp;
+    ci->blocks[ci->nb_blocks].timestamp = ts;
+    ci->blocks[ci->nb_blocks].offset    = ci->data_size;
+    p = ci->data + ci->data_size;
+    for (i = 0; i < COMPACT_INDEX_BLOCK; i++) {
+        const AVIndexEntry *ie = &ci->tail[i];
+        uint64_t new_delta = (uint64_t)ie->timestamp - ts;
+        p = compact_put_v(p, (uint32_t)ie->size);
+        p = compact_put_v(p, compact_zigzag((uint64_t)ie->pos - pos - size));
+        p = compact_put_v(p, compact_zigzag(new_delta - delta));
+        p = compact_put_v(p, (uint64_t)(unsigned)ie->min_distance << 2 | (ie->flags & 3));
+        pos   = ie->pos;
+        ts    = ie->timestamp;
+        size  = ie->size;
+        delta = new_delta;
+    }
+    ci->data_size = p - ci->data;
+    ci->nb_blocks++;
+    ci->nb_tail = 0;
+    return 0;
+}
+
+static void compact_index_free(AVStream *st)
+{
+    CompactIndex *ci = st->compact_index;
+
+    if (!ci)
+        return;
+    av_free(ci->blocks);
+    av_free(ci->data);
+    av_freep(&st->compact_index);
+}
+
+/**
+ * Convert the compact index of st back into a plain index_entries array.
+ */
+static int compact_index_expand(AVStream *st)
+{
+    CompactIndex *ci = st->compact_index;
+    int nb_entries = ff_index_nb_entries(st);
+    int i;
+
+    st->compact_index = NULL;
+    if (grow_index_entries(st, nb_entries + 1) < 0) {
+        st->compact_index = ci;
+        return -1;
+    }
+    for (i = 0; i < ci->nb_blocks; i++)
+        compact_index_decode(ci, i, st->index_entries + i * COMPACT_INDEX_BLOCK);
+    memcpy(st->index_entries + ci->nb_blocks * COMPACT_INDEX_BLOCK, ci->tail,
+           ci->nb_tail * sizeof(AVIndexEntry));
+    st->nb_index_entries = nb_entries;
+    st->compact_index = ci;
+    compact_index_free(st);
+    return 0;
+}
+
+static int compact_index_add(AVStream *st, int64_t pos, int64_t timestamp,
+                             int size, int distance, int flags)
+{
+    CompactIndex *ci = st->compact_index;
+    int index = ff_index_nb_entries(st);
+    AVIndexEntry *ie;
+
+    if (ci->nb_tail && ci->tail[ci->nb_tail - 1].timestamp == timestamp) {
+        ie = &ci->tail[ci->nb_tail - 1];
+        if (ie->pos == pos && distance < ie->min_distance) //do not reduce the distance
+            distance = ie->min_distance;
+        index--;
+    } else {
+        /* only flush when the next entry arrives, so that the last entry
+         * always stays in the tail and can still be updated */
+        if (ci->nb_tail == COMPACT_INDEX_BLOCK && compact_index_flush(ci) < 0)
+            return -1;
+        ie = &ci->tail[ci->nb_tail++];
+    }
+
+    ie->pos          = pos;
+    ie->timestamp    = timestamp;
+    ie->min_distance = distance;
+    ie->size         = size;
+    ie->flags        = flags;
+
+    return index;
+}
+
+/**
+ * @return the entries of chunk, which is either a coded block or the tail
+ */
+static const AVIndexEntry *compact_index_chunk(CompactIndex *ci, int chunk, int *nb_entries)
+{
+    if (chunk == ci->nb_blocks) {
+        *nb_entries = ci->nb_tail;
+        return ci->tail;
+    }
+    if (ci->cache_block != chunk) {
+        compact_index_decode(ci, chunk, ci->cache);
+        ci->cache_block = chunk;
+    }
+    *nb_entries = COMPACT_INDEX_BLOCK;
+    return ci->cache;
+}
+
+int ff_index_enable_compact(AVStream *st)
+{
+    if (st->compact_index)
+        return 0;
+    if (st->nb_index_entries)
+        return -1;
+    st->compact_index = av_mallocz(sizeof(CompactIndex));
+    if (!st->compact_index)
+        return AVERROR(ENOMEM);
+    st->compact_index->cache_block = -1;
+    return 0;
+}
+
+int ff_index_nb_entries(AVStream *st)
+{
+    CompactIndex *ci = st->compact_index;
+
+    if (!ci)
+        return st->nb_index_entries;
+    return ci->nb_blocks * COMPACT_INDEX_BLOCK + ci->nb_tail;
+}
+
+const AVIndexEntry *ff_index_get_entry(AVStream *st, int index)
+{
+    CompactIndex *ci = st->compact_index;
+    const AVIndexEntry *entries;
+    int nb_entries;
+
+    if (index < 0 || index >= ff_index_nb_entries(st))
+        return NULL;
+    if (!ci)
+        return &st->index_entries[index];
+    entries = compact_index_chunk(ci, index / COMPACT_INDEX_BLOCK, &nb_entries);
+    return &entries[index % COMPACT_INDEX_BLOCK];
+}
+
+/**
+ * Find the last entry <= and the first entry >= wanted_timestamp, looking
+ * only at the block starts and a single decoded block.
+ */
+static void compact_index_bound(AVStream *st, int64_t wanted_timestamp, int *pa, int *pb)
+{
+    CompactIndex *ci = st->compact_index;
+    const AVIndexEntry *entries;
+    int nb_chunks = ci->nb_blocks + !!ci->nb_tail;
+    int a = -1, b = nb_chunks, m, nb_entries;
+
+    while (b - a > 1) {
+        m = (a + b) >> 1;
+        if ((m < ci->nb_blocks ? ci->blocks[m].timestamp : ci->tail[0].timestamp) <= wanted_timestamp)
+            a = m;
+        else
+            b = m;
+    }
+    if (a < 0) {
+        *pa = -1;
+        *pb =  0;
+        return;
+    }
+
+    entries = compact_index_chunk(ci, a, &nb_entries);
+    for (m = 0; m < nb_entries && entries[m].timestamp < wanted_timestamp; m++)
+        ;
+    *pb = a * COMPACT_INDEX_BLOCK + m;
+    if (m < nb_entries && entries[m].timestamp == wanted_timestamp)
+        *pa = *pb;
+    else
+        *pa = *pb - 1;
+}
+
 int av_add_index_entry(AVStream *st,
                             int64_t pos, int64_t timestamp, int size, int distance, int flags)
 {
     AVIndexEntry *entries, *ie;
     int index;
 
+    if(st->max_index_entries && ff_index_nb_entries(st) >= st->max_index_entries)
+        return -1;
+
+    if(st->compact_index){
+        CompactIndex *ci= st->compact_index;
+        if(!ci->nb_tail || ci->tail[ci->nb_tail-1].timestamp <= timestamp)
+            return compact_index_add(st, pos, timestamp, size, distance, flags);
+        /* inserting in the middle would need recoding, switch to the plain array */
+        if(compact_index_expand(st) < 0)
+            return -1;
+    }
+
     if((unsigned)st->nb_index_entries + 1 >= UINT_MAX / sizeof(AVIndexEntry))
         return -1;
 
-    entries = av_fast_realloc(st->index_entries,
-                              &st->index_entries_allocated_size,
-                              (st->nb_index_entries + 1) *
-                              sizeof(AVIndexEntry));
-    if(!entries)
+    if(grow_index_entries(st, st->nb_index_entries + 1) < 0)
         return -1;
 
-    st->index_entries= entries;
+    entries= st->index_entries;
 
-    index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
+    /* entries mostly come in order, so check the end before searching */
+    if(!st->nb_index_entries || entries[st->nb_index_entries-1].timestamp < timestamp)
+        index= -1;
+    else if(entries[st->nb_index_entries-1].timestamp == timestamp)
+        index= st->nb_index_entries-1;
+    else
+        index= av_index_search_timestamp(st, timestamp, AVSEEK_FLAG_ANY);
 
     if(index<0){
         index= st->nb_index_entries++;
@@ -1297,25 +2805,29 @@ int av_index_search_timestamp(AVStream *st, int64_t wanted_timestamp,
                               int flags)
 {
     AVIndexEntry *entries= st->index_entries;
-    int nb_entries= st->nb_index_entries;
+    int nb_entries= ff_index_nb_entries(st);
     int a, b, m;
     int64_t timestamp;
 
     a = - 1;
     b = nb_entries;
 
-    while (b - a > 1) {
-        m = (a + b) >> 1;
-        timestamp = entries[m].timestamp;
-        if(timestamp >= wanted_timestamp)
-            b = m;
-        if(timestamp <= wanted_timestamp)
-            a = m;
+    if(st->compact_index){
+        compact_index_bound(st, wanted_timestamp, &a, &b);
+    }else{
+        while (b - a > 1) {
+            m = (a + b) >> 1;
+            timestamp = entries[m].timestamp;
+            if(timestamp >= wanted_timestamp)
+                b = m;
+            if(timestamp <= wanted_timestamp)
+                a = m;
+        }
     }
     m= (flags & AVSEEK_FLAG_BACKWARD) ? a : b;
 
     if(!(flags & AVSEEK_FLAG_ANY)){
-        while(m>=0 && m<nb_entries && !(entries[m].flags & AVINDEX_KEYFRAME)){
+        while(m>=0 && m<nb_entries && !(ff_index_get_entry(st, m)->flags & AVINDEX_KEYFRAME)){
             m += (flags & AVSEEK_FLAG_BACKWARD) ? -1 : 1;
         }
     }
@@ -1347,12 +2859,12 @@ int av_seek_frame_binary(AVFormatContext *s, int stream_index, int64_t target_ts
     pos_limit= -1; //gcc falsely says it may be uninitialized
 
     st= s->streams[stream_index];
-    if(st->index_entries){
-        AVIndexEntry *e;
+    if(ff_index_nb_entries(st)){
+        const AVIndexEntry *e;
 
         index= av_index_search_timestamp(st, target_ts, flags | AVSEEK_FLAG_BACKWARD); //FIXME whole func must be checked for non-keyframe entries in index case, especially read_timestamp()
         index= FFMAX(index, 0);
-        e= &st->index_entries[index];
+        e= ff_index_get_entry(st, index);
 
         if(e->timestamp <= target_ts || e->pos == e->min_distance){
             pos_min= e->pos;
@@ -1366,9 +2878,9 @@ int av_seek_frame_binary(AVFormatContext *s, int stream_index, int64_t target_ts
         }
 
         index= av_index_search_timestamp(st, target_ts, flags & ~AVSEEK_FLAG_BACKWARD);
-        assert(index < st->nb_index_entries);
+        assert(index < ff_index_nb_entries(st));
         if(index >= 0){
-            e= &st->index_entries[index];
+            e= ff_index_get_entry(st, index);
             assert(e->timestamp >= target_ts);
             pos_max= e->pos;
             ts_max= e->timestamp;
@@ -1393,10 +2905,164 @@ int av_seek_frame_binary(AVFormatContext *s, int stream_index, int64_t target_ts
     return 0;
 }
 
+/**
+ * Timestamps found by read_timestamp() during earlier searches of a stream.
+ * The file does not change while it is open, so they stay valid across
+ * seeks and let av_gen_search() start from a narrower range.
+ */
+typedef struct SeekPoint {
+    int64_t start;              ///< read_timestamp() from any position in [start, pos] finds ts at pos
+    int64_t pos;
+    int64_t ts;
+} SeekPoint;
+
+typedef struct SeekPointCache {
+    SeekPoint *points;          ///< sorted by pos
+    int nb_points;
+    int64_t end_size;           ///< file size for which end_pos/end_ts were found, -1 if unknown
+    int64_t end_pos, end_ts;    ///< last timestamp of the file
+} SeekPointCache;
+
+#define MAX_SEEK_POINTS 4096
+
+static SeekPointCache *seek_cache_get(AVFormatContext *s, int stream_index)
+{
+    AVStream *st;
+
+    if (stream_index < 0 || stream_index >= s->nb_streams)
+        return NULL;
+    st = s->streams[stream_index];
+    if (!st->seek_cache && (st->seek_cache = av_mallocz(sizeof(SeekPointCache))))
+        st->seek_cache->end_size = -1;
+    return st->seek_cache;
+}
+
+/**
+ * @return index of the first point at or after pos
+ */
+static int seek_cache_find(SeekPointCache *c, int64_t pos)
+{
+    int lo = 0, hi = c->nb_points;
+
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (c->points[mid].pos < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void seek_cache_add(SeekPointCache *c, int64_t start, int64_t pos, int64_t ts)
+{
+    int i = seek_cache_find(c, pos);
+    SeekPoint *p;
+
+    if (i < c->nb_points && c->points[i].pos == pos) {
+        c->points[i].start = FFMIN(c->points[i].start, start);
+        return;
+    }
+    if (c->nb_points >= MAX_SEEK_POINTS)
+        return;
+    p = av_realloc(c->points, (c->nb_points + 1) * sizeof(*p));
+    if (!p)
+        return;
+    c->points = p;
+    memmove(p + i + 1, p + i, (c->nb_points - i) * sizeof(*p));
+    p[i].start = start;
+    p[i].pos   = pos;
+    p[i].ts    = ts;
+    c->nb_points++;
+}
+
+/**
+ * read_timestamp() answered from the cache if an earlier call started
+ * within the same range.
+ */
+static int64_t cached_read_timestamp(AVFormatContext *s, SeekPointCache *c,
+                                     int stream_index, int64_t *ppos, int64_t pos_limit,
+                                     int64_t (*read_timestamp)(struct AVFormatContext *, int , int64_t *, int64_t ))
+{
+    int64_t start = *ppos, ts;
+    int i;
+
+    if (!c) {
+        s->seek_probes++;
+        return read_timestamp(s, stream_index, ppos, pos_limit);
+    }
+    i = seek_cache_find(c, start);
+    if (i < c->nb_points && c->points[i].start <= start &&
+        c->points[i].pos <= pos_limit) {
+        *ppos = c->points[i].pos;
+        return c->points[i].ts;
+    }
+    s->seek_probes++;
+    ts = read_timestamp(s, stream_index, ppos, pos_limit);
+    if (ts != AV_NOPTS_VALUE)
+        seek_cache_add(c, start, *ppos, ts);
+    return ts;
+}
+
+/**
+ * Narrow the search range with the cached points between its bounds.
+ */
+static void seek_cache_narrow(SeekPointCache *c, int64_t target_ts,
+                              int64_t *pos_min, int64_t *ts_min,
+                              int64_t *pos_max, int64_t *ts_max, int64_t *pos_limit)
+{
+    int i = seek_cache_find(c, *pos_min + 1);
+
+    for (; i < c->nb_points && c->points[i].pos < *pos_max; i++) {
+        SeekPoint *p = &c->points[i];
+        if (p->ts <= target_ts) {
+            *pos_min = p->pos;
+            *ts_min  = p->ts;
+        }
+        if (p->ts >= target_ts) {
+            *pos_max   = p->pos;
+            *ts_max    = p->ts;
+            *pos_limit = FFMAX(FFMIN(p->start - 1, *pos_limit), *pos_min);
+            break;
+        }
+    }
+}
+
+/**
+ * Move a probe position into the data buffered in pb if that is close,
+ * as probing there costs no I/O.
+ */
+static int64_t seek_snap_to_buffer(ByteIOContext *pb, int64_t pos,
+                                   int64_t pos_min, int64_t pos_limit)
+{
+    int64_t lo, hi, near;
+
+    if (!pb || pb->write_flag)
+        return pos;
+    lo = FFMAX(pb->pos - (pb->buf_end - pb->buffer), pos_min + 1);
+    hi = FFMIN(pb->pos - 1, pos_limit);
+    if (lo > hi || (pos >= lo && pos <= hi))
+        return pos;
+    near = pos < lo ? lo : hi;
+    if (FFABS(near - pos) <= (pos_limit - pos_min) >> 3)
+        return near;
+    return pos;
+}
+
+static void seek_cache_free(AVStream *st)
+{
+    if (st->seek_cache)
+        av_free(st->seek_cache->points);
+    av_freep(&st->seek_cache);
+}
+
 int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, int64_t pos_min, int64_t pos_max, int64_t pos_limit, int64_t ts_min, int64_t ts_max, int flags, int64_t *ts_ret, int64_t (*read_timestamp)(struct AVFormatContext *, int , int64_t *, int64_t )){
     int64_t pos, ts;
     int64_t start_pos, filesize;
-    int no_change;
+    int no_change, probes = 0, last_side = 0;
+    double weight_min = 1.0, weight_max = 1.0;
+    const int adaptive = s->seek_strategy == AVSEEK_STRATEGY_ADAPTIVE;
+    SeekPointCache *cache = seek_cache_get(s, stream_index);
 
 #ifdef DEBUG_SEEK
     av_log(s, AV_LOG_DEBUG, "gen_seek: %d %"PRId64"\n", stream_index, target_ts);
@@ -1404,18 +3070,25 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
 
     if(ts_min == AV_NOPTS_VALUE){
         pos_min = s->data_offset;
-        ts_min = read_timestamp(s, stream_index, &pos_min, INT64_MAX);
+        ts_min = cached_read_timestamp(s, cache, stream_index, &pos_min, INT64_MAX, read_timestamp);
         if (ts_min == AV_NOPTS_VALUE)
             return -1;
     }
 
+    if(ts_max == AV_NOPTS_VALUE && cache && cache->end_size >= 0 &&
+       cache->end_size == url_fsize(s->pb)){
+        pos_max   = cache->end_pos;
+        ts_max    = cache->end_ts;
+        pos_limit = pos_max;
+    }
+
     if(ts_max == AV_NOPTS_VALUE){
         int step= 1024;
         filesize = url_fsize(s->pb);
         pos_max = filesize - 1;
         do{
             pos_max -= step;
-            ts_max = read_timestamp(s, stream_index, &pos_max, pos_max + step);
+            ts_max = cached_read_timestamp(s, cache, stream_index, &pos_max, pos_max + step, read_timestamp);
             step += step;
         }while(ts_max == AV_NOPTS_VALUE && pos_max >= step);
         if (ts_max == AV_NOPTS_VALUE)
@@ -1423,7 +3096,7 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
 
         for(;;){
             int64_t tmp_pos= pos_max + 1;
-            int64_t tmp_ts= read_timestamp(s, stream_index, &tmp_pos, INT64_MAX);
+            int64_t tmp_ts= cached_read_timestamp(s, cache, stream_index, &tmp_pos, INT64_MAX, read_timestamp);
             if(tmp_ts == AV_NOPTS_VALUE)
                 break;
             ts_max= tmp_ts;
@@ -1432,6 +3105,11 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
                 break;
         }
         pos_limit= pos_max;
+        if (cache) {
+            cache->end_size = filesize;
+            cache->end_pos  = pos_max;
+            cache->end_ts   = ts_max;
+        }
     }
 
     if(ts_min > ts_max){
@@ -1440,6 +3118,9 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
         pos_limit= pos_min;
     }
 
+    if (cache && ts_min < ts_max)
+        seek_cache_narrow(cache, target_ts, &pos_min, &ts_min, &pos_max, &ts_max, &pos_limit);
+
     no_change=0;
     while (pos_min < pos_limit) {
 #ifdef DEBUG_SEEK
@@ -1449,7 +3130,22 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
 #endif
         assert(pos_limit <= pos_max);
 
-        if(no_change==0){
+        if (s->seek_max_probes > 0 && probes >= s->seek_max_probes)
+            break;
+        probes++;
+
+        if(no_change==0 && adaptive){
+            int64_t approximate_keyframe_distance= pos_max - pos_limit;
+            /* regula falsi with the Illinois modification: the weight of
+             * a bound that was kept twice in a row is halved, so that the
+             * bracket shrinks from both sides on skewed (VBR) content */
+            double d_min = (target_ts - ts_min) * weight_min;
+            double d_max = (ts_max - target_ts) * weight_max;
+            pos = pos_min - approximate_keyframe_distance;
+            if (d_min + d_max > 0)
+                pos += (pos_max - pos_min) * (d_min / (d_min + d_max));
+            pos = seek_snap_to_buffer(s->pb, pos, pos_min, pos_limit);
+        }else if(no_change==0){
             int64_t approximate_keyframe_distance= pos_max - pos_limit;
             // interpolate position (better than dichotomy)
             pos = av_rescale(target_ts - ts_min, pos_max - pos_min, ts_max - ts_min)
@@ -1468,7 +3164,7 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
             pos= pos_limit;
         start_pos= pos;
 
-        ts = read_timestamp(s, stream_index, &pos, INT64_MAX); //may pass pos_limit instead of -1
+        ts = cached_read_timestamp(s, cache, stream_index, &pos, INT64_MAX, read_timestamp); //may pass pos_limit instead of -1
         if(pos == pos_max)
             no_change++;
         else
@@ -1492,6 +3188,12 @@ int64_t av_gen_search(AVFormatContext *s, int stream_index, int64_t target_ts, i
             pos_min = pos;
             ts_min = ts;
         }
+        if (adaptive) {
+            int side = target_ts < ts ? 1 : target_ts > ts ? -1 : 0;
+            weight_min = side > 0 && last_side > 0 ? weight_min * 0.5 : 1.0;
+            weight_max = side < 0 && last_side < 0 ? weight_max * 0.5 : 1.0;
+            last_side = side;
+        }
     }
 
     pos = (flags & AVSEEK_FLAG_BACKWARD) ? pos_min : pos_max;
@@ -1539,19 +3241,18 @@ static int av_seek_frame_generic(AVFormatContext *s,
     int index;
     int64_t ret;
     AVStream *st;
-    AVIndexEntry *ie;
+    const AVIndexEntry *ie;
 
     st = s->streams[stream_index];
 
     index = av_index_search_timestamp(st, timestamp, flags);
 
-    if(index < 0 || index==st->nb_index_entries-1){
+    if(index < 0 || index==ff_index_nb_entries(st)-1){
         int i;
         AVPacket pkt;
 
-        if(st->nb_index_entries){
-            assert(st->index_entries);
-            ie= &st->index_entries[st->nb_index_entries-1];
+        if(ff_index_nb_entries(st)){
+            ie= ff_index_get_entry(st, ff_index_nb_entries(st)-1);
             if ((ret = url_fseek(s->pb, ie->pos, SEEK_SET)) < 0)
                 return ret;
             av_update_cur_dts(s, st, ie->timestamp);
@@ -1582,7 +3283,7 @@ static int av_seek_frame_generic(AVFormatContext *s,
         if(s->iformat->read_seek(s, stream_index, timestamp, flags) >= 0)
             return 0;
     }
-    ie = &st->index_entries[index];
+    ie = ff_index_get_entry(st, index);
     if ((ret = url_fseek(s->pb, ie->pos, SEEK_SET)) < 0)
         return ret;
     av_update_cur_dts(s, st, ie->timestamp);
@@ -1590,13 +3291,18 @@ static int av_seek_frame_generic(AVFormatContext *s,
     return 0;
 }
 
-int av_seek_frame(AVFormatContext *s, int stream_index, int64_t timestamp, int flags)
+/**
+ * @param phase set to the AVFMT_PHASE_SEEK_* kind of the seek
+ */
+static int seek_frame_internal(AVFormatContext *s, int stream_index, int64_t timestamp, int flags,
+                               int *phase)
 {
-    int ret;
+    int ret, index;
     AVStream *st;
 
     av_read_frame_flush(s);
 
+    *phase = AVFMT_PHASE_SEEK_BYTE;
     if(flags & AVSEEK_FLAG_BYTE)
         return av_seek_frame_byte(s, stream_index, timestamp, flags);
 
@@ -1611,6 +3317,7 @@ int av_seek_frame(AVFormatContext *s, int stream_index, int64_t timestamp, int f
     }
 
     /* first, we try the format specific seek */
+    *phase = AVFMT_PHASE_SEEK_READ_SEEK;
     if (s->iformat->read_seek)
         ret = s->iformat->read_seek(s, stream_index, timestamp, flags);
     else
@@ -1619,10 +3326,44 @@ int av_seek_frame(AVFormatContext *s, int stream_index, int64_t timestamp, int f
         return 0;
     }
 
-    if(s->iformat->read_timestamp)
+    if(s->iformat->read_timestamp){
+        *phase = AVFMT_PHASE_SEEK_BINARY;
         return av_seek_frame_binary(s, stream_index, timestamp, flags);
-    else
-        return av_seek_frame_generic(s, stream_index, timestamp, flags);
+    }
+    /* the generic seek only reads packets if the index does not cover the target */
+    st = s->streams[stream_index];
+    index = av_index_search_timestamp(st, timestamp, flags);
+    *phase = index < 0 || index == ff_index_nb_entries(st) - 1 ? AVFMT_PHASE_SEEK_GENERIC
+                                                               : AVFMT_PHASE_SEEK_INDEX;
+    return av_seek_frame_generic(s, stream_index, timestamp, flags);
+}
+
+/**
+ * Start counting the cost of a seek in seek_probes and seek_bytes.
+ */
+static int64_t seek_stats_start(AVFormatContext *s)
+{
+    s->seek_probes = 0;
+    s->seek_bytes  = 0;
+    return s->pb ? s->pb->stats.bytes_read : 0;
+}
+
+static void seek_stats_end(AVFormatContext *s, int64_t bytes_read, int phase, int64_t start_time)
+{
+    if (s->pb)
+        s->seek_bytes = s->pb->stats.bytes_read - bytes_read;
+    record_timing(s, phase, -1, av_gettime() - start_time);
+}
+
+int av_seek_frame(AVFormatContext *s, int stream_index, int64_t timestamp, int flags)
+{
+    int64_t start_time = av_gettime();
+    int64_t bytes_read = seek_stats_start(s);
+    int phase;
+    int ret = seek_frame_internal(s, stream_index, timestamp, flags, &phase);
+
+    seek_stats_end(s, bytes_read, phase, start_time);
+    return ret;
 }
 
 int avformat_seek_file(AVFormatContext *s, int stream_index, int64_t min_ts, int64_t ts, int64_t max_ts, int flags)
@@ -1632,8 +3373,13 @@ int avformat_seek_file(AVFormatContext *s, int stream_index, int64_t min_ts, int
 
     av_read_frame_flush(s);
 
-    if (s->iformat->read_seek2)
-        return s->iformat->read_seek2(s, stream_index, min_ts, ts, max_ts, flags);
+    if (s->iformat->read_seek2) {
+        int64_t start_time = av_gettime();
+        int64_t bytes_read = seek_stats_start(s);
+        int ret = s->iformat->read_seek2(s, stream_index, min_ts, ts, max_ts, flags);
+        seek_stats_end(s, bytes_read, AVFMT_PHASE_SEEK_READ_SEEK, start_time);
+        return ret;
+    }
 
     if(s->iformat->read_timestamp){
         //try to seek via read_timestamp()
@@ -1842,10 +3588,204 @@ static void av_estimate_timings_from_pts(AVFormatContext *ic, int64_t old_offset
     }
 }
 
+/**
+ * End of file scan refining the durations of av_estimate_timings() in the
+ * background, used with AVFMT_FLAG_LAZY_DURATION.
+ * The scan runs on its own context opened from the file name so that it
+ * does not disturb the demuxing of the caller; streams are matched by id.
+ */
+typedef struct DurationEstimate {
+    char filename[1024];
+    AVInputFormat *iformat;
+    int64_t offset;                     ///< where the scan starts
+    int nb_streams;
+    int id[MAX_STREAMS];
+    AVRational time_base[MAX_STREAMS];
+    int64_t start_time[MAX_STREAMS];
+    int64_t end_pts[MAX_STREAMS];       ///< largest pts found, in time_base
+    int ret;                            ///< scan result, AVERROR(EAGAIN) until it finished
+#if HAVE_PTHREADS
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+#endif
+} DurationEstimate;
+
+static void duration_scan(DurationEstimate *de)
+{
+    AVFormatContext *ic;
+    AVPacket pkt;
+    AVStream *st;
+    int64_t end_pts[MAX_STREAMS];
+    int read_size = 0, i, ret;
+
+    for (i = 0; i < de->nb_streams; i++)
+        end_pts[i] = AV_NOPTS_VALUE;
+
+    ret = av_open_input_file(&ic, de->filename, de->iformat, 0, NULL);
+    if (ret >= 0) {
+        url_fseek(ic->pb, de->offset, SEEK_SET);
+        while (read_size < DURATION_MAX_READ_SIZE) {
+            do {
+                ret = av_read_packet(ic, &pkt);
+            } while (ret == AVERROR(EAGAIN));
+            if (ret)
+                break;
+            read_size += pkt.size;
+            st = ic->streams[pkt.stream_index];
+            for (i = 0; i < de->nb_streams; i++)
+                if (de->id[i] == st->id)
+                    break;
+            if (i < de->nb_streams && pkt.pts != AV_NOPTS_VALUE) {
+                int64_t pts = av_rescale_q(pkt.pts, st->time_base, de->time_base[i]);
+                if (end_pts[i] == AV_NOPTS_VALUE || pts > end_pts[i])
+                    end_pts[i] = pts;
+            }
+            av_free_packet(&pkt);
+        }
+        av_close_input_file(ic);
+        ret = 0;
+    }
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&de->lock);
+#endif
+    memcpy(de->end_pts, end_pts, sizeof(end_pts));
+    de->ret = ret;
+#if HAVE_PTHREADS
+    pthread_mutex_unlock(&de->lock);
+#endif
+}
+
+#if HAVE_PTHREADS
+static void *duration_scan_thread(void *arg)
+{
+    duration_scan(arg);
+    return NULL;
+}
+#endif
+
+static int duration_estimate_start(AVFormatContext *ic)
+{
+    DurationEstimate *de;
+    AVStream *st;
+    int i;
+
+    if (!ic->filename[0] || ic->nb_streams > MAX_STREAMS)
+        return -1;
+    de = av_mallocz(sizeof(DurationEstimate));
+    if (!de)
+        return AVERROR(ENOMEM);
+    av_strlcpy(de->filename, ic->filename, sizeof(de->filename));
+    de->iformat    = ic->iformat;
+    de->offset     = FFMAX(ic->file_size - DURATION_MAX_READ_SIZE, 0);
+    de->nb_streams = ic->nb_streams;
+    de->ret        = AVERROR(EAGAIN);
+    for (i = 0; i < ic->nb_streams; i++) {
+        st = ic->streams[i];
+        de->id[i]         = st->id;
+        de->time_base[i]  = st->time_base;
+        de->start_time[i] = st->start_time != AV_NOPTS_VALUE ? st->start_time
+                                                             : st->first_dts;
+    }
+#if HAVE_PTHREADS
+    pthread_mutex_init(&de->lock, NULL);
+    if (!pthread_create(&de->thread, NULL, duration_scan_thread, de))
+        de->thread_started = 1;
+#endif
+    ic->duration_estimate = de;
+    return 0;
+}
+
+static void duration_estimate_free(AVFormatContext *ic)
+{
+    DurationEstimate *de = ic->duration_estimate;
+
+    if (!de)
+        return;
+#if HAVE_PTHREADS
+    if (de->thread_started)
+        pthread_join(de->thread, NULL);
+    pthread_mutex_destroy(&de->lock);
+#endif
+    av_freep(&ic->duration_estimate);
+}
+
+/**
+ * Replace the bit rate based durations by the ones found by the scan.
+ */
+static void duration_estimate_apply(AVFormatContext *ic)
+{
+    DurationEstimate *de = ic->duration_estimate;
+    AVStream *st;
+    int i, found = 0;
+
+    for (i = 0; i < de->nb_streams; i++)
+        if (de->end_pts[i] != AV_NOPTS_VALUE &&
+            de->start_time[i] != AV_NOPTS_VALUE &&
+            de->end_pts[i] > de->start_time[i])
+            found++;
+    if (!found) {
+        av_log(ic, AV_LOG_WARNING, "Could not refine the duration estimated from bitrate\n");
+        return;
+    }
+    for (i = 0; i < de->nb_streams; i++) {
+        st = ic->streams[i];
+        st->duration = AV_NOPTS_VALUE;
+        if (de->end_pts[i] != AV_NOPTS_VALUE &&
+            de->start_time[i] != AV_NOPTS_VALUE &&
+            de->end_pts[i] > de->start_time[i])
+            st->duration = de->end_pts[i] - de->start_time[i];
+    }
+    fill_all_stream_timings(ic);
+    av_update_stream_timings(ic);
+}
+
+int av_update_duration(AVFormatContext *ic, int wait)
+{
+    DurationEstimate *de = ic->duration_estimate;
+    int ret;
+
+    if (!de)
+        return 1;
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&de->lock);
+    ret = de->ret;
+    pthread_mutex_unlock(&de->lock);
+    if (de->thread_started) {
+        if (ret == AVERROR(EAGAIN) && !wait)
+            return 0;
+        pthread_join(de->thread, NULL);
+        de->thread_started = 0;
+    } else
+#else
+    ret = de->ret;
+#endif
+    if (ret == AVERROR(EAGAIN)) {
+        if (!wait)
+            return 0;
+        duration_scan(de);
+    }
+
+    if (de->ret < 0)
+        av_log(ic, AV_LOG_WARNING, "Could not reopen %s to refine the duration\n",
+               de->filename);
+    else
+        duration_estimate_apply(ic);
+    duration_estimate_free(ic);
+    return 1;
+}
+
 static void av_estimate_timings(AVFormatContext *ic, int64_t old_offset)
 {
     int64_t file_size;
 
+    /* live input has no duration worth reading ahead or seeking for */
+    if (ic->flags & AVFMT_FLAG_LOW_DELAY) {
+        av_update_stream_timings(ic);
+        return;
+    }
+
     /* get the file size, if possible */
     if (ic->iformat->flags & AVFMT_NOFILE) {
         file_size = 0;
@@ -1859,8 +3799,15 @@ static void av_estimate_timings(AVFormatContext *ic, int64_t old_offset)
     if ((!strcmp(ic->iformat->name, "mpeg") ||
          !strcmp(ic->iformat->name, "mpegts")) &&
         file_size && !url_is_streamed(ic->pb)) {
-        /* get accurate estimate from the PTSes */
-        av_estimate_timings_from_pts(ic, old_offset);
+        if (!(ic->flags & AVFMT_FLAG_LAZY_DURATION) ||
+            duration_estimate_start(ic) < 0) {
+            /* get accurate estimate from the PTSes */
+            av_estimate_timings_from_pts(ic, old_offset);
+        } else {
+            /* publish the bitrate estimate, the PTSes refine it later */
+            av_log(ic, AV_LOG_VERBOSE, "Estimating duration from bitrate until the end of the file was scanned\n");
+            av_estimate_timings_from_bit_rate(ic);
+        }
     } else if (av_has_duration(ic)) {
         /* at least one component has timings - we use them for all
            the components */
@@ -1890,6 +3837,32 @@ static void av_estimate_timings(AVFormatContext *ic, int64_t old_offset)
 #endif
 }
 
+/**
+ * @return 1 if the demuxer declared everything about st that
+ *         av_find_stream_info() would otherwise look for
+ */
+static int has_container_parameters(AVStream *st)
+{
+    AVCodecContext *enc = st->codec;
+    int params = st->container_params;
+
+    if (!(params & FF_PARAM_CODEC) || enc->codec_id == CODEC_ID_NONE ||
+        (!(params & FF_PARAM_EXTRADATA) && !enc->extradata))
+        return 0;
+    switch(enc->codec_type) {
+    case CODEC_TYPE_VIDEO:
+        return (params & FF_PARAM_DIMENSIONS) && enc->width && enc->height &&
+               ((params & FF_PARAM_FRAME_RATE) || st->r_frame_rate.num);
+    case CODEC_TYPE_AUDIO:
+        return (params & FF_PARAM_AUDIO) && enc->sample_rate && enc->channels;
+    case CODEC_TYPE_SUBTITLE:
+    case CODEC_TYPE_DATA:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 static int has_codec_parameters(AVCodecContext *enc)
 {
     int val;
@@ -1913,27 +3886,38 @@ static int has_codec_parameters(AVCodecContext *enc)
     return enc->codec_id != CODEC_ID_NONE && val != 0;
 }
 
-static int try_decode_frame(AVStream *st, AVPacket *avpkt)
+#if HAVE_PTHREADS
+/* avcodec_open() must not run concurrently */
+static pthread_mutex_t decode_open_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int try_decode_frame(AVCodecContext *avctx, AVPacket *avpkt)
 {
     int16_t *samples;
     AVCodec *codec;
     int got_picture, data_size, ret=0;
     AVFrame picture;
 
-    if(!st->codec->codec){
-        codec = avcodec_find_decoder(st->codec->codec_id);
+    if(!avctx->codec){
+        codec = avcodec_find_decoder(avctx->codec_id);
         if (!codec)
             return -1;
-        ret = avcodec_open(st->codec, codec);
+#if HAVE_PTHREADS
+        pthread_mutex_lock(&decode_open_lock);
+#endif
+        ret = avcodec_open(avctx, codec);
+#if HAVE_PTHREADS
+        pthread_mutex_unlock(&decode_open_lock);
+#endif
         if (ret < 0)
             return ret;
     }
 
-    if(!has_codec_parameters(st->codec)){
-        switch(st->codec->codec_type) {
+    if(!has_codec_parameters(avctx)){
+        switch(avctx->codec_type) {
         case CODEC_TYPE_VIDEO:
             avcodec_get_frame_defaults(&picture);
-            ret = avcodec_decode_video2(st->codec, &picture,
+            ret = avcodec_decode_video2(avctx, &picture,
                                         &got_picture, avpkt);
             break;
         case CODEC_TYPE_AUDIO:
@@ -1941,7 +3925,7 @@ static int try_decode_frame(AVStream *st, AVPacket *avpkt)
             samples = av_malloc(data_size);
             if (!samples)
                 goto fail;
-            ret = avcodec_decode_audio3(st->codec, samples,
+            ret = avcodec_decode_audio3(avctx, samples,
                                         &data_size, avpkt);
             av_free(samples);
             break;
@@ -1949,12 +3933,260 @@ static int try_decode_frame(AVStream *st, AVPacket *avpkt)
             break;
         }
     }
- fail:
-    return ret;
+ fail:
+    return ret;
+}
+
+#if HAVE_PTHREADS
+/**
+ * Probe decoding of one stream on the thread pool, one packet after the
+ * other. The tasks decode into a private copy of the codec context so that
+ * the demuxer and parsers can keep using st->codec; the results are copied
+ * back once complete.
+ */
+typedef struct DecodeWorker {
+    AVCodecContext *avctx;
+    FFTaskQueue *queue;         ///< of packets from the packet buffer, not owned
+    pthread_mutex_t lock;
+    int found;                  ///< avctx has all parameters, it is not touched any more
+    int quit;
+} DecodeWorker;
+
+static void decode_task(void *opaque, void *job)
+{
+    DecodeWorker *w = opaque;
+    int found;
+
+    pthread_mutex_lock(&w->lock);
+    found = w->found || w->quit;
+    pthread_mutex_unlock(&w->lock);
+    if (found)
+        return;
+
+    try_decode_frame(w->avctx, job);
+    found = has_codec_parameters(w->avctx);
+
+    pthread_mutex_lock(&w->lock);
+    w->found = found;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static DecodeWorker *decode_worker_start(AVFormatContext *ic, AVStream *st)
+{
+    DecodeWorker *w = av_mallocz(sizeof(DecodeWorker));
+
+    if (!w)
+        return NULL;
+    w->avctx = avcodec_alloc_context();
+    if (!w->avctx) {
+        av_free(w);
+        return NULL;
+    }
+    *w->avctx = *st->codec;
+    if (!(w->queue = ff_task_queue_alloc(ic, decode_task, w, 1))) {
+        av_free(w->avctx);
+        av_free(w);
+        return NULL;
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    return w;
+}
+
+static int decode_worker_queue(DecodeWorker *w, AVPacket *pkt)
+{
+    return ff_task_queue_submit(w->queue, pkt);
+}
+
+/**
+ * Copy the parameters found by the worker to st->codec.
+ * @return 1 if they are complete
+ */
+static int decode_worker_poll(DecodeWorker *w, AVStream *st)
+{
+    AVCodecContext *dst = st->codec, *src = w->avctx;
+    int found;
+
+    pthread_mutex_lock(&w->lock);
+    found = w->found;
+    pthread_mutex_unlock(&w->lock);
+    if (!found)
+        return 0;
+
+    dst->width               = src->width;
+    dst->height              = src->height;
+    dst->pix_fmt             = src->pix_fmt;
+    dst->has_b_frames        = src->has_b_frames;
+    dst->sample_aspect_ratio = src->sample_aspect_ratio;
+    dst->time_base           = src->time_base;
+    dst->ticks_per_frame     = src->ticks_per_frame;
+    dst->sample_rate         = src->sample_rate;
+    dst->channels            = src->channels;
+    dst->channel_layout      = src->channel_layout;
+    dst->sample_fmt          = src->sample_fmt;
+    dst->frame_size          = src->frame_size;
+    if (!dst->bit_rate)
+        dst->bit_rate        = src->bit_rate;
+    return 1;
+}
+
+static void decode_worker_stop(DecodeWorker *w, AVStream *st)
+{
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_mutex_unlock(&w->lock);
+    ff_task_queue_free(&w->queue);
+
+    decode_worker_poll(w, st);
+    if (w->avctx->codec) {
+        pthread_mutex_lock(&decode_open_lock);
+        avcodec_close(w->avctx);
+        pthread_mutex_unlock(&decode_open_lock);
+    }
+    pthread_mutex_destroy(&w->lock);
+    av_free(w->avctx);
+    av_free(w);
+}
+#endif
+
+#define CODEC_TAG_INDEX_SIZE 256 ///< maximum number of indexed tag tables, power of 2
+
+typedef struct CodecTagHashEntry {
+    unsigned int key;
+    int index;                  ///< entry in the tag table, -1 if the slot is free
+} CodecTagHashEntry;
+
+typedef struct CodecTagIndex {
+    const AVCodecTag *tags;
+    unsigned int mask;
+    CodecTagHashEntry *by_tag;
+    CodecTagHashEntry *by_upper_tag;
+    CodecTagHashEntry *by_id;
+} CodecTagIndex;
+
+static CodecTagIndex codec_tag_index[CODEC_TAG_INDEX_SIZE];
+static int codec_tag_index_count;
+
+static inline unsigned int tag_hash(unsigned int v)
+{
+    v *= 0x9E3779B1;
+    return v ^ (v >> 16);
+}
+
+static unsigned int upper_tag(unsigned int tag)
+{
+    return  toupper( tag        & 0xFF)        |
+           (toupper((tag >>  8) & 0xFF) <<  8) |
+           (toupper((tag >> 16) & 0xFF) << 16) |
+           ((unsigned int)toupper(tag >> 24) << 24);
+}
+
+static void tag_hash_add(CodecTagHashEntry *h, unsigned int mask,
+                         unsigned int key, int index)
+{
+    unsigned int i = tag_hash(key) & mask;
+
+    while (h[i].index >= 0) {
+        if (h[i].key == key)
+            return; /* the first entry of the table wins */
+        i = (i + 1) & mask;
+    }
+    h[i].key   = key;
+    h[i].index = index;
+}
+
+static int tag_hash_find(const CodecTagHashEntry *h, unsigned int mask,
+                         unsigned int key)
+{
+    unsigned int i = tag_hash(key) & mask;
+
+    while (h[i].index >= 0) {
+        if (h[i].key == key)
+            return h[i].index;
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+static unsigned int tag_table_slot(const AVCodecTag *tags)
+{
+    return tag_hash((unsigned int)(uintptr_t)tags) & (CODEC_TAG_INDEX_SIZE - 1);
+}
+
+static const CodecTagIndex *find_tag_index(const AVCodecTag *tags)
+{
+    unsigned int i;
+
+    if (!codec_tag_index_count)
+        return NULL;
+    for (i = tag_table_slot(tags); codec_tag_index[i].tags;
+         i = (i + 1) & (CODEC_TAG_INDEX_SIZE - 1))
+        if (codec_tag_index[i].tags == tags)
+            return &codec_tag_index[i];
+    return NULL;
+}
+
+static void add_tag_index(const AVCodecTag *tags)
+{
+    CodecTagIndex *idx;
+    unsigned int i, nb_entries, size;
+
+    /* keep the table of tables at most half full */
+    if (find_tag_index(tags) || codec_tag_index_count >= CODEC_TAG_INDEX_SIZE / 2)
+        return;
+
+    for (nb_entries = 0; tags[nb_entries].id != CODEC_ID_NONE; nb_entries++);
+    for (size = 16; size < 2 * nb_entries; size <<= 1);
+
+    for (i = tag_table_slot(tags); codec_tag_index[i].tags;
+         i = (i + 1) & (CODEC_TAG_INDEX_SIZE - 1));
+    idx = &codec_tag_index[i];
+
+    idx->by_tag = av_malloc(3 * size * sizeof(*idx->by_tag));
+    if (!idx->by_tag)
+        return;
+    idx->by_upper_tag = idx->by_tag       + size;
+    idx->by_id        = idx->by_upper_tag + size;
+    idx->mask         = size - 1;
+    for (i = 0; i < 3 * size; i++)
+        idx->by_tag[i].index = -1;
+
+    for (i = 0; i < nb_entries; i++) {
+        tag_hash_add(idx->by_tag,       idx->mask, tags[i].tag,            i);
+        tag_hash_add(idx->by_upper_tag, idx->mask, upper_tag(tags[i].tag), i);
+        tag_hash_add(idx->by_id,        idx->mask, tags[i].id,             i);
+    }
+    idx->tags = tags;
+    codec_tag_index_count++;
+}
+
+static void add_tag_list_index(const AVCodecTag * const *tags)
+{
+    int i;
+
+    for (i = 0; tags && tags[i]; i++)
+        add_tag_index(tags[i]);
+}
+
+void ff_codec_tag_index_init(void)
+{
+    AVInputFormat  *ifmt = NULL;
+    AVOutputFormat *ofmt = NULL;
+
+    while ((ifmt = av_iformat_next(ifmt)))
+        add_tag_list_index(ifmt->codec_tag);
+    while ((ofmt = av_oformat_next(ofmt)))
+        add_tag_list_index(ofmt->codec_tag);
 }
 
 unsigned int ff_codec_get_tag(const AVCodecTag *tags, int id)
 {
+    const CodecTagIndex *idx = find_tag_index(tags);
+
+    if (idx) {
+        int i = tag_hash_find(idx->by_id, idx->mask, id);
+        return i < 0 ? 0 : tags[i].tag;
+    }
+
     while (tags->id != CODEC_ID_NONE) {
         if (tags->id == id)
             return tags->tag;
@@ -1965,7 +4197,16 @@ unsigned int ff_codec_get_tag(const AVCodecTag *tags, int id)
 
 enum CodecID ff_codec_get_id(const AVCodecTag *tags, unsigned int tag)
 {
+    const CodecTagIndex *idx = find_tag_index(tags);
     int i;
+
+    if (idx) {
+        i = tag_hash_find(idx->by_tag, idx->mask, tag);
+        if (i < 0)
+            i = tag_hash_find(idx->by_upper_tag, idx->mask, upper_tag(tag));
+        return i < 0 ? CODEC_ID_NONE : tags[i].id;
+    }
+
     for(i=0; tags[i].id != CODEC_ID_NONE;i++) {
         if(tag == tags[i].tag)
             return tags[i].id;
@@ -2026,6 +4267,60 @@ static int get_std_framerate(int i){
     else        return ((const int[]){24,30,60,12,15})[i-60*12]*1000*12;
 }
 
+/** number of frame durations after which unlikely frame rates are dropped */
+#define FPS_PRUNE_COUNT 8
+
+/**
+ * Squared errors of the frame durations of a video stream against the
+ * standard frame rates still considered.
+ */
+typedef struct FrameRateGuess {
+    int nb_candidates;
+    int16_t candidate[MAX_STD_TIMEBASES]; ///< get_std_framerate() indexes, ascending
+    double error[MAX_STD_TIMEBASES];
+} FrameRateGuess;
+
+static FrameRateGuess *fps_guess_alloc(void)
+{
+    FrameRateGuess *g = av_mallocz(sizeof(FrameRateGuess));
+    int j;
+
+    if (!g)
+        return NULL;
+    for (j = 1; j < MAX_STD_TIMEBASES; j++)
+        g->candidate[g->nb_candidates++] = j;
+    return g;
+}
+
+static void fps_guess_add(FrameRateGuess *g, double dur, int duration_count)
+{
+    int k, n;
+
+    if (duration_count < 2)
+        memset(g->error, 0, g->nb_candidates * sizeof(*g->error));
+    for (k = 0; k < g->nb_candidates; k++) {
+        int framerate= get_std_framerate(g->candidate[k]);
+        int ticks= lrintf(dur*framerate/(1001*12));
+        double error= dur - ticks*1001*12/(double)framerate;
+        g->error[k] += error*error;
+    }
+
+    /* a rate that is far off after a few frames will not win later */
+    if (duration_count == FPS_PRUNE_COUNT) {
+        double best = g->error[0] * get_std_framerate(g->candidate[0]);
+        for (k = 1; k < g->nb_candidates; k++)
+            best = FFMIN(best, g->error[k] * get_std_framerate(g->candidate[k]));
+        for (k = n = 0; k < g->nb_candidates; k++) {
+            if (g->error[k] * get_std_framerate(g->candidate[k]) <= 16 * best) {
+                g->candidate[n] = g->candidate[k];
+                g->error[n]     = g->error[k];
+                n++;
+            }
+        }
+        g->nb_candidates = n;
+    }
+}
+
 /*
  * Is the time base unreliable.
  * This is a heuristic to balance between quick acceptance of the values in
@@ -2054,13 +4349,28 @@ int av_find_stream_info(AVFormatContext *ic)
     int64_t last_dts[MAX_STREAMS];
     int64_t duration_gcd[MAX_STREAMS]={0};
     int duration_count[MAX_STREAMS]={0};
-    double (*duration_error)[MAX_STD_TIMEBASES];
+    FrameRateGuess *fps_guess[MAX_STREAMS]={NULL};
     int64_t old_offset = url_ftell(ic->pb);
     int64_t codec_info_duration[MAX_STREAMS]={0};
     int codec_info_nb_frames[MAX_STREAMS]={0};
+    int nb_packets[MAX_STREAMS]={0};
+    int done[MAX_STREAMS]={0};
+    int cached[MAX_STREAMS]={0}; /* 1 if the probe cache applied, -1 if not */
+    ProbeCacheEntry *cache = NULL;
+    int64_t buffer_size = 0, progress_size = 0;
+    int nb_streams;
+#if HAVE_PTHREADS
+    DecodeWorker *workers[MAX_STREAMS]={NULL};
+    int nb_workers = 0;
+#endif
+    int64_t start_time = av_gettime(), duration_time;
+    const int low_delay = ic->flags & AVFMT_FLAG_LOW_DELAY;
 
-    duration_error = av_mallocz(MAX_STREAMS * sizeof(*duration_error));
-    if (!duration_error) return AVERROR(ENOMEM);
+    if (ff_index_cache_apply_info(ic)) {
+        record_timing(ic, AVFMT_PHASE_STREAM_INFO, -1, av_gettime() - start_time);
+        return 0;
+    }
+    ic->work_start = start_time;
 
     for(i=0;i<ic->nb_streams;i++) {
         st = ic->streams[i];
@@ -2073,7 +4383,7 @@ int av_find_stream_info(AVFormatContext *ic)
         //only for the split stuff
         if (!st->parser) {
             st->parser = av_parser_init(st->codec->codec_id);
-            if(st->need_parsing == AVSTREAM_PARSE_HEADERS && st->parser){
+            if(st->parser && parser_complete_frames(ic, st)){
                 st->parser->flags |= PARSER_FLAG_COMPLETE_FRAMES;
             }
         }
@@ -2083,46 +4393,126 @@ int av_find_stream_info(AVFormatContext *ic)
         last_dts[i]= AV_NOPTS_VALUE;
     }
 
+    /* the headers may already say all there is to know */
+    if ((ic->flags & AVFMT_FLAG_TRUST_CONTAINER) &&
+        !(ic->ctx_flags & AVFMTCTX_NOHEADER) && ic->nb_streams) {
+        for(i=0;i<ic->nb_streams;i++)
+            if (!has_container_parameters(ic->streams[i]))
+                break;
+        if (i == ic->nb_streams) {
+            for(i=0;i<ic->nb_streams;i++) {
+                st = ic->streams[i];
+                if (st->codec->codec_type == CODEC_TYPE_VIDEO && !st->r_frame_rate.num &&
+                    (st->container_params & FF_PARAM_FRAME_RATE))
+                    st->r_frame_rate = st->avg_frame_rate;
+            }
+            av_log(ic, AV_LOG_DEBUG, "Using the codec parameters of the container\n");
+            for(i=0;i<ic->nb_streams;i++)
+                record_timing(ic, AVFMT_PHASE_STREAM_INFO, i, av_gettime() - start_time);
+            ret = 0;
+            goto analyzed;
+        }
+    }
+
+    if (ic->flags & AVFMT_FLAG_PROBE_CACHE)
+        cache = ff_probe_cache_get(ic);
+
     count = 0;
     read_size = 0;
+    nb_streams = ic->nb_streams;
     for(;;) {
-        if(url_interrupt_cb()){
-            ret= AVERROR(EINTR);
+        int nb_done = 0, nb_idle = 0;
+
+        if((ret = ff_check_interrupt(&ic->interrupt)) < 0){
             av_log(ic, AV_LOG_DEBUG, "interrupted\n");
             break;
         }
 
-        /* check if one codec still needs to be handled */
+        /* check which codecs still need to be handled, a stream is not
+           looked at any more once it is done */
         for(i=0;i<ic->nb_streams;i++) {
             st = ic->streams[i];
-            if (!has_codec_parameters(st->codec))
-                break;
-            /* variable fps and no guess at the real fps */
-            if(   tb_unreliable(st->codec)
-               && duration_count[i]<20 && st->codec->codec_type == CODEC_TYPE_VIDEO)
-                break;
-            if(st->parser && st->parser->parser->split && !st->codec->extradata)
-                break;
-            if(st->first_dts == AV_NOPTS_VALUE)
-                break;
+            if (!done[i]) {
+                if (cache && !cached[i])
+                    cached[i] = ff_probe_cache_apply_stream(cache, st) ? 1 : -1;
+#if HAVE_PTHREADS
+                if (workers[i] && !decode_worker_poll(workers[i], st))
+                    goto not_done;
+#endif
+                if (!has_codec_parameters(st->codec))
+                    goto not_done;
+                if(st->parser && st->parser->parser->split && !st->codec->extradata)
+                    goto not_done;
+                /* the frame rate guess and the first dts are left to the
+                   packets read later in low delay mode */
+                if (!low_delay) {
+                    /* variable fps and no guess at the real fps, the
+                       cached frame rate is taken over */
+                    if(   tb_unreliable(st->codec) && cached[i] != 1
+                       && duration_count[i]<20 && st->codec->codec_type == CODEC_TYPE_VIDEO)
+                        goto not_done;
+                    if(st->first_dts == AV_NOPTS_VALUE)
+                        goto not_done;
+                }
+                done[i] = 1;
+                progress_size = read_size;
+                record_timing(ic, AVFMT_PHASE_STREAM_INFO, i, av_gettime() - start_time);
+            }
+            nb_done++;
+            continue;
+        not_done:
+            if (!nb_packets[i])
+                nb_idle++;
         }
-        if (i == ic->nb_streams) {
+        if (nb_done == ic->nb_streams) {
             /* NOTE: if the format has no header, then we need to read
                some packets to get most of the streams, so we cannot
-               stop here */
-            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER)) {
+               stop here, unless streams found later may be missed */
+            if (!(ic->ctx_flags & AVFMTCTX_NOHEADER) || (low_delay && ic->nb_streams) ||
+                (cache && ic->nb_streams >= ff_probe_cache_nb_streams(cache))) {
                 /* if we found the info for all the codecs, we can stop */
                 ret = count;
                 av_log(ic, AV_LOG_DEBUG, "All info found\n");
                 break;
             }
         }
+        if (ic->nb_streams != nb_streams) {
+            nb_streams    = ic->nb_streams;
+            progress_size = read_size;
+        }
+        /* streams without packets so far must not hold up the others
+           forever, neither must waiting for new streams */
+        if (ic->max_analyze_idle && nb_done + nb_idle == ic->nb_streams &&
+            read_size - progress_size >= ic->max_analyze_idle) {
+            ret = count;
+            av_log(ic, AV_LOG_DEBUG, "No new info for %d bytes, %d streams without packets\n",
+                   ic->max_analyze_idle, nb_idle);
+            break;
+        }
         /* we did not get all the codec info, but we read too much data */
         if (read_size >= ic->probesize) {
             ret = count;
             av_log(ic, AV_LOG_WARNING, "MAX_READ_SIZE:%d reached\n", ic->probesize);
             break;
         }
+        if (ic->max_analyze_buffer && buffer_size >= ic->max_analyze_buffer) {
+            ret = count;
+            av_log(ic, AV_LOG_WARNING, "analyzebuffer:%d reached\n", ic->max_analyze_buffer);
+            break;
+        }
+        if (ff_buffer_memory_check(ic, 0, "stream analysis")) {
+            ret = count;
+            break;
+        }
+        /* keep what was found if it is enough */
+        if ((ret = ff_check_work_time(ic)) < 0) {
+            for (i = 0; i < ic->nb_streams; i++)
+                if (!has_codec_parameters(ic->streams[i]->codec))
+                    break;
+            if (i == ic->nb_streams)
+                ret = count;
+            break;
+        }
 
         /* NOTE: a new stream can be added there if no header in file
            (AVFMTCTX_NOHEADER) */
@@ -2145,15 +4535,17 @@ int av_find_stream_info(AVFormatContext *ic)
             break;
         }
 
-        pkt= add_to_pktbuf(&ic->packet_buffer, &pkt1, &ic->packet_buffer_end);
-        if(av_dup_packet(pkt) < 0) {
-            av_free(duration_error);
-            return AVERROR(ENOMEM);
+        pkt= add_to_pktbuf(ic, &ic->packet_buffer, &pkt1, &ic->packet_buffer_end);
+        if(dup_packet(pkt) < 0) {
+            ret = AVERROR(ENOMEM);
+            goto fail;
         }
 
         read_size += pkt->size;
+        buffer_size += pkt->size + FF_INPUT_BUFFER_PADDING_SIZE + sizeof(AVPacketList);
 
         st = ic->streams[pkt->stream_index];
+        nb_packets[st->index]++;
         if(codec_info_nb_frames[st->index]>1) {
             if (st->time_base.den > 0 && av_rescale_q(codec_info_duration[st->index], st->time_base, AV_TIME_BASE_Q) >= ic->max_analyze_duration){
                 av_log(ic, AV_LOG_WARNING, "max_analyze_duration reached\n");
@@ -2164,6 +4556,11 @@ int av_find_stream_info(AVFormatContext *ic)
         if (pkt->duration != 0)
             codec_info_nb_frames[st->index]++;
 
+        if (done[st->index]) {
+            count++;
+            continue;
+        }
+
         {
             int index= pkt->stream_index;
             int64_t last= last_dts[index];
@@ -2174,13 +4571,13 @@ int av_find_stream_info(AVFormatContext *ic)
 
 //                if(st->codec->codec_type == CODEC_TYPE_VIDEO)
 //                    av_log(NULL, AV_LOG_ERROR, "%f\n", dur);
-                if(duration_count[index] < 2)
-                    memset(duration_error[index], 0, sizeof(*duration_error));
-                for(i=1; i<MAX_STD_TIMEBASES; i++){
-                    int framerate= get_std_framerate(i);
-                    int ticks= lrintf(dur*framerate/(1001*12));
-                    double error= dur - ticks*1001*12/(double)framerate;
-                    duration_error[index][i] += error*error;
+                /* the errors are only used to guess the rate of video */
+                if(st->codec->codec_type == CODEC_TYPE_VIDEO){
+                    if(!fps_guess[index] && !(fps_guess[index]= fps_guess_alloc())){
+                        ret = AVERROR(ENOMEM);
+                        goto fail;
+                    }
+                    fps_guess_add(fps_guess[index], dur, duration_count[index]);
                 }
                 duration_count[index]++;
                 // ignore the first 4 values, they might have some random jitter
@@ -2204,12 +4601,36 @@ int av_find_stream_info(AVFormatContext *ic)
            decompress the frame. We try to avoid that in most cases as
            it takes longer and uses more memory. For MPEG-4, we need to
            decompress for QuickTime. */
-        if (!has_codec_parameters(st->codec))
-            try_decode_frame(st, pkt);
+        if (!has_codec_parameters(st->codec)) {
+#if HAVE_PTHREADS
+            /* streams going through a parser or still waiting for their
+               extradata keep using st->codec on this thread */
+            if (!workers[st->index] && nb_workers < ic->analyze_threads &&
+                ic->analyze_threads > 1 && !st->codec->codec && !st->need_parsing &&
+                !(st->parser && st->parser->parser->split && !st->codec->extradata) &&
+                (workers[st->index] = decode_worker_start(ic, st)))
+                nb_workers++;
+            if (workers[st->index]) {
+                if (decode_worker_queue(workers[st->index], pkt) < 0) {
+                    ret = AVERROR(ENOMEM);
+                    goto fail;
+                }
+            } else
+#endif
+            try_decode_frame(st->codec, pkt);
+        }
 
         count++;
     }
 
+ analyzed:
+#if HAVE_PTHREADS
+    for(i=0;i<MAX_STREAMS;i++) {
+        if (workers[i])
+            decode_worker_stop(workers[i], ic->streams[i]);
+        workers[i] = NULL;
+    }
+#endif
     // close codecs which were opened in try_decode_frame()
     for(i=0;i<ic->nb_streams;i++) {
         st = ic->streams[i];
@@ -2231,7 +4652,7 @@ int av_find_stream_info(AVFormatContext *ic)
             // ipmovie.c produces.
             if (tb_unreliable(st->codec) && duration_count[i] > 15 && duration_gcd[i] > 1)
                 av_reduce(&st->r_frame_rate.num, &st->r_frame_rate.den, st->time_base.den, st->time_base.num * duration_gcd[i], INT_MAX);
-            if(duration_count[i]
+            if(duration_count[i] && fps_guess[i]
                && tb_unreliable(st->codec) /*&&
                //FIXME we should not special-case MPEG-2, but this needs testing with non-MPEG-2 ...
                st->time_base.num*duration_sum[i]/duration_count[i]*101LL > st->time_base.den*/){
@@ -2239,13 +4660,14 @@ int av_find_stream_info(AVFormatContext *ic)
                 double best_error= 2*av_q2d(st->time_base);
                 best_error= best_error*best_error*duration_count[i]*1000*12*30;
 
-                for(j=1; j<MAX_STD_TIMEBASES; j++){
-                    double error= duration_error[i][j] * get_std_framerate(j);
+                for(j=0; j<fps_guess[i]->nb_candidates; j++){
+                    int framerate= get_std_framerate(fps_guess[i]->candidate[j]);
+                    double error= fps_guess[i]->error[j] * framerate;
 //                    if(st->codec->codec_type == CODEC_TYPE_VIDEO)
-//                        av_log(NULL, AV_LOG_ERROR, "%f %f\n", get_std_framerate(j) / 12.0/1001, error);
+//                        av_log(NULL, AV_LOG_ERROR, "%f %f\n", framerate / 12.0/1001, error);
                     if(error < best_error){
                         best_error= error;
-                        num = get_std_framerate(j);
+                        num = framerate;
                     }
                 }
                 // do not increase frame rate by more than 1 % in order to match a standard rate.
@@ -2269,7 +4691,9 @@ int av_find_stream_info(AVFormatContext *ic)
         }
     }
 
+    duration_time = av_gettime();
     av_estimate_timings(ic, old_offset);
+    record_timing(ic, AVFMT_PHASE_DURATION, -1, av_gettime() - duration_time);
 
     compute_chapters_end(ic);
 
@@ -2298,8 +4722,23 @@ int av_find_stream_info(AVFormatContext *ic)
     }
 #endif
 
-    av_free(duration_error);
-
+    if (ret >= 0)
+        ff_index_cache_info_done(ic);
+    if (ret >= 0 && (ic->flags & AVFMT_FLAG_PROBE_CACHE))
+        ff_probe_cache_store(ic);
+    else if (ret < 0 && cache)
+        ff_probe_cache_drop(ic->filename);
+ fail:
+    ff_probe_cache_free(&cache);
+    ic->work_start = 0;
+    for(i=0;i<MAX_STREAMS;i++) {
+#if HAVE_PTHREADS
+        if (workers[i])
+            decode_worker_stop(workers[i], ic->streams[i]);
+#endif
+        av_free(fps_guess[i]);
+    }
+    record_timing(ic, AVFMT_PHASE_STREAM_INFO, -1, av_gettime() - start_time);
     return ret;
 }
 
@@ -2307,6 +4746,7 @@ int av_find_stream_info(AVFormatContext *ic)
 
 int av_read_play(AVFormatContext *s)
 {
+    demux_thread_pause(s, 0);
     if (s->iformat->read_play)
         return s->iformat->read_play(s);
     if (s->pb)
@@ -2316,6 +4756,7 @@ int av_read_play(AVFormatContext *s)
 
 int av_read_pause(AVFormatContext *s)
 {
+    demux_thread_pause(s, 0);
     if (s->iformat->read_pause)
         return s->iformat->read_pause(s);
     if (s->pb)
@@ -2323,11 +4764,102 @@ int av_read_pause(AVFormatContext *s)
     return AVERROR(ENOSYS);
 }
 
+int av_read_tail_tags(AVFormatContext *s)
+{
+    void (*read_tags)(AVFormatContext *s) = s->read_tail_tags;
+    int64_t pos, ret;
+
+    if (!read_tags)
+        return 0;
+    demux_thread_pause(s, 0);
+    s->read_tail_tags = NULL;
+    pos = url_ftell(s->pb);
+    read_tags(s);
+    ret = url_fseek(s->pb, pos, SEEK_SET);
+    return ret < 0 ? ret : 0;
+}
+
+/* files read through the file protocol or memory mapped, where a seek
+   to the end costs nothing; custom I/O is assumed to be local too */
+static int is_local_input(ByteIOContext *pb)
+{
+    URLContext *h;
+
+    if (pb->map || (void *)pb->read_packet != (void *)url_read)
+        return 1;
+    h = url_fileno(pb);
+    return h && h->prot && !strcmp(h->prot->name, "file");
+}
+
+void ff_read_tail_tags(AVFormatContext *s, void (*read_tags)(AVFormatContext *s))
+{
+    if (!s->pb || url_is_streamed(s->pb))
+        return;
+    s->read_tail_tags = read_tags;
+    if (is_local_input(s->pb))
+        av_read_tail_tags(s);
+}
+
+static int64_t stream_index_memory(AVStream *st)
+{
+    int64_t size = st->index_entries_allocated_size;
+    CompactIndex *ci = st->compact_index;
+    SeekPointCache *c = st->seek_cache;
+
+    if (ci)
+        size += sizeof(*ci) + ci->blocks_allocated * sizeof(*ci->blocks) +
+                ci->data_allocated;
+    if (c)
+        size += sizeof(*c) + c->nb_points * sizeof(*c->points);
+    return size;
+}
+
+void av_format_memory_usage(AVFormatContext *s, AVFormatMemoryUsage *usage)
+{
+    int i;
+
+    memset(usage, 0, sizeof(*usage));
+    usage->packets  = s->buffer_memory;
+    usage->metadata = ff_metadata_memory(s->metadata);
+    if (s->iformat)
+        usage->priv_data = s->iformat->priv_data_size;
+    else if (s->oformat)
+        usage->priv_data = s->oformat->priv_data_size;
+    if (s->pb)
+        usage->io = s->pb->buffer_size;
+    for (i = 0; i < s->nb_streams; i++) {
+        AVStream *st = s->streams[i];
+        usage->index    += stream_index_memory(st);
+        usage->metadata += ff_metadata_memory(st->metadata);
+        usage->streams  += sizeof(*st) + sizeof(*st->codec) +
+                           st->codec->extradata_size + st->probe_data.buf_size;
+    }
+    for (i = 0; i < s->nb_programs; i++)
+        usage->metadata += ff_metadata_memory(s->programs[i]->metadata);
+    for (i = 0; i < s->nb_chapters; i++)
+        usage->metadata += ff_metadata_memory(s->chapters[i]->metadata);
+    usage->total = usage->index + usage->packets + usage->priv_data +
+                   usage->metadata + usage->streams + usage->io;
+}
+
+int av_get_network_stats(AVFormatContext *s, int stream_index,
+                         AVStreamNetworkStats *stats)
+{
+    if (stream_index < 0 || stream_index >= s->nb_streams)
+        return AVERROR(EINVAL);
+    if (!s->iformat || !s->iformat->get_network_stats)
+        return AVERROR(ENOSYS);
+    return s->iformat->get_network_stats(s, stream_index, stats);
+}
+
 void av_close_input_stream(AVFormatContext *s)
 {
     int i;
     AVStream *st;
 
+    demux_thread_stop(s);
+    ff_index_cache_close(s, 1);
+    duration_estimate_free(s);
     if (s->iformat->read_close)
         s->iformat->read_close(s);
     for(i=0;i<s->nb_streams;i++) {
@@ -2339,6 +4871,8 @@ void av_close_input_stream(AVFormatContext *s)
         }
         av_metadata_free(&st->metadata);
         av_free(st->index_entries);
+        compact_index_free(st);
+        seek_cache_free(st);
         av_free(st->codec->extradata);
         av_free(st->codec);
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
@@ -2358,6 +4892,11 @@ void av_close_input_stream(AVFormatContext *s)
     }
     av_freep(&s->programs);
     flush_packet_queue(s);
+    av_freep(&s->packet_run);
+    ff_packet_pool_uninit(s);
+    ff_sdp_cache_free(s);
+    ff_clock_recovery_free(s);
+    av_freep(&s->parser_state);
     av_freep(&s->priv_data);
     while(s->nb_chapters--) {
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
@@ -2374,6 +4913,11 @@ void av_close_input_stream(AVFormatContext *s)
 void av_close_input_file(AVFormatContext *s)
 {
     ByteIOContext *pb = s->iformat->flags & AVFMT_NOFILE ? NULL : s->pb;
+    URLContext *h = pb ? url_fileno(pb) : NULL;
+
+    /* the interrupt settings are freed with s */
+    if (h && h->interrupt == &s->interrupt)
+        h->interrupt = NULL;
     av_close_input_stream(s);
     if (pb)
         url_fclose(pb);
@@ -2414,9 +4958,14 @@ AVStream *av_new_stream(AVFormatContext *s, int id)
     for(i=0; i<MAX_REORDER_DELAY+1; i++)
         st->pts_buffer[i]= AV_NOPTS_VALUE;
     st->reference_dts = AV_NOPTS_VALUE;
+    st->trickplay_ts = AV_NOPTS_VALUE;
+    st->max_index_entries = s->max_index_entries;
 
     st->sample_aspect_ratio = (AVRational){0,1};
 
+    if (s->iformat && (s->flags & AVFMT_FLAG_METADATA_ARENA))
+        ff_metadata_use_arena(&st->metadata);
+
     s->streams[s->nb_streams++] = st;
     return st;
 }
@@ -2440,6 +4989,8 @@ AVProgram *av_new_program(AVFormatContext *ac, int id)
             return NULL;
         dynarray_add(&ac->programs, &ac->nb_programs, program);
         program->discard = AVDISCARD_NONE;
+        if (ac->flags & AVFMT_FLAG_METADATA_ARENA)
+            ff_metadata_use_arena(&program->metadata);
     }
     program->id = id;
 
@@ -2460,6 +5011,8 @@ AVChapter *ff_new_chapter(AVFormatContext *s, int id, AVRational time_base, int6
         if(!chapter)
             return NULL;
         dynarray_add(&s->chapters, &s->nb_chapters, chapter);
+        if (s->flags & AVFMT_FLAG_METADATA_ARENA)
+            ff_metadata_use_arena(&chapter->metadata);
     }
 #if LIBAVFORMAT_VERSION_INT < (53<<16)
     av_free(chapter->title);
@@ -2495,6 +5048,11 @@ int av_set_parameters(AVFormatContext *s, AVFormatParameters *ap)
     return 0;
 }
 
+#if HAVE_PTHREADS
+static int mux_thread_start(AVFormatContext *s);
+static int mux_thread_sync(struct MuxThread *t);
+#endif
+
 int av_write_header(AVFormatContext *s)
 {
     int ret, i;
@@ -2588,6 +5146,14 @@ int av_write_header(AVFormatContext *s)
             av_frac_init(&st->pts, 0, 0, den);
         }
     }
+
+    if (s->write_behind > 0 && s->pb &&
+        url_fset_writebehind(s->pb, s->write_behind) < 0)
+        av_log(s, AV_LOG_WARNING, "Could not start the writing thread\n");
+#if HAVE_PTHREADS
+    if (s->mux_queue_size > 0 && mux_thread_start(s) < 0)
+        av_log(s, AV_LOG_WARNING, "Could not start the muxing thread\n");
+#endif
     return 0;
 }
 
@@ -2666,53 +5232,207 @@ static int compute_pkt_fields2(AVFormatContext *s, AVStream *st, AVPacket *pkt){
     return 0;
 }
 
+static int write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    int64_t t = FF_TRACE_START();
+    int ret = s->oformat->write_packet(s, pkt);
+
+    FF_TRACE_PACKET('X', "write_packet", t, pkt);
+    return ret;
+}
+
 int av_write_frame(AVFormatContext *s, AVPacket *pkt)
 {
-    int ret = compute_pkt_fields2(s, s->streams[pkt->stream_index], pkt);
+    int ret;
+
+#if HAVE_PTHREADS
+    /* keep the order of the packets queued for interleaving */
+    if (s->mux_thread && (ret = mux_thread_sync(s->mux_thread)) < 0)
+        return ret;
+#endif
+    ret = compute_pkt_fields2(s, s->streams[pkt->stream_index], pkt);
 
     if(ret<0 && !(s->oformat->flags & AVFMT_NOTIMESTAMPS))
         return ret;
 
-    ret= s->oformat->write_packet(s, pkt);
+    ret= write_packet(s, pkt);
     if(!ret)
         ret= url_ferror(s->pb);
     return ret;
 }
 
-void ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
-                              int (*compare)(AVFormatContext *, AVPacket *, AVPacket *))
+/**
+ * Muxing queue: one FIFO per stream plus a binary min-heap of the streams
+ * that have packets queued, ordered by their first packet.
+ */
+typedef struct InterleaveQueue {
+    int (*compare)(AVFormatContext *, AVPacket *, AVPacket *);
+    AVPacketList **head;    ///< first queued packet of each stream, the last is st->last_in_packet_buffer
+    int *nb_packets;        ///< number of queued packets of each stream
+    int *heap;              ///< indexes of the streams with queued packets
+    int nb_heap;
+    int64_t seq;            ///< sequence number of the next queued packet
+} InterleaveQueue;
+
+#define NODE_SEQ(pktl) (((PacketListNode *)(pktl))->seq)
+
+/**
+ * @return nonzero if the first packet of stream a goes before the first
+ *         packet of stream b
+ */
+static int interleave_before(AVFormatContext *s, InterleaveQueue *q, int a, int b)
+{
+    AVPacketList *pa = q->head[a], *pb = q->head[b];
+
+    /* the later packet only goes before the earlier one if compare() says
+     * so, giving the same order as inserting into a sorted list */
+    if (NODE_SEQ(pa) < NODE_SEQ(pb))
+        return !q->compare(s, &pa->pkt, &pb->pkt);
+    return q->compare(s, &pb->pkt, &pa->pkt);
+}
+
+static void interleave_heap_up(AVFormatContext *s, InterleaveQueue *q, int i)
+{
+    int st = q->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) >> 1;
+        if (!interleave_before(s, q, st, q->heap[parent]))
+            break;
+        q->heap[i] = q->heap[parent];
+        i = parent;
+    }
+    q->heap[i] = st;
+}
+
+static void interleave_heap_down(AVFormatContext *s, InterleaveQueue *q, int i)
+{
+    int st = q->heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= q->nb_heap)
+            break;
+        if (child + 1 < q->nb_heap &&
+            interleave_before(s, q, q->heap[child + 1], q->heap[child]))
+            child++;
+        if (!interleave_before(s, q, q->heap[child], st))
+            break;
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = st;
+}
+
+int ff_interleave_add_packet(AVFormatContext *s, AVPacket *pkt,
+                             int (*compare)(AVFormatContext *, AVPacket *, AVPacket *))
 {
-    AVPacketList **next_point, *this_pktl;
+    InterleaveQueue *q = s->interleave_queue;
+    AVStream *st = s->streams[pkt->stream_index];
+    AVPacketList *this_pktl;
+
+    if (!q) {
+        q = av_mallocz(sizeof(InterleaveQueue));
+        if (!q)
+            return AVERROR(ENOMEM);
+        q->head       = av_mallocz(s->nb_streams * sizeof(*q->head));
+        q->nb_packets = av_mallocz(s->nb_streams * sizeof(*q->nb_packets));
+        q->heap       = av_mallocz(s->nb_streams * sizeof(*q->heap));
+        if (!q->head || !q->nb_packets || !q->heap) {
+            av_free(q->head);
+            av_free(q->nb_packets);
+            av_free(q->heap);
+            av_free(q);
+            return AVERROR(ENOMEM);
+        }
+        s->interleave_queue = q;
+    }
 
-    this_pktl = av_mallocz(sizeof(AVPacketList));
+    this_pktl = ff_packet_list_alloc(s);
+    if (!this_pktl)
+        return AVERROR(ENOMEM);
     this_pktl->pkt= *pkt;
     pkt->destruct= NULL;             // do not free original but only the copy
-    av_dup_packet(&this_pktl->pkt);  // duplicate the packet if it uses non-alloced memory
+    ff_dup_packet(s, &this_pktl->pkt); // duplicate the packet if it uses non-alloced memory
+    ff_packet_list_account(s, this_pktl);
+    NODE_SEQ(this_pktl) = q->seq++;
+    q->compare = compare;
+
+    /* packets of one stream keep their order, so only a new first packet
+     * changes the heap */
+    if (st->last_in_packet_buffer) {
+        st->last_in_packet_buffer->next = this_pktl;
+    } else {
+        q->head[pkt->stream_index] = this_pktl;
+        q->heap[q->nb_heap] = pkt->stream_index;
+        interleave_heap_up(s, q, q->nb_heap++);
+    }
+    st->last_in_packet_buffer = this_pktl;
+    q->nb_packets[pkt->stream_index]++;
+    FF_TRACE_PACKET('b', "interleave", 0, &this_pktl->pkt);
+    return 0;
+}
 
-    if(s->streams[pkt->stream_index]->last_in_packet_buffer){
-        next_point = &(s->streams[pkt->stream_index]->last_in_packet_buffer->next);
-    }else
-        next_point = &s->packet_buffer;
+AVPacket *ff_interleave_peek(AVFormatContext *s)
+{
+    InterleaveQueue *q = s->interleave_queue;
 
-    if(*next_point){
-        if(compare(s, &s->packet_buffer_end->pkt, pkt)){
-            while(!compare(s, &(*next_point)->pkt, pkt)){
-                next_point= &(*next_point)->next;
-            }
-            goto next_non_null;
-        }else{
-            next_point = &(s->packet_buffer_end->next);
+    return q && q->nb_heap ? &q->head[q->heap[0]]->pkt : NULL;
+}
+
+int ff_interleave_get_packet(AVFormatContext *s, AVPacket *out)
+{
+    InterleaveQueue *q = s->interleave_queue;
+    AVPacketList *pktl;
+    int i;
+
+    if (!q || !q->nb_heap)
+        return 0;
+    i    = q->heap[0];
+    pktl = q->head[i];
+    *out = pktl->pkt;
+    FF_TRACE_PACKET('e', "interleave", 0, out);
+    q->nb_packets[i]--;
+    if ((q->head[i] = pktl->next)) {
+        interleave_heap_down(s, q, 0);
+    } else {
+        s->streams[i]->last_in_packet_buffer = NULL;
+        if (--q->nb_heap) {
+            q->heap[0] = q->heap[q->nb_heap];
+            interleave_heap_down(s, q, 0);
         }
     }
-    assert(!*next_point);
+    ff_packet_list_free(s, pktl);
+    return 1;
+}
+
+int ff_interleave_queued_streams(AVFormatContext *s)
+{
+    InterleaveQueue *q = s->interleave_queue;
+
+    return q ? q->nb_heap : 0;
+}
+
+int ff_interleave_queued_packets(AVFormatContext *s, int stream_index)
+{
+    InterleaveQueue *q = s->interleave_queue;
 
-    s->packet_buffer_end= this_pktl;
-next_non_null:
+    return q ? q->nb_packets[stream_index] : 0;
+}
 
-    this_pktl->next= *next_point;
+static void interleave_free(AVFormatContext *s)
+{
+    InterleaveQueue *q = s->interleave_queue;
+    AVPacket pkt;
 
-    s->streams[pkt->stream_index]->last_in_packet_buffer=
-    *next_point= this_pktl;
+    if (!q)
+        return;
+    while (ff_interleave_get_packet(s, &pkt))
+        av_free_packet(&pkt);
+    av_free(q->head);
+    av_free(q->nb_packets);
+    av_free(q->heap);
+    av_freep(&s->interleave_queue);
 }
 
 int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
@@ -2729,29 +5449,17 @@ int ff_interleave_compare_dts(AVFormatContext *s, AVPacket *next, AVPacket *pkt)
 }
 
 int av_interleave_packet_per_dts(AVFormatContext *s, AVPacket *out, AVPacket *pkt, int flush){
-    AVPacketList *pktl;
-    int stream_count=0;
-    int i;
+    int stream_count, ret;
 
     if(pkt){
-        ff_interleave_add_packet(s, pkt, ff_interleave_compare_dts);
+        if((ret = ff_interleave_add_packet(s, pkt, ff_interleave_compare_dts)) < 0)
+            return ret;
     }
 
-    for(i=0; i < s->nb_streams; i++)
-        stream_count+= !!s->streams[i]->last_in_packet_buffer;
+    stream_count= ff_interleave_queued_streams(s);
 
     if(stream_count && (s->nb_streams == stream_count || flush)){
-        pktl= s->packet_buffer;
-        *out= pktl->pkt;
-
-        s->packet_buffer= pktl->next;
-        if(!s->packet_buffer)
-            s->packet_buffer_end= NULL;
-
-        if(s->streams[out->stream_index]->last_in_packet_buffer == pktl)
-            s->streams[out->stream_index]->last_in_packet_buffer= NULL;
-        av_freep(&pktl);
-        return 1;
+        return ff_interleave_get_packet(s, out);
     }else{
         av_init_packet(out);
         return 0;
@@ -2774,7 +5482,7 @@ static int av_interleave_packet(AVFormatContext *s, AVPacket *out, AVPacket *in,
         return av_interleave_packet_per_dts(s, out, in, flush);
 }
 
-int av_interleaved_write_frame(AVFormatContext *s, AVPacket *pkt){
+static int interleaved_write_frame(AVFormatContext *s, AVPacket *pkt){
     AVStream *st= s->streams[ pkt->stream_index];
 
     //FIXME/XXX/HACK drop zero sized packets
@@ -2790,11 +5498,13 @@ int av_interleaved_write_frame(AVFormatContext *s, AVPacket *pkt){
 
     for(;;){
         AVPacket opkt;
-        int ret= av_interleave_packet(s, &opkt, pkt, 0);
+        /* write packets before they are due rather than buffering more */
+        int ret= av_interleave_packet(s, &opkt, pkt,
+                                      ff_buffer_memory_check(s, 0, "interleaving"));
         if(ret<=0) //FIXME cleanup needed for ret<0 ?
             return ret;
 
-        ret= s->oformat->write_packet(s, &opkt);
+        ret= write_packet(s, &opkt);
 
         av_free_packet(&opkt);
         pkt= NULL;
@@ -2806,10 +5516,176 @@ int av_interleaved_write_frame(AVFormatContext *s, AVPacket *pkt){
     }
 }
 
+#if HAVE_PTHREADS
+/**
+ * Muxing thread interleaving and writing the packets queued by
+ * av_interleaved_write_frame(), started by av_write_header() if
+ * mux_queue_size is set.
+ */
+typedef struct MuxThread {
+    AVFormatContext *s;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ThreadPacketQueue queue;
+    int status;                 ///< first error of the muxer, queued packets are dropped after it
+    int busy, abort;
+} MuxThread;
+
+static void *mux_thread(void *arg)
+{
+    MuxThread *t = arg;
+    AVFormatContext *s = t->s;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        AVPacket pkt;
+        int ret;
+
+        while (!t->abort && !t->queue.first)
+            pthread_cond_wait(&t->cond, &t->lock);
+        /* the queue is drained before exiting */
+        if (!t->queue.first)
+            break;
+        queue_get(s, &t->queue, &pkt);
+        t->busy = 1;
+        pthread_cond_broadcast(&t->cond);
+        ret = t->status;
+        pthread_mutex_unlock(&t->lock);
+
+        if (!ret)
+            ret = interleaved_write_frame(s, &pkt);
+        av_free_packet(&pkt);
+
+        pthread_mutex_lock(&t->lock);
+        t->busy = 0;
+        if (ret < 0 && !t->status)
+            t->status = ret;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+static int mux_thread_start(AVFormatContext *s)
+{
+    MuxThread *t = av_mallocz(sizeof(MuxThread));
+
+    if (!t)
+        return AVERROR(ENOMEM);
+    t->s              = s;
+    t->queue.first_ts = t->queue.last_ts = AV_NOPTS_VALUE;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->thread, NULL, mux_thread, t)) {
+        pthread_cond_destroy(&t->cond);
+        pthread_mutex_destroy(&t->lock);
+        av_free(t);
+        return AVERROR(ENOMEM);
+    }
+    s->mux_thread = t;
+    return 0;
+}
+
+/**
+ * Queue a packet for the muxing thread.
+ * @param nonblock if set, drop the packet and return AVERROR(EAGAIN)
+ *                 rather than wait while the queue is full
+ */
+static int mux_thread_put(MuxThread *t, AVPacket *pkt, int nonblock)
+{
+    AVFormatContext *s = t->s;
+    AVPacket copy = *pkt;
+    int ret;
+
+    pkt->destruct = NULL; // the queue owns the data now, as with interleaving
+    if (dup_packet(&copy) < 0) {
+        av_free_packet(&copy);
+        return AVERROR(ENOMEM);
+    }
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->status && queue_full(s, &t->queue, s->mux_queue_size, s->mux_queue_duration)) {
+        if (nonblock)
+            break;
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    if (!(ret = t->status) && nonblock &&
+        queue_full(s, &t->queue, s->mux_queue_size, s->mux_queue_duration))
+        ret = AVERROR(EAGAIN);
+    if (!ret) {
+        if ((ret = queue_put(s, &t->queue, &copy)) >= 0)
+            pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (ret < 0)
+        av_free_packet(&copy);
+    return ret;
+}
+
+/**
+ * Wait until all queued packets have been written.
+ * @return the first error of the muxer
+ */
+static int mux_thread_sync(MuxThread *t)
+{
+    int ret;
+
+    pthread_mutex_lock(&t->lock);
+    while (t->queue.first || t->busy)
+        pthread_cond_wait(&t->cond, &t->lock);
+    ret = t->status;
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+static int mux_thread_stop(AVFormatContext *s)
+{
+    MuxThread *t = s->mux_thread;
+    int ret;
+
+    if (!t)
+        return 0;
+    pthread_mutex_lock(&t->lock);
+    t->abort = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    ret = t->status;
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    av_freep(&s->mux_thread);
+    return ret;
+}
+#else
+#define mux_thread_stop(s) 0
+#endif
+
+int av_interleaved_write_frame(AVFormatContext *s, AVPacket *pkt)
+{
+#if HAVE_PTHREADS
+    if (s->mux_thread)
+        return mux_thread_put(s->mux_thread, pkt, 0);
+#endif
+    return interleaved_write_frame(s, pkt);
+}
+
+int ff_interleaved_write_frame_nonblock(AVFormatContext *s, AVPacket *pkt)
+{
+#if HAVE_PTHREADS
+    if (s->mux_thread)
+        return mux_thread_put(s->mux_thread, pkt, 1);
+#endif
+    return interleaved_write_frame(s, pkt);
+}
+
 int av_write_trailer(AVFormatContext *s)
 {
     int ret, i;
 
+    if ((ret = mux_thread_stop(s)) < 0)
+        goto fail;
+
     for(;;){
         AVPacket pkt;
         ret= av_interleave_packet(s, &pkt, NULL, 1);
@@ -2818,7 +5694,7 @@ int av_write_trailer(AVFormatContext *s)
         if(!ret)
             break;
 
-        ret= s->oformat->write_packet(s, &pkt);
+        ret= write_packet(s, &pkt);
 
         av_free_packet(&pkt);
 
@@ -2831,11 +5707,17 @@ int av_write_trailer(AVFormatContext *s)
     if(s->oformat->write_trailer)
         ret = s->oformat->write_trailer(s);
 fail:
+    /* let the pending writes finish, their errors show in url_ferror() */
+    if (s->pb)
+        url_fset_writebehind(s->pb, 0);
     if(ret == 0)
        ret=url_ferror(s->pb);
     for(i=0;i<s->nb_streams;i++)
         av_freep(&s->streams[i]->priv_data);
     av_freep(&s->priv_data);
+    interleave_free(s);
+    ff_packet_pool_uninit(s);
+    ff_sdp_cache_free(s);
     return ret;
 }
 
@@ -2876,7 +5758,8 @@ static void print_fps(double d, const char *postfix){
 
 static void dump_metadata(void *ctx, AVMetadata *m, const char *indent)
 {
-    if(m && !(m->count == 1 && av_metadata_get(m, "language", NULL, 0))){
+    ff_metadata_load(m);
+    if(m && m->count && !(m->count == 1 && av_metadata_get(m, "language", NULL, 0))){
         AVMetadataTag *tag=NULL;
 
         av_log(ctx, AV_LOG_INFO, "%sMetadata:\n", indent);
@@ -2976,6 +5859,8 @@ void dump_format(AVFormatContext *ic,
             av_log(NULL, AV_LOG_INFO, "N/A");
         }
         av_log(NULL, AV_LOG_INFO, "\n");
+        if (ic->pb)
+            url_fdump_stats(NULL, AV_LOG_VERBOSE, ic->pb);
     }
     if(ic->nb_programs) {
         int j, k, total = 0;
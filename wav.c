@@ -277,12 +277,7 @@ static int wav_read_packet(AVFormatContext *s,
         wav->data_end= url_ftell(s->pb) + left;
     }
 
-    size = MAX_SIZE;
-    if (st->codec->block_align > 1) {
-        if (size < st->codec->block_align)
-            size = st->codec->block_align;
-        size = (size / st->codec->block_align) * st->codec->block_align;
-    }
+    size = ff_pcm_packet_size(s, st, MAX_SIZE);
     size = FFMIN(size, left);
     ret  = av_get_packet(s->pb, pkt, size);
     if (ret < 0)
@@ -21,6 +21,8 @@
 
 #include "libavutil/intreadwrite.h"
 #include "avformat.h"
+#include "internal.h"
+#include "metadata.h"
 #include "apetag.h"
 #include "id3v1.h"
 
@@ -147,6 +149,12 @@ static int wv_read_block_header(AVFormatContext *ctx, ByteIOContext *pb)
     return 0;
 }
 
+static void wv_read_tail_tags(AVFormatContext *s)
+{
+    ff_ape_parse_tag(s);
+    ff_id3v1_read_fallback(s);
+}
+
 static int wv_read_header(AVFormatContext *s,
                           AVFormatParameters *ap)
 {
@@ -170,14 +178,10 @@ static int wv_read_header(AVFormatContext *s,
     av_set_pts_info(st, 64, 1, wc->rate);
     st->start_time = 0;
     st->duration = wc->samples;
+    /* the lower bound for bisection, data_offset is past this header */
+    av_add_index_entry(st, wc->pos, wc->soff, 0, 0, AVINDEX_KEYFRAME);
 
-    if(!url_is_streamed(s->pb)) {
-        int64_t cur = url_ftell(s->pb);
-        ff_ape_parse_tag(s);
-        if(!av_metadata_get(s->metadata, "", NULL, AV_METADATA_IGNORE_SUFFIX))
-            ff_id3v1_read(s);
-        url_fseek(s->pb, cur, SEEK_SET);
-    }
+    ff_read_tail_tags(s, wv_read_tail_tags);
 
     return 0;
 }
@@ -211,35 +215,55 @@ static int wv_read_packet(AVFormatContext *s,
     return 0;
 }
 
+/**
+ * Find the first block starting a frame at or after *ppos.
+ */
+static int64_t wv_read_timestamp(AVFormatContext *s, int stream_index,
+                                 int64_t *ppos, int64_t pos_limit)
+{
+    ByteIOContext *pb = s->pb;
+    uint8_t hdr[24];
+    uint32_t state = 0, size, flags;
+    int64_t pos;
+    int ver;
+
+    if (url_fseek(pb, *ppos, SEEK_SET) < 0)
+        return AV_NOPTS_VALUE;
+    while (!url_feof(pb)) {
+        state = state << 8 | get_byte(pb);
+        if (state != MKBETAG('w', 'v', 'p', 'k'))
+            continue;
+        pos = url_ftell(pb) - 4;
+        if (get_buffer(pb, hdr, sizeof(hdr)) != sizeof(hdr))
+            break;
+        size  = AV_RL32(hdr);
+        ver   = AV_RL16(hdr + 4);
+        flags = AV_RL32(hdr + 20);
+        /* a block of samples that is the first of its frame */
+        if (size >= 24 && size <= WV_BLOCK_LIMIT && ver >= 0x402 && ver <= 0x410 &&
+            AV_RL32(hdr + 16) && (flags & WV_MCINIT)) {
+            *ppos = pos;
+            return AV_RL32(hdr + 12);
+        }
+        url_fseek(pb, pos + 4, SEEK_SET);
+        state = 0;
+    }
+    return AV_NOPTS_VALUE;
+}
+
 static int wv_read_seek(AVFormatContext *s, int stream_index, int64_t timestamp, int flags)
 {
-    AVStream *st = s->streams[stream_index];
     WVContext *wc = s->priv_data;
-    AVPacket pkt1, *pkt = &pkt1;
     int ret;
-    int index = av_index_search_timestamp(st, timestamp, flags);
-    int64_t pos, pts;
 
-    /* if found, seek there */
-    if (index >= 0){
-        wc->block_parsed = 1;
-        url_fseek(s->pb, st->index_entries[index].pos, SEEK_SET);
-        return 0;
-    }
     /* if timestamp is out of bounds, return error */
-    if(timestamp < 0 || timestamp >= s->duration)
+    if (timestamp < 0 || timestamp >= s->streams[stream_index]->duration)
         return -1;
 
-    pos = url_ftell(s->pb);
-    do{
-        ret = av_read_frame(s, pkt);
-        if (ret < 0){
-            url_fseek(s->pb, pos, SEEK_SET);
-            return -1;
-        }
-        pts = pkt->pts;
-        av_free_packet(pkt);
-    }while(pts < timestamp);
+    /* bisect on block headers between the blocks already in the index */
+    if ((ret = av_seek_frame_binary(s, stream_index, timestamp, flags)) < 0)
+        return ret;
+    wc->block_parsed = 1;
     return 0;
 }
 
@@ -252,4 +276,5 @@ AVInputFormat wv_demuxer = {
     wv_read_packet,
     NULL,
     wv_read_seek,
+    wv_read_timestamp,
 };
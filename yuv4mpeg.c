@@ -23,6 +23,8 @@
 #define Y4M_MAGIC "YUV4MPEG2"
 #define Y4M_FRAME_MAGIC "FRAME"
 #define Y4M_LINE_MAX 256
+/** largest I/O buffer used to write each frame at once */
+#define Y4M_MAX_BUFFER_SIZE (16 << 20)
 
 struct frame_attributes {
     int interlaced_frame;
@@ -87,6 +89,22 @@ static int yuv4_generate_header(AVFormatContext *s, char* buf)
     return n;
 }
 
+/* write a plane, in a single put_buffer() when its rows are contiguous */
+static void put_plane(ByteIOContext *pb, const uint8_t *ptr, int linesize,
+                      int width, int height)
+{
+    int i;
+
+    if (linesize == width) {
+        put_buffer(pb, ptr, width * height);
+        return;
+    }
+    for (i = 0; i < height; i++) {
+        put_buffer(pb, ptr, width);
+        ptr += linesize;
+    }
+}
+
 static int yuv4_write_packet(AVFormatContext *s, AVPacket *pkt)
 {
     AVStream *st = s->streams[pkt->stream_index];
@@ -94,10 +112,9 @@ static int yuv4_write_packet(AVFormatContext *s, AVPacket *pkt)
     AVPicture *picture;
     int* first_pkt = s->priv_data;
     int width, height, h_chroma_shift, v_chroma_shift;
-    int i, m;
+    int m;
     char buf2[Y4M_LINE_MAX+1];
     char buf1[20];
-    uint8_t *ptr, *ptr1, *ptr2;
 
     picture = (AVPicture *)pkt->data;
 
@@ -120,28 +137,26 @@ static int yuv4_write_packet(AVFormatContext *s, AVPacket *pkt)
     width = st->codec->width;
     height = st->codec->height;
 
-    ptr = picture->data[0];
-    for(i=0;i<height;i++) {
-        put_buffer(pb, ptr, width);
-        ptr += picture->linesize[0];
-    }
-
-    if (st->codec->pix_fmt != PIX_FMT_GRAY8){
-    // Adjust for smaller Cb and Cr planes
-    avcodec_get_chroma_sub_sample(st->codec->pix_fmt, &h_chroma_shift, &v_chroma_shift);
-    width >>= h_chroma_shift;
-    height >>= v_chroma_shift;
-
-    ptr1 = picture->data[1];
-    ptr2 = picture->data[2];
-    for(i=0;i<height;i++) {     /* Cb */
-        put_buffer(pb, ptr1, width);
-        ptr1 += picture->linesize[1];
-    }
-    for(i=0;i<height;i++) {     /* Cr */
-        put_buffer(pb, ptr2, width);
-            ptr2 += picture->linesize[2];
-    }
+    if (st->codec->pix_fmt == PIX_FMT_GRAY8) {
+        put_plane(pb, picture->data[0], picture->linesize[0], width, height);
+    } else {
+        // Adjust for smaller Cb and Cr planes
+        int cw, ch;
+        avcodec_get_chroma_sub_sample(st->codec->pix_fmt, &h_chroma_shift, &v_chroma_shift);
+        cw = width  >> h_chroma_shift;
+        ch = height >> v_chroma_shift;
+
+        if (picture->linesize[0] == width && picture->linesize[1] == cw &&
+            picture->linesize[2] == cw &&
+            picture->data[1] == picture->data[0] + width * height &&
+            picture->data[2] == picture->data[1] + cw * ch) {
+            /* the planes follow each other, as in a frame from avpicture_fill() */
+            put_buffer(pb, picture->data[0], width * height + 2 * cw * ch);
+        } else {
+            put_plane(pb, picture->data[0], picture->linesize[0], width, height);
+            put_plane(pb, picture->data[1], picture->linesize[1], cw, ch); /* Cb */
+            put_plane(pb, picture->data[2], picture->linesize[2], cw, ch); /* Cr */
+        }
     }
     put_flush_packet(pb);
     return 0;
@@ -150,6 +165,8 @@ static int yuv4_write_packet(AVFormatContext *s, AVPacket *pkt)
 static int yuv4_write_header(AVFormatContext *s)
 {
     int* first_pkt = s->priv_data;
+    AVCodecContext *codec;
+    int frame_size;
 
     if (s->nb_streams != 1)
         return AVERROR(EIO);
@@ -165,6 +182,15 @@ static int yuv4_write_header(AVFormatContext *s)
         return AVERROR(EIO);
     }
 
+    /* let each frame go out in one write, nothing is buffered yet */
+    codec = s->streams[0]->codec;
+    frame_size = avpicture_get_size(codec->pix_fmt, codec->width, codec->height);
+    if (frame_size > 0 && !url_fget_max_packet_size(s->pb) && !url_ftell(s->pb)) {
+        frame_size = FFMIN(frame_size + sizeof(Y4M_FRAME_MAGIC), Y4M_MAX_BUFFER_SIZE);
+        if (frame_size > s->pb->buffer_size)
+            url_setbufsize(s->pb, frame_size);
+    }
+
     *first_pkt = 1;
     return 0;
 }